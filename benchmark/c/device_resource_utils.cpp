@@ -0,0 +1,24 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "resource_utils.h"
+
+#if USE_CUDA
+#include <cuda_runtime.h>
+#endif
+
+namespace benchmark::utils {
+
+size_t GetDeviceMemoryInUseInBytes() {
+#if USE_CUDA
+  size_t free_bytes{}, total_bytes{};
+  if (cudaMemGetInfo(&free_bytes, &total_bytes) != cudaSuccess) {
+    return 0;
+  }
+  return total_bytes - free_bytes;
+#else
+  return 0;
+#endif
+}
+
+}  // namespace benchmark::utils
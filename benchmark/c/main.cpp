@@ -3,12 +3,18 @@
 
 #include <cmath>
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <exception>
+#include <fstream>
 #include <iostream>
 #include <numeric>
+#include <random>
+#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <vector>
 
 #include "ort_genai.h"
@@ -96,17 +102,21 @@ void WritePerTokenStats(std::string_view label,
             << "\n\tavg (us):       " << avg_us.count()
             << "\n\tavg (tokens/s): " << 1.0e6f / avg_us.count() * tokens_per_measurement
             << "\n\tp50 (us):       " << MicrosecondsFp{stats.p50}.count()
+            << "\n\tp90 (us):       " << MicrosecondsFp{stats.p90}.count()
+            << "\n\tp99 (us):       " << MicrosecondsFp{stats.p99}.count()
             << "\n\tstddev (us):    " << MicrosecondsFp{stats.stddev}.count()
             << "\n\tn:              " << stats.n << " * " << tokens_per_measurement << " token(s)"
             << "\n";
 }
 
-void WriteE2EStats(std::string_view label,
-                   const Statistics& stats) {
+void WriteLatencyStats(std::string_view label,
+                       const Statistics& stats) {
   using MillisecondsFp = std::chrono::duration<float, std::chrono::milliseconds::period>;
   std::cout << label << ":"
             << "\n\tavg (ms):       " << MillisecondsFp{stats.average}.count()
             << "\n\tp50 (ms):       " << MillisecondsFp{stats.p50}.count()
+            << "\n\tp90 (ms):       " << MillisecondsFp{stats.p90}.count()
+            << "\n\tp99 (ms):       " << MillisecondsFp{stats.p99}.count()
             << "\n\tstddev (ms):    " << MillisecondsFp{stats.stddev}.count()
             << "\n\tn:              " << stats.n
             << "\n";
@@ -225,19 +235,202 @@ void RunBenchmark(const benchmark::Options& opts) {
                        prompt_processing_stats, opts.batch_size * num_prompt_tokens);
     WritePerTokenStats("Token generation", token_gen_stats, opts.batch_size);
     WritePerTokenStats("Token sampling", sampling_stats, opts.batch_size);
-    WriteE2EStats("E2E generation (entire generation loop)", e2e_gen_stats);
+    WriteLatencyStats("E2E generation (entire generation loop)", e2e_gen_stats);
 
     std::cout << "Peak working set size (bytes): " << benchmark::utils::GetPeakWorkingSetSizeInBytes() << "\n";
   }
 }
 
+// A request of a load benchmark
+struct Request {
+  Duration arrival;  // From the start of the run
+  size_t num_prompt_tokens;
+  size_t num_tokens_to_generate;
+};
+
+std::vector<Request> LoadTrace(const std::string& path) {
+  std::ifstream file{path};
+  if (!file) {
+    throw std::runtime_error("Failed to open trace file: " + path);
+  }
+
+  std::vector<Request> requests;
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream fields{line};
+    double arrival_seconds;
+    Request request{};
+    if (!(fields >> arrival_seconds >> request.num_prompt_tokens >> request.num_tokens_to_generate)) {
+      throw std::runtime_error("Failed to parse trace line: " + line);
+    }
+    request.arrival = std::chrono::duration_cast<Duration>(std::chrono::duration<double>{arrival_seconds});
+    requests.push_back(request);
+  }
+
+  std::sort(requests.begin(), requests.end(), [](const Request& a, const Request& b) { return a.arrival < b.arrival; });
+  return requests;
+}
+
+std::vector<Request> GeneratePoissonArrivals(const benchmark::Options& opts) {
+  std::mt19937 rng{opts.seed};
+  std::exponential_distribution<double> interval_seconds{opts.arrival_rate};
+  auto lengths = [](size_t mean) { return std::uniform_int_distribution<size_t>{std::max<size_t>(mean / 2, 1), std::max<size_t>(mean * 3 / 2, 1)}; };
+  auto prompt_lengths = lengths(opts.num_prompt_tokens);
+  auto generation_lengths = lengths(opts.num_tokens_to_generate);
+
+  std::vector<Request> requests;
+  double arrival_seconds = 0.0;
+  for (size_t i = 0; i < opts.num_requests; ++i) {
+    requests.push_back({std::chrono::duration_cast<Duration>(std::chrono::duration<double>{arrival_seconds}),
+                        prompt_lengths(rng), generation_lengths(rng)});
+    arrival_seconds += interval_seconds(rng);
+  }
+  return requests;
+}
+
+// The measurements of the requests run by one worker
+struct RequestTimes {
+  std::vector<Duration> time_to_first_token;  // From the arrival, so the time queued is included
+  std::vector<Duration> inter_token;
+  std::vector<Duration> e2e;
+  size_t num_generated_tokens{};
+};
+
+void RunLoadBenchmark(const benchmark::Options& opts) {
+  auto model = OgaModel::Create(opts.model_path.c_str());
+  auto tokenizer = OgaTokenizer::Create(*model);
+
+  const auto requests = opts.trace_path.empty() ? GeneratePoissonArrivals(opts) : LoadTrace(opts.trace_path);
+  if (requests.empty()) {
+    throw std::runtime_error("The load benchmark has no requests.");
+  }
+
+  // Every prompt is a prefix of the longest one
+  const auto longest = std::max_element(requests.begin(), requests.end(), [](const Request& a, const Request& b) {
+    return a.num_prompt_tokens < b.num_prompt_tokens;
+  });
+  const std::string prompt = GeneratePrompt(longest->num_prompt_tokens, *model, *tokenizer);
+  auto prompt_sequences = OgaSequences::Create();
+  tokenizer->Encode(prompt.c_str(), *prompt_sequences);
+  const int32_t* const prompt_tokens = prompt_sequences->SequenceData(0);
+  const size_t prompt_length = prompt_sequences->SequenceCount(0);
+
+  auto run_request = [&](const Request& request, Clock::time_point arrival, RequestTimes* times) {
+    const size_t num_prompt_tokens = std::min(std::max<size_t>(request.num_prompt_tokens, 1), prompt_length);
+    const size_t num_tokens = num_prompt_tokens + request.num_tokens_to_generate;
+
+    auto params = OgaGeneratorParams::Create(*model);
+    params->SetSearchOption("max_length", num_tokens);
+    params->SetSearchOption("min_length", num_tokens);
+    params->SetInputIDs(prompt_tokens, num_prompt_tokens, num_prompt_tokens, 1);
+    auto generator = OgaGenerator::Create(*model, *params);
+
+    auto last_token = arrival;
+    for (bool first_token = true; !generator->IsDone(); first_token = false) {
+      generator->ComputeLogits();
+      generator->GenerateNextToken();
+
+      const auto now = Clock::now();
+      if (times) {
+        (first_token ? times->time_to_first_token : times->inter_token).push_back(now - last_token);
+        times->num_generated_tokens++;
+      }
+      last_token = now;
+    }
+    if (times) {
+      times->e2e.push_back(last_token - arrival);
+    }
+  };
+
+  if (opts.verbose) std::cout << "Running warmup iterations (" << opts.num_warmup_iterations << ")...\n";
+  for (size_t i = 0; i < opts.num_warmup_iterations; ++i) {
+    run_request(requests.front(), Clock::now(), nullptr);
+  }
+
+  // Workers take the requests in arrival order and wait for their arrival, a request arriving while every worker is
+  // busy is queued until one is free
+  if (opts.verbose) std::cout << "Running " << requests.size() << " requests on " << opts.concurrency << " generators...\n";
+  std::vector<RequestTimes> worker_times(opts.concurrency);
+  std::vector<std::exception_ptr> worker_errors(opts.concurrency);
+  std::atomic<size_t> next_request{0}, finished_workers{0};
+  const auto start = Clock::now();
+
+  std::vector<std::thread> workers;
+  for (size_t w = 0; w < opts.concurrency; ++w) {
+    workers.emplace_back([&, w] {
+      try {
+        for (size_t i; (i = next_request++) < requests.size();) {
+          const auto arrival = start + requests[i].arrival;
+          std::this_thread::sleep_until(arrival);
+          run_request(requests[i], arrival, &worker_times[w]);
+        }
+      } catch (...) {
+        worker_errors[w] = std::current_exception();
+        next_request = requests.size();  // Stop the other workers
+      }
+      finished_workers++;
+    });
+  }
+
+  size_t peak_device_memory = benchmark::utils::GetDeviceMemoryInUseInBytes();
+  while (finished_workers < workers.size()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds{10});
+    peak_device_memory = std::max(peak_device_memory, benchmark::utils::GetDeviceMemoryInUseInBytes());
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  const auto elapsed = DurationFp{Clock::now() - start};
+
+  for (auto& error : worker_errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  RequestTimes totals;
+  for (const auto& times : worker_times) {
+    auto append = [](std::vector<Duration>& to, const std::vector<Duration>& from) { to.insert(to.end(), from.begin(), from.end()); };
+    append(totals.time_to_first_token, times.time_to_first_token);
+    append(totals.inter_token, times.inter_token);
+    append(totals.e2e, times.e2e);
+    totals.num_generated_tokens += times.num_generated_tokens;
+  }
+
+  {
+    const auto elapsed_seconds = std::chrono::duration<float>{elapsed}.count();
+    std::cout << "Requests: " << requests.size()
+              << ", concurrency: " << opts.concurrency
+              << ", duration (s): " << elapsed_seconds
+              << "\n";
+    std::cout << "Throughput:"
+              << "\n\trequests/s:     " << requests.size() / elapsed_seconds
+              << "\n\ttokens/s:       " << totals.num_generated_tokens / elapsed_seconds
+              << "\n";
+
+    WriteLatencyStats("Time to first token (from arrival)", ComputeStats(totals.time_to_first_token));
+    WriteLatencyStats("Inter-token latency", ComputeStats(totals.inter_token));
+    WriteLatencyStats("E2E request latency (from arrival)", ComputeStats(totals.e2e));
+
+    std::cout << "Peak working set size (bytes): " << benchmark::utils::GetPeakWorkingSetSizeInBytes() << "\n";
+    std::cout << "Peak device memory in use (bytes): " << peak_device_memory << "\n";
+  }
+}
+
 }  // namespace
 
 int main(int argc, char** argv) {
   OgaHandle handle;
   try {
     const auto opts = benchmark::ParseOptionsFromCommandLine(argc, argv);
-    RunBenchmark(opts);
+    if (opts.IsLoadMode()) {
+      RunLoadBenchmark(opts);
+    } else {
+      RunBenchmark(opts);
+    }
     return 0;
   } catch (const std::exception& e) {
     std::cerr << "Exception: " << e.what() << "\n";
@@ -11,6 +11,7 @@
 #include <string>
 #include <string_view>
 #include <system_error>
+#include <type_traits>
 
 namespace benchmark {
 
@@ -34,6 +35,18 @@ namespace {
     << "      Number of times to repeat the benchmark. Default: " << defaults.num_iterations << "\n"
     << "    -w,--warmup <number>\n"
     << "      Number of warmup runs before benchmarking. Default: " << defaults.num_warmup_iterations << "\n"
+    << "    --trace <path>\n"
+    << "      Load mode: replays the requests of a trace file, one \"<arrival seconds> <prompt tokens> <tokens to generate>\"\n"
+    << "      per line. -b and -r are ignored in load mode.\n"
+    << "    --arrival_rate <number>\n"
+    << "      Load mode: Poisson arrivals of this many requests per second, with prompt and generation lengths drawn\n"
+    << "      between half and one and a half times -l and -g.\n"
+    << "    --num_requests <number>\n"
+    << "      Number of Poisson arrivals. Default: " << defaults.num_requests << "\n"
+    << "    --concurrency <number>\n"
+    << "      Most generators running at the same time in load mode. Default: " << defaults.concurrency << "\n"
+    << "    --seed <number>\n"
+    << "      Seed of the Poisson arrivals and lengths. Default: " << defaults.seed << "\n"
     << "    -v,--verbose\n"
     << "      Show more informational output.\n"
     << "    -h,--help\n"
@@ -45,19 +58,36 @@ namespace {
 
 template <typename T>
 T ParseNumber(std::string_view s) {
-  T n;
-  const auto *s_begin = s.data(), *s_end = s.data() + s.size();
-  const auto [ptr, ec] = std::from_chars(s_begin, s_end, n);
-  if (ec != std::errc{} || ptr != s_end) {
-    throw std::runtime_error(std::string{"Failed to parse option value as number: "}.append(s));
+  if constexpr (std::is_floating_point_v<T>) {
+    // std::from_chars for floating point needs a newer standard library than the rest of the build
+    const std::string str{s};
+    char* end;
+    const T n = static_cast<T>(std::strtod(str.c_str(), &end));
+    if (str.empty() || end != str.c_str() + str.size()) {
+      throw std::runtime_error(std::string{"Failed to parse option value as number: "}.append(s));
+    }
+    return n;
+  } else {
+    T n;
+    const auto *s_begin = s.data(), *s_end = s.data() + s.size();
+    const auto [ptr, ec] = std::from_chars(s_begin, s_end, n);
+    if (ec != std::errc{} || ptr != s_end) {
+      throw std::runtime_error(std::string{"Failed to parse option value as number: "}.append(s));
+    }
+    return n;
   }
-  return n;
 }
 
 void VerifyOptions(const Options& opts) {
   if (opts.model_path.empty()) {
     throw std::runtime_error("ONNX model directory path must be provided.");
   }
+  if (!opts.trace_path.empty() && opts.arrival_rate > 0.0) {
+    throw std::runtime_error("Only one of --trace and --arrival_rate can be given.");
+  }
+  if (opts.IsLoadMode() && opts.concurrency < 1) {
+    throw std::runtime_error("Concurrency must be at least 1.");
+  }
 }
 
 }  // namespace
@@ -89,6 +119,16 @@ Options ParseOptionsFromCommandLine(int argc, const char* const* argv) {
         opts.num_iterations = ParseNumber<size_t>(next_arg(i));
       } else if (arg == "-w" || arg == "--warmup") {
         opts.num_warmup_iterations = ParseNumber<size_t>(next_arg(i));
+      } else if (arg == "--trace") {
+        opts.trace_path = next_arg(i);
+      } else if (arg == "--arrival_rate") {
+        opts.arrival_rate = ParseNumber<double>(next_arg(i));
+      } else if (arg == "--num_requests") {
+        opts.num_requests = ParseNumber<size_t>(next_arg(i));
+      } else if (arg == "--concurrency") {
+        opts.concurrency = ParseNumber<size_t>(next_arg(i));
+      } else if (arg == "--seed") {
+        opts.seed = ParseNumber<unsigned int>(next_arg(i));
       } else if (arg == "-v" || arg == "--verbose") {
         opts.verbose = true;
       } else if (arg == "-h" || arg == "--help") {
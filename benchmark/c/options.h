@@ -15,6 +15,15 @@ struct Options {
   size_t num_iterations{5};
   size_t num_warmup_iterations{1};
   bool verbose{false};
+
+  // Load mode, enabled by either a trace or an arrival rate. Requests arrive over time and run on concurrent generators.
+  std::string trace_path{};    // Lines of "<arrival seconds> <prompt tokens> <tokens to generate>"
+  double arrival_rate{0.0};    // Requests per second of Poisson arrivals
+  size_t num_requests{32};     // Poisson arrivals only, their lengths vary around num_prompt_tokens and num_tokens_to_generate
+  size_t concurrency{4};       // Generators running at the same time
+  unsigned int seed{0};
+
+  bool IsLoadMode() const { return !trace_path.empty() || arrival_rate > 0.0; }
 };
 
 Options ParseOptionsFromCommandLine(int argc, const char* const* argv);
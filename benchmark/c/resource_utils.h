@@ -9,4 +9,7 @@ namespace benchmark::utils {
 
 size_t GetPeakWorkingSetSizeInBytes();
 
+// Memory in use on the current CUDA device by every process, 0 without CUDA. Sample it to find a peak.
+size_t GetDeviceMemoryInUseInBytes();
+
 }  // namespace benchmark::utils
@@ -10,6 +10,7 @@
 import onnxruntime_genai as og
 import time
 import argparse
+import threading
 from tqdm import tqdm
 
 # Use input model to generate prompt
@@ -30,45 +31,185 @@ def generate_prompt(model, tokenizer, prompt_length, use_graph_capture) -> str:
         generator.generate_next_token()
     return tokenizer.decode(generator.get_sequence(0))
 
+COLUMNS = [
+    "Batch Size",
+    "Prompt Length",
+    "Tokens Generated",
+    "Max Length",
+    "Tokenization Throughput (tps)",
+    "Tokenization Latency (ms)",
+    "Prompt Processing Throughput (tps)",
+    "Prompt Processing Latency (ms)",
+    "Token Generation Throughput (tps)",
+    "Token Generation Latency (ms)",
+    "Sampling Throughput (tps)",
+    "Sampling Latency (ms)",
+    "Wall Clock Throughput (tps)",
+    "Wall Clock Time (s)",
+    # The generators' own metrics (generator.get_metrics()), averaged over the generators
+    "Prefill Session Latency (ms)",
+    "Decode Session Latency (ms)",
+    "Update Inputs Latency (ms)",
+    "Search Latency (ms)",
+    "Host To Device (bytes/token)",
+    "Device To Host (bytes/token)",
+    "Device Allocations (per token)",
+    # The most memory seen while the generators ran
+    "Peak Generator Memory (MB)",
+    "Peak Device Memory (MB)",
+    # The sweep's point, after the columns nightly runs already had so theirs keep their positions
+    "Concurrency",
+    "Graph Capture",
+]
+
 def save_results(results, filename):
-    import pandas as pd
-    df = pd.DataFrame(
-        results,
-        columns=[
-            "Batch Size",
-            "Prompt Length",
-            "Tokens Generated",
-            "Max Length",
-            "Tokenization Throughput (tps)",
-            "Tokenization Latency (ms)",
-            "Prompt Processing Throughput (tps)",
-            "Prompt Processing Latency (ms)",
-            "Token Generation Throughput (tps)",
-            "Token Generation Latency (ms)",
-            "Sampling Throughput (tps)",
-            "Sampling Latency (ms)",
-            "Wall Clock Throughput (tps)",
-            "Wall Clock Time (s)",
-        ],
-    )
-    # df = df.transpose()  # This line swaps the rows and columns
-    df.to_csv(filename, header=True, index=False)
+    if filename.endswith(".json"):
+        import json
+        with open(filename, "w") as f:
+            json.dump([dict(zip(COLUMNS, metrics)) for metrics in results], f, indent=2)
+    else:
+        import pandas as pd
+        df = pd.DataFrame(results, columns=COLUMNS)
+        # df = df.transpose()  # This line swaps the rows and columns
+        df.to_csv(filename, header=True, index=False)
     print(f"Results saved in {filename}!")
 
-def run_benchmark(args, model, tokenizer, batch_size, prompt_length, generation_length, max_length):
+class MemoryMonitor:
+    """Samples the memory in use while the generators run, keeping the peaks.
+
+    The generator memory is what the model accounts for its generators (model.get_memory_usage()): their kv caches,
+    logits and static buffers. The device memory is what NVML reports as used on the device, when pynvml is installed
+    and onnxruntime-genai was built with CUDA, else 0.
+    """
+    def __init__(self, model, device_id, interval=0.01):
+        self.model = model
+        self.interval = interval
+        self.peak_generator_bytes = 0
+        self.peak_device_bytes = 0
+        self.nvml_device = None
+        if og.is_cuda_available():
+            try:
+                import pynvml
+                pynvml.nvmlInit()
+                self.nvml_device = pynvml.nvmlDeviceGetHandleByIndex(device_id)
+            except Exception:
+                pass
+        self.stop_event = threading.Event()
+        self.thread = threading.Thread(target=self.run, daemon=True)
+
+    def sample(self):
+        usage = self.model.get_memory_usage()
+        generator_bytes = usage["kv_cache"] + usage["logits"] + usage["static_buffers"]
+        self.peak_generator_bytes = max(self.peak_generator_bytes, generator_bytes)
+        if self.nvml_device is not None:
+            import pynvml
+            self.peak_device_bytes = max(self.peak_device_bytes, pynvml.nvmlDeviceGetMemoryInfo(self.nvml_device).used)
+
+    def run(self):
+        while not self.stop_event.is_set():
+            self.sample()
+            self.stop_event.wait(self.interval)
+
+    def __enter__(self):
+        self.thread.start()
+        return self
+
+    def __exit__(self, *exc):
+        self.stop_event.set()
+        self.thread.join()
+        self.sample()
+
+def create_params(model, tokens, batch_size, max_length, use_graph_capture):
+    params = og.GeneratorParams(model)
+    params.input_ids = tokens
+    params.set_search_options(max_length=max_length, min_length=max_length)
+
+    if use_graph_capture:
+        params.try_graph_capture_with_max_batch_size(batch_size)
+    return params
+
+# One generator from tokenization to its last token, timing each phase. Runs on its own thread when there are
+# concurrent generators: the model runs release the GIL, so they overlap as they would in a server.
+def run_generator(args, model, tokenizer, prompt, batch_size, generation_length, max_length, use_graph_capture, timings):
+    # Measure tokenization
+    tokenize_start_time = time.perf_counter()
+    tokens = tokenizer.encode_batch(prompt)
+    tokenize_end_time = time.perf_counter()
+    timings["tokenize"].append(tokenize_end_time - tokenize_start_time)
+
+    # Prepare run
+    params = create_params(model, tokens, batch_size, max_length, use_graph_capture)
+    generator = og.Generator(model, params)
+
+    # Measure prompt processing
+    prompt_start_time = time.perf_counter()
+    generator.compute_logits()
+    prompt_end_time = time.perf_counter()
+    timings["prompt"].append(prompt_end_time - prompt_start_time)
+
+    sampling_start_time = time.perf_counter()
+    generator.generate_next_token()
+    sampling_end_time = time.perf_counter()
+    timings["sampling"].append(sampling_end_time - sampling_start_time)
+
+    # Measure token generation
+    i = 1
+    while not generator.is_done() and i < generation_length:
+        # Run inference
+        token_gen_start_time = time.perf_counter()
+        generator.compute_logits()
+        token_gen_end_time = time.perf_counter()
+
+        sampling_start_time = time.perf_counter()
+        generator.generate_next_token()
+        sampling_end_time = time.perf_counter()
+
+        timings["token_gen"].append(token_gen_end_time - token_gen_start_time)
+        timings["sampling"].append(sampling_end_time - sampling_start_time)
+        i += 1
+    timings["metrics"].append(generator.get_metrics())
+    if args.print_model_output: print(tokenizer.decode(generator.get_sequence(0)))
+
+    # Delete the generator to free the captured graph for the next generator, if graph capture is enabled
+    del generator
+
+def run_generators(args, model, tokenizer, prompt, batch_size, generation_length, max_length, concurrency, use_graph_capture, timings):
+    if concurrency == 1:
+        run_generator(args, model, tokenizer, prompt, batch_size, generation_length, max_length, use_graph_capture, timings)
+        return
+
+    errors = []
+    def worker():
+        try:
+            run_generator(args, model, tokenizer, prompt, batch_size, generation_length, max_length, use_graph_capture, timings)
+        except Exception as e:
+            errors.append(e)
+
+    threads = [threading.Thread(target=worker) for _ in range(concurrency)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    if errors:
+        raise errors[0]
+
+def average(values):
+    return sum(values) / len(values) if values else 0.0
+
+def run_benchmark(args, model, tokenizer, batch_size, prompt_length, generation_length, max_length, concurrency=1, use_graph_capture=False):
     # Get user arguments
     num_repetitions = args.repetitions
     temperature = 1.0
 
     # Generate prompt
-    prompt = [generate_prompt(model, tokenizer, prompt_length, args.use_graph_capture)] * batch_size
+    prompt = [generate_prompt(model, tokenizer, prompt_length, use_graph_capture)] * batch_size
     tokens = tokenizer.encode_batch(prompt)
 
     params = og.GeneratorParams(model)
     params.input_ids = tokens
     params.set_search_options(do_sample=True, top_k=args.top_k, top_p=args.top_p, temperature=temperature, max_length=max_length, min_length=max_length)
 
-    if args.use_graph_capture:
+    if use_graph_capture:
         params.try_graph_capture_with_max_batch_size(batch_size)
 
     if args.verbose: print("Running warmup runs...")
@@ -81,66 +222,20 @@ def run_benchmark(args, model, tokenizer, batch_size, prompt_length, generation_
         # Delete the generator to free the captured graph for the next generator, if graph capture is enabled
         del generator
 
-    tokenize_times = []
-    prompt_times = []
-    token_gen_times = []
-    sampling_times = []
+    # Lists append atomically, so the concurrent generators share these
+    timings = {"tokenize": [], "prompt": [], "token_gen": [], "sampling": [], "metrics": []}
     wall_clock_times = []
-    if args.verbose: print(f"Running benchmark for batch size = {batch_size}, prompt length = {prompt_length}")
-    for _ in tqdm(range(num_repetitions)):
-        wall_clock_start_time = time.time()
-
-        # Prepare run
-        generator = og.Generator(model, params)
-
-        # Measure tokenization
-        tokenize_start_time = time.perf_counter()
-        tokens = tokenizer.encode_batch(prompt)
-        tokenize_end_time = time.perf_counter()
-        tokenize_times.append(tokenize_end_time - tokenize_start_time)
-
-        # Prepare run
-        params = og.GeneratorParams(model)
-        params.input_ids = tokens
-        params.set_search_options(max_length=max_length, min_length=max_length)
-
-        if args.use_graph_capture:
-            params.try_graph_capture_with_max_batch_size(batch_size)
-
-        generator = og.Generator(model, params)
-
-        # Measure prompt processing
-        prompt_start_time = time.perf_counter()
-        generator.compute_logits()
-        prompt_end_time = time.perf_counter()
-        prompt_times.append(prompt_end_time - prompt_start_time)
-
-        sampling_start_time = time.perf_counter()
-        generator.generate_next_token()
-        sampling_end_time = time.perf_counter()
-        sampling_times.append(sampling_end_time - sampling_start_time)
-
-        # Measure token generation
-        i = 1
-        while not generator.is_done() and i < generation_length:
-            # Run inference
-            token_gen_start_time = time.perf_counter()
-            generator.compute_logits()
-            token_gen_end_time = time.perf_counter()
-
-            sampling_start_time = time.perf_counter()
-            generator.generate_next_token()
-            sampling_end_time = time.perf_counter()
-            
-            token_gen_times.append(token_gen_end_time - token_gen_start_time)
-            sampling_times.append(sampling_end_time - sampling_start_time)
-            i += 1
-        wall_clock_end_time = time.time()
-        wall_clock_times.append(wall_clock_end_time - wall_clock_start_time)
-        if args.print_model_output: print(tokenizer.decode(generator.get_sequence(0)))
-
-        # Delete the generator to free the captured graph for the next generator, if graph capture is enabled
-        del generator
+    if args.verbose: print(f"Running benchmark for batch size = {batch_size}, prompt length = {prompt_length}, concurrency = {concurrency}")
+    with MemoryMonitor(model, args.device_id) as memory:
+        for _ in tqdm(range(num_repetitions)):
+            wall_clock_start_time = time.time()
+            run_generators(args, model, tokenizer, prompt, batch_size, generation_length, max_length, concurrency, use_graph_capture, timings)
+            wall_clock_end_time = time.time()
+            wall_clock_times.append(wall_clock_end_time - wall_clock_start_time)
+    tokenize_times = timings["tokenize"]
+    prompt_times = timings["prompt"]
+    token_gen_times = timings["token_gen"]
+    sampling_times = timings["sampling"]
 
     # Calculate tokenization metrics
     avg_tokenization_latency_s = sum(tokenize_times) / len(tokenize_times)
@@ -171,12 +266,33 @@ def run_benchmark(args, model, tokenizer, batch_size, prompt_length, generation_
     print(f"Average Sampling Latency (per token): {avg_sampling_latency_ms} ms")
     print(f"Average Sampling Throughput (per token): {avg_sampling_thrpt} tps")
 
-    # Calculate wall clock time
+    # Calculate wall clock time, the throughput is of all the concurrent generators together
     avg_wall_clock_time = sum(wall_clock_times) / len(wall_clock_times)
-    avg_wall_clock_thrpt = batch_size * (max_length / avg_wall_clock_time)
+    avg_wall_clock_thrpt = concurrency * batch_size * (max_length / avg_wall_clock_time)
     print(f"Average Wall Clock Time: {avg_wall_clock_time} s")
     print(f"Average Wall Clock Throughput: {avg_wall_clock_thrpt} tps")
 
+    # Calculate the per phase metrics the generators measure themselves: the prefill is per generator, the rest per step
+    generator_metrics = timings["metrics"]
+    steps = [m["decode_steps"] + 1 for m in generator_metrics]
+    avg_prefill_ms = average([m["prefill_seconds"] for m in generator_metrics]) * 1000
+    avg_decode_ms = average([m["decode_seconds"] / max(m["decode_steps"], 1) for m in generator_metrics]) * 1000
+    avg_update_inputs_ms = average([m["update_inputs_seconds"] / n for m, n in zip(generator_metrics, steps)]) * 1000
+    avg_search_ms = average([m["search_seconds"] / n for m, n in zip(generator_metrics, steps)]) * 1000
+    avg_host_to_device = average([m["host_to_device_bytes"] / n for m, n in zip(generator_metrics, steps)])
+    avg_device_to_host = average([m["device_to_host_bytes"] / n for m, n in zip(generator_metrics, steps)])
+    avg_device_allocations = average([m["device_allocations"] / n for m, n in zip(generator_metrics, steps)])
+    print(f"Average Prefill Session Latency: {avg_prefill_ms} ms")
+    print(f"Average Decode Session Latency (per token): {avg_decode_ms} ms")
+    print(f"Average Update Inputs Latency (per token): {avg_update_inputs_ms} ms")
+    print(f"Average Search Latency (per token): {avg_search_ms} ms")
+
+    # Calculate the memory peaks
+    peak_generator_memory_mb = memory.peak_generator_bytes / (1024 * 1024)
+    peak_device_memory_mb = memory.peak_device_bytes / (1024 * 1024)
+    print(f"Peak Generator Memory: {peak_generator_memory_mb} MB")
+    if memory.nvml_device is not None: print(f"Peak Device Memory: {peak_device_memory_mb} MB")
+
     metrics = [
         batch_size, 
         prompt_length,
@@ -192,6 +308,17 @@ def run_benchmark(args, model, tokenizer, batch_size, prompt_length, generation_
         avg_sampling_latency_ms,
         avg_wall_clock_thrpt,
         avg_wall_clock_time,
+        avg_prefill_ms,
+        avg_decode_ms,
+        avg_update_inputs_ms,
+        avg_search_ms,
+        avg_host_to_device,
+        avg_device_to_host,
+        avg_device_allocations,
+        peak_generator_memory_mb,
+        peak_device_memory_mb,
+        concurrency,
+        use_graph_capture,
     ]
     return metrics
 
@@ -204,21 +331,24 @@ def main(args):
     if args.verbose: print("Model loaded")
     tokenizer = og.Tokenizer(model)
     if args.verbose: print("Benchmarking " + model_path)
-    for batch_size in args.batch_sizes:
-        for l, prompt_length in enumerate(args.prompt_lengths):
-            for g, gen_length in enumerate(args.generation_lengths):
-                if args.max_lengths:
-                    m = l * len(args.generation_lengths) + g
-                    max_length = args.max_lengths[m]
-                else:
-                    max_length = prompt_length + gen_length
-                print(f"Args: batch_size = {batch_size}, prompt_length = {prompt_length}, tokens = {gen_length}, max_length = {max_length}")
-                metrics = run_benchmark(args, model, tokenizer, batch_size, prompt_length, gen_length, max_length)
-                all_csv_metrics.append(metrics)
-    # Add metrics to CSV
-    if args.verbose: print("Adding results to CSV")
-    filename = args.output
-    save_results(all_csv_metrics, filename)
+    graph_capture_modes = [False, True] if args.sweep_graph_capture else [args.use_graph_capture]
+    for use_graph_capture in graph_capture_modes:
+        for concurrency in args.concurrency:
+            for batch_size in args.batch_sizes:
+                for l, prompt_length in enumerate(args.prompt_lengths):
+                    for g, gen_length in enumerate(args.generation_lengths):
+                        if args.max_lengths:
+                            m = l * len(args.generation_lengths) + g
+                            max_length = args.max_lengths[m]
+                        else:
+                            max_length = prompt_length + gen_length
+                        print(f"Args: batch_size = {batch_size}, prompt_length = {prompt_length}, tokens = {gen_length}, max_length = {max_length}, "
+                              f"concurrency = {concurrency}, graph_capture = {use_graph_capture}")
+                        metrics = run_benchmark(args, model, tokenizer, batch_size, prompt_length, gen_length, max_length, concurrency, use_graph_capture)
+                        all_csv_metrics.append(metrics)
+                        # Written after every point, so a long sweep that fails part way still leaves its results
+                        save_results(all_csv_metrics, args.output)
+    if args.verbose: print("Results written to " + args.output)
 
 def str2intlist(value):
     return [int(v) for v in value.split(',')]
@@ -237,9 +367,12 @@ if __name__ == "__main__":
     parser.add_argument('-w', '--warmup', type=int, default=5, help='Number of warmup runs before benchmarking')
     parser.add_argument('-k', '--top_k', type=int, default=50, help='Top k tokens to sample from')
     parser.add_argument('-p', '--top_p', type=float, default=1.0, help='Top p probability to sample with')
-    parser.add_argument('-o', '--output', type=str, default='genai_e2e', help='Output CSV file name or path (with .csv extension)')
+    parser.add_argument('-c', '--concurrency', type=str2intlist, default=[1], help='Number of generators running at the same time, each on its own thread')
+    parser.add_argument('-o', '--output', type=str, default='genai_e2e', help='Output file name or path, JSON with a .json extension, else CSV (with .csv extension)')
     parser.add_argument('-v', '--verbose', action='store_true', help='Print extra information')
     parser.add_argument('-mo', '--print_model_output', action='store_true', help='Print model output')
     parser.add_argument('-gc', '--use_graph_capture', action='store_true', help='Use the graph capture feature for CUDA or DML')
+    parser.add_argument('-sgc', '--sweep_graph_capture', action='store_true', help='Run every point both without and with graph capture')
+    parser.add_argument('-d', '--device_id', type=int, default=0, help='Device whose peak memory is recorded, with pynvml installed')
     args = parser.parse_args()
     main(args)
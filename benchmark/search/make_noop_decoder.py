@@ -0,0 +1,100 @@
+# Copyright (c) Microsoft Corporation. All rights reserved.
+# Licensed under the MIT License.
+
+"""
+Writes decoder only models that do no compute, for state_benchmark to measure the generator's own per step cost: the
+logits are zeros and every present is its past with zeros appended. Each model goes in <output>/layers_<n> with its
+genai_config.json.
+
+    python make_noop_decoder.py -o noop_models --layers 1 8 32 --provider cuda
+    state_benchmark --noop_models=noop_models --benchmark_format=json
+"""
+
+import argparse
+import json
+import os
+
+import onnx
+from onnx import TensorProto, helper
+
+
+def make_model(num_layers, num_heads, head_size, vocab_size):
+    inputs = [
+        helper.make_tensor_value_info("input_ids", TensorProto.INT64, ["batch_size", "sequence_length"]),
+        helper.make_tensor_value_info("attention_mask", TensorProto.INT64, ["batch_size", "total_sequence_length"]),
+        helper.make_tensor_value_info("position_ids", TensorProto.INT64, ["batch_size", "sequence_length"]),
+    ]
+    outputs = [helper.make_tensor_value_info("logits", TensorProto.FLOAT, ["batch_size", "sequence_length", vocab_size])]
+
+    zero = helper.make_tensor("zero", TensorProto.FLOAT, [1], [0.0])
+    nodes = [
+        helper.make_node("Shape", ["input_ids"], ["batch"], start=0, end=1),
+        helper.make_node("Shape", ["input_ids"], ["sequence"], start=1, end=2),
+        helper.make_node("Concat", ["batch", "sequence", "vocab"], ["logits_shape"], axis=0),
+        helper.make_node("ConstantOfShape", ["logits_shape"], ["logits"], value=zero),
+        helper.make_node("Concat", ["batch", "heads", "sequence", "head_size"], ["kv_shape"], axis=0),
+        helper.make_node("ConstantOfShape", ["kv_shape"], ["new_kv"], value=zero),
+    ]
+    initializers = [
+        helper.make_tensor("vocab", TensorProto.INT64, [1], [vocab_size]),
+        helper.make_tensor("heads", TensorProto.INT64, [1], [num_heads]),
+        helper.make_tensor("head_size", TensorProto.INT64, [1], [head_size]),
+    ]
+
+    for i in range(num_layers):
+        for kind in ("key", "value"):
+            past = f"past_key_values.{i}.{kind}"
+            present = f"present.{i}.{kind}"
+            inputs.append(helper.make_tensor_value_info(past, TensorProto.FLOAT, ["batch_size", num_heads, "past_sequence_length", head_size]))
+            outputs.append(helper.make_tensor_value_info(present, TensorProto.FLOAT, ["batch_size", num_heads, "total_sequence_length", head_size]))
+            nodes.append(helper.make_node("Concat", [past, "new_kv"], [present], axis=2))
+
+    graph = helper.make_graph(nodes, "noop_decoder", inputs, outputs, initializers)
+    return helper.make_model(graph, opset_imports=[helper.make_opsetid("", 17)])
+
+
+def make_config(num_layers, num_heads, head_size, vocab_size, context_length, provider):
+    session_options = {"provider_options": [{provider: {}}]} if provider != "cpu" else {}
+    return {
+        "model": {
+            "type": "llama",
+            "bos_token_id": 1,
+            "eos_token_id": 2,
+            "pad_token_id": 0,
+            "vocab_size": vocab_size,
+            "context_length": context_length,
+            "decoder": {
+                "filename": "model.onnx",
+                "head_size": head_size,
+                "hidden_size": num_heads * head_size,
+                "num_attention_heads": num_heads,
+                "num_key_value_heads": num_heads,
+                "num_hidden_layers": num_layers,
+                "session_options": session_options,
+            },
+        },
+        "search": {"max_length": context_length, "past_present_share_buffer": False},
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("-o", "--output", required=True, help="Directory to write the models to")
+    parser.add_argument("--layers", type=int, nargs="+", default=[1, 8, 32], help="Layer counts to write a model for")
+    parser.add_argument("--num_heads", type=int, default=8)
+    parser.add_argument("--head_size", type=int, default=128)
+    parser.add_argument("--vocab_size", type=int, default=32000)
+    parser.add_argument("--context_length", type=int, default=4096)
+    parser.add_argument("--provider", choices=["cpu", "cuda", "dml"], default="cpu", help="Execution provider of the models")
+    args = parser.parse_args()
+
+    for num_layers in args.layers:
+        path = os.path.join(args.output, f"layers_{num_layers}")
+        os.makedirs(path, exist_ok=True)
+        onnx.save(make_model(num_layers, args.num_heads, args.head_size, args.vocab_size), os.path.join(path, "model.onnx"))
+        with open(os.path.join(path, "genai_config.json"), "w") as f:
+            json.dump(make_config(num_layers, args.num_heads, args.head_size, args.vocab_size, args.context_length, args.provider), f, indent=2)
+
+
+if __name__ == "__main__":
+    main()
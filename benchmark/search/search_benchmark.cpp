@@ -0,0 +1,221 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+// Microbenchmarks of the search and sampling steps over vocab and batch sizes. Run with
+// --benchmark_format=json, or --benchmark_out=<file> --benchmark_out_format=json, to compare runs.
+
+#include <benchmark/benchmark.h>
+#include <generators.h>
+#include <search.h>
+#include <models/model.h>
+#if USE_CUDA
+#include <models/kernels.h>
+#endif
+#include <random>
+
+namespace {
+
+constexpr int c_max_length = 512;  // The context length of the model the generators are made with
+
+// Released in main before onnxruntime shuts down
+std::shared_ptr<Generators::Model> g_model;
+
+const Generators::Model& GetModel() {
+  if (!g_model)
+    g_model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  return *g_model;
+}
+
+// A generator whose search scores a fixed set of random logits every iteration. The generator is created and the
+// logits restored with the timer paused, as a search overwrites its scores.
+struct SearchFixture {
+  SearchFixture(Generators::DeviceType device_type, int vocab_size, int batch_size, int num_beams = 1)
+      : input_ids_(static_cast<size_t>(batch_size), 0) {
+    params_ = Generators::CreateGeneratorParams();
+    params_->search.max_length = c_max_length;
+    params_->search.num_beams = num_beams;
+    params_->batch_size = batch_size;
+    params_->sequence_length = 1;
+    params_->vocab_size = vocab_size;
+    params_->eos_token_id = vocab_size - 1;
+    params_->input_ids = input_ids_;
+    params_->device_type = device_type;
+
+    // A few large scores over a normal background, like real logits
+    const size_t count = static_cast<size_t>(params_->BatchBeamSize()) * static_cast<size_t>(vocab_size);
+    logits_.resize(count);
+    std::mt19937 engine{0};
+    std::normal_distribution<float> background{0.0f, 1.0f};
+    std::uniform_int_distribution<int> token{0, vocab_size - 1};
+    for (auto& logit : logits_)
+      logit = background(engine);
+    for (size_t row = 0; row < count / static_cast<size_t>(vocab_size); row++)
+      for (int i = 0; i < 20; i++)
+        logits_[row * static_cast<size_t>(vocab_size) + static_cast<size_t>(token(engine))] = 10.0f + static_cast<float>(i);
+    scores_ = logits_;
+
+#if USE_CUDA
+    if (device_type == Generators::DeviceType::CUDA) {
+      logits_gpu_ = Generators::CudaMallocArray<float>(count, &logits_gpu_span_);
+      scores_gpu_ = Generators::CudaMallocArray<float>(count, &scores_gpu_span_);
+      cudaMemcpy(logits_gpu_span_.data(), logits_.data(), count * sizeof(float), cudaMemcpyHostToDevice);
+    }
+#endif
+    generator_ = Generators::CreateGenerator(GetModel(), *params_);
+  }
+
+  // Call with the timer paused
+  void Reset() {
+    if (generator_->search_->IsDone() || generator_->search_->GetSequenceLength() >= c_max_length - 1)
+      generator_ = Generators::CreateGenerator(GetModel(), *params_);
+#if USE_CUDA
+    if (params_->device_type == Generators::DeviceType::CUDA) {
+      cudaMemcpyAsync(scores_gpu_span_.data(), logits_gpu_span_.data(), scores_gpu_span_.size_bytes(), cudaMemcpyDeviceToDevice, params_->cuda_stream);
+      generator_->search_->SetLogits(scores_gpu_span_);
+      cudaStreamSynchronize(params_->cuda_stream);
+      return;
+    }
+#endif
+    std::copy(logits_.begin(), logits_.end(), scores_.begin());
+    generator_->search_->SetLogits(Generators::cpu_span<float>{scores_.data(), scores_.size()});
+  }
+
+  // Call at the end of the timed step, so the device work is measured
+  void Sync() const {
+#if USE_CUDA
+    if (params_->device_type == Generators::DeviceType::CUDA)
+      cudaStreamSynchronize(params_->cuda_stream);
+#endif
+  }
+
+  Generators::Search& GetSearch() { return *generator_->search_; }
+
+  std::vector<int32_t> input_ids_;
+  std::shared_ptr<Generators::GeneratorParams> params_;
+  std::unique_ptr<Generators::Generator> generator_;
+  std::vector<float> logits_, scores_;
+#if USE_CUDA
+  Generators::cuda_unique_ptr<float> logits_gpu_, scores_gpu_;
+  Generators::gpu_span<float> logits_gpu_span_, scores_gpu_span_;
+#endif
+};
+
+// Runs step on the fixture's search once per iteration, range(0) is the vocab size and range(1) the batch size
+template <typename Step>
+void RunSearchBenchmark(benchmark::State& state, Generators::DeviceType device_type, int num_beams, Step step) {
+  SearchFixture fixture{device_type, static_cast<int>(state.range(0)), static_cast<int>(state.range(1)), num_beams};
+  for (auto _ : state) {
+    state.PauseTiming();
+    fixture.Reset();
+    state.ResumeTiming();
+
+    step(fixture.GetSearch(), state);
+    fixture.Sync();
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(1));  // Tokens
+}
+
+void SelectTop(benchmark::State& state, Generators::DeviceType device_type) {
+  RunSearchBenchmark(state, device_type, 1, [](Generators::Search& search, benchmark::State&) { search.SelectTop(); });
+}
+
+void BeamSelectTop(benchmark::State& state, Generators::DeviceType device_type) {
+  RunSearchBenchmark(state, device_type, static_cast<int>(state.range(2)), [](Generators::Search& search, benchmark::State&) { search.SelectTop(); });
+}
+
+void SampleTopK(benchmark::State& state, Generators::DeviceType device_type) {
+  RunSearchBenchmark(state, device_type, 1, [](Generators::Search& search, benchmark::State& state) {
+    search.SampleTopK(static_cast<int>(state.range(2)), 1.0f);
+  });
+}
+
+// range(2) is top_p in percent
+void SampleTopP(benchmark::State& state, Generators::DeviceType device_type) {
+  RunSearchBenchmark(state, device_type, 1, [](Generators::Search& search, benchmark::State& state) {
+    search.SampleTopP(static_cast<float>(state.range(2)) / 100.0f, 1.0f);
+  });
+}
+
+void SampleTopKTopP(benchmark::State& state, Generators::DeviceType device_type) {
+  RunSearchBenchmark(state, device_type, 1, [](Generators::Search& search, benchmark::State& state) {
+    search.SampleTopKTopP(static_cast<int>(state.range(2)), 0.95f, 1.0f);
+  });
+}
+
+void RepetitionPenalty(benchmark::State& state, Generators::DeviceType device_type) {
+  RunSearchBenchmark(state, device_type, 1, [](Generators::Search& search, benchmark::State&) { search.ApplyRepetitionPenalty(1.1f); });
+}
+
+#if USE_CUDA
+void HandleEOSArray(benchmark::State& state) {
+  SearchFixture fixture{Generators::DeviceType::CUDA, static_cast<int>(state.range(0)), static_cast<int>(state.range(1))};
+  const int32_t eos_token_ids_cpu[] = {0, 1, 2, 3};
+  Generators::gpu_span<int32_t> eos_token_ids;
+  auto eos_token_ids_owner = Generators::CudaMallocArray<int32_t>(std::size(eos_token_ids_cpu), &eos_token_ids);
+  cudaMemcpy(eos_token_ids.data(), eos_token_ids_cpu, sizeof(eos_token_ids_cpu), cudaMemcpyHostToDevice);
+  auto& params = *fixture.params_;
+  fixture.Reset();
+  for (auto _ : state) {
+    Generators::cuda::LaunchHandleEOSArray(fixture.scores_gpu_span_.data(), params.BatchBeamSize(), params.vocab_size, eos_token_ids.data(),
+                                           static_cast<int>(eos_token_ids.size()), params.cuda_stream);
+    fixture.Sync();
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(1));
+}
+#endif
+
+// Vocab sizes of llama 2, llama 3 and gemma, batch sizes from single user to large serving batches
+const std::vector<int64_t> c_vocab_sizes{32000, 128256, 256000};
+const std::vector<int64_t> c_batch_sizes{1, 16, 64, 256};
+
+void RegisterBenchmarks(const char* device_name, Generators::DeviceType device_type) {
+  auto name = [device_name](const char* benchmark) { return std::string(benchmark) + "/" + device_name; };
+  auto unit = benchmark::kMicrosecond;
+
+  benchmark::RegisterBenchmark(name("SelectTop").c_str(), SelectTop, device_type)
+      ->ArgsProduct({c_vocab_sizes, c_batch_sizes})
+      ->ArgNames({"vocab", "batch"})
+      ->Unit(unit);
+  benchmark::RegisterBenchmark(name("BeamSelectTop").c_str(), BeamSelectTop, device_type)
+      ->ArgsProduct({c_vocab_sizes, {1, 16, 64}, {4}})
+      ->ArgNames({"vocab", "batch", "beams"})
+      ->Unit(unit);
+  benchmark::RegisterBenchmark(name("SampleTopK").c_str(), SampleTopK, device_type)
+      ->ArgsProduct({c_vocab_sizes, c_batch_sizes, {5, 50}})
+      ->ArgNames({"vocab", "batch", "k"})
+      ->Unit(unit);
+  benchmark::RegisterBenchmark(name("SampleTopP").c_str(), SampleTopP, device_type)
+      ->ArgsProduct({c_vocab_sizes, c_batch_sizes, {50, 95}})
+      ->ArgNames({"vocab", "batch", "p_percent"})
+      ->Unit(unit);
+  benchmark::RegisterBenchmark(name("SampleTopKTopP").c_str(), SampleTopKTopP, device_type)
+      ->ArgsProduct({c_vocab_sizes, c_batch_sizes, {5, 50}})
+      ->ArgNames({"vocab", "batch", "k"})
+      ->Unit(unit);
+  benchmark::RegisterBenchmark(name("RepetitionPenalty").c_str(), RepetitionPenalty, device_type)
+      ->ArgsProduct({c_vocab_sizes, c_batch_sizes})
+      ->ArgNames({"vocab", "batch"})
+      ->Unit(unit);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  RegisterBenchmarks("cpu", Generators::DeviceType::CPU);
+#if USE_CUDA
+  RegisterBenchmarks("cuda", Generators::DeviceType::CUDA);
+  benchmark::RegisterBenchmark("HandleEOSArray/cuda", HandleEOSArray)
+      ->ArgsProduct({c_vocab_sizes, c_batch_sizes})
+      ->ArgNames({"vocab", "batch"})
+      ->Unit(benchmark::kMicrosecond);
+#endif
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    return 1;
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  g_model.reset();
+  Generators::Shutdown();
+  return 0;
+}
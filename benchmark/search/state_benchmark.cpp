@@ -0,0 +1,116 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+// The generator's own cost of a decoder step, measured on decoders that do no compute (see make_noop_decoder.py) over
+// layer counts, beam counts and sequence lengths. Every step is ComputeLogits and GenerateNextToken, the generator
+// metrics split it into the session run, the input updates around it (KV_Cache::Update, PickPastState,
+// PositionInputs::Update, Logits::Get and binding) and the search.
+//   state_benchmark --noop_models=<dir> [google benchmark options]
+
+#include <benchmark/benchmark.h>
+#include <generators.h>
+#include <models/model.h>
+#include <fstream>
+#include <map>
+#include <string_view>
+
+namespace {
+
+constexpr int c_steps_per_generator = 128;
+
+std::string g_model_dir;
+std::map<int64_t, std::shared_ptr<Generators::Model>> g_models;  // By layer count, released in main before onnxruntime shuts down
+
+std::string ModelPath(int64_t num_layers) {
+  return g_model_dir + "/layers_" + std::to_string(num_layers);
+}
+
+const Generators::Model& GetModel(int64_t num_layers) {
+  auto& model = g_models[num_layers];
+  if (!model)
+    model = Generators::CreateModel(Generators::GetOrtEnv(), ModelPath(num_layers).c_str());
+  return *model;
+}
+
+// range(0) layers, range(1) beams and range(2) the prompt length
+void DecoderStep(benchmark::State& state) {
+  auto& model = GetModel(state.range(0));
+  const int num_beams = static_cast<int>(state.range(1));
+  const int prompt_length = static_cast<int>(state.range(2));
+
+  std::vector<int32_t> input_ids(static_cast<size_t>(prompt_length), 3);
+  auto params = Generators::CreateGeneratorParams(model);
+  params->search.num_beams = num_beams;
+  params->search.max_length = prompt_length + c_steps_per_generator;
+  params->search.min_length = params->search.max_length;  // No eos, every generator runs all of its steps
+  params->batch_size = 1;
+  params->sequence_length = prompt_length;
+  params->input_ids = input_ids;
+
+  std::unique_ptr<Generators::Generator> generator;
+  Generators::GeneratorMetrics step_totals;
+  for (auto _ : state) {
+    // A fresh generator has run its prompt before its steps are timed
+    if (!generator || generator->IsDone()) {
+      state.PauseTiming();
+      generator = Generators::CreateGenerator(model, *params);
+      generator->ComputeLogits();
+      generator->GenerateNextToken();
+      state.ResumeTiming();
+    }
+
+    const auto before = generator->metrics_;
+    generator->ComputeLogits();
+    generator->GenerateNextToken();
+    const auto& after = generator->metrics_;
+    step_totals.decode_seconds += after.decode_seconds - before.decode_seconds;
+    step_totals.update_inputs_seconds += after.update_inputs_seconds - before.update_inputs_seconds;
+    step_totals.search_seconds += after.search_seconds - before.search_seconds;
+  }
+
+  auto average_us = [](double seconds) { return benchmark::Counter(seconds * 1e6, benchmark::Counter::kAvgIterations); };
+  state.counters["session_us"] = average_us(step_totals.decode_seconds);
+  state.counters["update_inputs_us"] = average_us(step_totals.update_inputs_seconds);
+  state.counters["search_us"] = average_us(step_totals.search_seconds);
+  const double total = step_totals.decode_seconds + step_totals.update_inputs_seconds + step_totals.search_seconds;
+  state.counters["overhead_fraction"] = total > 0 ? (step_totals.update_inputs_seconds + step_totals.search_seconds) / total : 0.0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  // Our own option is taken out before google benchmark sees the rest
+  int kept = 1;
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg{argv[i]};
+    constexpr std::string_view option{"--noop_models="};
+    if (arg.substr(0, option.size()) == option)
+      g_model_dir = std::string{arg.substr(option.size())};
+    else
+      argv[kept++] = argv[i];
+  }
+  argc = kept;
+  if (g_model_dir.empty()) {
+    std::cerr << "Usage: " << argv[0] << " --noop_models=<dir written by make_noop_decoder.py> [google benchmark options]" << std::endl;
+    return 1;
+  }
+
+  // Every layer count with a model in the directory
+  for (int64_t num_layers : {1, 8, 32, 80}) {
+    if (!std::ifstream{ModelPath(num_layers) + "/genai_config.json"})
+      continue;
+    benchmark::RegisterBenchmark("DecoderStep", DecoderStep)
+        ->ArgsProduct({{num_layers}, {1, 4}, {16, 512, 2048}})
+        ->ArgNames({"layers", "beams", "prompt"})
+        ->Unit(benchmark::kMicrosecond);
+  }
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    return 1;
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  g_models.clear();
+  Generators::Shutdown();
+  return 0;
+}
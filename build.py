@@ -92,6 +92,7 @@ def _parse_args():
     )
 
     parser.add_argument("--use_dml", action="store_true", help="Whether to use DML. Default is to not use DML.")
+    parser.add_argument("--use_rocm", action="store_true", help="Whether to use ROCm. Default is to not use ROCm.")
 
     # The following options are mutually exclusive (cross compiling options such as android, ios, etc.)
     platform_group = parser.add_mutually_exclusive_group()
@@ -365,6 +366,7 @@ def update(args: argparse.Namespace, env: dict[str, str]):
         "-DCMAKE_POSITION_INDEPENDENT_CODE=ON",
         "-DUSE_CUDA=ON" if args.use_cuda else "-DUSE_CUDA=OFF",
         "-DUSE_DML=ON" if args.use_dml else "-DUSE_DML=OFF",
+        "-DUSE_ROCM=ON" if args.use_rocm else "-DUSE_ROCM=OFF",
         f"-DBUILD_WHEEL={build_wheel}",
     ]
 
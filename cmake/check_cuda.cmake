@@ -44,6 +44,9 @@ if(USE_CUDA AND CMAKE_CUDA_COMPILER)
   list(APPEND generator_srcs ${generator_cuda_srcs})
   list(APPEND onnxruntime_libs "${ORT_LIB_DIR}/${ONNXRUNTIME_PROVIDERS_CUDA_LIB}")
   add_compile_definitions(USE_CUDA=1)
+  if(USE_NVTX)
+    add_compile_definitions(USE_NVTX=1)
+  endif()
   include_directories("${CMAKE_CUDA_TOOLKIT_INCLUDE_DIRECTORIES}")
 elseif(USE_CUDA)
   # USE_CUDA is true but cmake could not find the cuda compiler
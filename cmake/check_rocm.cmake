@@ -0,0 +1,9 @@
+# Checking if ROCm is supported
+
+if(USE_ROCM)
+  if(USE_CUDA AND CMAKE_CUDA_COMPILER)
+    message(FATAL_ERROR "USE_ROCM and USE_CUDA can't both be ON, onnxruntime is built for one of them.")
+  endif()
+  # The sessions run on the rocm provider, there are no HIP kernels yet so nothing else is built for it
+  add_compile_definitions(USE_ROCM=1)
+endif()
@@ -2,9 +2,13 @@ include(CMakeDependentOption)
 
 option(USE_CUDA "Build with CUDA support" ON)
 option(USE_DML "Build with DML support" OFF)
+option(USE_ROCM "Build with ROCm support, the search and kv cache still run on the host" OFF)
+option(USE_NVTX "Add NVTX ranges around the generator steps, CUDA builds only" OFF)
 option(ENABLE_PYTHON "Build the Python API." ON)
 option(ENABLE_TESTS "Enable tests" ON)
 option(TEST_PHI2 "Enable tests for Phi2" OFF)
+option(TEST_PHI3V "Enable tests for Phi3 vision, with the model in test_models/phi-3-vision" OFF)
 option(ENABLE_MODEL_BENCHMARK "Build model benchmark program" ON)
+option(ENABLE_SEARCH_BENCHMARK "Build the search, sampling and generator overhead microbenchmarks, needs google benchmark installed" OFF)
 
 cmake_dependent_option(BUILD_WHEEL "Build the python wheel" ON "ENABLE_PYTHON" OFF)
\ No newline at end of file
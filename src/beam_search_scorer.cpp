@@ -16,8 +16,7 @@ void BeamHypotheses::Init(float length_penalty, std::span<HypothesisScore> beams
   done_ = false;
 }
 
-void BeamHypotheses::Add(std::span<const int32_t> hypothesis, float sum_logprobs) {
-  auto length = hypothesis.size();
+void BeamHypotheses::Add(int batch_beam_index, int length, float sum_logprobs) {
   float const score = sum_logprobs / std::pow(static_cast<float>(length), length_penalty_);
 
   size_t index = beams_used_;
@@ -35,7 +34,7 @@ void BeamHypotheses::Add(std::span<const int32_t> hypothesis, float sum_logprobs
     beams_[index] = beams_[index - 1];
   }
 
-  beams_[index] = HypothesisScore{hypothesis, score};
+  beams_[index] = HypothesisScore{batch_beam_index, length, score};
 }
 
 bool BeamHypotheses::CanImprove(float best_sum_logprobs, int current_length) const {
@@ -44,6 +43,7 @@ bool BeamHypotheses::CanImprove(float best_sum_logprobs, int current_length) con
 }
 
 void BeamHypotheses::Output(
+    const Sequences& source,
     size_t top_k,
     size_t max_length,
     std::span<int32_t> sequences,             // buffer filled with pad token ID, shape (num_return_sequences, max_length)
@@ -57,7 +57,7 @@ void BeamHypotheses::Output(
 
     // Note that word_ids might be less than max_length.
     // Since the sequences has been filled with pad token ID, so padding is not needed here.
-    copy(item.hypothesis, target);
+    source.CopySequence(item.batch_beam_index, item.length, target);
 
     if (!sequences_scores.empty()) {
       sequences_scores[index] = item.score;
@@ -86,10 +86,6 @@ BeamSearchScorer::BeamSearchScorer(const GeneratorParams& parameters)
   next_beam_tokens_ptr_ = AllocateArray<int32_t>(batch_beam_size, &next_beam_tokens_);
   next_beam_indices_ptr_ = AllocateArray<int32_t>(batch_beam_size, &next_beam_indices_);
 
-  // Space to store intermediate sequence with length sequence_length, sequence_length + 1, ..., max_sequence_length.
-  size_t const per_beam = (max_length_ * (max_length_ + 1) - (parameters.sequence_length - 1) * parameters.sequence_length) / 2;
-  hypothesis_buffer_ptr_ = AllocateArray<int32_t>(batch_beam_size * per_beam, &hypothesis_buffer_);
-
   memset(next_beam_scores_.data(), 0, next_beam_scores_.size_bytes());
 
   // Initialize score of first beam of each group with 0 and the rest with -1e9.
@@ -120,11 +116,11 @@ void BeamSearchScorer::Process(Sequences& sequences,
     if (beam_hyp.done_) {
       assert(beam_hyp.beams_used_ == num_beams_);  // Batch can only be done if all beams have been generated
 
-      // Pad the batch.
+      // Pad the batch, every beam stays where it is so the reorders don't move rows into it
       for (size_t j = 0; j < num_beams_; j++) {
         next_beam_scores_[batch * num_beams_ + j] = 0.0f;
         next_beam_tokens_[batch * num_beams_ + j] = pad_token_id_;
-        next_beam_indices_[batch * num_beams_ + j] = 0;
+        next_beam_indices_[batch * num_beams_ + j] = static_cast<int32_t>(batch * num_beams_ + j);
       }
       continue;
     }
@@ -145,13 +141,7 @@ void BeamSearchScorer::Process(Sequences& sequences,
           continue;
         }
 
-        // Clone the sequence and append to buffer.
-        std::span<const int32_t> const src = sequences.GetSequence(batch_beam_idx);
-        auto clone = hypothesis_buffer_.subspan(static_cast<size_t>(hypothesis_buffer_used_), sequence_length);
-
-        copy(src, clone);
-        hypothesis_buffer_used_ += sequence_length;
-        beam_hyp.Add(clone, next_score);
+        beam_hyp.Add(batch_beam_idx, sequence_length, next_score);
       } else {
         // Add next predicted token since it is not eos_token.
         next_beam_scores_[batch * num_beams_ + beam_idx] = next_score;
@@ -167,7 +157,6 @@ void BeamSearchScorer::Process(Sequences& sequences,
     }
 
     assert(beam_idx == num_beams_);
-    assert(static_cast<size_t>(hypothesis_buffer_used_) <= hypothesis_buffer_.size());
 
     //  Check if we are done so that we can save a pad step if all(done)
     if (static_cast<size_t>(beam_hyp.beams_used_) < num_beams_) {
@@ -204,8 +193,7 @@ void BeamSearchScorer::Finalize(Sequences& sequences,
     for (int beam_index = 0; beam_index < num_beams_; beam_index++) {
       int const batch_beam_index = batch_index * num_beams_ + beam_index;
       float const final_score = next_beam_scores_[batch_beam_index];
-      auto final_tokens = sequences.GetSequence(batch_beam_index);
-      beam_hyp.Add(final_tokens, final_score);
+      beam_hyp.Add(batch_beam_index, sequences.GetSequenceLength(), final_score);
     }
   }
 
@@ -223,7 +211,7 @@ void BeamSearchScorer::Finalize(Sequences& sequences,
       sequence_scores_buffer = sequence_scores.subspan(batch_index * num_return_sequences, num_return_sequences);
     }
 
-    beam_hyp.Output(num_return_sequences, max_length_, batch_output, sequence_scores_buffer);
+    beam_hyp.Output(sequences, num_return_sequences, max_length_, batch_output, sequence_scores_buffer);
   }
 }
 
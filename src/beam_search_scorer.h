@@ -4,8 +4,11 @@
 // The implementation is based on huggingface transformers generation_beam_search.py
 namespace Generators {
 
+// A finished hypothesis is the sequence of a beam at a length, kept as a reference into the Sequences tree (see
+// Sequences::CopySequence) that's only copied out by Output
 struct HypothesisScore {
-  std::span<const int32_t> hypothesis;
+  int batch_beam_index;
+  int length;
   float score;
 };
 
@@ -14,13 +17,14 @@ struct BeamHypotheses {
   void Init(float length_penalty, std::span<HypothesisScore> beams);
 
   // Add a new hypothesis
-  void Add(std::span<const int32_t> hypothesis, float sum_logprobs);
+  void Add(int batch_beam_index, int length, float sum_logprobs);
 
   // Return true if this beats the worst score in the hypothesis
   bool CanImprove(float best_sum_logprobs, int current_length) const;
 
   // Output results
-  void Output(size_t top_k,                              // number of sequences to return
+  void Output(const Sequences& source,                   // the sequences the hypotheses refer to
+              size_t top_k,                              // number of sequences to return
               size_t max_length,                         // max sequence length
               std::span<int32_t> sequences,              // buffer with pad token, shape (num_return_sequences, max_length)
               std::span<float> sequences_scores) const;  // buffer for sequence scores, with shape (num_return_sequences)
@@ -45,6 +49,7 @@ struct BeamSearchScorer {
                 cpu_span<float> output_sequence_scores);
 
   bool IsDone() const { return not_done_count_ == 0; }
+  bool IsDone(int batch_index) const { return beam_hyps_[batch_index].done_; }  // Its scores are no longer read
 
   cpu_span<float> GetNextScores() { return next_beam_scores_; }
   cpu_span<int32_t> GetNextTokens() { return next_beam_tokens_; }
@@ -68,10 +73,6 @@ struct BeamSearchScorer {
   std::unique_ptr<int32_t[]> next_beam_indices_ptr_;
   cpu_span<int32_t> next_beam_indices_;
 
-  std::unique_ptr<int32_t[]> hypothesis_buffer_ptr_;  // Allocated buffer to hold all hypotheses
-  std::span<int32_t> hypothesis_buffer_;              // Span of the allocated buffer
-  int hypothesis_buffer_used_{};                      // Offset of available buffer, or length of used buffer.
-
   std::unique_ptr<HypothesisScore[]> hypothesis_scores_ptr_;  // num_beams_ * batch_size_, divided into num_beams_ chunks per BeamHypothesis in beam_hyps_
   std::unique_ptr<BeamHypotheses[]> beam_hyps_ptr_;
   std::span<BeamHypotheses> beam_hyps_;  // Shape is batch_size_
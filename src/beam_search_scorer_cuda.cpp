@@ -16,7 +16,6 @@ BeamSearchScorer_Cuda::BeamSearchScorer_Cuda(const GeneratorParams& parameters)
   state_cpu_->eos_token_id_ = parameters.eos_token_id;
   state_cpu_->early_stopping_ = parameters.search.early_stopping;
   state_cpu_->not_done_count_ = parameters.batch_size;
-  state_cpu_->hypothesis_buffer_used_ = 0;
   state_gpu_ = CudaMallocArray<cuda::BeamScorerState>(1);
   cudaMemcpyAsync(state_gpu_.get(), state_cpu_.get(), sizeof(cuda::BeamScorerState), ::cudaMemcpyHostToDevice, stream_);
 
@@ -31,14 +30,8 @@ BeamSearchScorer_Cuda::BeamSearchScorer_Cuda(const GeneratorParams& parameters)
   next_beam_scores_ptr_ = CudaMallocArray<float>(batch_beam_size, &next_beam_scores_);
   next_beam_tokens_ptr_ = CudaMallocArray<int32_t>(batch_beam_size, &next_beam_tokens_);
   next_beam_indices_ptr_ = CudaMallocArray<int32_t>(batch_beam_size, &next_beam_indices_);
-  next_beam_indices_cpu_ptr_ = std::make_unique<int32_t[]>(batch_beam_size);
-  next_beam_indices_cpu_ = cpu_span<int32_t>(next_beam_indices_cpu_ptr_.get(), batch_beam_size);
 
   cuda::LaunchInitScoresKernel(next_beam_scores_.data(), parameters.batch_size, parameters.search.num_beams, stream_);
-
-  // Space to store intermediate sequence with length sequence_length, sequence_length + 1, ..., max_sequence_length.
-  size_t per_beam = (state_cpu_->max_length_ * (state_cpu_->max_length_ + 1) - (parameters.sequence_length - 1) * parameters.sequence_length) / 2;
-  hypothesis_buffer_ptr_ = CudaMallocArray<int32_t>(batch_beam_size * per_beam, &hypothesis_buffer_);
 }
 
 void BeamSearchScorer_Cuda::Process(Sequences_Cuda& sequences,
@@ -47,13 +40,11 @@ void BeamSearchScorer_Cuda::Process(Sequences_Cuda& sequences,
                                     std::span<const int32_t> next_indices) {
   cuda::LaunchBeamSearchScorer_Process(*state_cpu_,
                                        *state_gpu_,
-                                       sequences.GetSequences(),
                                        sequences.GetSequenceLength(),
                                        beam_hyps_,
                                        next_beam_scores_,
                                        next_beam_tokens_,
                                        next_beam_indices_,
-                                       hypothesis_buffer_,
                                        next_scores,
                                        next_tokens,
                                        next_indices,
@@ -62,8 +53,8 @@ void BeamSearchScorer_Cuda::Process(Sequences_Cuda& sequences,
 
   cuda::LaunchBeamSearchScorer_AppendNextTokenToSequences(*state_cpu_,
                                                           *state_gpu_,
-                                                          sequences.GetSequences(),
-                                                          sequences.GetNextSequences(),
+                                                          sequences.GetBeamTokens(),
+                                                          sequences.GetBeamParents(),
                                                           sequences.GetSequenceLength(),
                                                           next_beam_tokens_,
                                                           next_beam_indices_,
@@ -75,12 +66,18 @@ bool BeamSearchScorer_Cuda::IsDoneLater() const {
   return state_cpu_->not_done_count_ == 0;
 }
 
+bool BeamSearchScorer_Cuda::IsDoneIfReady() const {
+  if (cudaEventQuery(event_process_complete_) == cudaErrorNotReady)
+    return false;
+  return state_cpu_->not_done_count_ == 0;
+}
+
 void BeamSearchScorer_Cuda::Finalize(Sequences_Cuda& sequences,
                                      size_t num_return_sequences,
                                      std::span<int32_t> output,           // Word IDs of each sequence, with shape (batch_size * num_return_sequences, max_sequence_length)
                                      std::span<float> sequence_scores) {  // Score of each sequence, with shape (batch_size * num_return_sequences).
   assert(!output.empty());
-  cuda::LaunchBeamSearchScorer_Finalize(state_cpu_->batch_size_, *state_gpu_, sequences.GetSequences(), sequences.GetSequenceLength(), beam_hyps_, next_beam_scores_, output, sequence_scores, stream_);
+  cuda::LaunchBeamSearchScorer_Finalize(state_cpu_->batch_size_, *state_gpu_, sequences.GetBeamTokens(), sequences.GetBeamParents(), sequences.GetSequenceLength(), beam_hyps_, next_beam_scores_, output, sequence_scores, stream_);
 }
 
 }  // namespace Generators
@@ -48,7 +48,7 @@ void LaunchInitializeBeamHypotheses(std::span<BeamHypotheses> beam_hyps,
                                                                              num_beams);
 }
 
-__device__ void BeamHypotheses::Add(const int32_t* hypothesis, int hypothesis_length, float sum_logprobs) {
+__device__ void BeamHypotheses::Add(int batch_beam_index, int hypothesis_length, float sum_logprobs) {
   float score = sum_logprobs / pow(static_cast<float>(hypothesis_length), length_penalty_);
 
   size_t index = beams_used_;
@@ -63,7 +63,7 @@ __device__ void BeamHypotheses::Add(const int32_t* hypothesis, int hypothesis_le
   for (; index > 0 && score > beams_[index - 1].score; index--)
     beams_[index] = beams_[index - 1];
 
-  beams_[index] = HypothesisScore{hypothesis, hypothesis_length, score};
+  beams_[index] = HypothesisScore{batch_beam_index, hypothesis_length, score};
 }
 
 __device__ bool BeamHypotheses::CanImprove(float best_sum_logprobs, int current_length) const {
@@ -75,6 +75,8 @@ __device__ void BeamHypotheses::Output(
     int top_k,
     int max_length,
     int pad_token_id,
+    const int32_t* tokens,
+    const int32_t* parents,
     int32_t* sequences,       // buffer of shape (num_return_sequences, max_length)
     float* sequences_scores)  // buffer of shape (num_return_sequences) or empty
 {
@@ -83,9 +85,13 @@ __device__ void BeamHypotheses::Output(
     auto& item = beams_[index];
     int32_t* target = sequences + index * max_length;
 
-    // Note that word_ids might be less than max_length.
-    for (int i = 0; i < item.hypothesis_length; i++)
-      target[i] = item.hypothesis[i];
+    // Note that word_ids might be less than max_length. Back from the last token, each one's parent is the row holding
+    // the token before it.
+    int row = item.batch_beam_index;
+    for (int i = item.hypothesis_length - 1; i >= 0; i--) {
+      target[i] = tokens[row * max_length + i];
+      row = parents[row * max_length + i];
+    }
     // Pad remaining values with pad token id
     for (int i = item.hypothesis_length; i < max_length; i++)
       target[i] = pad_token_id;
@@ -97,20 +103,14 @@ __device__ void BeamHypotheses::Output(
 
 __global__ void BeamSearchScorer_Process(BeamScorerState& state_cpu,
                                          BeamScorerState& state,
-                                         const int32_t* sequences_buffer,
                                          int sequence_length,
                                          BeamHypotheses* beam_hyps_,
                                          float* next_beam_scores_,
                                          int32_t* next_beam_tokens_,
                                          int32_t* next_beam_indices_,
-                                         int32_t* hypothesis_buffer_,
                                          const float* next_scores,
                                          const int32_t* next_tokens,
                                          const int32_t* next_indices) {
-  // Sequences shape is (batch_size * num_beams, total_sequence_length)
-  // It contains word ID of whole sequence generated so far.
-  // It is different from subgraph input_ids, which only need one word when past state is not empty.
-
   int batch = threadIdx.x;
   int batch_start = batch * state.num_beams_;
 
@@ -132,13 +132,7 @@ __global__ void BeamSearchScorer_Process(BeamScorerState& state_cpu,
           continue;
         }
 
-        // Clone the sequence and append to buffer.
-        const int32_t* src = sequences_buffer + batch_beam_idx * state.max_length_;
-        auto clone = hypothesis_buffer_ + atomicAdd(&state.hypothesis_buffer_used_, sequence_length);
-
-        for (unsigned i = 0; i < sequence_length; i++)
-          clone[i] = src[i];
-        beam_hyp.Add(clone, sequence_length, next_score);
+        beam_hyp.Add(batch_beam_idx, sequence_length, next_score);
       } else {
         // Add next predicted token since it is not eos_token.
         next_beam_scores_[batch_start + beam_idx] = next_score;
@@ -156,117 +150,81 @@ __global__ void BeamSearchScorer_Process(BeamScorerState& state_cpu,
     if (beam_hyp.beams_used_ == state.num_beams_) {
       if (state.early_stopping_ || !beam_hyp.CanImprove(*std::max_element(next_scores + batch_start, next_scores + batch_start + top_k), sequence_length)) {
         beam_hyp.done_ = true;
-        if (atomicAdd(&state.not_done_count_, -1) == 0)
+        if (atomicAdd(&state.not_done_count_, -1) == 1)  // The last one
           state_cpu.not_done_count_ = 0;  // Update the CPU side
       }
     }
   } else {
-    // Pad the batch.
+    // Pad the batch, every beam stays where it is so the reorders don't move rows into it
     for (size_t beam_idx = 0; beam_idx < state.num_beams_; beam_idx++) {
       next_beam_scores_[batch_start + beam_idx] = 0.0f;
       next_beam_tokens_[batch_start + beam_idx] = state.pad_token_id_;
-      next_beam_indices_[batch_start + beam_idx] = 0;
+      next_beam_indices_[batch_start + beam_idx] = batch_start + beam_idx;
     }
   }
 }
 
 void LaunchBeamSearchScorer_Process(BeamScorerState& state_cpu,
                                     BeamScorerState& state,
-                                    std::span<const int32_t> sequences,
                                     int sequence_length,
                                     std::span<BeamHypotheses> beam_hyps,
                                     std::span<float> next_beam_scores,
                                     std::span<int32_t> next_beam_tokens,
                                     std::span<int32_t> next_beam_indices,
-                                    std::span<int32_t> hypothesis_buffer,
                                     std::span<const float> next_scores,
                                     std::span<const int32_t> next_tokens,
                                     std::span<const int32_t> next_indices,
                                     cudaStream_t stream) {
   BeamSearchScorer_Process<<<1, state_cpu.batch_size_, 0, stream>>>(state_cpu,
                                                                     state,
-                                                                    sequences.data(),
                                                                     sequence_length,
                                                                     beam_hyps.data(),
                                                                     next_beam_scores.data(),
                                                                     next_beam_tokens.data(),
                                                                     next_beam_indices.data(),
-                                                                    hypothesis_buffer.data(),
                                                                     next_scores.data(),
                                                                     next_tokens.data(),
                                                                     next_indices.data());
 }
 
-__global__ void BeamSearchScorer_AppendNextTokenToSequences1(BeamScorerState& state,
-                                                             int batch_beam_size,
-                                                             const int32_t* sequences_buffer,
-                                                             int32_t* next_sequences,
-                                                             int sequence_length,
-                                                             int32_t* next_beam_indices_) {
+// Appends every beam's token to the sequences tree, with the row it continues
+__global__ void BeamSearchScorer_AppendNextTokenToSequences(BeamScorerState& state,
+                                                            int batch_beam_size,
+                                                            int32_t* tokens,
+                                                            int32_t* parents,
+                                                            int sequence_length,
+                                                            const int32_t* next_beam_tokens_,
+                                                            const int32_t* next_beam_indices_) {
   int beam_idx = threadIdx.x + blockIdx.x * blockDim.x;
   if (beam_idx >= batch_beam_size)
     return;
-  int sequence_index = threadIdx.y + blockIdx.y * blockDim.y;
-  if (sequence_index >= sequence_length)
-    return;
 
-  int beam_index = next_beam_indices_[beam_idx];
-  next_sequences[beam_idx * state.max_length_ + sequence_index] = sequences_buffer[beam_index * state.max_length_ + sequence_index];
-}
-
-__global__ void BeamSearchScorer_AppendNextTokenToSequences2(BeamScorerState& state,
-                                                             int32_t* next_sequences,
-                                                             int sequence_length,
-                                                             const int32_t* next_beam_tokens_) {
-  int beam_idx = threadIdx.x;
-  next_sequences[beam_idx * state.max_length_ + sequence_length] = next_beam_tokens_[beam_idx];
+  tokens[beam_idx * state.max_length_ + sequence_length] = next_beam_tokens_[beam_idx];
+  parents[beam_idx * state.max_length_ + sequence_length] = next_beam_indices_[beam_idx];
 }
 
 void LaunchBeamSearchScorer_AppendNextTokenToSequences(BeamScorerState& state_cpu,
                                                        BeamScorerState& state,
-                                                       std::span<const int32_t> sequences,
-                                                       std::span<int32_t> next_sequences,
+                                                       std::span<int32_t> tokens,
+                                                       std::span<int32_t> parents,
                                                        int sequence_length,
                                                        std::span<int32_t> next_beam_tokens,
                                                        std::span<int32_t> next_beam_indices,
                                                        cudaStream_t stream) {
-  const int max_threads = 512;
   int batch_beam_size = state_cpu.batch_size_ * state_cpu.num_beams_;
-  dim3 block_size;
-  dim3 grid_size;
-  if (batch_beam_size * sequence_length <= max_threads) {  // Can fit into a single thread block
-    block_size.x = batch_beam_size;
-    block_size.y = sequence_length;
-  } else {
-    if (sequence_length <= max_threads)  // Sequence length fits into thread block, but batch_beam_size does not, so chunk it
-    {
-      block_size.x = max_threads / sequence_length;
-      block_size.y = sequence_length;
-
-      grid_size.x = (batch_beam_size + block_size.x - 1) / block_size.x;
-    } else {  // Exceed max_threads in every dimension, so divide into max_thread chunks
-      block_size.x = 1;
-      block_size.y = max_threads;
-
-      grid_size.x = batch_beam_size;
-      grid_size.y = (sequence_length + block_size.y - 1) / block_size.y;
-    }
-  }
-  BeamSearchScorer_AppendNextTokenToSequences1<<<grid_size, block_size, 0, stream>>>(state,
-                                                                                     batch_beam_size,
-                                                                                     sequences.data(),
-                                                                                     next_sequences.data(),
-                                                                                     sequence_length,
-                                                                                     next_beam_indices.data());
-
-  BeamSearchScorer_AppendNextTokenToSequences2<<<1, batch_beam_size, 0, stream>>>(state,
-                                                                                  next_sequences.data(),
-                                                                                  sequence_length,
-                                                                                  next_beam_tokens.data());
+  GridBlock32 gb32{batch_beam_size};
+  BeamSearchScorer_AppendNextTokenToSequences<<<gb32.grid_size_, gb32.block_size_, 0, stream>>>(state,
+                                                                                               batch_beam_size,
+                                                                                               tokens.data(),
+                                                                                               parents.data(),
+                                                                                               sequence_length,
+                                                                                               next_beam_tokens.data(),
+                                                                                               next_beam_indices.data());
 }
 
 __global__ void BeamSearchScorer_Finalize(BeamScorerState& state,
-                                          const int32_t* sequences_buffer,
+                                          const int32_t* tokens,
+                                          const int32_t* parents,
                                           int sequence_length,
                                           BeamHypotheses* beam_hyps_,
                                           const float* final_beam_scores,
@@ -282,8 +240,7 @@ __global__ void BeamSearchScorer_Finalize(BeamScorerState& state,
     for (size_t beam_index = 0; beam_index < state.num_beams_; beam_index++) {
       size_t batch_beam_index = batch_index * state.num_beams_ + beam_index;
       float final_score = final_beam_scores[batch_beam_index];
-      auto final_tokens = sequences_buffer + batch_beam_index * state.max_length_;
-      beam_hyp.Add(final_tokens, sequence_length, final_score);
+      beam_hyp.Add(static_cast<int>(batch_beam_index), sequence_length, final_score);
     }
   }
 
@@ -296,13 +253,16 @@ __global__ void BeamSearchScorer_Finalize(BeamScorerState& state,
       num_return_sequences,
       state.max_length_,
       state.pad_token_id_,
+      tokens,
+      parents,
       batch_output,
       sequence_scores ? sequence_scores + batch_index * num_return_sequences : nullptr);
 }
 
 void LaunchBeamSearchScorer_Finalize(int batch_size,
                                      BeamScorerState& state,
-                                     std::span<const int32_t> sequences,
+                                     std::span<const int32_t> tokens,
+                                     std::span<const int32_t> parents,
                                      int sequence_length,
                                      std::span<BeamHypotheses> beam_hyps,
                                      std::span<const float> final_beam_scores,
@@ -310,7 +270,8 @@ void LaunchBeamSearchScorer_Finalize(int batch_size,
                                      std::span<float> sequence_scores,
                                      cudaStream_t stream) {
   BeamSearchScorer_Finalize<<<1, batch_size, 0, stream>>>(state,
-                                                          sequences.data(),
+                                                          tokens.data(),
+                                                          parents.data(),
                                                           sequence_length,
                                                           beam_hyps.data(),
                                                           final_beam_scores.data(),
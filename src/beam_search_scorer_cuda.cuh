@@ -1,8 +1,9 @@
 namespace Generators {
 namespace cuda {
 
+// A finished hypothesis, as a reference into the sequences tree like the CPU HypothesisScore
 struct HypothesisScore {
-  const int32_t* hypothesis;
+  int batch_beam_index;
   int hypothesis_length;
   float score;
 };
@@ -15,7 +16,7 @@ struct BeamHypotheses {
   bool done_;
 
   // Add a new hypothesis
-  __device__ void Add(const int32_t* hypothesis, int hypothesis_length, float sum_logprobs);
+  __device__ void Add(int batch_beam_index, int hypothesis_length, float sum_logprobs);
 
   // Return true if this beats the worst score in the hypothesis
   __device__ bool CanImprove(float best_sum_logprobs, int current_length) const;
@@ -24,6 +25,8 @@ struct BeamHypotheses {
   __device__ void Output(int top_k,                 // number of sequences to return
                          int max_length,            // max sequence length
                          int pad_token_id,          // pad token
+                         const int32_t* tokens,     // the sequences tree, shape (batch_beam_size, max_length)
+                         const int32_t* parents,    // the rows the tokens continue, shape (batch_beam_size, max_length)
                          int32_t* sequences,        // buffer with pad token, shape (num_return_sequences, max_length)
                          float* sequences_scores);  // buffer for sequence scores, with shape (num_return_sequences)
 };
@@ -36,21 +39,17 @@ struct BeamScorerState {
   int eos_token_id_;
   bool early_stopping_;
   int not_done_count_;  // When zero, every batch entry is done (starts at batch_size_)
-
-  int hypothesis_buffer_used_;  // Offset of available buffer, or length of used buffer.
 };
 
 void LaunchInitializeBeamHypotheses(std::span<BeamHypotheses> beam_hyps, float length_penalty, std::span<HypothesisScore> beams, int num_beams, cudaStream_t stream);
 
 void LaunchBeamSearchScorer_Process(BeamScorerState& state_cpu,
                                     BeamScorerState& state,
-                                    std::span<const int32_t> sequences,
                                     int sequence_length,
                                     std::span<BeamHypotheses> beam_hyps_,
                                     std::span<float> next_beam_scores_,
                                     std::span<int32_t> next_beam_tokens_,
                                     std::span<int32_t> next_beam_indices_,
-                                    std::span<int32_t> hypothesis_buffer_,
                                     std::span<const float> next_scores,
                                     std::span<const int32_t> next_tokens,
                                     std::span<const int32_t> next_indices,
@@ -58,8 +57,8 @@ void LaunchBeamSearchScorer_Process(BeamScorerState& state_cpu,
 
 void LaunchBeamSearchScorer_AppendNextTokenToSequences(BeamScorerState& state_cpu,
                                                        BeamScorerState& state,
-                                                       std::span<const int32_t> sequences,
-                                                       std::span<int32_t> next_sequences,
+                                                       std::span<int32_t> tokens,
+                                                       std::span<int32_t> parents,
                                                        int sequence_length,
                                                        std::span<int32_t> next_beam_tokens,
                                                        std::span<int32_t> next_beam_indices,
@@ -67,7 +66,8 @@ void LaunchBeamSearchScorer_AppendNextTokenToSequences(BeamScorerState& state_cp
 
 void LaunchBeamSearchScorer_Finalize(int batch_size,
                                      BeamScorerState& state,
-                                     std::span<const int32_t> sequences,
+                                     std::span<const int32_t> tokens,
+                                     std::span<const int32_t> parents,
                                      int sequence_length,
                                      std::span<BeamHypotheses> beam_hyps_,
                                      std::span<const float> final_beam_scores,
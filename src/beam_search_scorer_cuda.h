@@ -15,15 +15,11 @@ struct BeamSearchScorer_Cuda {
 
   bool IsDone() const { return false; }  // For CUDA we speculatively run the next step while we wait for the GPU to report status. We use 'IsDoneLater()' for this
   bool IsDoneLater() const;
+  bool IsDoneIfReady() const;  // False while the last Process is still running, without waiting for it
 
   gpu_span<float> GetNextScores() { return next_beam_scores_; }
   gpu_span<int32_t> GetNextTokens() { return next_beam_tokens_; }
-  cpu_span<int32_t> GetNextIndicesCPU() {
-    cudaMemcpyAsync(next_beam_indices_cpu_.data(), next_beam_indices_.data(), next_beam_indices_.size_bytes(), cudaMemcpyDeviceToHost, stream_);
-    cudaStreamSynchronize(stream_);
-    return next_beam_indices_cpu_;
-  }
-  gpu_span<int32_t> GetNextIndicesGPU() { return next_beam_indices_; }
+  gpu_span<int32_t> GetNextIndices() { return next_beam_indices_; }
 
  private:
   mutable cuda_event_holder event_process_complete_;
@@ -40,13 +36,6 @@ struct BeamSearchScorer_Cuda {
   cuda_unique_ptr<int32_t> next_beam_indices_ptr_;
   gpu_span<int32_t> next_beam_indices_;
 
-  std::unique_ptr<int32_t[]> next_beam_indices_cpu_ptr_;
-  cpu_span<int32_t> next_beam_indices_cpu_;
-
-  cuda_unique_ptr<int32_t> hypothesis_buffer_ptr_;  // Allocated buffer to hold all hypotheses
-  gpu_span<int32_t> hypothesis_buffer_;             // Span of the allocated buffer
-  size_t hypothesis_buffer_used_{};                 // Offset of available buffer, or length of used buffer.
-
   cuda_unique_ptr<cuda::HypothesisScore> hypothesis_scores_ptr_;  // num_beams_ * batch_size_, divided into num_beams_ chunks per BeamHypothesis in beam_hyps_
   cuda_unique_ptr<cuda::BeamHypotheses> beam_hyps_ptr_;
   gpu_span<cuda::BeamHypotheses> beam_hyps_;  // Shape is batch_size_
@@ -2,6 +2,7 @@
 // Licensed under the MIT License.
 #include "generators.h"
 #include "json.h"
+#include <cstdlib>
 #include <fstream>
 #include <sstream>
 
@@ -64,6 +65,8 @@ struct SessionOptions_Element : JSON::Element {
       v_.log_id = value;
     else if (name == "enable_profiling")
       v_.enable_profiling = value;
+    else if (name == "cache_dir")
+      v_.cache_dir = value;
     else
       throw JSON::unknown_value_error{};
   }
@@ -73,6 +76,8 @@ struct SessionOptions_Element : JSON::Element {
       v_.intra_op_num_threads = static_cast<int>(value);
     else if (name == "inter_op_num_threads")
       v_.inter_op_num_threads = static_cast<int>(value);
+    else if (name == "numa_node")
+      v_.numa_node = static_cast<int>(value);
     else if (name == "log_severity_level")
       v_.log_severity_level = static_cast<int>(value);
     else
@@ -84,6 +89,8 @@ struct SessionOptions_Element : JSON::Element {
       v_.enable_cpu_mem_arena = value;
     else if (name == "enable_mem_pattern")
       v_.enable_mem_pattern = value;
+    else if (name == "memory_map")
+      v_.memory_map = value;
     else
       throw JSON::unknown_value_error{};
   }
@@ -99,6 +106,38 @@ struct SessionOptions_Element : JSON::Element {
   ProviderOptionsArray_Element provider_options_{v_.provider_options};
 };
 
+struct EncoderDecoderInitInputs_Element : JSON::Element {
+  explicit EncoderDecoderInitInputs_Element(Config::Model::EncoderDecoderInit::Inputs& v) : v_{v} {}
+
+  void OnString(std::string_view name, std::string_view value) override {
+    if (name == "input_ids") {
+      v_.input_ids = value;
+    } else if (name == "attention_mask") {
+      v_.attention_mask = value;
+    } else if (name == "decoder_input_ids") {
+      v_.decoder_input_ids = value;
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+ private:
+  Config::Model::EncoderDecoderInit::Inputs& v_;
+};
+
+struct EncoderDecoderInitOutputs_Element : JSON::Element {
+  explicit EncoderDecoderInitOutputs_Element(Config::Model::EncoderDecoderInit::Outputs& v) : v_{v} {}
+
+  void OnString(std::string_view name, std::string_view value) override {
+    if (name == "hidden_states") {
+      v_.hidden_states = value;
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+ private:
+  Config::Model::EncoderDecoderInit::Outputs& v_;
+};
+
 struct EncoderDecoderInit_Element : JSON::Element {
   explicit EncoderDecoderInit_Element(Config::Model::EncoderDecoderInit& v) : v_{v} {}
 
@@ -109,8 +148,19 @@ struct EncoderDecoderInit_Element : JSON::Element {
       throw JSON::unknown_value_error{};
   }
 
+  Element& OnObject(std::string_view name) override {
+    if (name == "inputs") {
+      return inputs_;
+    } else if (name == "outputs") {
+      return outputs_;
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
  private:
   Config::Model::EncoderDecoderInit& v_;
+  EncoderDecoderInitInputs_Element inputs_{v_.inputs};
+  EncoderDecoderInitOutputs_Element outputs_{v_.outputs};
 };
 
 struct Inputs_Element : JSON::Element {
@@ -129,6 +179,12 @@ struct Inputs_Element : JSON::Element {
       v_.seqlens_k = value;
     } else if (name == "total_seq_len") {
       v_.total_sequence_length = value;
+    } else if (name == "past_sequence_length") {
+      v_.past_sequence_length = value;
+    } else if (name == "last_token_indices") {
+      v_.last_token_indices = value;
+    } else if (name == "adapter_ids") {
+      v_.adapter_ids = value;
     } else if (name == "past_key_names") {
       v_.past_key_names = value;
     } else if (name == "past_value_names") {
@@ -139,6 +195,22 @@ struct Inputs_Element : JSON::Element {
       v_.cross_past_key_names = value;
     } else if (name == "cross_past_value_names") {
       v_.cross_past_value_names = value;
+    } else if (name == "encoder_attention_mask") {
+      v_.encoder_attention_mask = value;
+    } else if (name == "encoder_hidden_states") {
+      v_.encoder_hidden_states = value;
+    } else if (name == "past_key_scale_names") {
+      v_.past_key_scale_names = value;
+    } else if (name == "past_value_scale_names") {
+      v_.past_value_scale_names = value;
+    } else if (name == "block_row_indices") {
+      v_.block_row_indices = value;
+    } else if (name == "block_col_indices") {
+      v_.block_col_indices = value;
+    } else if (name == "cos_cache") {
+      v_.cos_cache = value;
+    } else if (name == "sin_cache") {
+      v_.sin_cache = value;
     } else
       throw JSON::unknown_value_error{};
   }
@@ -153,6 +225,10 @@ struct Outputs_Element : JSON::Element {
   void OnString(std::string_view name, std::string_view value) override {
     if (name == "logits") {
       v_.logits = value;
+    } else if (name == "hidden_states") {
+      v_.hidden_states = value;
+    } else if (name == "next_tokens") {
+      v_.next_tokens = value;
     } else if (name == "present_key_names") {
       v_.present_key_names = value;
     } else if (name == "present_value_names") {
@@ -163,6 +239,10 @@ struct Outputs_Element : JSON::Element {
       v_.cross_present_key_names = value;
     } else if (name == "cross_present_value_names") {
       v_.cross_present_value_names = value;
+    } else if (name == "present_key_scale_names") {
+      v_.present_key_scale_names = value;
+    } else if (name == "present_value_scale_names") {
+      v_.present_value_scale_names = value;
     } else
       throw JSON::unknown_value_error{};
   }
@@ -171,12 +251,185 @@ struct Outputs_Element : JSON::Element {
   Config::Model::Decoder::Outputs& v_;
 };
 
+struct KVCache_Element : JSON::Element {
+  explicit KVCache_Element(Config::Model::Decoder::KVCache& v) : v_{v} {}
+
+  void OnNumber(std::string_view name, double value) override {
+    if (name == "block_size") {
+      v_.block_size = static_cast<int>(value);
+    } else if (name == "max_blocks") {
+      v_.max_blocks = static_cast<int>(value);
+    } else if (name == "prefix_cache_size") {
+      v_.prefix_cache_size = static_cast<int>(value);
+    } else if (name == "prefix_chunk_size") {
+      v_.prefix_chunk_size = static_cast<int>(value);
+    } else if (name == "prefix_cache_mb") {
+      v_.prefix_cache_mb = static_cast<int>(value);
+    } else if (name == "window_size") {
+      v_.window_size = static_cast<int>(value);
+    } else if (name == "sink_size") {
+      v_.sink_size = static_cast<int>(value);
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+  void OnBool(std::string_view name, bool value) override {
+    if (name == "preallocate") {
+      v_.preallocate = value;
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+ private:
+  Config::Model::Decoder::KVCache& v_;
+};
+
+struct IntArray_Element : JSON::Element {
+  explicit IntArray_Element(std::vector<int>& v) : v_{v} {}
+
+  void OnNumber(std::string_view /*name*/, double value) override {
+    v_.push_back(static_cast<int>(value));
+  }
+
+ private:
+  std::vector<int>& v_;
+};
+
+struct FloatArray_Element : JSON::Element {
+  explicit FloatArray_Element(std::vector<float>& v) : v_{v} {}
+
+  void OnNumber(std::string_view /*name*/, double value) override {
+    v_.push_back(static_cast<float>(value));
+  }
+
+ private:
+  std::vector<float>& v_;
+};
+
+struct GraphCapture_Element : JSON::Element {
+  explicit GraphCapture_Element(Config::Model::Decoder::GraphCapture& v) : v_{v} {}
+
+  void OnNumber(std::string_view name, double value) override {
+    if (name == "max_graphs") {
+      v_.max_graphs = static_cast<int>(value);
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+  void OnBool(std::string_view name, bool value) override {
+    if (name == "bucketed") {
+      v_.bucketed = value;
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+  Element& OnArray(std::string_view name) override {
+    if (name == "batch_sizes")
+      return batch_sizes_;
+    if (name == "max_lengths")
+      return max_lengths_;
+    throw JSON::unknown_value_error{};
+  }
+
+ private:
+  Config::Model::Decoder::GraphCapture& v_;
+  IntArray_Element batch_sizes_{v_.batch_sizes};
+  IntArray_Element max_lengths_{v_.max_lengths};
+};
+
+struct Offload_Element : JSON::Element {
+  explicit Offload_Element(Config::Model::Decoder::Offload& v) : v_{v} {}
+
+  void OnString(std::string_view name, std::string_view value) override {
+    if (name == "filename") {
+      v_.filename = value;
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+  void OnNumber(std::string_view name, double value) override {
+    if (name == "first_layer") {
+      v_.first_layer = static_cast<int>(value);
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+  Element& OnObject(std::string_view name) override {
+    if (name == "session_options")
+      return session_options_;
+    throw JSON::unknown_value_error{};
+  }
+
+ private:
+  Config::Model::Decoder::Offload& v_;
+  SessionOptions_Element session_options_{v_.session_options};
+};
+
+struct SparseAttention_Element : JSON::Element {
+  explicit SparseAttention_Element(Config::Model::Decoder::SparseAttention& v) : v_{v} {}
+
+  void OnNumber(std::string_view name, double value) override {
+    if (name == "block_size") {
+      v_.block_size = static_cast<int>(value);
+    } else if (name == "local_blocks") {
+      v_.local_blocks = static_cast<int>(value);
+    } else if (name == "vert_stride") {
+      v_.vert_stride = static_cast<int>(value);
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+  void OnBool(std::string_view name, bool value) override {
+    if (name == "homo_head") {
+      v_.homo_head = value;
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+ private:
+  Config::Model::Decoder::SparseAttention& v_;
+};
+
+struct RotaryEmbedding_Element : JSON::Element {
+  explicit RotaryEmbedding_Element(Config::Model::Decoder::RotaryEmbedding& v) : v_{v} {}
+
+  void OnNumber(std::string_view name, double value) override {
+    if (name == "dim") {
+      v_.dim = static_cast<int>(value);
+    } else if (name == "theta") {
+      v_.theta = static_cast<float>(value);
+    } else if (name == "original_context_length") {
+      v_.original_context_length = static_cast<int>(value);
+    } else if (name == "short_mscale") {
+      v_.short_mscale = static_cast<float>(value);
+    } else if (name == "long_mscale") {
+      v_.long_mscale = static_cast<float>(value);
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+  Element& OnArray(std::string_view name) override {
+    if (name == "short_factor")
+      return short_factor_;
+    if (name == "long_factor")
+      return long_factor_;
+    throw JSON::unknown_value_error{};
+  }
+
+ private:
+  Config::Model::Decoder::RotaryEmbedding& v_;
+  FloatArray_Element short_factor_{v_.short_factor};
+  FloatArray_Element long_factor_{v_.long_factor};
+};
+
 struct Decoder_Element : JSON::Element {
   explicit Decoder_Element(Config::Model::Decoder& v) : v_{v} {}
 
   void OnString(std::string_view name, std::string_view value) override {
     if (name == "filename") {
       v_.filename = value;
+    } else if (name == "gguf_filename") {
+      v_.gguf_filename = value;
     } else
       throw JSON::unknown_value_error{};
   }
@@ -192,6 +445,19 @@ struct Decoder_Element : JSON::Element {
       v_.num_hidden_layers = static_cast<int>(value);
     } else if (name == "head_size") {
       v_.head_size = static_cast<int>(value);
+    } else if (name == "world_size") {
+      v_.world_size = static_cast<int>(value);
+    } else if (name == "memory_budget_mb") {
+      v_.memory_budget_mb = static_cast<int>(value);
+    } else if (name == "memory_pool_mb") {
+      v_.memory_pool_mb = static_cast<int>(value);
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+  void OnBool(std::string_view name, bool value) override {
+    if (name == "generator_streams") {
+      v_.generator_streams = value;
     } else
       throw JSON::unknown_value_error{};
   }
@@ -206,6 +472,21 @@ struct Decoder_Element : JSON::Element {
     if (name == "outputs") {
       return outputs_;
     }
+    if (name == "kv_cache") {
+      return kv_cache_;
+    }
+    if (name == "graph_capture") {
+      return graph_capture_;
+    }
+    if (name == "offload") {
+      return offload_;
+    }
+    if (name == "sparse_attention") {
+      return sparse_attention_;
+    }
+    if (name == "rotary_embedding") {
+      return rotary_embedding_;
+    }
     throw JSON::unknown_value_error{};
   }
 
@@ -214,6 +495,11 @@ struct Decoder_Element : JSON::Element {
   SessionOptions_Element session_options_{v_.session_options};
   Inputs_Element inputs_{v_.inputs};
   Outputs_Element outputs_{v_.outputs};
+  KVCache_Element kv_cache_{v_.kv_cache};
+  GraphCapture_Element graph_capture_{v_.graph_capture};
+  Offload_Element offload_{v_.offload};
+  SparseAttention_Element sparse_attention_{v_.sparse_attention};
+  RotaryEmbedding_Element rotary_embedding_{v_.rotary_embedding};
 };
 
 struct VisionInputs_Element : JSON::Element {
@@ -256,6 +542,22 @@ struct Vision_Element : JSON::Element {
       throw JSON::unknown_value_error{};
   }
 
+  void OnNumber(std::string_view name, double value) override {
+    if (name == "idle_unload_seconds") {
+      v_.idle_unload_seconds = static_cast<int>(value);
+    } else if (name == "feature_cache_size") {
+      v_.feature_cache_size = static_cast<int>(value);
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+  void OnBool(std::string_view name, bool value) override {
+    if (name == "load_on_demand") {
+      v_.load_on_demand = value;
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
   Element& OnObject(std::string_view name) override {
     if (name == "inputs") {
       return inputs_;
@@ -362,6 +664,8 @@ struct Model_Element : JSON::Element {
       v_.vocab_size = static_cast<int>(value);
     } else if (name == "context_length") {
       v_.context_length = static_cast<int>(value);
+    } else if (name == "tokenizer_cache_size") {
+      v_.tokenizer_cache_size = static_cast<int>(value);
     } else if (name == "pad_token_id") {
       v_.pad_token_id = static_cast<int>(value);
     } else if (name == "eos_token_id") {
@@ -419,6 +723,10 @@ struct Search_Element : JSON::Element {
       v_.min_length = static_cast<int>(value);
     } else if (name == "max_length") {
       v_.max_length = static_cast<int>(value);
+    } else if (name == "max_new_tokens") {
+      v_.max_new_tokens = static_cast<int>(value);
+    } else if (name == "timeout_ms") {
+      v_.timeout_ms = static_cast<int>(value);
     } else if (name == "num_beams") {
       v_.num_beams = static_cast<int>(value);
     } else if (name == "num_return_sequences") {
@@ -431,6 +739,10 @@ struct Search_Element : JSON::Element {
       v_.temperature = static_cast<float>(value);
     } else if (name == "repetition_penalty") {
       v_.repetition_penalty = static_cast<float>(value);
+    } else if (name == "frequency_penalty") {
+      v_.frequency_penalty = static_cast<float>(value);
+    } else if (name == "presence_penalty") {
+      v_.presence_penalty = static_cast<float>(value);
     } else if (name == "length_penalty") {
       v_.length_penalty = static_cast<float>(value);
     } else if (name == "no_repeat_ngram_size") {
@@ -441,6 +753,10 @@ struct Search_Element : JSON::Element {
       v_.length_penalty = static_cast<float>(value);
     } else if (name == "random_seed") {
       v_.random_seed = static_cast<int>(value);
+    } else if (name == "prefill_chunk_size") {
+      v_.prefill_chunk_size = static_cast<int>(value);
+    } else if (name == "top_logprobs") {
+      v_.top_logprobs = static_cast<int>(value);
     } else
       throw JSON::unknown_value_error{};
   }
@@ -452,6 +768,10 @@ struct Search_Element : JSON::Element {
       v_.past_present_share_buffer = value;
     } else if (name == "early_stopping") {
       v_.early_stopping = value;
+    } else if (name == "compact_finished_rows") {
+      v_.compact_finished_rows = value;
+    } else if (name == "pipelined_steps") {
+      v_.pipelined_steps = value;
     } else
       throw JSON::unknown_value_error{};
   }
@@ -541,8 +861,41 @@ void ParseConfig(const fs::path& filename, Config& config) {
   }
 }
 
+static int GetEnvironmentRank(const char* mpi_name, const char* name) {
+  for (auto* variable : {mpi_name, name}) {
+    if (auto* value = std::getenv(variable))
+      return std::stoi(value);
+  }
+  return 0;
+}
+
+// Picks this process's shard of a tensor parallel decoder, each rank sees its own share of the heads
+static void SetupTensorParallel(Config::Model::Decoder& decoder) {
+  if (decoder.world_size < 1)
+    throw std::runtime_error("decoder world_size must be 1 or greater, is " + std::to_string(decoder.world_size));
+  if (decoder.world_size == 1)
+    return;
+
+  decoder.rank = GetEnvironmentRank("OMPI_COMM_WORLD_RANK", "RANK");
+  decoder.local_rank = GetEnvironmentRank("OMPI_COMM_WORLD_LOCAL_RANK", "LOCAL_RANK");
+  if (decoder.rank < 0 || decoder.rank >= decoder.world_size)
+    throw std::runtime_error("Rank " + std::to_string(decoder.rank) + " is outside of the decoder world_size " + std::to_string(decoder.world_size));
+
+  auto index = decoder.filename.find("%d");
+  if (index == std::string::npos)
+    throw std::runtime_error("A decoder with a world_size greater than 1 needs a %d in its filename for the rank");
+  decoder.filename.replace(index, 2, std::to_string(decoder.rank));
+
+  for (auto* heads : {&decoder.num_attention_heads, &decoder.num_key_value_heads}) {
+    if (*heads % decoder.world_size != 0)
+      throw std::runtime_error("The decoder heads (" + std::to_string(*heads) + ") don't divide evenly over the world_size " + std::to_string(decoder.world_size));
+    *heads /= decoder.world_size;
+  }
+}
+
 Config::Config(const fs::path& path) : config_path{path} {
   ParseConfig(path / "genai_config.json", *this);
+  SetupTensorParallel(model.decoder);
 
   if (model.context_length == 0)
     throw std::runtime_error("model context_length is 0 or was not set. It must be greater than 0");
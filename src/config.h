@@ -4,6 +4,8 @@
 
 namespace Generators {
 
+struct SharedWeights;
+
 struct Config {
   Config() = default;
   Config(const fs::path& path);
@@ -15,6 +17,7 @@ struct Config {
   };
 
   fs::path config_path;  // Path of the config directory
+  std::shared_ptr<SharedWeights> shared_weights;  // Not in the json, see CreateModel
 
   using ProviderOption = std::pair<std::string, std::string>;
   struct ProviderOptions {
@@ -25,11 +28,17 @@ struct Config {
   struct SessionOptions {
     std::optional<int> intra_op_num_threads;
     std::optional<int> inter_op_num_threads;
+    // Linux: the intra op threads are pinned to the cores of this NUMA node (-1 for the node the model is loaded on), one
+    // per physical core, and intra_op_num_threads defaults to its core count. The sessions are created on the node too,
+    // so the weights are allocated in its memory.
+    std::optional<int> numa_node;
     std::optional<bool> enable_cpu_mem_arena;
     std::optional<bool> enable_mem_pattern;
     std::optional<std::string> log_id;
     std::optional<int> log_severity_level;
-    std::optional<std::string> enable_profiling;
+    std::optional<std::string> enable_profiling;  // Profile prefix, every session writes <prefix>_<model file>_<n>_<date and time>.json
+    bool memory_map{};  // Map the model files and their external data (<filename>.data) instead of reading them in
+    std::string cache_dir;  // If set, the optimized graphs are saved in this folder (relative to the config) and reused by later loads
 
     std::vector<ProviderOptions> provider_options;
   };
@@ -45,10 +54,21 @@ struct Config {
     int decoder_start_token_id{};    // If an encoder-decoder model starts decoding with a different token than bos, the id of that token.
     int vocab_size{};
     int context_length{};
+    int tokenizer_cache_size{32};  // Number of prompt segments whose tokens Tokenizer::EncodeSegments keeps, 0 disables it
 
-    // For models like whisper
+    // For models like whisper, and the encoder-decoder models (t5, bart): the encoder with the decoder's first run
     struct EncoderDecoderInit {
       std::string filename;
+
+      struct Inputs {
+        std::string input_ids{"encoder_input_ids"};
+        std::string attention_mask{"encoder_attention_mask"};  // Optional, 1 for the encoder input ids that aren't pad_token_id
+        std::string decoder_input_ids{"decoder_input_ids"};
+      } inputs;
+
+      struct Outputs {
+        std::string hidden_states{"encoder_hidden_states"};  // Optional, passed on to the decoder if it takes them
+      } outputs;
     } encoder_decoder_init;
 
     struct Embedding {
@@ -65,6 +85,9 @@ struct Config {
 
     struct Vision {
       std::string filename;
+      bool load_on_demand{};        // Create the vision session for the first prompt with an image instead of at load
+      int idle_unload_seconds{-1};  // If >= 0, release the vision session once it's been unused this long, it's created again when needed
+      int feature_cache_size{};     // Number of images whose visual features are kept on the device, so a repeated image skips the vision session. 0 disables it
 
       struct Inputs {
         std::string pixel_values{Defaults::PixelValuesName};
@@ -78,6 +101,7 @@ struct Config {
 
     struct Decoder {
       std::string filename;
+      std::string gguf_filename;  // Optional, a GGUF file the decoder's initializers point into (the builder's gguf_skeleton option), memory mapped and read in place
       SessionOptions session_options;
 
       int hidden_size{};          // Not currently used, potentially useful for embeddings in the future
@@ -86,6 +110,11 @@ struct Config {
       int num_hidden_layers{};
       int head_size{};
 
+      // Tensor parallel: the decoder is sharded into world_size graphs with all-reduces inside, each run by its own
+      // process (launched with mpirun). filename has a %d for the rank, the heads above are for the whole model.
+      int world_size{1};
+      int rank{}, local_rank{};  // Not in the json, set from the launcher's environment when world_size > 1
+
       struct Inputs {
         std::string input_ids{Defaults::InputIdsName};
         std::string embeddings{"inputs_embeds"};
@@ -93,18 +122,91 @@ struct Config {
         std::string attention_mask{"attention_mask"};
         std::string seqlens_k{"seqlens_k"};
         std::string total_sequence_length{"total_seq_len"};
+        std::string last_token_indices{"last_token_indices"};  // Optional, {batch_size, 1} position whose logits the model computes
+        std::string adapter_ids{"adapter_ids"};                // Optional, {batch_size} index of the adapter of every row, see Adapters
         std::string past_key_names{"past_key_values.%d.key"}, past_value_names{"past_key_values.%d.value"};
         std::string past_names;  // When key/value pairs are combined
+        std::string past_sequence_length{"past_sequence_length"};  // Optional, combined kv with a shared buffer: int32 {1} valid tokens of the pasts
         std::string cross_past_key_names, cross_past_value_names;
+        std::string encoder_attention_mask{"encoder_attention_mask"};  // Optional, encoder-decoder models: the encoder's attention mask
+        std::string encoder_hidden_states{"encoder_hidden_states"};    // Optional, encoder-decoder models: the encoder's output
+        std::string past_key_scale_names{"past_key_values.%d.key_scale"}, past_value_scale_names{"past_key_values.%d.value_scale"};  // Optional, quantized kv scales
+        std::string block_row_indices{"block_row_indices"};  // Optional, sparse_attention: int32 {num_layouts, blocks + 1} CSR row offsets of the block mask
+        std::string block_col_indices{"block_col_indices"};  // Optional, sparse_attention: int32 {num_layouts, max blocks of a layout} CSR columns, padded with -1
+        std::string cos_cache{"cos_cache"}, sin_cache{"sin_cache"};  // Optional, rotary_embedding: {max_sequence_length, dim / 2}
       } inputs;
 
       struct Outputs {
         std::string logits{"logits"};
+        std::string hidden_states{"hidden_states"};  // Optional, the final norm's output, for EmbedSequences
+        std::string next_tokens{"next_tokens"};      // Optional, int32 argmax of the logits, fetched instead of them on plain greedy steps
         std::string present_key_names{"present.%d.key"}, present_value_names{"present.%d.value"};
         std::string present_names;  // When key/value pairs are combined
         std::string cross_present_key_names, cross_present_value_names;
+        std::string present_key_scale_names{"present.%d.key_scale"}, present_value_scale_names{"present.%d.value_scale"};  // Optional, quantized kv scales
       } outputs;
 
+      struct KVCache {
+        int block_size{};           // If > 0, shared past/present kv buffers grow in blocks of this many tokens taken from a model wide pool instead of being allocated to max_length
+        int max_blocks{};           // Total number of blocks in the model wide pool, 0 means unbounded
+        int prefix_cache_size{};    // Number of prompts whose kv is kept so later generators can skip the shared prefix, 0 disables it
+        int prefix_chunk_size{32};  // Cached prefixes are matched in multiples of this many tokens
+        int prefix_cache_mb{};      // Least recently used prefixes are also evicted once their kv takes more than this many MB, 0 means unbounded
+        int window_size{};          // If > 0, streaming: after the first sink_size tokens only the latest window_size are kept in the kv, so generation can go past context_length. Needs rotary_embedding to re-rotate the kept keys
+        int sink_size{4};           // Streaming: number of initial (attention sink) tokens that are never evicted
+        bool preallocate{};         // When past/present aren't shared, they're views over two per layer buffers that grow by doubling, so decode steps don't allocate
+      } kv_cache;
+
+      struct GraphCapture {
+        std::vector<int> batch_sizes;  // Graphs captured for these max_batch_sizes when the model is loaded, see Model::CaptureGraphs
+        std::vector<int> max_lengths;  // And these max_lengths, search.max_length if empty
+        int max_graphs{};              // Most idle captured graphs kept in the pool, the least recently used are retired first. 0 means unbounded
+        bool bucketed{};               // Round max_batch_size and max_length up to powers of two, so graphs are shared by similar requests
+      } graph_capture;
+
+      // CPU/GPU hybrid for decoders bigger than the device memory: filename holds only the first first_layer layers, the
+      // rest of them and the lm head are in offload.filename, run with offload.session_options (on the CPU when it
+      // has no providers). See OffloadedDecoder_Model.
+      struct Offload {
+        std::string filename;
+        int first_layer{};
+        SessionOptions session_options;
+      } offload;
+
+      // SparseAttention layers (block sparse, like Phi-3 small): the runtime makes their block mask for the generator's
+      // max_length and feeds it as the block_row_indices/block_col_indices inputs, so a model exported for a long
+      // context doesn't carry a mask for all of it. A query block sees the local_blocks blocks up to it and every
+      // vert_stride'th block before, shifted per head unless homo_head. Needs search.past_present_share_buffer.
+      struct SparseAttention {
+        int block_size{};  // 0 when the decoder has no sparse attention
+        int local_blocks{};
+        int vert_stride{};
+        bool homo_head{};
+      } sparse_attention;
+
+      // Rotary embeddings scaled for a long context (long-rope/yarn, like Phi-3 128k): the runtime makes the cos/sin
+      // caches and feeds them as inputs, with the short factors while the sequence fits in original_context_length and
+      // the long ones after. inv_freq[i] = 1 / (factor[i] * theta^(2i / dim)), the caches are scaled by the mscale.
+      struct RotaryEmbedding {
+        int dim{};  // The rotary part of a head, 0 when the caches are in the model
+        float theta{10000.0f};
+        int original_context_length{};
+        std::vector<float> short_factor, long_factor;  // dim / 2 each
+        float short_mscale{1.0f}, long_mscale{1.0f};
+      } rotary_embedding;
+
+      // CUDA: every generator does its search, sampling and logits processing on its own stream from a pool, so
+      // concurrent generators overlap that work with each other and with the session runs on the model's stream
+      bool generator_streams{};
+
+      // If > 0, generators are only created while the memory estimated for them and the live ones fits in this many
+      // MB, see MemoryBudget
+      int memory_budget_mb{};
+
+      // CUDA: if > 0, the device memory the generators free is kept, up to this many MB of it unused, for the next
+      // generators asking for the same sizes rather than given back to the device allocator. See DevicePool
+      int memory_pool_mb{};
+
     } decoder;
   } model;
 
@@ -112,18 +214,26 @@ struct Config {
     bool do_sample{};  // True to do randomized sampling through top_k and top_p, if false, the top logit score is chosen
     int min_length{};
     int max_length{};  // If omitted or 0 in json file, will be set to model.context_length on load
+    int max_new_tokens{};  // If > 0, a row is done after generating this many tokens (greedy search and sampling only)
+    int timeout_ms{};      // If > 0, the generator is cancelled this long after its creation, see Cancellation (not per row)
     int num_beams{1};  // 1 means no beam search.
-    int num_return_sequences{1};
+    int num_return_sequences{1};  // Beam search: the beams returned per prompt. Sampling: the samples per prompt, each a batch row
     float repetition_penalty{1.0f};  // 1.0 means no penalty.
+    float frequency_penalty{};       // Subtracted from a token's logit once per earlier occurrence, 0 means no penalty
+    float presence_penalty{};        // Subtracted from the logit of every token that occurred before, 0 means no penalty
     int top_k{};                     // Number of highest probability vocabulary tokens to keep for top-k-filtering that will be used by default in the generate method of the model.
     float top_p{};                   // If set to float >0 and <1, only the most probable tokens with probabilities that add up to top_p or higher are kept for generation.
     float temperature{1.0f};
     bool early_stopping{true};  //  Whether to stop the beam search when at least num_beams sentences are finished per batch or not.
-    int no_repeat_ngram_size{};
-    float diversity_penalty{};
+    int no_repeat_ngram_size{};  // If > 0, no ngram of this size is generated twice
+    float diversity_penalty{};   // If != 0, beam search only, lowers the scores of the tokens the earlier beams of a prompt picked this step (at most 32 beams)
+    int top_logprobs{};  // If > 0, the log probabilities of every generated token and of this many of the most likely ones are kept (greedy search and sampling only)
     float length_penalty{1.0f};        // Exponential penalty to the length that is used with beam-based generation. length_penalty > 0.0 promotes longer sequences, while length_penalty < 0.0 encourages shorter sequences.
-    bool past_present_share_buffer{};  // The past/present kv tensors are shared and allocated once to max_length (cuda only)
+    bool past_present_share_buffer{};  // The past/present kv tensors are shared and allocated once to max_length, beams are reordered in place (not with DML beam search)
     int random_seed{-1};               // -1 = Seed with random device, otherwise use value to seed RNG
+    int prefill_chunk_size{};          // If > 0, prompts longer than this are run through the decoder in chunks of this many tokens
+    bool compact_finished_rows{};      // Stop running the rows that are done through the decoder (decoder only models, num_beams 1)
+    bool pipelined_steps{};            // CUDA: don't wait for the device between steps, see Search_Cuda::IsDone
   } search;
 
   void AddMapping(const std::string& nominal_name, const std::string& graph_name);
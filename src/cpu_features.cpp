@@ -0,0 +1,66 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include "cpu_features.h"
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define GENAI_CPUID 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define GENAI_CPUID 1
+#endif
+
+namespace Generators {
+
+#if GENAI_CPUID
+static void Cpuid(unsigned leaf, unsigned subleaf, unsigned info[4]) {
+#if defined(_MSC_VER)
+  __cpuidex(reinterpret_cast<int*>(info), static_cast<int>(leaf), static_cast<int>(subleaf));
+#else
+  __cpuid_count(leaf, subleaf, info[0], info[1], info[2], info[3]);
+#endif
+}
+
+// The register state the OS saves on a context switch, which the wider registers have to be part of
+static unsigned long long Xgetbv() {
+#if defined(_MSC_VER)
+  return _xgetbv(0);
+#else
+  unsigned eax, edx;
+  __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+  return (static_cast<unsigned long long>(edx) << 32) | eax;
+#endif
+}
+#endif
+
+static CpuFeatures DetectCpuFeatures() {
+  CpuFeatures features;
+#if GENAI_CPUID
+  unsigned info[4];
+  Cpuid(0, 0, info);
+  const unsigned max_leaf = info[0];
+  Cpuid(1, 0, info);
+  const bool fma = (info[2] & (1u << 12)) != 0;
+  const bool f16c = (info[2] & (1u << 29)) != 0;
+  const bool osxsave = (info[2] & (1u << 27)) != 0 && (info[2] & (1u << 28)) != 0;  // And AVX
+  const unsigned long long state = osxsave ? Xgetbv() : 0;
+  const bool os_saves_avx = (state & 0x06) == 0x06;
+  const bool os_saves_avx512 = (state & 0xe6) == 0xe6;  // The opmask and upper zmm registers too
+  bool avx2 = false, avx512f = false;
+  if (max_leaf >= 7) {
+    Cpuid(7, 0, info);
+    avx2 = (info[1] & (1u << 5)) != 0;
+    avx512f = (info[1] & (1u << 16)) != 0;
+  }
+  features.avx2_fma = os_saves_avx && avx2 && fma;
+  features.f16c = os_saves_avx && f16c;
+  features.avx512f = os_saves_avx512 && avx512f;
+#endif
+  return features;
+}
+
+const CpuFeatures& GetCpuFeatures() {
+  static const CpuFeatures features = DetectCpuFeatures();
+  return features;
+}
+
+}  // namespace Generators
@@ -0,0 +1,17 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+namespace Generators {
+
+// The x86 instruction sets the CPU code picks its kernels by at runtime, so a build for any x86-64 CPU still uses the
+// widest one it runs on. All false on other architectures, whose kernels are picked at compile time.
+struct CpuFeatures {
+  bool avx2_fma{};  // AVX2 and FMA, which every AVX2 CPU also has
+  bool f16c{};
+  bool avx512f{};
+};
+
+const CpuFeatures& GetCpuFeatures();
+
+}  // namespace Generators
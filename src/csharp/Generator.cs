@@ -30,6 +30,8 @@ namespace Microsoft.ML.OnnxRuntimeGenAI
             Result.VerifySuccess(NativeMethods.OgaGenerator_GenerateNextToken(_generatorHandle));
         }
 
+        // The tokens of the sequence, owned by the generator. Every index has its own copy, which the next GetSequence or
+        // GetSequenceTail of the same index and new tokens may overwrite.
         public ReadOnlySpan<int> GetSequence(ulong index)
         {
             ulong sequenceLength = NativeMethods.OgaGenerator_GetSequenceCount(_generatorHandle, (UIntPtr)index).ToUInt64();
@@ -40,6 +42,33 @@ namespace Microsoft.ML.OnnxRuntimeGenAI
             }
         }
 
+        // The tokens of the sequence from offset on, for streaming: pass the number of tokens already read and only the
+        // new ones are copied off the device. Shares the copy of GetSequence for the same index.
+        public ReadOnlySpan<int> GetSequenceTail(ulong index, ulong offset)
+        {
+            Result.VerifySuccess(NativeMethods.OgaGenerator_GetSequenceTail(_generatorHandle, (UIntPtr)index, (UIntPtr)offset,
+                                                                            out IntPtr tokensPtr, out UIntPtr count));
+            unsafe
+            {
+                return new ReadOnlySpan<int>(tokensPtr.ToPointer(), (int)count.ToUInt64());
+            }
+        }
+
+        // The log probability of the last generated token of every sequence, and the top_logprobs most likely tokens of
+        // every sequence with theirs. Valid until the next GenerateNextToken.
+        public ReadOnlySpan<float> GetLogProbs(out ReadOnlySpan<int> topTokens, out ReadOnlySpan<float> topLogProbs)
+        {
+            Result.VerifySuccess(NativeMethods.OgaGenerator_GetLogProbs(_generatorHandle, out IntPtr logprobsPtr, out UIntPtr count,
+                                                                        out IntPtr topTokensPtr, out IntPtr topLogProbsPtr, out UIntPtr topCount));
+            int topLength = (int)(count.ToUInt64() * topCount.ToUInt64());
+            unsafe
+            {
+                topTokens = new ReadOnlySpan<int>(topTokensPtr.ToPointer(), topLength);
+                topLogProbs = new ReadOnlySpan<float>(topLogProbsPtr.ToPointer(), topLength);
+                return new ReadOnlySpan<float>(logprobsPtr.ToPointer(), (int)count.ToUInt64());
+            }
+        }
+
         ~Generator()
         {
             Dispose(false);
@@ -112,6 +112,25 @@ namespace Microsoft.ML.OnnxRuntimeGenAI
         public static extern IntPtr /* const in32_t* */ OgaGenerator_GetSequenceData(IntPtr /* const OgaGenerator* */ generator,
                                                                                      UIntPtr /* size_t */ index);
 
+        // This function returns the tokens of the sequence at the given index from offset on, copying only those off
+        // the device. They are owned by the OgaGenerator and valid until the next call.
+        [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
+        public static extern IntPtr /* OgaResult* */ OgaGenerator_GetSequenceTail(IntPtr /* const OgaGenerator* */ generator,
+                                                                                 UIntPtr /* size_t */ index,
+                                                                                 UIntPtr /* size_t */ offset,
+                                                                                 out IntPtr /* const int32_t** */ tokens,
+                                                                                 out UIntPtr /* size_t* */ count);
+
+        // The log probabilities of the last generated tokens and of the top_logprobs most likely ones, owned by the
+        // OgaGenerator object and valid until its next OgaGenerator_GenerateNextToken.
+        [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
+        public static extern IntPtr /* OgaResult* */ OgaGenerator_GetLogProbs(IntPtr /* const OgaGenerator* */ generator,
+                                                                              out IntPtr /* const float* */ logprobs,
+                                                                              out UIntPtr /* size_t */ count,
+                                                                              out IntPtr /* const int32_t* */ topTokens,
+                                                                              out IntPtr /* const float* */ topLogProbs,
+                                                                              out UIntPtr /* size_t */ topCount);
+
         [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
         public static extern IntPtr /* OgaResult* */ OgaCreateSequences(out IntPtr /* OgaSequences** */ sequences);
 
@@ -155,6 +174,16 @@ namespace Microsoft.ML.OnnxRuntimeGenAI
                                                                         byte[] /* const char* */ strings,
                                                                         IntPtr /* OgaSequences* */ sequences);
 
+        // This function encodes a batch of strings into the caller's buffer, padded to the longest row. sequenceLength
+        // is also set when the buffer is too small.
+        [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
+        public static extern unsafe IntPtr /* OgaResult* */ OgaTokenizerEncodeBatchInto(IntPtr /* const OgaTokenizer* */ tokenizer,
+                                                                                        byte** /* const char* const* */ strings,
+                                                                                        UIntPtr /* size_t */ count,
+                                                                                        int* /* int32_t* */ tokens,
+                                                                                        UIntPtr /* size_t */ tokensCapacity,
+                                                                                        int* /* int32_t* */ lengths,
+                                                                                        out UIntPtr /* size_t* */ sequenceLength);
 
         // This function is used to decode the given token into a string. The caller is responsible for freeing the
         // returned string using the OgaDestroyString function when it is no longer needed.
@@ -185,6 +214,27 @@ namespace Microsoft.ML.OnnxRuntimeGenAI
                                                                               int /* int32_t */ token,
                                                                               out IntPtr /* const char** */ outStr);
 
+        [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
+        public static extern IntPtr /* OgaResult* */ OgaCreateTokenizerBatchStream(IntPtr /* const OgaTokenizer* */ tokenizer,
+                                                                                   UIntPtr /* size_t */ batchSize,
+                                                                                   out IntPtr /* OgaTokenizerBatchStream** */ tokenizerBatchStream);
+
+        [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
+        public static extern void OgaDestroyTokenizerBatchStream(IntPtr /* OgaTokenizerBatchStream* */ tokenizerBatchStream);
+
+        // This function decodes the next token of every row. text and offsets are owned by the OgaTokenizerBatchStream
+        // and are valid until its next decode.
+        [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
+        public static extern unsafe IntPtr /* OgaResult* */ OgaTokenizerBatchStreamDecode(IntPtr /* OgaTokenizerBatchStream* */ tokenizerBatchStream,
+                                                                                          int* /* const int32_t* */ tokens,
+                                                                                          UIntPtr /* size_t */ tokenCount,
+                                                                                          out IntPtr /* const char** */ text,
+                                                                                          out IntPtr /* const size_t** */ offsets);
+
+        [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
+        public static extern IntPtr /* OgaResult* */ OgaTokenizerBatchStreamResetRow(IntPtr /* OgaTokenizerBatchStream* */ tokenizerBatchStream,
+                                                                                     UIntPtr /* size_t */ row);
+
         [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
         public static extern IntPtr /* OgaResult* */ OgaCreateTensorFromBuffer(IntPtr /* data* */ data,
                                                                                long[] shape_dims,
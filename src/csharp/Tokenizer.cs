@@ -2,6 +2,7 @@
 // Licensed under the MIT License.
 
 using System;
+using System.Buffers;
 using System.Runtime.InteropServices;
 using System.Text;
 
@@ -62,6 +63,65 @@ namespace Microsoft.ML.OnnxRuntimeGenAI
             }
         }
 
+        /// <summary>
+        /// Encodes a string into the caller's buffer and returns the number of tokens written.
+        /// Throws if the buffer is too small.
+        /// </summary>
+        public int EncodeInto(string str, Span<int> tokens)
+        {
+            return EncodeBatchInto(new string[] { str }, tokens, Span<int>.Empty);
+        }
+
+        /// <summary>
+        /// Encodes a batch of strings into the caller's buffer as strings.Length rows of the returned sequence length,
+        /// the shorter rows padded with the pad token. lengths, if not empty, receives the length of every row before
+        /// the padding. Throws if tokens is smaller than strings.Length * the sequence length.
+        /// </summary>
+        public int EncodeBatchInto(string[] strings, Span<int> tokens, Span<int> lengths)
+        {
+            if (!lengths.IsEmpty && lengths.Length < strings.Length)
+            {
+                throw new ArgumentException("lengths must hold one entry per string", nameof(lengths));
+            }
+
+            // All strings go null terminated into one pooled buffer instead of an array each
+            int byteCount = 0;
+            foreach (string str in strings)
+            {
+                byteCount += (str == null ? 0 : Encoding.UTF8.GetByteCount(str)) + 1;
+            }
+
+            byte[] utf8 = ArrayPool<byte>.Shared.Rent(byteCount);
+            try
+            {
+                unsafe
+                {
+                    byte** stringPtrs = stackalloc byte*[strings.Length];
+                    fixed (byte* utf8Ptr = utf8)
+                    fixed (int* tokensPtr = tokens)
+                    fixed (int* lengthsPtr = lengths)
+                    {
+                        int offset = 0;
+                        for (int i = 0; i < strings.Length; i++)
+                        {
+                            stringPtrs[i] = utf8Ptr + offset;
+                            offset += Encoding.UTF8.GetBytes(strings[i] ?? string.Empty, new Span<byte>(utf8, offset, byteCount - offset));
+                            utf8[offset++] = 0;
+                        }
+
+                        Result.VerifySuccess(NativeMethods.OgaTokenizerEncodeBatchInto(_tokenizerHandle, stringPtrs, (UIntPtr)strings.Length,
+                                                                                      tokensPtr, (UIntPtr)tokens.Length, lengths.IsEmpty ? null : lengthsPtr,
+                                                                                      out UIntPtr sequenceLength));
+                        return (int)sequenceLength.ToUInt64();
+                    }
+                }
+            }
+            finally
+            {
+                ArrayPool<byte>.Shared.Return(utf8);
+            }
+        }
+
         public string Decode(ReadOnlySpan<int> sequence)
         {
             IntPtr outStr = IntPtr.Zero;
@@ -89,6 +149,13 @@ namespace Microsoft.ML.OnnxRuntimeGenAI
             return new TokenizerStream(tokenizerStreamHandle);
         }
 
+        public TokenizerBatchStream CreateBatchStream(int batchSize)
+        {
+            IntPtr tokenizerBatchStreamHandle = IntPtr.Zero;
+            Result.VerifySuccess(NativeMethods.OgaCreateTokenizerBatchStream(_tokenizerHandle, (UIntPtr)batchSize, out tokenizerBatchStreamHandle));
+            return new TokenizerBatchStream(tokenizerBatchStreamHandle, batchSize);
+        }
+
 
         ~Tokenizer()
         {
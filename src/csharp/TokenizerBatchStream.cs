@@ -0,0 +1,115 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+using System;
+using System.Runtime.InteropServices;
+using System.Text;
+
+namespace Microsoft.ML.OnnxRuntimeGenAI
+{
+    /// <summary>
+    /// Decodes the next token of every row of a batch in one call. The decoded text stays in native memory and is
+    /// only valid until the next call to Decode.
+    /// </summary>
+    public class TokenizerBatchStream : IDisposable
+    {
+        private IntPtr _tokenizerBatchStreamHandle;
+        private readonly int _batchSize;
+        private IntPtr _text = IntPtr.Zero;
+        private IntPtr _offsets = IntPtr.Zero;
+        private bool _disposed = false;
+
+        internal TokenizerBatchStream(IntPtr tokenizerBatchStreamHandle, int batchSize)
+        {
+            _tokenizerBatchStreamHandle = tokenizerBatchStreamHandle;
+            _batchSize = batchSize;
+        }
+
+        internal IntPtr Handle { get { return _tokenizerBatchStreamHandle; } }
+
+        public int BatchSize { get { return _batchSize; } }
+
+        /// <summary>
+        /// Decodes one token per row, a negative token leaves its row without text. Returns the UTF-8 text of all
+        /// rows one after another, GetRowUtf8 and GetRowText split it by row.
+        /// </summary>
+        public ReadOnlySpan<byte> Decode(ReadOnlySpan<int> tokens)
+        {
+            unsafe
+            {
+                fixed (int* tokensPtr = tokens)
+                {
+                    Result.VerifySuccess(NativeMethods.OgaTokenizerBatchStreamDecode(_tokenizerBatchStreamHandle, tokensPtr, (UIntPtr)tokens.Length,
+                                                                                     out _text, out _offsets));
+                }
+                return new ReadOnlySpan<byte>(_text.ToPointer(), RowOffset(_batchSize));
+            }
+        }
+
+        /// <summary>
+        /// The UTF-8 text the last Decode produced for a row, without copying it.
+        /// </summary>
+        public ReadOnlySpan<byte> GetRowUtf8(int row)
+        {
+            if (_text == IntPtr.Zero)
+            {
+                throw new InvalidOperationException("Decode has not been called");
+            }
+            if (row < 0 || row >= _batchSize)
+            {
+                throw new ArgumentOutOfRangeException(nameof(row));
+            }
+            int start = RowOffset(row);
+            unsafe
+            {
+                return new ReadOnlySpan<byte>((byte*)_text.ToPointer() + start, RowOffset(row + 1) - start);
+            }
+        }
+
+        public string GetRowText(int row)
+        {
+            ReadOnlySpan<byte> utf8 = GetRowUtf8(row);
+            return utf8.IsEmpty ? string.Empty : Encoding.UTF8.GetString(utf8);
+        }
+
+        /// <summary>
+        /// Starts a row over, for a new sequence taking the row of a finished one.
+        /// </summary>
+        public void ResetRow(int row)
+        {
+            Result.VerifySuccess(NativeMethods.OgaTokenizerBatchStreamResetRow(_tokenizerBatchStreamHandle, (UIntPtr)row));
+        }
+
+        private int RowOffset(int row)
+        {
+            unsafe
+            {
+                return (int)((UIntPtr*)_offsets.ToPointer())[row].ToUInt64();
+            }
+        }
+
+        ~TokenizerBatchStream()
+        {
+            Dispose(false);
+        }
+
+        public void Dispose()
+        {
+            Dispose(true);
+            GC.SuppressFinalize(this);
+        }
+
+        protected virtual void Dispose(bool disposing)
+        {
+            if (_disposed)
+            {
+                return;
+            }
+            NativeMethods.OgaDestroyTokenizerBatchStream(_tokenizerBatchStreamHandle);
+            _tokenizerBatchStreamHandle = IntPtr.Zero;
+            _text = IntPtr.Zero;
+            _offsets = IntPtr.Zero;
+            _disposed = true;
+        }
+    }
+}
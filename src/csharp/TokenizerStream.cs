@@ -25,6 +25,17 @@ namespace Microsoft.ML.OnnxRuntimeGenAI
             return StringUtils.FromUtf8(decodedStr);
         }
 
+        /// <summary>
+        /// Decodes the next token to its UTF-8 bytes without allocating. The span points into the stream and is
+        /// only valid until the next call to Decode or DecodeUtf8.
+        /// </summary>
+        public ReadOnlySpan<byte> DecodeUtf8(int token)
+        {
+            IntPtr decodedStr = IntPtr.Zero;
+            Result.VerifySuccess(NativeMethods.OgaTokenizerStreamDecode(_tokenizerStreamHandle, token, out decodedStr));
+            return StringUtils.Utf8Span(decodedStr);
+        }
+
         ~TokenizerStream()
         {
             Dispose(false);
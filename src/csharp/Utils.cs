@@ -71,5 +71,16 @@ namespace Microsoft.ML.OnnxRuntimeGenAI
                 return Encoding.UTF8.GetString(nativeBytes, len);
             }
         }
+
+        // The bytes of a null terminated native string, without copying them
+        internal static ReadOnlySpan<byte> Utf8Span(IntPtr nativeUtf8)
+        {
+            unsafe
+            {
+                int len = 0;
+                while (*(byte*)(nativeUtf8 + len) != 0) ++len;
+                return new ReadOnlySpan<byte>(nativeUtf8.ToPointer(), len);
+            }
+        }
     }
 }
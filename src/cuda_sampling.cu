@@ -9,6 +9,8 @@
 #include "beam_search_topk.h"
 #include "cuda_sampling.cuh"
 #include "smartptrs.h"
+#include "cuda_common.h"
+#include <cuda_fp16.h>
 #include <cuda_runtime.h>
 #include <cub/cub.cuh>
 #include <iostream>
@@ -19,15 +21,7 @@ namespace cuda {
 constexpr int kMaxThreads = 1024;
 constexpr int kGPUWarpSize = 32;
 
-__global__ void InitCurandStates(unsigned long long seed, curandState* states, int batch_size) {
-  int index = threadIdx.x + blockIdx.x * blockDim.x;
-  if (index >= batch_size)
-    return;
-
-  curand_init(seed, index, 0, &states[index]);
-}
-
-SamplingData::SamplingData(unsigned long long random_seed, int batch_size, int vocab_size, cudaStream_t stream) {
+SamplingData::SamplingData(std::span<const RandomRow> rows, int batch_size, int vocab_size, cudaStream_t stream) {
   indices_sorted = CudaMallocArray<int>(vocab_size * batch_size);
   scores_sorted = CudaMallocArray<float>(vocab_size * batch_size);
   scores_softmaxed = CudaMallocArray<float>(vocab_size * batch_size);
@@ -35,13 +29,30 @@ SamplingData::SamplingData(unsigned long long random_seed, int batch_size, int v
   thresholds = CudaMallocArray<float>(batch_size);
   indices_in = CudaMallocArray<int>(vocab_size * batch_size);
   offsets = CudaMallocArray<int>(batch_size + 1);
-  curand_states = CudaMallocArray<curandState>(batch_size);
+  random_rows = CudaMallocArray<RandomRow>(batch_size);
+  candidate_ends = CudaMallocArray<int>(batch_size);
   temp_storage_bytes = 0;
   cub::DeviceSegmentedRadixSort::SortPairsDescending(nullptr, temp_storage_bytes, (float*)nullptr, (float*)nullptr,
     (int*)nullptr, (int*)nullptr, vocab_size*batch_size, batch_size, (int*)nullptr, (int*)nullptr, 0, sizeof(float) * 8, stream);
   temp_buffer = CudaMallocArray<float>(temp_storage_bytes / sizeof(float));
 
-  InitCurandStates<<<int(batch_size / 128) + 1, 128, 0, stream>>>(random_seed, curand_states.get(), batch_size);
+  CudaCheck() == cudaMemcpyAsync(random_rows.get(), rows.data(), rows.size_bytes(), cudaMemcpyHostToDevice, stream);
+  CudaCheck() == cudaStreamSynchronize(stream);  // Before the rows are freed
+}
+
+void SamplingData::SetRowOptions(std::span<const int> k, std::span<const float> p, std::span<const float> temperature, int vocab_size, cudaStream_t stream) {
+  const int batch_size = static_cast<int>(k.size());
+  row_k = CudaMallocArray<int>(batch_size);
+  row_p = CudaMallocArray<float>(batch_size);
+  row_temperature = CudaMallocArray<float>(batch_size);
+  cudaMemcpyAsync(row_k.get(), k.data(), k.size_bytes(), cudaMemcpyHostToDevice, stream);
+  cudaMemcpyAsync(row_p.get(), p.data(), p.size_bytes(), cudaMemcpyHostToDevice, stream);
+  cudaMemcpyAsync(row_temperature.get(), temperature.data(), temperature.size_bytes(), cudaMemcpyHostToDevice, stream);
+
+  row_max_k = 0;
+  for (int row : k)
+    row_max_k = (row <= 0 || row >= vocab_size) ? vocab_size : std::max(row_max_k, row);
+  cudaStreamSynchronize(stream);  // Before the options are freed
 }
 
 // Softmax Kernels and Launchers
@@ -297,19 +308,20 @@ __global__ void SoftmaxBlockForward(outscalar_t* output, scalar_t* input, int cl
   }
 }
 
-template <bool is_log_softmax>
-void DispatchBlockwiseSoftmaxForward(cudaStream_t* stream, float* output, const float* input, int softmax_elements,
+// The input can be fp16 logits as the model wrote them, the softmax accumulates and outputs fp32
+template <bool is_log_softmax, typename T>
+void DispatchBlockwiseSoftmaxForward(cudaStream_t* stream, float* output, const T* input, int softmax_elements,
                                           int input_stride, int output_stride, int batch_count, float temperature=1.0) {
   dim3 grid(batch_count);
   constexpr int ILP = sizeof(float4) / sizeof(float);
   dim3 block = SoftmaxGetBlockSize(ILP, softmax_elements);
   if (is_log_softmax) {
-    SoftmaxBlockForward<ILP, float, float, float, LogSoftmaxForwardEpilogue>
-        <<<grid, block, block.x * sizeof(float), *stream>>>(output, const_cast<float*>(input),
+    SoftmaxBlockForward<ILP, T, float, float, LogSoftmaxForwardEpilogue>
+        <<<grid, block, block.x * sizeof(float), *stream>>>(output, const_cast<T*>(input),
                                                            softmax_elements, input_stride, output_stride, temperature);
   } else {
-    SoftmaxBlockForward<ILP, float, float, float, SoftmaxForwardEpilogue>
-        <<<grid, block, block.x * sizeof(float), *stream>>>(output, const_cast<float*>(input),
+    SoftmaxBlockForward<ILP, T, float, float, SoftmaxForwardEpilogue>
+        <<<grid, block, block.x * sizeof(float), *stream>>>(output, const_cast<T*>(input),
                                                            softmax_elements, input_stride, output_stride, temperature);
   }
 }
@@ -441,34 +453,44 @@ void LaunchGetTopKSubset(cudaStream_t stream, float* scores_in, float* scores_ou
 }
 
 // Sets up random thresholds for top p or top k sampling
-__global__ void RandomThresholdKernelTopPAndK(curandState* curand_states, float* thresholds, float* prefix_sums, int batch_size, float p, int k) {
+__global__ void RandomThresholdKernelTopPAndK(const RandomRow* random_rows, float* thresholds, float* prefix_sums, int batch_size, float p, int k, uint64_t step) {
   int index = threadIdx.x + blockIdx.x * blockDim.x;
 
   float k_prob = prefix_sums[k-1];
   if (index < batch_size) {
     float min_p = fminf(p, k_prob);
-    thresholds[index] = min_p * curand_uniform(&curand_states[index]);
+    thresholds[index] = min_p * PhiloxUniform(random_rows[index], step);
   }
 }
 
 // Sets up random thresholds for top p or top k sampling
-__global__ void RandomThresholdKernelTopP(curandState* curand_states, float* thresholds, float* prefix_sums, int batch_size, float p) {
+__global__ void RandomThresholdKernelTopP(const RandomRow* random_rows, float* thresholds, float* prefix_sums, int batch_size, float p, uint64_t step) {
   int index = threadIdx.x + blockIdx.x * blockDim.x;
 
   if (index < batch_size) {
-    thresholds[index] = p * curand_uniform(&curand_states[index]);
+    thresholds[index] = p * PhiloxUniform(random_rows[index], step);
   }
 }
 
 // Sets up random thresholds for top p or top k sampling
-__global__ void RandomThresholdKernelTopK(curandState* curand_states, float* thresholds, float* prefix_sums, int batch_size, int k) {
+__global__ void RandomThresholdKernelTopK(const RandomRow* random_rows, float* thresholds, float* prefix_sums, int batch_size, int k, uint64_t step) {
   int index = threadIdx.x + blockIdx.x * blockDim.x;
 
   if (index < batch_size) {
-    thresholds[index] = prefix_sums[k - 1] * curand_uniform(&curand_states[index]);
+    thresholds[index] = prefix_sums[k - 1] * PhiloxUniform(random_rows[index], step);
   }
 }
 
+// Sets up random thresholds with every row's own top p and top k
+__global__ void RandomThresholdKernelRows(const RandomRow* random_rows, float* thresholds, float* prefix_sums, int batch_size, int sample_range, const int* row_k, const float* row_p, uint64_t step) {
+  int index = threadIdx.x + blockIdx.x * blockDim.x;
+
+  if (index < batch_size) {
+    int k = row_k[index] > 0 && row_k[index] < sample_range ? row_k[index] : sample_range;
+    float min_p = fminf(row_p[index], prefix_sums[index * sample_range + k - 1]);
+    thresholds[index] = min_p * PhiloxUniform(random_rows[index], step);
+  }
+}
 
 template <int kBlockSize>
 __global__ void SampleKernel(float* prefix_sums, int* indices, int* index_out, int sample_range, float* thresholds) {
@@ -498,7 +520,7 @@ __global__ void SampleKernel(float* prefix_sums, int* indices, int* index_out, i
   }
 }
 
-void LaunchSampleKernel(SamplingData* data, cudaStream_t stream, float* scores, int* indices, int* index_out, int sample_range, int batch_size, float p = 0.0, int k=-1) {
+void LaunchSampleKernel(SamplingData* data, cudaStream_t stream, float* scores, int* indices, int* index_out, int sample_range, int batch_size, uint64_t step, float p = 0.0, int k=-1, bool rows = false) {
   dim3 grid(batch_size, 1, 1);
   dim3 block(256, 1, 1);
   // Prefix Sums
@@ -506,12 +528,14 @@ void LaunchSampleKernel(SamplingData* data, cudaStream_t stream, float* scores,
   PrefixSumKernel<256><<<grid, block, 0, stream>>>(scores, prefix_sums.data(), sample_range, batch_size);
   // Random Thresholds for Top P or Top K Sampling
   std::span<float> thresholds{data->thresholds.get(), static_cast<size_t>(batch_size)};
-  if (p > 0.0 && k > 1) {
-    RandomThresholdKernelTopPAndK<<<int(batch_size / 128) + 1, 128, 0, stream>>>(data->curand_states.get(), thresholds.data(), prefix_sums.data(), batch_size, p, k);
+  if (rows) {
+    RandomThresholdKernelRows<<<int(batch_size / 128) + 1, 128, 0, stream>>>(data->random_rows.get(), thresholds.data(), prefix_sums.data(), batch_size, sample_range, data->row_k.get(), data->row_p.get(), step);
+  } else if (p > 0.0 && k > 1) {
+    RandomThresholdKernelTopPAndK<<<int(batch_size / 128) + 1, 128, 0, stream>>>(data->random_rows.get(), thresholds.data(), prefix_sums.data(), batch_size, p, k, step);
   } else if (p > 0.0) {
-    RandomThresholdKernelTopP<<<int(batch_size / 128) + 1, 128, 0, stream>>>(data->curand_states.get(), thresholds.data(), prefix_sums.data(), batch_size, p);
+    RandomThresholdKernelTopP<<<int(batch_size / 128) + 1, 128, 0, stream>>>(data->random_rows.get(), thresholds.data(), prefix_sums.data(), batch_size, p, step);
   } else if (k > 1) {
-    RandomThresholdKernelTopK<<<int(batch_size / 128) + 1, 128, 0, stream>>>(data->curand_states.get(), thresholds.data(), prefix_sums.data(), batch_size, k);
+    RandomThresholdKernelTopK<<<int(batch_size / 128) + 1, 128, 0, stream>>>(data->random_rows.get(), thresholds.data(), prefix_sums.data(), batch_size, k, step);
   }
   SampleKernel<256><<<grid, block, 0, stream>>>(prefix_sums.data(), indices, index_out, sample_range, thresholds.data());
 }
@@ -519,10 +543,11 @@ void LaunchSampleKernel(SamplingData* data, cudaStream_t stream, float* scores,
 // Top P+K Kernel Launchers
 
 // Outputs sorted scores and corresponding indices... scores_out and indices_out should already be allocated
-void SoftmaxAndSort(SamplingData* data, cudaStream_t stream, float* scores_in, float* scores_out, int* indices_out, int vocab_size, int batch_size, float temperature) {
+template <typename T>
+void SoftmaxAndSort(SamplingData* data, cudaStream_t stream, const T* scores_in, float* scores_out, int* indices_out, int vocab_size, int batch_size, float temperature) {
   // Softmax scores
   std::span<float> scores{data->scores_softmaxed.get(), static_cast<size_t>(vocab_size * batch_size)};
-  DispatchBlockwiseSoftmaxForward<false>(&stream, scores.data(), const_cast<const float*>(scores_in), vocab_size, vocab_size, vocab_size, batch_size, temperature);
+  DispatchBlockwiseSoftmaxForward<false>(&stream, scores.data(), scores_in, vocab_size, vocab_size, vocab_size, batch_size, temperature);
   // Sort indices by scores
   std::span<int> offsets_gpu{data->offsets.get(), static_cast<size_t>(batch_size + 1)};
   LaunchPopulateOffsets(offsets_gpu.data(), vocab_size, batch_size, stream);
@@ -534,6 +559,127 @@ void SoftmaxAndSort(SamplingData* data, cudaStream_t stream, float* scores_in, f
                          stream, /*is_descending*/true);
 }
 
+// Top p without sorting the vocab. The nucleus is every token at least as likely as its least likely member, and as
+// probabilities are positive floats they order like their bits. A radix select finds that probability 8 bits a pass,
+// from a histogram of the probability mass of the tokens that still match the digits found so far, then the tokens at
+// or above it are compacted. With a peaked distribution that's a handful of tokens instead of the vocab.
+template <int kBlockSize>
+__global__ void TopPCandidatesKernel(const float* probs, float* candidate_scores, int* candidate_indices, int* candidate_ends,
+                                     int vocab_size, float p) {
+  const int batch = blockIdx.x;
+  const size_t row_offset = static_cast<size_t>(batch) * vocab_size;
+  const float* row = probs + row_offset;
+
+  __shared__ float bucket_mass[256];
+  __shared__ uint32_t prefix;
+  __shared__ float mass_above;  // Of the tokens above every bucket of this pass
+  __shared__ int count;
+  if (threadIdx.x == 0) {
+    prefix = 0;
+    mass_above = 0.0f;
+    count = 0;
+  }
+
+  uint32_t prefix_mask = 0;
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    for (int bucket = threadIdx.x; bucket < 256; bucket += kBlockSize)
+      bucket_mass[bucket] = 0.0f;
+    __syncthreads();
+
+    const uint32_t pass_prefix = prefix;
+    for (int i = threadIdx.x; i < vocab_size; i += kBlockSize) {
+      const float prob = row[i];
+      const uint32_t bits = __float_as_uint(prob);
+      if ((bits & prefix_mask) == pass_prefix)
+        atomicAdd(&bucket_mass[(bits >> shift) & 0xFF], prob);
+    }
+    __syncthreads();
+
+    if (threadIdx.x == 0) {
+      // The highest digit whose tokens, with every more likely token, reach p
+      float mass = mass_above;
+      int digit = 255;
+      for (; digit > 0 && mass + bucket_mass[digit] < p; digit--)
+        mass += bucket_mass[digit];
+      prefix = pass_prefix | (static_cast<uint32_t>(digit) << shift);
+      mass_above = mass;
+    }
+    prefix_mask |= 0xFFu << shift;
+    __syncthreads();
+  }
+
+  const uint32_t threshold = prefix;
+  for (int i = threadIdx.x; i < vocab_size; i += kBlockSize) {
+    const float prob = row[i];
+    if (__float_as_uint(prob) >= threshold) {
+      const int slot = atomicAdd(&count, 1);
+      candidate_scores[row_offset + slot] = prob;
+      candidate_indices[row_offset + slot] = i;
+    }
+  }
+  __syncthreads();
+
+  if (threadIdx.x == 0)
+    candidate_ends[batch] = static_cast<int>(row_offset) + count;
+}
+
+// Samples from the sorted candidates of each row, like SampleKernel with a top p threshold
+template <int kBlockSize>
+__global__ void TopPSampleKernel(const float* sorted_scores, const int* sorted_indices, const int* candidate_ends,
+                                 const RandomRow* random_rows, uint64_t step, int vocab_size, float p, int* index_out) {
+  const int batch = blockIdx.x;
+  const int begin = batch * vocab_size;
+  const int count = candidate_ends[batch] - begin;
+
+  typedef cub::BlockScan<float, kBlockSize> BlockScan;
+  __shared__ typename BlockScan::TempStorage temp_storage;
+  __shared__ float threshold;
+  __shared__ int first_index;
+  if (threadIdx.x == 0) {
+    threshold = p * PhiloxUniform(random_rows[batch], step);
+    first_index = max(count - 1, 0);
+  }
+  __syncthreads();
+
+  float prefix_sum = 0.0f;
+  for (int i = 0; i < count; i += kBlockSize) {
+    const int index = i + threadIdx.x;
+    float sum = index < count ? sorted_scores[begin + index] : 0.0f;
+    float block_sum;
+    BlockScan(temp_storage).InclusiveSum(sum, sum, block_sum);
+    if (index < count && prefix_sum + sum >= threshold)
+      atomicMin(&first_index, index);
+    prefix_sum += block_sum;
+    __syncthreads();
+    if (first_index < i + kBlockSize)
+      break;
+  }
+
+  if (threadIdx.x == 0)
+    index_out[batch] = sorted_indices[begin + first_index];
+}
+
+template <typename T>
+void LaunchTopPSample(SamplingData* data, cudaStream_t stream, int32_t* next_token_out, const T* scores_in, int vocab_size, int batch_size, float p, float temperature, uint64_t step) {
+  std::span<float> scores{data->scores_softmaxed.get(), static_cast<size_t>(vocab_size * batch_size)};
+  DispatchBlockwiseSoftmaxForward<false>(&stream, scores.data(), scores_in, vocab_size, vocab_size, vocab_size, batch_size, temperature);
+
+  // prefix_sums and indices_in aren't used by this path, so they hold the unsorted candidates
+  float* candidate_scores = data->prefix_sums.get();
+  int* candidate_indices = data->indices_in.get();
+  TopPCandidatesKernel<256><<<batch_size, 256, 0, stream>>>(scores.data(), candidate_scores, candidate_indices, data->candidate_ends.get(), vocab_size, p);
+
+  // Every segment starts at its row and ends after its candidates, the rest of the buffers is left alone
+  std::span<int> offsets_gpu{data->offsets.get(), static_cast<size_t>(batch_size + 1)};
+  LaunchPopulateOffsets(offsets_gpu.data(), vocab_size, batch_size, stream);
+  cub::DeviceSegmentedRadixSort::SortPairsDescending(data->temp_buffer.get(), data->temp_storage_bytes, candidate_scores, data->scores_sorted.get(),
+                                                     candidate_indices, data->indices_sorted.get(), vocab_size * batch_size, batch_size,
+                                                     offsets_gpu.data(), data->candidate_ends.get(), 0, sizeof(float) * 8, stream);
+
+  TopPSampleKernel<256><<<batch_size, 256, 0, stream>>>(data->scores_sorted.get(), data->indices_sorted.get(), data->candidate_ends.get(),
+                                                        data->random_rows.get(), step, vocab_size, p, next_token_out);
+}
+
 void LaunchGetTopKSubsetFullSort(SamplingData* data, cudaStream_t stream, float* scores_in, float* scores_out, int* indices_out, int vocab_size, int batch_size, int k) {
   // Sort indices and scores
   std::span<float> scores_sorted{data->scores_sorted.get(), static_cast<size_t>(vocab_size * batch_size)};
@@ -548,10 +694,11 @@ void LaunchGetTopKSubsetFullSort(SamplingData* data, cudaStream_t stream, float*
                          stream, /*is_descending*/true);
 }
 
-void GetTopKSubset(SamplingData* data, cudaStream_t stream, float* scores_in, float* scores_out, int* indices_out, int vocab_size, int batch_size, int k, float temperature) {
+template <typename T>
+void GetTopKSubset(SamplingData* data, cudaStream_t stream, const T* scores_in, float* scores_out, int* indices_out, int vocab_size, int batch_size, int k, float temperature) {
   // Softmax scores
   std::span<float> scores_softmaxed{data->scores_softmaxed.get(), static_cast<size_t>(vocab_size * batch_size)};
-  DispatchBlockwiseSoftmaxForward<false>(&stream, scores_softmaxed.data(), const_cast<const float*>(scores_in), vocab_size, vocab_size, vocab_size, batch_size, temperature);
+  DispatchBlockwiseSoftmaxForward<false>(&stream, scores_softmaxed.data(), scores_in, vocab_size, vocab_size, vocab_size, batch_size, temperature);
   // Get top k subset
   #define GetTopK(max_k)                              \
   LaunchGetTopKSubset<max_k>(stream,                  \
@@ -579,7 +726,12 @@ void GetTopKSubset(SamplingData* data, cudaStream_t stream, float* scores_in, fl
 
 
 // Kernel launcher for combined (or seperate) top k and top p sampling; where k is the max number of tokens to sample and p is the probability threshold
-void GetSample(SamplingData* data, cudaStream_t stream, int32_t* next_token_out, float* scores_in, int vocab_size, int batch_size, int k, float p, float temperature) {
+template <typename T>
+void GetSample(SamplingData* data, cudaStream_t stream, int32_t* next_token_out, const T* scores_in, int vocab_size, int batch_size, int k, float p, float temperature, uint64_t step) {
+  if ((k <= 0 || k >= vocab_size) && p > 0.0f && p < 1.0f) {
+    LaunchTopPSample(data, stream, next_token_out, scores_in, vocab_size, batch_size, p, temperature, step);
+    return;
+  }
   int sample_range = (k > 0 && k <= 64) ? k : vocab_size;
   std::span<float> scores_sorted(data->scores_sorted.get(), static_cast<size_t>(sample_range * batch_size));
   std::span<int> indices_sorted(data->indices_sorted.get(), static_cast<size_t>(sample_range * batch_size));
@@ -589,7 +741,73 @@ void GetSample(SamplingData* data, cudaStream_t stream, int32_t* next_token_out,
     SoftmaxAndSort(data, stream, scores_in, scores_sorted.data(), indices_sorted.data(), vocab_size, batch_size, temperature);
   }
   // Sample kernel
-  LaunchSampleKernel(data, stream, scores_sorted.data(), indices_sorted.data(), next_token_out, sample_range, batch_size, p, k);
+  LaunchSampleKernel(data, stream, scores_sorted.data(), indices_sorted.data(), next_token_out, sample_range, batch_size, step, p, k);
+}
+
+void GetSample(SamplingData* data, cudaStream_t stream, int32_t* next_token_out, float* scores_in, int vocab_size, int batch_size, int k, float p, float temperature, uint64_t step) {
+  GetSample<float>(data, stream, next_token_out, scores_in, vocab_size, batch_size, k, p, temperature, step);
+}
+
+void GetSample(SamplingData* data, cudaStream_t stream, int32_t* next_token_out, const uint16_t* scores_in, int vocab_size, int batch_size, int k, float p, float temperature, uint64_t step) {
+  GetSample<half>(data, stream, next_token_out, reinterpret_cast<const half*>(scores_in), vocab_size, batch_size, k, p, temperature, step);
+}
+
+__global__ void ScaleRowsKernel(float* scores, const float* row_temperature, int vocab_size, int total_elements) {
+  int index = threadIdx.x + blockIdx.x * blockDim.x;
+  if (index < total_elements)
+    scores[index] /= row_temperature[index / vocab_size];
+}
+
+void GetSampleRows(SamplingData* data, cudaStream_t stream, int32_t* next_token_out, float* scores_in, int vocab_size, int batch_size, uint64_t step) {
+  // The softmax only takes a single temperature, so the rows are scaled up front
+  int total_elements = vocab_size * batch_size;
+  ScaleRowsKernel<<<(total_elements + 255) / 256, 256, 0, stream>>>(scores_in, data->row_temperature.get(), vocab_size, total_elements);
+
+  int k = data->row_max_k;
+  int sample_range = k <= 64 ? k : vocab_size;
+  std::span<float> scores_sorted(data->scores_sorted.get(), static_cast<size_t>(sample_range * batch_size));
+  std::span<int> indices_sorted(data->indices_sorted.get(), static_cast<size_t>(sample_range * batch_size));
+  if (k < vocab_size) {
+    GetTopKSubset(data, stream, scores_in, scores_sorted.data(), indices_sorted.data(), vocab_size, batch_size, k, 1.0f);
+  } else {
+    SoftmaxAndSort(data, stream, scores_in, scores_sorted.data(), indices_sorted.data(), vocab_size, batch_size, 1.0f);
+  }
+  LaunchSampleKernel(data, stream, scores_sorted.data(), indices_sorted.data(), next_token_out, sample_range, batch_size, step, 0.0f, k, true);
+}
+
+__global__ void ScaleRowsIntoKernel(float* scores_out, const float* scores_in, const float* row_temperature, int vocab_size, int total_elements) {
+  int index = threadIdx.x + blockIdx.x * blockDim.x;
+  if (index < total_elements)
+    scores_out[index] = scores_in[index] / row_temperature[index / vocab_size];
+}
+
+void LaunchLogSoftmax(float* log_probs, const float* scores_in, const float* row_temperature, int vocab_size, int batch_size, cudaStream_t stream) {
+  // Scaled into log_probs first, so the scores stay as they are for the sampler. The softmax then runs in place.
+  int total_elements = vocab_size * batch_size;
+  ScaleRowsIntoKernel<<<(total_elements + 255) / 256, 256, 0, stream>>>(log_probs, scores_in, row_temperature, vocab_size, total_elements);
+  DispatchBlockwiseSoftmaxForward<true>(&stream, log_probs, log_probs, vocab_size, vocab_size, vocab_size, batch_size);
+}
+
+__global__ void GatherTokenLogProbsKernel(float* logprobs, const float* log_probs, const int32_t* next_tokens, int vocab_size, int batch_size) {
+  int index = threadIdx.x + blockIdx.x * blockDim.x;
+  if (index < batch_size)
+    logprobs[index] = log_probs[static_cast<size_t>(index) * vocab_size + next_tokens[index]];
+}
+
+void LaunchGatherLogProbs(float* logprobs, int32_t* top_tokens, float* top_logprobs, float* log_probs, const int32_t* next_tokens,
+                          int vocab_size, int batch_size, int top_count, cudaStream_t stream) {
+  GatherTokenLogProbsKernel<<<(batch_size + 255) / 256, 256, 0, stream>>>(logprobs, log_probs, next_tokens, vocab_size, batch_size);
+  if (top_count <= 4) {
+    LaunchGetTopKSubset<4>(stream, log_probs, top_logprobs, top_tokens, vocab_size, batch_size, top_count);
+  } else if (top_count <= 8) {
+    LaunchGetTopKSubset<8>(stream, log_probs, top_logprobs, top_tokens, vocab_size, batch_size, top_count);
+  } else if (top_count <= 16) {
+    LaunchGetTopKSubset<16>(stream, log_probs, top_logprobs, top_tokens, vocab_size, batch_size, top_count);
+  } else if (top_count <= 32) {
+    LaunchGetTopKSubset<32>(stream, log_probs, top_logprobs, top_tokens, vocab_size, batch_size, top_count);
+  } else {  // At most 64, see CheckGeneratorParams
+    LaunchGetTopKSubset<64>(stream, log_probs, top_logprobs, top_tokens, vocab_size, batch_size, top_count);
+  }
 }
 
 } // namespace cuda
@@ -1,13 +1,13 @@
 // Copyright (c) Microsoft Corporation. All rights reserved.
 // Licensed under the MIT License.
 #include "smartptrs.h"
-#include <curand_kernel.h>
+#include "philox.h"
 
 namespace Generators {
 namespace cuda {
 
 struct SamplingData {
-  SamplingData(unsigned long long random_seed, int batch_size, int vocab_size, cudaStream_t stream);
+  SamplingData(std::span<const RandomRow> random_rows, int batch_size, int vocab_size, cudaStream_t stream);
   cuda_unique_ptr<int> indices_sorted;
   cuda_unique_ptr<float> scores_sorted;
   cuda_unique_ptr<float> scores_softmaxed;
@@ -16,12 +16,31 @@ struct SamplingData {
   cuda_unique_ptr<int> indices_in;
   cuda_unique_ptr<int> offsets;
   cuda_unique_ptr<float> temp_buffer;
-  cuda_unique_ptr<curandState> curand_states;
+  cuda_unique_ptr<RandomRow> random_rows;  // Every row draws at the step the sampler is given, see philox.h
+  cuda_unique_ptr<int> candidate_ends;  // Top p: where each row's candidates end, they start at row * vocab_size
   size_t temp_storage_bytes = 0;
+
+  // Per row sampling options for GetSampleRows. k of 0 samples from the whole vocab and p of 1 disables top p.
+  void SetRowOptions(std::span<const int> k, std::span<const float> p, std::span<const float> temperature, int vocab_size, cudaStream_t stream);
+  cuda_unique_ptr<int> row_k;
+  cuda_unique_ptr<float> row_p;
+  cuda_unique_ptr<float> row_temperature;
+  int row_max_k{};  // vocab_size if any row samples from the whole vocab
 };
 
 void LaunchPopulateIndices(int* indices, int size, int batch_size, cudaStream_t stream);
-void GetSample(SamplingData* data, cudaStream_t stream, int32_t* d_next_token, float* d_scores, int vocab_size, int batch_size, int k, float p, float temperature);
+// step is the counter of the random draws, the sequence length, so the same row at the same length draws the same
+void GetSample(SamplingData* data, cudaStream_t stream, int32_t* d_next_token, float* d_scores, int vocab_size, int batch_size, int k, float p, float temperature, uint64_t step);
+// The same on fp16 scores as the model wrote them, see State::logits16_. The softmax reads them in place, in fp32.
+void GetSample(SamplingData* data, cudaStream_t stream, int32_t* d_next_token, const uint16_t* d_scores, int vocab_size, int batch_size, int k, float p, float temperature, uint64_t step);
+// Same as GetSample, but with the options of SamplingData::SetRowOptions. d_scores is scaled by the temperatures.
+void GetSampleRows(SamplingData* data, cudaStream_t stream, int32_t* d_next_token, float* d_scores, int vocab_size, int batch_size, uint64_t step);
+
+// top_logprobs: d_log_probs gets the log softmax of every row of d_scores divided by the row's temperature
+void LaunchLogSoftmax(float* d_log_probs, const float* d_scores, const float* d_row_temperature, int vocab_size, int batch_size, cudaStream_t stream);
+// The log probability of each row's next token, and its top_count (at most 64) most likely tokens in order
+void LaunchGatherLogProbs(float* d_logprobs, int32_t* d_top_tokens, float* d_top_logprobs, float* d_log_probs, const int32_t* d_next_token,
+                          int vocab_size, int batch_size, int top_count, cudaStream_t stream);
 
 }  // namespace cuda
 }  // namespace Generators
\ No newline at end of file
@@ -0,0 +1,106 @@
+#include <d3dx12.h>
+#include <assert.h>
+#include <wil/result.h>
+#include <stdexcept>
+#include "dml_argmax_kernel.h"
+#include "dml_helpers.h"
+
+namespace DmlArgMax_Fp32 {
+#include "generated_dml_shaders/argmax_fp32.h"
+}
+
+DmlArgMaxKernel::DmlArgMaxKernel(
+    ID3D12Device* d3d12_device,
+    DmlExecutionContext* execution_context,
+    uint32_t row_count,
+    uint32_t vocab_size,
+    ID3D12Resource* logits_resource,
+    ID3D12Resource* tokens_resource)
+    : device_(d3d12_device),
+      execution_context_(execution_context),
+      logits_resource_(logits_resource),
+      tokens_resource_(tokens_resource),
+      row_count_(row_count) {
+  constants_.vocab_size = vocab_size;
+
+  // Compute root signature.
+  std::vector<CD3DX12_ROOT_PARAMETER1> root_parameters;
+  root_parameters.resize(uav_count_ + 1);
+
+  for (UINT i = 0; i < uav_count_; i++) {
+    root_parameters[i].InitAsUnorderedAccessView(i);
+  }
+
+  root_parameters[uav_count_].InitAsConstants(constant_count_, 0);
+
+  CD3DX12_VERSIONED_ROOT_SIGNATURE_DESC desc;
+  desc.Init_1_1(static_cast<uint32_t>(root_parameters.size()), root_parameters.data());
+
+  ComPtr<ID3DBlob> root_signature_blob;
+  ComPtr<ID3DBlob> root_signature_error_blob;
+  THROW_IF_FAILED(D3D12SerializeVersionedRootSignature(
+      &desc,
+      root_signature_blob.GetAddressOf(),
+      root_signature_error_blob.GetAddressOf()));
+
+  THROW_IF_FAILED(device_->CreateRootSignature(
+      0,
+      root_signature_blob->GetBufferPointer(),
+      root_signature_blob->GetBufferSize(),
+      IID_PPV_ARGS(&root_signature_)));
+
+  D3D12_COMPUTE_PIPELINE_STATE_DESC compute_pso_desc = {};
+  compute_pso_desc.pRootSignature = root_signature_.Get();
+  compute_pso_desc.CS = CD3DX12_SHADER_BYTECODE(DmlArgMax_Fp32::g_CSMain, sizeof(DmlArgMax_Fp32::g_CSMain));
+
+  THROW_IF_FAILED(device_->CreateComputePipelineState(&compute_pso_desc, IID_PPV_ARGS(&pipeline_state_)));
+
+  THROW_IF_FAILED(d3d12_device->CreateCommandAllocator(
+      D3D12_COMMAND_LIST_TYPE_COMPUTE,
+      IID_PPV_ARGS(command_allocator_.ReleaseAndGetAddressOf())));
+
+  THROW_IF_FAILED(d3d12_device->CreateCommandList(
+      0,
+      D3D12_COMMAND_LIST_TYPE_COMPUTE,
+      command_allocator_.Get(),
+      nullptr,
+      IID_PPV_ARGS(graphics_command_list_.ReleaseAndGetAddressOf())));
+
+  D3D12_DESCRIPTOR_HEAP_DESC heap_desc = {};
+  heap_desc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE;
+  heap_desc.NumDescriptors = uav_count_;
+  heap_desc.Type = D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV;
+
+  THROW_IF_FAILED(d3d12_device->CreateDescriptorHeap(&heap_desc, IID_PPV_ARGS(heap_.ReleaseAndGetAddressOf())));
+
+  ID3D12DescriptorHeap* descriptor_heaps[] = {heap_.Get()};
+  graphics_command_list_->SetDescriptorHeaps(ARRAYSIZE(descriptor_heaps), descriptor_heaps);
+
+  // Set the root signature and pipeline state
+  graphics_command_list_->SetComputeRootSignature(root_signature_.Get());
+  graphics_command_list_->SetPipelineState(pipeline_state_.Get());
+  graphics_command_list_->SetComputeRootUnorderedAccessView(0, logits_resource_->GetGPUVirtualAddress());
+  graphics_command_list_->SetComputeRootUnorderedAccessView(1, tokens_resource_->GetGPUVirtualAddress());
+
+  // A thread group per row, dispatched up to the maximum number of groups per iteration until all rows are done
+  auto constants = constants_;
+  for (uint32_t start_row = 0; start_row < row_count_; start_row += max_dispatch_rows_) {
+    constants.start_row = start_row;
+
+    // Set root constants
+    graphics_command_list_->SetComputeRoot32BitConstants(
+        uav_count_,       // root parameter index
+        constant_count_,  // Constant count
+        &constants,
+        0  // offset
+    );
+
+    graphics_command_list_->Dispatch(std::min(row_count_ - start_row, max_dispatch_rows_), 1, 1);
+  }
+
+  // The tokens are read back right after
+  auto barrier = CD3DX12_RESOURCE_BARRIER::UAV(tokens_resource_.Get());
+  graphics_command_list_->ResourceBarrier(1, &barrier);
+
+  graphics_command_list_->Close();
+}
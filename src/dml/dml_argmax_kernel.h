@@ -0,0 +1,48 @@
+#pragma once
+
+#include <numeric>
+#include <d3d12.h>
+#include <wrl/client.h>
+#include <vector>
+#include "dml_execution_context.h"
+
+using Microsoft::WRL::ComPtr;
+
+// The token with the highest fp32 logit of every row, so greedy search only reads back the tokens
+class DmlArgMaxKernel {
+ public:
+  DmlArgMaxKernel(
+      ID3D12Device* d3d12_device,
+      DmlExecutionContext* execution_context,
+      uint32_t row_count,
+      uint32_t vocab_size,
+      ID3D12Resource* logits_resource,
+      ID3D12Resource* tokens_resource);
+
+  ID3D12GraphicsCommandList* GetCommandList() { return graphics_command_list_.Get(); }
+  ID3D12Resource* GetLogitsResource() const { return logits_resource_.Get(); }
+
+ private:
+  struct Constants {
+    uint32_t vocab_size;
+    uint32_t start_row;
+  };
+
+  ComPtr<ID3D12Device> device_;
+  ComPtr<ID3D12RootSignature> root_signature_;
+  ComPtr<ID3D12PipelineState> pipeline_state_;
+  Constants constants_;
+  DmlExecutionContext* execution_context_;
+
+  ComPtr<ID3D12GraphicsCommandList> graphics_command_list_;
+  ComPtr<ID3D12CommandAllocator> command_allocator_;
+  ComPtr<ID3D12DescriptorHeap> heap_;
+
+  ComPtr<ID3D12Resource> logits_resource_;
+  ComPtr<ID3D12Resource> tokens_resource_;
+  uint32_t row_count_;
+
+  constexpr static uint32_t constant_count_ = sizeof(Constants) / sizeof(uint32_t);
+  constexpr static uint32_t uav_count_ = 2;
+  constexpr static uint32_t max_dispatch_rows_ = 65535;  // D3D12_CS_DISPATCH_MAX_THREAD_GROUPS_PER_DIMENSION
+};
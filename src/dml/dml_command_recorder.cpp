@@ -39,6 +39,13 @@ void DmlCommandRecorder::ExecuteCommandList(
     ID3D12GraphicsCommandList* command_list,
     _Outptr_ ID3D12Fence** fence,
     _Out_ uint64_t* completion_value) {
+  ExecuteCommandLists(std::span<ID3D12GraphicsCommandList* const>(&command_list, 1), fence, completion_value);
+}
+
+void DmlCommandRecorder::ExecuteCommandLists(
+    std::span<ID3D12GraphicsCommandList* const> command_lists,
+    _Outptr_ ID3D12Fence** fence,
+    _Out_ uint64_t* completion_value) {
   if (!operations_recorded_in_current_command_list) {
     // The caller can re-use relevant resources after the next set of work to be
     // flushed has completed.  Its command list hasn't been executed yet, just batched.
@@ -46,7 +53,8 @@ void DmlCommandRecorder::ExecuteCommandList(
     gpu_event.fence.CopyTo(fence);
     *completion_value = gpu_event.fence_value;
 
-    queue_->ExecuteCommandLists(std::span<ID3D12CommandList*>(reinterpret_cast<ID3D12CommandList**>(&command_list), 1));
+    std::vector<ID3D12CommandList*> lists_to_execute(command_lists.begin(), command_lists.end());
+    queue_->ExecuteCommandLists(lists_to_execute);
 
     // The fence value at which the current command allocator may be re-used will now be higher
     command_allocator_ring_.UpdateCurrentAllocatorCompletionEvent(queue_->GetNextCompletionEvent());
@@ -61,8 +69,8 @@ void DmlCommandRecorder::ExecuteCommandList(
   // the D3D object lazily at a point when the operation may not be parallelized with GPU work.
   auto heap = current_descriptor_heap_;
 
-  // Execute work in the current command list plus provided command list while closing the recorder.
-  CloseAndExecute(command_list);
+  // Execute work in the current command list plus provided command lists while closing the recorder.
+  CloseAndExecute(command_lists);
   Open();
 
   // Reset the descriptor heap opportunistically per above comment
@@ -111,25 +119,23 @@ void DmlCommandRecorder::Open() {
 }
 
 void DmlCommandRecorder::CloseAndExecute() {
-  CloseAndExecute(nullptr);
+  CloseAndExecute({});
 }
 
-void DmlCommandRecorder::CloseAndExecute(_In_opt_ ID3D12GraphicsCommandList* command_list) {
+void DmlCommandRecorder::CloseAndExecute(std::span<ID3D12GraphicsCommandList* const> command_lists) {
   THROW_IF_FAILED(current_command_list_->Close());
 
-  ID3D12GraphicsCommandList* command_lists_to_execute[2] = {};
-  uint32_t command_lists_to_execute_count = 0;
+  std::vector<ID3D12CommandList*> command_lists_to_execute;
+  command_lists_to_execute.reserve(command_lists.size() + 1);
 
   if (operations_recorded_in_current_command_list) {
-    command_lists_to_execute[command_lists_to_execute_count++] = current_command_list_.Get();
+    command_lists_to_execute.push_back(current_command_list_.Get());
   }
 
-  if (command_list) {
-    command_lists_to_execute[command_lists_to_execute_count++] = command_list;
-  }
+  command_lists_to_execute.insert(command_lists_to_execute.end(), command_lists.begin(), command_lists.end());
 
-  if (command_lists_to_execute_count > 0) {
-    queue_->ExecuteCommandLists(std::span<ID3D12CommandList*>(reinterpret_cast<ID3D12CommandList**>(command_lists_to_execute), command_lists_to_execute_count));
+  if (!command_lists_to_execute.empty()) {
+    queue_->ExecuteCommandLists(command_lists_to_execute);
   }
 
   cached_command_list_ = current_command_list_;
@@ -4,6 +4,7 @@
 #pragma once
 
 #include <memory>
+#include <vector>
 #include <d3d12.h>
 #include <DirectML.h>
 #include "../span.h"
@@ -51,6 +52,12 @@ class DmlCommandRecorder {
       _Outptr_ ID3D12Fence** fence,
       _Out_ uint64_t* completion_value);
 
+  // Executes pre-recorded command lists in order with a single submission and fence signal
+  void ExecuteCommandLists(
+      std::span<ID3D12GraphicsCommandList* const> command_lists,
+      _Outptr_ ID3D12Fence** fence,
+      _Out_ uint64_t* completion_value);
+
   ComPtr<ID3D12GraphicsCommandList> GetCommandList();
 
   void ResourceBarrier(std::span<const D3D12_RESOURCE_BARRIER> barriers);
@@ -69,7 +76,7 @@ class DmlCommandRecorder {
   }
 
  private:
-  void CloseAndExecute(_In_opt_ ID3D12GraphicsCommandList* command_list);
+  void CloseAndExecute(std::span<ID3D12GraphicsCommandList* const> command_lists);
 
   std::shared_ptr<DmlCommandQueue> queue_;
   ComPtr<ID3D12Device> d3d_device_;
@@ -72,6 +72,16 @@ void DmlExecutionContext::ExecuteCommandList(
   dml_recorder_.ExecuteCommandList(command_list, fence, completion_value);
 }
 
+void DmlExecutionContext::ExecuteCommandLists(
+    std::span<ID3D12GraphicsCommandList* const> command_lists,
+    _Outptr_ ID3D12Fence** fence,
+    _Out_ uint64_t* completion_value) {
+  assert(!closed_);
+
+  SetCommandRecorder(&dml_recorder_);
+  dml_recorder_.ExecuteCommandLists(command_lists, fence, completion_value);
+}
+
 void DmlExecutionContext::AddUAVBarrier() {
   assert(!closed_);
   SetCommandRecorder(&dml_recorder_);
@@ -49,6 +49,12 @@ class DmlExecutionContext {
       _Outptr_ ID3D12Fence** fence,
       _Out_ uint64_t* completion_value);
 
+  // Executes pre-recorded command lists in order with a single submission, for work that is replayed every step
+  void ExecuteCommandLists(
+      std::span<ID3D12GraphicsCommandList* const> command_lists,
+      _Outptr_ ID3D12Fence** fence,
+      _Out_ uint64_t* completion_value);
+
   void AddUAVBarrier();
   void ResourceBarrier(std::span<const D3D12_RESOURCE_BARRIER> barriers);
 
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <numeric>
+#include <d3d12.h>
+#include <wrl/client.h>
+#include <vector>
+#include "dml_execution_context.h"
+
+using Microsoft::WRL::ComPtr;
+
+// The root signature and pipeline state of the gather, which only depend on the logits type. The model creates them
+// once per type, the kernel of every prompt records its dispatch with them.
+struct DmlGatherLastTokensPipeline {
+  DmlGatherLastTokensPipeline(ID3D12Device* d3d12_device, ONNXTensorElementDataType dtype);
+
+  ComPtr<ID3D12RootSignature> root_signature_;
+  ComPtr<ID3D12PipelineState> pipeline_state_;
+
+  constexpr static uint32_t constant_count_ = 4;  // DmlGatherLastTokensKernel::Constants
+  constexpr static uint32_t uav_count_ = 3;
+};
+
+// Gathers the logits of the last token of every row out of the prompt's logits into fp32 {rows, 1, vocab_size} in a
+// single dispatch, casting fp16 logits on the way
+class DmlGatherLastTokensKernel {
+ public:
+  DmlGatherLastTokensKernel(
+      ID3D12Device* d3d12_device,
+      DmlExecutionContext* execution_context,
+      uint32_t row_count,
+      uint32_t seq_len,
+      uint32_t vocab_size,
+      const DmlGatherLastTokensPipeline& pipeline,
+      ID3D12Resource* logits_resource,
+      ID3D12Resource* last_token_indices_resource,
+      ID3D12Resource* output_resource);
+
+  ID3D12GraphicsCommandList* GetCommandList() { return graphics_command_list_.Get(); }
+
+ private:
+  struct Constants {
+    uint32_t vocab_size;
+    uint32_t seq_len;
+    uint32_t element_count;
+    uint32_t start_index;
+  };
+
+  Constants constants_;
+  DmlExecutionContext* execution_context_;
+
+  ComPtr<ID3D12GraphicsCommandList> graphics_command_list_;
+  ComPtr<ID3D12CommandAllocator> command_allocator_;
+  ComPtr<ID3D12DescriptorHeap> heap_;
+
+  ComPtr<ID3D12Resource> logits_resource_;
+  ComPtr<ID3D12Resource> last_token_indices_resource_;
+  ComPtr<ID3D12Resource> output_resource_;
+  uint32_t total_element_count_;
+
+  constexpr static uint32_t constant_count_ = DmlGatherLastTokensPipeline::constant_count_;
+  constexpr static uint32_t uav_count_ = DmlGatherLastTokensPipeline::uav_count_;
+  static_assert(sizeof(Constants) == constant_count_ * sizeof(uint32_t));
+};
@@ -2,6 +2,7 @@
 
 #include <assert.h>
 #include <stdexcept>
+#include <string>
 #include <dxcore.h>
 #include <dxcore_interface.h>
 #include <dxgi1_6.h>
@@ -21,7 +22,7 @@ static bool IsSoftwareAdapter(IDXGIAdapter1* adapter) {
   return desc.Flags & DXGI_ADAPTER_FLAG_SOFTWARE || (is_basic_render_driver_vendor_id && is_basic_render_driver_device_id);
 };
 
-static std::vector<ComPtr<IDXGIAdapter1>> EnumerateAdapters() {
+static std::vector<ComPtr<IDXGIAdapter1>> EnumerateAdapters(DXGI_GPU_PREFERENCE gpu_preference) {
   ComPtr<IDXGIFactory4> dxgi_factory;
   THROW_IF_FAILED(CreateDXGIFactory(IID_PPV_ARGS(&dxgi_factory)));
 
@@ -29,12 +30,12 @@ static std::vector<ComPtr<IDXGIAdapter1>> EnumerateAdapters() {
 
   ComPtr<IDXGIFactory6> dxgi_factory6;
   if (SUCCEEDED(dxgi_factory.As(&dxgi_factory6))) {
-    // Enumerate adapters by performance. This only works in Windows 10 Version 1803 and later.
+    // Enumerate adapters by preference. This only works in Windows 10 Version 1803 and later.
     ComPtr<IDXGIAdapter1> adapter;
     for (uint32_t adapter_index = 0;
          dxgi_factory6->EnumAdapterByGpuPreference(
              adapter_index,
-             DXGI_GPU_PREFERENCE_HIGH_PERFORMANCE,
+             gpu_preference,
              IID_PPV_ARGS(&adapter)) != DXGI_ERROR_NOT_FOUND;
          adapter_index++) {
       // Since we enumerate by performance, we can ignore everything that comes after the first software adapter, which includes the IDD
@@ -75,12 +76,49 @@ static std::vector<ComPtr<IDXGIAdapter1>> EnumerateAdapters() {
   return adapter_infos;
 }
 
-static ComPtr<IDXGIAdapter1> CreatePerformantAdapter() {
-  auto filtered_adapters = EnumerateAdapters();
+static ComPtr<IDXGIAdapter1> SelectAdapter(const DmlAdapterOptions& options) {
+  auto filtered_adapters = EnumerateAdapters(options.gpu_preference);
+  if (filtered_adapters.empty()) {
+    throw std::runtime_error("No DirectX 12 adapter found for DML");
+  }
+
+  if (options.luid) {
+    for (auto& adapter : filtered_adapters) {
+      DXGI_ADAPTER_DESC1 desc = {};
+      THROW_IF_FAILED(adapter->GetDesc1(&desc));
+      if (desc.AdapterLuid.LowPart == options.luid->LowPart && desc.AdapterLuid.HighPart == options.luid->HighPart) {
+        return adapter;
+      }
+    }
+    throw std::runtime_error("No DML adapter has the LUID given in the dml provider options");
+  }
+
+  if (options.device_id) {
+    if (*options.device_id >= filtered_adapters.size()) {
+      throw std::runtime_error("DML device_id " + std::to_string(*options.device_id) + " is out of range, there are " +
+                               std::to_string(filtered_adapters.size()) + " adapters");
+    }
+    return filtered_adapters[*options.device_id];
+  }
+
+  if (options.most_memory) {
+    ComPtr<IDXGIAdapter1> best;
+    SIZE_T best_memory = 0;
+    for (auto& adapter : filtered_adapters) {
+      DXGI_ADAPTER_DESC1 desc = {};
+      THROW_IF_FAILED(adapter->GetDesc1(&desc));
+      if (!best || desc.DedicatedVideoMemory > best_memory) {
+        best = adapter;
+        best_memory = desc.DedicatedVideoMemory;
+      }
+    }
+    return best;
+  }
+
   return filtered_adapters.front();
 }
 
-DmlObjects CreateDmlObjects() {
+DmlObjects CreateDmlObjects(const DmlAdapterOptions& adapter_options) {
   D3D12_COMMAND_QUEUE_DESC command_queue_description = {
       D3D12_COMMAND_LIST_TYPE_COMPUTE,
       0,
@@ -90,7 +128,7 @@ DmlObjects CreateDmlObjects() {
 
   DmlObjects dml_objects;
 
-  auto adapter = CreatePerformantAdapter();
+  auto adapter = SelectAdapter(adapter_options);
   THROW_IF_FAILED(D3D12CreateDevice(adapter.Get(), D3D_FEATURE_LEVEL_11_0, IID_PPV_ARGS(&dml_objects.d3d12_device)));
   THROW_IF_FAILED(dml_objects.d3d12_device->CreateCommandQueue(&command_queue_description, IID_PPV_ARGS(&dml_objects.command_queue)));
   THROW_IF_FAILED(dml_objects.d3d12_device->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_DIRECT, IID_PPV_ARGS(&dml_objects.command_allocator)));
@@ -4,6 +4,8 @@
 #include <wil/result.h>
 #include <d3d12.h>
 #include <DirectML.h>
+#include <dxgi1_6.h>
+#include <optional>
 #include "dml_execution_context.h"
 
 using Microsoft::WRL::ComPtr;
@@ -30,8 +32,17 @@ struct DmlObjects {
   ComPtr<ID3D12Resource> upload_buffer;
 };
 
+// Which adapter CreateDmlObjects creates its device on. Every model has its own device, queue and heaps, so models
+// loaded with different options run on different adapters.
+struct DmlAdapterOptions {
+  DXGI_GPU_PREFERENCE gpu_preference{DXGI_GPU_PREFERENCE_HIGH_PERFORMANCE};  // The order the adapters are enumerated in
+  std::optional<uint32_t> device_id;                                         // An index into that order
+  std::optional<LUID> luid;
+  bool most_memory{};  // The adapter with the most dedicated video memory
+};
+
 namespace DmlHelpers {
-DmlObjects CreateDmlObjects();
+DmlObjects CreateDmlObjects(const DmlAdapterOptions& adapter_options = {});
 
 DmlReusedCommandListState BuildReusableCommandList(
     IDMLDevice* dml_device,
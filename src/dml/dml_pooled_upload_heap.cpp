@@ -12,6 +12,14 @@ DmlPooledUploadHeap::DmlPooledUploadHeap(ID3D12Device* device, DmlExecutionConte
     : device_(device), execution_context_(execution_context) {
 }
 
+DmlPooledUploadHeap::~DmlPooledUploadHeap() {
+  // The copies are no longer waited for on upload, so the chunks can't be released while the GPU still reads them
+  for (const Chunk& chunk : chunks_) {
+    if (!chunk.allocations.empty())
+      chunk.allocations.back().done_event.WaitForSignal();
+  }
+}
+
 static size_t Align(size_t offset, size_t alignment) {
   assert(alignment != 0);
   return (offset + alignment - 1) & ~(alignment - 1);
@@ -92,7 +100,12 @@ std::optional<size_t> DmlPooledUploadHeap::FindOffsetForAllocation(const Chunk&
       nullptr,
       IID_PPV_ARGS(upload_buffer.ReleaseAndGetAddressOf())));
 
-  return Chunk{size_in_bytes, std::move(upload_buffer)};
+  // The CPU never reads from an upload heap
+  D3D12_RANGE read_range{0, 0};
+  void* mapped_data = nullptr;
+  THROW_IF_FAILED(upload_buffer->Map(0, &read_range, &mapped_data));
+
+  return Chunk{size_in_bytes, std::move(upload_buffer), static_cast<uint8_t*>(mapped_data)};
 }
 
 std::pair<DmlPooledUploadHeap::Chunk*, size_t> DmlPooledUploadHeap::Reserve(size_t size_in_bytes) {
@@ -140,6 +153,7 @@ DmlGpuEvent DmlPooledUploadHeap::BeginUploadToGpu(
   InvariantChecker checker(this);
 
   ReclaimAllocations();
+  execution_context_->ReleaseCompletedReferences();
 
   // Allocate space from the upload heap
   Chunk* chunk = nullptr;
@@ -149,11 +163,8 @@ DmlGpuEvent DmlPooledUploadHeap::BeginUploadToGpu(
   assert(chunk != nullptr);
   assert(offset_in_chunk + src.size() <= chunk->capacity_in_bytes);
 
-  // Map the upload heap and copy the source data into it at the specified offset
-  void* upload_heap_data = nullptr;
-  THROW_IF_FAILED(chunk->resource->Map(0, nullptr, &upload_heap_data));
-  memcpy(static_cast<byte*>(upload_heap_data) + offset_in_chunk, src.data(), src.size());
-  chunk->resource->Unmap(0, nullptr);
+  // Copy the source data into the upload heap at the specified offset
+  memcpy(chunk->mapped_data + offset_in_chunk, src.data(), src.size());
 
   // Copy from the upload heap into the destination resource
   execution_context_->CopyBufferRegion(
@@ -165,10 +176,13 @@ DmlGpuEvent DmlPooledUploadHeap::BeginUploadToGpu(
       D3D12_RESOURCE_STATE_GENERIC_READ,
       src.size());
 
+  // Keeps the destination alive until the copy is done, the caller may release it before then
+  execution_context_->QueueReference(dst);
+
   DmlGpuEvent done_event = execution_context_->GetCurrentCompletionEvent();
 
+  // Onnxruntime submits to the same queue, so the copy only has to be submitted ahead of its work
   execution_context_->Flush();
-  done_event.WaitForSignal();
 
   // Add an allocation entry to the chunk
   chunk->allocations.push_back(Allocation{static_cast<size_t>(src.size()), offset_in_chunk, done_event});
@@ -216,6 +230,7 @@ void DmlPooledUploadHeap::AssertInvariants() {
   for (const auto& chunk : chunks_) {
     assert(chunk.resource != nullptr);
     assert(chunk.capacity_in_bytes == chunk.resource->GetDesc().Width);
+    assert(chunk.mapped_data != nullptr);
   }
 
   // Validate allocation properties
@@ -11,13 +11,17 @@
 #include "dml_gpu_event.h"
 #include "dml_execution_context.h"
 
-// Implements a non-blocking, ring-buffer style upload heap for copying CPU data to GPU resources.
+// Implements a non-blocking, ring-buffer style upload heap for copying CPU data to GPU resources. Chunks stay mapped
+// for their lifetime and their space is reused once the GPU has passed the fence of the copy that used it, so once
+// the chunks have grown to the working set an upload neither creates a resource nor waits for the GPU.
 class DmlPooledUploadHeap {
  public:
   DmlPooledUploadHeap(ID3D12Device* device, DmlExecutionContext* execution_context);
+  ~DmlPooledUploadHeap();
 
   // Makes a copy of the source data and begins copying it into the destination resource, and returns a GpuEvent
-  // which will become signaled when the copy is complete. The destination resource must be a default or readback
+  // which will become signaled when the copy is complete. The copy is submitted to the queue but not waited for, work
+  // submitted to the same queue afterwards sees the data. The destination resource must be a default or readback
   // buffer.
   DmlGpuEvent BeginUploadToGpu(
       ID3D12Resource* dst,
@@ -50,6 +54,7 @@ class DmlPooledUploadHeap {
   struct Chunk {
     size_t capacity_in_bytes;  // The total size of the upload heap, in bytes
     ComPtr<ID3D12Resource> resource;
+    uint8_t* mapped_data;  // The resource is mapped once on creation, upload heaps don't need to be unmapped
 
     // Allocations are sorted by ascending fence value - that is, least to most recently allocated
     std::list<Allocation> allocations;
@@ -84,11 +84,13 @@ void DmlReadbackHeap::ReadbackFromGpu(
   execution_context_->GetCurrentCompletionEvent().WaitForSignal();
   execution_context_->ReleaseCompletedReferences();
 
-  // Map the readback heap and copy it into the destination
+  // Map only the range that was copied, so only it has to be made visible to the CPU, and nothing was written
+  D3D12_RANGE read_range{0, dst.size()};
+  D3D12_RANGE written_range{0, 0};
   void* readback_heap_data = nullptr;
-  THROW_IF_FAILED(readback_heap_->Map(0, nullptr, &readback_heap_data));
+  THROW_IF_FAILED(readback_heap_->Map(0, &read_range, &readback_heap_data));
   memcpy(dst.data(), readback_heap_data, dst.size());
-  readback_heap_->Unmap(0, nullptr);
+  readback_heap_->Unmap(0, &written_range);
 }
 
 void DmlReadbackHeap::ReadbackFromGpu(
@@ -131,8 +133,10 @@ void DmlReadbackHeap::ReadbackFromGpu(
   execution_context_->ReleaseCompletedReferences();
 
   // Map the readback heap and copy it into the destination
+  D3D12_RANGE read_range{0, total_size};
+  D3D12_RANGE written_range{0, 0};
   void* readback_heap_data = nullptr;
-  THROW_IF_FAILED(readback_heap_->Map(0, nullptr, &readback_heap_data));
+  THROW_IF_FAILED(readback_heap_->Map(0, &read_range, &readback_heap_data));
 
   // Copy from the source resource into the readback heap
   offset = 0;
@@ -141,5 +145,5 @@ void DmlReadbackHeap::ReadbackFromGpu(
     offset += dst_sizes[i];
   }
 
-  readback_heap_->Unmap(0, nullptr);
+  readback_heap_->Unmap(0, &written_range);
 }
\ No newline at end of file
@@ -0,0 +1,66 @@
+//------------------------------------------------------------------------------
+//
+//  Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//------------------------------------------------------------------------------
+
+#define ROOT_SIG_DEF "DescriptorTable(UAV(u0, numDescriptors=2, flags=DATA_VOLATILE | DESCRIPTORS_VOLATILE)), RootConstants(num32BitConstants=2, b0)"
+#define NUM_THREADS 256
+
+// One thread group per row: every thread scans a stride of the vocab, then the group reduces its best scores
+RWStructuredBuffer<float> logits : register(u0);
+RWStructuredBuffer<int> tokens : register(u1);
+
+cbuffer Constants
+{
+    uint vocab_size;
+    uint start_row;
+};
+
+groupshared float best_scores[NUM_THREADS];
+groupshared uint best_tokens[NUM_THREADS];
+
+[RootSignature(ROOT_SIG_DEF)]
+[numthreads(NUM_THREADS, 1, 1)]
+void CSMain(uint3 group_id : SV_GroupID, uint3 group_thread_id : SV_GroupThreadID)
+{
+    uint row = group_id.x + start_row;
+    uint thread = group_thread_id.x;
+    uint row_start = row * vocab_size;
+
+    // The lowest token wins a tie, like std::max_element
+    float best_score = -3.402823466e+38f;
+    uint best_token = vocab_size;
+    for (uint token = thread; token < vocab_size; token += NUM_THREADS)
+    {
+        float score = logits[row_start + token];
+        if (score > best_score)
+        {
+            best_score = score;
+            best_token = token;
+        }
+    }
+    best_scores[thread] = best_score;
+    best_tokens[thread] = best_token;
+    GroupMemoryBarrierWithGroupSync();
+
+    for (uint stride = NUM_THREADS / 2; stride > 0; stride /= 2)
+    {
+        if (thread < stride)
+        {
+            float other_score = best_scores[thread + stride];
+            uint other_token = best_tokens[thread + stride];
+            if (other_score > best_scores[thread] || (other_score == best_scores[thread] && other_token < best_tokens[thread]))
+            {
+                best_scores[thread] = other_score;
+                best_tokens[thread] = other_token;
+            }
+        }
+        GroupMemoryBarrierWithGroupSync();
+    }
+
+    if (thread == 0)
+    {
+        tokens[row] = best_tokens[0] < vocab_size ? best_tokens[0] : 0;
+    }
+}
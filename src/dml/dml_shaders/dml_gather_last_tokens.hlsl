@@ -0,0 +1,47 @@
+//------------------------------------------------------------------------------
+//
+//  Copyright (c) Microsoft Corporation. All rights reserved.
+//
+//------------------------------------------------------------------------------
+
+#define ROOT_SIG_DEF "DescriptorTable(UAV(u0, numDescriptors=3, flags=DATA_VOLATILE | DESCRIPTORS_VOLATILE)), RootConstants(num32BitConstants=4, b0)"
+#define NUM_THREADS 256
+
+// Copies the logits of the last token of every row out of the {rows, seq_len, vocab_size} logits into a
+// {rows, 1, vocab_size} fp32 output, casting from fp16 on the way when FP16 is defined
+#if FP16
+RWByteAddressBuffer logits : register(u0);
+#else
+RWStructuredBuffer<float> logits : register(u0);
+#endif
+RWStructuredBuffer<int> last_token_indices : register(u1);
+RWStructuredBuffer<float> output : register(u2);
+
+cbuffer Constants
+{
+    uint vocab_size;
+    uint seq_len;
+    uint element_count;
+    uint start_index;
+};
+
+[RootSignature(ROOT_SIG_DEF)]
+[numthreads(NUM_THREADS, 1, 1)]
+void CSMain(uint3 dispatch_thread_id : SV_DispatchThreadID)
+{
+    uint global_index = dispatch_thread_id.x + start_index;
+    if (global_index < element_count)
+    {
+        uint row = global_index / vocab_size;
+        uint token = global_index % vocab_size;
+        uint source_index = (row * seq_len + last_token_indices[row]) * vocab_size + token;
+#if FP16
+        // Two halves to a dword, the odd one is in the high bits
+        uint byte_offset = source_index * 2;
+        uint packed = logits.Load(byte_offset & ~3);
+        output[global_index] = f16tof32((byte_offset & 2) ? (packed >> 16) : packed);
+#else
+        output[global_index] = logits[source_index];
+#endif
+    }
+}
@@ -0,0 +1,140 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+// Embeddings: the prompt is run through the decoder once for its final hidden states only. The pasts are empty and
+// neither the presents nor the logits are asked for, so no kv cache or logits are allocated, and a model exported with
+// exclude_lm_head doesn't compute the lm head at all. The hidden states are pooled where the decoder left them.
+
+#include "generators.h"
+#include "models/model.h"
+#include "models/decoder_only.h"
+#include "models/utils.h"
+#if USE_CUDA
+#include "models/kernels.h"
+#endif
+
+namespace Generators {
+
+namespace {
+
+struct Embedding_State : State {
+  Embedding_State(const DecoderOnly_Model& model, RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params)
+      : State{params, model},
+        model_{model},
+        position_inputs_{model, *this, sequence_lengths} {
+    input_ids_.Add();
+    position_inputs_.Add();
+    extra_inputs_.Add();
+
+    auto& decoder = model.config_->model.decoder;
+    for (int i = 0; i < decoder.num_hidden_layers; i++) {
+      for (auto* names : {&decoder.inputs.past_key_names, &decoder.inputs.past_value_names}) {
+        char name[64];
+        snprintf(name, std::size(name), names->c_str(), i);
+        past_names_.emplace_back(name);
+      }
+    }
+    const std::array<int64_t, 4> past_shape{params.batch_size, decoder.num_key_value_heads, 0, decoder.head_size};
+    empty_past_ = OrtValue::CreateTensor(*model.allocator_device_, past_shape, model.session_info_->GetInputDataType(past_names_[0]));
+    for (auto& name : past_names_) {
+      input_names_.push_back(name.c_str());
+      inputs_.push_back(empty_past_.get());
+    }
+
+    const std::array<int64_t, 3> shape{params.batch_size, params.sequence_length, decoder.hidden_size};
+    hidden_states_ = OrtValue::CreateTensor(*model.allocator_device_, shape, model.session_info_->GetOutputDataType(decoder.outputs.hidden_states));
+    output_names_.push_back(decoder.outputs.hidden_states.c_str());
+    outputs_.push_back(hidden_states_.get());
+  }
+
+  RoamingArray<float> Run(int, RoamingArray<int32_t>, RoamingArray<int32_t>) override {
+    throw std::runtime_error("An embedding state has no logits, use RunHiddenStates");
+  }
+
+  // fp32 {batch_size, sequence_length, hidden_size} on the model's device
+  OrtValue& RunHiddenStates() {
+    State::Run(*model_.session_decoder_, params_->batch_size);
+    if (hidden_states_->GetTensorTypeAndShapeInfo()->GetElementType() == Ort::TypeToTensorType<float>::type)
+      return *hidden_states_;
+    ConvertFp16ToFp32(*model_.allocator_device_, *hidden_states_, hidden_states32_, model_.device_type_, model_.cuda_stream_);
+    return *hidden_states32_;
+  }
+
+ private:
+  const DecoderOnly_Model& model_;
+  InputIDs input_ids_{model_, *this};
+  PositionInputs position_inputs_;
+  ExtraInputs extra_inputs_{model_, *this};
+  std::vector<std::string> past_names_;
+  std::unique_ptr<OrtValue> empty_past_;  // Every past, a single run has nothing before the prompt
+  std::unique_ptr<OrtValue> hidden_states_, hidden_states32_;
+};
+
+}  // namespace
+
+std::vector<int32_t> GetPoolingRanges(const GeneratorParams& params, Pooling pooling) {
+  auto ranges = params.TokenRanges();
+  if (pooling == Pooling::LastToken) {
+    for (size_t row = 0; row < ranges.size() / 2; row++)
+      ranges[row * 2] = ranges[row * 2 + 1] - 1;
+  }
+  return ranges;
+}
+
+std::vector<float> EmbedSequences(const Model& model, const GeneratorParams& params, Pooling pooling) {
+  auto* decoder_only = dynamic_cast<const DecoderOnly_Model*>(&model);
+  if (!decoder_only)
+    throw std::runtime_error("Embeddings require a decoder only model, not " + model.config_->model.type);
+  if (!OnHost(model.device_type_) && model.device_type_ != DeviceType::CUDA)
+    throw std::runtime_error("Embeddings only support CPU and CUDA");
+  auto& decoder = model.config_->model.decoder;
+  if (!model.session_info_->HasOutput(decoder.outputs.hidden_states))
+    throw std::runtime_error("Embeddings need the model's " + decoder.outputs.hidden_states + " output, export it with include_hidden_states or exclude_lm_head");
+  char scale_name[64];
+  snprintf(scale_name, std::size(scale_name), decoder.inputs.past_key_scale_names.c_str(), 0);
+  if (model.session_info_->HasInput(scale_name) || model.session_info_->HasInput(decoder.inputs.last_token_indices))
+    throw std::runtime_error("Embeddings don't support models with a quantized kv cache or last_token_indices");
+  if (params.sequence_length < 1 || params.input_ids.size() != static_cast<size_t>(params.batch_size) * params.sequence_length)
+    throw std::runtime_error("input_ids size (" + std::to_string(params.input_ids.size()) + ") is not batch_size * sequence_length");
+
+  auto state_params = std::make_shared<GeneratorParams>(params);
+  state_params->external_owner_.reset();
+  state_params->search.num_beams = 1;
+  state_params->search.max_length = std::max(params.search.max_length, params.sequence_length);
+  state_params->use_cuda_graph = false;
+  std::vector<int32_t> sequence_lengths(params.batch_size);  // Written by the position inputs, pooling goes by the ranges
+  Embedding_State state{*decoder_only, cpu_span<int32_t>{sequence_lengths.data(), sequence_lengths.size()}, *state_params};
+  auto& hidden_states = state.RunHiddenStates();
+
+  const auto ranges = GetPoolingRanges(params, pooling);
+  const size_t hidden_size = decoder.hidden_size;
+  std::vector<float> embeddings(params.batch_size * hidden_size);
+#if USE_CUDA
+  if (model.device_type_ == DeviceType::CUDA) {
+    auto ranges_gpu = CudaMallocArray<int32_t>(ranges.size());
+    auto embeddings_gpu = CudaMallocArray<float>(embeddings.size());
+    cudaMemcpyAsync(ranges_gpu.get(), ranges.data(), ranges.size() * sizeof(int32_t), cudaMemcpyHostToDevice, model.cuda_stream_);
+    cuda::LaunchPoolHiddenStates(embeddings_gpu.get(), hidden_states.GetTensorData<float>(), ranges_gpu.get(), params.batch_size, params.sequence_length,
+                                 decoder.hidden_size, model.cuda_stream_);
+    cudaMemcpyAsync(embeddings.data(), embeddings_gpu.get(), embeddings.size() * sizeof(float), cudaMemcpyDeviceToHost, model.cuda_stream_);
+    cudaStreamSynchronize(model.cuda_stream_);
+    return embeddings;
+  }
+#endif
+
+  const float* states = hidden_states.GetTensorData<float>();
+  for (int row = 0; row < params.batch_size; row++) {
+    const int begin = ranges[row * 2], end = ranges[row * 2 + 1];
+    auto embedding = std::span<float>(embeddings.data() + row * hidden_size, hidden_size);
+    for (int position = begin; position < end; position++) {
+      const float* state = states + (static_cast<size_t>(row) * params.sequence_length + position) * hidden_size;
+      for (size_t i = 0; i < hidden_size; i++)
+        embedding[i] += state[i];
+    }
+    for (auto& value : embedding)
+      value /= static_cast<float>(end - begin);
+  }
+  return embeddings;
+}
+
+}  // namespace Generators
@@ -19,6 +19,8 @@
 
 #include <sys/stat.h>
 
+#include <cstdint>
+#include <cstdio>
 #include <string>
 #include <fstream>
 
@@ -98,6 +100,52 @@ class path {
 #endif  // _WIN32
   }
 
+  bool create_directory() const {  // False if it already exists
+#ifdef _WIN32
+    return CreateDirectoryW(wpath_.c_str(), nullptr) != 0;
+#else
+    return mkdir(path_.c_str(), 0755) == 0;
+#endif
+  }
+
+  bool rename(const path& new_path) const {  // Replaces new_path if it exists
+#ifdef _WIN32
+    return MoveFileExW(wpath_.c_str(), new_path.wpath_.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return std::rename(path_.c_str(), new_path.path_.c_str()) == 0;
+#endif
+  }
+
+  bool remove() const {
+#ifdef _WIN32
+    return DeleteFileW(wpath_.c_str()) != 0;
+#else
+    return std::remove(path_.c_str()) == 0;
+#endif
+  }
+
+  // The size and last write time, which tell a replaced file apart without reading it. False if it doesn't exist.
+  bool size_and_time(int64_t& size, int64_t& time) const {
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExW(wpath_.c_str(), GetFileExInfoStandard, &data))
+      return false;
+    size = (static_cast<int64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+    time = (static_cast<int64_t>(data.ftLastWriteTime.dwHighDateTime) << 32) | data.ftLastWriteTime.dwLowDateTime;
+#else
+    struct stat info;
+    if (stat(path_.c_str(), &info) != 0)
+      return false;
+    size = static_cast<int64_t>(info.st_size);
+#ifdef __APPLE__
+    time = static_cast<int64_t>(info.st_mtimespec.tv_sec) * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+    time = static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+#endif  // _WIN32
+    return true;
+  }
+
   bool exists() const {
 #ifdef _WIN32
     const int ret = GetFileAttributesW(wpath_.c_str());
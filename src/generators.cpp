@@ -8,6 +8,9 @@
 #if USE_CUDA
 #include "search_cuda.h"
 #endif
+#if USE_NVTX
+#include <nvtx3/nvToolsExt.h>
+#endif
 
 namespace Generators {
 
@@ -21,6 +24,7 @@ std::unique_ptr<OrtGlobals>& GetOrtGlobals() {
 }
 
 void Shutdown() {
+  SetLogBool("async", false);  // Writes the queued entries, the log's thread is gone before the library is
   GetOrtGlobals().reset();
 }
 
@@ -28,10 +32,43 @@ OrtEnv& GetOrtEnv() {
   return *GetOrtGlobals()->env_;
 }
 
+void Cancellation::Cancel(bool terminate_runs) {
+  cancelled_ = true;
+  if (!terminate_runs)
+    return;
+  std::lock_guard lock{mutex_};
+  terminate_runs_ = true;
+  for (auto* run_options : runs_)
+    run_options->SetTerminate();
+}
+
+void Cancellation::AddRun(OrtRunOptions& run_options) {
+  std::lock_guard lock{mutex_};
+  runs_.push_back(&run_options);
+  if (terminate_runs_)  // Cancelled since the run checked
+    run_options.SetTerminate();
+}
+
+void Cancellation::RemoveRun(OrtRunOptions& run_options) {
+  std::lock_guard lock{mutex_};
+  runs_.erase(std::find(runs_.begin(), runs_.end(), &run_options));
+}
+
+Cancellation::Run::Run(Cancellation* cancellation, OrtRunOptions& run_options) : cancellation_{cancellation}, run_options_{run_options} {
+  for (auto* c = cancellation_; c; c = c->parent_.get())
+    c->AddRun(run_options_);
+}
+
+Cancellation::Run::~Run() {
+  for (auto* c = cancellation_; c; c = c->parent_.get())
+    c->RemoveRun(run_options_);
+}
+
 GeneratorParams::GeneratorParams(const Model& model)
     : search{model.config_->search},
       pad_token_id{model.config_->model.pad_token_id},
       eos_token_id{model.config_->model.eos_token_id},
+      eos_token_ids{model.config_->model.eos_token_ids.begin(), model.config_->model.eos_token_ids.end()},
       vocab_size{model.config_->model.vocab_size},
       hidden_size{model.config_->model.decoder.hidden_size},
       device_type{model.device_type_},
@@ -44,8 +81,39 @@ GeneratorParams::GeneratorParams(const Model& model)
   }
 }
 
+bool GeneratorParams::IsFor(const Model& model) const {
+  return !config_ || config_ == model.config_.get();
+}
+
+Config::Search& GeneratorParams::SetRowSearch(int batch_index) {
+  if (batch_index < 0)
+    throw std::runtime_error("Search options row must be 0 or greater, is " + std::to_string(batch_index));
+  if (batch_index >= static_cast<int>(row_search.size())) {
+    auto row = search;
+    row.random_seed = -1;  // The batch's stream until the row gets a seed of its own, see MakeRandomRows
+    row_search.resize(batch_index + 1, row);
+  }
+  return row_search[batch_index];
+}
+
+void GeneratorParams::SetRowAdapter(int batch_index, std::string name) {
+  if (batch_index < 0)
+    throw std::runtime_error("Adapter row must be 0 or greater, is " + std::to_string(batch_index));
+  if (batch_index >= static_cast<int>(row_adapters.size()))
+    row_adapters.resize(batch_index + 1, adapter);
+  row_adapters[batch_index] = std::move(name);
+}
+
+int GeneratorParams::RowLengthLimit(int batch_index, int start_length) const {
+  auto& row = RowSearch(batch_index);
+  int limit = row.max_length > 0 ? std::min(row.max_length, search.max_length) : search.max_length;
+  if (row.max_new_tokens > 0)
+    limit = std::min(limit, start_length + row.max_new_tokens);
+  return limit;
+}
+
 void GeneratorParams::TryGraphCapture(int max_bs) {
-  if (!is_cuda_graph_enabled_ || device_type == DeviceType::CPU) {
+  if (!is_cuda_graph_enabled_ || OnHost(device_type)) {
     // no-op
     return;
   }
@@ -61,6 +129,70 @@ void GeneratorParams::TryGraphCapture(int max_bs) {
   }
 }
 
+static int RoundUpToPowerOfTwo(int value) {
+  int bucket = 1;
+  while (bucket < value)
+    bucket *= 2;
+  return bucket;
+}
+
+int GeneratorParams::GraphMaxBatchSize() const {
+  if (!use_cuda_graph || !config_ || !config_->model.decoder.graph_capture.bucketed)
+    return max_batch_size;
+  return RoundUpToPowerOfTwo(max_batch_size);
+}
+
+int GeneratorParams::BufferMaxLength() const {
+  if (!use_cuda_graph || !config_ || !config_->model.decoder.graph_capture.bucketed)
+    return search.max_length;
+  int bucket = RoundUpToPowerOfTwo(search.max_length);
+  return config_->model.context_length > 0 ? std::min(bucket, std::max(config_->model.context_length, search.max_length)) : bucket;
+}
+
+void GeneratorParams::SetPackedInputs(std::span<const int32_t> tokens, std::span<const int32_t> lengths, bool left) {
+  if (lengths.empty())
+    throw std::runtime_error("SetPackedInputs needs the length of at least one row");
+
+  std::vector<std::span<const int32_t>> rows;
+  size_t offset = 0;
+  for (auto length : lengths) {
+    if (length <= 0)
+      throw std::runtime_error("SetPackedInputs needs at least one token in every row");
+    if (offset + length > tokens.size())
+      throw std::runtime_error("SetPackedInputs lengths add up to more than the " + std::to_string(tokens.size()) + " tokens");
+    rows.push_back(tokens.subspan(offset, length));
+    offset += length;
+  }
+  if (offset != tokens.size())
+    throw std::runtime_error("SetPackedInputs lengths add up to " + std::to_string(offset) + " tokens, not " + std::to_string(tokens.size()));
+
+  input_ids_owner = PadInputs(rows, pad_token_id, left);
+  input_ids = input_ids_owner;
+  batch_size = static_cast<int>(lengths.size());
+  sequence_length = static_cast<int>(input_ids_owner.size() / lengths.size());
+  input_lengths.assign(lengths.begin(), lengths.end());
+  pad_left = left;
+}
+
+std::vector<int32_t> GeneratorParams::TokenRanges() const {
+  std::vector<int32_t> ranges(static_cast<size_t>(batch_size) * 2);
+  for (int row = 0; row < batch_size; row++) {
+    int begin = 0, end = sequence_length;
+    if (!input_lengths.empty()) {
+      (pad_left ? begin : end) = pad_left ? sequence_length - input_lengths[row] : input_lengths[row];
+    } else {
+      const int32_t* ids = input_ids.data() + static_cast<size_t>(row) * sequence_length;
+      while (end > 1 && ids[end - 1] == pad_token_id)
+        end--;
+      while (begin < end - 1 && ids[begin] == pad_token_id)
+        begin++;
+    }
+    ranges[row * 2] = begin;
+    ranges[row * 2 + 1] = end;
+  }
+  return ranges;
+}
+
 void GeneratorParams::SetInputs(const NamedTensors& named_tensors) {
   for (const auto& [name, tensor] : named_tensors) {
     if (name == Config::Defaults::InputIdsName) {
@@ -77,10 +209,35 @@ void GeneratorParams::SetInputs(const NamedTensors& named_tensors) {
   }
 }
 
+void GeneratorParams::SetEncoderInputs(std::span<const int32_t> encoder_input_ids, int encoder_sequence_length, int rows) {
+  if (rows < 1 || encoder_sequence_length < 1 || encoder_input_ids.size() != static_cast<size_t>(rows) * encoder_sequence_length)
+    throw std::runtime_error("sequence length * batch size is not equal to the encoder input ids count of " + std::to_string(encoder_input_ids.size()));
+  // A decoder prompt defaulted for earlier encoder ids is made again for these, as a second Prepare() in Python does
+  if (decoder_prompt_defaulted_ && input_ids.data() == input_ids_owner.data() && sequence_length == 1)
+    input_ids = {};
+  decoder_prompt_defaulted_ = false;
+  if (!input_ids.empty() && rows != batch_size)
+    throw std::runtime_error("The encoder input ids have " + std::to_string(rows) + " rows, the decoder's have " + std::to_string(batch_size));
+
+  inputs = EncoderDecoder{encoder_input_ids, encoder_sequence_length};
+  if (input_ids.empty()) {
+    input_ids_owner.assign(rows, config_->model.decoder_start_token_id);
+    input_ids = input_ids_owner;
+    sequence_length = 1;
+    input_lengths.clear();
+    decoder_prompt_defaulted_ = true;
+  }
+  batch_size = rows;
+}
+
 std::unique_ptr<Generator> CreateGenerator(const Model& model, const GeneratorParams& params) {
   return std::make_unique<Generator>(model, params);
 }
 
+std::unique_ptr<Generator> LoadGenerator(const Model& model, const GeneratorParams& params, const std::string& snapshot_path) {
+  return std::make_unique<Generator>(model, params, snapshot_path);
+}
+
 std::unique_ptr<Search> CreateSearch(const GeneratorParams& params) {
 #if USE_CUDA
   if (params.device_type == DeviceType::CUDA) {
@@ -96,10 +253,18 @@ std::unique_ptr<Search> CreateSearch(const GeneratorParams& params) {
   return std::make_unique<GreedySearch_Cpu>(params);
 }
 
-Generator::Generator(const Model& model, const GeneratorParams& params) : model_{model.shared_from_this()} {
+static void CheckGeneratorParams(const Model& model, const GeneratorParams& params) {
+  // The params carry the device and stream of the model they were made for, a replica on another device can't use them
+  if (!params.IsFor(model))
+    throw std::runtime_error("The generator params were created for a different model, create them from the model that runs them");
   if (params.search.max_length == 0)
     throw std::runtime_error("search max_length is 0");
-  if (params.search.max_length > model.config_->model.context_length)
+  auto& kv_cache = model.config_->model.decoder.kv_cache;
+  if (kv_cache.window_size > 0) {
+    // Streaming keeps the kv bounded, so only the kv has to fit in the context
+    if (kv_cache.sink_size < 0 || kv_cache.sink_size + kv_cache.window_size >= model.config_->model.context_length)
+      throw std::runtime_error("kv_cache sink_size + window_size (" + std::to_string(kv_cache.sink_size + kv_cache.window_size) + ") must be less than model context_length (" + std::to_string(model.config_->model.context_length) + ")");
+  } else if (params.search.max_length > model.config_->model.context_length)
     throw std::runtime_error("max_length (" + std::to_string(params.search.max_length) + ") cannot be greater than model context_length (" + std::to_string(model.config_->model.context_length) + ")");
   if (params.batch_size < 1)
     throw std::runtime_error("batch_size must be 1 or greater, is " + std::to_string(params.batch_size));
@@ -107,40 +272,521 @@ Generator::Generator(const Model& model, const GeneratorParams& params) : model_
     throw std::runtime_error("vocab_size must be 1 or greater, is " + std::to_string(params.vocab_size));
   if (params.sequence_length >= params.search.max_length)
     throw std::runtime_error("input sequence_length (" + std::to_string(params.sequence_length) + ") is >= max_length (" + std::to_string(params.search.max_length) + ")");
+  if (params.search.no_repeat_ngram_size < 0)
+    throw std::runtime_error("no_repeat_ngram_size must be 0 or greater, is " + std::to_string(params.search.no_repeat_ngram_size));
+  if (params.search.diversity_penalty != 0.0f && params.search.num_beams == 1)
+    throw std::runtime_error("diversity_penalty only applies to beam search, num_beams must be greater than 1");
+  if (params.search.diversity_penalty != 0.0f && params.search.num_beams > 32)
+    throw std::runtime_error("diversity_penalty supports at most 32 beams, num_beams is " + std::to_string(params.search.num_beams));
+  if (params.search.top_logprobs < 0 || params.search.top_logprobs > 64)
+    throw std::runtime_error("top_logprobs must be between 0 and 64, is " + std::to_string(params.search.top_logprobs));
+  if (params.search.top_logprobs > 0 && params.search.num_beams != 1)
+    throw std::runtime_error("top_logprobs only supports greedy search and sampling, num_beams must be 1");
+  if (params.search.num_return_sequences < 1)
+    throw std::runtime_error("num_return_sequences must be 1 or greater, is " + std::to_string(params.search.num_return_sequences));
+  if (params.search.num_return_sequences > 1 && params.search.num_beams == 1 && params.search.do_sample) {
+    // The samples are extra batch rows, which only input_ids and the per row options are repeated for. Encoder inputs
+    // stay at the prompt count, the encoder-decoder models copy their outputs to the samples.
+    auto* whisper = std::get_if<GeneratorParams::Whisper>(&params.inputs);
+    if (!params.extra_inputs.empty() || (whisper && whisper->input_features))
+      throw std::runtime_error("Sampling num_return_sequences doesn't support extra model inputs");
+    if (params.use_cuda_graph && params.batch_size * params.search.num_return_sequences > params.max_batch_size)
+      throw std::runtime_error("Sampling num_return_sequences makes the batch " + std::to_string(params.batch_size * params.search.num_return_sequences) +
+                               " rows, more than the graph's max_batch_size of " + std::to_string(params.max_batch_size));
+  }
+
+  auto check_token = [&](int32_t token, const char* what) {
+    if (token < 0 || token >= params.vocab_size)
+      throw std::runtime_error(std::string(what) + " token " + std::to_string(token) + " is outside of the vocab_size " + std::to_string(params.vocab_size));
+  };
+  for (auto& [token, bias] : params.logit_bias)
+    check_token(token, "logit_bias");
+  for (auto& bad_word : params.bad_words) {
+    if (bad_word.empty())
+      throw std::runtime_error("bad_words contains an empty sequence");
+    for (auto token : bad_word)
+      check_token(token, "bad_words");
+  }
+
+  for (auto& stop_sequence : params.stop_sequences) {
+    if (stop_sequence.empty())
+      throw std::runtime_error("stop_sequences contains an empty sequence");
+    for (auto token : stop_sequence)
+      check_token(token, "stop_sequences");
+  }
+  if (params.search.num_beams != 1 && (!params.stop_sequences.empty() || params.search.max_new_tokens > 0))
+    throw std::runtime_error("Stop sequences and max_new_tokens only support greedy search and sampling, num_beams must be 1");
+  if (params.search.num_beams != 1 && params.search.compact_finished_rows)
+    throw std::runtime_error("compact_finished_rows only supports greedy search and sampling, num_beams must be 1");
+
+  if (!params.row_search.empty()) {
+    if (params.search.num_beams != 1)
+      throw std::runtime_error("Per row search options only support greedy search and sampling, num_beams must be 1");
+    if (static_cast<int>(params.row_search.size()) > params.batch_size)
+      throw std::runtime_error("There are search options for " + std::to_string(params.row_search.size()) + " rows, but the batch_size is " + std::to_string(params.batch_size));
+    for (auto& row : params.row_search) {
+      if (row.top_p < 0.0f || row.top_p > 1.0f)
+        throw std::runtime_error("top_p must be between 0.0 and 1.0");
+      if (row.top_k < 0)
+        throw std::runtime_error("top_k must be 0 or greater");
+    }
+  }
+
+  // Every tensor parallel rank runs the same search on the same logits, only a fixed seed keeps the samples in step
+  if (model.config_->model.decoder.world_size > 1 && params.search.do_sample && params.search.random_seed == -1)
+    throw std::runtime_error("Sampling with a tensor parallel decoder needs a random_seed so every rank picks the same tokens");
+
+  if (params.grammar) {
+    if (params.search.num_beams != 1)
+      throw std::runtime_error("Constrained decoding only supports greedy search and sampling, num_beams must be 1");
+    if (params.grammar->VocabSize() != params.vocab_size)
+      throw std::runtime_error("The grammar is for a vocab_size of " + std::to_string(params.grammar->VocabSize()) + ", not " + std::to_string(params.vocab_size));
+  }
+}
 
+Generator::Generator(const Model& model, const GeneratorParams& params_in)
+    : model_{model.shared_from_this()},
+      params_in_{params_in.shared_from_this()} {
+  TraceScope trace{"create_generator", this};
+  model.SetCurrentDevice();
+  CheckGeneratorParams(model, params_in);
+  memory_.emplace(model.GetMemoryBudget(), model.EstimateMemory(params_in));
+  auto& params = ExpandSamples(UseCancellation(UseOwnStream(params_in)));
+  SetDeadline(params);
   search_ = CreateSearch(params);
-  state_ = model.CreateState(search_->GetSequenceLengths(), params);
+  try {
+    state_ = model.CreateState(search_->GetSequenceLengths(), params);
+  } catch (...) {
+    if (!cancellation_->IsCancelled())
+      throw;
+    // Cancelled while CreateState ran the prompt, the generator is done without a state
+  }
+  model.generator_count_++;
+}
+
+State& Generator::GetState() const {
+  if (!state_)
+    throw std::runtime_error("The generator was cancelled before its prompt ran");
+  return *state_;
+}
+
+Generator::~Generator() {
+  model_->generator_count_--;
+#if USE_CUDA
+  if (stream_)
+    model_->ReleaseStream(std::move(stream_));
+#endif
+}
+
+// A copy of params on a stream of our own, when the model hands them out
+const GeneratorParams& Generator::UseOwnStream(const GeneratorParams& params) {
+#if USE_CUDA
+  if (model_->config_->model.decoder.generator_streams && model_->device_type_ == DeviceType::CUDA) {
+    stream_ = model_->AcquireStream();
+    stream_params_ = std::make_shared<GeneratorParams>(params);
+    stream_params_->external_owner_.reset();
+    stream_params_->cuda_stream = *stream_;
+    return *stream_params_;
+  }
+#endif
+  return params;
+}
+
+// A copy of params with a cancellation of our own, under the one the caller shares through them if any. The states see
+// it through their params, so every session run of the generator can be terminated.
+const GeneratorParams& Generator::UseCancellation(const GeneratorParams& params) {
+  cancellation_ = std::make_shared<Cancellation>(params.cancellation);
+  cancellation_params_ = std::make_shared<GeneratorParams>(params);
+  cancellation_params_->external_owner_.reset();
+  cancellation_params_->cancellation = cancellation_;
+  return *cancellation_params_;
+}
+
+void Generator::SetDeadline(const GeneratorParams& params) {
+  if (params.search.timeout_ms > 0)
+    deadline_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(params.search.timeout_ms);
+}
+
+// Sampling with num_return_sequences: a copy of params whose batch has the samples of every prompt next to each other,
+// so sequence i * num_return_sequences + j is sample j of prompt i like the sequences beam search returns
+const GeneratorParams& Generator::ExpandSamples(const GeneratorParams& params) {
+  const int copies = params.search.num_return_sequences;
+  if (copies == 1 || params.search.num_beams != 1 || !params.search.do_sample)
+    return params;
+
+  sample_params_ = std::make_shared<GeneratorParams>(params);
+  auto& samples = *sample_params_;
+  samples.external_owner_.reset();
+  samples.batch_size = params.batch_size * copies;
+  samples.prompt_copies = copies;
+  samples.input_ids_owner.clear();
+  samples.input_lengths.clear();
+  samples.row_search.clear();
+  samples.row_adapters.clear();
+  for (int i = 0; i < params.batch_size; i++) {
+    auto prompt = params.input_ids.subspan(static_cast<size_t>(i) * params.sequence_length, params.sequence_length);
+    for (int j = 0; j < copies; j++) {
+      samples.input_ids_owner.insert(samples.input_ids_owner.end(), prompt.begin(), prompt.end());
+      if (!params.input_lengths.empty())
+        samples.input_lengths.push_back(params.input_lengths[i]);
+      if (!params.row_adapters.empty())
+        samples.row_adapters.push_back(params.RowAdapter(i));
+      if (!params.row_search.empty()) {
+        auto& row = samples.row_search.emplace_back(params.RowSearch(i));
+        // A row seeded on its own would draw the same sample in every copy
+        if (j > 0 && row.random_seed != -1)
+          row.random_seed += j;
+      }
+    }
+  }
+  samples.input_ids = samples.input_ids_owner;
+  return samples;
+}
+
+// Generator snapshot layout: the header, the sequence, the search state, then the model state (see State::Save), whose
+// kv data is page aligned
+struct SnapshotHeader {
+  char magic[8]{'O', 'G', 'A', 'S', 'N', 'A', 'P', '1'};
+  int32_t vocab_size{};  // Catches restoring into a different model
+  int32_t sequence_length{};
+};
+
+Generator::Generator(const Model& model, const GeneratorParams& params, const std::string& snapshot_path) : model_{model.shared_from_this()} {
+  model.SetCurrentDevice();
+  auto file = fs::path(snapshot_path).open(std::ios::binary);
+  if (!file)
+    throw std::runtime_error("Failed to open the generator snapshot " + snapshot_path);
+
+  SnapshotHeader header, expected;
+  file.read(reinterpret_cast<char*>(&header), sizeof(header));
+  if (!file || !std::equal(std::begin(header.magic), std::end(header.magic), std::begin(expected.magic)))
+    throw std::runtime_error(snapshot_path + " is not a generator snapshot");
+  if (header.vocab_size != params.vocab_size)
+    throw std::runtime_error("The generator snapshot is for a model with vocab_size " + std::to_string(header.vocab_size) + ", not " + std::to_string(params.vocab_size));
+  if (header.sequence_length < 1 || header.sequence_length >= params.search.max_length)
+    throw std::runtime_error("The generator snapshot has sequence_length " + std::to_string(header.sequence_length) + ", which isn't within 1 and max_length (" + std::to_string(params.search.max_length) + ")");
+
+  // The saved sequence is the prompt, the state only runs what isn't in the saved kv
+  auto restored = std::make_shared<GeneratorParams>(params);
+  restored->external_owner_.reset();
+  restored->input_ids_owner.resize(header.sequence_length);
+  file.read(reinterpret_cast<char*>(restored->input_ids_owner.data()), header.sequence_length * sizeof(int32_t));
+  if (!file)
+    throw std::runtime_error("The generator snapshot is corrupt");
+  restored->input_ids = restored->input_ids_owner;
+  restored->batch_size = 1;
+  restored->sequence_length = header.sequence_length;
+  CheckGeneratorParams(model, *restored);
+  memory_.emplace(model.GetMemoryBudget(), model.EstimateMemory(*restored));
+  restored->cuda_stream = UseOwnStream(*restored).cuda_stream;
+  cancellation_ = restored->cancellation = std::make_shared<Cancellation>(params.cancellation);
+  SetDeadline(*restored);
+
+  search_ = CreateSearch(*restored);
+  search_->Load(file);
+  state_ = model.LoadState(search_->GetSequenceLengths(), *restored, file);
+  model.generator_count_++;
+}
+
+void Generator::Save(const std::string& path) const {
+  if (computed_logits_)
+    throw std::runtime_error("Save can't be called in the middle of processing logits, call GenerateNextToken first");
+  if (swapped_out_)
+    throw std::runtime_error("Save called on a swapped out generator, call SwapIn first");
+  auto& params = *search_->params_;
+  if (params.batch_size != 1 || params.search.num_beams != 1)
+    throw std::runtime_error("Save only supports batch_size 1 and num_beams 1");
+
+  auto sequence = search_->GetSequence(0).GetCPU();
+  SnapshotHeader header;
+  header.vocab_size = params.vocab_size;
+  header.sequence_length = static_cast<int32_t>(sequence.size());
+
+  auto file = fs::path(path).open_for_write(std::ios::binary);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(sequence.data()), sequence.size_bytes());
+  search_->Save(file);
+  GetState().Save(file);
+  if (!file)
+    throw std::runtime_error("Failed to write the generator snapshot to " + path);
+}
+
+std::unique_ptr<Generator> Generator::Fork(const GeneratorParams& params) const {
+  if (computed_logits_)
+    throw std::runtime_error("Fork can't be called in the middle of processing logits, call GenerateNextToken first");
+  if (swapped_out_)
+    throw std::runtime_error("Fork called on a swapped out generator, call SwapIn first");
+  auto& own_params = *search_->params_;
+  if (own_params.batch_size != 1 || own_params.search.num_beams != 1)
+    throw std::runtime_error("Fork only supports batch_size 1 and num_beams 1");
+  if (IsDone())
+    throw std::runtime_error("Fork called on a generator that is done");
+  if (params.search.num_beams != 1)
+    throw std::runtime_error("Fork only supports greedy search and sampling, num_beams must be 1");
+  if (params.grammar)
+    throw std::runtime_error("Fork doesn't support constrained decoding, the grammar would start over at the fork");
+  return std::unique_ptr<Generator>(new Generator(*this, params));
+}
+
+// The sequence so far is the fork's prompt, the state only runs what isn't in the parent's kv
+Generator::Generator(const Generator& parent, const GeneratorParams& params) : model_{parent.model_} {
+  auto& model = *model_;
+  model.SetCurrentDevice();
+  auto sequence = parent.search_->GetSequence(0).GetCPU();
+  auto forked = std::make_shared<GeneratorParams>(params);
+  forked->external_owner_.reset();
+  forked->input_ids_owner.assign(sequence.begin(), sequence.end());
+  forked->input_ids = forked->input_ids_owner;
+  forked->input_lengths.clear();
+  forked->batch_size = 1;
+  forked->sequence_length = static_cast<int>(sequence.size());
+  CheckGeneratorParams(model, *forked);
+  memory_.emplace(model.GetMemoryBudget(), model.EstimateMemory(*forked));
+  forked->cuda_stream = UseOwnStream(*forked).cuda_stream;
+  cancellation_ = forked->cancellation = std::make_shared<Cancellation>(params.cancellation);
+  SetDeadline(*forked);
+
+  search_ = CreateSearch(*forked);
+  state_ = parent.GetState().Fork(search_->GetSequenceLengths(), *forked);
+  model.generator_count_++;
+}
+
+std::unique_ptr<Generator> Generator::Merge(std::span<Generator* const> generators, std::span<const std::vector<int32_t>> rows,
+                                            const GeneratorParams& params) {
+  if (generators.empty() || generators.size() != rows.size())
+    throw std::runtime_error("Merge needs the rows of every generator");
+  if (params.search.num_beams != 1 || params.grammar || params.search.compact_finished_rows)
+    throw std::runtime_error("Merge only supports num_beams 1 without constrained decoding or compact_finished_rows");
+  for (size_t i = 0; i < generators.size(); i++) {
+    auto& generator = *generators[i];
+    auto& own_params = *generator.search_->params_;
+    if (generator.model_ != generators[0]->model_)
+      throw std::runtime_error("Merge needs the generators of one model");
+    if (!generator.prefilled_ || generator.computed_logits_)
+      throw std::runtime_error("Merge needs generators that have generated a token, call GenerateNextToken first");
+    if (generator.swapped_out_)
+      throw std::runtime_error("Merge called on a swapped out generator, call SwapIn first");
+    if (own_params.search.num_beams != 1 || own_params.grammar || own_params.search.compact_finished_rows)
+      throw std::runtime_error("Merge only supports num_beams 1 without constrained decoding or compact_finished_rows");
+    for (auto row : rows[i]) {
+      if (row < 0 || row >= own_params.batch_size)
+        throw std::runtime_error("Merge row " + std::to_string(row) + " is out of range");
+    }
+  }
+  return std::unique_ptr<Generator>(new Generator(generators, rows, params));
+}
+
+// The merged sequences are a left padded prompt whose kv, up to the last generated token, is already there
+Generator::Generator(std::span<Generator* const> generators, std::span<const std::vector<int32_t>> rows, const GeneratorParams& params)
+    : model_{generators[0]->model_} {
+  auto& model = *model_;
+  model.SetCurrentDevice();
+  std::vector<std::vector<int32_t>> sequences;
+  for (size_t i = 0; i < generators.size(); i++) {
+    for (auto row : rows[i]) {
+      auto sequence = generators[i]->search_->GetSequence(row).GetCPU();
+      sequences.emplace_back(sequence.begin(), sequence.end());
+    }
+  }
+  std::vector<std::span<const int32_t>> spans{sequences.begin(), sequences.end()};
+
+  auto merged = std::make_shared<GeneratorParams>(params);
+  merged->external_owner_.reset();
+  merged->input_ids_owner = PadInputs(spans, params.pad_token_id, true);
+  merged->input_ids = merged->input_ids_owner;
+  merged->input_lengths.clear();
+  merged->batch_size = static_cast<int>(sequences.size());
+  merged->sequence_length = static_cast<int>(merged->input_ids_owner.size()) / merged->batch_size;
+  CheckGeneratorParams(model, *merged);
+
+  // The memory of the merged generators moves to this one. They get it back if it doesn't fit or the model can't
+  // merge them, which it checks before taking any kv.
+  for (auto* generator : generators)
+    generator->memory_.reset();
+  try {
+    memory_.emplace(model.GetMemoryBudget(), model.EstimateMemory(*merged));
+    merged->cuda_stream = UseOwnStream(*merged).cuda_stream;
+    cancellation_ = merged->cancellation = std::make_shared<Cancellation>(params.cancellation);
+    SetDeadline(*merged);
+
+    search_ = CreateSearch(*merged);
+    std::vector<State*> states;
+    for (auto* generator : generators)
+      states.push_back(&generator->GetState());
+    state_ = model.MergeStates(states, rows, search_->GetSequenceLengths(), *merged);
+  } catch (...) {
+    memory_.reset();
+    for (auto* generator : generators)
+      generator->memory_.emplace(model.GetMemoryBudget(), model.EstimateMemory(*generator->search_->params_));
+    throw;
+  }
+  prefilled_ = true;
+  model.generator_count_++;
+}
+
+// A profiler range around a generator step in USE_NVTX builds
+struct NvtxRange {
+#if USE_NVTX
+  NvtxRange(const char* name) { nvtxRangePushA(name); }
+  ~NvtxRange() { nvtxRangePop(); }
+#else
+  NvtxRange(const char*) {}
+#endif
+};
+
+static double SecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Adds the time and the transfers of a step to the metrics, however the step is left
+struct MetricsScope {
+  MetricsScope(GeneratorMetrics& metrics, double* seconds = nullptr) : metrics_{metrics}, seconds_{seconds}, counters_{g_transfer_counters} {}
+  ~MetricsScope() {
+    if (seconds_)
+      *seconds_ += SecondsSince(start_);
+    metrics_.host_to_device_bytes += g_transfer_counters.host_to_device_bytes - counters_.host_to_device_bytes;
+    metrics_.device_to_host_bytes += g_transfer_counters.device_to_host_bytes - counters_.device_to_host_bytes;
+    metrics_.device_allocations += g_transfer_counters.device_allocations - counters_.device_allocations;
+  }
+
+ private:
+  GeneratorMetrics& metrics_;
+  double* seconds_;
+  TransferCounters counters_;
+  std::chrono::steady_clock::time_point start_{std::chrono::steady_clock::now()};
+};
+
+// Steps whose logits are only read to pick the next token, with no penalties, masks or biases applied to them first
+static bool IsPlainStep(const Search& search) {
+  auto& params = *search.params_;
+  auto& s = params.search;
+  return s.num_beams == 1 && params.row_search.empty() && s.repetition_penalty == 1.0f &&
+         s.frequency_penalty == 0.0f && s.presence_penalty == 0.0f && s.no_repeat_ngram_size == 0 && params.bad_words.empty() &&
+         params.logit_bias.empty() && !search.grammar_ && s.top_logprobs == 0 && !(g_log.enabled && g_log.model_logits);
+}
+
+// Greedy steps that only take the argmax of the logits, as nothing but min_length is applied to them first
+static bool IsPlainGreedyStep(const Search& search) {
+  auto& s = search.params_->search;
+  return IsPlainStep(search) && (!s.do_sample || s.top_k == 1);
+}
+
+// Past min_length the eos folding in Logits::Get is all the processing a plain sampling step has
+static bool IsPlainSampleStep(const Search& search) {
+  auto& s = search.params_->search;
+  return IsPlainStep(search) && s.do_sample && s.top_k != 1 && search.GetSequenceLength() >= s.min_length;
+}
+
+// DML picks the top tokens with its own kernel, CPU models can have an argmax in the graph (see Logits::Update)
+static bool CanSelectTopOnDevice(const Model& model, const Search& search) {
+  const bool in_graph = OnHost(model.device_type_) && model.session_info_->HasOutput(model.config_->model.decoder.outputs.next_tokens);
+  return (model.device_type_ == DeviceType::DML || in_graph) && IsPlainGreedyStep(search) && search.GetSequenceLength() >= search.params_->search.min_length;
 }
 
 void Generator::ComputeLogits() {
   if (computed_logits_)
     throw std::runtime_error("ComputeLogits called again without calling GenerateNextToken first");
+  if (IsCancelled()) {
+    computed_logits_ = true;
+    return;
+  }
+  if (swapped_out_)
+    throw std::runtime_error("ComputeLogits called on a swapped out generator, call SwapIn first");
+  NvtxRange range{"ComputeLogits"};
+  TraceScope trace{prefilled_ ? "decode" : "prefill", this};
+  MetricsScope metrics_scope{metrics_};
+  auto start = std::chrono::steady_clock::now();
+  model_->SetCurrentDevice();
+
+  if (search_->params_->search.compact_finished_rows)
+    state_->SetFinishedRows(search_->GetDoneRows().GetCPU());
+#if USE_CUDA
+  if (stream_) {  // The run reads the search's next tokens and indices
+    cudaEventRecord(stream_event_, *stream_);
+    cudaStreamWaitEvent(model_->cuda_stream_, stream_event_);
+  }
+#endif
+  const double session_start = state_->session_seconds_;
+  state_->top_tokens_on_device_ = CanSelectTopOnDevice(*model_, *search_);
+  state_->greedy_step_on_device_ = model_->device_type_ == DeviceType::CUDA && IsPlainGreedyStep(*search_);
+  state_->sample_step_on_device_ = model_->device_type_ == DeviceType::CUDA && IsPlainSampleStep(*search_);
+  state_->greedy_step_folds_eos_ = state_->greedy_step_on_device_ ||
+                                   (IsPlainGreedyStep(*search_) && search_->GetSequenceLength() >= search_->params_->search.min_length);
+  state_->top_tokens_ = {};
+  state_->logits16_ = {};
+  auto logits = [&] {
+    try {
+      return state_->Run(search_->GetSequenceLength(), search_->GetNextTokens(), search_->GetNextIndices());
+    } catch (...) {
+      if (!cancellation_->IsCancelled())
+        throw;
+      return RoamingArray<float>{};  // Cancelled in the middle of the run, which is left unfinished
+    }
+  }();
+#if USE_CUDA
+  if (stream_) {  // And the search reads the logits
+    cudaEventRecord(stream_event_, model_->cuda_stream_);
+    cudaStreamWaitEvent(*stream_, stream_event_);
+  }
+#endif
+  const double session_seconds = state_->session_seconds_ - session_start;
+  if (prefilled_) {
+    metrics_.decode_seconds += session_seconds;
+    metrics_.decode_steps++;
+  } else
+    metrics_.prefill_seconds += session_seconds;
+  prefilled_ = true;
+  metrics_.update_inputs_seconds += SecondsSince(start) - session_seconds;
+
+  computed_logits_ = true;
+  if (IsCancelled())
+    return;
+  if (!state_->top_tokens_.empty()) {
+    search_->SetTopTokens(state_->top_tokens_);
+    return;
+  }
 
-  auto logits = state_->Run(search_->GetSequenceLength(), search_->GetNextTokens(), search_->GetNextIndices());
   if (g_log.enabled && g_log.model_logits) {
     auto& stream = Log("model_logits");
     DumpSpan(stream, logits.GetCPU());
     stream << std::endl;
   }
+  if (!state_->logits16_.empty()) {
+    search_->SetLogits16(state_->logits16_);
+    return;  // Nothing to process, see IsPlainSampleStep
+  }
   search_->SetLogits(logits);
-  computed_logits_ = true;
 
-  auto& search = search_->params_->search;
-  search_->ApplyMinLength(search.min_length);
-  search_->ApplyRepetitionPenalty(search.repetition_penalty);
+  TraceScope trace_search{"process_logits", this};
+  auto search_start = std::chrono::steady_clock::now();
+  if (!state_->greedy_step_on_device_ && !state_->sample_step_on_device_)  // Else all it would do is min_length, which SelectTop does and sampling is past
+    search_->ProcessLogits();
+  if (search_->params_->search.top_logprobs > 0)
+    search_->LogSoftMax();
+  metrics_.search_seconds += SecondsSince(search_start);
 }
 
 bool Generator::IsDone() const {
   if (computed_logits_)
     throw std::runtime_error("IsDone() can't be called in the middle of processing logits");
 
-  return search_->IsDone();
+  return IsCancelled() || search_->IsDone();
+}
+
+bool Generator::IsCancelled() const {
+  return cancellation_->IsCancelled() || std::chrono::steady_clock::now() >= deadline_;
 }
 
 void Generator::GenerateNextToken() {
   if (!computed_logits_)
     throw std::runtime_error("Must call ComputeLogits before GenerateNextToken");
   computed_logits_ = false;
+  if (IsCancelled() || search_->WasDone())
+    return;
+  NvtxRange range{"GenerateNextToken"};
+  TraceScope trace{"select_next_token", this};
+  MetricsScope metrics_scope{metrics_, &metrics_.search_seconds};
+  model_->SetCurrentDevice();
   auto& search = search_->params_->search;
 
   if (g_log.enabled && g_log.generate_next_token) {
@@ -153,6 +799,18 @@ void Generator::GenerateNextToken() {
            << std::endl;
   }
 
+  SelectNextToken();
+  if (search.top_logprobs > 0)
+    search_->GatherLogProbs();
+}
+
+void Generator::SelectNextToken() {
+  auto& search = search_->params_->search;
+  if (!search_->params_->row_search.empty()) {
+    search_->SampleRows();
+    return;
+  }
+
   if (!search.do_sample || search.top_k == 1) {
     search_->SelectTop();
     return;
@@ -178,10 +836,75 @@ void Generator::GenerateNextToken() {
   }
 }
 
+TokenLogProbs Generator::GetLogProbs() const {
+  if (search_->params_->search.top_logprobs == 0)
+    throw std::runtime_error("GetLogProbs needs search.top_logprobs to be set");
+  return search_->GetLogProbs();
+}
+
+void Generator::SwapOut(const std::string& path) {
+  if (swapped_out_)
+    throw std::runtime_error("SwapOut called on a generator that is already swapped out");
+  model_->SetCurrentDevice();
+  GetState().SwapOut(path);
+  swapped_out_ = true;
+}
+
+void Generator::SwapIn() {
+  if (!swapped_out_)
+    throw std::runtime_error("SwapIn called on a generator that isn't swapped out");
+  model_->SetCurrentDevice();
+  GetState().SwapIn();
+  swapped_out_ = false;
+}
+
+void Generator::AppendTokens(std::span<const int32_t> tokens) {
+  if (tokens.empty())
+    throw std::runtime_error("AppendTokens called with no tokens");
+  if (computed_logits_)
+    throw std::runtime_error("AppendTokens can't be called in the middle of processing logits, call GenerateNextToken first");
+  if (swapped_out_)
+    throw std::runtime_error("AppendTokens called on a swapped out generator, call SwapIn first");
+
+  auto& params = *search_->params_;
+  if (params.batch_size != 1 || params.search.num_beams != 1)
+    throw std::runtime_error("AppendTokens only supports batch_size 1 and num_beams 1");
+  auto sequence_cpu = search_->GetSequence(0).GetCPU();
+  std::vector<int32_t> sequence(sequence_cpu.begin(), sequence_cpu.end());
+  sequence.insert(sequence.end(), tokens.begin(), tokens.end());
+  if (static_cast<int>(sequence.size()) >= params.search.max_length)
+    throw std::runtime_error("sequence length after appending (" + std::to_string(sequence.size()) + ") is >= max_length (" + std::to_string(params.search.max_length) + ")");
+
+  // The state goes first, it checks whether the model supports this before anything changes
+  state_ = GetState().Continue(sequence, search_->GetSequenceLengths());
+  search_->AppendTokens(tokens);
+}
+
 RoamingArray<int32_t> Generator::GetSequence(int index) const {
   return search_->GetSequence(index);
 }
 
+std::span<const int32_t> Generator::GetSequenceTail(int index, size_t offset) const {
+  auto sequence = search_->GetSequence(index);
+  auto length = static_cast<size_t>(search_->GetSequenceLength());
+  if (offset > length)
+    throw std::runtime_error("Sequence offset " + std::to_string(offset) + " is past the sequence length " + std::to_string(length));
+#if USE_CUDA
+  if (sequence.cpu_.empty() && !sequence.device_.empty()) {
+    if (host_sequences_.size() <= static_cast<size_t>(index))
+      host_sequences_.resize(static_cast<size_t>(index) + 1);
+    auto& host = host_sequences_[index];
+    if (host.span.size() < length)
+      host.owner = CudaMallocHostArray<int32_t>(std::max(length, static_cast<size_t>(search_->params_->search.max_length)), &host.span);
+    size_t bytes = (length - offset) * sizeof(int32_t);
+    CudaCheck() == cudaMemcpy(host.span.data() + offset, sequence.device_.data() + offset, bytes, cudaMemcpyDeviceToHost);
+    g_transfer_counters.device_to_host_bytes += bytes;
+    return host.span.subspan(offset, length - offset);
+  }
+#endif
+  return sequence.Tail(offset).GetCPU();
+}
+
 TokenSequences Generate(const Model& model, const GeneratorParams& params) {
   auto generator = CreateGenerator(model, params);
 
@@ -192,7 +915,8 @@ TokenSequences Generate(const Model& model, const GeneratorParams& params) {
 
   TokenSequences result;
 
-  for (int i = 0; i < params.batch_size; i++) {
+  // Sampling num_return_sequences has more rows than params
+  for (int i = 0; i < generator->search_->params_->batch_size; i++) {
     auto sequence = generator->search_->GetSequence(i);
     auto sequence_cpu = sequence.GetCPU();
 
@@ -5,7 +5,9 @@
 // Licensed under the MIT License.
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <assert.h>
+#include <chrono>
 #include <cmath>
 #include <cstring>
 #include "filesystem.h"
@@ -13,6 +15,7 @@
 #include <iostream>
 #include "span.h"
 #include <memory>
+#include <mutex>
 #include <numeric>
 #include <optional>
 #include <queue>
@@ -34,8 +37,10 @@ using cudaStream_t = void*;
 #include "smartptrs.h"
 #include "models/onnxruntime_api.h"
 #include "models/debugging.h"
+#include "models/memory_budget.h"
 #include "config.h"
 #include "logging.h"
+#include "tracing.h"
 #include "tensor.h"
 
 namespace Generators {
@@ -43,14 +48,66 @@ struct Model;
 struct State;
 struct Search;
 struct Tokenizer;
+struct Grammar;
+struct Adapters;
 
 // OgaSequences are a vector of int32 vectors
 using TokenSequences = std::vector<std::vector<int32_t>>;
 
+// See search.top_logprobs, from Generator::GetLogProbs
+struct TokenLogProbs {
+  cpu_span<const float> logprobs;      // shape (batch_size), of the last generated tokens
+  cpu_span<const int32_t> top_tokens;  // shape (batch_size, top_logprobs), most likely first
+  cpu_span<const float> top_logprobs;  // shape (batch_size, top_logprobs)
+};
+
 enum struct DeviceType {
   CPU,
   CUDA,
   DML,
+  ROCM,  // USE_ROCM builds with the rocm provider, see OnHost
+};
+
+// ROCm runs the sessions on the GPU, but there are no HIP kernels for the search, kv cache and inputs, so they stay in
+// host memory and take the CPU paths like the CPU device does
+constexpr bool OnHost(DeviceType device_type) {
+  return device_type == DeviceType::CPU || device_type == DeviceType::ROCM;
+}
+
+// Stops generators from another thread, like when the client of a request goes away. Every generator has its own,
+// whose parent is GeneratorParams::cancellation when that shares one between the generators of a request (like the
+// one Generate runs): cancelling the parent cancels them all, cancelling a generator's own leaves its siblings running.
+// A cancelled generator is done: IsDone() returns true and ComputeLogits and GenerateNextToken do nothing, so a
+// generation loop ends at the next step and the generator can be released.
+struct Cancellation : std::enable_shared_from_this<Cancellation> {
+  Cancellation(std::shared_ptr<Cancellation> parent = {}) : parent_{std::move(parent)} {}
+
+  // terminate_runs also stops the session runs in progress through their run options, so a long prefill ends right
+  // away instead of at the end of its run (or its prefill chunk)
+  void Cancel(bool terminate_runs = false);
+  bool IsCancelled() const { return cancelled_ || (parent_ && parent_->IsCancelled()); }
+
+  // Around a session run, so Cancel(true) on the cancellation or any of its parents can terminate it
+  struct Run {
+    Run(Cancellation* cancellation, OrtRunOptions& run_options);
+    ~Run();
+
+   private:
+    Cancellation* cancellation_;
+    OrtRunOptions& run_options_;
+  };
+
+  std::shared_ptr<Cancellation> external_owner_;  // Set to 'this' when created by the C API to preserve lifetime
+
+ private:
+  void AddRun(OrtRunOptions& run_options);
+  void RemoveRun(OrtRunOptions& run_options);
+
+  std::shared_ptr<Cancellation> parent_;
+  std::atomic<bool> cancelled_{};
+  std::mutex mutex_;
+  bool terminate_runs_{};
+  std::vector<OrtRunOptions*> runs_;  // The run options of the runs in progress
 };
 
 struct GeneratorParams : std::enable_shared_from_this<GeneratorParams> {
@@ -59,9 +116,26 @@ struct GeneratorParams : std::enable_shared_from_this<GeneratorParams> {
 
   Config::Search search;
 
+  // Per row overrides of the sampling options (do_sample, top_k, top_p, temperature, the penalties and random_seed)
+  // and the stop options (max_length, max_new_tokens), greedy search only. Rows past the end use search. A row's
+  // random_seed isn't copied from search, it stays -1 (the batch's stream) until it's set, see MakeRandomRows.
+  std::vector<Config::Search> row_search;
+  const Config::Search& RowSearch(int batch_index) const { return batch_index < static_cast<int>(row_search.size()) ? row_search[batch_index] : search; }
+  Config::Search& SetRowSearch(int batch_index);  // Grows row_search with copies of search, so set those options first
+  // The sequence length the row is done at, from its max_length and its max_new_tokens counted from start_length
+  int RowLengthLimit(int batch_index, int start_length) const;
+
+  // Scheduler: requests of a higher priority are admitted first, and preempt running ones of a lower priority when
+  // memory runs short
+  int priority{};
+
+  // Shared by the generators created with these params, see Cancellation. search.timeout_ms is the deadline.
+  std::shared_ptr<Cancellation> cancellation;
+
   // Read only values copied from model
   int pad_token_id{};
   int eos_token_id{};
+  std::vector<int32_t> eos_token_ids;  // Every token that ends a sequence when there's more than one, eos_token_id first
   int vocab_size{};
   int context_length{};
 
@@ -75,23 +149,6 @@ struct GeneratorParams : std::enable_shared_from_this<GeneratorParams> {
   DeviceType device_type{DeviceType::CPU};
   cudaStream_t cuda_stream{};
 
-#if 0
-  struct Bert {
-    std::span<const int32_t> input_ids;  // Array of [batchsize][sequence_length]
-  };
-
-  struct Gpt {
-    using Gpt=Bert;
-  };
-
-  struct T5 {
-    std::span<const int32_t> encoder_input_ids;  // Array of [batchsize][sequence_length]
-    std::span<const int32_t> decoder_input_ids;  // Array of [batchsize][sequence_length]
-  };
-  using Bart=T5;
-
-#endif
-
   // TODO: Move this to a separate GPT struct
   std::span<const int32_t> input_ids;  // Array of [batchsize][sequence_length]
 
@@ -99,10 +156,31 @@ struct GeneratorParams : std::enable_shared_from_this<GeneratorParams> {
     std::shared_ptr<Tensor> input_features;  // float32 [batch_size, number_of_mels, something that is 3000]
   };
 
-  std::variant<Whisper> inputs;
+  // Encoder-decoder models (t5, bart): input_ids is the decoder's prompt, these are what the encoder reads
+  struct EncoderDecoder {
+    std::span<const int32_t> input_ids;  // Array of [batch_size][sequence_length], padded with pad_token_id
+    int sequence_length{};
+  };
+
+  std::variant<Whisper, EncoderDecoder> inputs;
 
   std::vector<int32_t> input_ids_owner;  // Backing memory of input_ids in some cases
 
+  // Sampling with search.num_return_sequences: the generator repeats every row of input_ids this many times in a row,
+  // which tells the model it can run each prompt once and copy its kv to the other rows
+  int prompt_copies{1};
+
+  // Ragged prompts: the real token count of every row of input_ids, the rest of the row is padding, on the left with
+  // pad_left. Empty to tell padding apart by pad_token_id, which also masks real tokens that happen to be pad_token_id.
+  std::vector<int32_t> input_lengths;
+  bool pad_left{};
+  // Pads the prompts in tokens, lengths[i] tokens for each row one after another, into input_ids and sets the lengths
+  void SetPackedInputs(std::span<const int32_t> tokens, std::span<const int32_t> lengths, bool pad_left = false);
+  // The positions [begin, end) of every row's tokens, two per row: from input_lengths, or without them by stripping
+  // the pad runs at either end, so a pad_token_id inside a row (an eos that is also the pad) is still a token. A row of
+  // only pad tokens keeps position 0.
+  std::vector<int32_t> TokenRanges() const;
+
   std::shared_ptr<GeneratorParams> external_owner_;  // Set to 'this' when created by the C API to preserve lifetime
 
   struct Input {
@@ -113,29 +191,152 @@ struct GeneratorParams : std::enable_shared_from_this<GeneratorParams> {
   // A list of extra model inputs that will be matched at runtime based on name
   std::vector<Input> extra_inputs;
 
+  // Logits processing that is not a single number, applied in the same pass as the search penalties
+  std::vector<std::pair<int32_t, float>> logit_bias;  // Added to the logit of the token every step
+  std::vector<std::vector<int32_t>> bad_words;         // Token sequences that are never generated
+  std::vector<std::vector<int32_t>> stop_sequences;    // A row is done once its generated tokens end with one of these
+  std::shared_ptr<const Grammar> grammar;               // Constrained decoding, the generated text must match it
+
+  // Multi-LoRA: the adapter from adapters every row runs with, rows past the end of row_adapters use adapter and ""
+  // is the base model. The rows of one batch can use different adapters.
+  std::shared_ptr<const Adapters> adapters;
+  std::string adapter;
+  std::vector<std::string> row_adapters;
+  const std::string& RowAdapter(int batch_index) const { return batch_index < static_cast<int>(row_adapters.size()) ? row_adapters[batch_index] : adapter; }
+  void SetRowAdapter(int batch_index, std::string name);  // Grows row_adapters with copies of adapter, so set that first
+
   void TryGraphCapture(int max_bs);
+  // Graph capture with model.decoder.graph_capture.bucketed: the max_batch_size and max_length the graph and its static
+  // buffers are sized for, rounded up to a power of two (max_length capped at context_length) so requests of similar
+  // sizes replay the same graph. They're the params values otherwise.
+  int GraphMaxBatchSize() const;
+  int BufferMaxLength() const;  // Also the length of a shared kv buffer
+  bool IsFor(const Model& model) const;  // Created for model, or without one
 
   void SetInputs(const NamedTensors& inputs);
+  // Sets the encoder's input ids and the batch size. Without a decoder prompt yet, or with the one an earlier call
+  // defaulted, every row's is decoder_start_token_id.
+  void SetEncoderInputs(std::span<const int32_t> encoder_input_ids, int encoder_sequence_length, int batch_size);
 
  private:
   bool is_cuda_graph_enabled_{};
+  bool decoder_prompt_defaulted_{};  // SetEncoderInputs filled input_ids with decoder_start_token_id
   const Config* config_{nullptr};  // Non owning pointer to the config.
                                    // The model outlives the GeneratorParams
 };
 
+// Always on timers and counters of a generator since it was created. Times are host wall clock seconds, so with an
+// asynchronous device a run's time may be counted in the step that waits for its results. The transfers and allocations
+// are those of this library (see TransferCounters), not the ones onnxruntime makes itself.
+struct GeneratorMetrics {
+  double prefill_seconds{};        // Session runs of the first ComputeLogits, the prompt
+  double decode_seconds{};         // Session runs of every later ComputeLogits
+  double update_inputs_seconds{};  // The rest of ComputeLogits: the input ids, positions, mask and kv cache updates
+  double search_seconds{};         // Processing the logits and GenerateNextToken
+  uint64_t decode_steps{};         // ComputeLogits calls after the first
+  uint64_t host_to_device_bytes{};
+  uint64_t device_to_host_bytes{};
+  uint64_t device_allocations{};
+};
+
 struct Generator {
   Generator(const Model& model, const GeneratorParams& params);
+  ~Generator();
 
   bool IsDone() const;
   void ComputeLogits();
   void GenerateNextToken();
 
+  // See Cancellation, safe to call from any thread while the generator runs. Only this generator is cancelled, not the
+  // others sharing GeneratorParams::cancellation.
+  void Cancel(bool terminate_runs = false) { cancellation_->Cancel(terminate_runs); }
+  // Cancelled, or past the search.timeout_ms deadline
+  bool IsCancelled() const;
+
   RoamingArray<int32_t> GetSequence(int index) const;
+  // Streaming: the tokens of sequence index from offset on (at most its length), in host memory. On the device only
+  // these are copied, so a client passing the length it already has reads every token once. Every row has its own
+  // copy, valid until the generator is destroyed; the next call for the same index updates it in place.
+  std::span<const int32_t> GetSequenceTail(int index, size_t offset) const;
+  // The log probabilities of the last generated token of every row and of its search.top_logprobs most likely ones
+  TokenLogProbs GetLogProbs() const;
+
+  // Frees the device memory of an idle generator by moving its kv cache to pinned host memory, or to a file when path
+  // isn't empty. SwapIn has to be called before the next ComputeLogits.
+  void SwapOut(const std::string& path = {});
+  void SwapIn();
+
+  // Multi-turn: appends tokens (e.g. the next user turn) to the sequence of a batch_size 1 greedy generator. The next
+  // ComputeLogits runs them along with the last generated token in one step on top of the existing kv, so the cost
+  // scales with the new tokens only. Clears IsDone(), call between GenerateNextToken and ComputeLogits.
+  void AppendTokens(std::span<const int32_t> tokens);
+
+  // Session migration: writes the sequence, search state and kv of a batch_size 1 greedy generator to path. The
+  // Generator(model, params, path) constructor restores it in another process, with the search options of params.
+  // The generator stays usable, call between GenerateNextToken and ComputeLogits.
+  void Save(const std::string& path) const;
+  Generator(const Model& model, const GeneratorParams& params, const std::string& snapshot_path);
+
+  // Tree search and best of n: a new generator that carries on from the sequence and kv of this batch_size 1 greedy
+  // generator without running them again, with the greedy or sampling search options of params. Its random draws are seeded from params
+  // like a new generator's, so forks with different random_seed values diverge, and max_new_tokens counts from the
+  // fork. The generator stays usable, call between GenerateNextToken and ComputeLogits.
+  std::unique_ptr<Generator> Fork(const GeneratorParams& params) const;
+
+  // Continuous batching: one generator for the rows[i] of every generators[i], so they step in one run. Each of them
+  // has to be between GenerateNextToken and ComputeLogits with num_beams 1 and no grammar or compacted rows. Their
+  // sequences are left padded to the longest and carry on from their kv, which is taken from them, leaving them
+  // unusable. params gives the search options (search.max_length covering the padding), its input_ids are ignored.
+  // The random draws are seeded from params like a new generator's, and max_new_tokens counts from the merge.
+  static std::unique_ptr<Generator> Merge(std::span<Generator* const> generators, std::span<const std::vector<int32_t>> rows,
+                                          const GeneratorParams& params);
+
+  // The state, which a generator cancelled while its prompt ran in CreateState (like a chunked prefill) doesn't have
+  State& GetState() const;
 
   std::shared_ptr<const Model> model_;
+  std::optional<MemoryReservation> memory_;  // The estimated memory of the generator, in the model's budget
   std::unique_ptr<State> state_;
   std::unique_ptr<Search> search_;
   bool computed_logits_{};  // Set to true in ComputeLogits() and false after appending a token to ensure a 1 to 1 call ratio
+  bool swapped_out_{};
+  GeneratorMetrics metrics_;
+
+ private:
+  bool prefilled_{};  // The first ComputeLogits ran
+  std::shared_ptr<Cancellation> cancellation_;
+  std::chrono::steady_clock::time_point deadline_{std::chrono::steady_clock::time_point::max()};
+#if USE_CUDA
+  // A pinned host copy per row of a device sequence, allocated once for max_length, see GetSequenceTail
+  struct HostSequence {
+    cuda_host_unique_ptr<int32_t> owner;
+    cpu_span<int32_t> span;
+  };
+  mutable std::vector<HostSequence> host_sequences_;
+#endif
+
+  void SelectNextToken();  // GenerateNextToken's search, by the search options
+
+  Generator(const Generator& parent, const GeneratorParams& params);  // See Fork
+  Generator(std::span<Generator* const> generators, std::span<const std::vector<int32_t>> rows, const GeneratorParams& params);  // See Merge
+
+  const GeneratorParams& UseOwnStream(const GeneratorParams& params);
+  const GeneratorParams& UseCancellation(const GeneratorParams& params);
+  void SetDeadline(const GeneratorParams& params);
+  const GeneratorParams& ExpandSamples(const GeneratorParams& params);
+
+  // The copies below keep pointing into the caller's params (input_ids, extra_inputs), which are kept alive with them
+  std::shared_ptr<const GeneratorParams> params_in_;
+  std::shared_ptr<GeneratorParams> sample_params_;        // The batch of ExpandSamples
+  std::shared_ptr<GeneratorParams> cancellation_params_;  // See UseCancellation
+
+#if USE_CUDA
+  // model.decoder.generator_streams: the search runs on stream_, the session runs stay on the model's stream and the
+  // two wait on each other through stream_event_ around every run
+  std::unique_ptr<cuda_stream_holder> stream_;
+  std::shared_ptr<GeneratorParams> stream_params_;
+  cuda_event_holder stream_event_{cudaEventDisableTiming};
+#endif
 };
 
 struct OrtGlobals {
@@ -143,8 +344,9 @@ struct OrtGlobals {
 
   std::unique_ptr<OrtEnv> env_;
 #if USE_CUDA
-  std::unique_ptr<OrtMemoryInfo> memory_info_cuda_;
-  std::unique_ptr<Ort::Allocator> allocator_cuda_;
+  // One per CUDA device id
+  std::unordered_map<int, std::unique_ptr<OrtMemoryInfo>> memory_info_cuda_;
+  std::unordered_map<int, std::unique_ptr<Ort::Allocator>> allocator_cuda_;
 #endif
  private:
   OrtGlobals(const OrtGlobals&) = delete;
@@ -156,12 +358,31 @@ void Shutdown();  // Do this once at exit, Ort code will fail after this call
 OrtEnv& GetOrtEnv();
 
 std::shared_ptr<Model> CreateModel(OrtEnv& ort_env, const char* config_path);
+std::shared_ptr<Model> CreateModel(OrtEnv& ort_env, std::unique_ptr<Config> config);
+std::shared_ptr<Model> CreateModel(OrtEnv& ort_env, const char* config_path, std::shared_ptr<SharedWeights> shared_weights);  // The model's files are mapped through shared_weights
 std::shared_ptr<GeneratorParams> CreateGeneratorParams(const Model& model);
 std::shared_ptr<GeneratorParams> CreateGeneratorParams();  // For benchmarking purposes only
 std::unique_ptr<Generator> CreateGenerator(const Model& model, const GeneratorParams& params);
+std::unique_ptr<Generator> LoadGenerator(const Model& model, const GeneratorParams& params, const std::string& snapshot_path);
 std::vector<std::vector<int32_t>> Generate(const Model& model, const GeneratorParams& params);  // Uses CreateGenerator and a simple loop to return the entire sequence
+// Prompt scoring, see scoring.cpp: the log probability of every input token given the ones before it, shape
+// (batch_size, sequence_length - 1), from a single run of a decoder only model without generating. Positions outside
+// a row's GeneratorParams::TokenRanges score 0.
+std::vector<float> ScoreSequences(const Model& model, const GeneratorParams& params);
+// Embeddings, see embedding.cpp: the final hidden states of every input sequence pooled into one vector, shape
+// (batch_size, hidden_size), from a single run of a decoder only model with a hidden_states output
+enum struct Pooling {
+  LastToken,  // The hidden state of the last non pad token
+  Mean,       // The mean over the non pad tokens
+};
+std::vector<float> EmbedSequences(const Model& model, const GeneratorParams& params, Pooling pooling);
+// The positions [begin, end) each row is pooled over, two per row: its TokenRanges, or only the last of them
+std::vector<int32_t> GetPoolingRanges(const GeneratorParams& params, Pooling pooling);
 
 float Float16ToFloat32(uint16_t v);  // v is a IEEE 752-2008 binary16 format, 1 sign bit, 5 bit exponent, 10 bit fraction
 void top_k_indices(std::span<int32_t> top_k, std::span<const float> inputs);
+// Single pass top-k for a small k, top_k and top_k_values receive the indices and values of the k largest inputs,
+// largest first. Faster than top_k_indices when most inputs are below the k-th largest, as with logits.
+void top_k_threshold(std::span<int32_t> top_k, std::span<float> top_k_values, std::span<const float> inputs);
 
 }  // namespace Generators
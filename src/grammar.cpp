@@ -0,0 +1,479 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "generators.h"
+#include "grammar.h"
+#include <bitset>
+#include <map>
+
+namespace Generators {
+
+namespace {
+
+using ByteSet = std::bitset<256>;
+
+constexpr int MaxRepeat = 1000;
+constexpr size_t MaxNfaStates = 100000;  // Nested counted repeats multiply, like (a{1000}){1000}
+constexpr size_t MaxDfaStates = 20000;
+
+struct RegexNode {
+  enum struct Kind { Bytes,
+                     Concat,
+                     Alternate,
+                     Repeat };
+
+  explicit RegexNode(Kind kind) : kind{kind} {}
+
+  Kind kind;
+  ByteSet bytes;                    // Bytes
+  std::vector<RegexNode> children;  // Concat, Alternate and Repeat (one child)
+  int min{}, max{};                 // Repeat, a max of -1 is unbounded
+};
+
+RegexNode MakeBytes(const ByteSet& bytes) {
+  RegexNode node{RegexNode::Kind::Bytes};
+  node.bytes = bytes;
+  return node;
+}
+
+struct RegexParser {
+  RegexParser(std::string_view pattern) : pattern_{pattern} {}
+
+  RegexNode Parse() {
+    auto node = ParseAlternate();
+    if (pos_ != pattern_.size())
+      Fail("unexpected )");
+    return node;
+  }
+
+ private:
+  [[noreturn]] void Fail(const char* what) const {
+    throw std::runtime_error("Invalid grammar regex at offset " + std::to_string(pos_) + ": " + what);
+  }
+
+  bool AtEnd() const { return pos_ == pattern_.size(); }
+  char Peek() const {
+    if (AtEnd())
+      Fail("unexpected end of pattern");
+    return pattern_[pos_];
+  }
+  char Next() {
+    if (AtEnd())
+      Fail("unexpected end of pattern");
+    return pattern_[pos_++];
+  }
+
+  RegexNode ParseAlternate() {
+    RegexNode node{RegexNode::Kind::Alternate};
+    node.children.push_back(ParseConcat());
+    while (!AtEnd() && Peek() == '|') {
+      pos_++;
+      node.children.push_back(ParseConcat());
+    }
+    return node.children.size() == 1 ? std::move(node.children[0]) : node;
+  }
+
+  RegexNode ParseConcat() {
+    RegexNode node{RegexNode::Kind::Concat};
+    while (!AtEnd() && Peek() != '|' && Peek() != ')')
+      node.children.push_back(ParseRepeat());
+    return node.children.size() == 1 ? std::move(node.children[0]) : node;
+  }
+
+  int ParseNumber() {
+    if (AtEnd() || !isdigit(static_cast<unsigned char>(Peek())))
+      Fail("expected a number");
+    int value = 0;
+    while (!AtEnd() && isdigit(static_cast<unsigned char>(Peek()))) {
+      value = value * 10 + (Next() - '0');
+      if (value > MaxRepeat)
+        Fail("repeat count is too large");
+    }
+    return value;
+  }
+
+  RegexNode ParseRepeat() {
+    auto atom = ParseAtom();
+    while (!AtEnd()) {
+      int min, max;
+      char c = Peek();
+      if (c == '*')
+        min = 0, max = -1;
+      else if (c == '+')
+        min = 1, max = -1;
+      else if (c == '?')
+        min = 0, max = 1;
+      else if (c == '{') {
+        pos_++;
+        min = max = ParseNumber();
+        if (Peek() == ',') {
+          pos_++;
+          max = Peek() == '}' ? -1 : ParseNumber();
+        }
+        if (Peek() != '}')
+          Fail("expected }");
+        if (max != -1 && max < min)
+          Fail("repeat max is less than min");
+      } else
+        break;
+      pos_++;
+
+      RegexNode node{RegexNode::Kind::Repeat};
+      node.min = min;
+      node.max = max;
+      node.children.push_back(std::move(atom));
+      atom = std::move(node);
+    }
+    return atom;
+  }
+
+  RegexNode ParseAtom() {
+    char c = Next();
+    switch (c) {
+      case '(': {
+        if (!AtEnd() && Peek() == '?') {
+          pos_++;
+          if (Next() != ':')
+            Fail("only (?: groups are supported");
+        }
+        auto node = ParseAlternate();
+        if (AtEnd() || Next() != ')')
+          Fail("expected )");
+        return node;
+      }
+      case '[':
+        return MakeBytes(ParseClass());
+      case '.': {
+        ByteSet bytes;
+        bytes.set();
+        bytes.reset('\n');
+        return MakeBytes(bytes);
+      }
+      case '\\':
+        return MakeBytes(ParseEscape());
+      case '*':
+      case '+':
+      case '?':
+      case '{':
+        Fail("nothing to repeat");
+      case '^':
+      case '$':
+        Fail("anchors are not supported, the whole text always has to match");
+      default: {
+        ByteSet bytes;
+        bytes.set(static_cast<unsigned char>(c));
+        return MakeBytes(bytes);
+      }
+    }
+  }
+
+  ByteSet ParseEscape() {
+    char c = Next();
+    ByteSet bytes;
+    auto add_range = [&](char first, char last) {
+      for (int b = static_cast<unsigned char>(first); b <= static_cast<unsigned char>(last); b++)
+        bytes.set(b);
+    };
+    switch (c) {
+      case 'd':
+      case 'D':
+        add_range('0', '9');
+        break;
+      case 'w':
+      case 'W':
+        add_range('a', 'z');
+        add_range('A', 'Z');
+        add_range('0', '9');
+        bytes.set('_');
+        break;
+      case 's':
+      case 'S':
+        for (char space : {' ', '\t', '\n', '\r', '\f', '\v'})
+          bytes.set(static_cast<unsigned char>(space));
+        break;
+      case 'n':
+        bytes.set('\n');
+        break;
+      case 'r':
+        bytes.set('\r');
+        break;
+      case 't':
+        bytes.set('\t');
+        break;
+      case 'f':
+        bytes.set('\f');
+        break;
+      case 'v':
+        bytes.set('\v');
+        break;
+      default:
+        if (isalnum(static_cast<unsigned char>(c)))
+          Fail("unsupported escape");
+        bytes.set(static_cast<unsigned char>(c));  // An escaped punctuation character
+        return bytes;
+    }
+    if (isupper(static_cast<unsigned char>(c)))
+      bytes.flip();
+    return bytes;
+  }
+
+  ByteSet ParseClass() {
+    ByteSet bytes;
+    bool negate = !AtEnd() && Peek() == '^';
+    if (negate)
+      pos_++;
+
+    bool first = true;
+    while (true) {
+      char c = Next();
+      if (c == ']' && !first)
+        break;
+      first = false;
+
+      if (c == '\\') {
+        bytes |= ParseEscape();
+        continue;
+      }
+      unsigned char low = static_cast<unsigned char>(c);
+      if (!AtEnd() && Peek() == '-' && pos_ + 1 < pattern_.size() && pattern_[pos_ + 1] != ']') {
+        pos_++;
+        char high = Next();
+        if (high == '\\')
+          high = Next();
+        if (static_cast<unsigned char>(high) < low)
+          Fail("class range is reversed");
+        for (int b = low; b <= static_cast<unsigned char>(high); b++)
+          bytes.set(b);
+      } else
+        bytes.set(low);
+    }
+    if (negate)
+      bytes.flip();
+    return bytes;
+  }
+
+  std::string_view pattern_;
+  size_t pos_{};
+};
+
+// Thompson construction, state 0 is the start and state 1 the match
+struct Nfa {
+  struct State {
+    std::vector<std::pair<ByteSet, int>> edges;
+    std::vector<int> epsilons;
+  };
+
+  explicit Nfa(const RegexNode& root) : states_(2) {
+    Connect(root, 0, 1);
+  }
+
+  // The states reachable from states through epsilons, sorted so equal sets compare equal
+  std::vector<int> Closure(std::vector<int> states) const {
+    std::vector<bool> seen(states_.size());
+    for (auto state : states)
+      seen[state] = true;
+    for (size_t i = 0; i < states.size(); i++) {
+      for (auto next : states_[states[i]].epsilons) {
+        if (!seen[next]) {
+          seen[next] = true;
+          states.push_back(next);
+        }
+      }
+    }
+    std::sort(states.begin(), states.end());
+    states.erase(std::unique(states.begin(), states.end()), states.end());
+    return states;
+  }
+
+  std::vector<State> states_;
+
+ private:
+  int AddState() {
+    if (states_.size() == MaxNfaStates)
+      throw std::runtime_error("Grammar regex is too complex, it needs more than " + std::to_string(MaxNfaStates) + " NFA states");
+    states_.emplace_back();
+    return static_cast<int>(states_.size() - 1);
+  }
+
+  void Connect(const RegexNode& node, int from, int to) {
+    switch (node.kind) {
+      case RegexNode::Kind::Bytes:
+        states_[from].edges.emplace_back(node.bytes, to);
+        break;
+
+      case RegexNode::Kind::Concat: {
+        if (node.children.empty()) {
+          states_[from].epsilons.push_back(to);
+          break;
+        }
+        int current = from;
+        for (size_t i = 0; i + 1 < node.children.size(); i++) {
+          int next = AddState();
+          Connect(node.children[i], current, next);
+          current = next;
+        }
+        Connect(node.children.back(), current, to);
+        break;
+      }
+
+      case RegexNode::Kind::Alternate:
+        for (auto& child : node.children)
+          Connect(child, from, to);
+        break;
+
+      case RegexNode::Kind::Repeat: {
+        auto& child = node.children[0];
+        int current = from;
+        for (int i = 0; i < node.min; i++) {
+          int next = AddState();
+          Connect(child, current, next);
+          current = next;
+        }
+        if (node.max < 0) {
+          int loop = AddState();
+          states_[current].epsilons.push_back(loop);
+          Connect(child, loop, loop);
+          states_[loop].epsilons.push_back(to);
+          break;
+        }
+        for (int i = node.min; i < node.max; i++) {
+          states_[current].epsilons.push_back(to);
+          int next = AddState();
+          Connect(child, current, next);
+          current = next;
+        }
+        states_[current].epsilons.push_back(to);
+        break;
+      }
+    }
+  }
+};
+
+}  // namespace
+
+Grammar::Grammar(std::string_view pattern, std::vector<std::string> token_strings, int32_t eos_token_id)
+    : token_strings_{std::move(token_strings)},
+      eos_token_id_{eos_token_id} {
+  if (eos_token_id_ < 0 || eos_token_id_ >= VocabSize())
+    throw std::runtime_error("Grammar eos_token_id " + std::to_string(eos_token_id_) + " is outside of the vocab");
+
+  Nfa nfa{RegexParser{pattern}.Parse()};
+
+  // Subset construction, DFA state 0 is the closure of the NFA start
+  std::map<std::vector<int>, int> ids;
+  std::vector<std::vector<int>> sets{nfa.Closure({0})};
+  ids[sets[0]] = 0;
+  for (size_t state = 0; state < sets.size(); state++) {
+    std::vector<std::pair<const ByteSet*, int>> edges;
+    for (auto nfa_state : sets[state]) {
+      for (auto& [bytes, next] : nfa.states_[nfa_state].edges)
+        edges.emplace_back(&bytes, next);
+    }
+
+    std::array<int, 256> transitions;
+    for (int byte = 0; byte < 256; byte++) {
+      std::vector<int> targets;
+      for (auto& [bytes, next] : edges) {
+        if (bytes->test(byte))
+          targets.push_back(next);
+      }
+      if (targets.empty()) {
+        transitions[byte] = DeadState;
+        continue;
+      }
+
+      auto [it, inserted] = ids.try_emplace(nfa.Closure(std::move(targets)), static_cast<int>(sets.size()));
+      if (inserted) {
+        if (sets.size() == MaxDfaStates)
+          throw std::runtime_error("Grammar regex is too complex, it needs more than " + std::to_string(MaxDfaStates) + " states");
+        sets.push_back(it->first);
+      }
+      transitions[byte] = it->second;
+    }
+    transitions_.push_back(transitions);
+    accepting_.push_back(std::binary_search(sets[state].begin(), sets[state].end(), 1));
+  }
+
+  trie_.emplace_back();
+  for (int32_t token = 0; token < VocabSize(); token++) {
+    if (token == eos_token_id_ || token_strings_[token].empty())
+      continue;  // eos is handled by accepting_, empty tokens would let the generator stall
+    int node = 0;
+    for (unsigned char byte : token_strings_[token]) {
+      auto& children = trie_[node].children;
+      auto it = std::find_if(children.begin(), children.end(), [byte](auto& child) { return child.first == byte; });
+      if (it != children.end()) {
+        node = it->second;
+        continue;
+      }
+      int child = static_cast<int>(trie_.size());
+      trie_[node].children.emplace_back(byte, child);
+      trie_.emplace_back();
+      node = child;
+    }
+    trie_[node].tokens.push_back(token);
+  }
+}
+
+int Grammar::Advance(int state, int32_t token) const {
+  assert(token >= 0 && token < VocabSize());
+  if (state == DeadState || token == eos_token_id_)
+    return state;  // The row is finished after eos
+  auto& text = token_strings_[token];
+  if (text.empty())
+    return DeadState;
+  for (unsigned char byte : text) {
+    state = transitions_[state][byte];
+    if (state == DeadState)
+      break;
+  }
+  return state;
+}
+
+std::span<const uint32_t> Grammar::GetMask(int state) const {
+  std::lock_guard lock(mutex_);
+  auto [it, inserted] = masks_.try_emplace(state);
+  if (inserted)
+    ComputeMask(state, it->second);
+  return it->second;
+}
+
+void Grammar::ComputeMask(int state, std::vector<uint32_t>& mask) const {
+  mask.assign((token_strings_.size() + 31) / 32, 0);
+  auto allow = [&](int32_t token) { mask[token / 32] |= 1u << (token % 32); };
+
+  if (state == DeadState || accepting_[state])
+    allow(eos_token_id_);
+  if (state == DeadState)
+    return;
+
+  std::vector<std::pair<int, int>> stack{{0, state}};  // Trie node, DFA state after its text
+  while (!stack.empty()) {
+    auto [node, node_state] = stack.back();
+    stack.pop_back();
+    for (auto token : trie_[node].tokens)
+      allow(token);
+    for (auto [byte, child] : trie_[node].children) {
+      int next = transitions_[node_state][byte];
+      if (next != DeadState)
+        stack.emplace_back(child, next);
+    }
+  }
+}
+
+GrammarMatcher::GrammarMatcher(std::shared_ptr<const Grammar> grammar, int batch_size, int sequence_length)
+    : grammar_{std::move(grammar)},
+      states_(batch_size, Grammar::InitialState),
+      sequence_length_{sequence_length} {}
+
+void GrammarMatcher::Advance(int row, std::span<const int32_t> tokens) {
+  for (auto token : tokens)
+    states_[row] = grammar_->Advance(states_[row], token);
+}
+
+void GrammarMatcher::Reset(int sequence_length) {
+  std::fill(states_.begin(), states_.end(), Grammar::InitialState);
+  sequence_length_ = sequence_length;
+}
+
+}  // namespace Generators
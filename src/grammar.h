@@ -0,0 +1,62 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+#include <array>
+#include <mutex>
+
+namespace Generators {
+
+// Constrained decoding. The pattern is compiled into a DFA over the bytes of the token text, the generated text has to
+// match the whole pattern and eos is only allowed once it does. For every DFA state the tokens whose text keeps the
+// DFA alive are a bitmask over the vocab, computed the first time a generator reaches the state and shared by every
+// generator using the grammar, so a step only has to AND the scores with the mask of the row's state.
+// Syntax: literals, ., [] classes with ^ and ranges, \d \w \s \D \W \S and the usual escapes, (), (?:), |, *, +, ?,
+// {n}, {n,} and {n,m}. Classes and . match single bytes. JSON schemas are used by lowering them to a regex first.
+struct Grammar {
+  Grammar(std::string_view pattern, std::vector<std::string> token_strings, int32_t eos_token_id);
+
+  static constexpr int InitialState = 0;
+  static constexpr int DeadState = -1;  // Only eos is allowed
+
+  int Advance(int state, int32_t token) const;  // DeadState if the token isn't allowed in state
+  bool IsMatch(int state) const { return state != DeadState && accepting_[state]; }
+
+  // Bit t % 32 of word t / 32 is set if token t is allowed in state
+  std::span<const uint32_t> GetMask(int state) const;
+  int VocabSize() const { return static_cast<int>(token_strings_.size()); }
+
+ private:
+  void ComputeMask(int state, std::vector<uint32_t>& mask) const;
+
+  std::vector<std::array<int, 256>> transitions_;  // The next DFA state for every byte
+  std::vector<bool> accepting_;
+
+  std::vector<std::string> token_strings_;
+  int32_t eos_token_id_;
+
+  // The token strings as a trie, so a mask walks every shared prefix once. The root is node 0.
+  struct TrieNode {
+    std::vector<std::pair<uint8_t, int>> children;
+    std::vector<int32_t> tokens;  // Whose text ends here
+  };
+  std::vector<TrieNode> trie_;
+
+  mutable std::mutex mutex_;
+  mutable std::unordered_map<int, std::vector<uint32_t>> masks_;  // Node based, so the spans handed out stay valid
+};
+
+// The grammar state of every row of a search (greedy only, beam search reorders the rows)
+struct GrammarMatcher {
+  GrammarMatcher(std::shared_ptr<const Grammar> grammar, int batch_size, int sequence_length);
+
+  void Advance(int row, std::span<const int32_t> tokens);
+  void Reset(int sequence_length);  // A new turn, the grammar starts over after the current sequence
+  std::span<const uint32_t> GetMask(int row) const { return grammar_->GetMask(states_[row]); }
+
+  std::shared_ptr<const Grammar> grammar_;
+  std::vector<int> states_;
+  int sequence_length_;  // The states include every token before this
+};
+
+}  // namespace Generators
@@ -3,8 +3,13 @@
 
 #include "generators.h"
 #include "json.h"
+#include <charconv>
 #include <iostream>
 #include <fstream>
+#include <condition_variable>
+#include <mutex>
+#include <sstream>
+#include <thread>
 
 namespace Generators {
 
@@ -12,6 +17,226 @@ LogItems g_log;
 static std::ostream* gp_stream{&std::cerr};
 static std::unique_ptr<std::ofstream> gp_logfile;
 
+namespace {
+
+// Bounded multi producer queue of log entries (Vyukov's, with a single consumer): a producer claims a slot with a
+// compare exchange of the enqueue position and publishes it through the slot's sequence, nothing waits on a lock. The
+// entry strings are swapped in and out, so in a steady state no entry allocates.
+struct LogQueue {
+  static constexpr size_t c_size = 4096;  // A power of 2
+
+  LogQueue() {
+    for (size_t i = 0; i < c_size; i++)
+      slots_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  // False when the queue is full, the entry is left as it was
+  bool Push(std::string& entry) {
+    size_t position = enqueue_position_.load(std::memory_order_relaxed);
+    Slot* slot;
+    for (;;) {
+      slot = &slots_[position & (c_size - 1)];
+      auto difference = static_cast<std::ptrdiff_t>(slot->sequence.load(std::memory_order_acquire)) - static_cast<std::ptrdiff_t>(position);
+      if (difference == 0) {
+        if (enqueue_position_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+          break;
+      } else if (difference < 0)
+        return false;
+      else
+        position = enqueue_position_.load(std::memory_order_relaxed);
+    }
+    slot->entry.swap(entry);
+    slot->sequence.store(position + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Only called by the holder of AsyncLog::write_mutex_
+  bool Pop(std::string& entry) {
+    auto& slot = slots_[dequeue_position_ & (c_size - 1)];
+    if (slot.sequence.load(std::memory_order_acquire) != dequeue_position_ + 1)
+      return false;
+    entry.swap(slot.entry);
+    slot.entry.clear();
+    slot.sequence.store(dequeue_position_ + c_size, std::memory_order_release);
+    dequeue_position_++;
+    return true;
+  }
+
+  // Only called by the holder of AsyncLog::write_mutex_
+  bool Empty() const {
+    return slots_[dequeue_position_ & (c_size - 1)].sequence.load(std::memory_order_acquire) != dequeue_position_ + 1;
+  }
+
+ private:
+  struct Slot {
+    std::atomic<size_t> sequence;
+    std::string entry;
+  };
+  Slot slots_[c_size];
+  alignas(64) std::atomic<size_t> enqueue_position_{};
+  alignas(64) size_t dequeue_position_{};
+};
+
+struct AsyncLog {
+  ~AsyncLog() { Stop(); }
+
+  void Start() {
+    std::lock_guard lock{state_mutex_};
+    if (thread_.joinable())
+      return;
+    stop_ = false;
+    running_ = true;
+    thread_ = std::thread([this] { Run(); });
+  }
+
+  // Writes what's queued and ends the thread
+  void Stop() {
+    std::lock_guard lock{state_mutex_};
+    if (!thread_.joinable())
+      return;
+    running_ = false;
+    {
+      std::lock_guard wake_lock{wake_mutex_};
+      stop_ = true;
+    }
+    wake_.notify_one();
+    thread_.join();
+
+    // Entries a thread queued just as the writer finished
+    std::lock_guard write_lock{write_mutex_};
+    WriteQueued();
+  }
+
+  void Push(std::string& entry) {
+    if (!running_) {
+      // A thread's entry that was started before the log stopped being async
+      std::lock_guard lock{write_mutex_};
+      *gp_stream << entry;
+      gp_stream->flush();
+      entry.clear();
+      return;
+    }
+    if (!Admit() || !queue_.Push(entry)) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      entry.clear();
+      return;
+    }
+    if (!running_) {
+      // Stop may have drained the queue before this entry was in it
+      std::lock_guard lock{write_mutex_};
+      WriteQueued();
+      return;
+    }
+    // Only the push that finds the writer asleep wakes it, the others are written with that entry. A wake up that's
+    // missed, as the flag is read without the lock, is only late by the wait's timeout.
+    if (sleeping_.load(std::memory_order_relaxed) && sleeping_.exchange(false, std::memory_order_relaxed))
+      wake_.notify_one();
+  }
+
+  void SetRateLimit(int per_second) { rate_limit_ = per_second; }
+
+  // Held while the thread writes, so the log's stream can be changed between entries
+  std::mutex write_mutex_;
+
+ private:
+  // The rate limit is kept per whole second
+  bool Admit() {
+    int limit = rate_limit_.load(std::memory_order_relaxed);
+    if (limit <= 0)
+      return true;
+    auto second = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    auto current = second_.load(std::memory_order_relaxed);
+    if (current != second && second_.compare_exchange_strong(current, second, std::memory_order_relaxed))
+      admitted_.store(0, std::memory_order_relaxed);
+    return admitted_.fetch_add(1, std::memory_order_relaxed) < limit;
+  }
+
+  // The caller holds write_mutex_, which makes it the queue's single consumer
+  void WriteQueued() {
+    bool wrote = false;
+    while (queue_.Pop(written_)) {
+      *gp_stream << written_;
+      wrote = true;
+    }
+    if (auto dropped = dropped_.exchange(0, std::memory_order_relaxed)) {
+      *gp_stream << "[" << dropped << " log entries dropped]" << '\n';
+      wrote = true;
+    }
+    if (wrote)
+      gp_stream->flush();
+  }
+
+  void Run() {
+    for (;;) {
+      bool empty;
+      {
+        std::lock_guard lock{write_mutex_};
+        WriteQueued();
+        empty = queue_.Empty();
+      }
+
+      std::unique_lock lock{wake_mutex_};
+      if (stop_ && empty)
+        return;
+      sleeping_.store(true, std::memory_order_relaxed);
+      wake_.wait_for(lock, std::chrono::milliseconds(10));
+      sleeping_.store(false, std::memory_order_relaxed);
+    }
+  }
+
+  LogQueue queue_;
+  std::mutex state_mutex_, wake_mutex_;
+  std::condition_variable wake_;
+  std::thread thread_;
+  bool stop_{};
+  std::atomic<bool> running_{};   // Entries are queued for the thread, otherwise Push writes them itself
+  std::atomic<bool> sleeping_{};  // The thread is waiting for entries
+  std::string written_;           // The entry being written, under write_mutex_
+  std::atomic<size_t> dropped_{};
+  std::atomic<int> rate_limit_{};
+  std::atomic<int64_t> second_{};
+  std::atomic<int> admitted_{};
+};
+
+AsyncLog& GetAsyncLog() {
+  static AsyncLog async_log;
+  return async_log;
+}
+
+// The stream Log() returns to a thread when the log is async, an entry is queued when the stream is flushed. The
+// entry is swapped into the queue for the string of one already written, so its memory is reused.
+struct AsyncLogBuffer : std::streambuf {
+ protected:
+  int_type overflow(int_type c) override {
+    if (!traits_type::eq_int_type(c, traits_type::eof()))
+      entry_.push_back(traits_type::to_char_type(c));
+    return traits_type::not_eof(c);
+  }
+
+  std::streamsize xsputn(const char* text, std::streamsize count) override {
+    entry_.append(text, static_cast<size_t>(count));
+    return count;
+  }
+
+  int sync() override {
+    if (!entry_.empty())
+      GetAsyncLog().Push(entry_);
+    entry_.clear();
+    return 0;
+  }
+
+ private:
+  std::string entry_;
+};
+
+std::ostream& GetAsyncLogStream() {
+  thread_local AsyncLogBuffer buffer;
+  thread_local std::ostream stream{&buffer};
+  return stream;
+}
+
+}  // namespace
+
 void SetLogBool(std::string_view name, bool value) {
   if (name == "enabled")
     g_log.enabled = value;
@@ -19,6 +244,13 @@ void SetLogBool(std::string_view name, bool value) {
     g_log.ansi_tags = value;
   else if (name == "warning")
     g_log.warning = value;
+  else if (name == "async") {
+    g_log.async = value;
+    if (value)
+      GetAsyncLog().Start();
+    else
+      GetAsyncLog().Stop();
+  }
   else if (name == "generate_next_token")
     g_log.generate_next_token = value;
   else if (name == "append_next_tokens")
@@ -35,12 +267,21 @@ void SetLogBool(std::string_view name, bool value) {
     g_log.model_output_values = value;
   else if (name == "model_logits")
     g_log.model_logits = value;
+  else if (name == "prefix_cache")
+    g_log.prefix_cache = value;
+  else if (name == "speculative_decoding")
+    g_log.speculative_decoding = value;
+  else if (name == "model_cache")
+    g_log.model_cache = value;
+  else if (name == "trace")
+    SetTraceRecording(value);
   else
     throw JSON::unknown_value_error{};
 }
 
 void SetLogString(std::string_view name, std::string_view value) {
   if (name == "filename") {
+    std::lock_guard lock{GetAsyncLog().write_mutex_};
     if (value.empty())
       gp_logfile.reset();
     else {
@@ -52,7 +293,16 @@ void SetLogString(std::string_view name, std::string_view value) {
       gp_stream = gp_logfile.get();
     else
       gp_stream = &std::cerr;
-  } else
+  } else if (name == "trace_filename")
+    SetTraceFilename(value);
+  else if (name == "rate_limit") {
+    int per_second{};
+    auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), per_second);
+    if (error != std::errc{} || end != value.data() + value.size() || per_second < 0)
+      throw std::runtime_error("rate_limit must be a number of entries per second (0 for no limit), not '" + std::string(value) + "'");
+    GetAsyncLog().SetRateLimit(per_second);
+  }
+  else
     throw JSON::unknown_value_error{};
 }
 
@@ -79,12 +329,13 @@ bool RunExample = (SGRExample(std::cerr), false);
 
 std::ostream& Log(std::string_view label, std::string_view string) {
   assert(g_log.enabled);
+  auto& stream = g_log.async ? GetAsyncLogStream() : *gp_stream;
 
   // Warnings will be yellow, all other labels will be blue
-  *gp_stream << SGR::Bold << (label == "warning" ? SGR::Bg_Yellow : SGR::Bg_Blue) << "  " << label << "  " << SGR::Reset << ' ';
+  stream << SGR::Bold << (label == "warning" ? SGR::Bg_Yellow : SGR::Bg_Blue) << "  " << label << "  " << SGR::Reset << ' ';
   if (!string.empty())
-    *gp_stream << string << std::endl;
-  return *gp_stream;
+    stream << string << std::endl;
+  return stream;
 }
 
 }  // namespace Generators
\ No newline at end of file
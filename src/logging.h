@@ -15,6 +15,13 @@
  *
  * Logging to a file is special: SetLogString("filename", "path") as "filename" is not a string in LogItems
  *
+ * Tracing is separate from the log: SetLogBool("trace", true) and SetLogString("trace_filename", "path"), see tracing.h
+ *
+ * ASYNC: With SetLogBool("async", true) the threads logging don't write to the log themselves. Every entry (a line,
+ *        up to the std::endl) goes through a lock free queue to a thread that writes them, so logging in production
+ *        doesn't hold up generation. Entries that don't fit in the queue, or over SetLogString("rate_limit", "N")
+ *        entries a second, are dropped and counted in the log. Turning async off writes what's queued first.
+ *
  * COLOR: The functions use ANSI SGR terminal codes for color, the 'struct SGR' below makes it easy to add common
  *        options during log options. Just look in the code for examples of how to use it. Note that the colors
  *        may differ in intensity/saturation on different platforms.
@@ -32,16 +39,20 @@ struct LogItems {
   bool enabled{};        // Global on/off for all logging
   bool ansi_tags{true};  // Use ansi SGR color & style tags to make console output easier to read
   bool warning{true};    // warning messages, like options that were set but don't apply
+  bool async{};          // Entries are written by a thread of their own, see ASYNC above
 
   // Loggable actions, will always have the name below with the log entry
   bool generate_next_token{};
   bool append_next_tokens{};
   bool hit_eos{};  // Only works for CPU non beam search
   bool hit_max_length{};
-  bool model_input_values{};   // Dump the input tensor shapes & values before the model runs
-  bool model_output_shapes{};  // Before the model runs there are only the output shapes, no values in them. Useful for pre Session::Run debugging
-  bool model_output_values{};  // After the model runs the output tensor values can be displayed
-  bool model_logits{};         // Same as model_output_values but only for the logits
+  bool model_input_values{};    // Dump the input tensor shapes & values before the model runs
+  bool model_output_shapes{};   // Before the model runs there are only the output shapes, no values in them. Useful for pre Session::Run debugging
+  bool model_output_values{};   // After the model runs the output tensor values can be displayed
+  bool model_logits{};          // Same as model_output_values but only for the logits
+  bool prefix_cache{};          // Prefix cache hits and insertions
+  bool speculative_decoding{};  // How many draft tokens were accepted every step
+  bool model_cache{};           // Optimized graphs saved to and loaded from session_options.cache_dir
 };
 
 extern LogItems g_log;
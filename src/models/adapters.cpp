@@ -0,0 +1,281 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include "../generators.h"
+#include "decoder_only.h"
+#include "utils.h"
+
+namespace Generators {
+
+static bool EndsWith(const std::string& s, std::string_view suffix) {
+  return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+std::vector<LoraInput> GetLoraInputs(OrtSession& session) {
+  std::vector<LoraInput> inputs;
+  auto names = session.GetInputNames();
+  for (size_t i = 0; i < names.size(); i++) {
+    bool is_a = EndsWith(names[i], ".lora_A");
+    if (!is_a && !EndsWith(names[i], ".lora_B"))
+      continue;
+
+    auto type_info = session.GetInputTypeInfo(i);
+    auto& tensor_info = type_info->GetTensorTypeAndShapeInfo();
+    auto shape = tensor_info.GetShape();
+    if (shape.size() != 3)
+      throw std::runtime_error("Lora input " + names[i] + " must have 3 dimensions");
+    inputs.push_back({std::move(names[i]), is_a, is_a ? shape[1] : shape[2], tensor_info.GetElementType()});
+  }
+  return inputs;
+}
+
+// The rank of an adapter's {in, rank} lora_A or {rank, out} lora_B
+static int64_t GetRank(const LoraInput& input, OrtValue& value) {
+  auto shape = value.GetTensorTypeAndShapeInfo()->GetShape();
+  return input.is_a ? shape[1] : shape[0];
+}
+
+AdapterStack::AdapterStack(const Model& model, std::span<const LoraInput> inputs)
+    : model_{model},
+      inputs_{inputs.begin(), inputs.end()} {
+  Restack(1, std::vector<int64_t>(inputs_.size(), 1));
+}
+
+// A new storage of slots with every loaded adapter written back to its slot
+void AdapterStack::Restack(int64_t slots, std::vector<int64_t> ranks) {
+  auto storage = std::make_shared<AdapterStorage>();
+  storage->slots = slots;
+  storage->ranks = std::move(ranks);
+
+  model_.SetCurrentDevice();
+  storage->values.reserve(inputs_.size());
+  for (size_t i = 0; i < inputs_.size(); i++) {
+    auto& input = inputs_[i];
+    const int64_t rank = storage->ranks[i];
+    std::array<int64_t, 3> shape{slots, input.is_a ? input.features : rank, input.is_a ? rank : input.features};
+    auto value = OrtValue::CreateTensor(*model_.allocator_device_, shape, input.type);
+    const size_t bytes = static_cast<size_t>(slots * input.features * rank) * SizeOf(input.type);
+    switch (model_.device_type_) {
+      case DeviceType::ROCM:
+      case DeviceType::CPU:
+        std::memset(value->GetTensorMutableRawData(), 0, bytes);
+        break;
+#if USE_CUDA
+      case DeviceType::CUDA:
+        CudaCheck() == cudaMemset(value->GetTensorMutableRawData(), 0, bytes);
+        break;
+#endif
+      default:
+        throw std::runtime_error("Adapters are only supported on CPU and CUDA");
+    }
+    storage->values.emplace_back(input.name, std::move(value));
+  }
+
+  std::vector<std::shared_ptr<const Adapter>> adapters;
+  if (weights_)
+    adapters = weights_->adapters_;
+  adapters.resize(static_cast<size_t>(slots - 1));
+  for (size_t i = 0; i < adapters.size(); i++) {
+    if (adapters[i])
+      WriteSlot(*storage, static_cast<int64_t>(i) + 1, *adapters[i]);
+  }
+
+  storage_ = std::move(storage);
+  occupants_.assign(adapters.begin(), adapters.end());
+  weights_ = std::make_shared<AdapterWeights>(AdapterWeights{storage_, std::move(adapters)});
+}
+
+void AdapterStack::WriteSlot(const AdapterStorage& storage, int64_t slot, const Adapter& adapter) const {
+  model_.SetCurrentDevice();
+  std::vector<uint8_t> host;
+  for (size_t i = 0; i < inputs_.size(); i++) {
+    auto& input = inputs_[i];
+    const int64_t rank = storage.ranks[i];
+    const size_t element_size = SizeOf(input.type);
+    const size_t slot_bytes = static_cast<size_t>(input.features * rank) * element_size;
+    host.assign(slot_bytes, 0);
+
+    if (auto it = adapter.values.find(input.name); it != adapter.values.end()) {
+      const int64_t adapter_rank = GetRank(input, *it->second);
+      auto* source = static_cast<const uint8_t*>(it->second->GetTensorRawData());
+      if (input.is_a) {
+        // {in, rank} rows, padded to the stacked rank
+        const size_t row_bytes = static_cast<size_t>(adapter_rank) * element_size;
+        for (int64_t f = 0; f < input.features; f++)
+          std::memcpy(host.data() + static_cast<size_t>(f * rank) * element_size, source + static_cast<size_t>(f) * row_bytes, row_bytes);
+      } else {
+        // {rank, out}, the rows past the adapter's rank stay zero
+        std::memcpy(host.data(), source, static_cast<size_t>(adapter_rank * input.features) * element_size);
+      }
+    }
+
+    // A reused slot is overwritten whole, so the previous adapter's weights past this one's rank don't remain
+    auto* target = static_cast<uint8_t*>(storage.values[i].second->GetTensorMutableRawData()) + static_cast<size_t>(slot) * slot_bytes;
+    switch (model_.device_type_) {
+      case DeviceType::ROCM:
+      case DeviceType::CPU:
+        std::memcpy(target, host.data(), slot_bytes);
+        break;
+#if USE_CUDA
+      case DeviceType::CUDA:
+        CudaCheck() == cudaMemcpy(target, host.data(), slot_bytes, cudaMemcpyHostToDevice);
+        break;
+#endif
+      default:
+        throw std::runtime_error("Adapters are only supported on CPU and CUDA");
+    }
+  }
+}
+
+std::shared_ptr<const AdapterWeights> AdapterStack::Load(Adapter adapter) {
+  for (auto& loaded : weights_->adapters_) {
+    if (loaded && loaded->name == adapter.name)
+      throw std::runtime_error("Adapter already loaded: " + adapter.name);
+  }
+
+  std::vector<int64_t> ranks = storage_->ranks;
+  bool grow_rank = false;
+  for (size_t i = 0; i < inputs_.size(); i++) {
+    if (auto it = adapter.values.find(inputs_[i].name); it != adapter.values.end()) {
+      const int64_t rank = GetRank(inputs_[i], *it->second);
+      grow_rank |= rank > ranks[i];
+      ranks[i] = std::max(ranks[i], rank);
+    }
+  }
+
+  // A slot is free once it's empty in the current weights and no older weights still hold its last adapter
+  auto loaded = std::make_shared<const Adapter>(std::move(adapter));
+  auto& adapters = weights_->adapters_;
+  auto free = std::find_if(occupants_.begin(), occupants_.end(), [](const auto& occupant) { return occupant.expired(); });
+  size_t slot = static_cast<size_t>(std::distance(occupants_.begin(), free));
+  if (grow_rank || free == occupants_.end()) {
+    // Restacking starts a new storage, so the slots older weights still hold are free in it
+    auto empty = std::find(adapters.begin(), adapters.end(), nullptr);
+    slot = static_cast<size_t>(std::distance(adapters.begin(), empty));
+    const int64_t slots = empty == adapters.end() ? storage_->slots * 2 : storage_->slots;
+    Restack(slots, std::move(ranks));
+  }
+
+  WriteSlot(*storage_, static_cast<int64_t>(slot) + 1, *loaded);
+  occupants_[slot] = loaded;
+  auto updated = weights_->adapters_;
+  updated[slot] = std::move(loaded);
+  weights_ = std::make_shared<AdapterWeights>(AdapterWeights{storage_, std::move(updated)});
+  return weights_;
+}
+
+std::shared_ptr<const AdapterWeights> AdapterStack::Unload(const std::string& name) {
+  auto updated = weights_->adapters_;
+  auto it = std::find_if(updated.begin(), updated.end(), [&](const auto& adapter) { return adapter && adapter->name == name; });
+  if (it == updated.end())
+    throw std::runtime_error("Adapter not loaded: " + name);
+  it->reset();
+  weights_ = std::make_shared<AdapterWeights>(AdapterWeights{storage_, std::move(updated)});
+  return weights_;
+}
+
+int32_t AdapterWeights::GetIndex(const std::string& name) const {
+  if (name.empty())
+    return 0;
+  auto it = std::find_if(adapters_.begin(), adapters_.end(), [&](const auto& adapter) { return adapter && adapter->name == name; });
+  if (it == adapters_.end())
+    throw std::runtime_error("Adapter not loaded: " + name);
+  return static_cast<int32_t>(std::distance(adapters_.begin(), it)) + 1;
+}
+
+static const DecoderOnly_Model& GetLoraModel(const Model& model) {
+  auto* decoder_only = dynamic_cast<const DecoderOnly_Model*>(&model);
+  if (!decoder_only)
+    throw std::runtime_error("Adapters require a decoder only model, not " + model.config_->model.type);
+  if (decoder_only->lora_inputs_.empty())
+    throw std::runtime_error("The model has no lora inputs, export it with the enable_lora builder option to use adapters");
+  return *decoder_only;
+}
+
+Adapters::Adapters(const Model& model)
+    : model_{model.shared_from_this()},
+      decoder_only_{GetLoraModel(model)},
+      stack_{model, decoder_only_.lora_inputs_} {}
+
+void Adapters::LoadAdapter(const fs::path& path, const std::string& name) {
+  if (name.empty())
+    throw std::runtime_error("An adapter needs a name, \"\" is the base model");
+
+  // The builder exports an adapter as a graph without inputs whose outputs are its weights
+  auto session = OrtSession::Create(GetOrtEnv(), path.c_str(), OrtSessionOptions::Create().get());
+  auto output_names = session->GetOutputNames();
+  std::vector<const char*> names;
+  for (auto& output_name : output_names)
+    names.push_back(output_name.c_str());
+  std::vector<OrtValue*> outputs(names.size());
+  session->Run(nullptr, nullptr, nullptr, 0, names.data(), outputs.data(), outputs.size());
+
+  Adapter adapter{name, {}};
+  for (size_t i = 0; i < outputs.size(); i++)
+    adapter.values.emplace(output_names[i], std::unique_ptr<OrtValue>{outputs[i]});
+
+  for (auto& [value_name, value] : adapter.values) {
+    auto input = std::find_if(decoder_only_.lora_inputs_.begin(), decoder_only_.lora_inputs_.end(), [&](const LoraInput& i) { return i.name == value_name; });
+    if (input == decoder_only_.lora_inputs_.end())
+      throw std::runtime_error("Adapter " + name + " has weights for " + value_name + ", which isn't a lora input of the model");
+    auto info = value->GetTensorTypeAndShapeInfo();
+    auto shape = info->GetShape();
+    if (info->GetElementType() != input->type || shape.size() != 2 || shape[input->is_a ? 0 : 1] != input->features)
+      throw std::runtime_error("Adapter " + name + " weights " + value_name + " don't match the type or shape of the model input");
+
+    // lora_A and lora_B of one MatMul have to agree on the rank
+    auto other_name = value_name.substr(0, value_name.size() - 1) + (input->is_a ? "B" : "A");
+    auto other = adapter.values.find(other_name);
+    if (other == adapter.values.end() || GetRank(*input, *value) != other->second->GetTensorTypeAndShapeInfo()->GetShape()[input->is_a ? 0 : 1])
+      throw std::runtime_error("Adapter " + name + " needs both lora_A and lora_B of " + value_name + " with the same rank");
+  }
+
+  std::lock_guard lock(mutex_);
+  stack_.Load(std::move(adapter));
+}
+
+void Adapters::UnloadAdapter(const std::string& name) {
+  std::lock_guard lock(mutex_);
+  stack_.Unload(name);
+}
+
+std::shared_ptr<const AdapterWeights> Adapters::GetWeights() const {
+  std::lock_guard lock(mutex_);
+  return stack_.Get();
+}
+
+AdapterInputs::AdapterInputs(const DecoderOnly_Model& model, State& state)
+    : model_{model},
+      state_{state} {
+  auto& params = *state_.params_;
+  if (model_.lora_inputs_.empty()) {
+    if (params.adapters)
+      throw std::runtime_error("The model has no lora inputs, export it with the enable_lora builder option to use adapters");
+    return;
+  }
+  if (params.adapters && params.adapters->model_.get() != &model_)
+    throw std::runtime_error("The adapters were loaded for another model");
+  if (state_.GetCapturedGraphInfo())
+    throw std::runtime_error("Adapters are not supported with graph capture, the captured graphs are shared by every adapter");
+
+  weights_ = params.adapters ? params.adapters->GetWeights() : model_.base_adapter_weights_;
+
+  const int num_beams = params.search.num_beams;
+  adapter_ids_ = OrtValue::CreateTensor<int32_t>(model_.allocator_cpu_, std::array<int64_t, 1>{params.BatchBeamSize()});
+  auto* ids = adapter_ids_->GetTensorMutableData<int32_t>();
+  for (int i = 0; i < params.batch_size; i++)
+    std::fill_n(ids + i * num_beams, num_beams, weights_->GetIndex(params.RowAdapter(i)));
+}
+
+void AdapterInputs::Add() {
+  if (!adapter_ids_)
+    return;
+
+  state_.input_names_.push_back(model_.config_->model.decoder.inputs.adapter_ids.c_str());
+  state_.inputs_.push_back(adapter_ids_.get());
+  for (auto& [name, value] : weights_->storage_->values) {
+    state_.input_names_.push_back(name.c_str());
+    state_.inputs_.push_back(value.get());
+  }
+}
+
+}  // namespace Generators
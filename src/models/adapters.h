@@ -0,0 +1,101 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+#include <mutex>
+
+namespace Generators {
+
+struct DecoderOnly_Model;
+
+// A decoder exported with enable_lora has for every adapted MatMul the inputs <weight>.lora_A {num_adapters, in, rank}
+// and <weight>.lora_B {num_adapters, rank, out}, plus adapter_ids {batch_size}. Every row adds
+// x * lora_A[adapter_ids[row]] * lora_B[adapter_ids[row]] to the MatMul output, so one batch can mix adapters.
+struct LoraInput {
+  std::string name;
+  bool is_a;         // lora_A, lora_B otherwise
+  int64_t features;  // The in features of lora_A, the out features of lora_B
+  ONNXTensorElementDataType type;
+};
+
+std::vector<LoraInput> GetLoraInputs(OrtSession& session);  // Empty if the session has none
+
+// An adapter as exported by the model builder: its lora_A {in, rank} and lora_B {rank, out} by input name, on the CPU
+struct Adapter {
+  std::string name;
+  std::unordered_map<std::string, std::unique_ptr<OrtValue>> values;
+};
+
+// The weights of every input stacked over slots of adapters in device memory, {slots, in, rank} for lora_A and
+// {slots, rank, out} for lora_B. Slot 0 is all zeros and runs the base model, adapters with a lower rank are zero padded
+// and inputs an adapter doesn't have stay zero.
+struct AdapterStorage {
+  int64_t slots{};
+  std::vector<int64_t> ranks;  // Of every input
+  std::vector<std::pair<std::string, std::unique_ptr<OrtValue>>> values;
+};
+
+// What a generator runs with: the storage and the adapter in each of its slots
+struct AdapterWeights {
+  int32_t GetIndex(const std::string& name) const;  // The slot of a loaded adapter, 0 for ""
+
+  std::shared_ptr<const AdapterStorage> storage_;
+  // By slot - 1, null for a free slot. Holding them keeps their slots from being reused while a generator runs on them.
+  std::vector<std::shared_ptr<const Adapter>> adapters_;
+};
+
+// The slots of the adapters loaded so far. Loading an adapter only writes its own slot, the storage is only restacked
+// when it runs out of slots (doubling them) or the adapter has a higher rank. An unloaded adapter's slot is reused once
+// no generator runs on it anymore. Not thread safe, see Adapters.
+struct AdapterStack {
+  AdapterStack(const Model& model, std::span<const LoraInput> inputs);
+
+  std::shared_ptr<const AdapterWeights> Load(Adapter adapter);
+  std::shared_ptr<const AdapterWeights> Unload(const std::string& name);
+  std::shared_ptr<const AdapterWeights> Get() const { return weights_; }
+
+ private:
+  void Restack(int64_t slots, std::vector<int64_t> ranks);
+  void WriteSlot(const AdapterStorage& storage, int64_t slot, const Adapter& adapter) const;
+
+  const Model& model_;
+  std::vector<LoraInput> inputs_;
+  std::shared_ptr<AdapterStorage> storage_;
+  std::vector<std::weak_ptr<const Adapter>> occupants_;  // The adapter last written to every slot of storage_ but 0
+  std::shared_ptr<const AdapterWeights> weights_;
+};
+
+// Multi-LoRA serving: the adapters of one decoder only base model, selected per batch row through
+// GeneratorParams::adapter and row_adapters. Generators keep running on the adapters that were loaded when they were
+// created, whatever is loaded or unloaded after.
+struct Adapters : std::enable_shared_from_this<Adapters> {
+  Adapters(const Model& model);
+
+  void LoadAdapter(const fs::path& path, const std::string& name);
+  void UnloadAdapter(const std::string& name);
+  std::shared_ptr<const AdapterWeights> GetWeights() const;
+
+  std::shared_ptr<const Model> model_;
+  std::shared_ptr<Adapters> external_owner_;  // Set to 'this' when created by the C API to preserve lifetime
+
+ private:
+  const DecoderOnly_Model& decoder_only_;
+
+  mutable std::mutex mutex_;
+  AdapterStack stack_;
+};
+
+// Feeds adapter_ids and the stacked weights of the state's adapters to the decoder
+struct AdapterInputs {
+  AdapterInputs(const DecoderOnly_Model& model, State& state);
+  void Add();
+
+ private:
+  const DecoderOnly_Model& model_;
+  State& state_;
+
+  std::shared_ptr<const AdapterWeights> weights_;
+  std::unique_ptr<OrtValue> adapter_ids_;  // {batch_size * num_beams} int32 on the CPU
+};
+
+}  // namespace Generators
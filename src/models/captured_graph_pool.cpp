@@ -19,6 +19,14 @@ void CapturedGraphInfoRecycler::operator()(CapturedGraphInfo* captured_graph_inf
   }
 }
 
+// The extra inputs of a multimodal model are the images, which only go to its vision session. That session runs once
+// per prompt and is never captured, so the graphs of the embedding and decoder sessions are shared by every image.
+std::span<const GeneratorParams::Input> CapturedGraphPool::GetGraphExtraInputs(const Config& config, const GeneratorParams& params) {
+  if (!config.model.vision.filename.empty())
+    return {};
+  return params.extra_inputs;
+}
+
 CapturedGraphInfoPtr CapturedGraphPool::ReserveCapturedGraph(const Model& model, const GeneratorParams& params) const {
   if (!params.use_cuda_graph || (model.device_type_ != DeviceType::CUDA && model.device_type_ != DeviceType::DML)) {
     return nullptr;
@@ -27,11 +35,17 @@ CapturedGraphInfoPtr CapturedGraphPool::ReserveCapturedGraph(const Model& model,
   // Multiple generators can reserve graphs in parallel, so we need to make it thread saf
   std::unique_lock lock(captured_graph_mutex_);
 
-  auto key = std::make_unique<CapturedGraphKey>(params.max_batch_size, params.search.max_length, params.search.num_beams, params.extra_inputs);
+  auto extra_inputs = GetGraphExtraInputs(*config_, params);
+  auto key = std::make_unique<CapturedGraphKey>(params.GraphMaxBatchSize(), params.BufferMaxLength(), params.search.num_beams, extra_inputs);
   auto& captured_graphs = captured_graphs_map_[*key];
 
+  // An idle graph can only be used while no other graph is using the memory it shares with it
+  auto available = std::find_if(captured_graphs.begin(), captured_graphs.end(), [&](const CapturedGraphInfoPtr& captured_graph) {
+    return arena_->Acquire(captured_graph->StaticBuffers());
+  });
+
   // If no graphs are available, create a graph with a new ID
-  if (captured_graphs.empty()) {
+  if (available == captured_graphs.end()) {
     auto new_captured_graph = CapturedGraphInfoPtr(new CapturedGraphInfo);
 
     // Create a unique annotation id
@@ -40,18 +54,18 @@ CapturedGraphInfoPtr CapturedGraphPool::ReserveCapturedGraph(const Model& model,
     // We can unlock the mutex here since we don't access state that is subject to changes after this point
     lock.unlock();
 
-    new_captured_graph->max_batch_size_ = params.max_batch_size;
-    new_captured_graph->max_length_ = params.search.max_length;
+    new_captured_graph->max_batch_size_ = key->max_batch_size_;
+    new_captured_graph->max_length_ = key->max_length_;
     new_captured_graph->num_beams_ = params.search.num_beams;
     new_captured_graph->pool_ = shared_from_this();
 
     // Create the static buffer for the input ids
-    size_t max_beam_batch_size = static_cast<size_t>(params.search.num_beams) * params.max_batch_size;
-    new_captured_graph->sb_input_ids_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size);
+    size_t max_beam_batch_size = static_cast<size_t>(params.search.num_beams) * key->max_batch_size_;
+    new_captured_graph->sb_input_ids_ = std::make_unique<StaticBuffer>(arena_, allocator_device_, max_beam_batch_size);
 
 #if USE_DML
     if (model.device_type_ == DeviceType::DML) {
-      new_captured_graph->sb_input_ids_int32_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size);
+      new_captured_graph->sb_input_ids_int32_ = std::make_unique<StaticBuffer>(arena_, allocator_device_, max_beam_batch_size);
     }
 #endif
 
@@ -60,22 +74,27 @@ CapturedGraphInfoPtr CapturedGraphPool::ReserveCapturedGraph(const Model& model,
     new_captured_graph->sb_kv_caches_.reserve(layer_count * 2);
 
     for (int i = 0; i < layer_count * 2; ++i) {
-      new_captured_graph->sb_kv_caches_.push_back(std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size));
+      new_captured_graph->sb_kv_caches_.push_back(std::make_unique<StaticBuffer>(arena_, allocator_device_, max_beam_batch_size));
     }
 
     // Create the static buffer for the position ids, if needed
     if (session_info_->HasInput(config_->model.decoder.inputs.position_ids)) {
-      new_captured_graph->sb_position_ids_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size);
+      new_captured_graph->sb_position_ids_ = std::make_unique<StaticBuffer>(arena_, allocator_device_, max_beam_batch_size);
+    }
+
+    // Create the static buffer for seqlens_k, if it's fed instead of the attention mask
+    if (session_info_->HasInput(config_->model.decoder.inputs.seqlens_k)) {
+      new_captured_graph->sb_seqlens_k_ = std::make_unique<StaticBuffer>(arena_, allocator_device_, max_beam_batch_size);
     }
 
     // Create the static buffer for the attention mask, if needed
     if (session_info_->HasInput(config_->model.decoder.inputs.attention_mask)) {
-      new_captured_graph->sb_attention_mask_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size);
+      new_captured_graph->sb_attention_mask_ = std::make_unique<StaticBuffer>(arena_, allocator_device_, max_beam_batch_size);
 
 #if USE_DML
       // DML currently needs an additional static buffer for the mask
       if (model.device_type_ == DeviceType::DML) {
-        new_captured_graph->sb_attention_mask_next_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size);
+        new_captured_graph->sb_attention_mask_next_ = std::make_unique<StaticBuffer>(arena_, allocator_device_, max_beam_batch_size);
       }
 #endif
     }
@@ -83,22 +102,22 @@ CapturedGraphInfoPtr CapturedGraphPool::ReserveCapturedGraph(const Model& model,
     auto output_type = session_info_->GetOutputDataType(config_->model.decoder.outputs.logits);
 
     if (output_type == Ort::TypeToTensorType<float>::type) {
-      new_captured_graph->sb_logits32_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size);
+      new_captured_graph->sb_logits32_ = std::make_unique<StaticBuffer>(arena_, allocator_device_, max_beam_batch_size);
     }
 
     if (output_type == Ort::TypeToTensorType<Ort::Float16_t>::type) {
-      new_captured_graph->sb_logits16_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size);
+      new_captured_graph->sb_logits16_ = std::make_unique<StaticBuffer>(arena_, allocator_device_, max_beam_batch_size);
     }
 
     // Create the extra inputs
-    for (const auto& extra_input : params.extra_inputs) {
+    for (const auto& extra_input : extra_inputs) {
       auto first_dim = extra_input.tensor->ort_tensor_->GetTensorTypeAndShapeInfo()->GetShape()[0];
-      new_captured_graph->sb_extra_inputs_[extra_input.name] = std::make_unique<StaticBuffer>(allocator_device_, first_dim);
+      new_captured_graph->sb_extra_inputs_[extra_input.name] = std::make_unique<StaticBuffer>(arena_, allocator_device_, first_dim);
     }
 
     // Create the input embeddings if needed
     if (!model.config_->model.embedding.filename.empty()) {
-      new_captured_graph->sb_embeddings_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size);
+      new_captured_graph->sb_embeddings_ = std::make_unique<StaticBuffer>(arena_, allocator_device_, max_beam_batch_size);
     }
 
     new_captured_graph->key_ = std::move(key);
@@ -107,13 +126,68 @@ CapturedGraphInfoPtr CapturedGraphPool::ReserveCapturedGraph(const Model& model,
   }
 
   // We found a graph, so take it from the pool and return it to the caller
-  auto captured_graph = std::move(captured_graphs.front());
-  captured_graphs.pop_front();
+  auto captured_graph = std::move(*available);
+  captured_graphs.erase(available);
+  idle_graph_count_--;
   return captured_graph;
 }
 
+std::vector<StaticBuffer*> CapturedGraphInfo::StaticBuffers() const {
+  std::vector<StaticBuffer*> buffers;
+  auto add = [&](const std::unique_ptr<StaticBuffer>& buffer) {
+    if (buffer)
+      buffers.push_back(buffer.get());
+  };
+  add(sb_input_ids_);
+  for (auto& sb_kv_cache : sb_kv_caches_)
+    add(sb_kv_cache);
+  add(sb_logits16_);
+  add(sb_logits32_);
+  add(sb_position_ids_);
+  add(sb_attention_mask_);
+  add(sb_seqlens_k_);
+  for (auto& sb_extra_input : sb_extra_inputs_)
+    add(sb_extra_input.second);
+  add(sb_embeddings_);
+#if USE_DML
+  add(sb_attention_mask_next_);
+  add(sb_input_ids_int32_);
+#endif
+  return buffers;
+}
+
 void CapturedGraphPool::AddCapturedGraph(CapturedGraphInfoPtr&& captured_graph) const {
   std::unique_lock lock(captured_graph_mutex_);
+  arena_->Release(captured_graph->StaticBuffers());
+  captured_graph->last_use_ = ++last_use_;
   captured_graphs_map_[*captured_graph->key_].push_back(std::move(captured_graph));
+  idle_graph_count_++;
+  EvictIdleGraphs();
+}
+
+// Only the idle graphs can go, the ones reserved by generators are still in use. onnxruntime has no call to release the
+// graph of one annotation id, it keeps every captured graph until its session is released, and a graph replays on the
+// addresses of its static buffers. So an evicted graph is never handed out again and its blocks stay with the arena,
+// where the graphs captured later bind them instead of allocating more, and its buffers are only freed with the pool,
+// which the base Model releases after the sessions of the derived models.
+void CapturedGraphPool::EvictIdleGraphs() const {
+  const int max_graphs = config_->model.decoder.graph_capture.max_graphs;
+  if (max_graphs <= 0)
+    return;
+
+  while (idle_graph_count_ > static_cast<size_t>(max_graphs)) {
+    // Each list is in the order the graphs were returned, so the oldest graph is at the front of one of them
+    auto oldest = captured_graphs_map_.end();
+    for (auto it = captured_graphs_map_.begin(); it != captured_graphs_map_.end(); ++it) {
+      if (!it->second.empty() && (oldest == captured_graphs_map_.end() || it->second.front()->last_use_ < oldest->second.front()->last_use_))
+        oldest = it;
+    }
+
+    evicted_graphs_.emplace_back(oldest->second.front().release());  // Not through the recycler, that would return it to the pool
+    oldest->second.pop_front();
+    if (oldest->second.empty())
+      captured_graphs_map_.erase(oldest);
+    idle_graph_count_--;
+  }
 }
 }  // namespace Generators
\ No newline at end of file
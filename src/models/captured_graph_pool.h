@@ -16,7 +16,7 @@ inline void hash_combine(size_t& seed, T const& v) {
 struct InputKey {
   InputKey(std::string name, ONNXTensorElementDataType tensor_type, std::vector<int64_t> tensor_shape)
       : name_(std::move(name)),
-        tensor_type_(tensor_type_),
+        tensor_type_(tensor_type),
         tensor_shape_(std::move(tensor_shape)) {}
 
   bool operator==(const InputKey& other) const {
@@ -29,7 +29,7 @@ struct InputKey {
 };
 
 struct CapturedGraphKey {
-  CapturedGraphKey(int max_batch_size, int max_length, int num_beams, const std::vector<Generators::GeneratorParams::Input>& extra_inputs)
+  CapturedGraphKey(int max_batch_size, int max_length, int num_beams, std::span<const Generators::GeneratorParams::Input> extra_inputs)
       : max_batch_size_(max_batch_size),
         max_length_(max_length),
         num_beams_(num_beams) {
@@ -112,21 +112,31 @@ class CapturedGraphPool : public std::enable_shared_from_this<CapturedGraphPool>
   CapturedGraphPool(const Config* config, const SessionInfo* session_info, Ort::Allocator* allocator_device)
       : config_(config),
         session_info_(session_info),
-        allocator_device_(allocator_device){};
+        allocator_device_(allocator_device),
+        arena_{std::make_shared<StaticBufferArena>(allocator_device)} {};
 
   void AddCapturedGraph(CapturedGraphInfoPtr&& captured_graph) const;
   CapturedGraphInfoPtr ReserveCapturedGraph(const Model& model, const GeneratorParams& params) const;
 
+  // The extra inputs the captured graphs read, which go in their key and get static buffers
+  static std::span<const GeneratorParams::Input> GetGraphExtraInputs(const Config& config, const GeneratorParams& params);
+
  private:
+  void EvictIdleGraphs() const;  // Retires the least recently used idle graphs past model.decoder.graph_capture.max_graphs
+
   // Map from batch_size/max_length to a list of captured graphs
   mutable std::unordered_map<CapturedGraphKey, std::list<CapturedGraphInfoPtr>> captured_graphs_map_;
   mutable std::mutex captured_graph_mutex_;
+  mutable size_t idle_graph_count_{};  // Graphs in captured_graphs_map_
+  mutable uint64_t last_use_{};        // Incremented every time a graph is returned
+  mutable std::vector<std::unique_ptr<CapturedGraphInfo>> evicted_graphs_;  // Never reserved again, see EvictIdleGraphs
 
   // 0 is reserved for internal usage in cuda graphs, so we start from 1
   mutable int current_graph_annotation_id_ = 1;
   const Config* config_;
   const SessionInfo* session_info_;
   Ort::Allocator* allocator_device_;
+  std::shared_ptr<StaticBufferArena> arena_;  // Backs the static buffers of every graph
 };
 
 struct CapturedGraphInfo {
@@ -135,12 +145,14 @@ struct CapturedGraphInfo {
   int max_length_;
   int num_beams_;
   int index_;
+  uint64_t last_use_{};  // When it was returned to the pool, for eviction
   std::unique_ptr<Generators::StaticBuffer> sb_input_ids_;
   std::vector<std::unique_ptr<Generators::StaticBuffer>> sb_kv_caches_;
   std::unique_ptr<Generators::StaticBuffer> sb_logits16_;
   std::unique_ptr<Generators::StaticBuffer> sb_logits32_;
   std::unique_ptr<Generators::StaticBuffer> sb_position_ids_;
   std::unique_ptr<Generators::StaticBuffer> sb_attention_mask_;
+  std::unique_ptr<Generators::StaticBuffer> sb_seqlens_k_;
   std::unordered_map<std::string, std::unique_ptr<Generators::StaticBuffer>> sb_extra_inputs_;
   std::unique_ptr<Generators::StaticBuffer> sb_embeddings_;
   std::unique_ptr<CapturedGraphKey> key_;
@@ -150,6 +162,8 @@ struct CapturedGraphInfo {
   std::unique_ptr<Generators::StaticBuffer> sb_input_ids_int32_;
 #endif
 
+  std::vector<Generators::StaticBuffer*> StaticBuffers() const;  // Every one of the above that's set
+
   // Generates a unique annotation ID across different captured graph objects. This is necessary because different
   // generators could be alive at the same time and run the same batch size but with different static buffers, so
   // they need to have different annotation IDs.
@@ -130,6 +130,10 @@ void DumpValues(std::ostream& stream, ONNXTensorElementDataType type, const void
 }
 
 void DumpTensor(std::ostream& stream, OrtValue* value, bool dump_value) {
+  if (!value) {
+    stream << SGR::Fg_Green << "Allocated by ORT" << SGR::Reset << "\r\n";  // An output before the run
+    return;
+  }
   auto type_info = value->GetTensorTypeAndShapeInfo();
   auto shape = type_info->GetShape();
   stream << SGR::Fg_Green << "Shape[ " << SGR::Reset;
@@ -4,42 +4,480 @@
 namespace Generators {
 DecoderOnly_Model::DecoderOnly_Model(std::unique_ptr<Config> config, OrtEnv& ort_env)
     : Model{std::move(config)} {
-  session_decoder_ = OrtSession::Create(ort_env, (config_->config_path / fs::path(config_->model.decoder.filename)).c_str(), session_options_.get());
+  session_decoder_ = CreateSession(ort_env, config_->model.decoder.filename, session_options_.get());
 
   InitDeviceAllocator(*session_decoder_);
+
+  lora_inputs_ = GetLoraInputs(*session_decoder_);
+  if (!lora_inputs_.empty())
+    base_adapter_weights_ = AdapterStack{*this, lora_inputs_}.Get();
+}
+
+// The prefix cache holds single sequence kv that grows by reallocation, and the decoder has to accept a multi token
+// input on top of a non empty past. The kv of an adapter isn't the base model's, so only the base model is cached.
+static bool CanUsePrefixCache(const Model& model, const GeneratorParams& params) {
+  return model.GetPrefixCache() && params.batch_size == 1 && params.search.num_beams == 1 && params.RowAdapter(0).empty() &&
+         !params.search.past_present_share_buffer && !params.use_cuda_graph &&
+         (OnHost(model.device_type_) || model.device_type_ == DeviceType::CUDA) &&
+         std::find(params.input_ids.begin(), params.input_ids.end(), params.pad_token_id) == params.input_ids.end();
+}
+
+// Chunks hand their presents to the next chunk as its past, so they run without the shared buffer and the last state
+// seeds them into its own. The chunks don't carry input_lengths, which only matters with padding.
+static bool CanChunkPrefill(const Model& model, const GeneratorParams& params) {
+  return params.search.prefill_chunk_size > 0 && !params.use_cuda_graph && (params.input_lengths.empty() || params.batch_size == 1) &&
+         (OnHost(model.device_type_) || model.device_type_ == DeviceType::CUDA);
+}
+
+// Sampling num_return_sequences: the copies of a prompt share the kv of all but the prompt's last token, which is run once
+// per prompt and copied to every copy's rows. Each copy then runs the prompt's last token itself to get its logits.
+static bool CanForkPrompt(const Model& model, const GeneratorParams& params) {
+  return params.prompt_copies > 1 && !params.use_cuda_graph && (params.input_lengths.empty() || params.batch_size == params.prompt_copies) &&
+         (OnHost(model.device_type_) || model.device_type_ == DeviceType::CUDA);
+}
+
+// Prefill/decode disaggregation: like chunks the prompt carries no input_lengths, and the adapters are only loaded on
+// this model
+static bool CanDisaggregate(const DecoderOnly_Model& model, const GeneratorParams& params) {
+  return model.prefill_model_ && !params.use_cuda_graph && (params.input_lengths.empty() || params.batch_size == 1) &&
+         params.adapter.empty() && params.row_adapters.empty() &&
+         (OnHost(model.device_type_) || model.device_type_ == DeviceType::CUDA);
+}
+
+// Leaving rows out changes the batch size of every input, which the extra inputs, adapter_ids and last_token_indices
+// don't follow
+static bool CanCompactRows(const DecoderOnly_Model& model, const GeneratorParams& params) {
+  return params.search.num_beams == 1 && params.extra_inputs.empty() && model.lora_inputs_.empty() &&
+         !model.session_info_->HasInput(model.config_->model.decoder.inputs.last_token_indices) &&
+         (OnHost(model.device_type_) || model.device_type_ == DeviceType::CUDA);
+}
+
+// Returns the input_ids columns [begin, end) of every batch row
+static std::vector<int32_t> SliceInputIds(const GeneratorParams& params, int begin, int end) {
+  std::vector<int32_t> slice;
+  slice.reserve(static_cast<size_t>(params.batch_size) * (end - begin));
+  for (int i = 0; i < params.batch_size; i++) {
+    auto row = params.input_ids.subspan(static_cast<size_t>(i) * params.sequence_length, params.sequence_length);
+    slice.insert(slice.end(), row.begin() + begin, row.begin() + end);
+  }
+  return slice;
+}
+
+static std::shared_ptr<GeneratorParams> SliceParams(const GeneratorParams& params, int begin, int end) {
+  auto slice = std::make_shared<GeneratorParams>(params);
+  slice->external_owner_.reset();
+  slice->input_lengths.clear();
+  slice->input_ids_owner = SliceInputIds(params, begin, end);
+  slice->input_ids = slice->input_ids_owner;
+  slice->sequence_length = end - begin;
+  return slice;
+}
+
+// The column of the earliest last non pad token of any row. A run that produces the logits has to include it.
+static int LastPromptToken(const GeneratorParams& params) {
+  int last_token = params.sequence_length;
+  for (int i = 0; i < params.batch_size; i++) {
+    auto row = params.input_ids.subspan(static_cast<size_t>(i) * params.sequence_length, params.sequence_length);
+    int row_last = static_cast<int>(std::distance(std::find_if(row.rbegin(), row.rend(), [&](int32_t id) { return id != params.pad_token_id; }), row.rend())) - 1;
+    last_token = std::min(last_token, row_last);
+  }
+  return last_token;
+}
+
+// The columns [0, end) of one copy of every prompt, see GeneratorParams::prompt_copies
+static std::shared_ptr<GeneratorParams> PromptParams(const GeneratorParams& params, int end) {
+  const int copies = params.prompt_copies;
+  auto prompts = std::make_shared<GeneratorParams>(params);
+  prompts->external_owner_.reset();
+  prompts->prompt_copies = 1;
+  prompts->batch_size = params.batch_size / copies;
+  prompts->sequence_length = end;
+  prompts->search.past_present_share_buffer = false;  // Its presents become the pasts of the copies
+  prompts->input_lengths.clear();
+  prompts->row_search.clear();
+  prompts->row_adapters.clear();
+  prompts->input_ids_owner.clear();
+  for (int i = 0; i < prompts->batch_size; i++) {
+    auto row = params.input_ids.subspan(static_cast<size_t>(i) * copies * params.sequence_length, params.sequence_length);
+    prompts->input_ids_owner.insert(prompts->input_ids_owner.end(), row.begin(), row.begin() + end);
+    if (!params.row_adapters.empty())
+      prompts->row_adapters.push_back(params.RowAdapter(i * copies));
+  }
+  prompts->input_ids = prompts->input_ids_owner;
+  return prompts;
+}
+
+void DecoderOnly_Model::SetPrefillModel(std::shared_ptr<const Model> prefill_model) {
+  auto decoder_only = std::dynamic_pointer_cast<const DecoderOnly_Model>(prefill_model);
+  if (!decoder_only)
+    throw std::runtime_error("The prefill model has to be a decoder only model like this one");
+  for (auto* model = decoder_only.get(); model; model = model->prefill_model_.get()) {
+    if (model == this)
+      throw std::runtime_error("A model can't be its own prefill model, directly or through its prefill model's");
+  }
+  if (!OnHost(decoder_only->device_type_) && decoder_only->device_type_ != DeviceType::CUDA)
+    throw std::runtime_error("The prefill model has to run on CPU or CUDA");
+
+  auto& decoder = config_->model.decoder;
+  auto& prefill_decoder = decoder_only->config_->model.decoder;
+  char past_name[64];
+  snprintf(past_name, std::size(past_name), decoder.inputs.past_key_names.c_str(), 0);
+  if (prefill_decoder.num_hidden_layers != decoder.num_hidden_layers || prefill_decoder.num_key_value_heads != decoder.num_key_value_heads ||
+      prefill_decoder.head_size != decoder.head_size || !decoder_only->session_info_->HasInput(past_name) ||
+      decoder_only->session_info_->GetInputDataType(past_name) != session_info_->GetInputDataType(past_name))
+    throw std::runtime_error("The kv cache of the prefill model doesn't have the layers, heads or type of this model's");
+  prefill_model_ = std::move(decoder_only);
+}
+
+// The prefill model's presents, copied to this model's device
+static std::vector<std::unique_ptr<OrtValue>> CopyPrefillPresents(const Model& prefill_model, std::vector<std::unique_ptr<OrtValue>> presents, const Model& model) {
+  if (OnHost(prefill_model.device_type_) && OnHost(model.device_type_))
+    return presents;  // Already in host memory
+
+#if USE_CUDA
+  if (prefill_model.device_type_ == DeviceType::CUDA)
+    CudaCheck() == cudaStreamSynchronize(prefill_model.cuda_stream_);
+  for (auto& present : presents) {
+    auto type_and_shape = present->GetTensorTypeAndShapeInfo();
+    auto copy = OrtValue::CreateTensor(*model.allocator_device_, type_and_shape->GetShape(), type_and_shape->GetElementType());
+    size_t bytes = type_and_shape->GetElementCount() * SizeOf(type_and_shape->GetElementType());
+    auto* target = copy->GetTensorMutableRawData();
+    auto* source = present->GetTensorRawData();
+    if (prefill_model.device_type_ == DeviceType::CUDA && model.device_type_ == DeviceType::CUDA)
+      CudaCheck() == cudaMemcpyPeerAsync(target, model.device_id_, source, prefill_model.device_id_, bytes, model.cuda_stream_);
+    else if (model.device_type_ == DeviceType::CUDA)
+      CudaCheck() == cudaMemcpyAsync(target, source, bytes, cudaMemcpyHostToDevice, model.cuda_stream_);
+    else
+      CudaCheck() == cudaMemcpy(target, source, bytes, cudaMemcpyDeviceToHost);
+    present = std::move(copy);
+  }
+#endif
+  return presents;
 }
 
 std::unique_ptr<State> DecoderOnly_Model::CreateState(RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params) const {
-  return std::make_unique<DecoderOnly_State>(*this, sequence_lengths, params);
+  PromptPrefix prefix;
+  int prefix_length{};
+
+  if (CanForkPrompt(*this, params)) {
+    if (int fork_length = LastPromptToken(params); fork_length > 0) {
+      // The prompt state may itself use the prefix cache or chunked prefill
+      auto prompt_params = PromptParams(params, fork_length);
+      std::vector<int32_t> prompt_sequence_lengths(prompt_params->batch_size);
+      auto prompt_state = CreateState(cpu_span<int32_t>{prompt_sequence_lengths.data(), prompt_sequence_lengths.size()}, *prompt_params);
+      KV_BeamGather gather{*this};
+      for (auto& value : static_cast<DecoderOnly_State&>(*prompt_state).RunPrefill()) {
+        auto shape = value->GetTensorTypeAndShapeInfo()->GetShape();
+        shape[0] *= params.prompt_copies;
+        auto& copies = prefix.values.emplace_back(OrtValue::CreateTensor(*allocator_device_, shape, value->GetTensorTypeAndShapeInfo()->GetElementType()));
+        gather.ExpandBeams(*value, *copies, params.prompt_copies);
+      }
+      prefix_length = fork_length;
+      prefix.tokens = SliceInputIds(params, 0, prefix_length);
+      if (g_log.enabled && g_log.prefix_cache)
+        Log("prefix_cache", "sharing " + std::to_string(prefix_length) + " prompt tokens between " + std::to_string(params.prompt_copies) + " samples");
+    }
+  }
+
+  if (prefix_length == 0 && CanDisaggregate(*this, params)) {
+    if (int last_token = LastPromptToken(params); last_token > 0) {
+      // The prefill model's own prefix cache and chunked prefill still apply. The last token runs here for the logits.
+      auto prefill_params = SliceParams(params, 0, last_token);
+      prefill_params->device_type = prefill_model_->device_type_;
+      prefill_params->cuda_stream = prefill_model_->cuda_stream_;
+      prefill_params->search.past_present_share_buffer = false;  // Its presents become the past here
+      std::vector<int32_t> prefill_sequence_lengths(prefill_params->BatchBeamSize());
+      prefill_model_->SetCurrentDevice();
+      auto prefill_state = prefill_model_->CreateState(cpu_span<int32_t>{prefill_sequence_lengths.data(), prefill_sequence_lengths.size()}, *prefill_params);
+      auto presents = static_cast<DecoderOnly_State&>(*prefill_state).RunPrefill();
+      prefill_state.reset();
+      SetCurrentDevice();
+
+      prefix.values = CopyPrefillPresents(*prefill_model_, std::move(presents), *this);
+      prefix_length = last_token;
+      prefix.tokens = SliceInputIds(params, 0, prefix_length);
+    }
+  }
+
+  if (prefix_length == 0 && CanUsePrefixCache(*this, params)) {
+    if ((prefix.cached = GetPrefixCache()->Find(params.input_ids, prefix_length))) {
+      if (g_log.enabled && g_log.prefix_cache)
+        Log("prefix_cache", "hit for " + std::to_string(prefix_length) + " of " + std::to_string(params.input_ids.size()) + " prompt tokens");
+      prefix.tokens = SliceInputIds(params, 0, prefix_length);
+    }
+  }
+
+  if (prefix.values.empty() && CanChunkPrefill(*this, params)) {
+    // The logits come from the last run, so it has to contain the last non pad token of every row
+    int last_token = LastPromptToken(params);
+    int chunk_size = params.search.prefill_chunk_size;
+    while (prefix_length + chunk_size <= last_token) {
+      auto chunk_params = SliceParams(params, prefix_length, prefix_length + chunk_size);
+      chunk_params->search.past_present_share_buffer = false;  // Its presents become the next chunk's past
+      DecoderOnly_State chunk_state{*this, sequence_lengths, *chunk_params, std::move(prefix)};
+      prefix = {};
+      prefix.values = chunk_state.RunPrefill();
+      prefix_length += chunk_size;
+      prefix.tokens = SliceInputIds(params, 0, prefix_length);
+    }
+  } else if (prefix.values.empty() && params.search.prefill_chunk_size > 0 && g_log.enabled && g_log.warning) {
+    Log("warning", "prefill_chunk_size search option set, but the prompt is run whole due to the current configuration");
+  }
+
+  if (prefix_length == 0)
+    return std::make_unique<DecoderOnly_State>(*this, sequence_lengths, params);
+
+  // The state only sees the rest of the prompt
+  auto suffix_params = SliceParams(params, prefix_length, params.sequence_length);
+  return std::make_unique<DecoderOnly_State>(*this, sequence_lengths, *suffix_params, std::move(prefix));
 }
 
-DecoderOnly_State::DecoderOnly_State(const DecoderOnly_Model& model, RoamingArray<int32_t> sequence_lengths_unk, const GeneratorParams& params)
+DecoderOnly_State::DecoderOnly_State(const DecoderOnly_Model& model, RoamingArray<int32_t> sequence_lengths_unk, const GeneratorParams& params,
+                                     PromptPrefix prefix)
     : State{params, model},
       model_{model},
       captured_graph_info_(model.GetCapturedGraphPool()->ReserveCapturedGraph(model, params)),
-      position_inputs_{model, *this, sequence_lengths_unk} {
+      prefix_tokens_{std::move(prefix.tokens)},
+      prefix_length_{static_cast<int>(prefix_tokens_.size()) / params.batch_size},
+      position_inputs_{model, *this, sequence_lengths_unk, prefix_tokens_} {
   input_ids_.Add();
   position_inputs_.Add();
   logits_.Add();
   kv_cache_.Add();
   extra_inputs_.Add();
+  adapter_inputs_.Add();
+  sparse_attention_inputs_.Add();
+  rotary_cache_inputs_.Add();
+
+  if (prefix.cached)
+    kv_cache_.SeedPrefix(*prefix.cached, prefix_length_);
+  else if (!prefix.values.empty())
+    kv_cache_.SeedPast(std::move(prefix.values), prefix_length_);
+  else if (prefix.snapshot)
+    kv_cache_.LoadPast(*prefix.snapshot, prefix_length_);
+
+  if (params.search.compact_finished_rows) {
+    can_compact_rows_ = CanCompactRows(model, params);
+    if (!can_compact_rows_ && g_log.enabled && g_log.warning)
+      Log("warning", "compact_finished_rows search option set to true, but has been disabled due to the current configuration");
+  }
+}
+
+std::vector<std::unique_ptr<OrtValue>> DecoderOnly_State::RunPrefill() {
+  assert(first_run_);
+  int batch_size = static_cast<int>(input_ids_.GetShape()[0]);
+  State::Run(*model_.session_decoder_, batch_size);
+  return kv_cache_.TakePresents();
+}
+
+RoamingArray<float> DecoderOnly_State::RunAllPositions(bool handle_eos) {
+  assert(first_run_);
+  int batch_size = static_cast<int>(input_ids_.GetShape()[0]);
+  State::Run(*model_.session_decoder_, batch_size);
+  return logits_.GetAllPositions(handle_eos);
 }
 
 RoamingArray<float> DecoderOnly_State::Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) {
+  bool first_run = first_run_;
   if (!first_run_) {
     UpdateInputs(next_tokens, next_indices, current_length);
   }
+  logits_.Update();
+  rotary_cache_inputs_.Update(current_length);
 
   int batch_size = static_cast<int>(input_ids_.GetShape()[0]);
-  State::Run(*model_.session_decoder_, *model_.run_options_, batch_size);
+  State::Run(*model_.session_decoder_, batch_size);
+  kv_length_ = current_length;
+
+  if (first_run && CanUsePrefixCache(model_, *params_))
+    AddToPrefixCache();
 
   return logits_.Get();
 }
 
+void DecoderOnly_State::SetFinishedRows(std::span<const bool> finished) {
+  if (!can_compact_rows_ || first_run_)
+    return;
+
+  std::vector<int32_t> rows;
+  size_t row_count = rows_.empty() ? static_cast<size_t>(params_->batch_size) : rows_.size();
+  for (size_t i = 0; i < row_count; i++) {
+    int32_t row = rows_.empty() ? static_cast<int32_t>(i) : rows_[i];
+    if (!finished[row])
+      rows.push_back(row);
+  }
+  // With every row finished the generator is done, so there's no next run to shrink
+  if (!rows.empty() && rows.size() < row_count)
+    next_rows_ = std::move(rows);
+}
+
+void DecoderOnly_State::SwapOut(const std::string& path) {
+  if (first_run_)
+    throw std::runtime_error("Nothing to swap out before the first ComputeLogits");
+  kv_cache_.SwapOut(path);
+}
+
+// Appending tokens and snapshots start a new state on the kv of the sequence so far, which has to be a single row whose
+// kv still matches its tokens
+static void CheckCanReuseKV(const Model& model, const GeneratorParams& params, const char* what) {
+  if (params.use_cuda_graph)
+    throw std::runtime_error(std::string(what) + " is not supported with cuda graphs, the input shapes would change");
+  if (model.config_->model.decoder.kv_cache.window_size > 0)
+    throw std::runtime_error(std::string(what) + " is not supported with a kv_cache window_size, the kv no longer matches the sequence");
+  if (!OnHost(model.device_type_) && model.device_type_ != DeviceType::CUDA)
+    throw std::runtime_error(std::string(what) + " is only supported on CPU and CUDA");
+}
+
+static void CheckCanContinue(const Model& model, const GeneratorParams& params, const char* what) {
+  if (params.batch_size != 1 || params.search.num_beams != 1)
+    throw std::runtime_error(std::string(what) + " only supports batch_size 1 and num_beams 1");
+  CheckCanReuseKV(model, params, what);
+}
+
+std::unique_ptr<State> DecoderOnly_Model::LoadState(RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params, std::istream& file) const {
+  CheckCanContinue(*this, params, "Loading a generator");
+
+  int32_t kv_length{};
+  file.read(reinterpret_cast<char*>(&kv_length), sizeof(kv_length));
+  if (!file || kv_length < 0 || kv_length >= params.sequence_length)
+    throw std::runtime_error("The generator snapshot is corrupt");
+  if (kv_length == 0)
+    return CreateState(sequence_lengths, params);
+
+  PromptPrefix prefix;
+  prefix.tokens = SliceInputIds(params, 0, kv_length);
+  prefix.snapshot = &file;
+  auto suffix_params = SliceParams(params, kv_length, params.sequence_length);
+  return std::make_unique<DecoderOnly_State>(*this, sequence_lengths, *suffix_params, std::move(prefix));
+}
+
+std::unique_ptr<State> DecoderOnly_State::Continue(std::span<const int32_t> sequence, RoamingArray<int32_t> sequence_lengths) {
+  CheckCanContinue(model_, *params_, "Appending tokens");
+
+  auto params = std::make_shared<GeneratorParams>(*params_);
+  params->external_owner_.reset();
+  params->input_ids_owner.assign(sequence.begin(), sequence.end());
+  params->input_ids = params->input_ids_owner;
+  params->sequence_length = static_cast<int>(sequence.size());
+  params->input_lengths.clear();
+
+  // Nothing has run yet, so it's just a longer prompt
+  if (first_run_)
+    return model_.CreateState(sequence_lengths, *params);
+
+  // The tokens after kv_length_ (the last generated one and the appended ones) run on top of the kv as a multi token step
+  PromptPrefix prefix;
+  prefix.tokens.assign(sequence.begin(), sequence.begin() + kv_length_);
+  prefix.values = kv_cache_.TakePrefix(kv_length_);
+  auto suffix_params = SliceParams(*params, kv_length_, params->sequence_length);
+  return std::make_unique<DecoderOnly_State>(model_, sequence_lengths, *suffix_params, std::move(prefix));
+}
+
+void DecoderOnly_State::CheckCanMerge() const {
+  CheckCanReuseKV(model_, *params_, "Merging generators");
+  if (params_->search.num_beams != 1)
+    throw std::runtime_error("Merging generators only supports num_beams 1");
+  if (first_run_)
+    throw std::runtime_error("Merging generators needs every generator to have run its prompt");
+  if (!rows_.empty() || !next_rows_.empty())
+    throw std::runtime_error("Merging generators doesn't support compacted rows, the kv no longer has every row");
+}
+
+// The kv of the rows is left padded to the longest, like a left padded prompt, and the last generated token of every
+// row is the new state's one token prompt
+std::unique_ptr<State> DecoderOnly_Model::MergeStates(std::span<State* const> states, std::span<const std::vector<int32_t>> rows,
+                                                      RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params) const {
+  std::vector<DecoderOnly_State*> decoder_states;
+  for (auto* state : states) {
+    auto* decoder_state = dynamic_cast<DecoderOnly_State*>(state);
+    if (!decoder_state)
+      throw std::runtime_error("Merging generators only supports the generators of one decoder only model");
+    decoder_state->CheckCanMerge();
+    decoder_states.push_back(decoder_state);
+  }
+
+  std::vector<std::vector<std::unique_ptr<OrtValue>>> parts;
+  for (auto* decoder_state : decoder_states)
+    parts.push_back(decoder_state->TakeMergePast());
+
+  int past_length = params.sequence_length - 1;
+  PromptPrefix prefix;
+  prefix.values = KV_Cache::ConcatRows(*this, parts, rows, past_length);
+  prefix.tokens = SliceInputIds(params, 0, past_length);
+  auto suffix_params = SliceParams(params, past_length, params.sequence_length);
+  return std::make_unique<DecoderOnly_State>(*this, sequence_lengths, *suffix_params, std::move(prefix));
+}
+
+std::unique_ptr<State> DecoderOnly_State::Fork(RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params) const {
+  CheckCanContinue(model_, *params_, "Forking a generator");
+  if (first_run_)
+    return model_.CreateState(sequence_lengths, params);
+
+  // Like Continue, but the kv stays with this state, so the fork gets a device side copy of it
+  PromptPrefix prefix;
+  prefix.tokens.assign(params.input_ids.begin(), params.input_ids.begin() + kv_length_);
+  prefix.values = kv_cache_.CopyPrefix(kv_length_);
+  auto suffix_params = SliceParams(params, kv_length_, params.sequence_length);
+  return std::make_unique<DecoderOnly_State>(model_, sequence_lengths, *suffix_params, std::move(prefix));
+}
+
+void DecoderOnly_State::Save(std::ostream& file) {
+  CheckCanContinue(model_, *params_, "Saving a generator");
+
+  // Before the first run there's no kv of our own (a seeded past isn't saved), the whole sequence is the prompt
+  int32_t kv_length = first_run_ ? 0 : kv_length_;
+  file.write(reinterpret_cast<const char*>(&kv_length), sizeof(kv_length));
+  if (kv_length > 0)
+    kv_cache_.Save(file, kv_length);
+}
+
+void DecoderOnly_State::AddToPrefixCache() {
+  auto& prefix_cache = *model_.GetPrefixCache();
+  int prompt_length = prefix_length_ + params_->sequence_length;
+  int cached_length = prompt_length / prefix_cache.ChunkSize() * prefix_cache.ChunkSize();
+  if (cached_length <= prefix_length_)
+    return;  // Nothing new beyond the prefix we started from
+
+  std::vector<int32_t> tokens;
+  tokens.reserve(cached_length);
+  tokens.assign(prefix_tokens_.begin(), prefix_tokens_.end());
+  tokens.insert(tokens.end(), params_->input_ids.begin(), params_->input_ids.begin() + (cached_length - prefix_length_));
+  if (prefix_cache.Contains(tokens))
+    return;  // Another generator with the same prompt added it, no need to copy the kv again
+
+  if (g_log.enabled && g_log.prefix_cache)
+    Log("prefix_cache", "adding " + std::to_string(cached_length) + " prompt tokens");
+  prefix_cache.Insert(std::move(tokens), kv_cache_.CopyPrefix(cached_length));
+}
+
 void DecoderOnly_State::UpdateInputs(const RoamingArray<int32_t>& next_tokens_unk, RoamingArray<int32_t> beam_indices, int current_length) {
+  // Streaming: once the kv is full, the kv cache evicts the oldest tokens after the sinks so its length stops growing
+  auto& kv_config = model_.config_->model.decoder.kv_cache;
+  if (kv_config.window_size > 0)
+    current_length = std::min(current_length, kv_config.sink_size + kv_config.window_size + 1);
+
+  // Compacting finished rows: the position of every row that's kept within the rows run so far
+  std::vector<int32_t> kept;
+  if (!next_rows_.empty()) {
+    for (auto row : next_rows_)
+      kept.push_back(rows_.empty() ? row : static_cast<int32_t>(std::lower_bound(rows_.begin(), rows_.end(), row) - rows_.begin()));
+    input_ids_.KeepRows(next_rows_);
+  }
+
   input_ids_.Update(next_tokens_unk);
   position_inputs_.Update(current_length);
-  kv_cache_.Update(beam_indices.GetCPU(), current_length);
+  kv_cache_.Update(beam_indices, current_length);
+
+  if (!kept.empty()) {
+    position_inputs_.KeepRows(kept);
+    kv_cache_.KeepRows(kept);
+    logits_.KeepRows(next_rows_);
+    rows_ = std::move(next_rows_);
+    next_rows_.clear();
+
+    if (g_log.enabled && g_log.generate_next_token)
+      Log("generate_next_token", "running " + std::to_string(rows_.size()) + " of " + std::to_string(params_->batch_size) + " batch rows");
+  }
 }
 
 }  // namespace Generators
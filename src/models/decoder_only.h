@@ -5,6 +5,9 @@
 #include "kv_cache.h"
 #include "position_inputs.h"
 #include "extra_inputs.h"
+#include "adapters.h"
+#include "sparse_attention.h"
+#include "rotary_embedding.h"
 
 namespace Generators {
 
@@ -12,26 +15,78 @@ struct DecoderOnly_Model : Model {
   DecoderOnly_Model(std::unique_ptr<Config> config, OrtEnv& ort_env);
 
   std::unique_ptr<State> CreateState(RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params) const override;
+  std::unique_ptr<State> LoadState(RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params, std::istream& file) const override;
+  std::unique_ptr<State> MergeStates(std::span<State* const> states, std::span<const std::vector<int32_t>> rows,
+                                     RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params) const override;
+  void SetPrefillModel(std::shared_ptr<const Model> prefill_model) override;
 
   std::unique_ptr<OrtSession> session_decoder_;
+  std::shared_ptr<const DecoderOnly_Model> prefill_model_;  // See Model::SetPrefillModel
+
+  std::vector<LoraInput> lora_inputs_;                          // Empty unless exported with enable_lora
+  std::shared_ptr<const AdapterWeights> base_adapter_weights_;  // No adapters loaded, for generators without adapters
+};
+
+// The start of a prompt whose kv is already known, either from the prefix cache or from earlier prefill chunks
+struct PromptPrefix {
+  std::vector<int32_t> tokens;                       // {batch_size, prefix_length}
+  std::shared_ptr<const PrefixCache::Entry> cached;  // Shared with the cache, so its values are copied
+  std::vector<std::unique_ptr<OrtValue>> values;     // Otherwise the past key/values are taken over as is
+  std::istream* snapshot{};                          // Or they're read from a generator snapshot
 };
 
 struct DecoderOnly_State : State {
-  DecoderOnly_State(const DecoderOnly_Model& model, RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params);
+  // With a prefix, params holds only the rest of the prompt
+  DecoderOnly_State(const DecoderOnly_Model& model, RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params, PromptPrefix prefix = {});
   RoamingArray<float> Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) override;
   const CapturedGraphInfo* GetCapturedGraphInfo() const override { return captured_graph_info_.get(); };
 
+  // Runs the prompt without reading the logits and hands back the presents, used for all but the last prefill chunk
+  std::vector<std::unique_ptr<OrtValue>> RunPrefill();
+
+  // Speculative decoding and scoring: runs the inputs and returns the logits of every one of them rather than only the
+  // last. Scoring leaves the eos tokens as the model scored them, see Logits::GetAllPositions.
+  RoamingArray<float> RunAllPositions(bool handle_eos = true);
+  // The kv of the first length tokens seen so far, to seed a later state with. The state can't be run again afterwards.
+  std::vector<std::unique_ptr<OrtValue>> TakePast(int length) { return kv_cache_.TakePrefix(length); }
+  // Merging: the kv of every token run so far, see Model::MergeStates. Check first, so no state loses its kv when
+  // another can't be merged.
+  void CheckCanMerge() const;
+  std::vector<std::unique_ptr<OrtValue>> TakeMergePast() { return kv_cache_.TakePrefix(kv_length_); }
+
+  void SwapOut(const std::string& path) override;
+  void SwapIn() override { kv_cache_.SwapIn(); }
+
+  void SetFinishedRows(std::span<const bool> finished) override;
+
+  std::unique_ptr<State> Continue(std::span<const int32_t> sequence, RoamingArray<int32_t> sequence_lengths) override;
+  std::unique_ptr<State> Fork(RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params) const override;
+  void Save(std::ostream& file) override;
+
  private:
   void UpdateInputs(const RoamingArray<int32_t>& next_tokens, RoamingArray<int32_t> next_indices, int current_length);
+  void AddToPrefixCache();
 
   const DecoderOnly_Model& model_;
   CapturedGraphInfoPtr captured_graph_info_;
 
+  // search.compact_finished_rows: the batch row of every row being run, empty until a row is first left out. next_rows_
+  // is set when more rows finished, the next UpdateInputs() drops the others.
+  bool can_compact_rows_{};
+  std::vector<int32_t> rows_, next_rows_;
+
+  std::vector<int32_t> prefix_tokens_;
+  int prefix_length_{};
+  int kv_length_{};  // Tokens run so far, their kv is in kv_cache_
+
   InputIDs input_ids_{model_, *this};
   Logits logits_{model_, *this};
   KV_Cache kv_cache_{model_, *this};
   PositionInputs position_inputs_;
   ExtraInputs extra_inputs_{model_, *this};
+  AdapterInputs adapter_inputs_{model_, *this};
+  SparseAttentionInputs sparse_attention_inputs_{model_, *this};
+  RotaryCacheInputs rotary_cache_inputs_{model_, *this, prefix_length_ + params_->sequence_length};
 };
 
 }  // namespace Generators
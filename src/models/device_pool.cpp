@@ -0,0 +1,101 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include "../generators.h"
+#include "device_pool.h"
+
+namespace Generators {
+
+DevicePool::DevicePool(Ort::Allocator& allocator, size_t max_free_bytes)
+    : OrtAllocator{},
+      allocator_{allocator},
+      max_free_bytes_{max_free_bytes} {
+  version = ORT_API_VERSION;
+  // Called from inside onnxruntime, so a failure is a nullptr rather than an exception
+  OrtAllocator::Alloc = [](OrtAllocator* this_, size_t size) -> void* {
+    try {
+      return static_cast<DevicePool*>(this_)->Alloc(size);
+    } catch (...) {
+      return nullptr;
+    }
+  };
+  OrtAllocator::Free = [](OrtAllocator* this_, void* p) { static_cast<DevicePool*>(this_)->Free(p); };
+  OrtAllocator::Info = [](const OrtAllocator* this_) { return &static_cast<const DevicePool*>(this_)->allocator_.GetInfo(); };
+}
+
+DevicePool::~DevicePool() {
+  assert(used_.empty());  // The model outlives its generators
+  Trim();
+}
+
+void* DevicePool::Alloc(size_t bytes) {
+  const size_t bucket = BlockSize(bytes);
+  {
+    std::lock_guard lock{mutex_};
+    auto it = free_.find(bucket);
+    if (it != free_.end() && !it->second.empty()) {
+      void* p = it->second.back();
+      it->second.pop_back();
+      free_bytes_ -= bucket;
+      used_.emplace(p, bucket);
+      return p;
+    }
+  }
+
+  // Outside the lock, the device allocator has its own. When it's out of memory, the free blocks of other sizes
+  // may be what's in the way.
+  void* p{};
+  try {
+    p = allocator_.Alloc(bucket);
+  } catch (const std::exception&) {
+    if (FreeBytes() == 0)
+      throw;
+  }
+  if (!p) {
+    Trim();
+    p = allocator_.Alloc(bucket);
+    if (!p)
+      throw std::bad_alloc();
+  }
+
+  std::lock_guard lock{mutex_};
+  used_.emplace(p, bucket);
+  return p;
+}
+
+void DevicePool::Free(void* p) {
+  if (!p)
+    return;
+  {
+    std::lock_guard lock{mutex_};
+    auto it = used_.find(p);
+    assert(it != used_.end());
+    const size_t bucket = it->second;
+    used_.erase(it);
+    if (free_bytes_ + bucket <= max_free_bytes_) {
+      free_[bucket].push_back(p);
+      free_bytes_ += bucket;
+      return;
+    }
+  }
+  allocator_.Free(p);
+}
+
+size_t DevicePool::FreeBytes() const {
+  std::lock_guard lock{mutex_};
+  return free_bytes_;
+}
+
+void DevicePool::Trim() {
+  decltype(free_) blocks;
+  {
+    std::lock_guard lock{mutex_};
+    blocks.swap(free_);
+    free_bytes_ = 0;
+  }
+  for (auto& [bucket, pointers] : blocks) {
+    for (auto* p : pointers)
+      allocator_.Free(p);
+  }
+}
+
+}  // namespace Generators
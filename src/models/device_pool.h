@@ -0,0 +1,49 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "onnxruntime_api.h"
+#include "static_buffer.h"
+
+namespace Generators {
+
+// model.decoder.memory_pool_mb: the model's device allocator for the tensors of its generators. The blocks a generator
+// frees, all of them once it finishes, are kept by size and handed to the next generator asking for that size, so a
+// server in a steady state takes nothing from the device allocator and doesn't fragment it. Free blocks past
+// max_free_bytes go back to the device allocator, and all of them do when the device allocator runs out.
+//
+// Small blocks are kept by BucketSize, so similar sizes share them. Blocks from exact_size_bytes on, like the kv
+// cache, are kept by their exact size: rounding those up could take up to a fifth more device memory than the
+// MemoryBudget estimates charge for them.
+//
+// It's an OrtAllocator so it can be Model::allocator_device_, which every component allocates from and the tensors
+// created on it are freed through.
+struct DevicePool : OrtAllocator {
+  DevicePool(Ort::Allocator& allocator, size_t max_free_bytes);
+  ~DevicePool();
+
+  Ort::Allocator& GetAllocator() { return *reinterpret_cast<Ort::Allocator*>(static_cast<OrtAllocator*>(this)); }
+
+  void* Alloc(size_t bytes);
+  void Free(void* p);
+  void Trim();  // Gives every free block back to the device allocator
+  size_t FreeBytes() const;  // Kept for reuse
+
+  static constexpr size_t exact_size_bytes = 1 << 20;
+  static size_t BlockSize(size_t bytes) { return bytes >= exact_size_bytes ? bytes : BucketSize(std::max<size_t>(bytes, 1)); }
+
+ private:
+  Ort::Allocator& allocator_;
+  size_t max_free_bytes_;
+
+  mutable std::mutex mutex_;
+  std::unordered_map<void*, size_t> used_;               // The BlockSize of every block handed out
+  std::unordered_map<size_t, std::vector<void*>> free_;  // By BlockSize
+  size_t free_bytes_{};
+};
+
+}  // namespace Generators
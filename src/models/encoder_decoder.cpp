@@ -0,0 +1,202 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include "../generators.h"
+#include "encoder_decoder.h"
+
+namespace Generators {
+
+EncoderDecoder_Model::EncoderDecoder_Model(std::unique_ptr<Config> config, OrtEnv& ort_env)
+    : Model{std::move(config)} {
+  auto& decoder = config_->model.decoder;
+  if (config_->model.encoder_decoder_init.filename.empty())
+    throw std::runtime_error("model.encoder_decoder_init.filename is needed by encoder-decoder models");
+  if (decoder.inputs.cross_past_key_names.empty() || decoder.inputs.cross_past_value_names.empty() ||
+      decoder.outputs.cross_present_key_names.empty() || decoder.outputs.cross_present_value_names.empty())
+    throw std::runtime_error("model.decoder cross_past_key_names, cross_past_value_names, cross_present_key_names and cross_present_value_names are needed by encoder-decoder models");
+
+  CreateSessions({[&] { session_decoder_ = CreateSession(ort_env, decoder.filename, session_options_.get()); },
+                  [&] { session_encoder_ = CreateSession(ort_env, config_->model.encoder_decoder_init.filename, session_options_.get()); }});
+
+  InitDeviceAllocator(*session_decoder_);
+  session_encoder_info_ = std::make_unique<SessionInfo>(*session_encoder_);
+}
+
+std::unique_ptr<State> EncoderDecoder_Model::CreateState(RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params) const {
+  return std::make_unique<EncoderDecoder_State>(*this, sequence_lengths, params);
+}
+
+template <typename T>
+static void CopyRows(std::span<const int32_t> source, size_t row_length, size_t row_stride, T* target, size_t rows) {
+  for (size_t i = 0; i < rows; i++) {
+    auto row = source.subspan(i * row_stride * row_length, row_length);
+    target = std::copy(row.begin(), row.end(), target);
+  }
+}
+
+// Every row_stride-th row of source, as type
+static std::unique_ptr<OrtValue> CreateIds(Ort::Allocator& allocator, std::span<const int32_t> source, std::array<int64_t, 2> shape, size_t row_stride,
+                                           ONNXTensorElementDataType type, const char* name) {
+  auto value = OrtValue::CreateTensor(allocator, shape, type);
+  if (type == Ort::TypeToTensorType<int64_t>::type)
+    CopyRows(source, static_cast<size_t>(shape[1]), row_stride, value->GetTensorMutableData<int64_t>(), static_cast<size_t>(shape[0]));
+  else if (type == Ort::TypeToTensorType<int32_t>::type)
+    CopyRows(source, static_cast<size_t>(shape[1]), row_stride, value->GetTensorMutableData<int32_t>(), static_cast<size_t>(shape[0]));
+  else
+    throw std::runtime_error(std::string(name) + " must be int64 or int32");
+  return value;
+}
+
+EncoderDecoder_State::EncoderDecoder_State(const EncoderDecoder_Model& model, RoamingArray<int32_t> sequence_lengths_unk, const GeneratorParams& params)
+    : State{params, model},
+      model_{model} {
+  auto* inputs = std::get_if<GeneratorParams::EncoderDecoder>(&params.inputs);
+  if (!inputs || inputs->input_ids.empty())
+    throw std::runtime_error("Encoder-decoder models need the encoder input ids, see SetEncoderInputs");
+  inputs_encoder_ = *inputs;
+
+  auto& init = model_.config_->model.encoder_decoder_init;
+  auto& decoder_inputs = model_.config_->model.decoder.inputs;
+  copies_ = params_->search.num_beams * params_->prompt_copies;
+  encoder_batch_size_ = params_->batch_size / params_->prompt_copies;
+  if (inputs_encoder_.input_ids.size() != static_cast<size_t>(encoder_batch_size_) * inputs_encoder_.sequence_length)
+    throw std::runtime_error("The encoder input ids have " + std::to_string(inputs_encoder_.input_ids.size()) + " tokens, not batch size * sequence length");
+
+  const std::array<int64_t, 2> encoder_shape{encoder_batch_size_, inputs_encoder_.sequence_length};
+  encoder_input_ids_ = CreateIds(model_.allocator_cpu_, inputs_encoder_.input_ids, encoder_shape, 1,
+                                 model_.session_encoder_info_->GetInputDataType(init.inputs.input_ids), init.inputs.input_ids.c_str());
+  encoder_input_ids_ = model_.ExpandInputs(encoder_input_ids_, 1);  // Only moves it to the device
+
+  // The samples of a prompt are next to each other in input_ids, the encoder only takes the first of them
+  const std::array<int64_t, 2> decoder_shape{encoder_batch_size_, params_->sequence_length};
+  encoder_decoder_input_ids_ = CreateIds(model_.allocator_cpu_, params_->input_ids, decoder_shape, params_->prompt_copies,
+                                         model_.session_encoder_info_->GetInputDataType(init.inputs.decoder_input_ids), init.inputs.decoder_input_ids.c_str());
+
+  auto sequence_lengths = sequence_lengths_unk.GetCPU();
+  for (int i = 0; i < decoder_input_ids_.GetShape()[0]; i++) {
+    sequence_lengths[i] = static_cast<int32_t>(params_->sequence_length);
+  }
+
+  input_names_.push_back(init.inputs.input_ids.c_str());
+  inputs_.push_back(encoder_input_ids_.get());
+  if (model_.session_encoder_info_->HasInput(init.inputs.attention_mask)) {
+    auto mask = CreateEncoderMask(model_.session_encoder_info_->GetInputDataType(init.inputs.attention_mask));
+    encoder_attention_mask_ = model_.ExpandInputs(mask, 1);
+    input_names_.push_back(init.inputs.attention_mask.c_str());
+    inputs_.push_back(encoder_attention_mask_.get());
+  }
+  input_names_.push_back(init.inputs.decoder_input_ids.c_str());
+  inputs_.push_back(encoder_decoder_input_ids_.get());
+
+  if (model_.session_info_->HasInput(decoder_inputs.encoder_attention_mask)) {
+    auto mask = CreateEncoderMask(model_.session_info_->GetInputDataType(decoder_inputs.encoder_attention_mask));
+    decoder_encoder_attention_mask_ = model_.ExpandInputs(mask, copies_);
+  }
+
+  logits_.Add();
+  kv_cache_.AddEncoder();
+  extra_inputs_.Add();
+  cross_cache_.AddOutputs();
+  if (model_.session_info_->HasInput(decoder_inputs.encoder_hidden_states)) {
+    if (!model_.session_encoder_info_->HasOutput(init.outputs.hidden_states))
+      throw std::runtime_error("The decoder takes " + decoder_inputs.encoder_hidden_states + ", which the encoder doesn't output as " + init.outputs.hidden_states);
+    hidden_states_index_ = outputs_.size();
+    outputs_.push_back(nullptr);  // ORT allocates it
+    output_names_.push_back(init.outputs.hidden_states.c_str());
+  }
+}
+
+std::unique_ptr<OrtValue> EncoderDecoder_State::CreateEncoderMask(ONNXTensorElementDataType type) const {
+  const std::array<int64_t, 2> shape{encoder_batch_size_, inputs_encoder_.sequence_length};
+  auto mask = OrtValue::CreateTensor(model_.allocator_cpu_, shape, type);
+  auto fill = [&](auto* data) {
+    for (auto id : inputs_encoder_.input_ids)
+      *data++ = id != params_->pad_token_id ? 1 : 0;
+  };
+  if (type == Ort::TypeToTensorType<int64_t>::type)
+    fill(mask->GetTensorMutableData<int64_t>());
+  else if (type == Ort::TypeToTensorType<int32_t>::type)
+    fill(mask->GetTensorMutableData<int32_t>());
+  else
+    throw std::runtime_error("encoder_attention_mask must be int64 or int32");
+  return mask;
+}
+
+RoamingArray<float> EncoderDecoder_State::Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) {
+  int batch_size = static_cast<int>(decoder_input_ids_.GetShape()[0]);
+
+  switch (run_state_) {
+    case RunState::Encoder_Decoder_Init:
+      RunEncoder();
+
+      run_state_ = RunState::Decoder_First;
+      return logits_.Get();
+
+    case RunState::Decoder_First:
+      ClearIO();
+
+      decoder_input_ids_.Add();
+      if (decoder_encoder_attention_mask_) {
+        input_names_.push_back(model_.config_->model.decoder.inputs.encoder_attention_mask.c_str());
+        inputs_.push_back(decoder_encoder_attention_mask_.get());
+      }
+      if (encoder_hidden_states_) {
+        input_names_.push_back(model_.config_->model.decoder.inputs.encoder_hidden_states.c_str());
+        inputs_.push_back(encoder_hidden_states_.get());
+      }
+      logits_.Add();
+      kv_cache_.Add();
+      cross_cache_.AddInputs();
+      run_state_ = RunState::Decoder;
+      // Fall through
+
+    case RunState::Decoder:
+      UpdateInputs(next_tokens, next_indices, current_length);
+      break;
+  }
+
+  State::Run(*model_.session_decoder_, batch_size);
+  return logits_.Get();
+}
+
+// One run for every prompt of the batch: its logits, self attention kv and hidden states are copied to the beams and
+// samples of the prompt afterwards, and the cross kv, which never changes, copies itself once.
+void EncoderDecoder_State::RunEncoder() {
+  auto row_outputs = outputs_;
+  if (copies_ > 1) {
+    for (auto& output : outputs_)
+      output = nullptr;  // ORT allocates them at the encoder batch size
+  }
+
+  State::Run(*model_.session_encoder_, encoder_batch_size_);
+
+  if (copies_ > 1) {
+    for (size_t i = 0; i < outputs_.size(); i++) {
+      if (!row_outputs[i])
+        continue;  // The cross kv and hidden states are taken below
+      std::unique_ptr<OrtValue> output{outputs_[i]};
+      beam_gather_.ExpandBeams(*output, *row_outputs[i], copies_);
+      outputs_[i] = row_outputs[i];
+    }
+  }
+  cross_cache_.TakeOutputs();
+
+  if (hidden_states_index_ != ~0U) {
+    encoder_hidden_states_.reset(outputs_[hidden_states_index_]);
+    outputs_[hidden_states_index_] = nullptr;
+    if (copies_ > 1) {
+      auto type_info = encoder_hidden_states_->GetTensorTypeAndShapeInfo();
+      auto shape = type_info->GetShape();
+      shape[0] *= copies_;
+      auto expanded = OrtValue::CreateTensor(*model_.allocator_device_, shape, type_info->GetElementType());
+      beam_gather_.ExpandBeams(*encoder_hidden_states_, *expanded, copies_);
+      encoder_hidden_states_ = std::move(expanded);
+    }
+  }
+}
+
+void EncoderDecoder_State::UpdateInputs(const RoamingArray<int32_t>& next_tokens, RoamingArray<int32_t> beam_indices, int current_length) {
+  decoder_input_ids_.Update(next_tokens);
+  kv_cache_.Update(beam_indices, current_length);
+}
+
+}  // namespace Generators
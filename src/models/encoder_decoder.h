@@ -0,0 +1,64 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+#include "model.h"
+#include "input_ids.h"
+#include "logits.h"
+#include "kv_cache.h"
+#include "extra_inputs.h"
+
+namespace Generators {
+
+// Text to text models like t5 and bart, with GeneratorParams::EncoderDecoder inputs. The encoder runs once for all the
+// prompts of a batch together with the decoder's first step, the decoder then runs alone for the following tokens.
+struct EncoderDecoder_Model : Model {
+  EncoderDecoder_Model(std::unique_ptr<Config> config, OrtEnv& ort_env);
+
+  std::unique_ptr<State> CreateState(RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params) const override;
+
+  std::unique_ptr<OrtSession> session_decoder_;  // decoder.onnx: decoder input ids, self and cross kv -> logits, self kv
+  std::unique_ptr<OrtSession> session_encoder_;  // encoder_decoder_init.onnx: encoder input ids, decoder input ids -> logits, self and cross kv
+
+  std::unique_ptr<SessionInfo> session_encoder_info_;
+};
+
+struct EncoderDecoder_State : State {
+  EncoderDecoder_State(const EncoderDecoder_Model& model, RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params);
+  RoamingArray<float> Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) override;
+
+ private:
+  void UpdateInputs(const RoamingArray<int32_t>& next_tokens, RoamingArray<int32_t> beam_indices, int current_length);
+  void RunEncoder();
+  std::unique_ptr<OrtValue> CreateEncoderMask(ONNXTensorElementDataType type) const;  // On the CPU at the encoder batch size
+
+  const EncoderDecoder_Model& model_;
+  enum struct RunState {
+    Encoder_Decoder_Init,
+    Decoder_First,
+    Decoder,
+  } run_state_{RunState::Encoder_Decoder_Init};
+
+  InputIDs decoder_input_ids_{model_, *this};
+  Logits logits_{model_, *this};
+  KV_Cache kv_cache_{model_, *this};
+  Cross_Cache cross_cache_{model_, *this};
+  ExtraInputs extra_inputs_{model_, *this};
+  KV_BeamGather beam_gather_{model_};
+
+  // The beams and samples of a prompt start out the same, so the encoder runs once per prompt and its outputs are
+  // copied to these rows of the decoder afterwards
+  int copies_;
+  int encoder_batch_size_;
+  GeneratorParams::EncoderDecoder inputs_encoder_;
+
+  std::unique_ptr<OrtValue> encoder_input_ids_;
+  std::unique_ptr<OrtValue> encoder_attention_mask_;
+  std::unique_ptr<OrtValue> encoder_decoder_input_ids_;
+
+  // The decoder inputs the encoder's run leaves behind, for decoders that take them, at every decoder row
+  std::unique_ptr<OrtValue> decoder_encoder_attention_mask_;
+  std::unique_ptr<OrtValue> encoder_hidden_states_;
+  size_t hidden_states_index_{~0U};  // Output of the encoder run
+};
+
+}  // namespace Generators
@@ -22,7 +22,7 @@ ExtraInputs::ExtraInputs(const Model& model, State& state)
       extra_inputs_.push_back(owned_extra_inputs_.back().get());
     }
   } else {
-    // We don't use graph capture, so simply use the existing pointers
+    // We don't use graph capture, so simply use the existing pointers. A tensor on the device is bound as it is.
     for (auto& extra_input : state_.params_->extra_inputs) {
       extra_inputs_.push_back(extra_input.tensor->ort_tensor_.get());
     }
@@ -36,7 +36,7 @@ void ExtraInputs::Add() {
     state_.inputs_.push_back(extra_inputs_[i]);
   }
 
-  // Copy the data from the CPU-backed ORT value to the static buffers
+  // Copy the data of the ORT values to the static buffers, the values can be on the CPU or already on the device
   for (int i = 0; i < sb_extra_inputs_.size(); ++i) {
     auto type_and_shape_info = extra_inputs_[i]->GetTensorTypeAndShapeInfo();
     auto shape = type_and_shape_info->GetShape();
@@ -49,7 +49,26 @@ void ExtraInputs::Add() {
         ComPtr<ID3D12Resource> target_resource;
         Ort::ThrowOnError(model_.GetOrtDmlApi()->GetD3D12ResourceFromAllocation(model_.allocator_device_, extra_inputs_[i]->GetTensorMutableRawData(), &target_resource));
 
-        auto source = std::span(state_.params_->extra_inputs[i].tensor->ort_tensor_->GetTensorData<const uint8_t>(), copy_size_in_bytes);
+        auto& user_input = *state_.params_->extra_inputs[i].tensor->ort_tensor_;
+        if (user_input.GetTensorMemoryInfo().GetDeviceType() == OrtMemoryInfoDeviceType_GPU) {
+          ComPtr<ID3D12Resource> source_resource;
+          Ort::ThrowOnError(model_.GetOrtDmlApi()->GetD3D12ResourceFromAllocation(model_.allocator_device_, user_input.GetTensorMutableRawData(), &source_resource));
+          model_.GetDmlExecutionContext()->CopyBufferRegion(
+              target_resource.Get(),
+              0,
+              D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+              source_resource.Get(),
+              0,
+              D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+              copy_size_in_bytes);
+
+          ComPtr<ID3D12Fence> fence;
+          uint64_t completion_value;
+          model_.GetDmlExecutionContext()->ExecuteCommandList(nullptr, &fence, &completion_value);
+          break;
+        }
+
+        auto source = std::span(user_input.GetTensorData<const uint8_t>(), copy_size_in_bytes);
 
         model_.GetDmlUploadHeap()->BeginUploadToGpu(
             target_resource.Get(),
@@ -65,7 +84,7 @@ void ExtraInputs::Add() {
             extra_inputs_[i]->GetTensorMutableRawData(),
             state_.params_->extra_inputs[i].tensor->ort_tensor_->GetTensorMutableRawData(),
             copy_size_in_bytes,
-            cudaMemcpyHostToDevice,
+            cudaMemcpyDefault,
             model_.cuda_stream_);
       } break;
 #endif
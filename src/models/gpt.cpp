@@ -5,7 +5,11 @@ namespace Generators {
 
 Gpt_Model::Gpt_Model(std::unique_ptr<Config> config, OrtEnv& ort_env)
     : Model{std::move(config)} {
-  session_decoder_ = OrtSession::Create(ort_env, (config_->config_path / fs::path(config_->model.decoder.filename)).c_str(), session_options_.get());
+  // The shared buffer needs the attention's past_sequence_length input, which is read on the cpu and so can't be
+  // replayed, and without it the kv shapes change every step
+  if (IsCudaGraphEnabled(config_->model.decoder.session_options))
+    throw std::runtime_error("Graph capture isn't supported by models with combined key/value tensors");
+  session_decoder_ = CreateSession(ort_env, config_->model.decoder.filename, session_options_.get());
   InitDeviceAllocator(*session_decoder_);
 }
 
@@ -33,7 +37,7 @@ RoamingArray<float> Gpt_State::Run(int current_length, RoamingArray<int32_t> nex
     UpdateInputs(next_tokens, next_indices, current_length);
   }
 
-  State::Run(*model_.session_decoder_, *model_.run_options_, batch_size);
+  State::Run(*model_.session_decoder_, batch_size);
   return logits_.Get();
 }
 
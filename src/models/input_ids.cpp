@@ -47,6 +47,15 @@ InputIDs::InputIDs(InputIDs&& other, State& state)
   type_ = other.type_;
 
   sb_input_ids_ = other.sb_input_ids_;
+  rows_ = std::move(other.rows_);
+#if USE_CUDA
+  rows_gpu_ptr_ = std::move(other.rows_gpu_ptr_);
+  rows_gpu_ = other.rows_gpu_;
+  next_tokens_pinned_ptr_ = std::move(other.next_tokens_pinned_ptr_);
+  next_tokens_pinned_ = other.next_tokens_pinned_;
+  next_tokens_gpu_ptr_ = std::move(other.next_tokens_gpu_ptr_);
+  next_tokens_gpu_ = other.next_tokens_gpu_;
+#endif
 
 #if USE_DML
   value_int32_ = std::move(other.value_int32_);
@@ -64,6 +73,45 @@ void InputIDs::Add() {
   state_.input_names_.push_back(name_);
 }
 
+void InputIDs::KeepRows(std::span<const int32_t> rows) {
+  rows_.assign(rows.begin(), rows.end());
+  shape_[0] = static_cast<int64_t>(rows.size());
+
+#if USE_CUDA
+  if (model_.device_type_ == DeviceType::CUDA) {
+    rows_gpu_ptr_ = CudaMallocArray<int32_t>(rows.size(), &rows_gpu_);
+    cudaMemcpyAsync(rows_gpu_.data(), rows_.data(), rows_.size() * sizeof(int32_t), cudaMemcpyHostToDevice, model_.cuda_stream_);
+    g_transfer_counters.host_to_device_bytes += rows_.size() * sizeof(int32_t);
+  }
+#endif
+
+  // Before the first Update() the prompt is still the input, Update() creates the tensor with the new shape then
+  if (shape_[1] == 1) {
+    value_ = sb_input_ids_ ? sb_input_ids_->CreateTensorOnStaticBuffer(shape_, type_) : OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
+    state_.inputs_[input_index_] = value_.get();
+  }
+}
+
+#if USE_CUDA
+// Tokens from the cuda search are used where they are. Tokens from the cpu (a cpu search, speculative decoding) go
+// through pinned memory with an async copy on the model stream, instead of RoamingArray::GetGPU's allocation and
+// synchronous copy. The staging buffer is free to reuse as the cpu had to wait for the last run to pick the tokens.
+gpu_span<int32_t> InputIDs::GetNextTokensGPU(RoamingArray<int32_t>& next_tokens) {
+  if (!next_tokens.device_.empty())
+    return next_tokens.device_;
+
+  auto cpu = next_tokens.GetCPU();
+  if (next_tokens_pinned_.size() < cpu.size()) {
+    next_tokens_pinned_ptr_ = CudaMallocHostArray<int32_t>(cpu.size(), &next_tokens_pinned_);
+    next_tokens_gpu_ptr_ = CudaMallocArray<int32_t>(cpu.size(), &next_tokens_gpu_);
+  }
+  std::copy(cpu.begin(), cpu.end(), next_tokens_pinned_.begin());
+  cudaMemcpyAsync(next_tokens_gpu_.data(), next_tokens_pinned_.data(), cpu.size_bytes(), cudaMemcpyHostToDevice, model_.cuda_stream_);
+  g_transfer_counters.host_to_device_bytes += cpu.size_bytes();
+  return gpu_span<int32_t>{next_tokens_gpu_.data(), cpu.size()};
+}
+#endif
+
 void InputIDs::Update(RoamingArray<int32_t> next_tokens_unk) {
   // Resize input_ids shape once if it doesn't match the decoder shape
   if (shape_[1] != 1) {
@@ -95,8 +143,11 @@ void InputIDs::Update(RoamingArray<int32_t> next_tokens_unk) {
 #if USE_CUDA
       case DeviceType::CUDA: {
         auto* data = value_->GetTensorMutableData<int64_t>();
-        auto next_tokens = next_tokens_unk.GetGPU();
-        cuda::LaunchInt32ToInt64(next_tokens.data(), data, static_cast<int>(next_tokens.size()), model_.cuda_stream_);
+        auto next_tokens = GetNextTokensGPU(next_tokens_unk);
+        if (!rows_.empty())
+          cuda::LaunchGatherTokens(next_tokens.data(), rows_gpu_.data(), data, static_cast<int>(shape_[0]), model_.cuda_stream_);
+        else
+          cuda::LaunchInt32ToInt64(next_tokens.data(), data, static_cast<int>(next_tokens.size()), model_.cuda_stream_);
       } break;
 #endif
 
@@ -125,21 +176,36 @@ void InputIDs::Update(RoamingArray<int32_t> next_tokens_unk) {
             input_ids_cast_command_list_state_);
       } break;
 #endif
+      case DeviceType::ROCM:
       case DeviceType::CPU: {
         auto* data = value_->GetTensorMutableData<int64_t>();
         auto next_tokens = next_tokens_unk.GetCPU();
         for (int i = 0; i < shape_[0]; i++) {
-          data[i] = next_tokens[i];
+          data[i] = next_tokens[rows_.empty() ? i : rows_[i]];
         }
       }
     }
   } else {
-    auto* data = value_->GetTensorMutableData<int32_t>();
 #if USE_CUDA
-    if (model_.device_type_ == DeviceType::CUDA)
-      cudaMemcpyAsync(data, next_tokens_unk.GetGPU().data(), shape_[0] * sizeof(int32_t), cudaMemcpyDeviceToDevice, model_.cuda_stream_);
-    else
+    if (model_.device_type_ == DeviceType::CUDA) {
+      auto next_tokens = GetNextTokensGPU(next_tokens_unk);
+      if (!rows_.empty())
+        cuda::LaunchGatherTokens(next_tokens.data(), rows_gpu_.data(), value_->GetTensorMutableData<int32_t>(), static_cast<int>(shape_[0]), model_.cuda_stream_);
+      else if (!sb_input_ids_) {
+        // Zero copy, the input is a view of the next tokens for this run. A captured graph needs its static buffer.
+        value_ = OrtValue::CreateTensor<int32_t>(model_.allocator_device_->GetInfo(), next_tokens.subspan(0, shape_[0]), shape_);
+        state_.inputs_[input_index_] = value_.get();
+      } else
+        cudaMemcpyAsync(value_->GetTensorMutableRawData(), next_tokens.data(), shape_[0] * sizeof(int32_t), cudaMemcpyDeviceToDevice, model_.cuda_stream_);
+      return;
+    }
 #endif
+    auto* data = value_->GetTensorMutableData<int32_t>();
+    if (!rows_.empty()) {
+      auto next_tokens = next_tokens_unk.GetCPU();
+      for (int i = 0; i < shape_[0]; i++)
+        data[i] = next_tokens[rows_[i]];
+    } else
       memcpy(data, next_tokens_unk.GetCPU().data(), shape_[0] * sizeof(int32_t));
   }
 }
@@ -11,6 +11,8 @@ struct InputIDs {
 
   void Add();
   void Update(RoamingArray<int32_t> next_tokens);
+  // Compacting finished rows: only the next tokens of these batch rows are run from now on
+  void KeepRows(std::span<const int32_t> rows);
 
   auto& GetShape() const { return shape_; }
   const char* name_;
@@ -26,6 +28,20 @@ struct InputIDs {
   ONNXTensorElementDataType type_;
   std::unique_ptr<OrtValue> value_;
 
+  std::vector<int32_t> rows_;  // Empty while every batch row is run
+#if USE_CUDA
+  gpu_span<int32_t> GetNextTokensGPU(RoamingArray<int32_t>& next_tokens);
+
+  cuda_unique_ptr<int32_t> rows_gpu_ptr_;
+  gpu_span<int32_t> rows_gpu_;
+
+  // Staging for next tokens that come from the cpu
+  cuda_host_unique_ptr<int32_t> next_tokens_pinned_ptr_;
+  cpu_span<int32_t> next_tokens_pinned_;
+  cuda_unique_ptr<int32_t> next_tokens_gpu_ptr_;
+  gpu_span<int32_t> next_tokens_gpu_;
+#endif
+
   // Used for decoding runs with cuda graphs.
   StaticBuffer* sb_input_ids_{};
 
@@ -2,8 +2,10 @@
 // Licensed under the MIT License.
 #include <cuda_fp16.h>
 #include <cuda_runtime.h>
+#include <cub/cub.cuh>
 #include <stdint.h>
 #include <limits>
+#include <algorithm>
 
 namespace Generators {
 namespace cuda {
@@ -23,6 +25,21 @@ void Launch_UpdatePositionIds(T* positions, int batch_beam_size, cudaStream_t st
 template void Launch_UpdatePositionIds(int32_t* positions, int batch_beam_size, cudaStream_t stream);
 template void Launch_UpdatePositionIds(int64_t* positions, int batch_beam_size, cudaStream_t stream);
 
+template <typename T>
+__global__ void ShiftPositionIds(T* positions, int batch_beam_size, int delta) {
+  int i = blockIdx.x * blockDim.x + threadIdx.x;
+  if (i < batch_beam_size)
+    positions[i] += delta;
+}
+
+template <typename T>
+void Launch_ShiftPositionIds(T* positions, int batch_beam_size, int delta, cudaStream_t stream) {
+  ShiftPositionIds<T><<<(batch_beam_size + 255) / 256, 256, 0, stream>>>(positions, batch_beam_size, delta);
+}
+
+template void Launch_ShiftPositionIds(int32_t* positions, int batch_beam_size, int delta, cudaStream_t stream);
+template void Launch_ShiftPositionIds(int64_t* positions, int batch_beam_size, int delta, cudaStream_t stream);
+
 template <typename T>
 __global__ void CopyAndUpdateAttentionMask(T* mask_data, const T* old_mask_data, int batch_beam_size,
                                            int current_length, int max_length) {
@@ -63,25 +80,30 @@ template void Launch_UpdateAttentionMask(int32_t* mask_data, const int32_t* old_
 template void Launch_UpdateAttentionMask(int64_t* mask_data, const int64_t* old_mask_data, int batch_beam_size,
                                          int current_length, int max_length, bool update_only, cudaStream_t stream);
 
-__global__ void HandleEOSArray(float* batch_logits, int batch_beam_size, int vocab_size, const int32_t* eos_token_ids, int eos_token_ids_count) {
+template <typename T>
+__global__ void HandleEOSArray(T* batch_logits, int batch_beam_size, int vocab_size, const int32_t* eos_token_ids, int eos_token_ids_count) {
   int index = blockIdx.x * blockDim.x + threadIdx.x;
   if (index >= batch_beam_size)
     return;
 
-  float* logits = batch_logits + index * vocab_size;
+  T* logits = batch_logits + index * vocab_size;
   float max = std::numeric_limits<float>::lowest();
   for (int i = 0; i < eos_token_ids_count; i++) {
-    max = std::max(max, logits[eos_token_ids[i]]);
-    logits[eos_token_ids[i]] = std::numeric_limits<float>::lowest();  // Set all EOS token options to never happen (the first will get the max of all)
+    max = std::max(max, static_cast<float>(logits[eos_token_ids[i]]));
+    logits[eos_token_ids[i]] = T(std::numeric_limits<float>::lowest());  // Set all EOS token options to never happen (the first will get the max of all)
   }
 
-  logits[eos_token_ids[0]] = max;  // Set the score of the primary EOS token to the highest of any of the EOS tokens
+  logits[eos_token_ids[0]] = T(max);  // Set the score of the primary EOS token to the highest of any of the EOS tokens
 }
 
 void LaunchHandleEOSArray(float* batch_logits, int batch_beam_size, int vocab_size, const int32_t* eos_token_ids, int eos_token_ids_count, cudaStream_t stream) {
   HandleEOSArray<<<(batch_beam_size + 255) / 256, 256, 0, stream>>>(batch_logits, batch_beam_size, vocab_size, eos_token_ids, eos_token_ids_count);
 }
 
+void LaunchHandleEOSArray(uint16_t* batch_logits, int batch_beam_size, int vocab_size, const int32_t* eos_token_ids, int eos_token_ids_count, cudaStream_t stream) {
+  HandleEOSArray<<<(batch_beam_size + 255) / 256, 256, 0, stream>>>(reinterpret_cast<half*>(batch_logits), batch_beam_size, vocab_size, eos_token_ids, eos_token_ids_count);
+}
+
 __global__ void ConvertFp16ToFp32(const half* src, float* dst, int count) {
   int idx = threadIdx.x + blockIdx.x * blockDim.x;
   if (idx < count)
@@ -107,5 +129,155 @@ void LaunchInt32ToInt64(const int32_t* src, int64_t* dst, int count, cudaStream_
   ConvertInt32ToInt64<<<num_blocks, block_size, 0, stream>>>(src, dst, count);
 }
 
+template <typename T>
+__global__ void GatherTokens(const int32_t* tokens, const int32_t* rows, T* target, int count) {
+  int i = blockIdx.x * blockDim.x + threadIdx.x;
+  if (i < count)
+    target[i] = tokens[rows[i]];
+}
+
+template <typename T>
+void LaunchGatherTokens(const int32_t* tokens, const int32_t* rows, T* target, int count, cudaStream_t stream) {
+  GatherTokens<T><<<(count + 255) / 256, 256, 0, stream>>>(tokens, rows, target, count);
+}
+
+template void LaunchGatherTokens(const int32_t* tokens, const int32_t* rows, int32_t* target, int count, cudaStream_t stream);
+template void LaunchGatherTokens(const int32_t* tokens, const int32_t* rows, int64_t* target, int count, cudaStream_t stream);
+
+// One thread block row per target block (blockIdx.y) and per tensor (blockIdx.z)
+template <typename T>
+__global__ void GatherBlocks(const void* const* tensors, int tensor_count, const int32_t* block_indices, size_t block_size) {
+  const T* source = reinterpret_cast<const T*>(tensors[blockIdx.z]) + block_indices[blockIdx.y] * block_size;
+  T* target = reinterpret_cast<T*>(const_cast<void*>(tensors[tensor_count + blockIdx.z])) + blockIdx.y * block_size;
+  for (size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < block_size; i += gridDim.x * blockDim.x)
+    target[i] = source[i];
+}
+
+void LaunchGatherBlocks(const void* const* tensors, int tensor_count, const int32_t* block_indices, int block_count, size_t block_bytes, cudaStream_t stream) {
+  // kv blocks are a multiple of head_size elements, so they can nearly always be copied 16 bytes at a time
+  bool vectorized = block_bytes % sizeof(uint4) == 0;
+  size_t block_size = vectorized ? block_bytes / sizeof(uint4) : block_bytes;
+  int block_dim = 256;
+  dim3 grid(static_cast<unsigned>(std::min<size_t>((block_size + block_dim - 1) / block_dim, 64)), block_count, tensor_count);
+  if (vectorized)
+    GatherBlocks<uint4><<<grid, block_dim, 0, stream>>>(tensors, tensor_count, block_indices, block_size);
+  else
+    GatherBlocks<uint8_t><<<grid, block_dim, 0, stream>>>(tensors, tensor_count, block_indices, block_size);
+}
+
+template <typename T>
+__global__ void GatherBlockRows(const void* const* tensors, int tensor_count, const int32_t* block_indices, int row_count, size_t row_pitch, size_t row_size) {
+  const size_t block_size = row_count * row_pitch;
+  const T* source = reinterpret_cast<const T*>(tensors[blockIdx.z]) + block_indices[blockIdx.y] * block_size;
+  T* target = reinterpret_cast<T*>(const_cast<void*>(tensors[tensor_count + blockIdx.z])) + blockIdx.y * block_size;
+  for (size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < row_count * row_size; i += gridDim.x * blockDim.x) {
+    size_t offset = i / row_size * row_pitch + i % row_size;
+    target[offset] = source[offset];
+  }
+}
+
+void LaunchGatherBlockRows(const void* const* tensors, int tensor_count, const int32_t* block_indices, int block_count, int row_count, size_t row_pitch,
+                           size_t row_bytes, cudaStream_t stream) {
+  bool vectorized = row_pitch % sizeof(uint4) == 0 && row_bytes % sizeof(uint4) == 0;
+  size_t element_size = vectorized ? sizeof(uint4) : 1;
+  size_t row_size = row_bytes / element_size;
+  int block_dim = 256;
+  dim3 grid(static_cast<unsigned>(std::min<size_t>((row_count * row_size + block_dim - 1) / block_dim, 64)), block_count, tensor_count);
+  if (vectorized)
+    GatherBlockRows<uint4><<<grid, block_dim, 0, stream>>>(tensors, tensor_count, block_indices, row_count, row_pitch / element_size, row_size);
+  else
+    GatherBlockRows<uint8_t><<<grid, block_dim, 0, stream>>>(tensors, tensor_count, block_indices, row_count, row_pitch, row_size);
+}
+
+// One block per scored position, the log sum of exponentials is reduced without writing the log softmax anywhere
+template <int kBlockSize>
+__global__ void TokenLogProbs(float* scores, const float* logits, const int32_t* input_ids, const int32_t* ranges, int sequence_length, int vocab_size) {
+  const int row = blockIdx.x / (sequence_length - 1);
+  const int position = blockIdx.x % (sequence_length - 1);
+  const int32_t target = input_ids[row * sequence_length + position + 1];
+  if (position < ranges[row * 2] || position + 1 >= ranges[row * 2 + 1]) {
+    if (threadIdx.x == 0)
+      scores[blockIdx.x] = 0.0f;
+    return;
+  }
+
+  const float* position_logits = logits + (static_cast<size_t>(row) * sequence_length + position) * vocab_size;
+  typedef cub::BlockReduce<float, kBlockSize> BlockReduce;
+  __shared__ typename BlockReduce::TempStorage temp_storage;
+  __shared__ float block_max;
+
+  float max = std::numeric_limits<float>::lowest();
+  for (int i = threadIdx.x; i < vocab_size; i += kBlockSize)
+    max = fmaxf(max, position_logits[i]);
+  max = BlockReduce(temp_storage).Reduce(max, cub::Max());
+  if (threadIdx.x == 0)
+    block_max = max;
+  __syncthreads();
+
+  float sum = 0.0f;
+  for (int i = threadIdx.x; i < vocab_size; i += kBlockSize)
+    sum += expf(position_logits[i] - block_max);
+  sum = BlockReduce(temp_storage).Sum(sum);
+  if (threadIdx.x == 0)
+    scores[blockIdx.x] = position_logits[target] - block_max - logf(sum);
+}
+
+void LaunchTokenLogProbs(float* scores, const float* logits, const int32_t* input_ids, const int32_t* ranges, int batch_size, int sequence_length,
+                         int vocab_size, cudaStream_t stream) {
+  constexpr int block_size = 256;
+  TokenLogProbs<block_size><<<batch_size * (sequence_length - 1), block_size, 0, stream>>>(scores, logits, input_ids, ranges, sequence_length, vocab_size);
+}
+
+// A thread per hidden state element (blockIdx.y is the row), walking down the row's positions so the reads coalesce
+__global__ void PoolHiddenStates(float* pooled, const float* hidden_states, const int32_t* ranges, int sequence_length, int hidden_size) {
+  const int row = blockIdx.y;
+  const int i = blockIdx.x * blockDim.x + threadIdx.x;
+  if (i >= hidden_size)
+    return;
+
+  const int begin = ranges[row * 2], end = ranges[row * 2 + 1];
+  const float* states = hidden_states + static_cast<size_t>(row) * sequence_length * hidden_size + i;
+  float sum = 0.0f;
+  for (int position = begin; position < end; position++)
+    sum += states[static_cast<size_t>(position) * hidden_size];
+  pooled[static_cast<size_t>(row) * hidden_size + i] = sum / (end - begin);
+}
+
+void LaunchPoolHiddenStates(float* pooled, const float* hidden_states, const int32_t* ranges, int batch_size, int sequence_length, int hidden_size,
+                            cudaStream_t stream) {
+  dim3 grid((hidden_size + 255) / 256, batch_size);
+  PoolHiddenStates<<<grid, 256, 0, stream>>>(pooled, hidden_states, ranges, sequence_length, hidden_size);
+}
+
+template <typename T>
+__global__ void RotateKeys(T* keys, int rows, int length, int start, int count, int head_size, int half_dim, const float* inv_freq, int delta) {
+  int index = blockIdx.x * blockDim.x + threadIdx.x;
+  if (index >= rows * count * half_dim)
+    return;
+  int i = index % half_dim;
+  int token = start + (index / half_dim) % count;
+  int row = index / (half_dim * count);
+
+  T* key = keys + (static_cast<size_t>(row) * length + token) * head_size;
+  float s, c;
+  sincosf(delta * inv_freq[i], &s, &c);
+  float x1 = static_cast<float>(key[i]), x2 = static_cast<float>(key[i + half_dim]);
+  key[i] = T(x1 * c - x2 * s);
+  key[i + half_dim] = T(x2 * c + x1 * s);
+}
+
+void LaunchRotateKeys(float* keys, int rows, int length, int start, int count, int head_size, int rotary_dim, const float* inv_freq,
+                      int delta, cudaStream_t stream) {
+  int total = rows * count * (rotary_dim / 2);
+  RotateKeys<float><<<(total + 255) / 256, 256, 0, stream>>>(keys, rows, length, start, count, head_size, rotary_dim / 2, inv_freq, delta);
+}
+
+void LaunchRotateKeys(uint16_t* keys, int rows, int length, int start, int count, int head_size, int rotary_dim, const float* inv_freq,
+                      int delta, cudaStream_t stream) {
+  int total = rows * count * (rotary_dim / 2);
+  RotateKeys<half><<<(total + 255) / 256, 256, 0, stream>>>(reinterpret_cast<half*>(keys), rows, length, start, count, head_size,
+                                                           rotary_dim / 2, inv_freq, delta);
+}
+
 }  // namespace cuda
 }  // namespace Generators
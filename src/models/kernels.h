@@ -8,13 +8,45 @@ namespace cuda {
 template <typename T>
 void Launch_UpdatePositionIds(T* positions, int batch_beam_size, cudaStream_t stream);
 template <typename T>
+void Launch_ShiftPositionIds(T* positions, int batch_beam_size, int delta, cudaStream_t stream);
+template <typename T>
 void Launch_UpdateAttentionMask(T* mask_data, const T* old_mask_data, int batch_beam_size, int current_length,
                                 int max_length, bool update_only, cudaStream_t stream);
 
 void LaunchHandleEOSArray(float* batch_logits, int batch_beam_size, int vocab_size, const int32_t* eos_token_ids, int eos_token_ids_count, cudaStream_t stream);
+void LaunchHandleEOSArray(uint16_t* batch_logits /* fp16 */, int batch_beam_size, int vocab_size, const int32_t* eos_token_ids, int eos_token_ids_count, cudaStream_t stream);
 
 void LaunchFp16ToFp32(const uint16_t* fp16, float* fp32, int count, cudaStream_t stream);
 void LaunchInt32ToInt64(const int32_t* src, int64_t* dst, int count, cudaStream_t stream);
+// target[i] = tokens[rows[i]], converted to T
+template <typename T>
+void LaunchGatherTokens(const int32_t* tokens, const int32_t* rows, T* target, int count, cudaStream_t stream);
+
+// tensors holds tensor_count sources followed by their tensor_count targets. Block j of each target gets a copy of block
+// block_indices[j] of its source, every block being block_bytes long.
+void LaunchGatherBlocks(const void* const* tensors, int tensor_count, const int32_t* block_indices, int block_count, size_t block_bytes, cudaStream_t stream);
+// Same with every block made of row_count rows row_pitch bytes apart, of which only the first row_bytes are copied
+void LaunchGatherBlockRows(const void* const* tensors, int tensor_count, const int32_t* block_indices, int block_count, int row_count, size_t row_pitch,
+                           size_t row_bytes, cudaStream_t stream);
+
+// Scoring: scores[row, i] = log_softmax(logits[row, i])[input_ids[row, i + 1]], or 0 where either token is outside the
+// row's tokens [ranges[row * 2], ranges[row * 2 + 1]). logits is {batch_size, sequence_length, vocab_size}, scores
+// {batch_size, sequence_length - 1}.
+void LaunchTokenLogProbs(float* scores, const float* logits, const int32_t* input_ids, const int32_t* ranges, int batch_size, int sequence_length,
+                         int vocab_size, cudaStream_t stream);
+
+// Embeddings: pooled[row] is the mean of hidden_states[row, ranges[row * 2] .. ranges[row * 2 + 1]), hidden_states is
+// {batch_size, sequence_length, hidden_size} and pooled {batch_size, hidden_size}
+void LaunchPoolHiddenStates(float* pooled, const float* hidden_states, const int32_t* ranges, int batch_size, int sequence_length, int hidden_size,
+                            cudaStream_t stream);
+
+// Streaming: rotates the keys of tokens [start, start + count) of every row by delta positions. keys is {rows, length,
+// head_size}, the rotary part is the first rotary_dim of a head with its two halves rotated together, and inv_freq (on
+// the device) has rotary_dim / 2 values.
+void LaunchRotateKeys(float* keys, int rows, int length, int start, int count, int head_size, int rotary_dim, const float* inv_freq,
+                      int delta, cudaStream_t stream);
+void LaunchRotateKeys(uint16_t* keys /* fp16 */, int rows, int length, int start, int count, int head_size, int rotary_dim,
+                      const float* inv_freq, int delta, cudaStream_t stream);
 }  // namespace cuda
 
 }  // namespace Generators
@@ -0,0 +1,62 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include "../generators.h"
+#include "kv_block_pool.h"
+
+namespace Generators {
+
+KV_BlockPool::KV_BlockPool(int block_size, int max_blocks)
+    : block_size_{block_size},
+      max_blocks_{max_blocks} {
+  if (block_size_ <= 0)
+    throw std::runtime_error("kv_cache block_size must be greater than 0");
+  if (max_blocks_ < 0)
+    throw std::runtime_error("kv_cache max_blocks must not be negative");
+}
+
+void KV_BlockPool::Grow(std::vector<int>& block_table, int token_count) {
+  Grow(std::span<std::vector<int>>{&block_table, 1}, token_count);
+}
+
+void KV_BlockPool::Grow(std::span<std::vector<int>> block_tables, int token_count) {
+  int needed = 0;
+  for (auto& block_table : block_tables)
+    needed += std::max(BlocksFor(token_count) - static_cast<int>(block_table.size()), 0);
+  if (needed == 0)
+    return;
+
+  std::lock_guard lock(mutex_);
+  if (max_blocks_ != 0 && used_blocks_ + needed > max_blocks_)
+    throw MemoryExhausted("The kv cache block pool is exhausted: " + std::to_string(used_blocks_) + " of " +
+                          std::to_string(max_blocks_) + " blocks are in use and " + std::to_string(needed) + " more were requested");
+
+  for (auto& block_table : block_tables) {
+    while (static_cast<int>(block_table.size()) < BlocksFor(token_count)) {
+      if (!free_blocks_.empty()) {
+        block_table.push_back(free_blocks_.back());
+        free_blocks_.pop_back();
+      } else
+        block_table.push_back(next_block_id_++);
+    }
+  }
+  used_blocks_ += needed;
+}
+
+void KV_BlockPool::Release(std::vector<int>& block_table) {
+  std::lock_guard lock(mutex_);
+  free_blocks_.insert(free_blocks_.end(), block_table.begin(), block_table.end());
+  used_blocks_ -= static_cast<int>(block_table.size());
+  block_table.clear();
+}
+
+int KV_BlockPool::UsedBlocks() const {
+  std::lock_guard lock(mutex_);
+  return used_blocks_;
+}
+
+int KV_BlockPool::FreeBlocks() const {
+  std::lock_guard lock(mutex_);
+  return max_blocks_ == 0 ? -1 : max_blocks_ - used_blocks_;
+}
+
+}  // namespace Generators
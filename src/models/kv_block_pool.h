@@ -0,0 +1,39 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+#include <mutex>
+#include <span>
+#include <vector>
+
+namespace Generators {
+
+// Model wide pool of fixed size kv cache blocks. A block covers block_size tokens of a single sequence across every
+// layer. Sequences take blocks from the pool as they grow and give them back when their generator goes away, so the
+// kv memory held by a generator tracks the tokens it has actually produced rather than max_length.
+struct KV_BlockPool {
+  KV_BlockPool(int block_size, int max_blocks);
+
+  int BlockSize() const { return block_size_; }
+  int BlocksFor(int token_count) const { return (token_count + block_size_ - 1) / block_size_; }
+
+  // Appends blocks to block_table until it covers token_count tokens, throws if the pool is exhausted
+  void Grow(std::vector<int>& block_table, int token_count);
+  // The same for every block table, all of them or none: nothing is taken when the pool can't cover them all
+  void Grow(std::span<std::vector<int>> block_tables, int token_count);
+  // Returns every block in block_table to the pool and clears it
+  void Release(std::vector<int>& block_table);
+
+  int UsedBlocks() const;
+  int FreeBlocks() const;  // Returns -1 if the pool is unbounded
+
+ private:
+  int block_size_;
+  int max_blocks_;  // 0 means unbounded
+  int next_block_id_{};
+  int used_blocks_{};
+  std::vector<int> free_blocks_;
+  mutable std::mutex mutex_;
+};
+
+}  // namespace Generators
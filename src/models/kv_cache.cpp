@@ -1,14 +1,180 @@
 #include "../generators.h"
 #include "model.h"
 #include "kv_cache.h"
+#include "rotary_embedding.h"
+#if USE_CUDA
+#include "kernels.h"
+#endif
 
 namespace Generators {
 
+void KV_BeamGather::Gather(std::span<const int32_t> block_indices, std::span<const OrtValue* const> sources, std::span<OrtValue* const> targets,
+                           size_t block_bytes) {
+  assert(sources.size() == targets.size());
+
+#if USE_CUDA
+  if (model_.device_type_ == DeviceType::CUDA) {
+    GatherOnDevice(Upload(block_indices), sources, targets, block_bytes);
+    return;
+  }
+#endif
+
+  for (size_t i = 0; i < sources.size(); i++) {
+    auto* source = sources[i]->GetTensorData<uint8_t>();
+    auto* target = static_cast<uint8_t*>(targets[i]->GetTensorMutableRawData());
+    for (size_t j = 0; j < block_indices.size(); j++)
+      std::memcpy(target + j * block_bytes, source + block_indices[j] * block_bytes, block_bytes);
+  }
+}
+
+void KV_BeamGather::GatherRows(std::span<const int32_t> block_indices, std::span<const OrtValue* const> sources, std::span<OrtValue* const> targets,
+                               int row_count, size_t row_pitch, size_t row_bytes) {
+  assert(sources.size() == targets.size() && row_bytes <= row_pitch);
+
+#if USE_CUDA
+  if (model_.device_type_ == DeviceType::CUDA) {
+    GatherRowsOnDevice(Upload(block_indices), sources, targets, row_count, row_pitch, row_bytes);
+    return;
+  }
+#endif
+
+  const size_t block_bytes = row_count * row_pitch;
+  for (size_t i = 0; i < sources.size(); i++) {
+    auto* source = sources[i]->GetTensorData<uint8_t>();
+    auto* target = static_cast<uint8_t*>(targets[i]->GetTensorMutableRawData());
+    for (size_t j = 0; j < block_indices.size(); j++) {
+      for (int row = 0; row < row_count; row++)
+        std::memcpy(target + j * block_bytes + row * row_pitch, source + block_indices[j] * block_bytes + row * row_pitch, row_bytes);
+    }
+  }
+}
+
+#if USE_CUDA
+gpu_span<const int32_t> KV_BeamGather::Upload(std::span<const int32_t> block_indices) {
+  if (block_indices_gpu_.size() != block_indices.size())
+    block_indices_ptr_ = CudaMallocArray<int32_t>(block_indices.size(), &block_indices_gpu_);
+  cudaMemcpyAsync(block_indices_gpu_.data(), block_indices.data(), block_indices.size_bytes(), cudaMemcpyHostToDevice, model_.cuda_stream_);
+  g_transfer_counters.host_to_device_bytes += block_indices.size_bytes();
+  return gpu_span<const int32_t>{block_indices_gpu_.data(), block_indices_gpu_.size()};
+}
+
+const void* const* KV_BeamGather::UploadTensors(std::span<const OrtValue* const> sources, std::span<OrtValue* const> targets) {
+  assert(sources.size() == targets.size());
+  if (tensors_gpu_.size() != sources.size() * 2)
+    tensors_ptr_ = CudaMallocArray<const void*>(sources.size() * 2, &tensors_gpu_);
+
+  tensors_cpu_.resize(sources.size() * 2);
+  for (size_t i = 0; i < sources.size(); i++) {
+    tensors_cpu_[i] = sources[i]->GetTensorRawData();
+    tensors_cpu_[sources.size() + i] = targets[i]->GetTensorMutableRawData();
+  }
+
+  cudaMemcpyAsync(tensors_gpu_.data(), tensors_cpu_.data(), tensors_cpu_.size() * sizeof(const void*), cudaMemcpyHostToDevice, model_.cuda_stream_);
+  g_transfer_counters.host_to_device_bytes += tensors_cpu_.size() * sizeof(const void*);
+  return tensors_gpu_.data();
+}
+
+void KV_BeamGather::GatherOnDevice(gpu_span<const int32_t> block_indices, std::span<const OrtValue* const> sources, std::span<OrtValue* const> targets,
+                                   size_t block_bytes) {
+  auto tensors = UploadTensors(sources, targets);
+  cuda::LaunchGatherBlocks(tensors, static_cast<int>(sources.size()), block_indices.data(), static_cast<int>(block_indices.size()), block_bytes, model_.cuda_stream_);
+}
+
+void KV_BeamGather::GatherRowsOnDevice(gpu_span<const int32_t> block_indices, std::span<const OrtValue* const> sources, std::span<OrtValue* const> targets,
+                                       int row_count, size_t row_pitch, size_t row_bytes) {
+  auto tensors = UploadTensors(sources, targets);
+  cuda::LaunchGatherBlockRows(tensors, static_cast<int>(sources.size()), block_indices.data(), static_cast<int>(block_indices.size()), row_count, row_pitch,
+                              row_bytes, model_.cuda_stream_);
+}
+#endif
+
+// Copies copy_length tokens of every [batch_beam, kv_heads] row between kv tensors holding source_length and
+// target_length tokens per row, starting at token source_start/target_start of the rows
+static void CopyKVRows(const Model& model, const OrtValue& source, int64_t source_length, OrtValue& target, int64_t target_length,
+                       int64_t copy_length, size_t row_count, size_t token_bytes, int64_t source_start = 0, int64_t target_start = 0) {
+  auto* source_data = source.GetTensorData<uint8_t>() + source_start * token_bytes;
+  auto* target_data = static_cast<uint8_t*>(target.GetTensorMutableRawData()) + target_start * token_bytes;
+  size_t source_pitch = source_length * token_bytes;
+  size_t target_pitch = target_length * token_bytes;
+  size_t copy_bytes = copy_length * token_bytes;
+
+#if USE_CUDA
+  if (model.device_type_ == DeviceType::CUDA) {
+    CudaCheck() == cudaMemcpy2DAsync(target_data, target_pitch, source_data, source_pitch, copy_bytes, row_count, cudaMemcpyDeviceToDevice, model.cuda_stream_);
+    return;
+  }
+#endif
+  for (size_t row = 0; row < row_count; row++)
+    std::memcpy(target_data + row * target_pitch, source_data + row * source_pitch, copy_bytes);
+}
+
+void KV_BeamGather::ExpandBeams(const OrtValue& source, OrtValue& target, int num_beams) {
+  auto source_info = source.GetTensorTypeAndShapeInfo();
+  auto source_shape = source_info->GetShape();
+  auto target_shape = target.GetTensorTypeAndShapeInfo()->GetShape();
+  const size_t batch_size = static_cast<size_t>(source_shape[0]);
+  const size_t element_count = source_info->GetElementCount();
+
+  // A kv buffer shared by past and present: expanded at the source's length first, then copied to its rows
+  if (source_shape.size() == 4 && target_shape.size() == 4 && target_shape[2] > source_shape[2] &&
+      target_shape[0] == source_shape[0] * num_beams && target_shape[1] == source_shape[1] && target_shape[3] == source_shape[3]) {
+    auto expanded_shape = source_shape;
+    expanded_shape[0] *= num_beams;
+    auto expanded = OrtValue::CreateTensor(*model_.allocator_device_, expanded_shape, source_info->GetElementType());
+    ExpandBeams(source, *expanded, num_beams);
+    CopyKVRows(model_, *expanded, source_shape[2], target, target_shape[2], source_shape[2], static_cast<size_t>(expanded_shape[0] * expanded_shape[1]),
+               static_cast<size_t>(source_shape[3]) * SizeOf(source_info->GetElementType()));
+    return;
+  }
+
+  if (target.GetTensorTypeAndShapeInfo()->GetElementCount() != element_count * num_beams)
+    throw std::runtime_error("ExpandBeams target must have num_beams times the elements of the source");
+
+  std::vector<int32_t> block_indices(batch_size * num_beams);
+  for (size_t i = 0; i < block_indices.size(); i++)
+    block_indices[i] = static_cast<int32_t>(i / static_cast<size_t>(num_beams));
+
+  const OrtValue* p_source = &source;
+  OrtValue* p_target = &target;
+  Gather(block_indices, {&p_source, 1}, {&p_target, 1}, element_count * SizeOf(source_info->GetElementType()) / batch_size);
+}
+
+KV_GrowableBuffer::~KV_GrowableBuffer() {
+  if (buffer_)
+    allocator_.Free(buffer_);
+}
+
+std::unique_ptr<OrtValue> KV_GrowableBuffer::CreateTensor(std::span<const int64_t> shape, ONNXTensorElementDataType type) {
+  size_t bytes = SizeOf(type);
+  for (auto dim : shape)
+    bytes *= dim;
+
+  if (bytes > bytes_) {
+    if (buffer_)
+      allocator_.Free(buffer_);
+    bytes_ = std::max(bytes, bytes_ * 2);
+    buffer_ = allocator_.Alloc(bytes_);
+  }
+  return OrtValue::CreateTensor(allocator_.GetInfo(), buffer_, bytes, shape, type);
+}
+
+KV_PingPong::KV_PingPong(Ort::Allocator& allocator, int tensor_count) {
+  buffers_.reserve(tensor_count * 2);
+  for (int i = 0; i < tensor_count * 2; i++)
+    buffers_.push_back(std::make_unique<KV_GrowableBuffer>(allocator));
+}
+
 KV_Cache_Combined::KV_Cache_Combined(const Model& model, State& state)
     : model_{model},
       state_{state},
       layer_count_{model.config_->model.decoder.num_hidden_layers},
+      past_present_share_buffer_{IsBufferShared(model, *state_.params_)},
       shape_{2, state_.params_->BatchBeamSize(), model.config_->model.decoder.num_key_value_heads, 0, model.config_->model.decoder.head_size} {
+  if (model.config_->model.decoder.kv_cache.window_size > 0)
+    throw std::runtime_error("kv_cache window_size is not supported by models with combined key/value tensors");
+  if (g_log.enabled && g_log.warning && past_present_share_buffer_ != state_.params_->search.past_present_share_buffer)
+    Log("warning", "past_present_share_buffer search option set to true, but has been disabled due to the current configuration. See https://aka.ms/generate_config for details");
+
   pasts_.resize(layer_count_);
   presents_.reserve(layer_count_);
 
@@ -25,13 +191,29 @@ KV_Cache_Combined::KV_Cache_Combined(const Model& model, State& state)
   type_ = model_.session_info_->GetInputDataType(input_name_strings_[0]);
 
   empty_past_ = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
-  shape_[3] = state_.params_->sequence_length;
+  shape_[3] = past_present_share_buffer_ ? state_.params_->BufferMaxLength() : state_.params_->sequence_length;
+
+  // Attention ops that share the buffer are told how much of it is valid, the rest of the pasts is garbage
+  if (past_present_share_buffer_) {
+    past_sequence_length_ = OrtValue::CreateTensor<int32_t>(model_.allocator_cpu_, std::array<int64_t, 1>{1});
+    *past_sequence_length_->GetTensorMutableData<int32_t>() = 0;
+  }
+
+  // When sharing was asked for but can't be used, the ping pong buffers still keep the decode steps from allocating
+  if (!past_present_share_buffer_ && (model_.config_->model.decoder.kv_cache.preallocate || state_.params_->search.past_present_share_buffer))
+    ping_pong_ = std::make_unique<KV_PingPong>(*model_.allocator_device_, layer_count_);
 
   for (int i = 0; i < layer_count_; ++i) {
-    presents_.push_back(OrtValue::CreateTensor(*model.allocator_device_, shape_, type_));
+    presents_.push_back(CreatePresent(i));
   }
 }
 
+std::unique_ptr<OrtValue> KV_Cache_Combined::CreatePresent(int index) {
+  if (ping_pong_)
+    return ping_pong_->CreatePresent(index, shape_, type_);
+  return OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
+}
+
 void KV_Cache_Combined::Add() {
   input_index_ = state_.inputs_.size();
   output_index_ = state_.outputs_.size();
@@ -42,110 +224,170 @@ void KV_Cache_Combined::Add() {
     state_.outputs_.push_back(presents_[i].get());
     state_.output_names_.push_back(output_name_strings_[i].c_str());
   }
+
+  // For shared_past_present, the past & presents never change, so set the inputs to the present values
+  if (past_present_share_buffer_) {
+    for (int i = 0; i < layer_count_; i++)
+      state_.inputs_[input_index_ + i] = presents_[i].get();
+  }
+
+  if (past_sequence_length_) {
+    state_.inputs_.push_back(past_sequence_length_.get());
+    state_.input_names_.push_back(model_.config_->model.decoder.inputs.past_sequence_length.c_str());
+  }
 }
 
 void KV_Cache_Combined::Update(std::span<const int32_t> beam_indices, int current_length) {
   assert(state_.params_->search.num_beams == 1 || !beam_indices.empty());  // We require beam_indices if we're a beam search
 
-  for (int i = 0; i < layer_count_; i++) {
-    if (beam_indices.empty()) {
-      pasts_[i] = std::move(presents_[i]);
-    } else {
-      PickPastState(beam_indices, i);
-    }
+  if (past_present_share_buffer_) {
+    *past_sequence_length_->GetTensorMutableData<int32_t>() = current_length - 1;
+    if (!beam_indices.empty())
+      ReorderBeams(beam_indices, current_length - 1);
+    return;
   }
 
+  if (beam_indices.empty()) {
+    for (int i = 0; i < layer_count_; i++)
+      pasts_[i] = std::move(presents_[i]);
+    if (ping_pong_)
+      ping_pong_->Swap();
+  } else
+    PickPastStates(beam_indices);
+
   shape_[3] = current_length;
   for (int i = 0; i < layer_count_; i++) {
-    presents_[i] = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
+    presents_[i] = CreatePresent(i);
     state_.inputs_[input_index_ + i] = pasts_[i].get();
     state_.outputs_[output_index_ + i] = presents_[i].get();
   }
 }
 
 // Copy present state to past state reordered by the beam_indices
-template <typename ScoreType>
-void KV_Cache_Combined::PickPastState(std::span<const int32_t> beam_indices, int index) {
-  auto block_size_per_beam = shape_[2] * shape_[3] * shape_[4];
-  auto past_key_size = shape_[1] * block_size_per_beam;
-  auto element_count = shape_[0] * past_key_size;
+void KV_Cache_Combined::PickPastStates(std::span<const int32_t> beam_indices) {
+  // The keys and values are the two halves of every tensor, so the value blocks use the same indices offset by batch_beam_size
+  std::vector<int32_t> block_indices(beam_indices.begin(), beam_indices.end());
+  for (auto beam_index : beam_indices)
+    block_indices.push_back(beam_index + static_cast<int32_t>(shape_[1]));
 
-  const OrtValue& present = *presents_[index];
-  std::unique_ptr<OrtValue> past = OrtValue::CreateTensor<ScoreType>(*model_.allocator_device_, shape_);
-  auto past_span = std::span<ScoreType>(past->GetTensorMutableData<ScoreType>(), element_count);
-  auto present_span = std::span<const ScoreType>(present.GetTensorData<ScoreType>(), element_count);
+  std::vector<const OrtValue*> sources;
+  std::vector<OrtValue*> targets;
+  for (int i = 0; i < layer_count_; i++) {
+    pasts_[i] = ping_pong_ ? ping_pong_->CreatePast(i, shape_, type_) : OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
+    sources.push_back(presents_[i].get());
+    targets.push_back(pasts_[i].get());
+  }
+  beam_gather_.Gather(block_indices, sources, targets, shape_[2] * shape_[3] * shape_[4] * SizeOf(type_));
+}
 
-#if USE_CUDA
-  if (model_.device_type_ == DeviceType::CUDA) {
-    for (size_t j = 0; j < beam_indices.size(); j++) {
-      int32_t beam_index = beam_indices[j];
-      auto present_key = present_span.subspan(beam_index * block_size_per_beam, block_size_per_beam);
-      auto present_value = present_span.subspan(past_key_size + beam_index * block_size_per_beam, block_size_per_beam);
-
-      auto past_key = past_span.subspan(j * block_size_per_beam, block_size_per_beam);
-      auto past_value = past_span.subspan(past_key_size + j * block_size_per_beam, block_size_per_beam);
-      cudaMemcpyAsync(past_key.data(), present_key.data(), present_key.size_bytes(), cudaMemcpyDeviceToDevice, model_.cuda_stream_);
-      cudaMemcpyAsync(past_value.data(), present_value.data(), present_value.size_bytes(), cudaMemcpyDeviceToDevice, model_.cuda_stream_);
-    }
-  } else
-#endif
-  {
-    for (size_t j = 0; j < beam_indices.size(); j++) {
-      int32_t const beam_index = beam_indices[j];
-      auto present_key = present_span.subspan(beam_index * block_size_per_beam, block_size_per_beam);
-      auto present_value = present_span.subspan(past_key_size + beam_index * block_size_per_beam, block_size_per_beam);
-
-      auto past_key = past_span.subspan(j * block_size_per_beam, block_size_per_beam);
-      auto past_value = past_span.subspan(past_key_size + j * block_size_per_beam, block_size_per_beam);
-      copy(present_key, past_key);
-      copy(present_value, past_value);
+// Only the valid tokens of the beams that change are copied, the rest of the max_length rows is garbage anyway. Every
+// moved beam is read into the scratch before any is written back, as a beam can be the source of another.
+void KV_Cache_Combined::ReorderBeams(std::span<const int32_t> beam_indices, int valid_length) {
+  if (!beam_scratch_)
+    beam_scratch_ = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
+
+  const size_t heads = static_cast<size_t>(shape_[2]);
+  const int64_t max_length = shape_[3];
+  const size_t token_bytes = shape_[4] * SizeOf(type_);
+  const int64_t block_tokens = heads * max_length;  // One [heads, max_length, head_size] key or value block of a beam
+  const int64_t batch_beam = shape_[1];
+
+  for (int i = 0; i < layer_count_; i++) {
+    auto& present = *presents_[i];
+    for (int pass = 0; pass < 2; pass++) {
+      for (int64_t kv = 0; kv < 2; kv++) {
+        for (int64_t beam = 0; beam < batch_beam; beam++) {
+          if (beam_indices[beam] == beam)
+            continue;
+          int64_t target = (kv * batch_beam + beam) * block_tokens;
+          int64_t source = (kv * batch_beam + beam_indices[beam]) * block_tokens;
+          if (pass == 0)
+            CopyKVRows(model_, present, max_length, *beam_scratch_, max_length, valid_length, heads, token_bytes, source, target);
+          else
+            CopyKVRows(model_, *beam_scratch_, max_length, present, max_length, valid_length, heads, token_bytes, target, target);
+        }
+      }
     }
   }
+}
 
-  pasts_[index] = std::move(past);
+// Beam search reorders the shared buffer in place, which needs the beam gather
+bool KV_Cache::IsBufferShared(const Model& model, const GeneratorParams& params) {
+  return params.search.past_present_share_buffer &&
+         (params.search.num_beams == 1 || OnHost(model.device_type_) || model.device_type_ == DeviceType::CUDA);
 }
 
-void KV_Cache_Combined::PickPastState(std::span<const int32_t> beam_indices, int index) {
-  if (type_ == Ort::TypeToTensorType<float>::type) {
-    PickPastState<float>(beam_indices, index);
-  } else {
-    PickPastState<Ort::Float16_t>(beam_indices, index);
-  }
+bool KV_Cache_Combined::IsBufferShared(const Model& model, const GeneratorParams& params) {
+  return KV_Cache::IsBufferShared(model, params) && model.session_info_->HasInput(model.config_->model.decoder.inputs.past_sequence_length);
 }
 
 KV_Cache::KV_Cache(const Model& model, State& state)
     : model_{model},
       state_{state},
       layer_count_{model_.config_->model.decoder.num_hidden_layers},
-      past_present_share_buffer_{state_.params_->search.past_present_share_buffer && state_.params_->search.num_beams == 1},
+      past_present_share_buffer_{IsBufferShared(model, *state_.params_)},
       shape_{state_.params_->BatchBeamSize(), model.config_->model.decoder.num_key_value_heads, 0, model.config_->model.decoder.head_size} {
   if (g_log.enabled && g_log.warning && past_present_share_buffer_ != state_.params_->search.past_present_share_buffer)
     Log("warning", "past_present_share_buffer search option set to true, but has been disabled due to the current configuration. See https://aka.ms/generate_config for details");
 
-  pasts_.resize(layer_count_ * 2);
-  presents_.reserve(layer_count_ * 2);
+  auto& inputs = model.config_->model.decoder.inputs;
+  auto& outputs = model.config_->model.decoder.outputs;
+  auto add_names = [&](const std::string& past_key, const std::string& past_value, const std::string& present_key, const std::string& present_value) {
+    for (int i = 0; i < layer_count_; ++i) {
+      char string[64];
+      snprintf(string, std::size(string), past_key.c_str(), i);
+      input_name_strings_.emplace_back(string);
+      snprintf(string, std::size(string), past_value.c_str(), i);
+      input_name_strings_.emplace_back(string);
 
-  for (int i = 0; i < layer_count_; ++i) {
-    char string[64];
-    snprintf(string, std::size(string), model.config_->model.decoder.inputs.past_key_names.c_str(), i);
-    input_name_strings_.emplace_back(string);
-    snprintf(string, std::size(string), model.config_->model.decoder.inputs.past_value_names.c_str(), i);
-    input_name_strings_.emplace_back(string);
-
-    snprintf(string, std::size(string), model.config_->model.decoder.outputs.present_key_names.c_str(), i);
-    output_name_strings_.emplace_back(string);
-    snprintf(string, std::size(string), model.config_->model.decoder.outputs.present_value_names.c_str(), i);
-    output_name_strings_.emplace_back(string);
-  }
+      snprintf(string, std::size(string), present_key.c_str(), i);
+      output_name_strings_.emplace_back(string);
+      snprintf(string, std::size(string), present_value.c_str(), i);
+      output_name_strings_.emplace_back(string);
+    }
+  };
+  add_names(inputs.past_key_names, inputs.past_value_names, outputs.present_key_names, outputs.present_value_names);
 
   // Derive the KV data type from the KV input 0
   type_ = model_.session_info_->GetInputDataType(input_name_strings_[0]);
 
+  // Quantized kv models (int8/fp8) take a scale per token per head alongside every past key/value, and requantize the presents
+  char scale_name[64];
+  snprintf(scale_name, std::size(scale_name), inputs.past_key_scale_names.c_str(), 0);
+  if (model_.session_info_->HasInput(scale_name)) {
+    if (past_present_share_buffer_)
+      throw std::runtime_error("Quantized kv cache models require past_present_share_buffer to be false");
+    add_names(inputs.past_key_scale_names, inputs.past_value_scale_names, outputs.present_key_scale_names, outputs.present_value_scale_names);
+    scale_type_ = model_.session_info_->GetInputDataType(scale_name);
+  }
+  tensor_count_ = static_cast<int>(input_name_strings_.size());
+
+  pasts_.resize(tensor_count_);
+  presents_.reserve(tensor_count_);
+
+  if (model_.config_->model.decoder.kv_cache.window_size > 0)
+    InitRotateKeys();
+
   empty_past_ = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
+  if (tensor_count_ > layer_count_ * 2)
+    empty_scale_ = OrtValue::CreateTensor(*model_.allocator_device_, ShapeOf(layer_count_ * 2), scale_type_);
 
-  // Set the size after empty_past_ has been created with 0 for this field
-  if (past_present_share_buffer_)
-    shape_[2] = state_.params_->search.max_length;
+  // The shared buffers can only be paged when their address is free to change between runs, so not with graph capture.
+  // Beams are reordered by whole rows, which paging doesn't keep contiguous.
+  if (past_present_share_buffer_ && model_.GetKVBlockPool()) {
+    if (state_.GetCapturedGraphInfo() || state_.params_->search.num_beams != 1 || (!OnHost(model_.device_type_) && model_.device_type_ != DeviceType::CUDA)) {
+      if (g_log.enabled && g_log.warning)
+        Log("warning", "kv_cache block_size is set, but paging has been disabled due to the current configuration");
+    } else
+      block_pool_ = model_.GetKVBlockPool();
+  }
+
+  // Set the size after empty_past_ has been created with 0 for this field. The blocks are taken at the end, as the
+  // destructor that returns them doesn't run if the constructor throws.
+  if (block_pool_) {
+    shape_[2] = std::min(block_pool_->BlocksFor(state_.params_->sequence_length) * block_pool_->BlockSize(), state_.params_->search.max_length);
+  } else if (past_present_share_buffer_)
+    shape_[2] = state_.params_->BufferMaxLength();
   else
     shape_[2] = state_.params_->sequence_length;
 
@@ -157,17 +399,46 @@ KV_Cache::KV_Cache(const Model& model, State& state)
     }
   }
 
-  for (int i = 0; i < layer_count_ * 2; ++i) {
+  // When sharing was asked for but can't be used, the ping pong buffers still keep the decode steps from allocating
+  if (!past_present_share_buffer_ && (model_.config_->model.decoder.kv_cache.preallocate || state_.params_->search.past_present_share_buffer))
+    ping_pong_ = std::make_unique<KV_PingPong>(*model_.allocator_device_, tensor_count_);
+
+  for (int i = 0; i < tensor_count_; ++i) {
     presents_.push_back(
-        sb_kv_caches_.empty() ? OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_)
+        sb_kv_caches_.empty() ? CreatePresent(i)
                               : sb_kv_caches_[i]->CreateTensorOnStaticBuffer(shape_, type_));
   }
+
+  if (block_pool_) {
+    block_tables_.resize(shape_[0]);
+    block_pool_->Grow(block_tables_, state_.params_->sequence_length);
+  }
+}
+
+std::array<int64_t, 4> KV_Cache::ShapeOf(int index) const {
+  auto shape = shape_;
+  if (index >= layer_count_ * 2)
+    shape[3] = 1;  // Scales
+  return shape;
+}
+
+std::unique_ptr<OrtValue> KV_Cache::CreatePresent(int index) {
+  if (ping_pong_)
+    return ping_pong_->CreatePresent(index, ShapeOf(index), TypeOf(index));
+  return OrtValue::CreateTensor(*model_.allocator_device_, ShapeOf(index), TypeOf(index));
+}
+
+KV_Cache::~KV_Cache() {
+  if (block_pool_) {
+    for (auto& block_table : block_tables_)
+      block_pool_->Release(block_table);
+  }
 }
 
 void KV_Cache::AddEncoder() {
   // We don't set the input_index_ & output_index_ because the encoder step only runs once, there's no update
 
-  for (int i = 0; i < layer_count_ * 2; ++i) {
+  for (int i = 0; i < tensor_count_; ++i) {
     state_.outputs_.push_back(presents_[i].get());
     state_.output_names_.push_back(output_name_strings_[i].c_str());
   }
@@ -177,8 +448,8 @@ void KV_Cache::Add() {
   input_index_ = state_.inputs_.size();
   output_index_ = state_.outputs_.size();
 
-  for (int i = 0; i < layer_count_ * 2; ++i) {
-    state_.inputs_.push_back(empty_past_.get());  // Set empty past here, AddEncoder() & Update() take care of the rest
+  for (int i = 0; i < tensor_count_; ++i) {
+    state_.inputs_.push_back(i < layer_count_ * 2 ? empty_past_.get() : empty_scale_.get());  // Set empty past here, AddEncoder() & Update() take care of the rest
     state_.input_names_.push_back(input_name_strings_[i].c_str());
     state_.outputs_.push_back(presents_[i].get());
     state_.output_names_.push_back(output_name_strings_[i].c_str());
@@ -192,73 +463,605 @@ void KV_Cache::Add() {
   }
 }
 
-void KV_Cache::Update(std::span<const int32_t> beam_indices, int current_length) {
-  // If we're sharing past & present buffers there is nothing to do here, so early exit
-  if (past_present_share_buffer_)
+void KV_Cache::Update(RoamingArray<int32_t> beam_indices, int current_length) {
+  TraceScope trace{"kv_update"};
+  // If we're sharing past & present buffers there is nothing to do here unless we need more blocks, so early exit
+  if (past_present_share_buffer_) {
+    if (block_pool_ && current_length > shape_[2])
+      GrowBlocks(current_length);
+    if (!beam_indices.empty())
+      ReorderBeams(beam_indices, current_length - 1);
     return;
+  }
 
-  for (int i = 0; i < layer_count_ * 2; i++) {
-    if (beam_indices.empty()) {
+  if (beam_indices.empty()) {
+    for (int i = 0; i < tensor_count_; i++)
       pasts_[i] = std::move(presents_[i]);
-    } else {
-      PickPastState(beam_indices, i);
+    if (ping_pong_)
+      ping_pong_->Swap();
+  } else
+    PickPastStates(beam_indices);
+
+  // Streaming: the state caps current_length once the kv is full
+  if (shape_[2] > current_length - 1)
+    EvictPast(current_length - 1);
+
+  for (int i = 0; i < tensor_count_; i++)
+    state_.inputs_[input_index_ + i] = pasts_[i].get();
+
+  shape_[2] = current_length;
+  for (int i = 0; i < tensor_count_; i++) {
+    presents_[i] = CreatePresent(i);
+    state_.outputs_[output_index_ + i] = presents_[i].get();
+  }
+}
+
+void KV_Cache::KeepRows(std::span<const int32_t> rows) {
+  if (block_pool_) {
+    std::vector<std::vector<int>> kept_tables;
+    for (size_t i = 0, next = 0; i < block_tables_.size(); i++) {
+      if (next < rows.size() && rows[next] == static_cast<int32_t>(i)) {
+        kept_tables.push_back(std::move(block_tables_[i]));
+        next++;
+      } else
+        block_pool_->Release(block_tables_[i]);
+    }
+    block_tables_ = std::move(kept_tables);
+  }
+
+  // With a shared buffer the kv is in the presents, otherwise Update() has already moved it into the pasts
+  auto& values = past_present_share_buffer_ ? presents_ : pasts_;
+  std::vector<std::unique_ptr<OrtValue>> kept(tensor_count_);
+
+  // A row of a tensor is one block, which is a different size for the kv and for their scales
+  auto gather = [&](int begin, int end) {
+    auto shape = values[begin]->GetTensorTypeAndShapeInfo()->GetShape();
+    size_t block_bytes = shape[1] * shape[2] * shape[3] * SizeOf(TypeOf(begin));
+    shape[0] = static_cast<int64_t>(rows.size());
+
+    std::vector<const OrtValue*> sources;
+    std::vector<OrtValue*> targets;
+    for (int i = begin; i < end; i++) {
+      // The pasts are where the presents were, so the kept pasts go where the next presents would have
+      kept[i] = ping_pong_ ? ping_pong_->CreatePresent(i, shape, TypeOf(i)) : OrtValue::CreateTensor(*model_.allocator_device_, shape, TypeOf(i));
+      sources.push_back(values[i].get());
+      targets.push_back(kept[i].get());
+    }
+    beam_gather_.Gather(rows, sources, targets, block_bytes);
+  };
+  gather(0, layer_count_ * 2);
+  if (tensor_count_ > layer_count_ * 2)
+    gather(layer_count_ * 2, tensor_count_);
+  if (ping_pong_)
+    ping_pong_->Swap();
+
+  shape_[0] = static_cast<int64_t>(rows.size());
+
+  // Graph capture needs the kv to stay where it is, so it's copied back to the start of the static buffers
+  if (!sb_kv_caches_.empty()) {
+    for (int i = 0; i < layer_count_ * 2; i++) {
+      auto kv = sb_kv_caches_[i]->CreateTensorOnStaticBuffer(shape_, type_);
+      CopyKVRows(model_, *kept[i], shape_[2], *kv, shape_[2], shape_[2], shape_[0] * shape_[1], shape_[3] * SizeOf(type_));
+      kept[i] = std::move(kv);
+    }
+  }
+  values = std::move(kept);
+
+  if (past_present_share_buffer_) {
+    for (int i = 0; i < layer_count_ * 2; i++) {
+      state_.inputs_[input_index_ + i] = presents_[i].get();
+      state_.outputs_[output_index_ + i] = presents_[i].get();
     }
+    return;
+  }
+
+  for (int i = 0; i < tensor_count_; i++) {
     state_.inputs_[input_index_ + i] = pasts_[i].get();
+    presents_[i] = CreatePresent(i);
+    state_.outputs_[output_index_ + i] = presents_[i].get();
   }
+}
 
-  shape_[2] = current_length;
+// The position ids of a streaming kv are relative to it, so once tokens are evicted the keys kept after the sinks are
+// rotated back by as many positions. The models cache rotated keys, so model.decoder.rotary_embedding says how.
+void KV_Cache::InitRotateKeys() {
+  const auto& decoder = model_.config_->model.decoder;
+  const auto& rotary = decoder.rotary_embedding;
+  if (past_present_share_buffer_)
+    throw std::runtime_error("kv_cache window_size requires past_present_share_buffer to be false");
+  if (tensor_count_ > layer_count_ * 2)
+    throw std::runtime_error("kv_cache window_size is not supported by quantized kv cache models, their keys can't be re-rotated");
+  if (rotary.dim <= 0 || rotary.dim > decoder.head_size)
+    throw std::runtime_error("kv_cache window_size needs model.decoder.rotary_embedding, the keys kept after an eviction are re-rotated to their new positions");
+  if (type_ != Ort::TypeToTensorType<float>::type && type_ != Ort::TypeToTensorType<Ort::Float16_t>::type)
+    throw std::runtime_error("kv_cache window_size needs a float or float16 kv cache");
+
+  // The positions never go past sink_size + window_size
+  const auto& kv_cache = decoder.kv_cache;
+  rotary_inv_freq_ = RotaryCache::InverseFrequencies(rotary, kv_cache.sink_size + kv_cache.window_size > rotary.original_context_length);
+#if USE_CUDA
+  if (model_.device_type_ == DeviceType::CUDA) {
+    rotary_inv_freq_device_ = CudaMallocArray<float>(rotary_inv_freq_.size());
+    CudaCheck() == cudaMemcpy(rotary_inv_freq_device_.get(), rotary_inv_freq_.data(), rotary_inv_freq_.size() * sizeof(float), cudaMemcpyHostToDevice);
+  }
+#endif
+}
+
+// Tokens [start, start + count) of every row of the {batch_beam, kv_heads, length, head_size} keys, by delta positions
+void KV_Cache::RotateKeys(OrtValue& keys, int64_t length, int64_t start, int64_t count, int delta) {
+  const int head_size = model_.config_->model.decoder.head_size;
+  const int rotary_dim = model_.config_->model.decoder.rotary_embedding.dim;
+  const int half_dim = rotary_dim / 2;
+  const int64_t rows = shape_[0] * shape_[1];
+
+#if USE_CUDA
+  if (model_.device_type_ == DeviceType::CUDA) {
+    if (type_ == Ort::TypeToTensorType<float>::type)
+      cuda::LaunchRotateKeys(keys.GetTensorMutableData<float>(), static_cast<int>(rows), static_cast<int>(length), static_cast<int>(start),
+                             static_cast<int>(count), head_size, rotary_dim, rotary_inv_freq_device_.get(), delta, model_.cuda_stream_);
+    else
+      cuda::LaunchRotateKeys(keys.GetTensorMutableData<uint16_t>(), static_cast<int>(rows), static_cast<int>(length), static_cast<int>(start),
+                             static_cast<int>(count), head_size, rotary_dim, rotary_inv_freq_device_.get(), delta, model_.cuda_stream_);
+    return;
+  }
+#endif
+
+  std::vector<float> cos(half_dim), sin(half_dim);
+  for (int i = 0; i < half_dim; i++) {
+    cos[i] = std::cos(delta * rotary_inv_freq_[i]);
+    sin[i] = std::sin(delta * rotary_inv_freq_[i]);
+  }
+  auto rotate = [&](auto* data, auto load, auto store) {
+    for (int64_t row = 0; row < rows; row++) {
+      for (int64_t token = start; token < start + count; token++) {
+        auto* key = data + (row * length + token) * head_size;
+        for (int i = 0; i < half_dim; i++) {
+          float x1 = load(key[i]), x2 = load(key[i + half_dim]);
+          key[i] = store(x1 * cos[i] - x2 * sin[i]);
+          key[i + half_dim] = store(x2 * cos[i] + x1 * sin[i]);
+        }
+      }
+    }
+  };
+  if (type_ == Ort::TypeToTensorType<float>::type)
+    rotate(keys.GetTensorMutableData<float>(), [](float x) { return x; }, [](float x) { return x; });
+  else
+    rotate(keys.GetTensorMutableData<uint16_t>(), [](uint16_t x) { return FastFloat16ToFloat32(x); }, [](float x) { return FastFloat32ToFloat16(x); });
+}
+
+void KV_Cache::EvictPast(int past_length) {
+  int64_t sink_length = std::min(model_.config_->model.decoder.kv_cache.sink_size, past_length);
+  int64_t evicted = shape_[2] - past_length;
+
+  for (int i = 0; i < tensor_count_; i++) {
+    auto shape = ShapeOf(i);
+    shape[2] = past_length;
+    // The pasts are where the presents were, so the evicted pasts go where the next presents would have
+    auto past = ping_pong_ ? ping_pong_->CreatePresent(i, shape, TypeOf(i)) : OrtValue::CreateTensor(*model_.allocator_device_, shape, TypeOf(i));
+    size_t token_bytes = shape[3] * SizeOf(TypeOf(i));
+    size_t row_count = shape[0] * shape[1];
+    CopyKVRows(model_, *pasts_[i], shape_[2], *past, past_length, sink_length, row_count, token_bytes);
+    CopyKVRows(model_, *pasts_[i], shape_[2], *past, past_length, past_length - sink_length, row_count, token_bytes, sink_length + evicted, sink_length);
+    if (i % 2 == 0)  // Keys
+      RotateKeys(*past, past_length, sink_length, past_length - sink_length, -static_cast<int>(evicted));
+    pasts_[i] = std::move(past);
+  }
+  if (ping_pong_)
+    ping_pong_->Swap();
+  shape_[2] = past_length;
+}
+
+void KV_Cache::GrowBlocks(int current_length) {
+  block_pool_->Grow(block_tables_, current_length);
+
+  auto old_length = shape_[2];
+  shape_[2] = std::min(block_pool_->BlocksFor(current_length) * block_pool_->BlockSize(), state_.params_->search.max_length);
+
+  // Each [batch_beam, kv_heads] row keeps its tokens at the start, so copy them over with the new row pitch
   for (int i = 0; i < layer_count_ * 2; i++) {
-    presents_[i] = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
+    auto grown = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
+    CopyKVRows(model_, *presents_[i], old_length, *grown, shape_[2], old_length, shape_[0] * shape_[1], shape_[3] * SizeOf(type_));
+
+    presents_[i] = std::move(grown);
+    state_.inputs_[input_index_ + i] = presents_[i].get();
     state_.outputs_[output_index_ + i] = presents_[i].get();
   }
 }
 
-// Copy present state to past state reordered by the beam_indices
-template <typename ScoreType>
-void KV_Cache::PickPastState(std::span<const int32_t> beam_indices, int index) {
-  auto block_size_per_beam = shape_[1] * shape_[2] * shape_[3];
-  auto element_count = shape_[0] * block_size_per_beam;
+void KV_Cache::SeedPrefix(const PrefixCache::Entry& prefix, int prefix_length) {
+  assert(shape_[0] == 1);
+
+  int64_t cached_length = static_cast<int64_t>(prefix.tokens.size());
+  std::vector<std::unique_ptr<OrtValue>> pasts;
+  for (int i = 0; i < tensor_count_; i++) {
+    auto past_shape = ShapeOf(i);
+    past_shape[2] = prefix_length;
+    auto& past = pasts.emplace_back(OrtValue::CreateTensor(*model_.allocator_device_, past_shape, TypeOf(i)));
+    CopyKVRows(model_, *prefix.values[i], cached_length, *past, prefix_length, prefix_length, shape_[0] * shape_[1], past_shape[3] * SizeOf(TypeOf(i)));
+  }
+  SeedPast(std::move(pasts), prefix_length);
+}
+
+void KV_Cache::SeedPast(std::vector<std::unique_ptr<OrtValue>> pasts, int past_length) {
+  assert(pasts.size() == static_cast<size_t>(tensor_count_));
 
-  const OrtValue& present_value = *presents_[index];
-  std::unique_ptr<OrtValue> past_value = OrtValue::CreateTensor<ScoreType>(*model_.allocator_device_, shape_);
-  auto past_span = std::span<ScoreType>(past_value->GetTensorMutableData<ScoreType>(), element_count);
-  auto present_span = std::span<const ScoreType>(present_value.GetTensorData<ScoreType>(), element_count);
+  // The past and present are the same buffer, so the past goes at the start of every row
+  if (past_present_share_buffer_) {
+    if (block_pool_)
+      GrowBlocks(past_length + state_.params_->sequence_length);
+    for (int i = 0; i < tensor_count_; i++)
+      CopyKVRows(model_, *pasts[i], past_length, *presents_[i], shape_[2], past_length, shape_[0] * shape_[1], shape_[3] * SizeOf(type_));
+    return;
+  }
+
+  for (int i = 0; i < tensor_count_; i++) {
+    pasts_[i] = std::move(pasts[i]);
+    state_.inputs_[input_index_ + i] = pasts_[i].get();
+  }
+
+  // The first run now produces the past and the prompt
+  shape_[2] += past_length;
+  for (int i = 0; i < tensor_count_; i++) {
+    presents_[i] = CreatePresent(i);
+    state_.outputs_[output_index_ + i] = presents_[i].get();
+  }
+}
+
+std::vector<std::unique_ptr<OrtValue>> KV_Cache::TakePresents() {
+  for (int i = 0; i < tensor_count_; i++)
+    state_.outputs_[output_index_ + i] = nullptr;
+  // Views over the ping pong buffers can't outlive the cache
+  if (ping_pong_)
+    return CopyPrefix(static_cast<int>(shape_[2]));
+  return std::move(presents_);
+}
+
+std::vector<std::unique_ptr<OrtValue>> KV_Cache::TakePrefix(int length) {
+  if (length == shape_[2])
+    return TakePresents();
+  return CopyPrefix(length);
+}
+
+std::vector<std::unique_ptr<OrtValue>> KV_Cache::CopyPrefix(int length) const {
+  assert(length <= shape_[2]);
+
+  std::vector<std::unique_ptr<OrtValue>> values;
+  for (int i = 0; i < tensor_count_; i++) {
+    auto prefix_shape = ShapeOf(i);
+    prefix_shape[2] = length;
+    auto& value = values.emplace_back(OrtValue::CreateTensor(*model_.allocator_device_, prefix_shape, TypeOf(i)));
+    CopyKVRows(model_, *presents_[i], shape_[2], *value, length, length, shape_[0] * shape_[1], prefix_shape[3] * SizeOf(TypeOf(i)));
+  }
+  return values;
+}
+
+std::vector<std::unique_ptr<OrtValue>> KV_Cache::ConcatRows(const Model& model, std::span<std::vector<std::unique_ptr<OrtValue>>> parts,
+                                                            std::span<const std::vector<int32_t>> rows, int length) {
+  size_t row_count = 0;
+  for (auto& part_rows : rows)
+    row_count += part_rows.size();
 
+  std::vector<std::unique_ptr<OrtValue>> values;
+  for (size_t i = 0; i < parts[0].size(); i++) {
+    auto type_info = parts[0][i]->GetTensorTypeAndShapeInfo();
+    auto shape = type_info->GetShape();
+    auto type = type_info->GetElementType();
+    const int64_t heads = shape[1];
+    const size_t token_bytes = shape[3] * SizeOf(type);
+    shape[0] = static_cast<int64_t>(row_count);
+    shape[2] = length;
+    auto& value = values.emplace_back(OrtValue::CreateTensor(*model.allocator_device_, shape, type));
+
+    // The padding is masked out, but garbage in it could still be a NaN that the mask doesn't hide
+    size_t bytes = row_count * heads * length * token_bytes;
+#if USE_CUDA
+    if (model.device_type_ == DeviceType::CUDA)
+      CudaCheck() == cudaMemsetAsync(value->GetTensorMutableRawData(), 0, bytes, model.cuda_stream_);
+    else
+#endif
+      std::memset(value->GetTensorMutableRawData(), 0, bytes);
+
+    int64_t target_row = 0;
+    for (size_t part = 0; part < parts.size(); part++) {
+      const auto& source = *parts[part][i];
+      const int64_t part_length = source.GetTensorTypeAndShapeInfo()->GetShape()[2];
+      for (auto row : rows[part]) {
+        CopyKVRows(model, source, part_length, *value, length, part_length, heads, token_bytes,
+                   row * heads * part_length, target_row * heads * length + (length - part_length));
+        target_row++;
+      }
+    }
+  }
+  return values;
+}
+
+// Where each present starts in the swapped out copy, followed by the total size
+std::vector<size_t> KV_Cache::SwapOffsets() const {
+  std::vector<size_t> offsets{0};
+  for (int i = 0; i < tensor_count_; i++)
+    offsets.push_back(offsets.back() + presents_[i]->GetTensorTypeAndShapeInfo()->GetElementCount() * SizeOf(TypeOf(i)));
+  return offsets;
+}
+
+void KV_Cache::SwapOut(const std::string& path) {
+  if (swapped_out_)
+    throw std::runtime_error("The kv cache is already swapped out");
+  if (!sb_kv_caches_.empty())
+    throw std::runtime_error("The kv cache can't be swapped out with graph capture, its buffers are part of the graph");
+  if (!OnHost(model_.device_type_) && model_.device_type_ != DeviceType::CUDA)
+    throw std::runtime_error("Swapping out the kv cache is only supported on CPU and CUDA");
+  if (OnHost(model_.device_type_) && path.empty()) {
+    swapped_out_ = true;  // Already in host memory, the presents stay where they are
+    return;
+  }
+
+  auto offsets = SwapOffsets();
+  size_t total_bytes = offsets.back();
+
+  uint8_t* host = nullptr;
 #if USE_CUDA
   if (model_.device_type_ == DeviceType::CUDA) {
-    for (size_t j = 0; j < beam_indices.size(); j++) {
-      int32_t beam_index = beam_indices[j];
-      auto present = present_span.subspan(beam_index * block_size_per_beam, block_size_per_beam);
-      auto past = past_span.subspan(j * block_size_per_beam, block_size_per_beam);
-      cudaMemcpyAsync(past.data(), present.data(), present.size_bytes(), cudaMemcpyDeviceToDevice, model_.cuda_stream_);
+    swap_pinned_ = CudaMallocHostArray<uint8_t>(total_bytes);
+    host = swap_pinned_.get();
+    for (int i = 0; i < tensor_count_; i++)
+      cudaMemcpyAsync(host + offsets[i], presents_[i]->GetTensorRawData(), offsets[i + 1] - offsets[i], cudaMemcpyDeviceToHost, model_.cuda_stream_);
+    cudaStreamSynchronize(model_.cuda_stream_);  // Before the device memory is freed
+  }
+#endif
+  if (!host) {
+    swap_cpu_ = std::make_unique<uint8_t[]>(total_bytes);
+    host = swap_cpu_.get();
+    for (int i = 0; i < tensor_count_; i++)
+      std::memcpy(host + offsets[i], presents_[i]->GetTensorRawData(), offsets[i + 1] - offsets[i]);
+  }
+
+  if (!path.empty()) {
+    auto file = fs::path(path).open_for_write(std::ios::binary);
+    file.write(reinterpret_cast<const char*>(host), total_bytes);
+    if (!file)
+      throw std::runtime_error("Failed to write the kv cache to " + path);
+    swap_cpu_.reset();
+#if USE_CUDA
+    swap_pinned_.reset();
+#endif
+  }
+  swap_path_ = path;
+
+  // The pasts were consumed by the last run, the presents are all there is
+  for (int i = 0; i < tensor_count_; i++) {
+    pasts_[i].reset();
+    presents_[i].reset();
+    state_.outputs_[output_index_ + i] = nullptr;
+    if (past_present_share_buffer_)
+      state_.inputs_[input_index_ + i] = nullptr;
+  }
+  if (ping_pong_)
+    ping_pong_ = std::make_unique<KV_PingPong>(*model_.allocator_device_, tensor_count_);
+  if (block_pool_) {
+    for (auto& block_table : block_tables_)
+      block_pool_->Release(block_table);
+  }
+  swapped_out_ = true;
+}
+
+void KV_Cache::SwapIn() {
+  if (!swapped_out_)
+    throw std::runtime_error("The kv cache is not swapped out");
+  if (presents_[0]) {  // SwapOut had nothing to do
+    swapped_out_ = false;
+    return;
+  }
+
+  if (block_pool_)
+    block_pool_->Grow(block_tables_, static_cast<int>(shape_[2]));
+
+  // On failure the cache stays swapped out, without the blocks and device memory it took
+  try {
+    for (int i = 0; i < tensor_count_; i++)
+      presents_[i] = CreatePresent(i);
+
+    auto offsets = SwapOffsets();
+    size_t total_bytes = offsets.back();
+
+    uint8_t* host = swap_cpu_.get();
+#if USE_CUDA
+    if (model_.device_type_ == DeviceType::CUDA) {
+      if (!swap_path_.empty())
+        swap_pinned_ = CudaMallocHostArray<uint8_t>(total_bytes);
+      host = swap_pinned_.get();
     }
-  } else
 #endif
-  {
-    for (size_t j = 0; j < beam_indices.size(); j++) {
-      int32_t const beam_index = beam_indices[j];
-      auto present = present_span.subspan(beam_index * block_size_per_beam, block_size_per_beam);
-      auto past = past_span.subspan(j * block_size_per_beam, block_size_per_beam);
-      copy(present, past);
+    if (!swap_path_.empty()) {
+      if (!host) {
+        swap_cpu_ = std::make_unique<uint8_t[]>(total_bytes);
+        host = swap_cpu_.get();
+      }
+      auto file = fs::path(swap_path_).open(std::ios::binary);
+      file.read(reinterpret_cast<char*>(host), total_bytes);
+      if (!file)
+        throw std::runtime_error("Failed to read the kv cache from " + swap_path_);
+      file.close();
+      std::remove(swap_path_.c_str());
+    }
+
+    for (int i = 0; i < tensor_count_; i++) {
+      size_t bytes = offsets[i + 1] - offsets[i];
+#if USE_CUDA
+      if (model_.device_type_ == DeviceType::CUDA)
+        cudaMemcpyAsync(presents_[i]->GetTensorMutableRawData(), host + offsets[i], bytes, cudaMemcpyHostToDevice, model_.cuda_stream_);
+      else
+#endif
+        std::memcpy(presents_[i]->GetTensorMutableRawData(), host + offsets[i], bytes);
+
+      state_.outputs_[output_index_ + i] = presents_[i].get();
+      if (past_present_share_buffer_)
+        state_.inputs_[input_index_ + i] = presents_[i].get();
+    }
+  } catch (...) {
+    for (int i = 0; i < tensor_count_; i++) {
+      presents_[i].reset();
+      state_.outputs_[output_index_ + i] = nullptr;
+      if (past_present_share_buffer_)
+        state_.inputs_[input_index_ + i] = nullptr;
+    }
+    if (block_pool_) {
+      for (auto& block_table : block_tables_)
+        block_pool_->Release(block_table);
     }
+    throw;
   }
 
-  pasts_[index] = std::move(past_value);
+#if USE_CUDA
+  if (model_.device_type_ == DeviceType::CUDA)
+    cudaStreamSynchronize(model_.cuda_stream_);  // Before the pinned memory is freed
+  swap_pinned_.reset();
+#endif
+  swap_cpu_.reset();
+  swap_path_.clear();
+  swapped_out_ = false;
+}
+
+// Snapshot kv data starts on page boundaries, so it can be memory mapped or read straight into device buffers
+constexpr std::streamoff snapshot_alignment = 4096;
+
+static void PadToAlignment(std::ostream& file) {
+  auto position = static_cast<std::streamoff>(file.tellp());
+  std::vector<char> zeros(static_cast<size_t>((snapshot_alignment - position % snapshot_alignment) % snapshot_alignment));
+  file.write(zeros.data(), zeros.size());
+}
+
+static void SkipToAlignment(std::istream& file) {
+  auto position = static_cast<std::streamoff>(file.tellg());
+  file.seekg((snapshot_alignment - position % snapshot_alignment) % snapshot_alignment, std::ios::cur);
 }
 
-void KV_Cache::PickPastState(std::span<const int32_t> beam_indices, int index) {
-  if (type_ == Ort::TypeToTensorType<float>::type) {
-    PickPastState<float>(beam_indices, index);
-  } else {
-    PickPastState<Ort::Float16_t>(beam_indices, index);
+void KV_Cache::Save(std::ostream& file, int length) {
+  if (swapped_out_)
+    throw std::runtime_error("A swapped out kv cache can't be saved, call SwapIn first");
+  assert(length <= shape_[2]);
+
+  for (int i = 0; i < tensor_count_; i++) {
+    auto shape = ShapeOf(i);
+    shape[2] = length;
+    size_t token_bytes = shape[3] * SizeOf(TypeOf(i));
+    uint64_t bytes = static_cast<uint64_t>(shape[0] * shape[1] * shape[2]) * token_bytes;
+
+    // A shared buffer holds max_length tokens per row, only the first length of them are saved
+    std::unique_ptr<OrtValue> prefix;
+    const OrtValue* value = presents_[i].get();
+    if (shape_[2] != length) {
+      prefix = OrtValue::CreateTensor(*model_.allocator_device_, shape, TypeOf(i));
+      CopyKVRows(model_, *presents_[i], shape_[2], *prefix, length, length, shape[0] * shape[1], token_bytes);
+      value = prefix.get();
+    }
+
+    auto* data = value->GetTensorData<uint8_t>();
+#if USE_CUDA
+    cuda_host_unique_ptr<uint8_t> host;
+    if (model_.device_type_ == DeviceType::CUDA) {
+      host = CudaMallocHostArray<uint8_t>(bytes);
+      cudaMemcpyAsync(host.get(), data, bytes, cudaMemcpyDeviceToHost, model_.cuda_stream_);
+      cudaStreamSynchronize(model_.cuda_stream_);
+      data = host.get();
+    }
+#endif
+    file.write(reinterpret_cast<const char*>(&bytes), sizeof(bytes));
+    PadToAlignment(file);
+    file.write(reinterpret_cast<const char*>(data), bytes);
+  }
+}
+
+void KV_Cache::LoadPast(std::istream& file, int past_length) {
+  std::vector<std::unique_ptr<OrtValue>> pasts;
+  for (int i = 0; i < tensor_count_; i++) {
+    auto shape = ShapeOf(i);
+    shape[2] = past_length;
+    uint64_t expected_bytes = static_cast<uint64_t>(shape[0] * shape[1] * shape[2] * shape[3]) * SizeOf(TypeOf(i));
+    uint64_t bytes{};
+    file.read(reinterpret_cast<char*>(&bytes), sizeof(bytes));
+    if (!file || bytes != expected_bytes)
+      throw std::runtime_error("The snapshot's kv cache doesn't match this model");
+    SkipToAlignment(file);
+
+    auto& past = pasts.emplace_back(OrtValue::CreateTensor(*model_.allocator_device_, shape, TypeOf(i)));
+    auto* data = static_cast<char*>(past->GetTensorMutableRawData());
+#if USE_CUDA
+    if (model_.device_type_ == DeviceType::CUDA) {
+      auto host = CudaMallocHostArray<uint8_t>(bytes);
+      file.read(reinterpret_cast<char*>(host.get()), bytes);
+      cudaMemcpyAsync(data, host.get(), bytes, cudaMemcpyHostToDevice, model_.cuda_stream_);
+      cudaStreamSynchronize(model_.cuda_stream_);  // Before the pinned memory is freed
+    } else
+#endif
+      file.read(data, bytes);  // Straight into the tensor
+    if (!file)
+      throw std::runtime_error("Failed to read the kv cache from the snapshot");
+  }
+  SeedPast(std::move(pasts), past_length);
+}
+
+// Copy present state to past state reordered by the beam_indices
+void KV_Cache::PickPastStates(RoamingArray<int32_t> beam_indices) {
+  // The keys/values and their scales have different block sizes, so they're gathered separately
+  for (int first = 0; first < tensor_count_; first += layer_count_ * 2) {
+    std::vector<const OrtValue*> sources;
+    std::vector<OrtValue*> targets;
+    for (int i = first; i < first + layer_count_ * 2; i++) {
+      pasts_[i] = ping_pong_ ? ping_pong_->CreatePast(i, ShapeOf(i), TypeOf(i)) : OrtValue::CreateTensor(*model_.allocator_device_, ShapeOf(i), TypeOf(i));
+      sources.push_back(presents_[i].get());
+      targets.push_back(pasts_[i].get());
+    }
+    auto shape = ShapeOf(first);
+    size_t block_bytes = shape[1] * shape[2] * shape[3] * SizeOf(TypeOf(first));
+#if USE_CUDA
+    if (model_.device_type_ == DeviceType::CUDA && !beam_indices.device_.empty()) {
+      beam_gather_.GatherOnDevice(gpu_span<const int32_t>{beam_indices.device_.data(), beam_indices.device_.size()}, sources, targets, block_bytes);
+      continue;
+    }
+#endif
+    beam_gather_.Gather(beam_indices.GetCPU(), sources, targets, block_bytes);
+  }
+}
+
+// The buffers keep their address (graph capture), so each tensor is gathered into a scratch tensor and copied back.
+// Only the valid_length tokens of every head are copied, the rest of the rows up to max_length is garbage anyway.
+void KV_Cache::ReorderBeams(RoamingArray<int32_t> beam_indices, int valid_length) {
+  assert(tensor_count_ == layer_count_ * 2);  // Quantized kv can't share the buffer
+  auto shape = ShapeOf(0);
+  const size_t token_bytes = shape[3] * SizeOf(type_);
+  const size_t row_pitch = shape[2] * token_bytes;
+  const size_t row_bytes = valid_length * token_bytes;
+  const int heads = static_cast<int>(shape[1]);
+  if (!beam_scratch_)
+    beam_scratch_ = OrtValue::CreateTensor(*model_.allocator_device_, shape, type_);
+  OrtValue* scratch = beam_scratch_.get();
+
+#if USE_CUDA
+  if (model_.device_type_ == DeviceType::CUDA) {
+    // With pipelined steps the indices are already on the device, otherwise they're uploaded once for every tensor
+    auto indices = !beam_indices.device_.empty() ? gpu_span<const int32_t>{beam_indices.device_.data(), beam_indices.device_.size()}
+                                                 : beam_gather_.Upload(beam_indices.GetCPU());
+    for (int i = 0; i < tensor_count_; i++) {
+      const OrtValue* present = presents_[i].get();
+      beam_gather_.GatherRowsOnDevice(indices, {&present, 1}, {&scratch, 1}, heads, row_pitch, row_bytes);
+      CopyKVRows(model_, *scratch, shape[2], *presents_[i], shape[2], valid_length, static_cast<size_t>(shape[0] * shape[1]), token_bytes);
+    }
+    return;
+  }
+#endif
+
+  auto indices = beam_indices.GetCPU();
+  for (int i = 0; i < tensor_count_; i++) {
+    const OrtValue* present = presents_[i].get();
+    beam_gather_.GatherRows(indices, {&present, 1}, {&scratch, 1}, heads, row_pitch, row_bytes);
+    CopyKVRows(model_, *scratch, shape[2], *presents_[i], shape[2], valid_length, static_cast<size_t>(shape[0] * shape[1]), token_bytes);
   }
 }
 
 Cross_Cache::Cross_Cache(const Model& model, State& state)
     : model_{model},
       state_{state},
-      layer_count_{model_.config_->model.decoder.num_hidden_layers},
-      shape_{state_.params_->BatchBeamSize(), model.config_->model.decoder.num_key_value_heads, 1500, model.config_->model.decoder.head_size} {
+      layer_count_{model_.config_->model.decoder.num_hidden_layers} {
   values_.reserve(layer_count_ * 2);
 
   for (int i = 0; i < layer_count_; ++i) {
@@ -273,23 +1076,36 @@ Cross_Cache::Cross_Cache(const Model& model, State& state)
     snprintf(string, std::size(string), model.config_->model.decoder.outputs.cross_present_value_names.c_str(), i);
     output_name_strings_.emplace_back(string);
   }
-
-  // Derive the KV data type from the KV input 0
-  type_ = model_.session_info_->GetInputDataType(input_name_strings_[0]);
-
-  for (int i = 0; i < layer_count_; ++i) {
-    values_.push_back(OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_));
-    values_.push_back(OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_));
-  }
 }
 
 void Cross_Cache::AddOutputs() {
+  output_index_ = state_.outputs_.size();
   for (int i = 0; i < layer_count_ * 2; ++i) {
-    state_.outputs_.push_back(values_[i].get());
+    state_.outputs_.push_back(nullptr);  // ORT allocates them
     state_.output_names_.push_back(output_name_strings_[i].c_str());
   }
 }
 
+void Cross_Cache::TakeOutputs() {
+  const int copies = state_.params_->search.num_beams * state_.params_->prompt_copies;
+  values_.clear();
+  for (int i = 0; i < layer_count_ * 2; ++i) {
+    std::unique_ptr<OrtValue> value{state_.outputs_[output_index_ + i]};
+    state_.outputs_[output_index_ + i] = nullptr;
+
+    // The beams and samples of a prompt all attend to the same encoder output, but the decoder takes the kv of every row
+    if (copies > 1) {
+      auto type_info = value->GetTensorTypeAndShapeInfo();
+      auto shape = type_info->GetShape();
+      shape[0] *= copies;
+      auto expanded = OrtValue::CreateTensor(*model_.allocator_device_, shape, type_info->GetElementType());
+      beam_gather_.ExpandBeams(*value, *expanded, copies);
+      value = std::move(expanded);
+    }
+    values_.push_back(std::move(value));
+  }
+}
+
 void Cross_Cache::AddInputs() {
   for (int i = 0; i < layer_count_ * 2; ++i) {
     state_.inputs_.push_back(values_[i].get());
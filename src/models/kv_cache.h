@@ -4,21 +4,92 @@
 
 namespace Generators {
 
+// Reorders the beams of a set of kv tensors for beam search. Block j of every target becomes a copy of block
+// block_indices[j] of its source. On CUDA all tensors are done in a single kernel launch instead of a copy per beam per
+// layer.
+struct KV_BeamGather {
+  explicit KV_BeamGather(const Model& model) : model_{model} {}
+
+  void Gather(std::span<const int32_t> block_indices, std::span<const OrtValue* const> sources, std::span<OrtValue* const> targets, size_t block_bytes);
+  // Same with every block made of row_count rows row_pitch bytes apart, of which only the first row_bytes are copied,
+  // like the valid tokens of every head of a beam in a kv buffer shared by past and present
+  void GatherRows(std::span<const int32_t> block_indices, std::span<const OrtValue* const> sources, std::span<OrtValue* const> targets,
+                  int row_count, size_t row_pitch, size_t row_bytes);
+#if USE_CUDA
+  // Same with the indices already on the device, nothing waits for them on the host
+  void GatherOnDevice(gpu_span<const int32_t> block_indices, std::span<const OrtValue* const> sources, std::span<OrtValue* const> targets, size_t block_bytes);
+  void GatherRowsOnDevice(gpu_span<const int32_t> block_indices, std::span<const OrtValue* const> sources, std::span<OrtValue* const> targets,
+                          int row_count, size_t row_pitch, size_t row_bytes);
+  gpu_span<const int32_t> Upload(std::span<const int32_t> block_indices);  // Valid until the next call
+#endif
+  // Copies every batch row of source to the rows of all its num_beams beams in target. A [batch, heads, sequence, head
+  // size] target with a longer sequence, a kv buffer shared by past and present, gets the source's tokens at the start.
+  void ExpandBeams(const OrtValue& source, OrtValue& target, int num_beams);
+
+ private:
+  const Model& model_;
+#if USE_CUDA
+  const void* const* UploadTensors(std::span<const OrtValue* const> sources, std::span<OrtValue* const> targets);
+
+  cuda_unique_ptr<int32_t> block_indices_ptr_;
+  gpu_span<int32_t> block_indices_gpu_;
+  cuda_unique_ptr<const void*> tensors_ptr_;
+  gpu_span<const void*> tensors_gpu_;   // Sources followed by targets
+  std::vector<const void*> tensors_cpu_;  // Staging for tensors_gpu_
+#endif
+};
+
+// Backing memory for a kv tensor that grows every step. The tensors are views over it, and it's only reallocated (to at
+// least double its size) when a tensor doesn't fit, so generating n tokens takes O(log n) allocations instead of n.
+// Creating a tensor invalidates the previous one when the buffer has to grow.
+struct KV_GrowableBuffer {
+  explicit KV_GrowableBuffer(Ort::Allocator& allocator) : allocator_{allocator} {}
+  ~KV_GrowableBuffer();
+
+  std::unique_ptr<OrtValue> CreateTensor(std::span<const int64_t> shape, ONNXTensorElementDataType type);
+
+ private:
+  Ort::Allocator& allocator_;
+  void* buffer_{};
+  size_t bytes_{};
+};
+
+// Two growable buffers per kv tensor that the past and present alternate between (model.decoder.kv_cache.preallocate)
+struct KV_PingPong {
+  KV_PingPong(Ort::Allocator& allocator, int tensor_count);
+
+  // Greedy: the last presents become the pasts, so the new presents go in the other buffer
+  void Swap() { present_ ^= 1; }
+  std::unique_ptr<OrtValue> CreatePast(int index, std::span<const int64_t> shape, ONNXTensorElementDataType type) { return buffers_[index * 2 + (present_ ^ 1)]->CreateTensor(shape, type); }
+  std::unique_ptr<OrtValue> CreatePresent(int index, std::span<const int64_t> shape, ONNXTensorElementDataType type) { return buffers_[index * 2 + present_]->CreateTensor(shape, type); }
+
+ private:
+  std::vector<std::unique_ptr<KV_GrowableBuffer>> buffers_;
+  int present_{};  // Which buffer of each pair holds the presents
+};
+
 struct KV_Cache_Combined {
   KV_Cache_Combined(const Model& model, State& state);
 
+  // KV_Cache::IsBufferShared, and the attention takes past_sequence_length, as it can't tell the valid pasts otherwise
+  static bool IsBufferShared(const Model& model, const GeneratorParams& params);
+
   void Add();  // Add to state inputs/outputs
   void Update(std::span<const int32_t> beam_indices, int current_length);
 
-  template <typename ScoreType>
-  void PickPastState(std::span<const int32_t> beam_indices, int index);
-  void PickPastState(std::span<const int32_t> beam_indices, int index);
-
  private:
+  void PickPastStates(std::span<const int32_t> beam_indices);  // Sets the pasts to the presents reordered by beam_indices
+  void ReorderBeams(std::span<const int32_t> beam_indices, int valid_length);  // Shared buffer: reorders the presents in place
+  std::unique_ptr<OrtValue> CreatePresent(int index);
+
   const Model& model_;
   State& state_;
   int layer_count_;
   size_t input_index_{~0U}, output_index_{~0U};
+  KV_BeamGather beam_gather_{model_};
+  std::unique_ptr<KV_PingPong> ping_pong_;  // Set when the pasts & presents are views over preallocated buffers
+  bool past_present_share_buffer_;          // See IsBufferShared
+  std::unique_ptr<OrtValue> beam_scratch_;  // Shared buffer beam search: one tensor, the reordered copy before it's written back
 
   std::array<int64_t, 5> shape_;
   ONNXTensorElementDataType type_;
@@ -26,48 +97,116 @@ struct KV_Cache_Combined {
   std::unique_ptr<OrtValue> empty_past_;
   std::vector<std::unique_ptr<OrtValue>> pasts_, presents_;
   std::vector<std::string> input_name_strings_, output_name_strings_;
+
+  // Shared buffer: int32 {1} on the cpu, the number of valid tokens in the pasts
+  std::unique_ptr<OrtValue> past_sequence_length_;
 };
 
 struct KV_Cache {
   KV_Cache(const Model& model, State& state);
+  ~KV_Cache();
+
+  // Whether the pasts & presents are one buffer allocated to max_length (search.past_present_share_buffer)
+  static bool IsBufferShared(const Model& model, const GeneratorParams& params);
 
   void AddEncoder();  // If model has an initial encoder step, this is used
   void Add();
-  void Update(std::span<const int32_t> beam_indices, int current_length);
-  template <typename ScoreType>
-  void PickPastState(std::span<const int32_t> beam_indices, int index);
-  void PickPastState(std::span<const int32_t> beam_indices, int index);
+  // The beam indices can be on the device (pipelined beam search on CUDA), they're only copied to the host on CPU
+  void Update(RoamingArray<int32_t> beam_indices, int current_length);
+  // Compacting finished rows: keeps the kv of only these rows (ascending indices into the current batch), call after
+  // Update(). Paged mode gives the blocks of the others back to the pool.
+  void KeepRows(std::span<const int32_t> rows);
+
+  // Prefix caching: use the first prefix_length tokens of a cached prefix as the initial past (call after Add())
+  void SeedPrefix(const PrefixCache::Entry& prefix, int prefix_length);
+  // Chunked prefill and multi-turn: adopt the presents of the previous state as the initial past (call after Add()).
+  // With a shared buffer they're copied into it instead.
+  void SeedPast(std::vector<std::unique_ptr<OrtValue>> pasts, int past_length);
+  // Hands the presents to the caller, the state can't be run again afterwards
+  std::vector<std::unique_ptr<OrtValue>> TakePresents();
+  // The presents of the first length tokens, moved out when that's all of them (rolls the kv back for speculative decoding)
+  std::vector<std::unique_ptr<OrtValue>> TakePrefix(int length);
+  // Copies the first length tokens of the presents, used to fill the prefix cache after the prompt run
+  std::vector<std::unique_ptr<OrtValue>> CopyPrefix(int length) const;
+  // Merging generators: the rows of several TakePrefix results one after the other, each left padded with zeros to
+  // length tokens like the kv of a left padded prompt. rows[i] are the rows of parts[i] to keep.
+  static std::vector<std::unique_ptr<OrtValue>> ConcatRows(const Model& model, std::span<std::vector<std::unique_ptr<OrtValue>>> parts,
+                                                           std::span<const std::vector<int32_t>> rows, int length);
+
+  // Offload for idle generators: copies the presents to pinned host memory, or to a file when path isn't empty, and
+  // frees the device memory (call between runs). SwapIn restores them before the next run. On the CPU without a path
+  // the presents stay where they are, but the cache is still swapped out until SwapIn.
+  void SwapOut(const std::string& path);
+  void SwapIn();
+
+  // Generator snapshots: writes the kv of the first length tokens, each tensor's data page aligned. LoadPast reads it
+  // back as the initial past (call after Add()).
+  void Save(std::ostream& file, int length);
+  void LoadPast(std::istream& file, int past_length);
 
  private:
+  void GrowBlocks(int current_length);  // Paged mode: grow the shared buffers to hold current_length tokens
+  std::vector<size_t> SwapOffsets() const;
+  void EvictPast(int past_length);      // Streaming: keep the sink tokens and the latest past_length - sink_size of the pasts
+  void InitRotateKeys();                // Streaming: checks the kv can be re-rotated and makes the rotary frequencies
+  void RotateKeys(OrtValue& keys, int64_t length, int64_t start, int64_t count, int delta);
+  void PickPastStates(RoamingArray<int32_t> beam_indices);  // Sets the pasts to the presents reordered by beam_indices
+  void ReorderBeams(RoamingArray<int32_t> beam_indices, int valid_length);  // Shared buffer: reorders the presents in place
+  std::unique_ptr<OrtValue> CreatePresent(int index);
+  // Tensors are the key/value of every layer, followed by their scales for quantized kv
+  std::array<int64_t, 4> ShapeOf(int index) const;
+  ONNXTensorElementDataType TypeOf(int index) const { return index < layer_count_ * 2 ? type_ : scale_type_; }
+
   const Model& model_;
   State& state_;
   int layer_count_;
+  int tensor_count_;  // layer_count_ * 2, doubled when the model has kv scales
   size_t input_index_{~0U}, output_index_{~0U};
-  bool past_present_share_buffer_;  // True if model.decoder.past_present_share_buffer is set to true, and we're using cuda, and not beam search
+  KV_BeamGather beam_gather_{model_};
+  std::unique_ptr<KV_PingPong> ping_pong_;  // Set when the pasts & presents are views over preallocated buffers
+  bool past_present_share_buffer_;  // See IsBufferShared
+  std::unique_ptr<OrtValue> beam_scratch_;  // Shared buffer beam search: one tensor, the reordered copy before it's written back
+
+  KV_BlockPool* block_pool_{};                // Set when the shared buffers are paged (model.decoder.kv_cache.block_size)
+  std::vector<std::vector<int>> block_tables_;  // Per sequence (batch_beam) list of blocks taken from block_pool_
 
   std::array<int64_t, 4> shape_;
   ONNXTensorElementDataType type_;
+  ONNXTensorElementDataType scale_type_{};  // Quantized kv: the {batch_beam, kv_heads, sequence_length, 1} scales
 
-  std::unique_ptr<OrtValue> empty_past_;
+  std::unique_ptr<OrtValue> empty_past_, empty_scale_;
   std::vector<std::unique_ptr<OrtValue>> pasts_, presents_;
   std::vector<std::string> input_name_strings_, output_name_strings_;
   std::vector<StaticBuffer*> sb_kv_caches_;
+
+  std::vector<float> rotary_inv_freq_;  // Streaming: see InitRotateKeys
+#if USE_CUDA
+  cuda_unique_ptr<float> rotary_inv_freq_device_;
+#endif
+
+  bool swapped_out_{};
+  std::string swap_path_;                 // Empty when swapped to host memory
+  std::unique_ptr<uint8_t[]> swap_cpu_;  // Host copy of the presents, one after the other
+#if USE_CUDA
+  cuda_host_unique_ptr<uint8_t> swap_pinned_;  // Used instead of swap_cpu_ on CUDA
+#endif
 };
 
-// Very similar to the KV_Cache, but is only created once at the encoder step, then used without modification for every decoder step
+// The cross attention kv, computed once by the encoder and then used without modification for every decoder step. It's
+// allocated by ORT so its shape (the number of audio frames) comes from the encoder output instead of being fixed.
 struct Cross_Cache {
   Cross_Cache(const Model& model, State& state);
 
   void AddOutputs();
+  void TakeOutputs();  // After the encoder run, which is once per prompt, the values are expanded to every beam and sample
   void AddInputs();
 
  private:
   const Model& model_;
   State& state_;
   int layer_count_;
-
-  std::array<int64_t, 4> shape_;
-  ONNXTensorElementDataType type_;
+  size_t output_index_{~0U};
+  KV_BeamGather beam_gather_{model_};
 
   std::vector<std::unique_ptr<OrtValue>> values_;
   std::vector<std::string> input_name_strings_, output_name_strings_;
@@ -14,6 +14,23 @@ Logits::Logits(const Model& model, State& state)
       state_{state},
       shape_{static_cast<int64_t>(state_.params_->batch_size) * state_.params_->search.num_beams, state_.params_->sequence_length, state_.params_->vocab_size},
       type_{model_.session_info_->GetOutputDataType(model_.config_->model.decoder.outputs.logits)} {
+  auto& last_token_indices_name = model_.config_->model.decoder.inputs.last_token_indices;
+  if (model_.session_info_->HasInput(last_token_indices_name)) {
+    auto indices_type = model_.session_info_->GetInputDataType(last_token_indices_name);
+    if (indices_type != Ort::TypeToTensorType<int32_t>::type && indices_type != Ort::TypeToTensorType<int64_t>::type)
+      throw std::runtime_error("last_token_indices only supports int32 or int64 types");
+
+    auto last_tokens = GetLastTokenIndices();
+    std::array<int64_t, 2> indices_shape{state_.params_->batch_size, 1};  // Expanded over the beams below
+    last_token_indices_ = OrtValue::CreateTensor(model_.allocator_cpu_, indices_shape, indices_type);
+    if (indices_type == Ort::TypeToTensorType<int32_t>::type)
+      std::copy(last_tokens.begin(), last_tokens.end(), last_token_indices_->GetTensorMutableData<int32_t>());
+    else
+      std::copy(last_tokens.begin(), last_tokens.end(), last_token_indices_->GetTensorMutableData<int64_t>());
+    last_token_indices_ = model_.ExpandInputs(last_token_indices_, state_.params_->search.num_beams);
+    shape_[1] = 1;
+  }
+
   auto logits_tensor = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
   if (type_ == Ort::TypeToTensorType<float>::type)
     value32_ = std::move(logits_tensor);
@@ -29,6 +46,10 @@ Logits::Logits(const Model& model, State& state)
     }
   }
 
+  auto& next_tokens_name = model_.config_->model.decoder.outputs.next_tokens;
+  has_next_tokens_ = OnHost(model_.device_type_) && model_.session_info_->HasOutput(next_tokens_name) &&
+                     model_.session_info_->GetOutputDataType(next_tokens_name) == Ort::TypeToTensorType<int32_t>::type;
+
 #if USE_CUDA
   if (model_.device_type_ == DeviceType::CUDA && !model_.config_->model.eos_token_ids.empty()) {
     auto& cpu_ids = model_.config_->model.eos_token_ids;
@@ -36,128 +57,219 @@ Logits::Logits(const Model& model, State& state)
     cudaMemcpyAsync(cuda_eos_token_ids_.data(), cpu_ids.data(), cpu_ids.size() * sizeof(int32_t), ::cudaMemcpyHostToDevice, model_.cuda_stream_);
   }
 #endif
-}
 
-RoamingArray<float> Logits::Get() {
-  size_t element_count = shape_[0] * shape_[1] * shape_[2];
-
-  // Convert from float16 to float32 if necessary
-  if (type_ == Ort::TypeToTensorType<Ort::Float16_t>::type) {
 #if USE_DML
-    if (model_.device_type_ == DeviceType::DML) {
-      DmlHelpers::DmlCastInputToOutput(
-          model_.GetDmlExecutionContext(),
-          *model_.allocator_device_,
-          *value16_,
-          value32_,
-          model_.GetDmlDevice(),
-          model_.GetOrtDmlApi(),
-          logits_cast_command_list_state_);
-    } else
-#endif
-      ConvertFp16ToFp32(*model_.allocator_device_, *value16_, value32_, model_.device_type_, model_.cuda_stream_);
+  // DML doesn't support on-device scoring yet, so we need to download some data to the CPU
+  if (model_.device_type_ == DeviceType::DML) {
+    value32_cpu_ = OrtValue::CreateTensor<float>(model_.allocator_cpu_, std::array<int64_t, 3>{shape_[0], 1, shape_[2]});
   }
+#endif
+}
 
-  // First iteration? Then copy the logits over to a {batch_beams, 1, vocab_size} tensor
-  // We'll reuse this tensor for all future iterations
-  // The model's output logits are {batch_size*num_beams, input_seq_len, vocab_size}
-  if (shape_[1] != 1) {
-    const size_t seq_length = shape_[1];
-    const size_t vocab_size = shape_[2];
-    const size_t num_beams = state_.params_->search.num_beams;
+std::vector<int32_t> Logits::GetLastTokenIndices() const {
+  const size_t seq_length = state_.params_->sequence_length;
+  const auto* input_ids = state_.params_->input_ids.data();
+
+  std::vector<int32_t> last_tokens(state_.params_->batch_size);
+  auto& lengths = state_.params_->input_lengths;
+  if (!lengths.empty()) {
+    // Known lengths, a left padded row always ends in its last token
+    for (size_t i = 0; i < last_tokens.size(); i++)
+      last_tokens[i] = state_.params_->pad_left ? static_cast<int32_t>(seq_length) - 1 : lengths[i] - 1;
+    return last_tokens;
+  }
 
-    shape_[1] = 1;
+  for (auto& last_token : last_tokens) {
+    // Find the first non pad token from the end, a row of only pad tokens uses position 0
+    size_t token_index = seq_length;
+    while (token_index > 1 && input_ids[token_index - 1] == state_.params_->pad_token_id)
+      token_index--;
+    last_token = static_cast<int32_t>(token_index) - 1;
+    if (last_token < 0)
+      last_token = 0;
 
-    // bugbug: not done yet
-    auto value_next = !sb_logits32_ ? OrtValue::CreateTensor<float>(*model_.allocator_device_, shape_)
-                                    : sb_logits32_->CreateTensorOnStaticBuffer(shape_, type_);
+    input_ids += seq_length;
+  }
+  return last_tokens;
+}
 
+// First iteration? Then copy the logits of the last token over to a {batch_beams, 1, vocab_size} tensor
+// We'll reuse this tensor for all future iterations
+// The model's output logits are {batch_size*num_beams, input_seq_len, vocab_size}
+// This is done before the fp16->fp32 conversion, so only the rows that are kept get converted
+void Logits::SelectLastTokens() {
 #if USE_DML
-    // DML doesn't support on-device scoring yet, so we need to download some data to the CPU
-    if (model_.device_type_ == DeviceType::DML) {
-      value32_cpu_ = OrtValue::CreateTensor<float>(model_.allocator_cpu_, shape_);
-    }
+  if (model_.device_type_ == DeviceType::DML) {
+    SelectLastTokensDml();
+    return;
+  }
 #endif
 
-    size_t vocab_index = 0;  // Simpler math to have this index go up by vocab_size for every logit chunk we process
-
-    const auto* input_ids = state_.params_->input_ids.data();
-    for (int batch_index = 0; batch_index < state_.params_->batch_size; batch_index++) {
-      // Find the first non pad token from the end
-      size_t token_index = seq_length;
-      while (token_index-- > 0) {
-        if (input_ids[token_index] != state_.params_->pad_token_id)
+  const size_t seq_length = shape_[1];
+  const size_t vocab_size = shape_[2];
+  const size_t num_beams = state_.params_->search.num_beams;
+  const size_t row_bytes = vocab_size * SizeOf(type_);
+
+  auto& value = type_ == Ort::TypeToTensorType<float>::type ? value32_ : value16_;
+  auto* sb_logits = type_ == Ort::TypeToTensorType<float>::type ? sb_logits32_ : sb_logits16_;
+
+  shape_[1] = 1;
+  auto value_next = !sb_logits ? OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_)
+                               : sb_logits->CreateTensorOnStaticBuffer(shape_, type_);
+
+  const auto* source_data = reinterpret_cast<const uint8_t*>(value->GetTensorRawData());
+  auto* target_data = reinterpret_cast<uint8_t*>(value_next->GetTensorMutableRawData());
+
+  size_t row_index = 0;  // Row of value_next, goes up by one for every beam of every batch entry
+  auto last_tokens = GetLastTokenIndices();
+  for (auto token_index : last_tokens) {
+    for (size_t beam_index = 0; beam_index < num_beams; beam_index++, row_index++) {
+      size_t source_offset = (row_index * seq_length + static_cast<size_t>(token_index)) * row_bytes;
+      size_t target_offset = row_index * row_bytes;
+
+      switch (model_.device_type_) {
+        case DeviceType::ROCM:
+        case DeviceType::CPU:
+          memcpy(target_data + target_offset, source_data + source_offset, row_bytes);
           break;
-      }
 
-      for (int beam_index = 0; beam_index < num_beams; beam_index++) {
-        switch (model_.device_type_) {
-#if USE_DML
-          case DeviceType::DML: {
-            ComPtr<ID3D12Resource> source_resource;
-            Ort::ThrowOnError(model_.GetOrtDmlApi()->GetD3D12ResourceFromAllocation(model_.allocator_device_, value32_->GetTensorMutableRawData(), &source_resource));
-
-            ComPtr<ID3D12Resource> target_resource;
-            Ort::ThrowOnError(model_.GetOrtDmlApi()->GetD3D12ResourceFromAllocation(model_.allocator_device_, value_next->GetTensorMutableRawData(), &target_resource));
-
-            uint64_t source_offset = (vocab_index * seq_length + token_index * vocab_size) * sizeof(float);
-            uint64_t target_offset = vocab_index * sizeof(float);
-            uint64_t size_in_bytes = vocab_size * sizeof(float);
-
-            model_.GetDmlExecutionContext()->CopyBufferRegion(
-                target_resource.Get(),
-                target_offset,
-                D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
-                source_resource.Get(),
-                source_offset,
-                D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
-                size_in_bytes);
-          } break;
-#endif
-
-          case DeviceType::CPU:
-          case DeviceType::CUDA: {
-            auto logits = std::span<float>{value32_->GetTensorMutableData<float>(), element_count};
-            auto logits_next = gpu_span<float>{value_next->GetTensorMutableData<float>(), element_count};
-            auto target = logits_next.subspan(vocab_index, vocab_size);
-            std::span<const float> source = logits.subspan(vocab_index * seq_length + token_index * vocab_size, vocab_size);
-            if (model_.device_type_ == DeviceType::CUDA)
+        case DeviceType::CUDA:
 #if USE_CUDA
-              CudaCheck() == cudaMemcpyAsync(target.data(), source.data(), source.size_bytes(), cudaMemcpyDeviceToDevice, state_.params_->cuda_stream);
+          CudaCheck() == cudaMemcpyAsync(target_data + target_offset, source_data + source_offset, row_bytes, cudaMemcpyDeviceToDevice, model_.cuda_stream_);
 #else
-              throw std::runtime_error("Unexpected CUDA device usage");
+          throw std::runtime_error("Unexpected CUDA device usage");
 #endif
-            else
-              copy(source, target);
-          } break;
-        }
-
-        vocab_index += vocab_size;
+          break;
       }
-
-      input_ids += seq_length;
     }
+  }
+
+  value = std::move(value_next);
+  state_.outputs_[output_index_] = value.get();
+}
 
-    value32_ = std::move(value_next);
-    if (type_ == Ort::TypeToTensorType<Ort::Float16_t>::type)
-      value16_ = !sb_logits16_ ? OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_)
-                               : sb_logits16_->CreateTensorOnStaticBuffer(shape_, type_);
+// Every eos token counts as the primary one, which is what HandleEOSArray does to the logits
+static void HandleEOSTokens(const Model& model, std::span<int32_t> tokens) {
+  auto& eos_token_ids = model.config_->model.eos_token_ids;
+  for (auto& token : tokens) {
+    if (std::find(eos_token_ids.begin(), eos_token_ids.end(), token) != eos_token_ids.end())
+      token = model.config_->model.eos_token_id;
+  }
+}
+
+void Logits::Update() {
+  if (!has_next_tokens_)
+    return;
+
+  next_tokens_bound_ = state_.top_tokens_on_device_;
+  if (next_tokens_bound_) {
+    std::vector<int64_t> tokens_shape{shape_[0], shape_[1]};
+    if (!next_tokens_ || next_tokens_->GetTensorTypeAndShapeInfo()->GetShape() != tokens_shape)
+      next_tokens_ = OrtValue::CreateTensor<int32_t>(model_.allocator_cpu_, tokens_shape);
+    state_.output_names_[output_index_] = model_.config_->model.decoder.outputs.next_tokens.c_str();
+    state_.outputs_[output_index_] = next_tokens_.get();
+  } else {
+    state_.output_names_[output_index_] = model_.config_->model.decoder.outputs.logits.c_str();
     state_.outputs_[output_index_] = type_ == Ort::TypeToTensorType<float>::type ? value32_.get() : value16_.get();
-    element_count = shape_[0] * shape_[2];  // shape_[1] is now 1, so the element count must be updated
+  }
+}
+
+void Logits::SelectTopTokens() {
+  const size_t seq_length = shape_[1];
+  const auto* tokens = next_tokens_->GetTensorData<int32_t>();
+  auto last_tokens = seq_length == 1 ? std::vector<int32_t>(shape_[0]) : GetLastTokenIndices();
+
+  // Greedy search has a single beam, rows left out by KeepRows are finished and never read
+  top_tokens_cpu_.assign(state_.params_->batch_size, 0);
+  for (size_t i = 0; i < static_cast<size_t>(shape_[0]); i++)
+    top_tokens_cpu_[rows_.empty() ? i : rows_[i]] = tokens[i * seq_length + last_tokens[i]];
+  HandleEOSTokens(model_, top_tokens_cpu_);
+  state_.top_tokens_ = cpu_span<int32_t>{top_tokens_cpu_};
+
+  if (seq_length != 1) {
+    // As after SelectLastTokens, the runs after the prompt output a single token per row
+    shape_[1] = 1;
+    auto& value = type_ == Ort::TypeToTensorType<float>::type ? value32_ : value16_;
+    value = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
+  }
+}
+
+RoamingArray<float> Logits::Get() {
+  if (shape_[1] != 1 && !next_tokens_bound_)
+    SelectLastTokens();
+  else if (reset_last_token_indices_) {
+    // Every run after the prompt has a single token per row, so it's always the one at index 0
+    auto bytes = last_token_indices_->GetTensorTypeAndShapeInfo()->GetElementCount() * SizeOf(last_token_indices_->GetTensorTypeAndShapeInfo()->GetElementType());
+#if USE_CUDA
+    if (model_.device_type_ == DeviceType::CUDA)
+      CudaCheck() == cudaMemsetAsync(last_token_indices_->GetTensorMutableRawData(), 0, bytes, model_.cuda_stream_);
+    else
+#endif
+      memset(last_token_indices_->GetTensorMutableRawData(), 0, bytes);
+    reset_last_token_indices_ = false;
+  }
+
+  if (next_tokens_bound_) {
+    SelectTopTokens();
+    return cpu_span<float>{};
   }
 
   assert(shape_[1] == 1);
+  size_t element_count = shape_[0] * shape_[2];
+
+#if USE_CUDA
+  // The greedy and sampling kernels read fp16 logits themselves, so they're left as they are (see State::logits16_)
+  if (type_ == Ort::TypeToTensorType<Ort::Float16_t>::type && model_.device_type_ == DeviceType::CUDA && rows_.empty() &&
+      (state_.greedy_step_on_device_ || state_.sample_step_on_device_)) {
+    auto* logits16 = value16_->GetTensorMutableData<uint16_t>();
+    if (cuda_eos_token_ids_ptr_ && !state_.greedy_step_folds_eos_)
+      cuda::LaunchHandleEOSArray(logits16, static_cast<int>(shape_[0]) /* batch_beam_size*/, static_cast<int>(shape_[2]) /* vocab_size */, cuda_eos_token_ids_.data(), static_cast<int>(cuda_eos_token_ids_.size()), model_.cuda_stream_);
+    state_.logits16_ = gpu_span<uint16_t>{logits16, element_count};
+    return gpu_span<float>{};
+  }
+#endif
+
+  // Convert from float16 to float32 if necessary
+  if (type_ == Ort::TypeToTensorType<Ort::Float16_t>::type && !gathered_fp32_) {
+#if USE_DML
+    if (model_.device_type_ == DeviceType::DML) {
+      DmlHelpers::DmlCastInputToOutput(
+          model_.GetDmlExecutionContext(),
+          *model_.allocator_device_,
+          *value16_,
+          value32_,
+          model_.GetDmlDevice(),
+          model_.GetOrtDmlApi(),
+          logits_cast_command_list_state_);
+    } else
+#endif
+    if (OnHost(model_.device_type_) && converted_count_ == element_count) {
+      // Same shape as the last step, so convert into the same buffer without looking up the tensor shapes
+      FastFloat16ToFloat32(value16_->GetTensorData<uint16_t>(), value32_->GetTensorMutableData<float>(), element_count);
+    } else {
+      ConvertFp16ToFp32(*model_.allocator_device_, *value16_, value32_, model_.device_type_, model_.cuda_stream_);
+      converted_count_ = OnHost(model_.device_type_) ? element_count : 0;
+    }
+  }
+  gathered_fp32_ = false;
 
 #if USE_CUDA
   if (model_.device_type_ == DeviceType::CUDA) {
     auto batched_logits_gpu = gpu_span<float>{value32_->GetTensorMutableData<float>(), element_count};
-    if (cuda_eos_token_ids_ptr_)
+    if (cuda_eos_token_ids_ptr_ && !state_.greedy_step_folds_eos_)
       cuda::LaunchHandleEOSArray(batched_logits_gpu.data(), static_cast<int>(shape_[0]) /* batch_beam_size*/, static_cast<int>(shape_[2]) /* vocab_size */, cuda_eos_token_ids_.data(), static_cast<int>(cuda_eos_token_ids_.size()), model_.cuda_stream_);
+    if (!rows_.empty())
+      return gpu_span<float>{ScatterRows(batched_logits_gpu.data()), static_cast<size_t>(state_.params_->batch_size) * shape_[2]};
     return batched_logits_gpu;
   }
 #elif USE_DML
   if (model_.device_type_ == DeviceType::DML) {
-    // DML doesn't support on-device scoring yet, so we transfer the data to the CPU
+    if (state_.top_tokens_on_device_) {
+      SelectTopTokensDml();
+      return cpu_span<float>{};
+    }
+
+    // Sampling and logits processing are done on the CPU, so we transfer the data to the CPU
     ComPtr<ID3D12Resource> gpu_resource;
     Ort::ThrowOnError(model_.GetOrtDmlApi()->GetD3D12ResourceFromAllocation(model_.allocator_device_, value32_->GetTensorMutableRawData(), &gpu_resource));
     auto cpu_tensor = value32_cpu_->GetTensorMutableData<float>();
@@ -167,15 +279,162 @@ RoamingArray<float> Logits::Get() {
         gpu_resource.Get(),
         0,
         D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+    g_transfer_counters.device_to_host_bytes += element_count * sizeof(float);
 
     auto batched_logits_cpu = cpu_span<float>{cpu_tensor, element_count};
-    HandleEOSArray(batched_logits_cpu);
+    if (!state_.greedy_step_folds_eos_)
+      HandleEOSArray(batched_logits_cpu);
     return batched_logits_cpu;
   }
 #endif
 
   auto batched_logits_cpu = cpu_span<float>{value32_->GetTensorMutableData<float>(), element_count};
-  HandleEOSArray(batched_logits_cpu);
+  if (!state_.greedy_step_folds_eos_)
+    HandleEOSArray(batched_logits_cpu);
+  if (!rows_.empty())
+    return cpu_span<float>{ScatterRows(batched_logits_cpu.data()), static_cast<size_t>(state_.params_->batch_size) * shape_[2]};
+  return batched_logits_cpu;
+}
+
+#if USE_DML
+void Logits::SelectLastTokensDml() {
+  const auto row_count = static_cast<uint32_t>(shape_[0]);
+  const auto seq_length = static_cast<uint32_t>(shape_[1]);
+  const size_t num_beams = state_.params_->search.num_beams;
+
+  std::vector<int32_t> indices;  // Of every beam row
+  indices.reserve(row_count);
+  for (auto token_index : GetLastTokenIndices())
+    indices.insert(indices.end(), num_beams, token_index);
+
+  gather_indices_ = OrtValue::CreateTensor<int32_t>(*model_.allocator_device_, std::array<int64_t, 1>{shape_[0]});
+  ComPtr<ID3D12Resource> indices_resource;
+  Ort::ThrowOnError(model_.GetOrtDmlApi()->GetD3D12ResourceFromAllocation(model_.allocator_device_, gather_indices_->GetTensorMutableRawData(), &indices_resource));
+  model_.GetDmlUploadHeap()->BeginUploadToGpu(
+      indices_resource.Get(),
+      0,
+      D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+      std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(indices.data()), indices.size() * sizeof(int32_t)));
+
+  auto& value = type_ == Ort::TypeToTensorType<float>::type ? value32_ : value16_;
+  shape_[1] = 1;
+  auto gathered = type_ == Ort::TypeToTensorType<float>::type && sb_logits32_ ? sb_logits32_->CreateTensorOnStaticBuffer(shape_, type_)
+                                                                              : OrtValue::CreateTensor<float>(*model_.allocator_device_, shape_);
+
+  ComPtr<ID3D12Resource> logits_resource;
+  Ort::ThrowOnError(model_.GetOrtDmlApi()->GetD3D12ResourceFromAllocation(model_.allocator_device_, value->GetTensorMutableRawData(), &logits_resource));
+  ComPtr<ID3D12Resource> gathered_resource;
+  Ort::ThrowOnError(model_.GetOrtDmlApi()->GetD3D12ResourceFromAllocation(model_.allocator_device_, gathered->GetTensorMutableRawData(), &gathered_resource));
+
+  dml_gather_kernel_.emplace(model_.GetD3D12Device(), model_.GetDmlExecutionContext(), row_count, seq_length, static_cast<uint32_t>(shape_[2]),
+                             model_.GetDmlGatherLastTokensPipeline(type_), logits_resource.Get(), indices_resource.Get(), gathered_resource.Get());
+  ComPtr<ID3D12Fence> fence;
+  uint64_t completion_value;
+  model_.GetDmlExecutionContext()->ExecuteCommandList(dml_gather_kernel_->GetCommandList(), &fence, &completion_value);
+
+  // The runs after the prompt output a single token per row, into value16_ for fp16 logits
+  value32_ = std::move(gathered);
+  if (type_ == Ort::TypeToTensorType<Ort::Float16_t>::type) {
+    value16_ = sb_logits16_ ? sb_logits16_->CreateTensorOnStaticBuffer(shape_, type_) : OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
+    gathered_fp32_ = true;
+  }
+  state_.outputs_[output_index_] = value.get();
+}
+
+void Logits::SelectTopTokensDml() {
+  const auto row_count = static_cast<uint32_t>(shape_[0]);
+  if (!top_tokens_) {
+    top_tokens_ = OrtValue::CreateTensor<int32_t>(*model_.allocator_device_, std::array<int64_t, 1>{shape_[0]});
+    top_tokens_cpu_.resize(row_count);
+  }
+
+  ComPtr<ID3D12Resource> logits_resource;
+  Ort::ThrowOnError(model_.GetOrtDmlApi()->GetD3D12ResourceFromAllocation(model_.allocator_device_, value32_->GetTensorMutableRawData(), &logits_resource));
+  ComPtr<ID3D12Resource> tokens_resource;
+  Ort::ThrowOnError(model_.GetOrtDmlApi()->GetD3D12ResourceFromAllocation(model_.allocator_device_, top_tokens_->GetTensorMutableRawData(), &tokens_resource));
+
+  // The command list is recorded for one logits tensor, which only changes after the prompt or with fp16 logits
+  if (!dml_argmax_kernel_ || dml_argmax_kernel_->GetLogitsResource() != logits_resource.Get())
+    dml_argmax_kernel_.emplace(model_.GetD3D12Device(), model_.GetDmlExecutionContext(), row_count, static_cast<uint32_t>(shape_[2]),
+                               logits_resource.Get(), tokens_resource.Get());
+
+  ComPtr<ID3D12Fence> fence;
+  uint64_t completion_value;
+  model_.GetDmlExecutionContext()->ExecuteCommandList(dml_argmax_kernel_->GetCommandList(), &fence, &completion_value);
+
+  model_.GetDmlReadbackHeap()->ReadbackFromGpu(
+      std::span(reinterpret_cast<uint8_t*>(top_tokens_cpu_.data()), top_tokens_cpu_.size() * sizeof(int32_t)),
+      tokens_resource.Get(),
+      0,
+      D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+  g_transfer_counters.device_to_host_bytes += top_tokens_cpu_.size() * sizeof(int32_t);
+
+  HandleEOSTokens(model_, top_tokens_cpu_);
+  state_.top_tokens_ = cpu_span<int32_t>{top_tokens_cpu_};
+}
+#endif
+
+void Logits::KeepRows(std::span<const int32_t> rows) {
+  if (!batch_logits_) {
+    // The rows that are left out aren't sampled from anymore, zeros just keep the search's math on them finite
+    std::array<int64_t, 3> batch_shape{state_.params_->batch_size, 1, shape_[2]};
+    batch_logits_ = OrtValue::CreateTensor<float>(*model_.allocator_device_, batch_shape);
+    size_t bytes = batch_shape[0] * batch_shape[2] * sizeof(float);
+#if USE_CUDA
+    if (model_.device_type_ == DeviceType::CUDA)
+      cudaMemsetAsync(batch_logits_->GetTensorMutableRawData(), 0, bytes, model_.cuda_stream_);
+    else
+#endif
+      memset(batch_logits_->GetTensorMutableRawData(), 0, bytes);
+  }
+
+  rows_.assign(rows.begin(), rows.end());
+  shape_[0] = static_cast<int64_t>(rows.size());
+
+  auto& value = type_ == Ort::TypeToTensorType<float>::type ? value32_ : value16_;
+  auto* sb_logits = type_ == Ort::TypeToTensorType<float>::type ? sb_logits32_ : sb_logits16_;
+  value = !sb_logits ? OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_)
+                     : sb_logits->CreateTensorOnStaticBuffer(shape_, type_);
+  state_.outputs_[output_index_] = value.get();
+}
+
+float* Logits::ScatterRows(const float* logits) {
+  const size_t row_bytes = shape_[2] * sizeof(float);
+  auto* batch_logits = batch_logits_->GetTensorMutableData<float>();
+  for (size_t i = 0; i < rows_.size(); i++) {
+    auto* target = batch_logits + rows_[i] * shape_[2];
+#if USE_CUDA
+    if (model_.device_type_ == DeviceType::CUDA)
+      cudaMemcpyAsync(target, logits + i * shape_[2], row_bytes, cudaMemcpyDeviceToDevice, model_.cuda_stream_);
+    else
+#endif
+      memcpy(target, logits + i * shape_[2], row_bytes);
+  }
+  return batch_logits;
+}
+
+RoamingArray<float> Logits::GetAllPositions(bool handle_eos) {
+  size_t element_count = shape_[0] * shape_[1] * shape_[2];
+
+  if (type_ == Ort::TypeToTensorType<Ort::Float16_t>::type) {
+    ConvertFp16ToFp32(*model_.allocator_device_, *value16_, value32_, model_.device_type_, model_.cuda_stream_);
+    converted_count_ = 0;  // value32_ has every position now
+  }
+
+#if USE_CUDA
+  if (model_.device_type_ == DeviceType::CUDA) {
+    auto batched_logits_gpu = gpu_span<float>{value32_->GetTensorMutableData<float>(), element_count};
+    if (cuda_eos_token_ids_ptr_ && handle_eos)
+      cuda::LaunchHandleEOSArray(batched_logits_gpu.data(), static_cast<int>(shape_[0] * shape_[1]) /* every position */, static_cast<int>(shape_[2]) /* vocab_size */, cuda_eos_token_ids_.data(), static_cast<int>(cuda_eos_token_ids_.size()), model_.cuda_stream_);
+    return batched_logits_gpu;
+  }
+#endif
+  if (!OnHost(model_.device_type_))
+    throw std::runtime_error("Logits of every position are only available on CPU and CUDA");
+
+  auto batched_logits_cpu = cpu_span<float>{value32_->GetTensorMutableData<float>(), element_count};
+  if (handle_eos)
+    HandleEOSArray(batched_logits_cpu);
   return batched_logits_cpu;
 }
 
@@ -186,7 +445,7 @@ void Logits::HandleEOSArray(cpu_span<float> batched_logits) {
   const size_t vocab_size = shape_[2];
   size_t vocab_index = 0;  // Simpler math to have this index go up by vocab_size for every logit chunk we process
 
-  for (int index = 0; index < shape_[0]; index++) {
+  for (size_t index = 0; index < batched_logits.size() / vocab_size; index++) {
     auto logits = batched_logits.subspan(vocab_index, vocab_size);
     float max = std::numeric_limits<float>::lowest();
     for (auto id : model_.config_->model.eos_token_ids) {
@@ -204,6 +463,12 @@ void Logits::Add() {
 
   state_.output_names_.push_back(model_.config_->model.decoder.outputs.logits.c_str());
   state_.outputs_.push_back(type_ == Ort::TypeToTensorType<float>::type ? value32_.get() : value16_.get());
+
+  if (last_token_indices_) {
+    state_.input_names_.push_back(model_.config_->model.decoder.inputs.last_token_indices.c_str());
+    state_.inputs_.push_back(last_token_indices_.get());
+    reset_last_token_indices_ = true;
+  }
 }
 
 }  // namespace Generators
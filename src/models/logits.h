@@ -4,16 +4,34 @@
 
 #include "static_buffer.h"
 
+#if USE_DML
+#include "../dml/dml_argmax_kernel.h"
+#include "../dml/dml_gather_last_tokens_kernel.h"
+#endif
+
 namespace Generators {
 
 struct Logits {
   Logits(const Model& model, State& state);
 
   void Add();
+  // Before a run: binds the model's next_tokens output in place of the logits when the step only takes their argmax
+  // (State::top_tokens_on_device_), Get() then returns the tokens in State::top_tokens_
+  void Update();
   RoamingArray<float> Get();
+  // First run only: the {batch_beams, sequence_length, vocab_size} logits of every input position, CPU and CUDA only.
+  // Without handle_eos the extra eos tokens aren't folded into the primary one.
+  RoamingArray<float> GetAllPositions(bool handle_eos = true);
+  // Compacting finished rows: the model only computes the logits of these batch rows from now on, Get() still returns
+  // the logits of the whole batch with these rows filled in
+  void KeepRows(std::span<const int32_t> rows);
 
  private:
+  std::vector<int32_t> GetLastTokenIndices() const;  // Per batch row, the position of its last non pad prompt token
+  void SelectLastTokens();
   void HandleEOSArray(cpu_span<float> logits);
+  float* ScatterRows(const float* logits);  // Copies the kept rows to their place in batch_logits_
+  void SelectTopTokens();                   // The last token of every row from next_tokens_ into State::top_tokens_
 
   const Model& model_;
   State& state_;
@@ -23,6 +41,22 @@ struct Logits {
   ONNXTensorElementDataType type_;
   std::unique_ptr<OrtValue> value32_;  // Always fp32 values
   std::unique_ptr<OrtValue> value16_;  // When model output is fp16
+  bool gathered_fp32_{};               // value32_ already has this step's logits, set by SelectLastTokensDml
+  size_t converted_count_{};           // CPU: the element count of value32_ once it holds converted value16_ logits
+
+  // When the model has a last_token_indices input it only computes the logits of these positions, so the prompt run
+  // already produces {batch_beams, 1, vocab_size}. After the prompt they're all 0, as there's a single input token.
+  std::unique_ptr<OrtValue> last_token_indices_;
+  bool reset_last_token_indices_{};
+
+  std::vector<int32_t> rows_;  // Empty while every batch row is run
+  std::vector<int32_t> top_tokens_cpu_;  // State::top_tokens_ when they're picked on the device or in the graph
+
+  // CPU models with an in-graph argmax: int32 {batch_beams, sequence_length}, bound instead of the logits by Update
+  bool has_next_tokens_{};
+  bool next_tokens_bound_{};
+  std::unique_ptr<OrtValue> next_tokens_;
+  std::unique_ptr<OrtValue> batch_logits_;
 
   // Used for decoding runs with cuda graphs.
   StaticBuffer* sb_logits32_{};
@@ -36,6 +70,16 @@ struct Logits {
 #if USE_DML
   DmlReusedCommandListState logits_cast_command_list_state_{};
   std::unique_ptr<OrtValue> value32_cpu_;
+
+  // The prompt's last token rows gathered and cast to fp32 in one dispatch, value32_ then has this step's logits
+  void SelectLastTokensDml();
+  std::optional<DmlGatherLastTokensKernel> dml_gather_kernel_;  // Kept until its command list has run
+  std::unique_ptr<OrtValue> gather_indices_;
+
+  // State::top_tokens_on_device_, the top token of every row is picked where the logits are
+  void SelectTopTokensDml();
+  std::optional<DmlArgMaxKernel> dml_argmax_kernel_;
+  std::unique_ptr<OrtValue> top_tokens_;  // int32 {batch_beams} on the device
 #endif
 };
 
@@ -0,0 +1,211 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include "../generators.h"
+#include "mapped_file.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Generators {
+
+#ifdef _WIN32
+MappedFile::MappedFile(const fs::path& path) {
+  HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    throw std::runtime_error("Failed to open " + path.string() + " for mapping");
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+    CloseHandle(file);
+    throw std::runtime_error("Failed to map " + path.string() + ", it's empty or unreadable");
+  }
+  size_ = static_cast<size_t>(size.QuadPart);
+
+  mapping_ = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  CloseHandle(file);  // The mapping keeps the file open
+  if (mapping_)
+    data_ = MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+  if (!data_) {
+    if (mapping_)
+      CloseHandle(mapping_);
+    throw std::runtime_error("Failed to map " + path.string());
+  }
+}
+
+MappedFile::~MappedFile() {
+  UnmapViewOfFile(data_);
+  CloseHandle(mapping_);
+}
+#else
+MappedFile::MappedFile(const fs::path& path) {
+  int file = open(path.c_str(), O_RDONLY);
+  if (file == -1)
+    throw std::runtime_error("Failed to open " + path.string() + " for mapping");
+
+  struct stat info;
+  if (fstat(file, &info) != 0 || info.st_size == 0) {
+    close(file);
+    throw std::runtime_error("Failed to map " + path.string() + ", it's empty or unreadable");
+  }
+  size_ = static_cast<size_t>(info.st_size);
+
+  data_ = mmap(nullptr, size_, PROT_READ, MAP_SHARED, file, 0);
+  close(file);  // The mapping keeps the file open
+  if (data_ == MAP_FAILED) {
+    data_ = nullptr;
+    throw std::runtime_error("Failed to map " + path.string());
+  }
+}
+
+MappedFile::~MappedFile() {
+  munmap(data_, size_);
+}
+#endif
+
+namespace {
+
+// Just enough of the protobuf wire format to walk the messages of onnx.proto down to the external data of tensors
+struct ProtoReader {
+  explicit ProtoReader(std::span<const uint8_t> data) : data_{data} {}
+
+  // The next field of the message, false at its end
+  bool Next(uint32_t& field, uint32_t& wire_type) {
+    if (pos_ == data_.size())
+      return false;
+    auto tag = Varint();
+    field = static_cast<uint32_t>(tag >> 3);
+    wire_type = static_cast<uint32_t>(tag & 7);
+    return true;
+  }
+
+  std::span<const uint8_t> Bytes() {
+    auto size = Varint();
+    if (size > data_.size() - pos_)
+      Fail();
+    auto bytes = data_.subspan(pos_, static_cast<size_t>(size));
+    pos_ += static_cast<size_t>(size);
+    return bytes;
+  }
+
+  void Skip(uint32_t wire_type) {
+    switch (wire_type) {
+      case 0:
+        Varint();
+        break;
+      case 1:
+        Advance(8);
+        break;
+      case 2:
+        Bytes();
+        break;
+      case 5:
+        Advance(4);
+        break;
+      default:
+        Fail();
+    }
+  }
+
+ private:
+  [[noreturn]] static void Fail() { throw std::runtime_error("The model file isn't a valid ONNX model"); }
+
+  uint64_t Varint() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (pos_ == data_.size())
+        Fail();
+      uint8_t byte = data_[pos_++];
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+        return value;
+    }
+    Fail();
+  }
+
+  void Advance(size_t bytes) {
+    if (bytes > data_.size() - pos_)
+      Fail();
+    pos_ += bytes;
+  }
+
+  std::span<const uint8_t> data_;
+  size_t pos_{};
+};
+
+// Field numbers of onnx.proto
+constexpr uint32_t ModelProto_graph = 7;
+constexpr uint32_t GraphProto_node = 1, GraphProto_initializer = 5, GraphProto_sparse_initializer = 15;
+constexpr uint32_t NodeProto_attribute = 5;
+constexpr uint32_t AttributeProto_g = 6, AttributeProto_graphs = 11;
+constexpr uint32_t SparseTensorProto_values = 1, SparseTensorProto_indices = 2;
+constexpr uint32_t TensorProto_external_data = 13;
+constexpr uint32_t StringStringEntryProto_key = 1, StringStringEntryProto_value = 2;
+
+void AddTensorLocation(std::span<const uint8_t> tensor, std::vector<std::string>& locations) {
+  ProtoReader reader{tensor};
+  uint32_t field, wire_type;
+  while (reader.Next(field, wire_type)) {
+    if (field != TensorProto_external_data || wire_type != 2) {
+      reader.Skip(wire_type);
+      continue;
+    }
+    ProtoReader entry{reader.Bytes()};
+    std::string key, value;
+    while (entry.Next(field, wire_type)) {
+      if ((field == StringStringEntryProto_key || field == StringStringEntryProto_value) && wire_type == 2) {
+        auto bytes = entry.Bytes();
+        (field == StringStringEntryProto_key ? key : value).assign(bytes.begin(), bytes.end());
+      } else
+        entry.Skip(wire_type);
+    }
+    if (key == "location" && std::find(locations.begin(), locations.end(), value) == locations.end())
+      locations.push_back(std::move(value));
+  }
+}
+
+void AddGraphLocations(std::span<const uint8_t> graph, std::vector<std::string>& locations);
+
+// The messages holding tensors and subgraphs, by field of the message they're in
+void AddMessageLocations(std::span<const uint8_t> message, std::vector<std::string>& locations,
+                         std::initializer_list<std::pair<uint32_t, void (*)(std::span<const uint8_t>, std::vector<std::string>&)>> fields) {
+  ProtoReader reader{message};
+  uint32_t field, wire_type;
+  while (reader.Next(field, wire_type)) {
+    auto it = std::find_if(fields.begin(), fields.end(), [field](auto& entry) { return entry.first == field; });
+    if (it == fields.end() || wire_type != 2) {
+      reader.Skip(wire_type);
+      continue;
+    }
+    it->second(reader.Bytes(), locations);
+  }
+}
+
+void AddSparseTensorLocations(std::span<const uint8_t> sparse_tensor, std::vector<std::string>& locations) {
+  AddMessageLocations(sparse_tensor, locations, {{SparseTensorProto_values, AddTensorLocation}, {SparseTensorProto_indices, AddTensorLocation}});
+}
+
+void AddAttributeLocations(std::span<const uint8_t> attribute, std::vector<std::string>& locations) {
+  AddMessageLocations(attribute, locations, {{AttributeProto_g, AddGraphLocations}, {AttributeProto_graphs, AddGraphLocations}});
+}
+
+void AddNodeLocations(std::span<const uint8_t> node, std::vector<std::string>& locations) {
+  AddMessageLocations(node, locations, {{NodeProto_attribute, AddAttributeLocations}});
+}
+
+void AddGraphLocations(std::span<const uint8_t> graph, std::vector<std::string>& locations) {
+  AddMessageLocations(graph, locations, {{GraphProto_node, AddNodeLocations}, {GraphProto_initializer, AddTensorLocation}, {GraphProto_sparse_initializer, AddSparseTensorLocations}});
+}
+
+}  // namespace
+
+std::vector<std::string> GetExternalDataLocations(std::span<const uint8_t> model) {
+  std::vector<std::string> locations;
+  AddMessageLocations(model, locations, {{ModelProto_graph, AddGraphLocations}});
+  return locations;
+}
+
+}  // namespace Generators
@@ -0,0 +1,31 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+namespace Generators {
+
+// A read only memory mapping of a whole file. The pages come from the OS file cache, so every process mapping the same
+// file shares one copy of them, and they're only read in as they're touched.
+struct MappedFile {
+  MappedFile(const fs::path& path);
+  ~MappedFile();
+
+  const void* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  MappedFile(const MappedFile&) = delete;
+  void operator=(const MappedFile&) = delete;
+
+  void* data_{};
+  size_t size_{};
+#ifdef _WIN32
+  HANDLE mapping_{};
+#endif
+};
+
+// The external data files an ONNX model's initializers refer to, relative to the model's directory, each once. Reads
+// the serialized ModelProto directly, including the initializers of subgraphs.
+std::vector<std::string> GetExternalDataLocations(std::span<const uint8_t> model);
+
+}  // namespace Generators
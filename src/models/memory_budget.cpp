@@ -0,0 +1,45 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include "../generators.h"
+#include "memory_budget.h"
+
+namespace Generators {
+
+GeneratorMemory& GeneratorMemory::operator+=(const GeneratorMemory& other) {
+  kv_cache += other.kv_cache;
+  logits += other.logits;
+  static_buffers += other.static_buffers;
+  return *this;
+}
+
+GeneratorMemory& GeneratorMemory::operator-=(const GeneratorMemory& other) {
+  kv_cache -= other.kv_cache;
+  logits -= other.logits;
+  static_buffers -= other.static_buffers;
+  return *this;
+}
+
+GeneratorMemory MemoryBudget::Used() const {
+  std::lock_guard lock(mutex_);
+  return used_;
+}
+
+bool MemoryBudget::Fits(const GeneratorMemory& memory) const {
+  std::lock_guard lock(mutex_);
+  return bytes_ == 0 || used_.Total() + memory.Total() <= bytes_;
+}
+
+void MemoryBudget::Reserve(const GeneratorMemory& memory) {
+  std::lock_guard lock(mutex_);
+  if (bytes_ != 0 && used_.Total() + memory.Total() > bytes_)
+    throw MemoryExhausted("The generator needs an estimated " + std::to_string(memory.Total()) + " bytes of device memory, but " +
+                          std::to_string(used_.Total()) + " of the memory_budget_mb of " + std::to_string(bytes_) + " bytes are in use");
+  used_ += memory;
+}
+
+void MemoryBudget::Release(const GeneratorMemory& memory) {
+  std::lock_guard lock(mutex_);
+  used_ -= memory;
+}
+
+}  // namespace Generators
@@ -0,0 +1,60 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+#include <mutex>
+#include <stdexcept>
+
+namespace Generators {
+
+// Device memory of a generator, estimated from its params before anything is allocated (see Model::EstimateMemory)
+struct GeneratorMemory {
+  size_t kv_cache{};        // Pasts and presents at max_length
+  size_t logits{};          // The prompt's logits, the largest ones
+  size_t static_buffers{};  // Graph capture: the other inputs sized for max_batch_size
+  size_t Total() const { return kv_cache + logits + static_buffers; }
+
+  GeneratorMemory& operator+=(const GeneratorMemory& other);
+  GeneratorMemory& operator-=(const GeneratorMemory& other);
+};
+
+// Thrown when a generator doesn't fit next to the live ones, in the memory budget or in the kv block pool. It may fit
+// once others go away, unlike the other errors of creating a generator.
+struct MemoryExhausted : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+// Model wide accounting of the memory estimated for the live generators. With model.decoder.memory_budget_mb a
+// generator that doesn't fit next to the others is rejected when it's created, and the Scheduler keeps requests queued
+// until their cohort fits. Without it nothing is rejected, the accounting is only reported.
+struct MemoryBudget {
+  explicit MemoryBudget(size_t bytes) : bytes_{bytes} {}
+
+  size_t Bytes() const { return bytes_; }  // 0 means unbounded
+  GeneratorMemory Used() const;
+  bool Fits(const GeneratorMemory& memory) const;
+
+  // Accounts for memory, throws MemoryExhausted if it doesn't fit
+  void Reserve(const GeneratorMemory& memory);
+  void Release(const GeneratorMemory& memory);
+
+ private:
+  size_t bytes_;
+  GeneratorMemory used_;
+  mutable std::mutex mutex_;
+};
+
+// A generator's share of the budget, given back when it goes away
+struct MemoryReservation {
+  MemoryReservation(MemoryBudget& budget, const GeneratorMemory& memory) : budget_{budget}, memory_{memory} { budget_.Reserve(memory_); }
+  ~MemoryReservation() { budget_.Release(memory_); }
+
+  MemoryReservation(const MemoryReservation&) = delete;
+  MemoryReservation& operator=(const MemoryReservation&) = delete;
+
+ private:
+  MemoryBudget& budget_;
+  GeneratorMemory memory_;
+};
+
+}  // namespace Generators
@@ -1,16 +1,24 @@
 // Copyright (c) Microsoft Corporation. All rights reserved.
 // Licensed under the MIT License.
 #include <algorithm>
+#include <future>
+#include <random>
 #include <thread>
 
 #include "../generators.h"
 #include "../search.h"
+#include "../thread_pool.h"
 #include "model.h"
 #include "gpt.h"
 #include "decoder_only.h"
 #include "whisper.h"
+#include "encoder_decoder.h"
 #include "kernels.h"
 #include "multi_modal_vision_model.h"
+#include "offloaded_decoder.h"
+#include "sparse_attention.h"
+#include "rotary_embedding.h"
+#include "numa.h"
 #if USE_DML
 #include <wil/wrl.h>
 #include "dml_provider_factory.h"
@@ -32,25 +40,70 @@ static std::wstring CurrentModulePath() {
 
   return out_path;
 }
+
+// The dml provider options choose the adapter, onnxruntime gets the device and queue made on it
+static DmlAdapterOptions ParseDmlAdapterOptions(const std::vector<Generators::Config::ProviderOption>& options) {
+  DmlAdapterOptions adapter_options;
+  for (auto& option : options) {
+    if (option.first == "performance_preference") {
+      if (option.second == "high_performance")
+        adapter_options.gpu_preference = DXGI_GPU_PREFERENCE_HIGH_PERFORMANCE;
+      else if (option.second == "minimum_power")
+        adapter_options.gpu_preference = DXGI_GPU_PREFERENCE_MINIMUM_POWER;
+      else if (option.second == "default")
+        adapter_options.gpu_preference = DXGI_GPU_PREFERENCE_UNSPECIFIED;
+      else
+        throw std::runtime_error("dml performance_preference must be high_performance, minimum_power or default, not " + option.second);
+    } else if (option.first == "device_id") {
+      adapter_options.device_id = static_cast<uint32_t>(std::stoul(option.second));
+    } else if (option.first == "luid") {
+      // The 64 bit LUID as HighPart:LowPart, each 32 bit half in hex, the way DXGI tools print it
+      auto parse_half = [&](const std::string& half) {
+        size_t end = 0;
+        unsigned long value = 0;
+        try {
+          value = std::stoul(half, &end, 16);
+        } catch (const std::exception&) {
+          end = 0;
+        }
+        if (half.empty() || end != half.size() || value > 0xFFFFFFFF)
+          throw std::runtime_error("dml luid must be HighPart:LowPart in hex, not " + option.second);
+        return static_cast<uint32_t>(value);
+      };
+      const auto separator = option.second.find(':');
+      if (separator == std::string::npos)
+        throw std::runtime_error("dml luid must be HighPart:LowPart in hex, not " + option.second);
+      const uint32_t high_part = parse_half(option.second.substr(0, separator));
+      const uint32_t low_part = parse_half(option.second.substr(separator + 1));
+      adapter_options.luid = LUID{static_cast<DWORD>(low_part), static_cast<LONG>(high_part)};
+    } else if (option.first == "most_memory") {
+      adapter_options.most_memory = option.second == "1";
+    } else {
+      throw std::runtime_error("Unknown dml provider option: " + option.first);
+    }
+  }
+  return adapter_options;
+}
 #endif
 
 namespace Generators {
 
 State::State(const GeneratorParams& params, const Model& model)
     : params_{params.shared_from_this()},
+      run_options_{OrtRunOptions::Create()},
       model_{model} {}
 
-void State::Run(OrtSession& session, OrtRunOptions& run_options, int new_batch_size) {
+void State::Run(OrtSession& session, int new_batch_size) {
   if (first_run_) {
     if (params_->use_cuda_graph) {
-      model_.run_options_->AddConfigEntry("gpu_graph_id", "-1");
+      run_options_->AddConfigEntry("gpu_graph_id", "-1");
     }
     first_run_ = false;
   } else if (params_->use_cuda_graph && new_batch_size != current_batch_size_) {
     assert(GetCapturedGraphInfo() != nullptr);
     current_batch_size_ = new_batch_size;
     auto annotation_id = std::to_string(GetCapturedGraphInfo()->GenerateUniqueAnnotationID(new_batch_size));
-    model_.run_options_->AddConfigEntry("gpu_graph_id", annotation_id.c_str());
+    run_options_->AddConfigEntry("gpu_graph_id", annotation_id.c_str());
   }
 
   if (g_log.enabled && g_log.model_input_values) {
@@ -65,7 +118,20 @@ void State::Run(OrtSession& session, OrtRunOptions& run_options, int new_batch_s
     DumpTensors(stream, outputs_.data(), output_names_.data(), output_names_.size(), false);
   }
 
-  session.Run(&run_options, input_names_.data(), inputs_.data(), input_names_.size(), output_names_.data(), outputs_.data(), output_names_.size());
+  // Between the runs of a step (like prefill chunks) too, so a cancelled generator stops at the next one
+  auto* cancellation = params_->cancellation.get();
+  if (cancellation && cancellation->IsCancelled())
+    throw std::runtime_error("The generator was cancelled");
+  Cancellation::Run cancellable{cancellation, *run_options_};
+
+  TraceScope trace{"session_run"};
+  auto start = std::chrono::steady_clock::now();
+  // ORT allocates the outputs left null, which only a plain run hands back
+  if (std::find(outputs_.begin(), outputs_.end(), nullptr) != outputs_.end())
+    session.Run(run_options_.get(), input_names_.data(), inputs_.data(), input_names_.size(), output_names_.data(), outputs_.data(), output_names_.size());
+  else
+    RunWithBinding(session);
+  session_seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
   if (g_log.enabled && g_log.model_output_values) {
     auto& stream = Log("model_output_values");
@@ -74,6 +140,33 @@ void State::Run(OrtSession& session, OrtRunOptions& run_options, int new_batch_s
   }
 }
 
+// A bound value stays alive until it's unbound, and the kv cache replaces its pasts and presents between runs, so
+// keeping them bound would hold another kv at the peak. Every run binds its values and unbinds them afterwards, which
+// also means a value replaced by one at the same address with another shape can't be left bound at its old shape.
+// Binding a device value is only a reference, the cpu inputs of a device session are copied like the plain Run does.
+void State::RunWithBinding(OrtSession& session) {
+  auto it = std::find_if(bindings_.begin(), bindings_.end(), [&](const Binding& binding) { return binding.session == &session; });
+  if (it == bindings_.end())
+    it = bindings_.insert(bindings_.end(), Binding{&session, OrtIoBinding::Create(session)});
+  auto& io_binding = *it->io_binding;
+
+  auto unbind = [&] {
+    io_binding.ClearBoundInputs();
+    io_binding.ClearBoundOutputs();
+  };
+  try {
+    for (size_t i = 0; i < inputs_.size(); i++)
+      io_binding.BindInput(input_names_[i], *inputs_[i]);
+    for (size_t i = 0; i < outputs_.size(); i++)
+      io_binding.BindOutput(output_names_[i], *outputs_[i]);
+    session.Run(run_options_.get(), io_binding);
+  } catch (...) {
+    unbind();
+    throw;
+  }
+  unbind();
+}
+
 OrtValue* State::GetOutput(const char* name) {
   for (size_t i = 0; i < output_names_.size(); i++) {
     if (std::strcmp(output_names_[i], name) == 0) {
@@ -90,9 +183,7 @@ void State::ClearIO() {
   outputs_.clear();
 }
 
-std::vector<int32_t> PadInputs(std::span<std::span<const int32_t>> sequences, int32_t pad_token_id) {
-  bool pad_right_{true};
-
+std::vector<int32_t> PadInputs(std::span<std::span<const int32_t>> sequences, int32_t pad_token_id, bool pad_left) {
   size_t max_length = 0;
   for (auto& sequence : sequences)
     max_length = std::max(max_length, sequence.size());
@@ -106,7 +197,7 @@ std::vector<int32_t> PadInputs(std::span<std::span<const int32_t>> sequences, in
     auto input_span = sequences[i];
 
     auto pad_count = max_length - input_span.size();
-    if (pad_right_) {
+    if (!pad_left) {
       std::copy(input_span.begin(), input_span.end(), output_span.begin());
       std::fill(output_span.end() - pad_count, output_span.end(), pad_token_id);
     } else {
@@ -129,21 +220,73 @@ TokenizerStream::TokenizerStream(const Tokenizer& tokenizer)
 }
 
 const std::string& TokenizerStream::Decode(int32_t token) {
+  TraceScope trace{"detokenize"};
   const char* string;
   CheckResult(OrtxDetokenizeCached(tokenizer_->tokenizer_, cache_, token, &string));
   chunk_ = string;
   return chunk_;
 }
 
-Tokenizer::Tokenizer(Config& config) : pad_token_id_{config.model.pad_token_id} {
+TokenizerBatchStream::TokenizerBatchStream(const Tokenizer& tokenizer, size_t batch_size)
+    : tokenizer_{tokenizer.shared_from_this()},
+      batch_size_{batch_size},
+      caches_{std::make_unique<OrtxPtr<OrtxObject>[]>(batch_size)},
+      offsets_(batch_size + 1) {
+  for (size_t row = 0; row < batch_size; row++)
+    CheckResult(OrtxCreate(kOrtxKindDetokenizerCache, caches_[row].Address()));
+}
+
+void TokenizerBatchStream::Decode(std::span<const int32_t> tokens) {
+  if (tokens.size() != batch_size_)
+    throw std::runtime_error("TokenizerBatchStream::Decode expects " + std::to_string(batch_size_) + " tokens, got " + std::to_string(tokens.size()));
+
+  TraceScope trace{"detokenize"};
+  text_.clear();
+  for (size_t row = 0; row < batch_size_; row++) {
+    offsets_[row] = text_.size();
+    if (tokens[row] < 0)
+      continue;
+    const char* string;
+    CheckResult(OrtxDetokenizeCached(tokenizer_->tokenizer_, caches_[row], tokens[row], &string));
+    text_ += string;
+  }
+  offsets_[batch_size_] = text_.size();
+}
+
+void TokenizerBatchStream::Reset(size_t row) {
+  if (row >= batch_size_)
+    throw std::runtime_error("TokenizerBatchStream::Reset row " + std::to_string(row) + " is out of range");
+  OrtxDispose(&caches_[row].p_);
+  caches_[row].p_ = nullptr;
+  CheckResult(OrtxCreate(kOrtxKindDetokenizerCache, caches_[row].Address()));
+}
+
+Tokenizer::Tokenizer(Config& config)
+    : pad_token_id_{config.model.pad_token_id},
+      segment_cache_size_{static_cast<size_t>(std::max(config.model.tokenizer_cache_size, 0))} {
   CheckResult(OrtxCreateTokenizer(tokenizer_.Address(), config.config_path.string().c_str()));
+
+  // The tokens of "" split into the ones every text starts with (like BOS) and the ones it ends with (like EOS), by
+  // where they are around the tokens of a text
+  auto empty_tokens = Encode("");
+  auto text_tokens = Encode("a");
+  size_t prefix = 0;
+  while (prefix < empty_tokens.size() && prefix < text_tokens.size() && empty_tokens[prefix] == text_tokens[prefix])
+    prefix++;
+  prefix_tokens_.assign(empty_tokens.begin(), empty_tokens.begin() + prefix);
+  suffix_tokens_.assign(empty_tokens.begin() + prefix, empty_tokens.end());
 }
 
 std::unique_ptr<TokenizerStream> Tokenizer::CreateStream() const {
   return std::make_unique<TokenizerStream>(*this);
 }
 
+std::unique_ptr<TokenizerBatchStream> Tokenizer::CreateBatchStream(size_t batch_size) const {
+  return std::make_unique<TokenizerBatchStream>(*this, batch_size);
+}
+
 std::vector<int32_t> Tokenizer::Encode(const char* text) const {
+  TraceScope trace{"tokenize"};
   OrtxPtr<OrtxTokenId2DArray> ids;
   CheckResult(OrtxTokenize(tokenizer_, &text, 1, ids.Address()));
 
@@ -153,7 +296,67 @@ std::vector<int32_t> Tokenizer::Encode(const char* text) const {
   return {tokens, tokens + count};
 }
 
+std::shared_ptr<const std::vector<int32_t>> Tokenizer::EncodeSegment(const std::string& segment) const {
+  if (segment_cache_size_ == 0)
+    return std::make_shared<const std::vector<int32_t>>(Encode(segment.c_str()));
+
+  {
+    std::lock_guard<std::mutex> lock{segments_mutex_};
+    if (auto it = segment_index_.find(segment); it != segment_index_.end()) {
+      segments_.splice(segments_.begin(), segments_, it->second);
+      return it->second->second;
+    }
+  }
+
+  // Tokenized outside of the lock, two requests with the same new segment both tokenize it and the second one wins
+  auto tokens = std::make_shared<const std::vector<int32_t>>(Encode(segment.c_str()));
+
+  std::lock_guard<std::mutex> lock{segments_mutex_};
+  if (auto it = segment_index_.find(segment); it != segment_index_.end()) {
+    segments_.splice(segments_.begin(), segments_, it->second);
+    return it->second->second;
+  }
+  segments_.emplace_front(segment, tokens);
+  segment_index_.emplace(segments_.front().first, segments_.begin());
+  if (segments_.size() > segment_cache_size_) {
+    segment_index_.erase(segments_.back().first);
+    segments_.pop_back();
+  }
+  return tokens;
+}
+
+std::vector<int32_t> Tokenizer::EncodeSegments(std::span<const std::string> segments) const {
+  std::vector<std::shared_ptr<const std::vector<int32_t>>> encoded;
+  size_t count = 0;
+  for (auto& segment : segments) {
+    encoded.push_back(EncodeSegment(segment));
+    count += encoded.back()->size();
+  }
+
+  // Only the start of the whole prompt keeps the prefix tokens and only its end the suffix tokens, a segment in the
+  // middle loses both
+  auto starts_with = [](std::span<const int32_t> tokens, const std::vector<int32_t>& prefix) {
+    return !prefix.empty() && tokens.size() >= prefix.size() && std::equal(prefix.begin(), prefix.end(), tokens.begin());
+  };
+  auto ends_with = [](std::span<const int32_t> tokens, const std::vector<int32_t>& suffix) {
+    return !suffix.empty() && tokens.size() >= suffix.size() && std::equal(suffix.begin(), suffix.end(), tokens.end() - suffix.size());
+  };
+
+  std::vector<int32_t> result;
+  result.reserve(count);
+  for (size_t i = 0; i < encoded.size(); i++) {
+    std::span<const int32_t> tokens = *encoded[i];
+    if (i > 0 && starts_with(tokens, prefix_tokens_))
+      tokens = tokens.subspan(prefix_tokens_.size());
+    if (i + 1 < encoded.size() && ends_with(tokens, suffix_tokens_))
+      tokens = tokens.first(tokens.size() - suffix_tokens_.size());
+    result.insert(result.end(), tokens.begin(), tokens.end());
+  }
+  return result;
+}
+
 std::string Tokenizer::Decode(std::span<const int32_t> tokens) const {
+  TraceScope trace{"detokenize"};
   OrtxPtr<OrtxStringArray> ortx_string_array;
   CheckResult(OrtxDetokenize1D(tokenizer_, reinterpret_cast<const uint32_t*>(tokens.data()), tokens.size(), ortx_string_array.Address()));
 
@@ -162,24 +365,147 @@ std::string Tokenizer::Decode(std::span<const int32_t> tokens) const {
   return string;
 }
 
-std::vector<int32_t> Tokenizer::EncodeBatch(std::span<const std::string> strings) const {
-  std::vector<std::vector<int32_t>> sequences;
-  std::vector<std::span<const int32_t>> span_sequences;
+// The text each token adds to a sequence. Decoding a token alone loses the leading space some tokenizers only produce
+// after another token, so each token is decoded after a fixed one whose text is then removed.
+std::vector<std::string> Tokenizer::GetTokenStrings(int vocab_size) const {
+  auto anchor_tokens = Encode("a");
+  std::vector<int32_t> pair{anchor_tokens.empty() ? 0 : anchor_tokens.back(), 0};
+  auto anchor = Decode(std::span<const int32_t>(pair).subspan(0, 1));
+
+  std::vector<std::string> strings(vocab_size);
+  for (int32_t token = 0; token < vocab_size; token++) {
+    pair[1] = token;
+    try {
+      auto text = Decode(pair);
+      strings[token] = text.compare(0, anchor.size(), anchor) == 0 ? text.substr(anchor.size()) : Decode(std::span<const int32_t>(pair).subspan(1, 1));
+    } catch (const std::exception&) {
+      // Model vocabs can be padded past the tokenizer's, those tokens stay empty and are never allowed
+    }
+  }
+  return strings;
+}
+
+std::shared_ptr<const Grammar> Tokenizer::GetGrammar(const std::string& pattern, int vocab_size, int32_t eos_token_id) const {
+  // The same pattern makes a different grammar for another model's vocab size or eos
+  auto key = std::to_string(vocab_size) + ',' + std::to_string(eos_token_id) + ',' + pattern;
+  std::shared_ptr<const std::vector<std::string>> token_strings;
+  {
+    std::lock_guard lock(grammars_mutex_);
+    if (auto it = grammars_.find(key); it != grammars_.end()) {
+      if (auto grammar = it->second.lock())
+        return grammar;
+    }
+    if (token_strings_ && token_strings_->size() == static_cast<size_t>(vocab_size))
+      token_strings = token_strings_;
+  }
+
+  // Decoding the vocab and compiling the grammar are slow, so they don't hold up the users of other grammars
+  if (!token_strings)
+    token_strings = std::make_shared<const std::vector<std::string>>(GetTokenStrings(vocab_size));
+  auto grammar = std::make_shared<const Grammar>(pattern, *token_strings, eos_token_id);
+
+  std::lock_guard lock(grammars_mutex_);
+  token_strings_ = std::move(token_strings);
+  if (auto it = grammars_.find(key); it != grammars_.end()) {
+    if (auto raced = it->second.lock())
+      return raced;  // Another thread compiled the same grammar meanwhile, share theirs
+  }
+  for (auto it = grammars_.begin(); it != grammars_.end();)
+    it = it->second.expired() ? grammars_.erase(it) : std::next(it);
+  grammars_[key] = grammar;
+  return grammar;
+}
+
+// Batches are tokenized in chunks of this many strings, one native ortx batch call per chunk, with the chunks spread
+// over the search thread pool
+constexpr size_t c_tokenize_chunk_size = 64;
+
+size_t Tokenizer::EncodeBatchInto(std::span<const char* const> strings, const std::function<std::span<int32_t>(size_t)>& get_output,
+                                  std::span<int32_t> lengths, int32_t pad_token_id) const {
+  if (!lengths.empty() && lengths.size() != strings.size())
+    throw std::runtime_error("EncodeBatch: lengths must have an entry for every string");
+
+  const size_t chunk_count = (strings.size() + c_tokenize_chunk_size - 1) / c_tokenize_chunk_size;
+  auto chunks = std::make_unique<OrtxPtr<OrtxTokenId2DArray>[]>(chunk_count);
+  GetSearchThreadPool().ParallelFor(chunk_count, [&](size_t chunk) {
+    const size_t begin = chunk * c_tokenize_chunk_size;
+    const size_t count = std::min(strings.size() - begin, c_tokenize_chunk_size);
+    CheckResult(OrtxTokenize(tokenizer_, const_cast<const char**>(strings.data() + begin), count, chunks[chunk].Address()));
+  });
+
+  // The rows are read where ortx put them and padded straight into the output, the same layout PadInputs makes
+  std::vector<std::span<const extTokenId_t>> rows(strings.size());
+  size_t max_length = 0;
   for (size_t i = 0; i < strings.size(); i++) {
-    sequences.emplace_back(Encode(strings[i].c_str()));
-    span_sequences.emplace_back(sequences.back());
+    const extTokenId_t* tokens;
+    size_t count;
+    CheckResult(OrtxTokenId2DArrayGetItem(chunks[i / c_tokenize_chunk_size], i % c_tokenize_chunk_size, &tokens, &count));
+    rows[i] = {tokens, count};
+    max_length = std::max(max_length, count);
+    if (!lengths.empty())
+      lengths[i] = static_cast<int32_t>(count);
+  }
+
+  auto output = get_output(max_length);
+  if (output.size() < max_length * strings.size())
+    throw std::runtime_error("EncodeBatch: the output holds " + std::to_string(output.size()) + " tokens, the batch needs " + std::to_string(max_length * strings.size()));
+  for (size_t i = 0; i < rows.size(); i++) {
+    auto row = output.subspan(i * max_length, max_length);
+    std::copy(rows[i].begin(), rows[i].end(), row.begin());
+    std::fill(row.begin() + static_cast<std::ptrdiff_t>(rows[i].size()), row.end(), pad_token_id);
   }
+  return max_length;
+}
+
+std::vector<int32_t> Tokenizer::EncodeBatch(std::span<const std::string> strings) const {
+  std::vector<const char*> texts;
+  for (auto& string : strings)
+    texts.push_back(string.c_str());
+
+  std::vector<int32_t> result;
+  EncodeBatchInto(
+      texts, [&](size_t sequence_length) {
+        result.resize(sequence_length * strings.size());
+        return std::span<int32_t>(result);
+      },
+      {}, pad_token_id_);
+  return result;
+}
 
-  return PadInputs(span_sequences, pad_token_id_);
+void Tokenizer::EncodeBatchInto(std::span<const char* const> strings, GeneratorParams& params, std::span<int32_t> lengths) const {
+  if (strings.empty())
+    throw std::runtime_error("EncodeBatch: there are no strings to encode");
+  if (!lengths.empty() && lengths.size() != strings.size())
+    throw std::runtime_error("EncodeBatch: lengths must have an entry for every string");
+  std::vector<int32_t> row_lengths(strings.size());
+  auto sequence_length = EncodeBatchInto(
+      strings, [&](size_t sequence_length) {
+        params.input_ids_owner.resize(sequence_length * strings.size());
+        return std::span<int32_t>(params.input_ids_owner);
+      },
+      row_lengths, params.pad_token_id);
+  params.batch_size = static_cast<int>(strings.size());
+  params.sequence_length = static_cast<int>(sequence_length);
+  params.input_ids = params.input_ids_owner;
+  if (!lengths.empty())
+    std::copy(row_lengths.begin(), row_lengths.end(), lengths.begin());
+
+  // The lengths tell the padding apart, unless a string had no tokens at all
+  params.pad_left = false;
+  if (std::find(row_lengths.begin(), row_lengths.end(), 0) == row_lengths.end())
+    params.input_lengths = std::move(row_lengths);
+  else
+    params.input_lengths.clear();
 }
 
 std::vector<std::string> Tokenizer::DecodeBatch(std::span<const int32_t> sequences, size_t count) const {
   if (sequences.size() % count != 0)
     throw std::runtime_error("DecodeBatch: sequences must be evenly divisible by the count");
   size_t sequence_length = sequences.size() / count;
-  std::vector<std::string> strings;
-  for (size_t i = 0; i < count; i++)
-    strings.emplace_back(Decode(sequences.subspan(sequence_length * i, sequence_length)));
+  std::vector<std::string> strings(count);
+  GetSearchThreadPool().ParallelFor(count, [&](size_t i) {
+    strings[i] = Decode(sequences.subspan(sequence_length * i, sequence_length));
+  });
   return strings;
 }
 
@@ -188,13 +514,17 @@ std::vector<std::string> Tokenizer::DecodeBatch(std::span<const int32_t> sequenc
 // the allocator used is not destroyed until last. This keeps the allocator around until exit, after all other memory
 // has been destroyed. Without this, we will crash in the Onnxruntime BFCArena code when deleting tensors due to the
 // arena already being destroyed.
-Ort::Allocator* GetCudaAllocator(OrtSession& session) {
+Ort::Allocator* GetCudaAllocator(OrtSession& session, int device_id) {
+  static std::mutex mutex;  // Models can load on several threads
+  std::lock_guard lock(mutex);
   auto& globals = *GetOrtGlobals();
-  if (!globals.allocator_cuda_) {
-    globals.memory_info_cuda_ = OrtMemoryInfo::Create("Cuda", OrtAllocatorType::OrtDeviceAllocator, 0, OrtMemType::OrtMemTypeDefault);
-    globals.allocator_cuda_ = Ort::Allocator::Create(session, *globals.memory_info_cuda_);
+  auto& allocator = globals.allocator_cuda_[device_id];
+  if (!allocator) {
+    auto& memory_info = globals.memory_info_cuda_[device_id];
+    memory_info = OrtMemoryInfo::Create("Cuda", OrtAllocatorType::OrtDeviceAllocator, device_id, OrtMemType::OrtMemTypeDefault);
+    allocator = Ort::Allocator::Create(session, *memory_info);
   }
-  return globals.allocator_cuda_.get();
+  return allocator.get();
 }
 #endif
 
@@ -244,19 +574,52 @@ ONNXTensorElementDataType SessionInfo::GetOutputDataType(const std::string& name
 }
 
 Model::Model(std::unique_ptr<Config> config) : config_{std::move(config)} {
-  // TODO: add function to create run options
-  run_options_ = OrtRunOptions::Create();
-
   CreateSessionOptions();
+  memory_budget_ = std::make_unique<MemoryBudget>(static_cast<size_t>(config_->model.decoder.memory_budget_mb) << 20);
 }
 
 Model::~Model() = default;
 
+std::shared_ptr<const SparseAttentionLayout> Model::GetSparseAttentionLayout(int block_count) const {
+  {
+    std::lock_guard lock(sparse_layouts_mutex_);
+    if (auto layout = sparse_layouts_[block_count].lock())
+      return layout;
+  }
+
+  // Built unlocked so generators wanting other layouts aren't held up, the first of two racing builds is kept
+  auto layout = std::make_shared<const SparseAttentionLayout>(*this, block_count);
+  std::lock_guard lock(sparse_layouts_mutex_);
+  if (auto existing = sparse_layouts_[block_count].lock())
+    return existing;
+  for (auto it = sparse_layouts_.begin(); it != sparse_layouts_.end();)
+    it = it->second.expired() ? sparse_layouts_.erase(it) : std::next(it);
+  sparse_layouts_[block_count] = layout;
+  return layout;
+}
+
+std::shared_ptr<const RotaryCache> Model::GetRotaryCache(bool long_factors, int length) const {
+  std::lock_guard lock(rotary_caches_mutex_);
+  auto& caches = rotary_caches_[long_factors];
+  if (auto cache = caches[length].lock())
+    return cache;
+
+  auto cache = std::make_shared<const RotaryCache>(*this, long_factors, length);
+  for (auto it = caches.begin(); it != caches.end();)
+    it = it->second.expired() ? caches.erase(it) : std::next(it);
+  caches[length] = cache;
+  return cache;
+}
+
 void Model::InitDeviceAllocator([[maybe_unused]] OrtSession& session) {
   allocator_device_ = &allocator_cpu_;
 #if USE_CUDA
   if (device_type_ == DeviceType::CUDA) {
-    allocator_device_ = GetCudaAllocator(session);
+    allocator_device_ = GetCudaAllocator(session, device_id_);
+    if (int pool_mb = config_->model.decoder.memory_pool_mb; pool_mb > 0) {
+      device_pool_ = std::make_unique<DevicePool>(*allocator_device_, static_cast<size_t>(pool_mb) << 20);
+      allocator_device_ = &device_pool_->GetAllocator();
+    }
   }
 #elif USE_DML
   if (device_type_ == DeviceType::DML) {
@@ -268,6 +631,39 @@ void Model::InitDeviceAllocator([[maybe_unused]] OrtSession& session) {
 
   session_info_ = std::make_unique<SessionInfo>(session);
   captured_graph_pool_ = std::make_shared<CapturedGraphPool>(config_.get(), session_info_.get(), allocator_device_);
+
+  auto& kv_cache = config_->model.decoder.kv_cache;
+  if (kv_cache.block_size > 0)
+    kv_block_pool_ = std::make_unique<KV_BlockPool>(kv_cache.block_size, kv_cache.max_blocks);
+  // A paged kv buffer grows in whole blocks of the sparse mask, so the blocks SparseAttention reads are all there
+  auto sparse_block_size = config_->model.decoder.sparse_attention.block_size;
+  if (kv_cache.block_size > 0 && sparse_block_size > 0 && kv_cache.block_size % sparse_block_size != 0)
+    throw std::runtime_error("kv_cache block_size must be a multiple of sparse_attention block_size " + std::to_string(sparse_block_size));
+  if (kv_cache.prefix_cache_size > 0)
+    prefix_cache_ = std::make_unique<PrefixCache>(kv_cache.prefix_cache_size, kv_cache.prefix_chunk_size, static_cast<size_t>(kv_cache.prefix_cache_mb) << 20);
+}
+
+// Thread 0 of the intra op pool is the thread calling Run, the others get a core of the node each, the physical cores
+// first and then their SMT siblings when there are more threads than cores
+void Model::PinIntraOpThreads(OrtSessionOptions& ort_options, const Config::SessionOptions& options) {
+  auto node = GetNumaNode(options.numa_node.value());
+  std::vector<int> cpus = node.core_cpus;
+  for (int cpu : node.cpus) {
+    if (std::find(node.core_cpus.begin(), node.core_cpus.end(), cpu) == node.core_cpus.end())
+      cpus.push_back(cpu);
+  }
+
+  int thread_count = options.intra_op_num_threads.value_or(static_cast<int>(node.core_cpus.size()));
+  ort_options.SetIntraOpNumThreads(thread_count);
+  std::string affinities;  // onnxruntime numbers the logical processors from 1
+  for (int i = 1; i < thread_count; i++)
+    affinities += (i > 1 ? ";" : "") + std::to_string(cpus[i % cpus.size()] + 1);
+  if (!affinities.empty())
+    ort_options.AddConfigEntry("session.intra_op_thread_affinities", affinities.c_str());
+  numa_cpus_ = node.cpus;
+
+  if (g_log.enabled && g_log.warning && options.intra_op_num_threads.value_or(0) > static_cast<int>(node.cpus.size()))
+    Log("warning", "intra_op_num_threads is more than the " + std::to_string(node.cpus.size()) + " cpus of NUMA node " + std::to_string(node.id));
 }
 
 void Model::CreateSessionOptions() {
@@ -285,6 +681,9 @@ void Model::CreateSessionOptions() {
     ort_options.SetIntraOpNumThreads(options.intra_op_num_threads.value());
   }
 
+  if (options.numa_node.has_value())
+    PinIntraOpThreads(ort_options, options);
+
   if (options.inter_op_num_threads.has_value()) {
     ort_options.SetInterOpNumThreads(options.inter_op_num_threads.value());
   }
@@ -320,13 +719,23 @@ void Model::CreateSessionOptions() {
     if (provider_options.name == "cuda") {
       auto ort_provider_options = OrtCUDAProviderOptionsV2::Create();
       std::vector<const char*> keys, values;
+      // The GPU is the device_id option, or the local rank for tensor parallel ranks on one machine
+      std::string device_id = std::to_string(config_->model.decoder.local_rank);
       for (auto& option : provider_options.options) {
+        if (option.first == "device_id") {
+          device_id = option.second;
+          continue;
+        }
         keys.emplace_back(option.first.c_str());
         values.emplace_back(option.second.c_str());
       }
+      keys.emplace_back("device_id");
+      values.emplace_back(device_id.c_str());
+      device_id_ = std::stoi(device_id);
       ort_provider_options->Update(keys.data(), values.data(), keys.size());
 
-      // Create and set our cudaStream_t
+      // Create and set our cudaStream_t, on the model's device
+      Ort::SetCurrentGpuDeviceId(device_id_);
       cuda_stream_.Create();
       ort_provider_options->UpdateValue("user_compute_stream", cuda_stream_.get());
 
@@ -343,9 +752,12 @@ void Model::CreateSessionOptions() {
 
       Ort::ThrowOnError(Ort::api->UpdateROCMProviderOptions(&ort_provider_options, keys.data(), values.data(), keys.size()));
       ort_options.AppendExecutionProvider_ROCM(ort_provider_options);
+#if USE_ROCM
+      device_type_ = DeviceType::ROCM;  // The inputs, outputs and search stay in host memory for now, see OnHost
+#endif
 #if USE_DML
     } else if (provider_options.name == "dml") {
-      dml_objects_ = DmlHelpers::CreateDmlObjects();
+      dml_objects_ = DmlHelpers::CreateDmlObjects(ParseDmlAdapterOptions(provider_options.options));
 
       auto directml_dll = CurrentModulePath() + L"DirectML.dll";
       wil::unique_hmodule smart_directml_dll(LoadLibraryExW(directml_dll.c_str(), nullptr, 0));
@@ -389,6 +801,254 @@ void Model::CreateSessionOptions() {
     } else
       throw std::runtime_error("Unknown provider type: " + provider_options.name);
   }
+
+  // The providers, their options and the device decide the optimized graph, the thread and logging options don't
+  std::string options_key;
+  for (auto& provider_options : options.provider_options) {
+    options_key += provider_options.name + '\0';
+    for (auto& option : provider_options.options)
+      options_key += option.first + '\0' + option.second + '\0';
+  }
+  options_key += std::to_string(device_id_);
+  if (vision_session_options_)
+    cache_options_keys_[vision_session_options_.get()] = options_key;
+  if (device_type_ == DeviceType::DML)
+    options_key += "|ep.dml.enable_graph_capture";
+  cache_options_keys_[session_options_.get()] = options_key;
+}
+
+void Model::SetCurrentDevice() const {
+#if USE_CUDA
+  if (device_type_ == DeviceType::CUDA)
+    Ort::SetCurrentGpuDeviceId(device_id_);
+#endif
+}
+
+#if USE_CUDA
+std::unique_ptr<cuda_stream_holder> Model::AcquireStream() const {
+  {
+    std::lock_guard lock(streams_mutex_);
+    if (!idle_streams_.empty()) {
+      auto stream = std::move(idle_streams_.back());
+      idle_streams_.pop_back();
+      return stream;
+    }
+  }
+  SetCurrentDevice();
+  auto stream = std::make_unique<cuda_stream_holder>();
+  stream->Create();
+  return stream;
+}
+
+void Model::ReleaseStream(std::unique_ptr<cuda_stream_holder> stream) const {
+  std::lock_guard lock(streams_mutex_);
+  idle_streams_.push_back(std::move(stream));  // Work still queued on it stays ahead of the next generator's
+}
+#endif
+
+#if USE_DML
+const DmlGatherLastTokensPipeline& Model::GetDmlGatherLastTokensPipeline(ONNXTensorElementDataType type) const {
+  std::lock_guard lock(dml_gather_pipelines_mutex_);
+  auto& pipeline = dml_gather_pipelines_[static_cast<int>(type)];
+  if (!pipeline)
+    pipeline = std::make_unique<DmlGatherLastTokensPipeline>(dml_objects_.d3d12_device.Get(), type);
+  return *pipeline;
+}
+#endif
+
+// Identifies the optimized graph of filename by the size and last write time of the model file and its external data,
+// the session options it was optimized with and the onnxruntime version. The files aren't read, they can be many GB.
+static std::string GetCacheKey(const Config& config, const std::string& filename, const std::string& options_key) {
+  uint64_t hash = 14695981039346656037ull;  // FNV-1a
+  auto add = [&](const void* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+      hash ^= static_cast<const uint8_t*>(data)[i];
+      hash *= 1099511628211ull;
+    }
+  };
+  auto add_string = [&](const std::string& s) { add(s.c_str(), s.size() + 1); };  // With the terminator, so "a" "bc" != "ab" "c"
+  auto add_file = [&](const std::string& name) {
+    int64_t size_and_time[2]{-1, -1};
+    (config.config_path / name).size_and_time(size_and_time[0], size_and_time[1]);
+    add(size_and_time, sizeof(size_and_time));
+  };
+
+  // A model exported again rewrites filename, so the external data files other than these don't need to be looked up
+  add_file(filename);
+  add_file(filename + ".data");
+  if (filename == config.model.decoder.filename && !config.model.decoder.gguf_filename.empty())
+    add_file(config.model.decoder.gguf_filename);
+  add_string(options_key);
+  add_string(OrtGetApiBase()->GetVersionString());
+
+  char key[17];
+  snprintf(key, sizeof(key), "%016llx", static_cast<unsigned long long>(hash));
+  return key;
+}
+
+std::unique_ptr<OrtSession> Model::CreateSession(OrtEnv& ort_env, const std::string& filename, OrtSessionOptions* session_options) const {
+  ScopedThreadAffinity on_node{numa_cpus_};  // The weights are touched first, so allocated, on the node the threads run on
+  auto& cache_dir = config_->model.decoder.session_options.cache_dir;
+  auto options_key = cache_options_keys_.find(session_options);
+  if (cache_dir.empty() || options_key == cache_options_keys_.end())
+    return CreateSessionFromFile(ort_env, filename, session_options);
+
+  auto separator = filename.find_last_of("/\\");
+  auto stem = separator == std::string::npos ? filename : filename.substr(separator + 1);
+  if (auto extension = stem.rfind(".onnx"); extension != std::string::npos)
+    stem.resize(extension);
+  auto cached_name = stem + "." + GetCacheKey(*config_, filename, options_key->second);
+  auto cached_filename = cache_dir + "/" + cached_name + ".onnx";
+
+  auto options = session_options->Clone();
+  auto cached_path = config_->config_path / cached_filename;
+  if (cached_path.exists()) {
+    if (g_log.enabled && g_log.model_cache)
+      Log("model_cache", "loading the optimized " + filename + " from " + cached_filename);
+    options->SetGraphOptimizationLevel(ORT_DISABLE_ALL);
+    return CreateSessionFromFile(ort_env, cached_filename, options.get());
+  }
+
+  // The model is saved under a temporary name and renamed when complete, so a load that fails or is interrupted never
+  // leaves a partial model behind. Its weights go to a .data file of a name only this load uses, which the renamed
+  // model refers to, so loads saving the same model at the same time never write each other's weights. Layout
+  // optimizations can't be saved, so the graph is optimized up to ORT_ENABLE_EXTENDED.
+  (config_->config_path / cache_dir).create_directory();
+  char unique[17];
+  snprintf(unique, sizeof(unique), "%08x%08x", std::random_device{}(), std::random_device{}());
+  auto temp_path = config_->config_path / (cache_dir + "/" + cached_name + "." + unique + ".tmp");
+  auto data_name = cached_name + "." + unique + ".data";
+  auto data_path = config_->config_path / (cache_dir + "/" + data_name);
+  options->SetGraphOptimizationLevel(ORT_ENABLE_EXTENDED);
+  options->SetOptimizedModelFilePath(temp_path.c_str());
+  options->AddConfigEntry("session.optimized_model_external_initializers_file_name", data_name.c_str());
+  options->AddConfigEntry("session.optimized_model_external_initializers_min_size_in_bytes", "1024");
+  std::unique_ptr<OrtSession> session;
+  try {
+    session = CreateSessionFromFile(ort_env, filename, options.get());
+  } catch (...) {
+    temp_path.remove();
+    data_path.remove();
+    throw;
+  }
+  bool saved = temp_path.rename(cached_path);
+  if (!saved) {
+    temp_path.remove();
+    data_path.remove();
+  }
+  if (g_log.enabled && g_log.model_cache)
+    Log("model_cache", (saved ? "saved the optimized " : "couldn't save the optimized ") + filename + " as " + cached_filename);
+  return session;
+}
+
+void Model::CreateSessions(const std::vector<std::function<void()>>& creations) const {
+  if (device_type_ == DeviceType::DML) {
+    for (auto& create : creations)
+      create();
+    return;
+  }
+  if (creations.empty())
+    return;
+
+  // On threads of their own rather than a shared pool: a creation takes seconds and can create sessions itself (like an
+  // offloaded decoder's model), and other models can load at the same time
+  std::vector<std::future<void>> others;
+  for (size_t i = 1; i < creations.size(); i++)
+    others.push_back(std::async(std::launch::async, creations[i]));
+
+  std::exception_ptr error;
+  try {
+    creations[0]();
+  } catch (...) {
+    error = std::current_exception();
+  }
+  for (auto& other : others) {
+    try {
+      other.get();
+    } catch (...) {
+      if (!error)
+        error = std::current_exception();
+    }
+  }
+  if (error)
+    std::rethrow_exception(error);
+}
+
+// onnxruntime names a profile <prefix>_<date and time>.json, so the sessions of a model started in the same second
+// would write one file. Every profiled session gets a prefix of its own instead, which the traces list.
+static std::string SessionProfilePrefix(const std::string& prefix, const std::string& filename) {
+  static std::atomic<int> next_session;
+  auto name = filename;
+  std::replace_if(name.begin(), name.end(), [](char c) { return c == '/' || c == '\\' || c == '.'; }, '_');
+  return prefix + "_" + name + "_" + std::to_string(next_session++);
+}
+
+// A session onnxruntime profiles is listed in the traces, so its profile can be put on their timeline
+static std::unique_ptr<OrtSession> ListProfiled(std::unique_ptr<OrtSession> session, const std::string& filename, const std::string& profile_prefix) {
+  if (auto start_ns = session->GetProfilingStartTimeNs())
+    TraceProfiledSession(filename, profile_prefix, start_ns);
+  return session;
+}
+
+std::unique_ptr<OrtSession> Model::CreateSessionFromFile(OrtEnv& ort_env, const std::string& filename, OrtSessionOptions* session_options) const {
+  auto path = config_->config_path / fs::path(filename);
+  auto& shared_weights = config_->shared_weights;
+  auto& gguf_filename = config_->model.decoder.gguf_filename;
+
+  std::unique_ptr<OrtSessionOptions> profiled_options;
+  std::string profile_prefix;
+  if (auto& profiling = config_->model.decoder.session_options.enable_profiling) {
+    profile_prefix = SessionProfilePrefix(*profiling, filename);
+    profiled_options = session_options ? session_options->Clone() : OrtSessionOptions::Create();
+    profiled_options->EnableProfiling(fs::path{profile_prefix}.c_str());
+    session_options = profiled_options.get();
+  }
+
+  if (!config_->model.decoder.session_options.memory_map && !shared_weights && gguf_filename.empty())
+    return ListProfiled(OrtSession::Create(ort_env, path.c_str(), session_options), filename, profile_prefix);
+
+  auto map = [&](const fs::path& file_path) -> const MappedFile& {
+    std::lock_guard lock{mapped_files_mutex_};  // Sessions can be created at the same time, see CreateSessions
+    auto& file = mapped_files_[file_path.string()];
+    if (!file)
+      file = shared_weights ? shared_weights->Map(file_path) : std::make_shared<const MappedFile>(file_path);
+    return *file;
+  };
+  auto& model_file = map(path);
+  auto options = session_options ? session_options->Clone() : OrtSessionOptions::Create();
+
+  auto add_external_data = [&](const std::string& location, const MappedFile& data_file) {
+    fs::path data_name{location};
+    options->AddExternalInitializersFromFilesInMemory({data_name.c_str()}, {static_cast<char*>(const_cast<void*>(data_file.data()))}, {data_file.size()});
+  };
+  // The initializers of a GGUF skeleton refer to the tensors of the GGUF file by their offsets in it, so they're used
+  // where they are in the mapping rather than read in
+  if (!gguf_filename.empty())
+    add_external_data(gguf_filename, map(config_->config_path / fs::path(gguf_filename)));
+
+  // Every other external data file the initializers refer to, where the model records it relative to its directory
+  auto separator = filename.find_last_of("/\\");
+  auto model_directory = separator == std::string::npos ? config_->config_path : config_->config_path / filename.substr(0, separator);
+  for (auto& location : GetExternalDataLocations({static_cast<const uint8_t*>(model_file.data()), model_file.size()})) {
+    if (location == gguf_filename)
+      continue;
+    if (location.empty() || location[0] == '/' || location[0] == '\\' || location.find(':') != std::string::npos || location.find("..") != std::string::npos)
+      throw std::runtime_error(filename + " refers to external data at " + location + ", which isn't within its directory");
+    add_external_data(location, map(model_directory / location));
+  }
+  if (shared_weights)
+    return ListProfiled(OrtSession::Create(ort_env, model_file.data(), model_file.size(), options.get(), shared_weights->GetPrepackedWeights()), filename, profile_prefix);
+  return ListProfiled(OrtSession::Create(ort_env, model_file.data(), model_file.size(), options.get()), filename, profile_prefix);
+}
+
+SharedWeights::SharedWeights() : prepacked_weights_{OrtPrepackedWeightsContainer::Create()} {}
+
+std::shared_ptr<const MappedFile> SharedWeights::Map(const fs::path& path) {
+  std::lock_guard lock(mutex_);
+  auto& file = files_[path.string()];
+  if (!file)
+    file = std::make_shared<const MappedFile>(path);
+  return file;
 }
 
 std::shared_ptr<Tokenizer> Model::CreateTokenizer() const {
@@ -396,24 +1056,151 @@ std::shared_ptr<Tokenizer> Model::CreateTokenizer() const {
 }
 
 std::shared_ptr<MultiModalProcessor> Model::CreateMultiModalProcessor() const {
-  return std::make_shared<MultiModalProcessor>(*config_, *session_info_);
+  return std::make_shared<MultiModalProcessor>(*config_, *session_info_, device_type_);
 }
 
-std::shared_ptr<Model> CreateModel(OrtEnv& ort_env, const char* config_path) {
-  auto config = std::make_unique<Config>(fs::path(config_path));
+// ORT runs a graph id normally a couple of times before it captures it, the prompt run doesn't count
+static constexpr int c_graph_capture_steps = 4;
+
+void Model::CaptureGraphs(std::span<const int> batch_sizes, std::span<const int> max_lengths) const {
+  if (device_type_ != DeviceType::CUDA && device_type_ != DeviceType::DML)
+    throw std::runtime_error("Graph capture is only supported on CUDA and DML");
+  if (!IsCudaGraphEnabled(config_->model.decoder.session_options))
+    throw std::runtime_error("Capturing graphs requires enable_cuda_graph in the decoder session options");
+
+  std::vector<int> default_max_length{config_->search.max_length};
+  if (max_lengths.empty())
+    max_lengths = default_max_length;
+
+  const int32_t token = config_->model.pad_token_id == 0 ? 1 : 0;  // Anything but padding
+  for (int max_length : max_lengths) {
+    for (int batch_size : batch_sizes) {
+      if (batch_size <= 0)
+        throw std::runtime_error("graph_capture batch_sizes must be greater than 0, is " + std::to_string(batch_size));
+
+      auto params = CreateGeneratorParams(*this);
+      params->TryGraphCapture(batch_size);
+      params->batch_size = batch_size;
+      params->sequence_length = 1;
+      params->search.max_length = max_length;
+      params->search.min_length = c_graph_capture_steps + 1;  // Don't stop early on eos
+      std::vector<int32_t> input_ids(batch_size, token);
+      params->input_ids = input_ids;
+
+      auto generator = CreateGenerator(*this, *params);
+      for (int step = 0; step < c_graph_capture_steps && !generator->IsDone(); step++) {
+        generator->ComputeLogits();
+        generator->GenerateNextToken();
+      }
+    }  // The generator gives its graph back to the pool
+  }
+
+  const int max_graphs = config_->model.decoder.graph_capture.max_graphs;
+  if (g_log.enabled && g_log.warning && max_graphs > 0 && max_lengths.size() * batch_sizes.size() > static_cast<size_t>(max_graphs))
+    Log("warning", "More graphs were captured than graph_capture max_graphs keeps, the first ones have been retired");
+}
+
+GeneratorMemory Model::EstimateMemory(const GeneratorParams& params) const {
+  auto& decoder = config_->model.decoder;
+
+  // Sampling num_return_sequences makes every sample a batch row, and a captured graph is sized for max_batch_size
+  size_t rows = params.BatchBeamSize();
+  if (params.search.num_beams == 1 && params.search.do_sample)
+    rows *= params.search.num_return_sequences;
+  if (params.use_cuda_graph)
+    rows = static_cast<size_t>(params.GraphMaxBatchSize()) * params.search.num_beams;
+
+  GeneratorMemory memory;
+
+  char past_name[64];
+  snprintf(past_name, std::size(past_name), (decoder.inputs.past_names.empty() ? decoder.inputs.past_key_names : decoder.inputs.past_names).c_str(), 0);
+  if (session_info_->HasInput(past_name)) {
+    auto& kv_cache = decoder.kv_cache;
+    size_t length = kv_cache.window_size > 0 ? kv_cache.sink_size + kv_cache.window_size : params.BufferMaxLength();
+    bool shared = decoder.inputs.past_names.empty() ? KV_Cache::IsBufferShared(*this, params) : KV_Cache_Combined::IsBufferShared(*this, params);
+    size_t copies = shared ? 1 : 2;  // Otherwise the pasts and presents of a step are both alive
+    // num_key_value_heads is already this rank's share of the heads (see SetupTensorParallel)
+    memory.kv_cache = decoder.num_hidden_layers * 2 * rows * decoder.num_key_value_heads * length * decoder.head_size *
+                      SizeOf(session_info_->GetInputDataType(past_name)) * copies;
+  }
+
+  // The prompt's logits are for every token, unless the model only computes the last one
+  if (session_info_->HasOutput(decoder.outputs.logits)) {
+    size_t prompt_length = session_info_->HasInput(decoder.inputs.last_token_indices) ? 1 : params.sequence_length;
+    auto type = session_info_->GetOutputDataType(decoder.outputs.logits);
+    memory.logits = rows * prompt_length * config_->model.vocab_size * SizeOf(type);
+    if (type != Ort::TypeToTensorType<float>::type)
+      memory.logits += rows * config_->model.vocab_size * sizeof(float);  // The float copy the search reads
+  }
+
+  // The input ids, position ids and attention mask of a captured graph, int64 at most
+  if (params.use_cuda_graph)
+    memory.static_buffers = rows * (params.BufferMaxLength() + 2) * sizeof(int64_t);
 
+  return memory;
+}
+
+static std::shared_ptr<Model> CreateModelOfType(std::unique_ptr<Config> config, OrtEnv& ort_env) {
+  if (!config->model.decoder.offload.filename.empty())
+    return std::make_shared<OffloadedDecoder_Model>(std::move(config), ort_env);
   if (config->model.type == "gpt2")
     return std::make_shared<Gpt_Model>(std::move(config), ort_env);
   if (config->model.type == "llama" || config->model.type == "gemma" || config->model.type == "mistral" || config->model.type == "phi" || config->model.type == "phi3" || config->model.type == "phi3small")
     return std::make_shared<DecoderOnly_Model>(std::move(config), ort_env);
   if (config->model.type == "whisper")
     return std::make_shared<Whisper_Model>(std::move(config), ort_env);
+  if (config->model.type == "t5" || config->model.type == "mt5" || config->model.type == "bart" || config->model.type == "mbart" || config->model.type == "marian")
+    return std::make_shared<EncoderDecoder_Model>(std::move(config), ort_env);
   if (config->model.type == "phi3v")
     return std::make_shared<MultiModalVisionModel>(std::move(config), ort_env);
 
   throw std::runtime_error("Unsupported model_type in config.json: " + config->model.type);
 }
 
+std::shared_ptr<Model> CreateModel(OrtEnv& ort_env, const char* config_path) {
+  return CreateModel(ort_env, std::make_unique<Config>(fs::path(config_path)));
+}
+
+std::shared_ptr<Model> CreateModel(OrtEnv& ort_env, const char* config_path, std::shared_ptr<SharedWeights> shared_weights) {
+  auto config = std::make_unique<Config>(fs::path(config_path));
+  config->shared_weights = std::move(shared_weights);
+  return CreateModel(ort_env, std::move(config));
+}
+
+std::shared_ptr<Model> CreateModel(OrtEnv& ort_env, std::unique_ptr<Config> config) {
+  auto model = CreateModelOfType(std::move(config), ort_env);
+
+  auto& graph_capture = model->config_->model.decoder.graph_capture;
+  if (!graph_capture.batch_sizes.empty())
+    model->CaptureGraphs(graph_capture.batch_sizes, graph_capture.max_lengths);
+  return model;
+}
+
+ModelReplicas::ModelReplicas(OrtEnv& ort_env, const char* config_path, std::span<const int> device_ids) {
+  if (device_ids.empty())
+    throw std::runtime_error("ModelReplicas needs at least one device id");
+
+  for (auto device_id : device_ids) {
+    auto config = std::make_unique<Config>(fs::path(config_path));
+    auto& provider_options = config->model.decoder.session_options.provider_options;
+    auto cuda = std::find_if(provider_options.begin(), provider_options.end(), [](auto& v) { return v.name == "cuda"; });
+    if (cuda == provider_options.end())
+      throw std::runtime_error("ModelReplicas only supports models that run on CUDA");
+    if (config->model.decoder.world_size > 1)
+      throw std::runtime_error("ModelReplicas doesn't support tensor parallel decoders, they're one process per rank");
+
+    auto& options = cuda->options;
+    options.erase(std::remove_if(options.begin(), options.end(), [](auto& v) { return v.first == "device_id"; }), options.end());
+    options.emplace_back("device_id", std::to_string(device_id));
+    models_.push_back(CreateModel(ort_env, std::move(config)));
+  }
+  tokenizer_ = models_.front()->CreateTokenizer();
+}
+
+const Model& ModelReplicas::GetLeastLoaded() const {
+  return **std::min_element(models_.begin(), models_.end(), [](auto& a, auto& b) { return a->generator_count_ < b->generator_count_; });
+}
+
 std::shared_ptr<GeneratorParams> CreateGeneratorParams(const Model& model) {
   return std::make_shared<GeneratorParams>(model);
 }
@@ -445,9 +1232,9 @@ void ConvertFp16ToFp32(OrtAllocator& allocator, OrtValue& in, std::unique_ptr<Or
   switch (device_type) {
     case DeviceType::DML:
       // DML doesn't currently support on-device scoring, so we fall back to the CPU
+    case DeviceType::ROCM:
     case DeviceType::CPU:
-      for (int i = 0; i < count; i++)
-        fp32[i] = FastFloat16ToFloat32(fp16[i]);
+      FastFloat16ToFloat32(fp16, fp32, count);
       break;
 
 #if USE_CUDA
@@ -483,6 +1270,7 @@ void ConvertFp32ToFp16(OrtAllocator& allocator, OrtValue& in, std::unique_ptr<Or
 
   switch (device_type) {
     case DeviceType::DML:
+    case DeviceType::ROCM:
     case DeviceType::CPU:
       for (int i = 0; i < count; i++)
         fp16[i] = FastFloat32ToFloat16(fp32[i]);
@@ -504,7 +1292,12 @@ std::unique_ptr<OrtValue> Model::ExpandInputs(std::unique_ptr<OrtValue>& input,
 
   // If we're on CUDA, we still want to do the copy to move the data over to CUDA memory where we will read from it later.
   // DML doesn't currently support on-device scoring, so we go the same route as the CPU
-  if (num_beams == 1 && (device_type_ == DeviceType::CPU || device_type_ == DeviceType::DML)) {
+  if (num_beams == 1 && (OnHost(device_type_) || device_type_ == DeviceType::DML)) {
+    return std::move(input);
+  }
+  // Already on the device (e.g. features produced by another session), so there's nothing to move
+  const bool on_device = input->GetTensorMemoryInfo().GetDeviceType() == OrtMemoryInfoDeviceType_GPU;
+  if (num_beams == 1 && on_device) {
     return std::move(input);
   }
 
@@ -517,7 +1310,8 @@ std::unique_ptr<OrtValue> Model::ExpandInputs(std::unique_ptr<OrtValue>& input,
 
   input_shape[0] *= num_beams;
 
-  auto& allocator = device_type_ == DeviceType::DML ? allocator_cpu_ : *allocator_device_;
+  // DML keeps the inputs it expands on the CPU, unless they're already on the device
+  auto& allocator = device_type_ == DeviceType::DML && !on_device ? allocator_cpu_ : *allocator_device_;
   auto expanded = OrtValue::CreateTensor(allocator, input_shape, element_type);
   const auto* input_data = reinterpret_cast<const uint8_t*>(input->GetTensorRawData());
   auto* expanded_data = reinterpret_cast<uint8_t*>(expanded->GetTensorMutableRawData());
@@ -525,7 +1319,35 @@ std::unique_ptr<OrtValue> Model::ExpandInputs(std::unique_ptr<OrtValue>& input,
 
   switch (device_type_) {
     case DeviceType::DML:
+#if USE_DML
+      if (on_device) {
+        // Device memory can't be read by the CPU, every batch entry is copied to its beams on the GPU instead
+        ComPtr<ID3D12Resource> source_resource;
+        Ort::ThrowOnError(p_dml_api_->GetD3D12ResourceFromAllocation(allocator_device_, input->GetTensorMutableRawData(), &source_resource));
+        ComPtr<ID3D12Resource> target_resource;
+        Ort::ThrowOnError(p_dml_api_->GetD3D12ResourceFromAllocation(allocator_device_, expanded_data, &target_resource));
+        for (int i = 0; i < batch_size; i++) {
+          for (int j = 0; j < num_beams; j++) {
+            dml_execution_context_->CopyBufferRegion(
+                target_resource.Get(),
+                (static_cast<uint64_t>(i) * num_beams + j) * data_size_bytes,
+                D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                source_resource.Get(),
+                static_cast<uint64_t>(i) * data_size_bytes,
+                D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                data_size_bytes);
+          }
+        }
+
+        ComPtr<ID3D12Fence> fence;
+        uint64_t completion_value;
+        dml_execution_context_->ExecuteCommandList(nullptr, &fence, &completion_value);
+        break;
+      }
+#endif
       // DML doesn't currently support on-device scoring, so we use the CPU for non-cache inputs/outputs
+      [[fallthrough]];
+    case DeviceType::ROCM:
     case DeviceType::CPU:
       for (int i = 0; i < batch_size; i++) {
         for (int j = 0; j < num_beams; j++) {
@@ -536,14 +1358,20 @@ std::unique_ptr<OrtValue> Model::ExpandInputs(std::unique_ptr<OrtValue>& input,
       break;
 
 #if USE_CUDA
-    case DeviceType::CUDA:
-      for (int i = 0; i < batch_size; i++) {
-        for (int j = 0; j < num_beams; j++) {
-          cudaMemcpyAsync(target, input_data + i * data_size_bytes, data_size_bytes, cudaMemcpyHostToDevice, cuda_stream_);
-          target += data_size_bytes;
-        }
+    case DeviceType::CUDA: {
+      // Every batch entry is only moved once, into its first beam. The beams are then filled on the device by doubling,
+      // each copy covering every batch entry at once.
+      const size_t row_bytes = static_cast<size_t>(data_size_bytes);
+      const size_t beam_pitch = row_bytes * num_beams;
+      cudaMemcpy2DAsync(target, beam_pitch, input_data, row_bytes, row_bytes, batch_size, on_device ? cudaMemcpyDeviceToDevice : cudaMemcpyHostToDevice, cuda_stream_);
+      if (!on_device)
+        g_transfer_counters.host_to_device_bytes += row_bytes * static_cast<size_t>(batch_size);
+      for (int copied = 1; copied < num_beams;) {
+        int count = std::min(copied, num_beams - copied);
+        cudaMemcpy2DAsync(target + copied * row_bytes, beam_pitch, target, beam_pitch, count * row_bytes, batch_size, cudaMemcpyDeviceToDevice, cuda_stream_);
+        copied += count;
       }
-      break;
+    } break;
 #endif
     default:
       throw std::runtime_error("ExpandInputs - Unsupported device type");
@@ -551,10 +1379,10 @@ std::unique_ptr<OrtValue> Model::ExpandInputs(std::unique_ptr<OrtValue>& input,
   return expanded;
 }
 
-MultiModalProcessor::MultiModalProcessor(Config& config, const SessionInfo& session_info)
+MultiModalProcessor::MultiModalProcessor(Config& config, const SessionInfo& session_info, DeviceType device_type)
     : tokenizer_{std::make_shared<Tokenizer>(config)} {
   if (!config.model.vision.filename.empty()) {
-    image_processor_ = std::make_shared<ImageProcessor>(config, session_info);
+    image_processor_ = std::make_shared<ImageProcessor>(config, session_info, device_type);
   }
 }
 
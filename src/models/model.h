@@ -3,8 +3,13 @@
 #pragma once
 #include "ortx_tokenizer.h"
 #include "captured_graph_pool.h"
+#include "device_pool.h"
+#include "kv_block_pool.h"
+#include "memory_budget.h"
+#include "prefix_cache.h"
 #include "utils.h"
 #include "prompt_image_processor.h"
+#include "mapped_file.h"
 
 #if USE_DML
 #include "dml_provider_factory.h"
@@ -12,11 +17,14 @@
 #include "../dml/dml_execution_context.h"
 #include "../dml/dml_pooled_upload_heap.h"
 #include "../dml/dml_readback_heap.h"
+#include "../dml/dml_gather_last_tokens_kernel.h"
 #endif
 
 namespace Generators {
 
 struct Tokenizer;
+struct SparseAttentionLayout;
+struct RotaryCache;
 
 void ConvertFp16ToFp32(OrtAllocator& allocator, OrtValue& in, std::unique_ptr<OrtValue>& p_out, DeviceType device_type, cudaStream_t stream);
 
@@ -31,21 +39,71 @@ struct State {
   virtual RoamingArray<float> Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices = {}) = 0;
   virtual const CapturedGraphInfo* GetCapturedGraphInfo() const { return nullptr; }
 
+  // Moves the kv cache out of device memory between runs, see KV_Cache::SwapOut
+  virtual void SwapOut(const std::string& path) { throw std::runtime_error("Swapping out the kv cache is not supported by this model"); }
+  virtual void SwapIn() { throw std::runtime_error("Swapping out the kv cache is not supported by this model"); }
+
+  // Multi-turn: a state for sequence, the whole single row conversation so far, that reuses the kv of the tokens this
+  // state has run so only the rest is run next. This state can't be run again afterwards.
+  virtual std::unique_ptr<State> Continue(std::span<const int32_t> /*sequence*/, RoamingArray<int32_t> /*sequence_lengths*/) {
+    throw std::runtime_error("Appending tokens to a generator is not supported by this model");
+  }
+
+  // Tree search and best of n: a new state for params, whose input_ids are this state's single row sequence, on a copy of
+  // the kv of the tokens this state has run. This state carries on unchanged.
+  virtual std::unique_ptr<State> Fork(RoamingArray<int32_t> /*sequence_lengths*/, const GeneratorParams& /*params*/) const {
+    throw std::runtime_error("Forking a generator is not supported by this model");
+  }
+
+  // Rows marked as finished are left out of the next runs when the state supports it (search.compact_finished_rows),
+  // the logits of the rows still running are handed back at their batch positions
+  virtual void SetFinishedRows(std::span<const bool> /*finished*/) {}
+
+  // Generator snapshots: writes what Model::LoadState needs to recreate this state on top of the same sequence
+  virtual void Save(std::ostream& /*file*/) { throw std::runtime_error("Saving a generator is not supported by this model"); }
+
   OrtValue* GetOutput(const char* name);
 
   std::shared_ptr<const GeneratorParams> params_;
 
+  // Greedy steps with no logits processing, set by the generator before Run. On DML, Run then picks the top token of
+  // every row on the device and returns it in top_tokens_ rather than the logits, so only the tokens are read back.
+  // CPU models with a next_tokens output fetch it instead of the logits.
+  bool top_tokens_on_device_{};
+  cpu_span<int32_t> top_tokens_;  // Empty when Run returned the logits
+  // The same steps on CUDA, where SelectTop folds the eos tokens and applies min_length in its own launch, so Run
+  // returns the logits as the model wrote them.
+  bool greedy_step_on_device_{};
+  // Greedy steps whose argmax folds the eos tokens into eos_token_id itself, so Logits::Get leaves them as they are:
+  // every greedy_step_on_device_, and on the other devices the plain steps that min_length no longer masks eos in
+  bool greedy_step_folds_eos_{};
+  // CUDA sampling steps with no logits processing past min_length, the sampler is all that reads the logits
+  bool sample_step_on_device_{};
+  // In either of these steps fp16 logits are read as the model wrote them: Run returns an empty array and leaves
+  // them here, rather than converting them to fp32 first
+  gpu_span<uint16_t> logits16_;
+
   std::vector<const char*> input_names_, output_names_;
   std::vector<OrtValue*> inputs_, outputs_;
+  double session_seconds_{};  // The time spent in session runs, for the generator metrics
 
  protected:
-  void Run(OrtSession& session, OrtRunOptions& run_options, int new_batch_size);  // Uses the inputs below to run
-  void ClearIO();                                                                 // Clear all inputs/outputs
+  void Run(OrtSession& session, int new_batch_size);  // Uses the inputs below to run
+  void ClearIO();                                     // Clear all inputs/outputs
   bool first_run_{true};
+  std::unique_ptr<OrtRunOptions> run_options_;  // Per state, the captured graph id is a run option
 
  private:
+  // One io binding per session this state runs, bound for the length of a run (see RunWithBinding)
+  struct Binding {
+    OrtSession* session;
+    std::unique_ptr<OrtIoBinding> io_binding;
+  };
+  void RunWithBinding(OrtSession& session);
+
   const Model& model_;
   int current_batch_size_{0};
+  std::vector<Binding> bindings_;
 };
 
 struct TokenizerStream {
@@ -59,30 +117,90 @@ struct TokenizerStream {
   std::string chunk_;
 };
 
+// A TokenizerStream for every row of a batch, so a step of a batch is decoded with one call
+struct TokenizerBatchStream {
+  TokenizerBatchStream(const Tokenizer& tokenizer, size_t batch_size);
+
+  // Decodes the next token of every row, a negative token is skipped (a finished row). Row i's new text is
+  // Text().substr(Offsets()[i], Offsets()[i + 1] - Offsets()[i]), both are valid until the next call.
+  void Decode(std::span<const int32_t> tokens);
+  // Starts a row over, for a new sequence in the row
+  void Reset(size_t row);
+
+  std::string_view Text() const { return text_; }
+  std::span<const size_t> Offsets() const { return offsets_; }  // batch_size + 1 of them
+  size_t BatchSize() const { return batch_size_; }
+
+ private:
+  std::shared_ptr<const Tokenizer> tokenizer_;
+  size_t batch_size_;
+  std::unique_ptr<OrtxPtr<OrtxObject>[]> caches_;
+  std::string text_;
+  std::vector<size_t> offsets_;
+};
+
 // Turn an array of ragged token sequences into a 2D input suitable for batching. Handles padding for the model
 // Sequence length is vector.size()/count
-std::vector<int32_t> PadInputs(std::span<std::span<const int32_t>> sequences, int32_t pad_token_id);
+std::vector<int32_t> PadInputs(std::span<std::span<const int32_t>> sequences, int32_t pad_token_id, bool pad_left = false);
 
 struct Tokenizer : std::enable_shared_from_this<Tokenizer> {
   Tokenizer(Config& config);
 
   std::unique_ptr<TokenizerStream> CreateStream() const;
+  std::unique_ptr<TokenizerBatchStream> CreateBatchStream(size_t batch_size) const;
 
   std::vector<int32_t> Encode(const char* text) const;
+  // Prompt templates: the tokens of the segments one after another, each segment tokenized on its own. The tokens of
+  // the last model.tokenizer_cache_size segments are kept, so a fixed system prompt or tool schema is tokenized once.
+  // A boundary should be where the tokenizer splits anyway, like next to a special token or a newline. The tokens the
+  // tokenizer puts around every text (like BOS and EOS) are only kept at the start of the first and the end of the last
+  // segment. SentencePiece tokenizers (like Llama's) add a space in front of every text they encode, so each segment
+  // after the first starts with one and the tokens differ from Encode of the whole prompt unless it begins with a
+  // special token or a space there is intended.
+  std::vector<int32_t> EncodeSegments(std::span<const std::string> segments) const;
   std::string Decode(std::span<const int32_t> tokens) const;
 
   std::vector<int32_t> EncodeBatch(std::span<const std::string> strings) const;
+  // Tokenizes straight into get_output(sequence_length), which has to hold a row of sequence_length tokens for every
+  // string: the rows are padded with pad_token_id to the longest one. lengths, when not empty, gets the unpadded
+  // length of every row. Returns sequence_length.
+  size_t EncodeBatchInto(std::span<const char* const> strings, const std::function<std::span<int32_t>(size_t)>& get_output,
+                         std::span<int32_t> lengths, int32_t pad_token_id) const;
+  // Into params.input_ids_owner, setting the params input_ids, batch_size and sequence_length
+  void EncodeBatchInto(std::span<const char* const> strings, GeneratorParams& params, std::span<int32_t> lengths = {}) const;
   std::vector<std::string> DecodeBatch(std::span<const int32_t> sequences, size_t count) const;
 
+  // Constrained decoding: the grammar for pattern over this tokenizer's vocab, reused while any generator still has it
+  std::shared_ptr<const Grammar> GetGrammar(const std::string& pattern, int vocab_size, int32_t eos_token_id) const;
+
+  int32_t GetPadTokenId() const { return pad_token_id_; }
+
   OrtxPtr<OrtxTokenizer> tokenizer_;
   std::shared_ptr<Tokenizer> external_owner_;  // Set to 'this' when created by the C API to preserve lifetime
 
  private:
   int32_t pad_token_id_;
+
+  std::shared_ptr<const std::vector<int32_t>> EncodeSegment(const std::string& segment) const;
+
+  // The segment LRU, most recently used first. The index's keys point at the strings in the list
+  using SegmentEntry = std::pair<std::string, std::shared_ptr<const std::vector<int32_t>>>;
+  size_t segment_cache_size_;
+  // What the tokenizer makes of "", the tokens it puts before and after every text
+  std::vector<int32_t> prefix_tokens_, suffix_tokens_;
+  mutable std::mutex segments_mutex_;
+  mutable std::list<SegmentEntry> segments_;
+  mutable std::unordered_map<std::string_view, std::list<SegmentEntry>::iterator> segment_index_;
+
+  std::vector<std::string> GetTokenStrings(int vocab_size) const;
+
+  mutable std::mutex grammars_mutex_;
+  mutable std::shared_ptr<const std::vector<std::string>> token_strings_;  // Of the last GetGrammar's vocab size
+  mutable std::unordered_map<std::string, std::weak_ptr<const Grammar>> grammars_;  // By vocab size, eos and pattern
 };
 
 struct MultiModalProcessor : std::enable_shared_from_this<MultiModalProcessor> {
-  MultiModalProcessor(Config& config, const SessionInfo& session_info);
+  MultiModalProcessor(Config& config, const SessionInfo& session_info, DeviceType device_type);
 
   std::shared_ptr<Tokenizer> tokenizer_;
   std::shared_ptr<ImageProcessor> image_processor_;
@@ -105,6 +223,10 @@ struct SessionInfo {
   std::unordered_map<std::string, ONNXTensorElementDataType> inputs_, outputs_;
 };
 
+// After loading, a model is safe to use from many threads at once: every generator has its own state, search and run
+// options, and what a model shares between generators (the captured graph pool, the kv block pool, the prefix cache,
+// the stream pool and the tokenizer's grammars) is behind a mutex. A single generator is not thread safe, and neither are
+// the DML execution context or changes to config_ after generators were created.
 struct Model : std::enable_shared_from_this<Model> {
   Model(std::unique_ptr<Config> config);
   virtual ~Model();
@@ -114,18 +236,67 @@ struct Model : std::enable_shared_from_this<Model> {
   std::shared_ptr<MultiModalProcessor> CreateMultiModalProcessor() const;
 
   virtual std::unique_ptr<State> CreateState(RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params) const = 0;
+  // Recreates a state written by State::Save, params.input_ids holds the saved sequence
+  virtual std::unique_ptr<State> LoadState(RoamingArray<int32_t> /*sequence_lengths*/, const GeneratorParams& /*params*/, std::istream& /*file*/) const {
+    throw std::runtime_error("Loading a generator is not supported by this model");
+  }
+
+  // Merging generators: one state for the rows[i] of every states[i], which have run up to their last generated token
+  // and can't be run again. params.input_ids holds their sequences left padded to one length.
+  virtual std::unique_ptr<State> MergeStates(std::span<State* const> /*states*/, std::span<const std::vector<int32_t>> /*rows*/,
+                                             RoamingArray<int32_t> /*sequence_lengths*/, const GeneratorParams& /*params*/) const {
+    throw std::runtime_error("Merging generators is not supported by this model");
+  }
 
   std::unique_ptr<OrtValue> ExpandInputs(std::unique_ptr<OrtValue>& input, int num_beams) const;
 
+  // Prefill/decode disaggregation: the prompts of later generators are run on prefill_model, and their kv is copied
+  // to this model for the decode steps. It can be on another device, or share the weights with its own session options
+  // and stream (see SharedWeights), so long prompts don't hold up the decode steps of the other generators.
+  virtual void SetPrefillModel(std::shared_ptr<const Model> /*prefill_model*/) {
+    throw std::runtime_error("A prefill model is not supported by this model");
+  }
+
+  // Graph capture: runs a few steps at every batch size for every max_length, so the graphs are captured before the
+  // first request. Generators with the same max_batch_size and max_length then replay them from the pool. An empty
+  // max_lengths means search.max_length. Called on load with model.decoder.graph_capture.
+  void CaptureGraphs(std::span<const int> batch_sizes, std::span<const int> max_lengths) const;
+
   CapturedGraphPool* GetCapturedGraphPool() const { return captured_graph_pool_.get(); }
+  KV_BlockPool* GetKVBlockPool() const { return kv_block_pool_.get(); }  // nullptr unless model.decoder.kv_cache.block_size is set
+  PrefixCache* GetPrefixCache() const { return prefix_cache_.get(); }    // nullptr unless model.decoder.kv_cache.prefix_cache_size is set
+  MemoryBudget& GetMemoryBudget() const { return *memory_budget_; }
+  // model.decoder.memory_pool_mb: gives the unused device memory the pool keeps back to the device allocator
+  void TrimMemoryPool() const {
+    if (device_pool_)
+      device_pool_->Trim();
+  }
+  // model.decoder.sparse_attention: the block mask for block_count blocks, reused while any generator still has it
+  std::shared_ptr<const SparseAttentionLayout> GetSparseAttentionLayout(int block_count) const;
+  // model.decoder.rotary_embedding: the cos/sin caches for length positions, reused while any generator still has them
+  std::shared_ptr<const RotaryCache> GetRotaryCache(bool long_factors, int length) const;
+
+  // Admission control: the device memory a generator created with params would take, an upper bound since a graph
+  // captured earlier or a paged kv cache can need less. Every generator reserves it in the memory budget.
+  GeneratorMemory EstimateMemory(const GeneratorParams& params) const;
 
   std::unique_ptr<Config> config_;
   std::unique_ptr<OrtSessionOptions> session_options_;
   std::unique_ptr<OrtSessionOptions> vision_session_options_;
-  std::unique_ptr<OrtRunOptions> run_options_;
 
   cuda_stream_holder cuda_stream_;
   DeviceType device_type_{DeviceType::CPU};
+  int device_id_{};  // The CUDA device, from the provider options device_id
+
+  // Makes the model's CUDA device current on the calling thread, so our kernels launch on it
+  void SetCurrentDevice() const;
+  mutable std::atomic<int> generator_count_{};  // Generators alive on this model, see ModelReplicas
+
+#if USE_CUDA
+  // model.decoder.generator_streams: a stream for one generator, handed back to the pool when it's done with it
+  std::unique_ptr<cuda_stream_holder> AcquireStream() const;
+  void ReleaseStream(std::unique_ptr<cuda_stream_holder> stream) const;
+#endif
   Ort::Allocator& allocator_cpu_{Ort::Allocator::GetWithDefaultOptions()};
   Ort::Allocator* allocator_device_{};  // Can be CUDA or CPU based on the DeviceType in the model
 
@@ -141,13 +312,26 @@ struct Model : std::enable_shared_from_this<Model> {
   IDMLDevice* GetDmlDevice() const { return dml_device_.Get(); }
   ID3D12Device* GetD3D12Device() const { return dml_objects_.d3d12_device.Get(); }
   bool IsIntelDevice() const { return is_intel_device_; }
+  // Created on the first prompt with logits of this type, then shared by the prompts that follow
+  const DmlGatherLastTokensPipeline& GetDmlGatherLastTokensPipeline(ONNXTensorElementDataType type) const;
 #endif
 
  protected:
   void InitDeviceAllocator(OrtSession& session);
   void CreateSessionOptions();
+  void PinIntraOpThreads(OrtSessionOptions& ort_options, const Config::SessionOptions& options);  // session_options.numa_node
+  // Loads filename from the config directory, mapped into memory with session_options.memory_map. With
+  // session_options.cache_dir, the first load saves the optimized graph there and later loads skip the optimization.
+  std::unique_ptr<OrtSession> CreateSession(OrtEnv& ort_env, const std::string& filename, OrtSessionOptions* session_options) const;
+  // The same without the cache, for sessions whose options don't match the ones the cache key is made of
+  std::unique_ptr<OrtSession> CreateSessionFromFile(OrtEnv& ort_env, const std::string& filename, OrtSessionOptions* session_options) const;
+  // Multi-session models: runs the creations of their sessions at the same time, as each spends seconds optimizing
+  // its graph and loading its weights. One after the other on DML, whose sessions share the device's command queue.
+  // Returns once all of them are done, then throws the first error.
+  void CreateSessions(const std::vector<std::function<void()>>& creations) const;
 
  private:
+
 #if USE_DML
   mutable DmlObjects dml_objects_;
   const OrtDmlApi* p_dml_api_{};
@@ -158,9 +342,67 @@ struct Model : std::enable_shared_from_this<Model> {
   bool is_intel_device_{};
   std::unique_ptr<Ort::Allocator> dml_owned_allocator_;
   std::unique_ptr<OrtMemoryInfo> memory_info_device_;
+  mutable std::mutex dml_gather_pipelines_mutex_;
+  mutable std::unordered_map<int, std::unique_ptr<DmlGatherLastTokensPipeline>> dml_gather_pipelines_;  // By logits type
 #endif
 
+  std::unique_ptr<DevicePool> device_pool_;  // Before anything holding tensors allocated from it
   std::shared_ptr<CapturedGraphPool> captured_graph_pool_;
+  std::unique_ptr<KV_BlockPool> kv_block_pool_;
+  std::unique_ptr<PrefixCache> prefix_cache_;
+  std::unique_ptr<MemoryBudget> memory_budget_;
+  mutable std::mutex sparse_layouts_mutex_;
+  mutable std::unordered_map<int, std::weak_ptr<const SparseAttentionLayout>> sparse_layouts_;  // By block count
+  mutable std::mutex rotary_caches_mutex_;
+  mutable std::unordered_map<int, std::weak_ptr<const RotaryCache>> rotary_caches_[2];  // By length, short and long factors
+  // By path, the sessions can use them directly so they live as long as the model. A session created again (like an
+  // unloaded vision session) reuses the mapping.
+  mutable std::mutex mapped_files_mutex_;
+  mutable std::unordered_map<std::string, std::shared_ptr<const MappedFile>> mapped_files_;
+  std::vector<int> numa_cpus_;  // session_options.numa_node: the cpus the sessions are created on
+  // session_options.cache_dir: what the optimized graphs of sessions created with each of the model's session options
+  // depend on besides the model, sessions created with other options aren't cached
+  std::unordered_map<const OrtSessionOptions*, std::string> cache_options_keys_;
+
+#if USE_CUDA
+  mutable std::mutex streams_mutex_;
+  mutable std::vector<std::unique_ptr<cuda_stream_holder>> idle_streams_;
+#endif
+};
+
+// Weights shared by every model created with the same handle, e.g. a text only decoder next to the multimodal model
+// built on it, or variants that only differ in their adapters. Each file is mapped once and every session reads its
+// initializers from that mapping, and the CPU EP's prepacked weights are kept once in a shared container. Weights
+// copied to a device are still per session, onnxruntime can't share those between sessions.
+struct SharedWeights : std::enable_shared_from_this<SharedWeights> {
+  SharedWeights();
+
+  std::shared_ptr<const MappedFile> Map(const fs::path& path);  // The same mapping for the same path
+  OrtPrepackedWeightsContainer& GetPrepackedWeights() { return *prepacked_weights_; }
+
+  std::shared_ptr<SharedWeights> external_owner_;  // Set to 'this' when created by the C API to preserve lifetime
+
+ private:
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::shared_ptr<const MappedFile>> files_;
+  std::unique_ptr<OrtPrepackedWeightsContainer> prepacked_weights_;
+};
+
+// Data parallel serving: the same CUDA model loaded once per device in one process, each replica with its own stream,
+// allocator and captured graph pool. A new generator goes to the replica with the fewest generators alive, and the
+// replicas share one tokenizer.
+struct ModelReplicas : std::enable_shared_from_this<ModelReplicas> {
+  ModelReplicas(OrtEnv& ort_env, const char* config_path, std::span<const int> device_ids);
+
+  const Model& GetLeastLoaded() const;
+  std::shared_ptr<Tokenizer> GetTokenizer() const { return tokenizer_; }
+
+  std::vector<std::shared_ptr<Model>> models_;  // In device_ids order
+
+  std::shared_ptr<ModelReplicas> external_owner_;  // Set to 'this' when created by the C API to preserve lifetime
+
+ private:
+  std::shared_ptr<Tokenizer> tokenizer_;
 };
 
 }  // namespace Generators
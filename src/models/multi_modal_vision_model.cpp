@@ -16,27 +16,16 @@ void Select(const Model& model, std::span<const int32_t> input_ids, OrtValue* hi
             OrtValue* visual_features, int32_t num_img_tokens, int32_t hidden_size, DeviceType device_type,
             cudaStream_t cuda_stream) {
   // Assme batch_size = 1
-  constexpr int32_t min_input_id = -1000000000;
-  constexpr int64_t expected_batch_size = 1;
-
-  // Find the position in the input_ids that corresponds to the start of the image tokens.
-  // Image tokens are represented by negative values in the input_ids.
   const int64_t sequence_length = input_ids.size();
-  int32_t image_position_start{};
-  for (int64_t idx = 0; idx < sequence_length; ++idx) {
-    if (input_ids[idx] < 0 && input_ids[idx] > min_input_id) {
-      image_position_start = idx;
-      break;
-    }
-  }
 
   // Replace the positions in the hidden_states tensor that correspond to the image tokens
   // with the visual features tensor.
-  const int32_t start_pos = image_position_start * hidden_size;
+  const int32_t start_pos = GetImagePositionStart(input_ids, num_img_tokens) * hidden_size;
   const int32_t element_count = num_img_tokens * hidden_size;
   const int32_t hidden_states_element_count = static_cast<int32_t>(sequence_length) * hidden_size;
 
   switch (device_type) {
+    case DeviceType::ROCM:
     case DeviceType::CPU: {
       auto target = cpu_span<float>(hidden_states->GetTensorMutableData<float>(), hidden_states_element_count)
                         .subspan(start_pos, element_count);
@@ -138,25 +127,180 @@ std::unique_ptr<OrtValue> GetVisualFeatures(OrtAllocator& device_allocator, cons
 
 }  // namespace
 
-MultiModalVisionModel::MultiModalVisionModel(std::unique_ptr<Config> config, OrtEnv& ort_env)
-    : Model{std::move(config)} {
-  embedding_session_ = OrtSession::Create(
-      ort_env, (config_->config_path / fs::path(config_->model.embedding.filename)).c_str(), session_options_.get());
+// The name, size and bytes of every input, in order, or false when one is on the device
+template <typename Visit>
+static bool VisitInputBytes(const std::vector<GeneratorParams::Input>& extra_inputs, Visit&& visit) {
+  for (auto& input : extra_inputs) {
+    auto& value = *input.tensor->ort_tensor_;
+    if (value.GetTensorMemoryInfo().GetDeviceType() != OrtMemoryInfoDeviceType_CPU)
+      return false;
+
+    auto type_and_shape = value.GetTensorTypeAndShapeInfo();
+    const uint64_t bytes = type_and_shape->GetElementCount() * SizeOf(type_and_shape->GetElementType());
+    visit(std::span<const uint8_t>{reinterpret_cast<const uint8_t*>(input.name.data()), input.name.size()});
+    visit(std::span<const uint8_t>{reinterpret_cast<const uint8_t*>(&bytes), sizeof(bytes)});
+    visit(std::span<const uint8_t>{static_cast<const uint8_t*>(value.GetTensorRawData()), static_cast<size_t>(bytes)});
+  }
+  return true;
+}
 
-  // User a custom vision session if available; otherwise, fallback to the generic options
-  auto* vision_session_options = vision_session_options_ ? vision_session_options_.get() : session_options_.get();
+int32_t GetImagePositionStart(std::span<const int32_t> input_ids, int32_t num_image_tokens) {
+  constexpr int32_t min_input_id = -1000000000;
+  for (size_t idx = 0; idx < input_ids.size(); ++idx) {
+    if (input_ids[idx] < 0 && input_ids[idx] > min_input_id) {
+      if (idx + num_image_tokens > input_ids.size())
+        throw std::runtime_error("The " + std::to_string(num_image_tokens) + " image tokens starting at position " + std::to_string(idx) +
+                                 " don't fit in the " + std::to_string(input_ids.size()) + " tokens of the prompt");
+      return static_cast<int32_t>(idx);
+    }
+  }
+  throw std::runtime_error("The prompt has images but no image tokens (negative input ids) to put their features at");
+}
+
+uint64_t VisualFeatureCache::Hash(const std::vector<GeneratorParams::Input>& extra_inputs) {
+  // FNV-1a over 8 byte words. It only picks the candidate entry, a hit is confirmed by comparing the bytes.
+  constexpr uint64_t prime = 0x100000001b3;
+  uint64_t hash = 0xcbf29ce484222325;
+  auto mix = [&](uint64_t word) { hash = (hash ^ word) * prime; };
+
+  bool on_cpu = VisitInputBytes(extra_inputs, [&](std::span<const uint8_t> data) {
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= data.size(); i += sizeof(uint64_t)) {
+      uint64_t word;
+      std::memcpy(&word, data.data() + i, sizeof(word));
+      mix(word);
+    }
+    for (; i < data.size(); i++)
+      mix(data[i]);
+  });
+  if (!on_cpu)
+    return 0;
+  return hash == 0 ? 1 : hash;
+}
+
+std::shared_ptr<OrtValue> VisualFeatureCache::Find(uint64_t hash, const std::vector<GeneratorParams::Input>& extra_inputs) {
+  std::lock_guard lock(mutex_);
+  auto it = std::find_if(entries_.begin(), entries_.end(), [&](const Entry& entry) {
+    if (entry.hash != hash)
+      return false;
+    size_t offset = 0;
+    bool equal = true;
+    VisitInputBytes(extra_inputs, [&](std::span<const uint8_t> data) {
+      equal = equal && offset + data.size() <= entry.inputs.size() &&
+              std::memcmp(entry.inputs.data() + offset, data.data(), data.size()) == 0;
+      offset += data.size();
+    });
+    return equal && offset == entry.inputs.size();
+  });
+  if (it == entries_.end())
+    return {};
+  entries_.splice(entries_.begin(), entries_, it);
+  return it->visual_features;
+}
 
-  vision_session_ = OrtSession::Create(
-      ort_env, (config_->config_path / fs::path(config_->model.vision.filename)).c_str(), vision_session_options);
-  decoder_session_ = OrtSession::Create(
-      ort_env, (config_->config_path / fs::path(config_->model.decoder.filename)).c_str(), session_options_.get());
+void VisualFeatureCache::Insert(uint64_t hash, const std::vector<GeneratorParams::Input>& extra_inputs, std::shared_ptr<OrtValue> visual_features) {
+  std::vector<uint8_t> inputs;
+  VisitInputBytes(extra_inputs, [&](std::span<const uint8_t> data) { inputs.insert(inputs.end(), data.begin(), data.end()); });
+
+  std::lock_guard lock(mutex_);
+  auto it = std::find_if(entries_.begin(), entries_.end(), [&](const Entry& entry) { return entry.hash == hash && entry.inputs == inputs; });
+  if (it != entries_.end())
+    entries_.erase(it);  // Another generator ran the same image at the same time
+  entries_.push_front(Entry{hash, std::move(inputs), std::move(visual_features)});
+  while (entries_.size() > static_cast<size_t>(max_entries_))
+    entries_.pop_back();
+}
+
+MultiModalVisionModel::MultiModalVisionModel(std::unique_ptr<Config> config, OrtEnv& ort_env)
+    : Model{std::move(config)},
+      ort_env_{ort_env} {
+  // With load_on_demand, the vision input and output types are still needed up front (the image processor and the
+  // visual features use them), so they're read from an unoptimized CPU session that's released right away
+  std::unique_ptr<OrtSession> vision_info_session;
+  CreateSessions({[&] { embedding_session_ = CreateSession(ort_env, config_->model.embedding.filename, session_options_.get()); },
+                  [&] { decoder_session_ = CreateSession(ort_env, config_->model.decoder.filename, session_options_.get()); },
+                  [&] {
+                    if (!config_->model.vision.load_on_demand) {
+                      GetVisionSession();
+                      return;
+                    }
+                    auto options = OrtSessionOptions::Create();
+                    options->SetGraphOptimizationLevel(ORT_DISABLE_ALL);
+                    vision_info_session = CreateSessionFromFile(ort_env, config_->model.vision.filename, options.get());
+                  }});
 
   InitDeviceAllocator(*decoder_session_);
   session_info_->Add(*embedding_session_);
-  session_info_->Add(*vision_session_);
+  session_info_->Add(vision_info_session ? *vision_info_session : *vision_session_);
+
+  if (config_->model.vision.feature_cache_size > 0)
+    feature_cache_ = std::make_unique<VisualFeatureCache>(config_->model.vision.feature_cache_size);
+}
+
+std::shared_ptr<OrtSession> MultiModalVisionModel::GetVisionSession() const {
+  {
+    std::lock_guard lock(vision_mutex_);
+    if (vision_session_)
+      return vision_session_;
+  }
+
+  // Creating it takes seconds, vision_mutex_ stays free meanwhile for the generators releasing their session or
+  // creating text only states
+  std::lock_guard load_lock(vision_load_mutex_);
+  {
+    std::lock_guard lock(vision_mutex_);
+    if (vision_session_)
+      return vision_session_;  // Another generator created it while this one waited
+  }
+
+  // Use a custom vision session if available; otherwise, fallback to the generic options
+  auto* vision_session_options = vision_session_options_ ? vision_session_options_.get() : session_options_.get();
+  std::shared_ptr<OrtSession> session = CreateSession(ort_env_, config_->model.vision.filename, vision_session_options);
+  if (g_log.enabled && g_log.model_cache && config_->model.vision.load_on_demand)
+    Log("model_cache", "loaded the vision session");
+
+  std::lock_guard lock(vision_mutex_);
+  vision_session_ = session;
+  vision_last_used_ = std::chrono::steady_clock::now();
+  return session;
+}
+
+void MultiModalVisionModel::ReleaseVisionSession(std::shared_ptr<OrtSession>& session) const {
+  if (!session)
+    return;
+  std::shared_ptr<OrtSession> idle;
+  {
+    std::lock_guard lock(vision_mutex_);
+    session.reset();
+    vision_last_used_ = std::chrono::steady_clock::now();
+    idle = TakeIdleVisionSession();
+  }
+}
+
+bool MultiModalVisionModel::IsVisionSessionLoaded() const {
+  std::lock_guard lock(vision_mutex_);
+  return vision_session_ != nullptr;
+}
+
+std::shared_ptr<OrtSession> MultiModalVisionModel::TakeIdleVisionSession() const {
+  const int idle_seconds = config_->model.vision.idle_unload_seconds;
+  if (idle_seconds < 0 || !vision_session_ || vision_session_.use_count() > 1)
+    return {};  // Never unloaded, not loaded, or in use
+  if (std::chrono::steady_clock::now() - vision_last_used_ < std::chrono::seconds(idle_seconds))
+    return {};
+
+  if (g_log.enabled && g_log.model_cache)
+    Log("model_cache", "unloaded the idle vision session");
+  return std::move(vision_session_);
 }
 
 std::unique_ptr<State> MultiModalVisionModel::CreateState(RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params) const {
+  std::shared_ptr<OrtSession> idle;
+  {
+    // Text only traffic never releases a vision session, so check here too
+    std::lock_guard lock(vision_mutex_);
+    idle = TakeIdleVisionSession();
+  }
   return std::make_unique<MultiModalPipelineState>(*this, sequence_lengths, params);
 }
 
@@ -175,7 +319,7 @@ void EmbeddingState::UpdateInputsAndOutputs(RoamingArray<int32_t> next_tokens) {
 
 RoamingArray<float> EmbeddingState::Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) {
   int batch_size = static_cast<int>(input_ids_.GetShape()[0]);
-  State::Run(*model_.embedding_session_, *model_.run_options_, batch_size);
+  State::Run(*model_.embedding_session_, batch_size);
 
   return MakeDummy();
 }
@@ -186,6 +330,15 @@ VisionState::VisionState(const MultiModalVisionModel& model, const GeneratorPara
   extra_inputs_.Add();
   num_image_tokens_ = GetNumImageTokens(params_->extra_inputs, model_.config_->model.vision.inputs.image_sizes);
   if (num_image_tokens_ > 0) {
+    if (model_.feature_cache_ && (image_hash_ = VisualFeatureCache::Hash(params_->extra_inputs)) != 0) {
+      if ((visual_features_ = model_.feature_cache_->Find(image_hash_, params_->extra_inputs))) {
+        if (g_log.enabled && g_log.model_cache)
+          Log("model_cache", "visual features cache hit");
+        return;
+      }
+    }
+
+    session_ = model_.GetVisionSession();
     visual_features_ = GetVisualFeatures(*model_.allocator_device_, *model_.session_info_,
                                          model_.config_->model.vision.outputs.visual_features,
                                          params_->hidden_size, num_image_tokens_);
@@ -194,8 +347,38 @@ VisionState::VisionState(const MultiModalVisionModel& model, const GeneratorPara
   }
 }
 
+bool VisionState::WriteFeaturesInto(OrtValue& inputs_embeds, int32_t image_position_start) {
+  // DML allocations can't be offset into, and cached features have to stay in their own tensor
+  if (!session_ || image_hash_ != 0 || model_.device_type_ == DeviceType::DML)
+    return false;
+  auto type = visual_features_->GetTensorTypeAndShapeInfo()->GetElementType();
+  if (inputs_embeds.GetTensorTypeAndShapeInfo()->GetElementType() != type)
+    return false;
+
+  const int64_t sequence_length = inputs_embeds.GetTensorTypeAndShapeInfo()->GetShape()[1];
+  if (image_position_start < 0 || image_position_start + num_image_tokens_ > sequence_length)
+    throw std::runtime_error("The image tokens at " + std::to_string(image_position_start) + " don't fit in the " + std::to_string(sequence_length) + " rows of inputs_embeds");
+
+  auto shape = visual_features_->GetTensorTypeAndShapeInfo()->GetShape();
+  const size_t element_size = SizeOf(type);
+  const size_t bytes = static_cast<size_t>(num_image_tokens_) * params_->hidden_size * element_size;
+  auto* target = static_cast<uint8_t*>(inputs_embeds.GetTensorMutableRawData()) + static_cast<size_t>(image_position_start) * params_->hidden_size * element_size;
+  visual_features_ = OrtValue::CreateTensor(inputs_embeds.GetTensorMemoryInfo(), target, bytes, shape, type);
+  outputs_.back() = visual_features_.get();
+  return true;
+}
+
+VisionState::~VisionState() {
+  model_.ReleaseVisionSession(session_);
+}
+
 RoamingArray<float> VisionState::Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) {
-  State::Run(*model_.vision_session_, *model_.run_options_, 1);
+  if (!session_)
+    return MakeDummy();  // The features came from the cache
+
+  State::Run(*session_, 1);
+  if (image_hash_ != 0)
+    model_.feature_cache_->Insert(image_hash_, params_->extra_inputs, visual_features_);
 
   return MakeDummy();
 }
@@ -209,17 +392,19 @@ DecoderState::DecoderState(const MultiModalVisionModel& model, RoamingArray<int3
   position_inputs_.Add();
   logits_.Add();
   kv_cache_.Add();
+  rotary_cache_inputs_.Add();
 }
 
 RoamingArray<float> DecoderState::Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) {
   int batch_size = static_cast<int>(inputs_embeds_.GetShape()[0]);
-  State::Run(*model_.decoder_session_, *model_.run_options_, batch_size);
+  State::Run(*model_.decoder_session_, batch_size);
   return logits_.Get();
 }
 
 void DecoderState::UpdateInputs(int current_length, RoamingArray<int32_t> beam_indices) {
   position_inputs_.Update(current_length);
-  kv_cache_.Update(beam_indices.GetCPU(), current_length);
+  kv_cache_.Update(beam_indices, current_length);
+  rotary_cache_inputs_.Update(current_length);
 }
 
 MultiModalPipelineState::MultiModalPipelineState(const MultiModalVisionModel& model,
@@ -244,15 +429,22 @@ RoamingArray<float> MultiModalPipelineState::Run(int current_length, RoamingArra
   // Generation stage:
   //   - input_ids -> |embeddings_model| -> |inputs_embeds|
   //   - inputs_embeds -> |decoder_model| -> |logits|
+  // With graph capture, the generation stage's input_ids, inputs_embeds, kv cache and logits are all on the captured
+  // graph's static buffers, so both sessions replay their graphs. The prompt stage is never captured.
   if (is_prompt_) {
     embedding_state_->Run(current_length, next_tokens, next_indices);
     if (vision_state_->num_image_tokens_ > 0) {
+      // The vision session writes the features over the image token rows of inputs_embeds when it can, so there's
+      // nothing to select afterwards
+      bool in_place = vision_state_->WriteFeaturesInto(*embedding_state_->inputs_embeds_.Get(),
+                                                       GetImagePositionStart(params_->input_ids, vision_state_->num_image_tokens_));
       vision_state_->Run(current_length, next_tokens, next_indices);
 
       // Run the select logic
-      Select(model_, params_->input_ids, embedding_state_->inputs_embeds_.Get(),
-             vision_state_->visual_features_.get(), vision_state_->num_image_tokens_,
-             params_->hidden_size, params_->device_type, params_->cuda_stream);
+      if (!in_place)
+        Select(model_, params_->input_ids, embedding_state_->inputs_embeds_.Get(),
+               vision_state_->visual_features_.get(), vision_state_->num_image_tokens_,
+               params_->hidden_size, params_->device_type, model_.cuda_stream_);
     }
 
     decoder_state_->inputs_embeds_ = embedding_state_->inputs_embeds_;
@@ -2,6 +2,9 @@
 // Licensed under the MIT License.
 
 #pragma once
+#include <chrono>
+#include <list>
+#include <mutex>
 #include "model.h"
 #include "input_ids.h"
 #include "embeddings.h"
@@ -9,18 +12,65 @@
 #include "logits.h"
 #include "kv_cache.h"
 #include "position_inputs.h"
+#include "rotary_embedding.h"
 
 namespace Generators {
 
+// The position of the first image token (negative input ids) of a batch size 1 prompt. Throws if there's none, or if
+// num_image_tokens from there don't fit in the prompt.
+int32_t GetImagePositionStart(std::span<const int32_t> input_ids, int32_t num_image_tokens);
+
+// Visual features of earlier images, keyed by a hash of their image inputs (pixel_values and image_sizes). Every entry
+// keeps a copy of its inputs, so a hash collision is a miss rather than the features of another image. Entries are
+// least recently used evicted once there are more than max_entries.
+struct VisualFeatureCache {
+  VisualFeatureCache(int max_entries) : max_entries_{max_entries} {}
+
+  // The hash of the inputs, or 0 when they can't be hashed because they're already on the device
+  static uint64_t Hash(const std::vector<GeneratorParams::Input>& extra_inputs);
+
+  // extra_inputs are the ones hash was computed from
+  std::shared_ptr<OrtValue> Find(uint64_t hash, const std::vector<GeneratorParams::Input>& extra_inputs);
+  void Insert(uint64_t hash, const std::vector<GeneratorParams::Input>& extra_inputs, std::shared_ptr<OrtValue> visual_features);
+
+ private:
+  struct Entry {
+    uint64_t hash;
+    std::vector<uint8_t> inputs;  // The names, sizes and bytes of the inputs, as Hash reads them
+    std::shared_ptr<OrtValue> visual_features;
+  };
+
+  int max_entries_;
+  std::list<Entry> entries_;  // Most recently used at the front
+  std::mutex mutex_;
+};
+
 struct MultiModalVisionModel : Model {
   MultiModalVisionModel(std::unique_ptr<Config> config, OrtEnv& ort_env);
 
   std::unique_ptr<State> CreateState(RoamingArray<int32_t> sequence_lengths,
                                      const GeneratorParams& params) const override;
 
+  // The vision session, created here if vision.load_on_demand is set and it isn't loaded yet. Give it back with
+  // ReleaseVisionSession once the run is done, so an idle session can be unloaded.
+  std::shared_ptr<OrtSession> GetVisionSession() const;
+  void ReleaseVisionSession(std::shared_ptr<OrtSession>& session) const;
+  bool IsVisionSessionLoaded() const;
+
   std::unique_ptr<OrtSession> embedding_session_;  // input_ids -> inputs_embeds
-  std::unique_ptr<OrtSession> vision_session_;     // pixel_values, img_sizes -> visual_features
   std::unique_ptr<OrtSession> decoder_session_;    // inputs_embeds, attention_mask, kv_cache -> logits
+  std::unique_ptr<VisualFeatureCache> feature_cache_;  // When vision.feature_cache_size > 0
+
+ private:
+  // Requires vision_mutex_. The session when it's idle long enough to be unloaded, for the caller to destroy once it
+  // doesn't hold the mutex anymore.
+  std::shared_ptr<OrtSession> TakeIdleVisionSession() const;
+
+  OrtEnv& ort_env_;
+  mutable std::mutex vision_load_mutex_;  // Held while creating the session, so only the generators needing it wait
+  mutable std::mutex vision_mutex_;
+  mutable std::shared_ptr<OrtSession> vision_session_;  // pixel_values, img_sizes -> visual_features
+  mutable std::chrono::steady_clock::time_point vision_last_used_;
 };
 
 struct EmbeddingState : State {
@@ -46,16 +96,24 @@ struct EmbeddingState : State {
 struct VisionState : State {
   VisionState(const MultiModalVisionModel& model, const GeneratorParams& params);
 
+  ~VisionState();
+
   RoamingArray<float> Run(int current_length, RoamingArray<int32_t> next_tokens,
                           RoamingArray<int32_t> next_indices = {}) override;
 
  private:
   friend struct MultiModalPipelineState;
 
+  // Makes the run write the visual features straight into the image token rows of the prompt's inputs_embeds, false
+  // if they have to be selected into it after the run instead
+  bool WriteFeaturesInto(OrtValue& inputs_embeds, int32_t image_position_start);
+
   const MultiModalVisionModel& model_;
+  std::shared_ptr<OrtSession> session_;        // Only held when there are images that aren't in the feature cache
   ExtraInputs extra_inputs_{model_, *this};    // Model inputs
-  std::unique_ptr<OrtValue> visual_features_;  // Model output
+  std::shared_ptr<OrtValue> visual_features_;  // Model output, or the cached features of the same image
   int32_t num_image_tokens_{};
+  uint64_t image_hash_{};  // Key of the features in the cache, 0 when they aren't cached
 };
 
 struct DecoderState : State {
@@ -79,6 +137,7 @@ struct DecoderState : State {
   PositionInputs position_inputs_;    // Model input
   KV_Cache kv_cache_{model_, *this};  // Model input
   Logits logits_{model_, *this};      // Model output
+  RotaryCacheInputs rotary_cache_inputs_{model_, *this, params_->sequence_length};  // Model inputs
 };
 
 struct MultiModalPipelineState : State {
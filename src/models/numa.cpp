@@ -0,0 +1,96 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#include "../generators.h"
+#include "numa.h"
+
+namespace Generators {
+
+// A sysfs cpu list, like "0-15,32-47"
+static std::vector<int> ParseCpuList(const std::string& list) {
+  std::vector<int> cpus;
+  std::istringstream stream{list};
+  std::string range;
+  while (std::getline(stream, range, ',')) {
+    if (range.empty() || range == "\n")
+      continue;
+    auto dash = range.find('-');
+    int first = std::stoi(range.substr(0, dash));
+    int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    for (int cpu = first; cpu <= last; cpu++)
+      cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+static std::string ReadLine(const std::string& path) {
+  std::ifstream file{path};
+  std::string line;
+  std::getline(file, line);
+  return line;
+}
+
+NumaNode GetNumaNode(int node) {
+  NumaNode result;
+#ifdef __linux__
+  if (node < 0) {
+    int cpu = sched_getcpu();
+    result.id = 0;
+    for (int i = 0; cpu >= 0 && fs::path("/sys/devices/system/node/node" + std::to_string(i)).exists(); i++) {
+      auto cpus = ParseCpuList(ReadLine("/sys/devices/system/node/node" + std::to_string(i) + "/cpulist"));
+      if (std::find(cpus.begin(), cpus.end(), cpu) != cpus.end()) {
+        result.id = i;
+        break;
+      }
+    }
+  } else
+    result.id = node;
+
+  auto cpulist = "/sys/devices/system/node/node" + std::to_string(result.id) + "/cpulist";
+  if (fs::path(cpulist).exists())
+    result.cpus = ParseCpuList(ReadLine(cpulist));
+  else if (node > 0)
+    throw std::runtime_error("NUMA node " + std::to_string(node) + " doesn't exist");
+
+  for (int cpu : result.cpus) {
+    auto siblings = ParseCpuList(ReadLine("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/thread_siblings_list"));
+    if (siblings.empty() || siblings.front() == cpu)
+      result.core_cpus.push_back(cpu);
+  }
+#else
+  if (node > 0)
+    throw std::runtime_error("NUMA nodes are only supported on Linux");
+#endif
+
+  if (result.cpus.empty()) {
+    for (int cpu = 0; cpu < static_cast<int>(std::max(std::thread::hardware_concurrency(), 1u)); cpu++)
+      result.cpus.push_back(cpu);
+    result.core_cpus = result.cpus;
+  }
+  return result;
+}
+
+#ifdef __linux__
+ScopedThreadAffinity::ScopedThreadAffinity(std::span<const int> cpus) {
+  if (cpus.empty() || sched_getaffinity(0, sizeof(previous_), &previous_) != 0)
+    return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus)
+    CPU_SET(cpu, &set);
+  pinned_ = sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+ScopedThreadAffinity::~ScopedThreadAffinity() {
+  if (pinned_)
+    sched_setaffinity(0, sizeof(previous_), &previous_);
+}
+#else
+ScopedThreadAffinity::ScopedThreadAffinity(std::span<const int>) {}
+ScopedThreadAffinity::~ScopedThreadAffinity() {}
+#endif
+
+}  // namespace Generators
@@ -0,0 +1,38 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+#include <span>
+#include <vector>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+namespace Generators {
+
+// The cpus of a NUMA node, read from sysfs. Elsewhere than Linux (or without sysfs) there's a single node with every cpu.
+struct NumaNode {
+  int id{};
+  std::vector<int> cpus;        // Logical cpus, ascending
+  std::vector<int> core_cpus;   // The first logical cpu of every physical core, so one per core without the SMT siblings
+};
+
+// node -1 is the node of the cpu the calling thread is running on
+NumaNode GetNumaNode(int node);
+
+// Pins the calling thread to cpus while alive, so the memory it touches first is allocated on their node. Does nothing
+// with no cpus or elsewhere than Linux.
+struct ScopedThreadAffinity {
+  explicit ScopedThreadAffinity(std::span<const int> cpus);
+  ~ScopedThreadAffinity();
+
+ private:
+  ScopedThreadAffinity(const ScopedThreadAffinity&) = delete;
+  void operator=(const ScopedThreadAffinity&) = delete;
+
+#ifdef __linux__
+  cpu_set_t previous_{};
+  bool pinned_{};
+#endif
+};
+
+}  // namespace Generators
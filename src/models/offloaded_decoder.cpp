@@ -0,0 +1,144 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "../generators.h"
+#include "offloaded_decoder.h"
+
+namespace Generators {
+
+OffloadedLayers_Model::OffloadedLayers_Model(std::unique_ptr<Config> config, OrtEnv& ort_env)
+    : Model{std::move(config)} {
+  session_ = CreateSession(ort_env, config_->model.decoder.filename, session_options_.get());
+  InitDeviceAllocator(*session_);
+}
+
+std::unique_ptr<State> OffloadedLayers_Model::CreateState(RoamingArray<int32_t> /*sequence_lengths*/, const GeneratorParams& /*params*/) const {
+  throw std::runtime_error("The offloaded layers of a decoder only run through the decoder's generators");
+}
+
+OffloadedDecoder_Model::OffloadedDecoder_Model(std::unique_ptr<Config> config, OrtEnv& ort_env)
+    : Model{std::move(config)} {
+  auto& decoder = config_->model.decoder;
+  if (device_type_ != DeviceType::CUDA)
+    throw std::runtime_error("model.decoder.offload needs the decoder to run on CUDA");
+  if (decoder.offload.first_layer <= 0 || decoder.offload.first_layer >= decoder.num_hidden_layers)
+    throw std::runtime_error("model.decoder.offload.first_layer must leave layers on both sides, the decoder has " + std::to_string(decoder.num_hidden_layers));
+  if (decoder.world_size > 1)
+    throw std::runtime_error("model.decoder.offload doesn't support tensor parallel decoders");
+
+  auto offload_config = std::make_unique<Config>(*config_);
+  auto& offload_decoder = offload_config->model.decoder;
+  offload_decoder.filename = decoder.offload.filename;
+  offload_decoder.gguf_filename.clear();
+  offload_decoder.session_options = decoder.offload.session_options;
+  offload_decoder.num_hidden_layers = decoder.num_hidden_layers - decoder.offload.first_layer;
+  offload_decoder.offload = {};
+  offload_decoder.graph_capture = {};
+  offload_decoder.memory_budget_mb = 0;  // The budget is for the device memory, which is all in this model
+
+  // From here on the decoder is only the layers in filename, so its kv cache and memory estimate are only theirs
+  decoder.num_hidden_layers = decoder.offload.first_layer;
+  CreateSessions({[&] { offload_model_ = std::make_unique<OffloadedLayers_Model>(std::move(offload_config), ort_env); },
+                  [&] { session_decoder_ = CreateSession(ort_env, decoder.filename, session_options_.get()); }});
+  InitDeviceAllocator(*session_decoder_);
+}
+
+std::unique_ptr<State> OffloadedDecoder_Model::CreateState(RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params) const {
+  return std::make_unique<OffloadedDecoder_State>(*this, sequence_lengths, params);
+}
+
+OffloadedLayers_State::OffloadedLayers_State(const OffloadedLayers_Model& model, RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params)
+    : State{params, model},
+      model_{model},
+      position_inputs_{model, *this, sequence_lengths} {
+  hidden_states_index_ = inputs_.size();
+  inputs_.push_back(nullptr);
+  input_names_.push_back(model_.config_->model.decoder.inputs.embeddings.c_str());
+  position_inputs_.Add();
+  logits_.Add();
+  kv_cache_.Add();
+  rotary_cache_inputs_.Add();
+}
+
+RoamingArray<float> OffloadedLayers_State::Run(int /*current_length*/, RoamingArray<int32_t> /*next_tokens*/, RoamingArray<int32_t> /*next_indices*/) {
+  int batch_size = static_cast<int>(inputs_[hidden_states_index_]->GetTensorTypeAndShapeInfo()->GetShape()[0]);
+  State::Run(*model_.session_, batch_size);
+  return logits_.Get();
+}
+
+void OffloadedLayers_State::UpdateInputs(int current_length, RoamingArray<int32_t> beam_indices) {
+  position_inputs_.Update(current_length);
+  kv_cache_.Update(beam_indices.GetCPU(), current_length);
+  rotary_cache_inputs_.Update(current_length);
+}
+
+OffloadedDecoder_State::OffloadedDecoder_State(const OffloadedDecoder_Model& model, RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params)
+    : State{params, model},
+      model_{model},
+      position_inputs_{model, *this, sequence_lengths},
+      offload_state_{std::make_unique<OffloadedLayers_State>(*model.offload_model_, sequence_lengths, params)} {
+  if (params.use_cuda_graph)
+    throw std::runtime_error("Graph capture is not supported with model.decoder.offload");
+
+  auto& hidden_states_name = model_.config_->model.decoder.outputs.hidden_states;
+  hidden_states_type_ = model_.session_info_->GetOutputDataType(hidden_states_name);
+  if (hidden_states_type_ != model_.offload_model_->session_info_->GetInputDataType(model_.config_->model.decoder.inputs.embeddings))
+    throw std::runtime_error("The hidden states of the offloaded decoder's parts have different types");
+  hidden_states_shape_ = {input_ids_.GetShape()[0], input_ids_.GetShape()[1], params.hidden_size};
+
+  input_ids_.Add();
+  position_inputs_.Add();
+  kv_cache_.Add();
+  rotary_cache_inputs_.Add();
+  hidden_states_index_ = outputs_.size();
+  outputs_.push_back(nullptr);
+  output_names_.push_back(hidden_states_name.c_str());
+  CreateHiddenStates();
+}
+
+RoamingArray<float> OffloadedDecoder_State::Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) {
+  // Every run goes through both parts in turn:
+  //   - input_ids -> |decoder on CUDA| -> |hidden_states in pinned memory|
+  //   - hidden_states -> |offloaded layers and lm head| -> |logits|
+  // The device run copies its hidden states out before it returns, so the offloaded part reads them in place.
+  if (first_run_) {
+    first_run_ = false;
+  } else {
+    UpdateInputs(next_tokens, next_indices, current_length);
+  }
+
+  State::Run(*model_.session_decoder_, static_cast<int>(hidden_states_shape_[0]));
+  auto logits = offload_state_->Run(current_length, next_tokens, next_indices);
+  session_seconds_ += std::exchange(offload_state_->session_seconds_, 0.0);
+  return logits;
+}
+
+void OffloadedDecoder_State::UpdateInputs(const RoamingArray<int32_t>& next_tokens, RoamingArray<int32_t> beam_indices, int current_length) {
+  input_ids_.Update(next_tokens);
+  position_inputs_.Update(current_length);
+  kv_cache_.Update(beam_indices.GetCPU(), current_length);
+  rotary_cache_inputs_.Update(current_length);
+  offload_state_->UpdateInputs(current_length, beam_indices);
+
+  if (hidden_states_shape_[1] != 1) {
+    hidden_states_shape_[1] = 1;
+    CreateHiddenStates();
+  }
+}
+
+void OffloadedDecoder_State::CreateHiddenStates() {
+#if USE_CUDA
+  auto bytes = static_cast<size_t>(hidden_states_shape_[0] * hidden_states_shape_[1] * hidden_states_shape_[2]) * SizeOf(hidden_states_type_);
+  if (!hidden_states_buffer_)
+    hidden_states_buffer_ = CudaMallocHostArray<uint8_t>(bytes);
+
+  auto memory_info = OrtMemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeCPU);
+  hidden_states_ = OrtValue::CreateTensor(*memory_info, hidden_states_buffer_.get(), bytes, hidden_states_shape_, hidden_states_type_);
+  outputs_[hidden_states_index_] = hidden_states_.get();
+  offload_state_->inputs_[offload_state_->hidden_states_index_] = hidden_states_.get();
+#else
+  throw std::runtime_error("model.decoder.offload needs a CUDA build");
+#endif
+}
+
+}  // namespace Generators
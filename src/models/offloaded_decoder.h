@@ -0,0 +1,82 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+#include "model.h"
+#include "input_ids.h"
+#include "logits.h"
+#include "kv_cache.h"
+#include "position_inputs.h"
+#include "rotary_embedding.h"
+
+namespace Generators {
+
+// The layers of an offloaded decoder from model.decoder.offload.first_layer on, and the lm head. Its config is the
+// decoder's with only these layers and the offload filename and session options, so the kv cache, position inputs and
+// logits work on it as they do on any other model.
+struct OffloadedLayers_Model : Model {
+  OffloadedLayers_Model(std::unique_ptr<Config> config, OrtEnv& ort_env);
+
+  std::unique_ptr<State> CreateState(RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params) const override;
+
+  std::unique_ptr<OrtSession> session_;  // inputs_embeds (the hidden states), attention_mask, kv of these layers -> logits
+};
+
+// CPU/GPU hybrid for decoders bigger than the device memory (model.decoder.offload): the first offload.first_layer
+// layers run on CUDA and the others on the offload model, usually the CPU. Each part keeps the kv of its own layers in
+// its own memory, the hidden states of every run go from one to the other through pinned host memory.
+struct OffloadedDecoder_Model : Model {
+  OffloadedDecoder_Model(std::unique_ptr<Config> config, OrtEnv& ort_env);
+
+  std::unique_ptr<State> CreateState(RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params) const override;
+
+  std::unique_ptr<OrtSession> session_decoder_;  // input_ids, attention_mask, kv of the first layers -> hidden_states
+  std::unique_ptr<OffloadedLayers_Model> offload_model_;
+};
+
+struct OffloadedLayers_State : State {
+  OffloadedLayers_State(const OffloadedLayers_Model& model, RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params);
+
+  RoamingArray<float> Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) override;
+
+ private:
+  friend struct OffloadedDecoder_State;
+
+  void UpdateInputs(int current_length, RoamingArray<int32_t> beam_indices);
+
+  const OffloadedLayers_Model& model_;
+  size_t hidden_states_index_{};      // Model input, set by OffloadedDecoder_State to its output
+  PositionInputs position_inputs_;    // Model input
+  KV_Cache kv_cache_{model_, *this};  // Model input
+  Logits logits_{model_, *this};      // Model output
+  RotaryCacheInputs rotary_cache_inputs_{model_, *this, params_->sequence_length};
+};
+
+struct OffloadedDecoder_State : State {
+  OffloadedDecoder_State(const OffloadedDecoder_Model& model, RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params);
+
+  RoamingArray<float> Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) override;
+
+ private:
+  void UpdateInputs(const RoamingArray<int32_t>& next_tokens, RoamingArray<int32_t> beam_indices, int current_length);
+  void CreateHiddenStates();  // Over hidden_states_buffer_ in hidden_states_shape_, bound to both parts
+
+  const OffloadedDecoder_Model& model_;
+
+  InputIDs input_ids_{model_, *this};
+  PositionInputs position_inputs_;
+  KV_Cache kv_cache_{model_, *this};
+  RotaryCacheInputs rotary_cache_inputs_{model_, *this, params_->sequence_length};
+
+  std::array<int64_t, 3> hidden_states_shape_{};  // [batch_size, sequence_length, hidden_size]
+  ONNXTensorElementDataType hidden_states_type_;
+#if USE_CUDA
+  cuda_host_unique_ptr<uint8_t> hidden_states_buffer_;  // Sized for the prompt, the later runs use the start of it
+#endif
+  std::unique_ptr<OrtValue> hidden_states_;
+  size_t hidden_states_index_{};
+
+  std::unique_ptr<OffloadedLayers_State> offload_state_;
+};
+
+}  // namespace Generators
@@ -345,6 +345,13 @@ struct OrtCUDAProviderOptionsV2 {
   Ort::Abstract make_abstract;
 };
 
+struct OrtPrepackedWeightsContainer {
+  static std::unique_ptr<OrtPrepackedWeightsContainer> Create();  ///< Wraps OrtApi::CreatePrepackedWeightsContainer
+
+  static void operator delete(void* p) { Ort::api->ReleasePrepackedWeightsContainer(reinterpret_cast<OrtPrepackedWeightsContainer*>(p)); }
+  Ort::Abstract make_abstract;
+};
+
 /** \brief Options object used when creating a new Session object
  *
  * Wraps ::OrtSessionOptions object and methods
@@ -380,8 +387,11 @@ struct OrtSessionOptions {
   OrtSessionOptions& DisablePerSessionThreads();  ///< Wraps OrtApi::DisablePerSessionThreads
 
   OrtSessionOptions& AddConfigEntry(const char* config_key, const char* config_value);                                                          ///< Wraps OrtApi::AddSessionConfigEntry
+  std::string GetConfigEntry(const char* config_key) const;                                                                                     ///< Wraps OrtApi::GetSessionConfigEntry
   OrtSessionOptions& AddInitializer(const char* name, const OrtValue& ort_val);                                                                 ///< Wraps OrtApi::AddInitializer
   OrtSessionOptions& AddExternalInitializers(const std::vector<std::string>& names, const std::vector<std::unique_ptr<OrtValue>>& ort_values);  ///< Wraps OrtApi::AddExternalInitializers
+  OrtSessionOptions& AddExternalInitializersFromFilesInMemory(const std::vector<const ORTCHAR_T*>& file_names, const std::vector<char*>& buffers,
+                                                              const std::vector<size_t>& lengths);  ///< Wraps OrtApi::AddExternalInitializersFromFilesInMemory
 
   OrtSessionOptions& AppendExecutionProvider_CUDA(const OrtCUDAProviderOptions& provider_options);               ///< Wraps OrtApi::SessionOptionsAppendExecutionProvider_CUDA
   OrtSessionOptions& AppendExecutionProvider_CUDA_V2(const OrtCUDAProviderOptionsV2& provider_options);          ///< Wraps OrtApi::SessionOptionsAppendExecutionProvider_CUDA_V2
@@ -405,6 +405,12 @@ inline std::unique_ptr<OrtRunOptions> OrtRunOptions::Create() {
   return std::unique_ptr<OrtRunOptions>{p};
 }
 
+inline std::unique_ptr<OrtPrepackedWeightsContainer> OrtPrepackedWeightsContainer::Create() {
+  OrtPrepackedWeightsContainer* p;
+  Ort::ThrowOnError(Ort::api->CreatePrepackedWeightsContainer(&p));
+  return std::unique_ptr<OrtPrepackedWeightsContainer>{p};
+}
+
 inline OrtRunOptions& OrtRunOptions::SetRunLogVerbosityLevel(int level) {
   Ort::ThrowOnError(Ort::api->RunOptionsSetRunLogVerbosityLevel(this, level));
   return *this;
@@ -559,6 +565,15 @@ inline OrtSessionOptions& OrtSessionOptions::AddConfigEntry(const char* config_k
   return *this;
 }
 
+inline std::string OrtSessionOptions::GetConfigEntry(const char* config_key) const {
+  size_t size{};
+  Ort::ThrowOnError(Ort::api->GetSessionConfigEntry(this, config_key, nullptr, &size));
+  std::string value(size, '\0');
+  Ort::ThrowOnError(Ort::api->GetSessionConfigEntry(this, config_key, value.data(), &size));
+  value.resize(size - 1);  // The size counts the terminating null
+  return value;
+}
+
 inline OrtSessionOptions& OrtSessionOptions::AddInitializer(const char* name, const OrtValue& ort_val) {
   Ort::ThrowOnError(Ort::api->AddInitializer(this, name, &ort_val));
   return *this;
@@ -587,6 +602,17 @@ inline OrtSessionOptions& OrtSessionOptions::AddExternalInitializers(const std::
   return *this;
 }
 
+inline OrtSessionOptions& OrtSessionOptions::AddExternalInitializersFromFilesInMemory(const std::vector<const ORTCHAR_T*>& file_names,
+                                                                                      const std::vector<char*>& buffers,
+                                                                                      const std::vector<size_t>& lengths) {
+  const size_t files_num = file_names.size();
+  if (files_num != buffers.size() || files_num != lengths.size()) {
+    Ort::ThrowOnError(OrtStatus::Create(ORT_INVALID_ARGUMENT, "Expecting file_names, buffers and lengths to have the same length").get());
+  }
+  Ort::ThrowOnError(Ort::api->AddExternalInitializersFromFilesInMemory(this, file_names.data(), buffers.data(), lengths.data(), files_num));
+  return *this;
+}
+
 inline OrtSessionOptions& OrtSessionOptions::AppendExecutionProvider_CUDA(const OrtCUDAProviderOptions& provider_options) {
   Ort::ThrowOnError(Ort::api->SessionOptionsAppendExecutionProvider_CUDA(this, &provider_options));
   return *this;
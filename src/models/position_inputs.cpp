@@ -9,7 +9,7 @@
 
 namespace Generators {
 
-PositionInputs::PositionInputs(const Model& model, State& state, RoamingArray<int32_t>& sequence_lengths_unk)
+PositionInputs::PositionInputs(const Model& model, State& state, RoamingArray<int32_t>& sequence_lengths_unk, std::span<const int32_t> prefix_tokens)
     : model_{model},
       state_{state} {
   has_mask_input_ = model_.session_info_->HasInput(model_.config_->model.decoder.inputs.attention_mask);
@@ -31,29 +31,74 @@ PositionInputs::PositionInputs(const Model& model, State& state, RoamingArray<in
   if (type_ != Ort::TypeToTensorType<int32_t>::type && type_ != Ort::TypeToTensorType<int64_t>::type)
     throw std::runtime_error("position_ids & attention_mask only support int32 or int64 types");
 
+  auto& inputs = model_.config_->model.decoder.inputs;
+  has_seqlens_input_ = !has_mask_input_ && model_.session_info_->HasInput(inputs.seqlens_k) && model_.session_info_->HasInput(inputs.total_sequence_length);
+  if (has_seqlens_input_) {
+    if (model_.session_info_->GetInputDataType(inputs.seqlens_k) != Ort::TypeToTensorType<int32_t>::type ||
+        model_.session_info_->GetInputDataType(inputs.total_sequence_length) != Ort::TypeToTensorType<int32_t>::type)
+      throw std::runtime_error("seqlens_k & total_seq_len must be int32");
+    if (!OnHost(model_.device_type_) && model_.device_type_ != DeviceType::CUDA)
+      throw std::runtime_error("seqlens_k & total_seq_len inputs are only supported on CPU and CUDA, the model needs an attention_mask");
+    if (model_.config_->model.decoder.kv_cache.window_size > 0)
+      throw std::runtime_error("kv_cache window_size needs an attention_mask input, the evicted tokens can't be taken out of seqlens_k");
+  }
+
+  auto& lengths = state_.params_->input_lengths;
+  if (!lengths.empty()) {
+    if (lengths.size() != static_cast<size_t>(state_.params_->batch_size))
+      throw std::runtime_error("input_lengths has " + std::to_string(lengths.size()) + " rows, the batch size is " + std::to_string(state_.params_->batch_size));
+    for (auto length : lengths) {
+      if (length <= 0 || length > state_.params_->sequence_length)
+        throw std::runtime_error("input_lengths must be between 1 and the sequence length");
+    }
+    if (state_.params_->pad_left && has_seqlens_input_)
+      throw std::runtime_error("seqlens_k & total_seq_len inputs need right padded prompts, the model needs an attention_mask for pad_left");
+  }
+
   std::array<int64_t, 2> shape{state_.params_->batch_size, state_.params_->sequence_length};  // Only batch_size initially, as we haven't expanded over the beams yet
+  int64_t prefix_length = static_cast<int64_t>(prefix_tokens.size()) / shape[0];
+  std::array<int64_t, 2> mask_shape{shape[0], prefix_length + shape[1]};  // The mask also covers any prefix
   position_ids_ = OrtValue::CreateTensor(model.allocator_cpu_, shape, type_);
   position_ids_next_ = OrtValue::CreateTensor(model.allocator_cpu_, std::array<int64_t, 2>{shape[0], 1}, type_);
-  attention_mask_ = OrtValue::CreateTensor(model.allocator_cpu_, shape, type_);
+  attention_mask_ = OrtValue::CreateTensor(model.allocator_cpu_, mask_shape, type_);
 
   initial_sequence_lengths_.resize(state_.params_->BatchBeamSize());
 
   if (type_ == Ort::TypeToTensorType<int32_t>::type)
-    InitializeTensors<int32_t>(shape, sequence_lengths_unk);
+    InitializeTensors<int32_t>(shape, sequence_lengths_unk, prefix_tokens);
   else
-    InitializeTensors<int64_t>(shape, sequence_lengths_unk);
+    InitializeTensors<int64_t>(shape, sequence_lengths_unk, prefix_tokens);
+
+  if (has_seqlens_input_) {
+    // What the mask would reduce to, so it's only built on the cpu
+    seqlens_k_ = OrtValue::CreateTensor<int32_t>(model.allocator_cpu_, std::array<int64_t, 1>{shape[0]});
+    auto* seqlens_k = seqlens_k_->GetTensorMutableData<int32_t>();
+    for (int64_t i = 0; i < shape[0]; i++)
+      seqlens_k[i] = initial_sequence_lengths_[i * state_.params_->search.num_beams] - 1;
+    seqlens_k_ = model_.ExpandInputs(seqlens_k_, state_.params_->search.num_beams);
+    seqlens_k_shape_ = {shape[0] * state_.params_->search.num_beams};
+
+    total_seq_len_ = OrtValue::CreateTensor<int32_t>(model.allocator_cpu_, std::array<int64_t, 0>{});
+    *total_seq_len_->GetTensorMutableData<int32_t>() = static_cast<int32_t>(mask_shape[1]);
+  }
 
   position_ids_ = model_.ExpandInputs(position_ids_, state_.params_->search.num_beams);
   position_ids_next_ = model_.ExpandInputs(position_ids_next_, state_.params_->search.num_beams);
-  attention_mask_ = model_.ExpandInputs(attention_mask_, state_.params_->search.num_beams);
+  if (has_mask_input_)
+    attention_mask_ = model_.ExpandInputs(attention_mask_, state_.params_->search.num_beams);
   shape[0] *= state_.params_->search.num_beams;
+  mask_shape[0] = shape[0];
   position_ids_shape_ = shape;
-  attention_mask_shape_ = shape;
+  attention_mask_shape_ = mask_shape;
+  kv_length_ = static_cast<int>(mask_shape[1]);
 
   if (state_.GetCapturedGraphInfo()) {
     if (has_posid_input_) {
       sb_position_ids_ = state_.GetCapturedGraphInfo()->sb_position_ids_.get();
     }
+    if (has_seqlens_input_) {
+      sb_seqlens_k_ = state_.GetCapturedGraphInfo()->sb_seqlens_k_.get();
+    }
     if (has_mask_input_) {
       sb_attention_mask_ = state_.GetCapturedGraphInfo()->sb_attention_mask_.get();
 
@@ -73,14 +118,72 @@ void PositionInputs::Add() {
   if (has_mask_input_) {
     AddAttentionMask();
   }
+  if (has_seqlens_input_) {
+    AddSeqlens();
+  }
 }
 
 void PositionInputs::Update(int current_length) {
+  // Streaming: a current_length that didn't grow by one means the kv cache evicted the tokens after the sinks
+  int evicted = model_.config_->model.decoder.kv_cache.window_size > 0 ? kv_length_ - (current_length - 1) : 0;
+  kv_length_ = current_length;
+
   if (has_posid_input_) {
-    UpdatePositionIDs(current_length);
+    UpdatePositionIDs(current_length, evicted);
   }
   if (has_mask_input_) {
-    UpdateAttentionMask(current_length);
+    UpdateAttentionMask(current_length, evicted);
+  }
+  if (has_seqlens_input_) {
+    UpdateSeqlens(current_length);
+  }
+
+#if USE_DML
+  // The position and mask kernels are recorded once and replayed every step with a single submission
+  if (!dml_step_command_lists_.empty()) {
+    ComPtr<ID3D12Fence> fence;
+    uint64_t completion_value;
+    model_.GetDmlExecutionContext()->ExecuteCommandLists(dml_step_command_lists_, &fence, &completion_value);
+    dml_step_command_lists_.clear();
+  }
+#endif
+}
+
+// Copies the rows of a {batch_beam} or {batch_beam, length} tensor. On a static buffer it's done in place, which is fine
+// as rows is ascending so no row is overwritten before it's copied.
+static std::unique_ptr<OrtValue> KeepTensorRows(const Model& model, OrtValue& value, std::span<int64_t> shape, ONNXTensorElementDataType type,
+                                                std::span<const int32_t> rows, StaticBuffer* sb) {
+  size_t row_bytes = (shape.size() > 1 ? shape[1] : 1) * SizeOf(type);
+  shape[0] = static_cast<int64_t>(rows.size());
+  auto kept = sb ? sb->CreateTensorOnStaticBuffer(shape, type) : OrtValue::CreateTensor(*model.allocator_device_, shape, type);
+
+  auto* source = value.GetTensorData<uint8_t>();
+  auto* target = static_cast<uint8_t*>(kept->GetTensorMutableRawData());
+  for (size_t i = 0; i < rows.size(); i++) {
+    if (target + i * row_bytes == source + rows[i] * row_bytes)
+      continue;
+#if USE_CUDA
+    if (model.device_type_ == DeviceType::CUDA)
+      cudaMemcpyAsync(target + i * row_bytes, source + rows[i] * row_bytes, row_bytes, cudaMemcpyDeviceToDevice, model.cuda_stream_);
+    else
+#endif
+      std::memcpy(target + i * row_bytes, source + rows[i] * row_bytes, row_bytes);
+  }
+  return kept;
+}
+
+void PositionInputs::KeepRows(std::span<const int32_t> rows) {
+  if (has_posid_input_) {
+    position_ids_ = KeepTensorRows(model_, *position_ids_, position_ids_shape_, type_, rows, sb_position_ids_);
+    state_.inputs_[posid_input_index_] = position_ids_.get();
+  }
+  if (has_mask_input_) {
+    attention_mask_ = KeepTensorRows(model_, *attention_mask_, attention_mask_shape_, type_, rows, sb_attention_mask_);
+    state_.inputs_[mask_input_index_] = attention_mask_.get();
+  }
+  if (has_seqlens_input_) {
+    seqlens_k_ = KeepTensorRows(model_, *seqlens_k_, seqlens_k_shape_, Ort::TypeToTensorType<int32_t>::type, rows, sb_seqlens_k_);
+    state_.inputs_[seqlens_k_input_index_] = seqlens_k_.get();
   }
 }
 
@@ -98,7 +201,51 @@ void PositionInputs::AddPositionIDs() {
   state_.input_names_.push_back(model_.config_->model.decoder.inputs.position_ids.c_str());
 }
 
-void PositionInputs::UpdatePositionIDs(int current_length) {
+void PositionInputs::AddSeqlens() {
+  seqlens_k_input_index_ = state_.inputs_.size();
+  state_.inputs_.push_back(seqlens_k_.get());
+  state_.input_names_.push_back(model_.config_->model.decoder.inputs.seqlens_k.c_str());
+
+  total_seq_len_input_index_ = state_.inputs_.size();
+  state_.inputs_.push_back(total_seq_len_.get());
+  state_.input_names_.push_back(model_.config_->model.decoder.inputs.total_sequence_length.c_str());
+}
+
+// Every row gets one more token, so seqlens_k is incremented in place instead of reducing a mask
+void PositionInputs::UpdateSeqlens(int current_length) {
+  const int batch_beam_size = static_cast<int>(seqlens_k_shape_[0]);
+  if (sb_seqlens_k_ && is_first_seqlens_update_) {
+#if USE_CUDA
+    auto seqlens_k = sb_seqlens_k_->CreateTensorOnStaticBuffer(seqlens_k_shape_, Ort::TypeToTensorType<int32_t>::type);
+    cudaMemcpyAsync(seqlens_k->GetTensorMutableRawData(), seqlens_k_->GetTensorRawData(), batch_beam_size * sizeof(int32_t), cudaMemcpyDeviceToDevice, model_.cuda_stream_);
+    seqlens_k_ = std::move(seqlens_k);
+    state_.inputs_[seqlens_k_input_index_] = seqlens_k_.get();
+#endif
+  }
+  is_first_seqlens_update_ = false;
+
+  switch (model_.device_type_) {
+    case DeviceType::ROCM:
+    case DeviceType::CPU: {
+      auto* seqlens_k = seqlens_k_->GetTensorMutableData<int32_t>();
+      for (int i = 0; i < batch_beam_size; i++)
+        seqlens_k[i]++;
+      break;
+    }
+#if USE_CUDA
+    case DeviceType::CUDA:
+      cuda::Launch_UpdatePositionIds(seqlens_k_->GetTensorMutableData<int32_t>(), batch_beam_size, model_.cuda_stream_);
+      break;
+#endif
+    default:
+      throw std::runtime_error("PositionInputs::UpdateSeqlens - Unsupported device type");
+  }
+
+  // A captured graph runs on the whole static kv buffer, like the static attention mask
+  *total_seq_len_->GetTensorMutableData<int32_t>() = sb_seqlens_k_ ? state_.params_->BufferMaxLength() : current_length;
+}
+
+void PositionInputs::UpdatePositionIDs(int current_length, int evicted) {
   // Reallocate position_ids for the 2nd and onward shape
   if (is_first_posid_update_) {
     position_ids_shape_[1] = 1;
@@ -149,6 +296,11 @@ void PositionInputs::UpdatePositionIDs(int current_length) {
     }
     is_first_posid_update_ = false;
     state_.inputs_[posid_input_index_] = position_ids_.get();
+    if (evicted > 0)
+      ShiftPositionIDs(-evicted);
+  } else if (evicted > 0) {  // Streaming: the new token takes the place of the evicted ones
+    if (evicted > 1)
+      ShiftPositionIDs(1 - evicted);
   } else {  // Just incrementing existing position IDs
     switch (model_.device_type_) {
 #if USE_DML
@@ -166,12 +318,11 @@ void PositionInputs::UpdatePositionIDs(int current_length) {
               target_resource.Get());
         }
 
-        // Execute the cached command list
-        ComPtr<ID3D12Fence> fence;
-        uint64_t completion_value;
-        model_.GetDmlExecutionContext()->ExecuteCommandList(dml_update_position_ids_kernel_->GetCommandList(), &fence, &completion_value);
+        // The cached command list is executed with the mask update at the end of Update
+        dml_step_command_lists_.push_back(dml_update_position_ids_kernel_->GetCommandList());
       } break;
 #endif
+      case DeviceType::ROCM:
       case DeviceType::CPU: {
         if (type_ == Ort::TypeToTensorType<int32_t>::type)
           UpdatePositionIDsImpl<int32_t>();
@@ -193,11 +344,76 @@ void PositionInputs::UpdatePositionIDs(int current_length) {
   }
 }
 
-void PositionInputs::UpdateAttentionMask(int current_length) {
+void PositionInputs::ShiftPositionIDs(int delta) {
+  auto shift = [&](auto* data) {
+    for (int i = 0; i < position_ids_shape_[0]; i++)
+      data[i] += delta;
+  };
+
+  switch (model_.device_type_) {
+    case DeviceType::ROCM:
+    case DeviceType::CPU:
+      if (type_ == Ort::TypeToTensorType<int32_t>::type)
+        shift(position_ids_->GetTensorMutableData<int32_t>());
+      else
+        shift(position_ids_->GetTensorMutableData<int64_t>());
+      break;
+#if USE_CUDA
+    case DeviceType::CUDA:
+      if (type_ == Ort::TypeToTensorType<int32_t>::type)
+        cuda::Launch_ShiftPositionIds(position_ids_->GetTensorMutableData<int32_t>(), static_cast<int>(position_ids_shape_[0]), delta, model_.cuda_stream_);
+      else
+        cuda::Launch_ShiftPositionIds(position_ids_->GetTensorMutableData<int64_t>(), static_cast<int>(position_ids_shape_[0]), delta, model_.cuda_stream_);
+      break;
+#endif
+    default:
+      throw std::runtime_error("kv_cache window_size is only supported on CPU and CUDA");
+  }
+}
+
+// Drops the mask of the tokens the kv cache evicted, they come right after the sinks
+void PositionInputs::EvictAttentionMask(int evicted) {
+  std::array<int64_t, 2> shape{attention_mask_shape_[0], attention_mask_shape_[1] - evicted};
+  auto evicted_mask = OrtValue::CreateTensor(*model_.allocator_device_, shape, type_);
+
+  size_t element_bytes = SizeOf(type_);
+  size_t source_pitch = attention_mask_shape_[1] * element_bytes;
+  size_t target_pitch = shape[1] * element_bytes;
+  size_t sink_bytes = std::min<int64_t>(model_.config_->model.decoder.kv_cache.sink_size, shape[1]) * element_bytes;
+  auto* source = attention_mask_->GetTensorData<uint8_t>();
+  auto* target = static_cast<uint8_t*>(evicted_mask->GetTensorMutableRawData());
+  const uint8_t* source_tail = source + sink_bytes + evicted * element_bytes;
+  uint8_t* target_tail = target + sink_bytes;
+  size_t tail_bytes = target_pitch - sink_bytes;
+
+  switch (model_.device_type_) {
+    case DeviceType::ROCM:
+    case DeviceType::CPU:
+      for (int64_t row = 0; row < shape[0]; row++) {
+        std::memcpy(target + row * target_pitch, source + row * source_pitch, sink_bytes);
+        std::memcpy(target_tail + row * target_pitch, source_tail + row * source_pitch, tail_bytes);
+      }
+      break;
+#if USE_CUDA
+    case DeviceType::CUDA:
+      if (sink_bytes > 0)
+        cudaMemcpy2DAsync(target, target_pitch, source, source_pitch, sink_bytes, shape[0], cudaMemcpyDeviceToDevice, model_.cuda_stream_);
+      cudaMemcpy2DAsync(target_tail, target_pitch, source_tail, source_pitch, tail_bytes, shape[0], cudaMemcpyDeviceToDevice, model_.cuda_stream_);
+      break;
+#endif
+    default:
+      throw std::runtime_error("kv_cache window_size is only supported on CPU and CUDA");
+  }
+
+  attention_mask_ = std::move(evicted_mask);
+  attention_mask_shape_ = shape;
+}
+
+void PositionInputs::UpdateAttentionMask(int current_length, int evicted) {
   // Update attention mask
   if (sb_attention_mask_) {
 #if USE_CUDA
-    attention_mask_shape_[1] = state_.params_->search.max_length;
+    attention_mask_shape_[1] = state_.params_->BufferMaxLength();
     attention_mask_next_ = sb_attention_mask_->CreateTensorOnStaticBuffer(attention_mask_shape_, type_);
     if (is_first_mask_update_) {
       if (type_ == Ort::TypeToTensorType<int32_t>::type) {
@@ -213,14 +429,21 @@ void PositionInputs::UpdateAttentionMask(int current_length) {
       }
     }
 #elif USE_DML
-    attention_mask_shape_[1] = state_.params_->search.max_length;
+    attention_mask_shape_[1] = state_.params_->BufferMaxLength();
     attention_mask_ = sb_attention_mask_->CreateTensorOnStaticBuffer(attention_mask_shape_, type_);
     attention_mask_next_ = sb_attention_mask_next_->CreateTensorOnStaticBuffer(attention_mask_shape_, type_);
 #endif
   } else {
+    if (evicted > 0)
+      EvictAttentionMask(evicted);
     assert(attention_mask_shape_[1] == current_length - 1);  // We should always be growing by 1
     attention_mask_shape_[1] = current_length;
 
+    if (attention_mask_shape_[0] == 1 && (OnHost(model_.device_type_) || model_.device_type_ == DeviceType::CUDA)) {
+      AppendAttentionMask(current_length);
+      return;
+    }
+
 #if USE_DML
     if (model_.device_type_ == DeviceType::DML) {
       attention_mask_ = OrtValue::CreateTensor(*model_.allocator_device_, attention_mask_shape_, type_);
@@ -263,12 +486,11 @@ void PositionInputs::UpdateAttentionMask(int current_length) {
         is_second_mask_update_ = false;
       }
 
-      ComPtr<ID3D12Fence> fence;
-      uint64_t completion_value;
-      model_.GetDmlExecutionContext()->ExecuteCommandList(dml_update_mask_kernel_->GetCommandList(), &fence, &completion_value);
+      dml_step_command_lists_.push_back(dml_update_mask_kernel_->GetCommandList());
       break;
     }
 #endif
+    case DeviceType::ROCM:
     case DeviceType::CPU: {
       if (type_ == Ort::TypeToTensorType<int32_t>::type)
         UpdateAttentionMaskImpl(attention_mask_next_->GetTensorMutableData<int32_t>(),
@@ -282,7 +504,7 @@ void PositionInputs::UpdateAttentionMask(int current_length) {
     }
 #if USE_CUDA
     case DeviceType::CUDA: {
-      int max_seq_len = sb_attention_mask_ ? state_.params_->search.max_length : current_length;
+      int max_seq_len = sb_attention_mask_ ? state_.params_->BufferMaxLength() : current_length;
       bool update_only = sb_attention_mask_ && !is_first_mask_update_;
       if (type_ == Ort::TypeToTensorType<int32_t>::type) {
         cuda::Launch_UpdateAttentionMask(attention_mask_next_->GetTensorMutableData<int32_t>(),
@@ -321,20 +543,79 @@ void PositionInputs::UpdateAttentionMask(int current_length) {
   is_first_mask_update_ = false;
 }
 
+// A single row mask has no row pitch to keep, so it grows in place: only the new token's column is written and the
+// mask becomes a view of one more value of the buffer
+void PositionInputs::AppendAttentionMask(int current_length) {
+  const size_t element_bytes = SizeOf(type_);
+  const size_t old_bytes = static_cast<size_t>(current_length - 1) * element_bytes;
+  if (!attention_mask_buffer_) {
+    const std::array<int64_t, 2> buffer_shape{1, std::max(state_.params_->BufferMaxLength(), current_length)};
+    attention_mask_buffer_ = OrtValue::CreateTensor(*model_.allocator_device_, buffer_shape, type_);
+  }
+  auto* buffer = static_cast<uint8_t*>(attention_mask_buffer_->GetTensorMutableRawData());
+
+  // The first update, or the mask was replaced by an eviction or KeepRows
+  if (attention_mask_->GetTensorRawData() != buffer) {
+#if USE_CUDA
+    if (model_.device_type_ == DeviceType::CUDA)
+      cudaMemcpyAsync(buffer, attention_mask_->GetTensorRawData(), old_bytes, cudaMemcpyDeviceToDevice, model_.cuda_stream_);
+    else
+#endif
+      std::memcpy(buffer, attention_mask_->GetTensorRawData(), old_bytes);
+  }
+
+  switch (model_.device_type_) {
+    case DeviceType::ROCM:
+    case DeviceType::CPU:
+      if (type_ == Ort::TypeToTensorType<int32_t>::type)
+        reinterpret_cast<int32_t*>(buffer)[current_length - 1] = 1;
+      else
+        reinterpret_cast<int64_t*>(buffer)[current_length - 1] = 1;
+      break;
+#if USE_CUDA
+    case DeviceType::CUDA: {
+      int max_length = static_cast<int>(attention_mask_buffer_->GetTensorTypeAndShapeInfo()->GetShape()[1]);
+      if (type_ == Ort::TypeToTensorType<int32_t>::type)
+        cuda::Launch_UpdateAttentionMask(reinterpret_cast<int32_t*>(buffer), nullptr, 1, current_length - 1, max_length, true, model_.cuda_stream_);
+      else
+        cuda::Launch_UpdateAttentionMask(reinterpret_cast<int64_t*>(buffer), nullptr, 1, current_length - 1, max_length, true, model_.cuda_stream_);
+      break;
+    }
+#endif
+    default:
+      throw std::runtime_error("AppendAttentionMask - Unsupported device type");
+  }
+
+  attention_mask_ = OrtValue::CreateTensor(attention_mask_buffer_->GetTensorMemoryInfo(), buffer, old_bytes + element_bytes, attention_mask_shape_, type_);
+  state_.inputs_[mask_input_index_] = attention_mask_.get();
+  is_first_mask_update_ = false;
+}
+
 template <typename T>
-void PositionInputs::InitializeTensors(std::array<int64_t, 2> shape, cpu_span<int32_t> sequence_lengths) {
+void PositionInputs::InitializeTensors(std::array<int64_t, 2> shape, cpu_span<int32_t> sequence_lengths, std::span<const int32_t> prefix_tokens) {
   // Set attention mask to be 0 for pad tokens, and 1 for all other tokens.
   // Set position id to be 0 for pad tokens, and accumulated sum of mask in a batch for other tokens
+  // Prefix tokens only contribute to the mask and the positions, their kv is already in the past
   auto* mask_data = attention_mask_->GetTensorMutableData<T>();
   auto* position_data = position_ids_->GetTensorMutableData<T>();
   auto* position_data_next = position_ids_next_->GetTensorMutableData<T>();
   const auto* word_id = state_.params_->input_ids.data();
+  const auto* prefix_word_id = prefix_tokens.data();
+  const size_t prefix_length = prefix_tokens.size() / shape[0];
+  auto& lengths = state_.params_->input_lengths;  // When known, the padding is told apart by position and not token
   auto* mask = mask_data;
   auto* position = position_data;
   for (int i = 0; i < shape[0]; i++) {
     T abs_position = 0;
+    for (size_t j = 0; j < prefix_length; j++, prefix_word_id++, mask++) {
+      *mask = *prefix_word_id != state_.params_->pad_token_id;
+      abs_position += *mask;
+    }
+    const int64_t tokens_begin = !lengths.empty() && state_.params_->pad_left ? shape[1] - lengths[i] : 0;
+    const int64_t tokens_end = !lengths.empty() && !state_.params_->pad_left ? lengths[i] : shape[1];
     for (int j = 0; j < shape[1]; j++, word_id++, mask++, position++) {
-      if (*word_id == state_.params_->pad_token_id) {
+      const bool is_pad = lengths.empty() ? *word_id == state_.params_->pad_token_id : j < tokens_begin || j >= tokens_end;
+      if (is_pad) {
         *mask = 0;
         *position = 0;
       } else {
@@ -363,9 +644,7 @@ void PositionInputs::UpdatePositionIDsImpl() {
 template <typename T>
 void PositionInputs::UpdateAttentionMaskImpl(T* data, const T* old_data, int current_length) {
   for (int i = 0; i < attention_mask_shape_[0]; i++) {
-    for (int j = 0; j < current_length - 1; j++) {
-      data[i * current_length + j] = old_data[i * (current_length - 1) + j];
-    }
+    std::copy_n(old_data + i * (current_length - 1), current_length - 1, data + i * current_length);
     data[i * current_length + current_length - 1] = 1;
   }
 };
@@ -10,20 +10,29 @@
 namespace Generators {
 
 struct PositionInputs {
-  PositionInputs(const Model& model, State& state, RoamingArray<int32_t>& sequence_lengths);
+  // prefix_tokens are the {batch_size, prefix_length} prompt tokens already in the past kv, ahead of the input_ids
+  PositionInputs(const Model& model, State& state, RoamingArray<int32_t>& sequence_lengths, std::span<const int32_t> prefix_tokens = {});
 
   void Add();
   void Update(int current_length);
+  // Compacting finished rows: keeps only these rows (ascending indices into the current batch), call after Update()
+  void KeepRows(std::span<const int32_t> rows);
 
  private:
   void AddAttentionMask();
   void AddPositionIDs();
+  void AddSeqlens();
 
-  void UpdatePositionIDs(int current_length);
-  void UpdateAttentionMask(int current_length);
+  // evicted is the number of tokens the kv cache dropped in streaming mode (model.decoder.kv_cache.window_size)
+  void UpdatePositionIDs(int current_length, int evicted);
+  void UpdateAttentionMask(int current_length, int evicted);
+  void ShiftPositionIDs(int delta);
+  void EvictAttentionMask(int evicted);
+  void AppendAttentionMask(int current_length);
+  void UpdateSeqlens(int current_length);
 
   template <typename T>
-  void InitializeTensors(std::array<int64_t, 2> shape, cpu_span<int32_t> sequence_lengths);
+  void InitializeTensors(std::array<int64_t, 2> shape, cpu_span<int32_t> sequence_lengths, std::span<const int32_t> prefix_tokens);
 
   template <typename T>
   void UpdatePositionIDsImpl();
@@ -40,6 +49,10 @@ struct PositionInputs {
 
   bool has_mask_input_{false};
   bool has_posid_input_{false};
+  // GroupQueryAttention models can take seqlens_k and total_seq_len instead of the mask they'd be computed from
+  bool has_seqlens_input_{false};
+  size_t seqlens_k_input_index_{~0U};
+  size_t total_seq_len_input_index_{~0U};
 
   std::array<int64_t, 2> position_ids_shape_{};  // {params.batch_size*params.beam_size, params.sequence_length}
   std::unique_ptr<OrtValue> position_ids_;
@@ -48,20 +61,28 @@ struct PositionInputs {
 
   std::unique_ptr<OrtValue> position_ids_next_;    // Replaces position_ids_ after the first Run() call
   std::unique_ptr<OrtValue> attention_mask_next_;  // Replaces attention_mask_ after the first Run() call
+  std::unique_ptr<OrtValue> attention_mask_buffer_;  // {1, BufferMaxLength}, a single row mask is a view of its start
+  std::array<int64_t, 1> seqlens_k_shape_{};  // {params.batch_size*params.beam_size}
+  std::unique_ptr<OrtValue> seqlens_k_;       // int32, the kv length of every row minus one
+  std::unique_ptr<OrtValue> total_seq_len_;   // int32 scalar on the cpu, the length of the kv
   std::vector<int32_t> initial_sequence_lengths_;
+  int kv_length_{};  // Tokens in the kv after the last run, the positions are relative to it
 
   // Used for decoding runs with cuda graphs.
   StaticBuffer* sb_position_ids_{};
   StaticBuffer* sb_attention_mask_{};
+  StaticBuffer* sb_seqlens_k_{};
 
   bool is_first_posid_update_{true};
   bool is_first_mask_update_{true};
+  bool is_first_seqlens_update_{true};
 
 #if USE_DML
   std::optional<DmlUpdateMaskKernel> dml_update_mask_kernel_;
   StaticBuffer* sb_attention_mask_next_{};
   std::optional<DmlIncrementValuesKernel> dml_update_position_ids_kernel_;
   bool is_second_mask_update_{};
+  std::vector<ID3D12GraphicsCommandList*> dml_step_command_lists_;  // The kernels of an Update, submitted together
 #endif
 };
 
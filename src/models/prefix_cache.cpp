@@ -0,0 +1,140 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include "../generators.h"
+#include "prefix_cache.h"
+
+namespace Generators {
+
+PrefixCache::PrefixCache(int max_entries, int chunk_size, size_t max_bytes)
+    : max_entries_{max_entries},
+      chunk_size_{chunk_size},
+      max_bytes_{max_bytes} {
+  if (chunk_size_ <= 0)
+    throw std::runtime_error("kv_cache prefix_chunk_size must be greater than 0");
+}
+
+size_t PrefixCache::HashChunk(size_t seed, std::span<const int32_t> chunk) {
+  for (auto token : chunk)
+    seed ^= std::hash<int32_t>()(token) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+  return seed;
+}
+
+std::shared_ptr<const PrefixCache::Entry> PrefixCache::Find(std::span<const int32_t> tokens, int& prefix_length) {
+  prefix_length = 0;
+  if (tokens.empty())
+    return {};
+  int chunk_count = static_cast<int>(tokens.size() - 1) / chunk_size_;
+  if (chunk_count == 0)
+    return {};
+
+  std::vector<size_t> hashes(chunk_count);
+  size_t hash = 0;
+  for (int i = 0; i < chunk_count; i++)
+    hashes[i] = hash = HashChunk(hash, tokens.subspan(i * chunk_size_, chunk_size_));
+
+  std::lock_guard lock(mutex_);
+  for (int i = chunk_count; i > 0; i--) {
+    auto it = prefixes_.find(hashes[i - 1]);
+    if (it == prefixes_.end())
+      continue;
+
+    auto& entry = it->second;
+    size_t length = static_cast<size_t>(i) * chunk_size_;
+    if (entry->tokens.size() < length || !std::equal(tokens.begin(), tokens.begin() + length, entry->tokens.begin()))
+      continue;  // Hash collision
+
+    entries_.remove(entry);
+    entries_.push_front(entry);
+    prefix_length = static_cast<int>(length);
+    return entry;
+  }
+  return {};
+}
+
+std::shared_ptr<PrefixCache::Entry> PrefixCache::FindCovering(std::span<const int32_t> tokens) {
+  size_t hash = 0;
+  for (size_t i = 0; i < tokens.size(); i += chunk_size_)
+    hash = HashChunk(hash, tokens.subspan(i, chunk_size_));
+  auto it = prefixes_.find(hash);
+  if (it == prefixes_.end())
+    return {};
+  auto& entry = it->second;
+  if (entry->tokens.size() < tokens.size() || !std::equal(tokens.begin(), tokens.end(), entry->tokens.begin()))
+    return {};  // Hash collision
+  return entry;
+}
+
+bool PrefixCache::Contains(std::span<const int32_t> tokens) {
+  assert(!tokens.empty() && tokens.size() % chunk_size_ == 0);
+  std::lock_guard lock(mutex_);
+  if (auto entry = FindCovering(tokens)) {
+    entries_.remove(entry);
+    entries_.push_front(std::move(entry));
+    return true;
+  }
+  return false;
+}
+
+void PrefixCache::Insert(std::vector<int32_t> tokens, std::vector<std::unique_ptr<OrtValue>> values) {
+  assert(!tokens.empty() && tokens.size() % chunk_size_ == 0);
+
+  auto entry = std::make_shared<Entry>();
+  entry->tokens = std::move(tokens);
+  entry->values = std::move(values);
+  for (auto& value : entry->values) {
+    auto type_info = value->GetTensorTypeAndShapeInfo();
+    entry->bytes += type_info->GetElementCount() * SizeOf(type_info->GetElementType());
+  }
+  if (max_bytes_ != 0 && entry->bytes > max_bytes_)
+    return;  // It would evict everything and still not fit
+
+  std::lock_guard lock(mutex_);
+  if (auto covering = FindCovering(entry->tokens)) {  // Another generator with the same prompt got here first
+    entries_.remove(covering);
+    entries_.push_front(std::move(covering));
+    return;
+  }
+
+  size_t hash = 0;
+  for (size_t i = 0; i < entry->tokens.size(); i += chunk_size_) {
+    hash = HashChunk(hash, std::span<const int32_t>(entry->tokens).subspan(i, chunk_size_));
+    auto& prefix = prefixes_[hash];
+    // An entry that ends at this boundary is a prefix of the new one, which covers everything it did
+    if (prefix && prefix->tokens.size() == i + chunk_size_ && std::equal(prefix->tokens.begin(), prefix->tokens.end(), entry->tokens.begin()))
+      Remove(std::shared_ptr<Entry>(prefix));
+    prefixes_[hash] = entry;  // A newer entry covers the same prefix just as well, so it's fine to replace
+  }
+  bytes_ += entry->bytes;
+  entries_.push_front(std::move(entry));
+  Evict();
+}
+
+void PrefixCache::Remove(const std::shared_ptr<Entry>& entry) {
+  entries_.remove(entry);
+  bytes_ -= entry->bytes;
+
+  // Only drop the hashes that still point to this entry, newer entries may have taken some of them over
+  for (auto it = prefixes_.begin(); it != prefixes_.end();) {
+    if (it->second == entry)
+      it = prefixes_.erase(it);
+    else
+      ++it;
+  }
+}
+
+size_t PrefixCache::Bytes() {
+  std::lock_guard lock(mutex_);
+  return bytes_;
+}
+
+size_t PrefixCache::EntryCount() {
+  std::lock_guard lock(mutex_);
+  return entries_.size();
+}
+
+void PrefixCache::Evict() {
+  while (static_cast<int>(entries_.size()) > max_entries_ || (max_bytes_ != 0 && bytes_ > max_bytes_))
+    Remove(std::shared_ptr<Entry>(entries_.back()));
+}
+
+}  // namespace Generators
@@ -0,0 +1,56 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+#include <list>
+#include <mutex>
+
+namespace Generators {
+
+// Model wide cache of the kv produced by earlier prompts, so a generator whose prompt starts with a cached prefix
+// only has to run the uncached suffix. Prefixes are hashed in multiples of chunk_size tokens, a lookup walks the
+// prompt's chunk boundaries from the longest down and takes the first one that matches. Entries are least recently
+// used evicted once there are more than max_entries, or once they hold more than max_bytes of kv when it isn't 0.
+struct PrefixCache {
+  struct Entry {
+    std::vector<int32_t> tokens;                    // Always a multiple of chunk_size long
+    std::vector<std::unique_ptr<OrtValue>> values;  // Past key/value per layer {1, num_key_value_heads, tokens.size(), head_size}
+    size_t bytes{};                                 // Of values
+  };
+
+  PrefixCache(int max_entries, int chunk_size, size_t max_bytes = 0);
+
+  // Returns the entry with the longest cached prefix of tokens, leaving at least one token uncached so the prompt run
+  // still produces logits. prefix_length receives how many tokens of the entry apply.
+  std::shared_ptr<const Entry> Find(std::span<const int32_t> tokens, int& prefix_length);
+
+  // True if an entry already covers all of tokens, a multiple of chunk_size long, so the caller can skip copying the kv
+  // for Insert
+  bool Contains(std::span<const int32_t> tokens);
+
+  // tokens is the prompt the values were produced for, it's truncated to a multiple of chunk_size by the caller. Does
+  // nothing if an entry already covers tokens, and replaces the entries that tokens extends.
+  void Insert(std::vector<int32_t> tokens, std::vector<std::unique_ptr<OrtValue>> values);
+
+  size_t Bytes();
+  size_t EntryCount();
+
+  int ChunkSize() const { return chunk_size_; }
+
+ private:
+  static size_t HashChunk(size_t seed, std::span<const int32_t> chunk);
+  std::shared_ptr<Entry> FindCovering(std::span<const int32_t> tokens);  // With mutex_ held
+  void Remove(const std::shared_ptr<Entry>& entry);                       // With mutex_ held
+  void Evict();
+
+  int max_entries_;
+  int chunk_size_;
+  size_t max_bytes_;
+  size_t bytes_{};
+
+  std::list<std::shared_ptr<Entry>> entries_;  // Most recently used at the front
+  std::unordered_map<size_t, std::shared_ptr<Entry>> prefixes_;  // Hash of every chunk aligned prefix of an entry
+  std::mutex mutex_;
+};
+
+}  // namespace Generators
@@ -2,6 +2,7 @@
 // Licensed under the MIT License.
 
 #include "../generators.h"
+#include "../thread_pool.h"
 #include "model.h"
 
 #include <regex>
@@ -11,9 +12,8 @@ namespace Generators {
 namespace {
 
 std::unique_ptr<OrtValue> ProcessImagePrompt(const Generators::Tokenizer& tokenizer, const std::string& prompt,
-                                             ortc::Tensor<int64_t>* num_img_tokens, Ort::Allocator& allocator) {
-  const size_t num_images = num_img_tokens ? num_img_tokens->NumberOfElement() : 0U;
-  auto* num_img_tokens_data = num_img_tokens ? num_img_tokens->Data() : nullptr;
+                                             std::span<const int64_t> num_img_tokens, Ort::Allocator& allocator) {
+  const size_t num_images = num_img_tokens.size();
 
   // Split the prompt string based on the occurrences of the pattern "<|image_<numder>|>"
   // Here the <number> represents the image id.
@@ -60,7 +60,7 @@ std::unique_ptr<OrtValue> ProcessImagePrompt(const Generators::Tokenizer& tokeni
                                     std::to_string(num_images) + ". Actual value: " + std::to_string(image_ids[i]);
         throw std::runtime_error(error_message);
       }
-      for (size_t j = 0; j < num_img_tokens_data[image_ids[i] - 1]; ++j) {
+      for (int64_t j = 0; j < num_img_tokens[image_ids[i] - 1]; ++j) {
         input_ids.push_back(-image_ids[i]);
       }
     }
@@ -73,88 +73,220 @@ std::unique_ptr<OrtValue> ProcessImagePrompt(const Generators::Tokenizer& tokeni
   return input_ids_value;
 }
 
-std::unique_ptr<OrtValue> ProcessPixelValues(ortc::Tensor<float>* pixel_values, ONNXTensorElementDataType expected_type,
-                                             Ort::Allocator& allocator) {
-  if (!(expected_type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT || expected_type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16)) {
-    throw std::runtime_error("Expected pixel_values to be of type float or float16. Actual: " + expected_type);
-  }
-  auto pixel_values_value = expected_type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT
-                                ? OrtValue::CreateTensor<float>(allocator, pixel_values->Shape())
-                                : OrtValue::CreateTensor<Ort::Float16_t>(allocator, pixel_values->Shape());
-  if (expected_type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT) {
-    std::copy(pixel_values->Data(), pixel_values->Data() + pixel_values->NumberOfElement(),
-              pixel_values_value->GetTensorMutableData<float>());
-  } else {
-    auto pixel_values_fp32 = OrtValue::CreateTensor<float>(
-        allocator.GetInfo(),
-        std::span<float>(const_cast<float*>(pixel_values->Data()), pixel_values->NumberOfElement()),
-        pixel_values->Shape());
-    ConvertFp32ToFp16(allocator, *pixel_values_fp32, pixel_values_value, DeviceType::CPU, nullptr);
-  }
+}  // namespace
 
-  return pixel_values_value;
+std::unique_ptr<Images> LoadImageImpl(const char* image_path) {
+  return LoadImagesImpl(std::span<const char* const>(&image_path, 1));
 }
 
-std::unique_ptr<OrtValue> ProcessImageSizes(ortc::Tensor<int64_t>* image_sizes, Ort::Allocator& allocator) {
-  auto image_sizes_value = OrtValue::CreateTensor<int64_t>(allocator, image_sizes->Shape());
-  std::copy(image_sizes->Data(), image_sizes->Data() + image_sizes->NumberOfElement(),
-            image_sizes_value->GetTensorMutableData<int64_t>());
-  return image_sizes_value;
+std::unique_ptr<Images> LoadImagesImpl(std::span<const char* const> image_paths) {
+  if (image_paths.empty())
+    throw std::runtime_error("No images provided");
+
+  auto images = std::make_unique<ort_extensions::ImageRawData[]>(image_paths.size());
+  for (size_t i = 0; i < image_paths.size(); i++) {
+    if (!fs::path(image_paths[i]).exists()) {
+      throw std::runtime_error("Image path does not exist: " + std::string(image_paths[i]));
+    }
+    auto [image, num_images] = ort_extensions::LoadRawImages({image_paths[i]});
+    images[i] = std::move(image[0]);
+  }
+  return std::make_unique<Images>(std::move(images), image_paths.size());
 }
 
-}  // namespace
+std::unique_ptr<Images> LoadImagesFromBuffersImpl(std::span<const void* const> buffers, std::span<const size_t> sizes) {
+  if (buffers.empty())
+    throw std::runtime_error("No images provided");
+  if (buffers.size() != sizes.size())
+    throw std::runtime_error("Every image buffer needs a size");
 
-std::unique_ptr<Images> LoadImageImpl(const char* image_path) {
-  if (!fs::path(image_path).exists()) {
-    throw std::runtime_error("Image path does not exist: " + std::string(image_path));
+  auto images = std::make_unique<ort_extensions::ImageRawData[]>(buffers.size());
+  for (size_t i = 0; i < buffers.size(); i++) {
+    if (!buffers[i] || sizes[i] == 0)
+      throw std::runtime_error("Image buffer " + std::to_string(i) + " is empty");
+    auto* data = static_cast<const uint8_t*>(buffers[i]);
+    images[i].assign(data, data + sizes[i]);
   }
-  auto [images, num_images] = ort_extensions::LoadRawImages({image_path});
-  return std::make_unique<Images>(std::move(images), num_images);
+  return std::make_unique<Images>(std::move(images), buffers.size());
 }
 
-ImageProcessor::ImageProcessor(Config& config, const SessionInfo& session_info)
-    : pixel_values_type_{session_info.GetInputDataType(config.model.vision.inputs.pixel_values)} {
-  const std::string default_processor_file_name = "processor_config.json";
-  auto processor_config = (config.config_path / fs::path(default_processor_file_name)).string();
-  CheckResult(OrtxCreateProcessor(processor_.Address(), processor_config.c_str()));
+// The outputs for the images of one prompt. The first image that's done allocates the tensors, their shape is only
+// known once an image has been preprocessed.
+struct ImageProcessor::Outputs {
+  std::mutex mutex;
+  std::shared_ptr<Tensor> pixel_values;
+  std::shared_ptr<Tensor> image_sizes;
+  std::vector<int64_t> num_img_tokens;
+};
+
+ImageProcessor::ImageProcessor(Config& config, const SessionInfo& session_info, DeviceType device_type)
+    : processor_config_{(config.config_path / fs::path("processor_config.json")).string()},
+      device_type_{device_type},
+      pixel_values_type_{session_info.GetInputDataType(config.model.vision.inputs.pixel_values)} {
+  ReleaseProcessor(AcquireProcessor());  // Checks the processor config up front
 
   config.AddMapping(std::string(Config::Defaults::InputIdsName), config.model.embedding.inputs.input_ids);
   config.AddMapping(std::string(Config::Defaults::PixelValuesName), config.model.vision.inputs.pixel_values);
   config.AddMapping(std::string(Config::Defaults::ImageSizesName), config.model.vision.inputs.image_sizes);
 }
 
-std::unique_ptr<NamedTensors> ImageProcessor::Process(const Tokenizer& tokenizer, const std::string& prompt,
-                                                      const Images* images) {
-  Ort::Allocator& allocator{Ort::Allocator::GetWithDefaultOptions()};
-  auto named_tensors = std::make_unique<NamedTensors>();
+std::unique_ptr<OrtxPtr<OrtxProcessor>> ImageProcessor::AcquireProcessor() {
+  {
+    std::lock_guard lock(processors_mutex_);
+    if (!processors_.empty()) {
+      auto processor = std::move(processors_.back());
+      processors_.pop_back();
+      return processor;
+    }
+  }
+  auto processor = std::make_unique<OrtxPtr<OrtxProcessor>>();
+  CheckResult(OrtxCreateProcessor(processor->Address(), processor_config_.c_str()));
+  return processor;
+}
+
+void ImageProcessor::ReleaseProcessor(std::unique_ptr<OrtxPtr<OrtxProcessor>> processor) {
+  std::lock_guard lock(processors_mutex_);
+  processors_.push_back(std::move(processor));
+}
+
+std::shared_ptr<Tensor> ImageProcessor::CreatePixelValues(std::span<const int64_t> shape) {
+  if (!(pixel_values_type_ == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT || pixel_values_type_ == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16)) {
+    throw std::runtime_error("Expected pixel_values to be of type float or float16. Actual: " + std::to_string(pixel_values_type_));
+  }
+
+  auto pixel_values = std::make_shared<Tensor>();
+#if USE_CUDA
+  if (device_type_ == DeviceType::CUDA) {
+    // Pinned, so the copy to the device when the vision model runs doesn't need a staging buffer
+    const size_t byte_count = std::accumulate(shape.begin(), shape.end(), SizeOf(pixel_values_type_), std::multiplies<size_t>());
+    cuda_host_unique_ptr<uint8_t> pinned;
+    {
+      std::lock_guard lock(pinned_buffers_->mutex);
+      auto& free = pinned_buffers_->free;
+      auto it = std::find_if(free.begin(), free.end(), [&](const auto& entry) { return entry.first == byte_count; });
+      if (it != free.end()) {
+        pinned = std::move(it->second);
+        free.erase(it);
+      }
+    }
+    if (!pinned)
+      pinned = CudaMallocHostArray<uint8_t>(byte_count);
 
-  if (!images) {
-    named_tensors->emplace(Config::Defaults::InputIdsName,
-                           std::make_shared<Tensor>(ProcessImagePrompt(tokenizer, prompt, nullptr, allocator)));
-    return named_tensors;
+    // Handed back when the last user of the tensor lets go of it, the oldest free buffers beyond a few are released
+    constexpr size_t max_free_buffers = 8;
+    std::shared_ptr<uint8_t> buffer{pinned.release(), [pool = pinned_buffers_, byte_count](uint8_t* p) {
+                                      std::lock_guard lock(pool->mutex);
+                                      pool->free.emplace_back(byte_count, cuda_host_unique_ptr<uint8_t>{p});
+                                      if (pool->free.size() > max_free_buffers)
+                                        pool->free.erase(pool->free.begin());
+                                    }};
+    auto memory_info = OrtMemoryInfo::Create("CudaPinned", OrtAllocatorType::OrtDeviceAllocator, 0, OrtMemType::OrtMemTypeCPUOutput);
+    pixel_values->ort_tensor_ = OrtValue::CreateTensor(*memory_info, buffer.get(), byte_count, shape, pixel_values_type_);
+    pixel_values->buffer_ = std::move(buffer);
+    return pixel_values;
   }
+#endif
+  pixel_values->ort_tensor_ = OrtValue::CreateTensor(Ort::Allocator::GetWithDefaultOptions(), shape, pixel_values_type_);
+  return pixel_values;
+}
 
-  ort_extensions::ImageProcessor* processor = static_cast<ort_extensions::ImageProcessor*>(processor_.p_);
+void ImageProcessor::PreprocessImage(ort_extensions::ImageRawData& image, size_t index, size_t count, Outputs& outputs) {
+  auto processor_ptr = AcquireProcessor();
+  auto* processor = static_cast<ort_extensions::ImageProcessor*>(processor_ptr->p_);
 
   ortc::Tensor<float>* pixel_values = nullptr;
   ortc::Tensor<int64_t>* image_sizes = nullptr;
   ortc::Tensor<int64_t>* num_img_tokens = nullptr;
-  auto [status, result] = processor->PreProcess(ort_extensions::span(images->images_.get(), images->num_images_),
-                                                &pixel_values, &image_sizes, &num_img_tokens);
-  if (!status.IsOk()) {
-    throw std::runtime_error(status.ToString());
+  auto [status, result] = processor->PreProcess(ort_extensions::span(&image, 1), &pixel_values, &image_sizes, &num_img_tokens);
+
+  // The processor goes back to the free list with its outputs cleared, whether or not the image could be used
+  std::exception_ptr error;
+  try {
+    if (!status.IsOk())
+      throw std::runtime_error(status.ToString());
+    CopyImageOutputs(*pixel_values, *image_sizes, *num_img_tokens, index, count, outputs);
+  } catch (...) {
+    error = std::current_exception();
+  }
+  processor->ClearOutputs(&result);
+  ReleaseProcessor(std::move(processor_ptr));
+  if (error)
+    std::rethrow_exception(error);
+}
+
+void ImageProcessor::CopyImageOutputs(ortc::Tensor<float>& pixel_values, ortc::Tensor<int64_t>& image_sizes,
+                                      ortc::Tensor<int64_t>& num_img_tokens, size_t index, size_t count, Outputs& outputs) {
+  // The outputs of a single image have a batch dimension of 1, the prompt's stack count of them
+  auto pixel_values_shape = pixel_values.Shape();
+  auto image_sizes_shape = image_sizes.Shape();
+  pixel_values_shape[0] = image_sizes_shape[0] = static_cast<int64_t>(count);
+  {
+    std::lock_guard lock(outputs.mutex);
+    if (!outputs.pixel_values) {
+      outputs.pixel_values = CreatePixelValues(pixel_values_shape);
+      outputs.image_sizes = std::make_shared<Tensor>(OrtValue::CreateTensor<int64_t>(Ort::Allocator::GetWithDefaultOptions(), image_sizes_shape));
+    } else if (outputs.pixel_values->ort_tensor_->GetTensorTypeAndShapeInfo()->GetShape() != pixel_values_shape) {
+      throw std::runtime_error("All images of a prompt must have the same pixel_values shape after preprocessing");
+    }
   }
 
-  named_tensors->emplace(std::string(Config::Defaults::InputIdsName),
-                         std::make_shared<Tensor>(ProcessImagePrompt(tokenizer, prompt, num_img_tokens, allocator)));
-  named_tensors->emplace(std::string(Config::Defaults::PixelValuesName),
-                         std::make_shared<Tensor>(ProcessPixelValues(pixel_values, pixel_values_type_, allocator)));
-  named_tensors->emplace(std::string(Config::Defaults::ImageSizesName),
-                         std::make_shared<Tensor>(ProcessImageSizes(image_sizes, allocator)));
+  const size_t element_count = pixel_values.NumberOfElement();
+  const float* source = pixel_values.Data();
+  if (pixel_values_type_ == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT) {
+    auto* target = outputs.pixel_values->ort_tensor_->GetTensorMutableData<float>() + index * element_count;
+    std::copy(source, source + element_count, target);
+  } else {
+    auto* target = outputs.pixel_values->ort_tensor_->GetTensorMutableData<uint16_t>() + index * element_count;
+    for (size_t i = 0; i < element_count; i++)
+      target[i] = FastFloat32ToFloat16(source[i]);
+  }
 
-  processor->ClearOutputs(&result);
+  const size_t image_sizes_count = image_sizes.NumberOfElement();
+  std::copy(image_sizes.Data(), image_sizes.Data() + image_sizes_count,
+            outputs.image_sizes->ort_tensor_->GetTensorMutableData<int64_t>() + index * image_sizes_count);
+  outputs.num_img_tokens[index] = num_img_tokens.Data()[0];
+}
 
-  return named_tensors;
+std::unique_ptr<NamedTensors> ImageProcessor::Process(const Tokenizer& tokenizer, const std::string& prompt,
+                                                      const Images* images) {
+  return std::move(ProcessBatch(tokenizer, std::span<const std::string>(&prompt, 1), std::span<const Images* const>(&images, 1))[0]);
+}
+
+std::vector<std::unique_ptr<NamedTensors>> ImageProcessor::ProcessBatch(const Tokenizer& tokenizer, std::span<const std::string> prompts,
+                                                                        std::span<const Images* const> images) {
+  if (prompts.size() != images.size())
+    throw std::runtime_error("Every prompt needs its images, null for a prompt without any");
+
+  // One job per image of every prompt, so a prompt with several images is spread over the threads too
+  std::vector<Outputs> outputs(prompts.size());
+  std::vector<std::pair<size_t, size_t>> jobs;  // Prompt, image
+  for (size_t i = 0; i < prompts.size(); i++) {
+    if (!images[i])
+      continue;
+    outputs[i].num_img_tokens.resize(images[i]->num_images_);
+    for (size_t j = 0; j < images[i]->num_images_; j++)
+      jobs.emplace_back(i, j);
+  }
+
+  GetImageThreadPool().ParallelFor(jobs.size(), [&](size_t job) {
+    auto [prompt, image] = jobs[job];
+    PreprocessImage(images[prompt]->images_[image], image, images[prompt]->num_images_, outputs[prompt]);
+  });
+
+  Ort::Allocator& allocator{Ort::Allocator::GetWithDefaultOptions()};
+  std::vector<std::unique_ptr<NamedTensors>> results;
+  results.reserve(prompts.size());
+  for (size_t i = 0; i < prompts.size(); i++) {
+    auto named_tensors = std::make_unique<NamedTensors>();
+    named_tensors->emplace(std::string(Config::Defaults::InputIdsName),
+                           std::make_shared<Tensor>(ProcessImagePrompt(tokenizer, prompts[i], outputs[i].num_img_tokens, allocator)));
+    if (images[i]) {
+      named_tensors->emplace(std::string(Config::Defaults::PixelValuesName), std::move(outputs[i].pixel_values));
+      named_tensors->emplace(std::string(Config::Defaults::ImageSizesName), std::move(outputs[i].image_sizes));
+    }
+    results.push_back(std::move(named_tensors));
+  }
+  return results;
 }
 
 }  // namespace Generators
@@ -1,6 +1,7 @@
 // Copyright (c) Microsoft Corporation. All rights reserved.
 // Licensed under the MIT License.
 
+#include <mutex>
 #include "ortx_processor.h"
 #include "image_processor.h"
 #include "utils.h"
@@ -17,16 +18,48 @@ struct Images {
 };
 
 std::unique_ptr<Images> LoadImageImpl(const char* image_path);
+std::unique_ptr<Images> LoadImagesImpl(std::span<const char* const> image_paths);
+// Encoded images (jpeg, png, ...) that are already in memory, the bytes are copied
+std::unique_ptr<Images> LoadImagesFromBuffersImpl(std::span<const void* const> buffers, std::span<const size_t> sizes);
 
 struct ImageProcessor {
-  ImageProcessor(Config& config, const SessionInfo& session_info);
+  ImageProcessor(Config& config, const SessionInfo& session_info, DeviceType device_type);
 
   // Returned NamedTensors own the OrtValue and are not owned by the caller.
   // OrtValue memory will be released when the NamedTensors are destroyed.
   std::unique_ptr<NamedTensors> Process(const Tokenizer& tokenizer, const std::string& prompt, const Images* images);
 
+  // Several prompts at once, images[i] (null for none) goes with prompts[i]. The images of every prompt are decoded,
+  // resized and normalized in parallel, each straight into its slice of the prompt's pixel_values, which is in pinned
+  // memory on CUDA. The result is one set of inputs per prompt.
+  std::vector<std::unique_ptr<NamedTensors>> ProcessBatch(const Tokenizer& tokenizer, std::span<const std::string> prompts,
+                                                          std::span<const Images* const> images);
+
  private:
-  OrtxPtr<OrtxProcessor> processor_;
+  struct Outputs;
+  void PreprocessImage(ort_extensions::ImageRawData& image, size_t index, size_t count, Outputs& outputs);
+  void CopyImageOutputs(ortc::Tensor<float>& pixel_values, ortc::Tensor<int64_t>& image_sizes, ortc::Tensor<int64_t>& num_img_tokens,
+                        size_t index, size_t count, Outputs& outputs);
+  std::shared_ptr<Tensor> CreatePixelValues(std::span<const int64_t> shape);
+
+  // The ortx processors aren't safe to use from several threads at once, so every image being preprocessed takes one
+  // from the free list, created when it's empty
+  std::unique_ptr<OrtxPtr<OrtxProcessor>> AcquireProcessor();
+  void ReleaseProcessor(std::unique_ptr<OrtxPtr<OrtxProcessor>> processor);
+
+  std::string processor_config_;
+  std::mutex processors_mutex_;
+  std::vector<std::unique_ptr<OrtxPtr<OrtxProcessor>>> processors_;
+  DeviceType device_type_;
+#if USE_CUDA
+  // Pinned pixel_values buffers whose tensors were released, reused by byte count since cudaMallocHost takes longer
+  // than preprocessing an image. Shared with the buffers in use, which can outlive the processor.
+  struct PinnedBuffers {
+    std::mutex mutex;
+    std::vector<std::pair<size_t, cuda_host_unique_ptr<uint8_t>>> free;  // Oldest first
+  };
+  std::shared_ptr<PinnedBuffers> pinned_buffers_{std::make_shared<PinnedBuffers>()};
+#endif
 
   std::string input_ids_name_;
   std::string pixel_values_name_;
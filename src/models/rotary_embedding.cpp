@@ -0,0 +1,130 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include "../generators.h"
+#include "model.h"
+#include "rotary_embedding.h"
+
+namespace Generators {
+
+namespace {
+
+template <typename T>
+std::unique_ptr<OrtValue> CreateCache(const Model& model, std::span<const T> data, std::span<const int64_t> shape) {
+  auto cpu = OrtValue::CreateTensor<T>(model.allocator_cpu_, shape);
+  std::copy(data.begin(), data.end(), cpu->GetTensorMutableData<T>());
+  if (OnHost(model.device_type_))
+    return cpu;
+
+#if USE_CUDA
+  if (model.device_type_ == DeviceType::CUDA) {
+    auto device = OrtValue::CreateTensor<T>(*model.allocator_device_, shape);
+    CudaCheck() == cudaMemcpy(device->GetTensorMutableRawData(), cpu->GetTensorRawData(), data.size_bytes(), cudaMemcpyHostToDevice);
+    return device;
+  }
+#endif
+  throw std::runtime_error("model.decoder.rotary_embedding is only supported on the CPU and CUDA");
+}
+
+}  // namespace
+
+std::vector<float> RotaryCache::InverseFrequencies(const Config::Model::Decoder::RotaryEmbedding& rotary, bool long_factors) {
+  const auto& factors = long_factors ? rotary.long_factor : rotary.short_factor;
+  const int half_dim = rotary.dim / 2;
+  if (factors.size() != static_cast<size_t>(half_dim))
+    throw std::runtime_error("model.decoder.rotary_embedding factors must have dim / 2 = " + std::to_string(half_dim) + " values");
+
+  // In float, as the builder made them
+  std::vector<float> inv_freq(half_dim);
+  for (int i = 0; i < half_dim; i++)
+    inv_freq[i] = 1.0f / (factors[i] * std::pow(rotary.theta, static_cast<float>(2 * i) / rotary.dim));
+  return inv_freq;
+}
+
+void RotaryCache::Compute(const Config::Model::Decoder::RotaryEmbedding& rotary, bool long_factors, int length,
+                          std::vector<float>& cos, std::vector<float>& sin) {
+  const float mscale = long_factors ? rotary.long_mscale : rotary.short_mscale;
+  const int half_dim = rotary.dim / 2;
+  auto inv_freq = InverseFrequencies(rotary, long_factors);
+
+  cos.resize(static_cast<size_t>(length) * half_dim);
+  sin.resize(cos.size());
+  for (int t = 0; t < length; t++) {
+    for (int i = 0; i < half_dim; i++) {
+      float angle = static_cast<float>(t) * inv_freq[i];
+      cos[t * half_dim + i] = std::cos(angle) * mscale;
+      sin[t * half_dim + i] = std::sin(angle) * mscale;
+    }
+  }
+}
+
+RotaryCache::RotaryCache(const Model& model, bool long_factors, int length) {
+  const auto& rotary = model.config_->model.decoder.rotary_embedding;
+  std::vector<float> cos, sin;
+  Compute(rotary, long_factors, length, cos, sin);
+
+  const std::array<int64_t, 2> shape{length, rotary.dim / 2};
+  auto type = model.session_info_->GetInputDataType(model.config_->model.decoder.inputs.cos_cache);
+  if (type == Ort::TypeToTensorType<float>::type) {
+    cos_ = CreateCache<float>(model, cos, shape);
+    sin_ = CreateCache<float>(model, sin, shape);
+  } else if (type == Ort::TypeToTensorType<Ort::Float16_t>::type) {
+    std::vector<uint16_t> cos16(cos.size()), sin16(sin.size());
+    std::transform(cos.begin(), cos.end(), cos16.begin(), FastFloat32ToFloat16);
+    std::transform(sin.begin(), sin.end(), sin16.begin(), FastFloat32ToFloat16);
+    cos_ = CreateCache<Ort::Float16_t>(model, std::span{reinterpret_cast<const Ort::Float16_t*>(cos16.data()), cos16.size()}, shape);
+    sin_ = CreateCache<Ort::Float16_t>(model, std::span{reinterpret_cast<const Ort::Float16_t*>(sin16.data()), sin16.size()}, shape);
+  } else
+    throw std::runtime_error("model.decoder.rotary_embedding caches must be float or float16");
+}
+
+RotaryCacheInputs::RotaryCacheInputs(const Model& model, State& state, int sequence_length)
+    : model_{model},
+      state_{state} {
+  const auto& rotary = model_.config_->model.decoder.rotary_embedding;
+  if (rotary.dim <= 0 || !model_.session_info_->HasInput(model_.config_->model.decoder.inputs.cos_cache))
+    return;
+
+  long_factors_ = state_.GetCapturedGraphInfo() ? state_.params_->BufferMaxLength() > rotary.original_context_length
+                                                : sequence_length > rotary.original_context_length;
+  cache_ = GetCache(long_factors_);
+}
+
+std::shared_ptr<const RotaryCache> RotaryCacheInputs::GetCache(bool long_factors) const {
+  // The positions run are below max_length, and the short caches are only used below the original context length.
+  // Lengths are bucketed to powers of two so generators with similar max_lengths share the caches.
+  const auto& rotary = model_.config_->model.decoder.rotary_embedding;
+  int needed = state_.params_->BufferMaxLength();
+  if (!long_factors)
+    needed = std::min(needed, rotary.original_context_length);
+  int limit = long_factors ? std::max(model_.config_->model.context_length, needed) : rotary.original_context_length;
+  int bucket = 1;
+  while (bucket < needed)
+    bucket *= 2;
+  return model_.GetRotaryCache(long_factors, std::min(bucket, limit));
+}
+
+void RotaryCacheInputs::Add() {
+  if (!cache_)
+    return;
+
+  const auto& inputs = model_.config_->model.decoder.inputs;
+  input_index_ = state_.inputs_.size();
+  state_.input_names_.push_back(inputs.cos_cache.c_str());
+  state_.inputs_.push_back(cache_->cos_.get());
+  state_.input_names_.push_back(inputs.sin_cache.c_str());
+  state_.inputs_.push_back(cache_->sin_.get());
+}
+
+void RotaryCacheInputs::Update(int current_length) {
+  if (!cache_ || long_factors_ || state_.GetCapturedGraphInfo() ||
+      current_length <= model_.config_->model.decoder.rotary_embedding.original_context_length)
+    return;
+
+  // Only ever switches from the short caches to the long ones, the kv of the earlier tokens is kept as it is
+  long_factors_ = true;
+  cache_ = GetCache(true);
+  state_.inputs_[input_index_] = cache_->cos_.get();
+  state_.inputs_[input_index_ + 1] = cache_->sin_.get();
+}
+
+}  // namespace Generators
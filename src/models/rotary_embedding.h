@@ -0,0 +1,40 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+namespace Generators {
+
+// The cos/sin caches of model.decoder.rotary_embedding for positions up to length, with the long or the short factors
+struct RotaryCache {
+  RotaryCache(const Model& model, bool long_factors, int length);
+
+  // 1 / (factor * theta^(2i / dim)) of the dim / 2 frequencies
+  static std::vector<float> InverseFrequencies(const Config::Model::Decoder::RotaryEmbedding& rotary, bool long_factors);
+
+  // The float values, {length, dim / 2} each, before they're converted to the input type and moved to the device
+  static void Compute(const Config::Model::Decoder::RotaryEmbedding& rotary, bool long_factors, int length,
+                      std::vector<float>& cos, std::vector<float>& sin);
+
+  std::unique_ptr<OrtValue> cos_;  // {length, dim / 2} of the model's cos_cache type
+  std::unique_ptr<OrtValue> sin_;
+};
+
+// The cos_cache/sin_cache inputs: the short caches while the sequence fits in the original context length, the long
+// ones from the run that goes past it. Caches are shared with the other generators of the model, see
+// Model::GetRotaryCache. A captured graph can't switch, it has the long caches if max_length goes past it.
+struct RotaryCacheInputs {
+  RotaryCacheInputs(const Model& model, State& state, int sequence_length);
+  void Add();
+  void Update(int current_length);
+
+ private:
+  std::shared_ptr<const RotaryCache> GetCache(bool long_factors) const;
+
+  const Model& model_;
+  State& state_;
+  bool long_factors_{};
+  std::shared_ptr<const RotaryCache> cache_;  // nullptr when the caches are in the model
+  size_t input_index_{~0U};
+};
+
+}  // namespace Generators
@@ -0,0 +1,95 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include "../generators.h"
+#include "model.h"
+#include "kv_cache.h"
+#include "sparse_attention.h"
+
+namespace Generators {
+
+namespace {
+
+std::unique_ptr<OrtValue> CreateIndices(const Model& model, std::span<const int32_t> data, std::span<const int64_t> shape) {
+  auto cpu = OrtValue::CreateTensor<int32_t>(model.allocator_cpu_, shape);
+  std::copy(data.begin(), data.end(), cpu->GetTensorMutableData<int32_t>());
+  if (OnHost(model.device_type_))
+    return cpu;
+
+#if USE_CUDA
+  if (model.device_type_ == DeviceType::CUDA) {
+    auto device = OrtValue::CreateTensor<int32_t>(*model.allocator_device_, shape);
+    CudaCheck() == cudaMemcpy(device->GetTensorMutableRawData(), cpu->GetTensorRawData(), data.size_bytes(), cudaMemcpyHostToDevice);
+    return device;
+  }
+#endif
+  throw std::runtime_error("model.decoder.sparse_attention is only supported on the CPU and CUDA");
+}
+
+}  // namespace
+
+SparseAttentionLayout::SparseAttentionLayout(const Model& model, int block_count) {
+  const auto& sparse = model.config_->model.decoder.sparse_attention;
+  const int num_heads = model.config_->model.decoder.num_attention_heads;
+  const int num_layouts = sparse.homo_head ? 1 : num_heads;
+  // With vert_stride <= num_heads every head's vertical blocks start one further, as in the builder's mask
+  const int head_step = sparse.homo_head ? 0 : std::max(1, sparse.vert_stride / num_heads);
+
+  // Row q sees the blocks k <= q that are local to it or on the head's vertical stride: the vertical blocks before
+  // the local ones, then the local ones. Only the blocks seen are visited, not every k <= q.
+  std::vector<int32_t> rows(static_cast<size_t>(num_layouts) * (block_count + 1));
+  std::vector<std::vector<int32_t>> columns(num_layouts);
+  for (int h = 0; h < num_layouts; h++) {
+    auto* layout_rows = rows.data() + static_cast<size_t>(h) * (block_count + 1);
+    const int first_vertical = sparse.vert_stride > 0 ? sparse.vert_stride - 1 - (h * head_step) % sparse.vert_stride : block_count;
+    for (int q = 0; q < block_count; q++) {
+      const int local_begin = std::max(0, q - std::max(sparse.local_blocks, 0) + 1);
+      for (int k = first_vertical; k < local_begin; k += sparse.vert_stride)
+        columns[h].push_back(k);
+      for (int k = local_begin; k <= q; k++)
+        columns[h].push_back(k);
+      layout_rows[q + 1] = static_cast<int32_t>(columns[h].size());
+    }
+  }
+
+  size_t max_columns = 0;
+  for (auto& layout_columns : columns)
+    max_columns = std::max(max_columns, layout_columns.size());
+  std::vector<int32_t> cols(num_layouts * max_columns, -1);
+  for (int h = 0; h < num_layouts; h++)
+    std::copy(columns[h].begin(), columns[h].end(), cols.begin() + h * max_columns);
+
+  const std::array<int64_t, 2> rows_shape{num_layouts, block_count + 1};
+  const std::array<int64_t, 2> cols_shape{num_layouts, static_cast<int64_t>(max_columns)};
+  row_indices_ = CreateIndices(model, rows, rows_shape);
+  col_indices_ = CreateIndices(model, cols, cols_shape);
+}
+
+SparseAttentionInputs::SparseAttentionInputs(const Model& model, State& state)
+    : model_{model},
+      state_{state} {
+  const auto& sparse = model_.config_->model.decoder.sparse_attention;
+  if (sparse.block_size <= 0)
+    return;
+  const auto& inputs = model_.config_->model.decoder.inputs;
+  if (!model_.session_info_->HasInput(inputs.block_row_indices) || !model_.session_info_->HasInput(inputs.block_col_indices))
+    return;  // Exported with the mask as a constant
+
+  // SparseAttention reads the kv in place, the layout has to cover all of the buffer it's in
+  if (!KV_Cache::IsBufferShared(model_, *state_.params_))
+    throw std::runtime_error("model.decoder.sparse_attention needs search.past_present_share_buffer");
+  int block_count = (state_.params_->BufferMaxLength() + sparse.block_size - 1) / sparse.block_size;
+  layout_ = model_.GetSparseAttentionLayout(block_count);
+}
+
+void SparseAttentionInputs::Add() {
+  if (!layout_)
+    return;
+
+  const auto& inputs = model_.config_->model.decoder.inputs;
+  state_.input_names_.push_back(inputs.block_row_indices.c_str());
+  state_.inputs_.push_back(layout_->row_indices_.get());
+  state_.input_names_.push_back(inputs.block_col_indices.c_str());
+  state_.inputs_.push_back(layout_->col_indices_.get());
+}
+
+}  // namespace Generators
@@ -0,0 +1,28 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+namespace Generators {
+
+// The block mask of model.decoder.sparse_attention in the CSR form SparseAttention takes, for block_count blocks of
+// sparse_attention.block_size tokens. homo_head has one layout for every head, otherwise there's one per head.
+struct SparseAttentionLayout {
+  SparseAttentionLayout(const Model& model, int block_count);
+
+  std::unique_ptr<OrtValue> row_indices_;  // int32 {num_layouts, block_count + 1}
+  std::unique_ptr<OrtValue> col_indices_;  // int32 {num_layouts, most blocks of a layout}, padded with -1
+};
+
+// The block_row_indices/block_col_indices inputs, a layout covering the generator's kv buffer. It's shared with the
+// other generators of the model that have as many blocks, see Model::GetSparseAttentionLayout.
+struct SparseAttentionInputs {
+  SparseAttentionInputs(const Model& model, State& state);
+  void Add();
+
+ private:
+  const Model& model_;
+  State& state_;
+  std::shared_ptr<const SparseAttentionLayout> layout_;  // nullptr when the decoder has no sparse attention
+};
+
+}  // namespace Generators
@@ -6,22 +6,78 @@
 
 namespace Generators {
 
-StaticBuffer::StaticBuffer(Ort::Allocator* allocator, size_t max_beam_batch_size) : allocator_{allocator}, info_{allocator_->GetInfo()}, max_beam_batch_size_{max_beam_batch_size} {
+size_t BucketSize(size_t bytes) {
+  size_t power = 1;
+  while (power <= bytes / 2)
+    power *= 2;
+  size_t step = std::max<size_t>(power / 4, 1);
+  return (bytes + step - 1) / step * step;
+}
+
+StaticBufferArena::~StaticBufferArena() {
+  for (auto& block : blocks_)
+    allocator_->Free(block.p);
+}
+
+StaticBufferArena::Block* StaticBufferArena::Bind(const StaticBuffer& buffer, size_t bytes) {
+  bytes = BucketSize(bytes);
+  std::lock_guard lock(mutex_);
+  auto it = std::find_if(blocks_.begin(), blocks_.end(), [&](const Block& block) { return block.bytes == bytes && !block.owner; });
+  if (it == blocks_.end())
+    it = blocks_.insert(blocks_.end(), Block{allocator_->Alloc(bytes), bytes});
+  it->users++;
+  it->owner = &buffer;
+  return &*it;
+}
+
+void StaticBufferArena::Unbind(const StaticBuffer& buffer, Block* block) {
+  std::lock_guard lock(mutex_);
+  if (block->owner == &buffer)
+    block->owner = nullptr;
+  if (--block->users > 0)
+    return;
+  allocator_->Free(block->p);
+  blocks_.remove_if([&](const Block& b) { return &b == block; });
+}
+
+bool StaticBufferArena::Acquire(std::span<StaticBuffer* const> buffers) {
+  std::lock_guard lock(mutex_);
+  for (auto* buffer : buffers) {
+    if (buffer->block_ && buffer->block_->owner && buffer->block_->owner != buffer)
+      return false;
+  }
+  for (auto* buffer : buffers) {
+    if (buffer->block_)
+      buffer->block_->owner = buffer;
+  }
+  return true;
+}
+
+void StaticBufferArena::Release(std::span<StaticBuffer* const> buffers) {
+  std::lock_guard lock(mutex_);
+  for (auto* buffer : buffers) {
+    if (buffer->block_ && buffer->block_->owner == buffer)
+      buffer->block_->owner = nullptr;
+  }
+}
+
+StaticBuffer::StaticBuffer(std::shared_ptr<StaticBufferArena> arena, Ort::Allocator* allocator, size_t max_beam_batch_size)
+    : arena_{std::move(arena)}, info_{allocator->GetInfo()}, max_beam_batch_size_{max_beam_batch_size} {
 }
 
 std::unique_ptr<OrtValue> StaticBuffer::CreateTensorOnStaticBuffer(std::span<const int64_t> shape,
                                                                    ONNXTensorElementDataType type) {
   size_t new_bytes = SizeOf(type) * GetNumElements(shape);
-  if (buffer_ == nullptr) {
+  if (block_ == nullptr) {
     // Assuming the first dimension is the batch size
     bytes_ = new_bytes * (max_beam_batch_size_ / shape[0]);
-    buffer_ = allocator_->Alloc(bytes_);
-    return OrtValue::CreateTensor(info_, buffer_, new_bytes, shape, type);
+    block_ = arena_->Bind(*this, bytes_);
+    return OrtValue::CreateTensor(info_, block_->p, new_bytes, shape, type);
   }
   if (new_bytes > bytes_) {
     std::runtime_error("StaticBuffer: new_bytes > bytes_");
   }
-  return OrtValue::CreateTensor(info_, buffer_, new_bytes, shape, type);
+  return OrtValue::CreateTensor(info_, block_->p, new_bytes, shape, type);
 }
 
 size_t StaticBuffer::GetNumElements(std::span<const int64_t> shape) {
@@ -33,9 +89,9 @@ size_t StaticBuffer::GetNumElements(std::span<const int64_t> shape) {
 }
 
 StaticBuffer::~StaticBuffer() {
-  if (buffer_ != nullptr) {
-    allocator_->Free(buffer_);
+  if (block_ != nullptr) {
+    arena_->Unbind(*this, block_);
   }
 }
 
-}  // namespace Generators
\ No newline at end of file
+}  // namespace Generators
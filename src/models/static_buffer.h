@@ -2,7 +2,9 @@
 // Licensed under the MIT License.
 #pragma once
 
+#include <list>
 #include <memory>
+#include <mutex>
 #include "../span.h"
 
 namespace Ort {
@@ -11,22 +13,56 @@ struct Allocator;
 
 namespace Generators {
 
+// Rounded up to a quarter of a power of two, so similar sizes share blocks and at most a fifth of a block is wasted
+size_t BucketSize(size_t bytes);
+
+struct StaticBuffer;
+
+// Device memory shared by the static buffers of every captured graph of a model. Sizes are bucketed, and a free block
+// of the right bucket goes to whichever static buffer asks for it, so graphs that aren't live at the same time share
+// memory. A graph replays on the addresses it was captured with, so a static buffer keeps its block for good, and the
+// graph pool only hands a graph out when none of its blocks is being used by another graph (see Acquire).
+struct StaticBufferArena {
+  explicit StaticBufferArena(Ort::Allocator* allocator) : allocator_{allocator} {}
+  ~StaticBufferArena();
+
+  struct Block {
+    void* p{};
+    size_t bytes{};
+    int users{};                  // Static buffers bound to it
+    const StaticBuffer* owner{};  // The one using it right now
+  };
+
+  Block* Bind(const StaticBuffer& buffer, size_t bytes);  // A free block big enough, now used by buffer
+  void Unbind(const StaticBuffer& buffer, Block* block);  // Frees the block once no static buffer is bound to it
+
+  // All the buffers of one graph: marks their blocks used by them, unless one of them is already used by another buffer
+  bool Acquire(std::span<StaticBuffer* const> buffers);
+  void Release(std::span<StaticBuffer* const> buffers);
+
+ private:
+  Ort::Allocator* allocator_;
+  std::mutex mutex_;
+  std::list<Block> blocks_;  // A list so the pointers held by the static buffers stay valid
+};
+
 struct StaticBuffer {
   // Add max_beam_batch_size to the constructor
-  StaticBuffer(Ort::Allocator* allocator, size_t max_beam_batch_size);
+  StaticBuffer(std::shared_ptr<StaticBufferArena> arena, Ort::Allocator* allocator, size_t max_beam_batch_size);
   ~StaticBuffer();
 
   std::unique_ptr<OrtValue> CreateTensorOnStaticBuffer(std::span<const int64_t> shape,
                                                        ONNXTensorElementDataType type);
 
  private:
+  friend struct StaticBufferArena;
   size_t GetNumElements(std::span<const int64_t> shape);
 
-  Ort::Allocator* allocator_{};
+  std::shared_ptr<StaticBufferArena> arena_;
   const OrtMemoryInfo& info_;
-  void* buffer_{};
+  StaticBufferArena::Block* block_{};
   size_t bytes_{};
   size_t max_beam_batch_size_{};
 };
 
-}  // namespace Generators
\ No newline at end of file
+}  // namespace Generators
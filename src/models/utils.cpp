@@ -1,6 +1,13 @@
 // Copyright (c) Microsoft Corporation. All rights reserved.
 // Licensed under the MIT License.
 #include "../generators.h"
+#include "../cpu_features.h"
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define GENAI_F16C 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 namespace Generators {
 
@@ -32,6 +39,11 @@ size_t SizeOf(ONNXTensorElementDataType type) {
       return sizeof(Ort::Float16_t);
     case Ort::TypeToTensorType<Ort::BFloat16_t>::type:
       return sizeof(Ort::BFloat16_t);
+    case ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT8E4M3FN:
+    case ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT8E4M3FNUZ:
+    case ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT8E5M2:
+    case ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT8E5M2FNUZ:
+      return 1;
     default:
       throw std::runtime_error("Unsupported ONNXTensorElementDataType in GetTypeSize");
   }
@@ -80,6 +92,50 @@ float FastFloat16ToFloat32(const uint16_t x) {
   return bit_cast<float>((x & 0x8000) << 16 | (e != 0) * ((e + 112) << 23 | m) | ((e == 0) & (m != 0)) * ((v - 37) << 23 | ((m << (150 - v)) & 0x007FE000)));  // sign : normalized : denormalized
 }
 
+#if GENAI_F16C
+// Compiled for F16C whatever the build targets and only called when the CPU has it, MSVC compiles the intrinsics
+// without a flag. The remainder goes through a zero padded vector, so it converts NaN and Inf like the rest.
+#if defined(__GNUC__)
+__attribute__((target("avx,f16c")))
+#endif
+static void Float16ToFloat32F16C(const uint16_t* fp16, float* fp32, size_t count) {
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8)
+    _mm256_storeu_ps(fp32 + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(fp16 + i))));
+  if (i < count) {
+    uint16_t tail16[8]{};
+    float tail32[8];
+    std::copy(fp16 + i, fp16 + count, tail16);
+    _mm256_storeu_ps(tail32, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(tail16))));
+    std::copy(tail32, tail32 + (count - i), fp32 + i);
+  }
+}
+#elif defined(__aarch64__)
+static void Float16ToFloat32Neon(const uint16_t* fp16, float* fp32, size_t count) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4)
+    vst1q_f32(fp32 + i, vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(fp16 + i))));
+  if (i < count) {
+    uint16_t tail16[4]{};
+    float tail32[4];
+    std::copy(fp16 + i, fp16 + count, tail16);
+    vst1q_f32(tail32, vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(tail16))));
+    std::copy(tail32, tail32 + (count - i), fp32 + i);
+  }
+}
+#endif
+
+void FastFloat16ToFloat32(const uint16_t* fp16, float* fp32, size_t count) {
+#if GENAI_F16C
+  if (GetCpuFeatures().f16c)
+    return Float16ToFloat32F16C(fp16, fp32, count);
+#elif defined(__aarch64__)
+  return Float16ToFloat32Neon(fp16, fp32, count);
+#endif
+  for (size_t i = 0; i < count; i++)
+    fp32[i] = FastFloat16ToFloat32(fp16[i]);
+}
+
 uint16_t FastFloat32ToFloat16(float v) {
   const uint32_t b = bit_cast<uint32_t>(v) + 0x00001000;  // round-to-nearest-even: add last bit after truncated mantissa
 
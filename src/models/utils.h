@@ -27,5 +27,8 @@ float Float16ToFloat32(uint16_t v);
 // Fast fp16<->fp32 conversions that do not handle NaN and Inf but are fast (as these are not typical values)
 float FastFloat16ToFloat32(const uint16_t x);
 uint16_t FastFloat32ToFloat16(float v);
+// The same over an array, with the F16C conversion instructions when the CPU has them (checked at runtime) or NEON on
+// ARM64. Those handle NaN and Inf, for every element. Without them it's the scalar conversion above, which doesn't.
+void FastFloat16ToFloat32(const uint16_t* fp16, float* fp32, size_t count);
 
 }  // namespace Generators
\ No newline at end of file
@@ -7,11 +7,19 @@ namespace Generators {
 
 Whisper_Model::Whisper_Model(std::unique_ptr<Config> config, OrtEnv& ort_env)
     : Model{std::move(config)} {
-  session_decoder_ = OrtSession::Create(ort_env, (config_->config_path / fs::path(config_->model.decoder.filename)).c_str(), session_options_.get());
-  session_encoder_ = OrtSession::Create(ort_env, (config_->config_path / fs::path(config_->model.encoder_decoder_init.filename)).c_str(), session_options_.get());
+  CreateSessions({[&] { session_decoder_ = CreateSession(ort_env, config_->model.decoder.filename, session_options_.get()); },
+                  [&] { session_encoder_ = CreateSession(ort_env, config_->model.encoder_decoder_init.filename, session_options_.get()); }});
 
   InitDeviceAllocator(*session_decoder_);
   session_encoder_info_ = std::make_unique<SessionInfo>(*session_encoder_);
+
+  auto input_names = session_encoder_->GetInputNames();
+  for (size_t i = 0; i < input_names.size(); i++) {
+    if (input_names[i] != "encoder_input_ids")
+      continue;
+    auto shape = session_encoder_->GetInputTypeInfo(i)->GetTensorTypeAndShapeInfo().GetShape();
+    encoder_frames_ = shape.size() == 3 ? shape[2] : -1;
+  }
 }
 
 std::unique_ptr<State> Whisper_Model::CreateState(RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params) const {
@@ -23,11 +31,17 @@ Whisper_State::Whisper_State(const Whisper_Model& model, RoamingArray<int32_t> s
       model_{model} {
   auto& inputs = const_cast<GeneratorParams::Whisper&>(std::get<GeneratorParams::Whisper>(params.inputs));
 
-  encoder_input_ids_ = model_.ExpandInputs(inputs.input_features->ort_tensor_, params_->search.num_beams);
+  encoder_input_ids_ = model_.ExpandInputs(inputs.input_features->ort_tensor_, 1);  // Only moves it to the device
 
-  auto hidden_states_type = model_.session_encoder_info_->GetOutputDataType("encoder_hidden_states");
-  auto encoder_hidden_states_shape = std::array<int64_t, 3>{decoder_input_ids_.GetShape()[0], 1500, static_cast<int64_t>(model_.config_->model.decoder.num_key_value_heads) * model_.config_->model.decoder.head_size};
-  encoder_hidden_states_ = OrtValue::CreateTensor(*model_.allocator_device_, encoder_hidden_states_shape, hidden_states_type);
+  const std::array<int64_t, 2> decoder_input_ids_shape{params_->batch_size, params_->sequence_length};
+  auto decoder_input_ids_type = model_.session_encoder_info_->GetInputDataType("decoder_input_ids");
+  encoder_decoder_input_ids_ = OrtValue::CreateTensor(model_.allocator_cpu_, decoder_input_ids_shape, decoder_input_ids_type);
+  if (decoder_input_ids_type == Ort::TypeToTensorType<int64_t>::type)
+    std::copy(params_->input_ids.begin(), params_->input_ids.end(), encoder_decoder_input_ids_->GetTensorMutableData<int64_t>());
+  else if (decoder_input_ids_type == Ort::TypeToTensorType<int32_t>::type)
+    std::copy(params_->input_ids.begin(), params_->input_ids.end(), encoder_decoder_input_ids_->GetTensorMutableData<int32_t>());
+  else
+    throw std::runtime_error("decoder_input_ids must be int64 or int32");
 
   auto sequence_lengths = sequence_lengths_unk.GetCPU();
   for (int i = 0; i < decoder_input_ids_.GetShape()[0]; i++) {
@@ -36,12 +50,10 @@ Whisper_State::Whisper_State(const Whisper_Model& model, RoamingArray<int32_t> s
 
   input_names_.push_back("encoder_input_ids");
   inputs_.push_back(encoder_input_ids_.get());
-  decoder_input_ids_.name_ = "decoder_input_ids";
-  decoder_input_ids_.Add();
+  input_names_.push_back("decoder_input_ids");
+  inputs_.push_back(encoder_decoder_input_ids_.get());
 
   logits_.Add();
-  output_names_.push_back("encoder_hidden_states");
-  outputs_.push_back(encoder_hidden_states_.get());
   kv_cache_.AddEncoder();
   extra_inputs_.Add();
   cross_cache_.AddOutputs();
@@ -52,7 +64,7 @@ RoamingArray<float> Whisper_State::Run(int current_length, RoamingArray<int32_t>
 
   switch (run_state_) {
     case RunState::Encoder_Decoder_Init:
-      State::Run(*model_.session_encoder_, *model_.run_options_, batch_size);
+      RunEncoder();
 
       run_state_ = RunState::Decoder_First;
       return logits_.Get();
@@ -73,13 +85,37 @@ RoamingArray<float> Whisper_State::Run(int current_length, RoamingArray<int32_t>
       break;
   }
 
-  State::Run(*model_.session_decoder_, *model_.run_options_, batch_size);
+  State::Run(*model_.session_decoder_, batch_size);
   return logits_.Get();
 }
 
+// The beams of a batch entry start out the same, so the encoder only runs once per batch entry. Its logits and self
+// attention kv are copied to the beams afterwards.
+void Whisper_State::RunEncoder() {
+  const int num_beams = params_->search.num_beams;
+  auto beam_outputs = outputs_;
+  if (num_beams > 1) {
+    for (auto& output : outputs_)
+      output = nullptr;  // ORT allocates them at the batch size
+  }
+
+  State::Run(*model_.session_encoder_, params_->batch_size);
+
+  if (num_beams > 1) {
+    for (size_t i = 0; i < outputs_.size(); i++) {
+      if (!beam_outputs[i])
+        continue;  // The cross kv takes its own outputs
+      std::unique_ptr<OrtValue> output{outputs_[i]};
+      beam_gather_.ExpandBeams(*output, *beam_outputs[i], num_beams);
+      outputs_[i] = beam_outputs[i];
+    }
+  }
+  cross_cache_.TakeOutputs();
+}
+
 void Whisper_State::UpdateInputs(const RoamingArray<int32_t>& next_tokens, RoamingArray<int32_t> beam_indices, int current_length) {
   decoder_input_ids_.Update(next_tokens);
-  kv_cache_.Update(beam_indices.GetCPU(), current_length);
+  kv_cache_.Update(beam_indices, current_length);
 }
 
 }  // namespace Generators
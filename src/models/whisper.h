@@ -17,6 +17,7 @@ struct Whisper_Model : Model {
   std::unique_ptr<OrtSession> session_encoder_;  // encoder_decoder_init.onnx
 
   std::unique_ptr<SessionInfo> session_encoder_info_;
+  int64_t encoder_frames_{};  // The frame count of encoder_input_ids, -1 when the encoder takes features of any length
 };
 
 struct Whisper_State : State {
@@ -25,6 +26,7 @@ struct Whisper_State : State {
 
  private:
   void UpdateInputs(const RoamingArray<int32_t>& next_tokens, RoamingArray<int32_t> next_indices, int current_length);
+  void RunEncoder();
 
   const Whisper_Model& model_;
   enum struct RunState {
@@ -38,7 +40,9 @@ struct Whisper_State : State {
   KV_Cache kv_cache_{model_, *this};
   Cross_Cache cross_cache_{model_, *this};
   ExtraInputs extra_inputs_{model_, *this};
+  KV_BeamGather beam_gather_{model_};
+  // The encoder runs once per batch entry, so these aren't expanded over the beams
   std::unique_ptr<OrtValue> encoder_input_ids_;
-  std::unique_ptr<OrtValue> encoder_hidden_states_;
+  std::unique_ptr<OrtValue> encoder_decoder_input_ids_;
 };
 }  // namespace Generators
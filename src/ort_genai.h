@@ -59,6 +59,16 @@ inline void OgaCheckResult(OgaResult* result) {
   }
 }
 
+struct OgaSharedWeights : OgaAbstract {
+  static std::unique_ptr<OgaSharedWeights> Create() {
+    OgaSharedWeights* p;
+    OgaCheckResult(OgaCreateSharedWeights(&p));
+    return std::unique_ptr<OgaSharedWeights>(p);
+  }
+
+  static void operator delete(void* p) { OgaDestroySharedWeights(reinterpret_cast<OgaSharedWeights*>(p)); }
+};
+
 struct OgaModel : OgaAbstract {
   static std::unique_ptr<OgaModel> Create(const char* config_path) {
     OgaModel* p;
@@ -66,15 +76,123 @@ struct OgaModel : OgaAbstract {
     return std::unique_ptr<OgaModel>(p);
   }
 
+  static std::unique_ptr<OgaModel> Create(const char* config_path, OgaSharedWeights& shared_weights) {
+    OgaModel* p;
+    OgaCheckResult(OgaCreateModelWithSharedWeights(config_path, &shared_weights, &p));
+    return std::unique_ptr<OgaModel>(p);
+  }
+
   std::unique_ptr<OgaSequences> Generate(const OgaGeneratorParams& params) const {
     OgaSequences* p;
     OgaCheckResult(OgaGenerate(this, &params, &p));
     return std::unique_ptr<OgaSequences>(p);
   }
 
+  // See OgaScoreSequences
+  void ScoreSequences(const OgaGeneratorParams& params, float* scores, size_t scores_count) const {
+    OgaCheckResult(OgaScoreSequences(this, &params, scores, scores_count));
+  }
+
+  // See OgaEmbedSequences
+  void EmbedSequences(const OgaGeneratorParams& params, OgaPooling pooling, float* embeddings, size_t embeddings_count) const {
+    OgaCheckResult(OgaEmbedSequences(this, &params, pooling, embeddings, embeddings_count));
+  }
+
+  void CaptureGraphs(const int32_t* batch_sizes, size_t batch_sizes_count, const int32_t* max_lengths = nullptr, size_t max_lengths_count = 0) const {
+    OgaCheckResult(OgaModelCaptureGraphs(this, batch_sizes, batch_sizes_count, max_lengths, max_lengths_count));
+  }
+
+#if __cplusplus >= 202002L
+  void CaptureGraphs(std::span<const int32_t> batch_sizes, std::span<const int32_t> max_lengths = {}) const {
+    CaptureGraphs(batch_sizes.data(), batch_sizes.size(), max_lengths.data(), max_lengths.size());
+  }
+#endif
+
+  // See OgaModelSetPrefillModel
+  void SetPrefillModel(const OgaModel& prefill_model) {
+    OgaCheckResult(OgaModelSetPrefillModel(this, &prefill_model));
+  }
+
+  // See OgaModelEstimateGeneratorMemory
+  OgaGeneratorMemory EstimateGeneratorMemory(const OgaGeneratorParams& params) const {
+    OgaGeneratorMemory memory;
+    OgaCheckResult(OgaModelEstimateGeneratorMemory(this, &params, &memory));
+    return memory;
+  }
+
+  // See OgaModelGetMemoryUsage, returns the memory used by the live generators and sets budget if it isn't null
+  OgaGeneratorMemory GetMemoryUsage(uint64_t* budget = nullptr) const {
+    OgaGeneratorMemory memory;
+    uint64_t bytes;
+    OgaCheckResult(OgaModelGetMemoryUsage(this, &memory, &bytes));
+    if (budget)
+      *budget = bytes;
+    return memory;
+  }
+
+  // See OgaModelTrimMemoryPool
+  void TrimMemoryPool() const {
+    OgaCheckResult(OgaModelTrimMemoryPool(this));
+  }
+
   static void operator delete(void* p) { OgaDestroyModel(reinterpret_cast<OgaModel*>(p)); }
 };
 
+struct OgaAdapters : OgaAbstract {
+  static std::unique_ptr<OgaAdapters> Create(const OgaModel& model) {
+    OgaAdapters* p;
+    OgaCheckResult(OgaCreateAdapters(&model, &p));
+    return std::unique_ptr<OgaAdapters>(p);
+  }
+
+  void LoadAdapter(const char* adapter_path, const char* name) {
+    OgaCheckResult(OgaLoadAdapter(this, adapter_path, name));
+  }
+
+  void UnloadAdapter(const char* name) {
+    OgaCheckResult(OgaUnloadAdapter(this, name));
+  }
+
+  static void operator delete(void* p) { OgaDestroyAdapters(reinterpret_cast<OgaAdapters*>(p)); }
+};
+
+struct OgaCancellation : OgaAbstract {
+  static std::unique_ptr<OgaCancellation> Create() {
+    OgaCancellation* p;
+    OgaCheckResult(OgaCreateCancellation(&p));
+    return std::unique_ptr<OgaCancellation>(p);
+  }
+
+  void Cancel(bool terminate_runs = false) {
+    OgaCancel(this, terminate_runs);
+  }
+
+  static void operator delete(void* p) { OgaDestroyCancellation(reinterpret_cast<OgaCancellation*>(p)); }
+};
+
+struct OgaModelReplicas : OgaAbstract {
+  static std::unique_ptr<OgaModelReplicas> Create(const char* config_path, const int32_t* device_ids, size_t device_ids_count) {
+    OgaModelReplicas* p;
+    OgaCheckResult(OgaCreateModelReplicas(config_path, device_ids, device_ids_count, &p));
+    return std::unique_ptr<OgaModelReplicas>(p);
+  }
+
+  // Owned by the replicas, don't delete them
+  const OgaModel& GetModel() const {
+    const OgaModel* p;
+    OgaCheckResult(OgaModelReplicasGetModel(this, &p));
+    return *p;
+  }
+
+  const OgaTokenizer& GetTokenizer() const {
+    const OgaTokenizer* p;
+    OgaCheckResult(OgaModelReplicasGetTokenizer(this, &p));
+    return *p;
+  }
+
+  static void operator delete(void* p) { OgaDestroyModelReplicas(reinterpret_cast<OgaModelReplicas*>(p)); }
+};
+
 struct OgaString {
   OgaString(const char* p) : p_{p} {}
   ~OgaString() { OgaDestroyString(p_); }
@@ -123,6 +241,21 @@ struct OgaTokenizer : OgaAbstract {
     OgaCheckResult(OgaTokenizerEncode(this, str, &sequences));
   }
 
+  void EncodeSegments(const char* const* segments, size_t count, OgaSequences& sequences) const {
+    OgaCheckResult(OgaTokenizerEncodeSegments(this, segments, count, &sequences));
+  }
+
+  // Returns the padded length of the rows written to tokens
+  size_t EncodeBatchInto(const char* const* strings, size_t count, int32_t* tokens, size_t tokens_capacity, int32_t* lengths = nullptr) const {
+    size_t sequence_length;
+    OgaCheckResult(OgaTokenizerEncodeBatchInto(this, strings, count, tokens, tokens_capacity, lengths, &sequence_length));
+    return sequence_length;
+  }
+
+  void EncodeBatchToParams(const char* const* strings, size_t count, OgaGeneratorParams& params, int32_t* lengths = nullptr) const {
+    OgaCheckResult(OgaTokenizerEncodeBatchToParams(this, strings, count, &params, lengths));
+  }
+
   OgaString Decode(const int32_t* tokens_data, size_t tokens_length) const {
     const char* p;
     OgaCheckResult(OgaTokenizerDecode(this, tokens_data, tokens_length, &p));
@@ -167,6 +300,28 @@ struct OgaTokenizerStream : OgaAbstract {
   static void operator delete(void* p) { OgaDestroyTokenizerStream(reinterpret_cast<OgaTokenizerStream*>(p)); }
 };
 
+struct OgaTokenizerBatchStream : OgaAbstract {
+  static std::unique_ptr<OgaTokenizerBatchStream> Create(const OgaTokenizer& tokenizer, size_t batch_size) {
+    OgaTokenizerBatchStream* p;
+    OgaCheckResult(OgaCreateTokenizerBatchStream(&tokenizer, batch_size, &p));
+    return std::unique_ptr<OgaTokenizerBatchStream>(p);
+  }
+
+  /*
+   * Decodes the next token of every row, a negative token is skipped. Row i's new text is text[offsets[i]] to
+   * text[offsets[i + 1]], both are valid until the next call to Decode or when the stream is destroyed.
+   */
+  void Decode(const int32_t* tokens, size_t token_count, const char*& text, const size_t*& offsets) {
+    OgaCheckResult(OgaTokenizerBatchStreamDecode(this, tokens, token_count, &text, &offsets));
+  }
+
+  void ResetRow(size_t row) {
+    OgaCheckResult(OgaTokenizerBatchStreamResetRow(this, row));
+  }
+
+  static void operator delete(void* p) { OgaDestroyTokenizerBatchStream(reinterpret_cast<OgaTokenizerBatchStream*>(p)); }
+};
+
 struct OgaGeneratorParams : OgaAbstract {
   static std::unique_ptr<OgaGeneratorParams> Create(const OgaModel& model) {
     OgaGeneratorParams* p;
@@ -182,10 +337,54 @@ struct OgaGeneratorParams : OgaAbstract {
     OgaCheckResult(OgaGeneratorParamsSetSearchBool(this, name, value));
   }
 
+  void SetRowSearchOption(size_t row, const char* name, double value) {
+    OgaCheckResult(OgaGeneratorParamsSetRowSearchNumber(this, row, name, value));
+  }
+
+  void SetRowSearchOptionBool(size_t row, const char* name, bool value) {
+    OgaCheckResult(OgaGeneratorParamsSetRowSearchBool(this, row, name, value));
+  }
+
+  void SetAdapter(const OgaAdapters& adapters, const char* name) {
+    OgaCheckResult(OgaGeneratorParamsSetAdapter(this, &adapters, name));
+  }
+
+  void SetCancellation(OgaCancellation& cancellation) {
+    OgaCheckResult(OgaGeneratorParamsSetCancellation(this, &cancellation));
+  }
+
+  void SetRowAdapter(size_t row, const char* name) {
+    OgaCheckResult(OgaGeneratorParamsSetRowAdapter(this, row, name));
+  }
+
+  void SetLogitBias(const int32_t* token_ids, const float* biases, size_t count) {
+    OgaCheckResult(OgaGeneratorParamsSetLogitBias(this, token_ids, biases, count));
+  }
+
+  void AddBadWords(const int32_t* token_ids, size_t count) {
+    OgaCheckResult(OgaGeneratorParamsAddBadWords(this, token_ids, count));
+  }
+
+  void AddStopSequence(const int32_t* token_ids, size_t count) {
+    OgaCheckResult(OgaGeneratorParamsAddStopSequence(this, token_ids, count));
+  }
+
+  void SetRegexConstraint(const OgaTokenizer& tokenizer, const char* pattern) {
+    OgaCheckResult(OgaGeneratorParamsSetRegexConstraint(this, &tokenizer, pattern));
+  }
+
   void SetInputIDs(const int32_t* input_ids, size_t input_ids_count, size_t sequence_length, size_t batch_size) {
     OgaCheckResult(OgaGeneratorParamsSetInputIDs(this, input_ids, input_ids_count, sequence_length, batch_size));
   }
 
+  void SetEncoderInputIDs(const int32_t* input_ids, size_t input_ids_count, size_t sequence_length, size_t batch_size) {
+    OgaCheckResult(OgaGeneratorParamsSetEncoderInputIDs(this, input_ids, input_ids_count, sequence_length, batch_size));
+  }
+
+  void SetPackedInputs(const int32_t* tokens, size_t token_count, const int32_t* lengths, size_t batch_size, bool pad_left = false) {
+    OgaCheckResult(OgaGeneratorParamsSetPackedInputs(this, tokens, token_count, lengths, batch_size, pad_left));
+  }
+
   void SetInputSequences(const OgaSequences& sequences) {
     OgaCheckResult(OgaGeneratorParamsSetInputSequences(this, &sequences));
   }
@@ -212,10 +411,20 @@ struct OgaGenerator : OgaAbstract {
     return std::unique_ptr<OgaGenerator>(p);
   }
 
+  static std::unique_ptr<OgaGenerator> Load(const OgaModel& model, const OgaGeneratorParams& params, const char* path) {
+    OgaGenerator* p;
+    OgaCheckResult(OgaLoadGenerator(&model, &params, path, &p));
+    return std::unique_ptr<OgaGenerator>(p);
+  }
+
   bool IsDone() const {
     return OgaGenerator_IsDone(this);
   }
 
+  void Cancel(bool terminate_runs = false) {
+    OgaGenerator_Cancel(this, terminate_runs);
+  }
+
   void ComputeLogits() {
     OgaCheckResult(OgaGenerator_ComputeLogits(this));
   }
@@ -224,23 +433,135 @@ struct OgaGenerator : OgaAbstract {
     OgaCheckResult(OgaGenerator_GenerateNextToken(this));
   }
 
+  void SwapOut(const char* path = nullptr) {
+    OgaCheckResult(OgaGenerator_SwapOut(this, path));
+  }
+
+  void SwapIn() {
+    OgaCheckResult(OgaGenerator_SwapIn(this));
+  }
+
+  void AppendTokens(const int32_t* tokens, size_t token_count) {
+    OgaCheckResult(OgaGenerator_AppendTokens(this, tokens, token_count));
+  }
+
+  void Save(const char* path) const {
+    OgaCheckResult(OgaGenerator_Save(this, path));
+  }
+
+  std::unique_ptr<OgaGenerator> Fork(const OgaGeneratorParams& params) const {
+    OgaGenerator* p;
+    OgaCheckResult(OgaGenerator_Fork(this, &params, &p));
+    return std::unique_ptr<OgaGenerator>(p);
+  }
+
+  OgaGeneratorMetrics GetMetrics() const {
+    OgaGeneratorMetrics metrics;
+    OgaCheckResult(OgaGenerator_GetMetrics(this, &metrics));
+    return metrics;
+  }
+
+  // See OgaGenerator_GetLogProbs
+  void GetLogProbs(const float** logprobs, size_t* count, const int32_t** top_tokens, const float** top_logprobs, size_t* top_count) const {
+    OgaCheckResult(OgaGenerator_GetLogProbs(this, logprobs, count, top_tokens, top_logprobs, top_count));
+  }
+
+  // Runs the generation calling callback(row, token, text) from another thread for every new token, see OgaGenerator_Stream
+  template <typename Callback>
+  void Stream(const OgaTokenizer* tokenizer, Callback& callback) {
+    OgaCheckResult(OgaGenerator_Stream(
+        this, tokenizer, [](void* user_data, size_t row, int32_t token, const char* text) -> bool {
+          return (*static_cast<Callback*>(user_data))(row, token, text);
+        },
+        &callback));
+  }
+
   size_t GetSequenceCount(size_t index) const {
     return OgaGenerator_GetSequenceCount(this, index);
   }
 
+  // Owned by the generator, one copy per index, see OgaGenerator_GetSequenceData
   const int32_t* GetSequenceData(size_t index) const {
     return OgaGenerator_GetSequenceData(this, index);
   }
 
+  void GetNextTokens(const int32_t** tokens, size_t* count) const {
+    OgaCheckResult(OgaGenerator_GetNextTokens(this, tokens, count));
+  }
+
+  // Steps every generator by one token, see OgaGenerators_Step. Returns the number of tokens written to next_tokens.
+  static size_t Step(OgaGenerator* const* generators, size_t count, int32_t* next_tokens, size_t next_tokens_capacity) {
+    size_t next_tokens_count;
+    OgaCheckResult(OgaGenerators_Step(generators, count, next_tokens, next_tokens_capacity, &next_tokens_count));
+    return next_tokens_count;
+  }
+
+  // Merges the generators into one that steps them in a single run, see OgaGenerators_Merge
+  static std::unique_ptr<OgaGenerator> Merge(OgaGenerator* const* generators, size_t count, const OgaGeneratorParams& params) {
+    OgaGenerator* p;
+    OgaCheckResult(OgaGenerators_Merge(generators, count, &params, &p));
+    return std::unique_ptr<OgaGenerator>(p);
+  }
+
 #if __cplusplus >= 202002L
   std::span<const int32_t> GetSequence(size_t index) const {
     return {GetSequenceData(index), GetSequenceCount(index)};
   }
+
+  // The tokens from offset on, see OgaGenerator_GetSequenceTail
+  std::span<const int32_t> GetSequenceTail(size_t index, size_t offset) const {
+    const int32_t* tokens;
+    size_t count;
+    OgaCheckResult(OgaGenerator_GetSequenceTail(this, index, offset, &tokens, &count));
+    return {tokens, count};
+  }
 #endif
 
   static void operator delete(void* p) { OgaDestroyGenerator(reinterpret_cast<OgaGenerator*>(p)); }
 };
 
+struct OgaScheduler : OgaAbstract {
+  static std::unique_ptr<OgaScheduler> Create(const OgaModel& model, const OgaGeneratorParams& params) {
+    OgaScheduler* p;
+    OgaCheckResult(OgaCreateScheduler(&model, &params, &p));
+    return std::unique_ptr<OgaScheduler>(p);
+  }
+
+  int32_t AddRequest(const int32_t* prompt, size_t prompt_count, int32_t max_length = 0) {
+    int32_t request_id;
+    OgaCheckResult(OgaScheduler_AddRequest(this, prompt, prompt_count, max_length, &request_id));
+    return request_id;
+  }
+
+  int32_t AddRequest(const int32_t* prompt, size_t prompt_count, int32_t max_length, int32_t priority) {
+    int32_t request_id;
+    OgaCheckResult(OgaScheduler_AddRequestWithPriority(this, prompt, prompt_count, max_length, priority, &request_id));
+    return request_id;
+  }
+
+  void Step() {
+    OgaCheckResult(OgaScheduler_Step(this));
+  }
+
+  bool IsIdle() const {
+    return OgaScheduler_IsIdle(this);
+  }
+
+  bool IsFinished(int32_t request_id) const {
+    bool finished;
+    OgaCheckResult(OgaScheduler_IsFinished(this, request_id, &finished));
+    return finished;
+  }
+
+  std::unique_ptr<OgaSequences> TakeResult(int32_t request_id) {
+    OgaSequences* p;
+    OgaCheckResult(OgaScheduler_TakeResult(this, request_id, &p));
+    return std::unique_ptr<OgaSequences>(p);
+  }
+
+  static void operator delete(void* p) { OgaDestroyScheduler(reinterpret_cast<OgaScheduler*>(p)); }
+};
+
 struct OgaTensor : OgaAbstract {
 #if __cplusplus >= 202002L
   static std::unique_ptr<OgaTensor> Create(void* data, std::span<const int64_t> shape, OgaElementType element_type) {
@@ -255,6 +576,19 @@ struct OgaTensor : OgaAbstract {
     return std::unique_ptr<OgaTensor>(p);
   }
 
+  // data is in the memory of the model's device
+  static std::unique_ptr<OgaTensor> CreateOnDevice(const OgaModel& model, void* data, const int64_t* shape_dims, size_t shape_dims_count, OgaElementType element_type) {
+    OgaTensor* p;
+    OgaCheckResult(OgaCreateTensorFromDeviceBuffer(&model, data, shape_dims, shape_dims_count, element_type, &p));
+    return std::unique_ptr<OgaTensor>(p);
+  }
+
+  static std::unique_ptr<OgaTensor> CreateOnDevice(const OgaModel& model, const int64_t* shape_dims, size_t shape_dims_count, OgaElementType element_type) {
+    OgaTensor* p;
+    OgaCheckResult(OgaCreateDeviceTensor(&model, shape_dims, shape_dims_count, element_type, &p));
+    return std::unique_ptr<OgaTensor>(p);
+  }
+
   OgaElementType Type() {
     OgaElementType type;
     OgaCheckResult(OgaTensorGetType(this, &type));
@@ -285,6 +619,20 @@ struct OgaImages : OgaAbstract {
     return std::unique_ptr<OgaImages>(p);
   }
 
+  static std::unique_ptr<OgaImages> Load(const std::vector<const char*>& image_paths) {
+    OgaImages* p;
+    OgaCheckResult(OgaLoadImages(image_paths.data(), image_paths.size(), &p));
+    return std::unique_ptr<OgaImages>(p);
+  }
+
+  static std::unique_ptr<OgaImages> LoadFromBuffers(const std::vector<const void*>& buffers, const std::vector<size_t>& buffer_sizes) {
+    if (buffers.size() != buffer_sizes.size())
+      throw std::runtime_error("Every image buffer needs a size");
+    OgaImages* p;
+    OgaCheckResult(OgaLoadImagesFromBuffers(buffers.data(), buffer_sizes.data(), buffers.size(), &p));
+    return std::unique_ptr<OgaImages>(p);
+  }
+
   static void operator delete(void* p) { OgaDestroyImages(reinterpret_cast<OgaImages*>(p)); }
 };
 
@@ -305,6 +653,18 @@ struct OgaMultiModalProcessor : OgaAbstract {
     return std::unique_ptr<OgaNamedTensors>(p);
   }
 
+  // images[i] goes with prompts[i], null for a prompt without images
+  std::vector<std::unique_ptr<OgaNamedTensors>> ProcessImages(const std::vector<const char*>& prompts, const std::vector<const OgaImages*>& images) const {
+    if (prompts.size() != images.size())
+      throw std::runtime_error("Every prompt needs its images, null for a prompt without any");
+    std::vector<OgaNamedTensors*> p(prompts.size());
+    OgaCheckResult(OgaProcessorProcessImagesBatch(this, prompts.data(), images.data(), prompts.size(), p.data()));
+    std::vector<std::unique_ptr<OgaNamedTensors>> named_tensors;
+    for (auto* tensors : p)
+      named_tensors.emplace_back(tensors);
+    return named_tensors;
+  }
+
   OgaString Decode(const int32_t* tokens_data, size_t tokens_length) const {
     const char* p;
     OgaCheckResult(OgaProcessorDecode(this, tokens_data, tokens_length, &p));
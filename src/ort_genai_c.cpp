@@ -5,11 +5,16 @@
 #include <stdexcept>
 #include <cstdint>
 #include <cstddef>
+#include <numeric>
 #include "span.h"
 #include "ort_genai_c.h"
 #include "generators.h"
 #include "models/model.h"
+#include "models/adapters.h"
+#include "scheduler.h"
 #include "search.h"
+#include "streaming.h"
+#include "thread_pool.h"
 
 namespace Generators {
 
@@ -78,6 +83,20 @@ OgaResult* OGA_API_CALL OgaLoadImage(const char* image_path, OgaImages** images)
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaLoadImages(const char* const* image_paths, size_t image_path_count, OgaImages** images) {
+  OGA_TRY
+  *images = reinterpret_cast<OgaImages*>(Generators::LoadImagesImpl({image_paths, image_path_count}).release());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaLoadImagesFromBuffers(const void* const* buffers, const size_t* buffer_sizes, size_t buffer_count, OgaImages** images) {
+  OGA_TRY
+  *images = reinterpret_cast<OgaImages*>(Generators::LoadImagesFromBuffersImpl({buffers, buffer_count}, {buffer_sizes, buffer_count}).release());
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaCreateModel(const char* config_path, OgaModel** out) {
   OGA_TRY
   auto model = Generators::CreateModel(Generators::GetOrtEnv(), config_path);
@@ -87,6 +106,108 @@ OgaResult* OGA_API_CALL OgaCreateModel(const char* config_path, OgaModel** out)
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaCreateAdapters(const OgaModel* model, OgaAdapters** out) {
+  OGA_TRY
+  auto adapters = std::make_shared<Generators::Adapters>(*reinterpret_cast<const Generators::Model*>(model));
+  adapters->external_owner_ = adapters;
+  *out = reinterpret_cast<OgaAdapters*>(adapters.get());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaLoadAdapter(OgaAdapters* adapters, const char* adapter_path, const char* name) {
+  OGA_TRY
+  reinterpret_cast<Generators::Adapters*>(adapters)->LoadAdapter(fs::path(adapter_path), name);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaUnloadAdapter(OgaAdapters* adapters, const char* name) {
+  OGA_TRY
+  reinterpret_cast<Generators::Adapters*>(adapters)->UnloadAdapter(name);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsSetAdapter(OgaGeneratorParams* generator_params, const OgaAdapters* adapters, const char* name) {
+  OGA_TRY
+  auto& params = *reinterpret_cast<Generators::GeneratorParams*>(generator_params);
+  auto& owner = *reinterpret_cast<const Generators::Adapters*>(adapters);
+  owner.GetWeights()->GetIndex(name);  // Fail here rather than in CreateGenerator for an adapter that isn't loaded
+  params.adapters = owner.shared_from_this();
+  params.adapter = name;
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsSetRowAdapter(OgaGeneratorParams* generator_params, size_t row, const char* name) {
+  OGA_TRY
+  reinterpret_cast<Generators::GeneratorParams*>(generator_params)->SetRowAdapter(static_cast<int>(row), name);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaCreateCancellation(OgaCancellation** out) {
+  OGA_TRY
+  auto cancellation = std::make_shared<Generators::Cancellation>();
+  cancellation->external_owner_ = cancellation;
+  *out = reinterpret_cast<OgaCancellation*>(cancellation.get());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsSetCancellation(OgaGeneratorParams* generator_params, OgaCancellation* cancellation) {
+  OGA_TRY
+  reinterpret_cast<Generators::GeneratorParams*>(generator_params)->cancellation = reinterpret_cast<Generators::Cancellation*>(cancellation)->shared_from_this();
+  return nullptr;
+  OGA_CATCH
+}
+
+void OGA_API_CALL OgaCancel(OgaCancellation* cancellation, bool terminate_runs) {
+  reinterpret_cast<Generators::Cancellation*>(cancellation)->Cancel(terminate_runs);
+}
+
+OgaResult* OGA_API_CALL OgaCreateSharedWeights(OgaSharedWeights** out) {
+  OGA_TRY
+  auto shared_weights = std::make_shared<Generators::SharedWeights>();
+  shared_weights->external_owner_ = shared_weights;
+  *out = reinterpret_cast<OgaSharedWeights*>(shared_weights.get());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaCreateModelWithSharedWeights(const char* config_path, OgaSharedWeights* shared_weights, OgaModel** out) {
+  OGA_TRY
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), config_path, reinterpret_cast<Generators::SharedWeights*>(shared_weights)->shared_from_this());
+  model->external_owner_ = model;
+  *out = reinterpret_cast<OgaModel*>(model.get());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaCreateModelReplicas(const char* config_path, const int32_t* device_ids, size_t device_ids_count, OgaModelReplicas** out) {
+  OGA_TRY
+  auto replicas = std::make_shared<Generators::ModelReplicas>(Generators::GetOrtEnv(), config_path, std::span<const int>(device_ids, device_ids_count));
+  replicas->external_owner_ = replicas;
+  *out = reinterpret_cast<OgaModelReplicas*>(replicas.get());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaModelReplicasGetModel(const OgaModelReplicas* replicas, const OgaModel** out) {
+  OGA_TRY
+  *out = reinterpret_cast<const OgaModel*>(&reinterpret_cast<const Generators::ModelReplicas*>(replicas)->GetLeastLoaded());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaModelReplicasGetTokenizer(const OgaModelReplicas* replicas, const OgaTokenizer** out) {
+  OGA_TRY
+  *out = reinterpret_cast<const OgaTokenizer*>(reinterpret_cast<const Generators::ModelReplicas*>(replicas)->GetTokenizer().get());
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaCreateGeneratorParams(const OgaModel* model, OgaGeneratorParams** out) {
   OGA_TRY
   auto params = std::make_shared<Generators::GeneratorParams>(*reinterpret_cast<const Generators::Model*>(model));
@@ -110,6 +231,56 @@ OgaResult* OGA_API_CALL OgaGeneratorParamsSetSearchBool(OgaGeneratorParams* gene
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaGeneratorParamsSetRowSearchNumber(OgaGeneratorParams* generator_params, size_t row, const char* name, double value) {
+  OGA_TRY
+  Generators::SetSearchNumber(reinterpret_cast<Generators::GeneratorParams*>(generator_params)->SetRowSearch(static_cast<int>(row)), name, value);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsSetRowSearchBool(OgaGeneratorParams* generator_params, size_t row, const char* name, bool value) {
+  OGA_TRY
+  Generators::SetSearchBool(reinterpret_cast<Generators::GeneratorParams*>(generator_params)->SetRowSearch(static_cast<int>(row)), name, value);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsSetLogitBias(OgaGeneratorParams* oga_params, const int32_t* token_ids, const float* biases, size_t count) {
+  OGA_TRY
+  auto& params = *reinterpret_cast<Generators::GeneratorParams*>(oga_params);
+  params.logit_bias.clear();
+  for (size_t i = 0; i < count; i++)
+    params.logit_bias.emplace_back(token_ids[i], biases[i]);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsAddBadWords(OgaGeneratorParams* oga_params, const int32_t* token_ids, size_t count) {
+  OGA_TRY
+  if (count == 0)
+    throw std::runtime_error("A bad word needs at least one token");
+  reinterpret_cast<Generators::GeneratorParams*>(oga_params)->bad_words.emplace_back(token_ids, token_ids + count);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsAddStopSequence(OgaGeneratorParams* oga_params, const int32_t* token_ids, size_t count) {
+  OGA_TRY
+  if (count == 0)
+    throw std::runtime_error("A stop sequence needs at least one token");
+  reinterpret_cast<Generators::GeneratorParams*>(oga_params)->stop_sequences.emplace_back(token_ids, token_ids + count);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsSetRegexConstraint(OgaGeneratorParams* oga_params, const OgaTokenizer* tokenizer, const char* pattern) {
+  OGA_TRY
+  auto& params = *reinterpret_cast<Generators::GeneratorParams*>(oga_params);
+  params.grammar = reinterpret_cast<const Generators::Tokenizer*>(tokenizer)->GetGrammar(pattern, params.vocab_size, params.eos_token_id);
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaGeneratorParamsTryGraphCaptureWithMaxBatchSize(OgaGeneratorParams* generator_params, int32_t max_batch_size) {
   OGA_TRY
   auto* params = reinterpret_cast<Generators::GeneratorParams*>(generator_params);
@@ -126,6 +297,22 @@ OgaResult* OGA_API_CALL OgaGeneratorParamsSetInputIDs(OgaGeneratorParams* oga_pa
   params.batch_size = static_cast<int>(batch_size);
   if (params.sequence_length * params.batch_size != input_ids_count)
     throw std::runtime_error("sequence length * batch size is not equal to input_ids_count");
+  params.input_lengths.clear();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsSetEncoderInputIDs(OgaGeneratorParams* oga_params, const int32_t* input_ids, size_t input_ids_count, size_t sequence_length, size_t batch_size) {
+  OGA_TRY
+  reinterpret_cast<Generators::GeneratorParams*>(oga_params)->SetEncoderInputs({input_ids, input_ids_count}, static_cast<int>(sequence_length), static_cast<int>(batch_size));
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsSetPackedInputs(OgaGeneratorParams* oga_params, const int32_t* tokens, size_t token_count,
+                                                          const int32_t* lengths, size_t batch_size, bool pad_left) {
+  OGA_TRY
+  reinterpret_cast<Generators::GeneratorParams*>(oga_params)->SetPackedInputs({tokens, token_count}, {lengths, batch_size}, pad_left);
   return nullptr;
   OGA_CATCH
 }
@@ -144,6 +331,7 @@ OgaResult* OGA_API_CALL OgaGeneratorParamsSetInputSequences(OgaGeneratorParams*
   params.batch_size = static_cast<int>(sequences.size());
   params.sequence_length = static_cast<int>(params.input_ids_owner.size() / params.batch_size);
   params.input_ids = params.input_ids_owner;
+  params.input_lengths.clear();
   return nullptr;
   OGA_CATCH
 }
@@ -184,6 +372,70 @@ OgaResult* OGA_API_CALL OgaGenerate(const OgaModel* model, const OgaGeneratorPar
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaScoreSequences(const OgaModel* model, const OgaGeneratorParams* generator_params, float* scores, size_t scores_count) {
+  OGA_TRY
+  auto result = Generators::ScoreSequences(*reinterpret_cast<const Generators::Model*>(model), *reinterpret_cast<const Generators::GeneratorParams*>(generator_params));
+  if (result.size() > scores_count)
+    throw std::runtime_error("scores_count (" + std::to_string(scores_count) + ") is less than the " + std::to_string(result.size()) + " scores");
+  std::copy(result.begin(), result.end(), scores);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaEmbedSequences(const OgaModel* model, const OgaGeneratorParams* generator_params, OgaPooling pooling, float* embeddings, size_t embeddings_count) {
+  OGA_TRY
+  auto result = Generators::EmbedSequences(*reinterpret_cast<const Generators::Model*>(model), *reinterpret_cast<const Generators::GeneratorParams*>(generator_params),
+                                           pooling == OgaPooling_Mean ? Generators::Pooling::Mean : Generators::Pooling::LastToken);
+  if (result.size() > embeddings_count)
+    throw std::runtime_error("embeddings_count (" + std::to_string(embeddings_count) + ") is less than the " + std::to_string(result.size()) + " embedding values");
+  std::copy(result.begin(), result.end(), embeddings);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaModelCaptureGraphs(const OgaModel* model, const int32_t* batch_sizes, size_t batch_sizes_count, const int32_t* max_lengths, size_t max_lengths_count) {
+  OGA_TRY
+  reinterpret_cast<const Generators::Model*>(model)->CaptureGraphs(std::span<const int>(batch_sizes, batch_sizes_count), std::span<const int>(max_lengths, max_lengths ? max_lengths_count : 0));
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaModelSetPrefillModel(OgaModel* model, const OgaModel* prefill_model) {
+  OGA_TRY
+  reinterpret_cast<Generators::Model*>(model)->SetPrefillModel(reinterpret_cast<const Generators::Model*>(prefill_model)->shared_from_this());
+  return nullptr;
+  OGA_CATCH
+}
+
+static void ToOgaGeneratorMemory(const Generators::GeneratorMemory& memory, OgaGeneratorMemory* out) {
+  out->kv_cache = memory.kv_cache;
+  out->logits = memory.logits;
+  out->static_buffers = memory.static_buffers;
+}
+
+OgaResult* OGA_API_CALL OgaModelEstimateGeneratorMemory(const OgaModel* model, const OgaGeneratorParams* params, OgaGeneratorMemory* out) {
+  OGA_TRY
+  ToOgaGeneratorMemory(reinterpret_cast<const Generators::Model*>(model)->EstimateMemory(*reinterpret_cast<const Generators::GeneratorParams*>(params)), out);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaModelGetMemoryUsage(const OgaModel* model, OgaGeneratorMemory* used, uint64_t* budget) {
+  OGA_TRY
+  auto& memory_budget = reinterpret_cast<const Generators::Model*>(model)->GetMemoryBudget();
+  ToOgaGeneratorMemory(memory_budget.Used(), used);
+  *budget = memory_budget.Bytes();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaModelTrimMemoryPool(const OgaModel* model) {
+  OGA_TRY
+  reinterpret_cast<const Generators::Model*>(model)->TrimMemoryPool();
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OgaCreateGenerator(const OgaModel* model, const OgaGeneratorParams* generator_params, OgaGenerator** out) {
   OGA_TRY
   *out = reinterpret_cast<OgaGenerator*>(CreateGenerator(*reinterpret_cast<const Generators::Model*>(model), *reinterpret_cast<const Generators::GeneratorParams*>(generator_params)).release());
@@ -195,6 +447,10 @@ bool OGA_API_CALL OgaGenerator_IsDone(const OgaGenerator* generator) {
   return reinterpret_cast<const Generators::Generator*>(generator)->IsDone();
 }
 
+void OGA_API_CALL OgaGenerator_Cancel(OgaGenerator* generator, bool terminate_runs) {
+  reinterpret_cast<Generators::Generator*>(generator)->Cancel(terminate_runs);
+}
+
 OgaResult* OGA_API_CALL OgaGenerator_ComputeLogits(OgaGenerator* generator) {
   OGA_TRY
   reinterpret_cast<Generators::Generator*>(generator)->ComputeLogits();
@@ -209,14 +465,221 @@ OgaResult* OGA_API_CALL OgaGenerator_GenerateNextToken(OgaGenerator* generator)
   OGA_CATCH
 }
 
-size_t OGA_API_CALL OgaGenerator_GetSequenceCount(const OgaGenerator* oga_generator, size_t index) {
+OgaResult* OGA_API_CALL OgaGenerator_SwapOut(OgaGenerator* generator, const char* path) {
+  OGA_TRY
+  reinterpret_cast<Generators::Generator*>(generator)->SwapOut(path ? path : "");
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_SwapIn(OgaGenerator* generator) {
+  OGA_TRY
+  reinterpret_cast<Generators::Generator*>(generator)->SwapIn();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_AppendTokens(OgaGenerator* generator, const int32_t* tokens, size_t token_count) {
+  OGA_TRY
+  reinterpret_cast<Generators::Generator*>(generator)->AppendTokens(std::span<const int32_t>(tokens, token_count));
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_Save(const OgaGenerator* generator, const char* path) {
+  OGA_TRY
+  reinterpret_cast<const Generators::Generator*>(generator)->Save(path);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_Fork(const OgaGenerator* generator, const OgaGeneratorParams* params, OgaGenerator** out) {
+  OGA_TRY
+  *out = reinterpret_cast<OgaGenerator*>(reinterpret_cast<const Generators::Generator*>(generator)->Fork(*reinterpret_cast<const Generators::GeneratorParams*>(params)).release());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_GetMetrics(const OgaGenerator* generator, OgaGeneratorMetrics* out) {
+  OGA_TRY
+  auto& metrics = reinterpret_cast<const Generators::Generator*>(generator)->metrics_;
+  out->prefill_seconds = metrics.prefill_seconds;
+  out->decode_seconds = metrics.decode_seconds;
+  out->update_inputs_seconds = metrics.update_inputs_seconds;
+  out->search_seconds = metrics.search_seconds;
+  out->decode_steps = metrics.decode_steps;
+  out->host_to_device_bytes = metrics.host_to_device_bytes;
+  out->device_to_host_bytes = metrics.device_to_host_bytes;
+  out->device_allocations = metrics.device_allocations;
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_Stream(OgaGenerator* generator, const OgaTokenizer* tokenizer, OgaTokenCallback callback, void* user_data) {
+  OGA_TRY
+  Generators::StreamTokens(*reinterpret_cast<Generators::Generator*>(generator), reinterpret_cast<const Generators::Tokenizer*>(tokenizer),
+                           [&](size_t row, int32_t token, const std::string& text) { return callback(user_data, row, token, text.c_str()); });
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaLoadGenerator(const OgaModel* model, const OgaGeneratorParams* generator_params, const char* path, OgaGenerator** out) {
+  OGA_TRY
+  *out = reinterpret_cast<OgaGenerator*>(LoadGenerator(*reinterpret_cast<const Generators::Model*>(model), *reinterpret_cast<const Generators::GeneratorParams*>(generator_params), path).release());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_GetLogProbs(const OgaGenerator* oga_generator, const float** logprobs, size_t* count,
+                                                 const int32_t** top_tokens, const float** top_logprobs, size_t* top_count) {
+  OGA_TRY
+  auto& generator = *reinterpret_cast<const Generators::Generator*>(oga_generator);
+  auto result = generator.GetLogProbs();
+  *logprobs = result.logprobs.data();
+  *count = result.logprobs.size();
+  *top_tokens = result.top_tokens.data();
+  *top_logprobs = result.top_logprobs.data();
+  *top_count = result.logprobs.empty() ? 0 : result.top_tokens.size() / result.logprobs.size();
+  return nullptr;
+  OGA_CATCH
+}
+
+size_t OGA_API_CALL OgaGenerator_GetSequenceCount(const OgaGenerator* oga_generator, size_t /*index*/) {
+  // Every sequence of the batch has the same length, no need to copy one off the device to count it
   auto& generator = *reinterpret_cast<const Generators::Generator*>(oga_generator);
-  return generator.GetSequence(static_cast<int>(index)).GetCPU().size();
+  return static_cast<size_t>(generator.search_->GetSequenceLength());
 }
 
 const int32_t* OGA_API_CALL OgaGenerator_GetSequenceData(const OgaGenerator* oga_generator, size_t index) {
   auto& generator = *reinterpret_cast<const Generators::Generator*>(oga_generator);
-  return generator.GetSequence(static_cast<int>(index)).GetCPU().data();
+  return generator.GetSequenceTail(static_cast<int>(index), 0).data();
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_GetSequenceTail(const OgaGenerator* oga_generator, size_t index, size_t offset,
+                                                     const int32_t** tokens, size_t* count) {
+  OGA_TRY
+  auto& generator = *reinterpret_cast<const Generators::Generator*>(oga_generator);
+  auto tail = generator.GetSequenceTail(static_cast<int>(index), offset);
+  *tokens = tail.data();
+  *count = tail.size();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_GetNextTokens(const OgaGenerator* oga_generator, const int32_t** tokens, size_t* count) {
+  OGA_TRY
+  auto& generator = *reinterpret_cast<const Generators::Generator*>(oga_generator);
+  auto next_tokens = generator.search_->GetNextTokens().GetCPU();
+  *tokens = next_tokens.data();
+  *count = next_tokens.size();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerators_Step(OgaGenerator* const* oga_generators, size_t count, int32_t* next_tokens,
+                                           size_t next_tokens_capacity, size_t* next_tokens_count) {
+  OGA_TRY
+  auto generators = std::span<Generators::Generator* const>(reinterpret_cast<Generators::Generator* const*>(oga_generators), count);
+
+  size_t total = 0;
+  for (auto* generator : generators)
+    total += generator->search_->params_->BatchBeamSize();
+  *next_tokens_count = total;
+  if (total > next_tokens_capacity)
+    throw std::runtime_error("next_tokens holds " + std::to_string(next_tokens_capacity) + " tokens, the generators need " + std::to_string(total));
+
+  std::vector<size_t> offsets(generators.size());
+  for (size_t i = 1; i < generators.size(); i++)
+    offsets[i] = offsets[i - 1] + static_cast<size_t>(generators[i - 1]->search_->params_->BatchBeamSize());
+
+  // Each generator runs its own session, so their runs overlap instead of waiting on one another
+  std::vector<std::string> errors(generators.size());
+  Generators::GetSessionThreadPool().ParallelFor(generators.size(), [&](size_t i) {
+    auto& generator = *generators[i];
+    auto* next = next_tokens + offsets[i];
+    auto rows = static_cast<size_t>(generator.search_->params_->BatchBeamSize());
+    try {
+      if (generator.IsDone()) {
+        std::fill_n(next, rows, -1);
+      } else {
+        generator.ComputeLogits();
+        generator.GenerateNextToken();
+        auto tokens = generator.search_->GetNextTokens().GetCPU();
+        std::copy(tokens.begin(), tokens.end(), next);
+      }
+    } catch (const std::exception& e) {
+      std::fill_n(next, rows, -1);
+      errors[i] = "Generator " + std::to_string(i) + ": " + e.what();
+    }
+  });
+  for (auto& error : errors) {
+    if (!error.empty())
+      throw std::runtime_error(error);
+  }
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerators_Merge(OgaGenerator* const* oga_generators, size_t count, const OgaGeneratorParams* params, OgaGenerator** out) {
+  OGA_TRY
+  auto generators = std::span<Generators::Generator* const>(reinterpret_cast<Generators::Generator* const*>(oga_generators), count);
+  std::vector<std::vector<int32_t>> rows(generators.size());
+  for (size_t i = 0; i < generators.size(); i++) {
+    rows[i].resize(static_cast<size_t>(generators[i]->search_->params_->batch_size));
+    std::iota(rows[i].begin(), rows[i].end(), 0);
+  }
+  *out = reinterpret_cast<OgaGenerator*>(Generators::Generator::Merge(generators, rows, *reinterpret_cast<const Generators::GeneratorParams*>(params)).release());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaCreateScheduler(const OgaModel* model, const OgaGeneratorParams* params, OgaScheduler** out) {
+  OGA_TRY
+  *out = reinterpret_cast<OgaScheduler*>(std::make_unique<Generators::Scheduler>(*reinterpret_cast<const Generators::Model*>(model), *reinterpret_cast<const Generators::GeneratorParams*>(params)).release());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaScheduler_AddRequest(OgaScheduler* scheduler, const int32_t* prompt, size_t prompt_count, int32_t max_length, int32_t* request_id) {
+  OGA_TRY
+  *request_id = reinterpret_cast<Generators::Scheduler*>(scheduler)->AddRequest(std::span<const int32_t>(prompt, prompt_count), max_length);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaScheduler_AddRequestWithPriority(OgaScheduler* scheduler, const int32_t* prompt, size_t prompt_count, int32_t max_length,
+                                                            int32_t priority, int32_t* request_id) {
+  OGA_TRY
+  *request_id = reinterpret_cast<Generators::Scheduler*>(scheduler)->AddRequest(std::span<const int32_t>(prompt, prompt_count), max_length, priority);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaScheduler_Step(OgaScheduler* scheduler) {
+  OGA_TRY
+  reinterpret_cast<Generators::Scheduler*>(scheduler)->Step();
+  return nullptr;
+  OGA_CATCH
+}
+
+bool OGA_API_CALL OgaScheduler_IsIdle(const OgaScheduler* scheduler) {
+  return reinterpret_cast<const Generators::Scheduler*>(scheduler)->IsIdle();
+}
+
+OgaResult* OGA_API_CALL OgaScheduler_IsFinished(const OgaScheduler* scheduler, int32_t request_id, bool* out) {
+  OGA_TRY
+  *out = reinterpret_cast<const Generators::Scheduler*>(scheduler)->IsFinished(request_id);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaScheduler_TakeResult(OgaScheduler* scheduler, int32_t request_id, OgaSequences** out) {
+  OGA_TRY
+  auto sequences = std::make_unique<Generators::TokenSequences>();
+  sequences->emplace_back(reinterpret_cast<Generators::Scheduler*>(scheduler)->TakeResult(request_id));
+  *out = reinterpret_cast<OgaSequences*>(sequences.release());
+  return nullptr;
+  OGA_CATCH
 }
 
 OgaResult* OGA_API_CALL OgaCreateTokenizer(const OgaModel* model, OgaTokenizer** out) {
@@ -237,6 +700,40 @@ OgaResult* OGA_API_CALL OgaTokenizerEncode(const OgaTokenizer* p, const char* st
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaTokenizerEncodeSegments(const OgaTokenizer* p, const char* const* segments, size_t count, OgaSequences* sequences) {
+  OGA_TRY
+  auto& tokenizer = *reinterpret_cast<const Generators::Tokenizer*>(p);
+  auto& token_sequences = *reinterpret_cast<Generators::TokenSequences*>(sequences);
+  std::vector<std::string> strings(segments, segments + count);
+  token_sequences.emplace_back(tokenizer.EncodeSegments(strings));
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaTokenizerEncodeBatchInto(const OgaTokenizer* p, const char* const* strings, size_t count,
+                                                    int32_t* tokens, size_t tokens_capacity, int32_t* lengths, size_t* sequence_length) {
+  OGA_TRY
+  auto& tokenizer = *reinterpret_cast<const Generators::Tokenizer*>(p);
+  tokenizer.EncodeBatchInto(
+      std::span<const char* const>(strings, count), [&](size_t length) {
+        *sequence_length = length;
+        return std::span<int32_t>(tokens, tokens_capacity);
+      },
+      lengths ? std::span<int32_t>(lengths, count) : std::span<int32_t>{}, tokenizer.GetPadTokenId());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaTokenizerEncodeBatchToParams(const OgaTokenizer* p, const char* const* strings, size_t count,
+                                                        OgaGeneratorParams* generator_params, int32_t* lengths) {
+  OGA_TRY
+  auto& tokenizer = *reinterpret_cast<const Generators::Tokenizer*>(p);
+  auto& params = *reinterpret_cast<Generators::GeneratorParams*>(generator_params);
+  tokenizer.EncodeBatchInto(std::span<const char* const>(strings, count), params, lengths ? std::span<int32_t>(lengths, count) : std::span<int32_t>{});
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaTokenizerDecode(const OgaTokenizer* p, const int32_t* tokens, size_t token_count, const char** out_string) {
   OGA_TRY
   auto& tokenizer = *reinterpret_cast<const Generators::Tokenizer*>(p);
@@ -298,6 +795,31 @@ OgaResult* OGA_API_CALL OgaTokenizerStreamDecode(OgaTokenizerStream* p, int32_t
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaCreateTokenizerBatchStream(const OgaTokenizer* p, size_t batch_size, OgaTokenizerBatchStream** out) {
+  OGA_TRY
+  *out = reinterpret_cast<OgaTokenizerBatchStream*>(reinterpret_cast<const Generators::Tokenizer*>(p)->CreateBatchStream(batch_size).release());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaTokenizerBatchStreamDecode(OgaTokenizerBatchStream* p, const int32_t* tokens, size_t token_count,
+                                                      const char** text, const size_t** offsets) {
+  OGA_TRY
+  auto& stream = *reinterpret_cast<Generators::TokenizerBatchStream*>(p);
+  stream.Decode({tokens, token_count});
+  *text = stream.Text().data();
+  *offsets = stream.Offsets().data();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaTokenizerBatchStreamResetRow(OgaTokenizerBatchStream* p, size_t row) {
+  OGA_TRY
+  reinterpret_cast<Generators::TokenizerBatchStream*>(p)->Reset(row);
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaCreateTensorFromBuffer(void* data, const int64_t* shape_dims, size_t shape_dims_count, OgaElementType element_type, OgaTensor** out) {
   OGA_TRY
   auto tensor = std::make_shared<Generators::Tensor>();
@@ -313,6 +835,32 @@ OgaResult* OGA_API_CALL OgaCreateTensorFromBuffer(void* data, const int64_t* sha
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaCreateTensorFromDeviceBuffer(const OgaModel* oga_model, void* data, const int64_t* shape_dims, size_t shape_dims_count, OgaElementType element_type, OgaTensor** out) {
+  OGA_TRY
+  auto& model = *reinterpret_cast<const Generators::Model*>(oga_model);
+  auto tensor = std::make_shared<Generators::Tensor>();
+  auto ort_element_type = static_cast<ONNXTensorElementDataType>(element_type);
+  size_t byte_count = Generators::SizeOf(ort_element_type);
+  for (size_t i = 0; i < shape_dims_count; i++)
+    byte_count *= shape_dims[i];
+  tensor->ort_tensor_ = OrtValue::CreateTensor(model.allocator_device_->GetInfo(), data, byte_count, std::span<const int64_t>{shape_dims, shape_dims_count}, ort_element_type);
+  tensor->external_owner_ = tensor;
+  *out = reinterpret_cast<OgaTensor*>(tensor.get());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaCreateDeviceTensor(const OgaModel* oga_model, const int64_t* shape_dims, size_t shape_dims_count, OgaElementType element_type, OgaTensor** out) {
+  OGA_TRY
+  auto& model = *reinterpret_cast<const Generators::Model*>(oga_model);
+  auto tensor = std::make_shared<Generators::Tensor>();
+  tensor->ort_tensor_ = OrtValue::CreateTensor(*model.allocator_device_, std::span<const int64_t>{shape_dims, shape_dims_count}, static_cast<ONNXTensorElementDataType>(element_type));
+  tensor->external_owner_ = tensor;
+  *out = reinterpret_cast<OgaTensor*>(tensor.get());
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaTensorGetType(OgaTensor* tensor, OgaElementType* out) {
   OGA_TRY
   *out = static_cast<OgaElementType>(reinterpret_cast<Generators::Tensor*>(tensor)->ort_tensor_->GetTensorTypeAndShapeInfo()->GetElementType());
@@ -377,6 +925,20 @@ OgaResult* OGA_API_CALL OgaProcessorProcessImages(const OgaMultiModalProcessor*
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaProcessorProcessImagesBatch(const OgaMultiModalProcessor* p, const char* const* prompts, const OgaImages* const* images, size_t count, OgaNamedTensors** input_tensors) {
+  OGA_TRY
+  auto& processor = *reinterpret_cast<const Generators::MultiModalProcessor*>(p);
+  if (!processor.image_processor_)
+    throw std::runtime_error("Image processor is not available.");
+  std::vector<std::string> prompt_strings(prompts, prompts + count);
+  auto named_tensors = processor.image_processor_->ProcessBatch(*processor.tokenizer_, prompt_strings,
+                                                                {reinterpret_cast<const Generators::Images* const*>(images), count});
+  for (size_t i = 0; i < count; i++)
+    input_tensors[i] = reinterpret_cast<OgaNamedTensors*>(named_tensors[i].release());
+  return nullptr;
+  OGA_CATCH
+}
+
 void OGA_API_CALL OgaDestroyResult(OgaResult* p) {
   delete reinterpret_cast<Generators::Result*>(p);
 }
@@ -393,6 +955,22 @@ void OGA_API_CALL OgaDestroyModel(OgaModel* p) {
   reinterpret_cast<Generators::Model*>(p)->external_owner_ = nullptr;
 }
 
+void OGA_API_CALL OgaDestroyAdapters(OgaAdapters* p) {
+  reinterpret_cast<Generators::Adapters*>(p)->external_owner_ = nullptr;
+}
+
+void OGA_API_CALL OgaDestroyCancellation(OgaCancellation* p) {
+  reinterpret_cast<Generators::Cancellation*>(p)->external_owner_ = nullptr;
+}
+
+void OGA_API_CALL OgaDestroySharedWeights(OgaSharedWeights* p) {
+  reinterpret_cast<Generators::SharedWeights*>(p)->external_owner_ = nullptr;
+}
+
+void OGA_API_CALL OgaDestroyModelReplicas(OgaModelReplicas* p) {
+  reinterpret_cast<Generators::ModelReplicas*>(p)->external_owner_ = nullptr;
+}
+
 void OGA_API_CALL OgaDestroyGeneratorParams(OgaGeneratorParams* p) {
   reinterpret_cast<Generators::GeneratorParams*>(p)->external_owner_ = nullptr;
 }
@@ -401,6 +979,10 @@ void OGA_API_CALL OgaDestroyGenerator(OgaGenerator* p) {
   delete reinterpret_cast<Generators::Generator*>(p);
 }
 
+void OGA_API_CALL OgaDestroyScheduler(OgaScheduler* p) {
+  delete reinterpret_cast<Generators::Scheduler*>(p);
+}
+
 void OGA_API_CALL OgaDestroyTokenizer(OgaTokenizer* p) {
   reinterpret_cast<Generators::Tokenizer*>(p)->external_owner_ = nullptr;
 }
@@ -409,6 +991,10 @@ void OGA_API_CALL OgaDestroyTokenizerStream(OgaTokenizerStream* p) {
   delete reinterpret_cast<Generators::TokenizerStream*>(p);
 }
 
+void OGA_API_CALL OgaDestroyTokenizerBatchStream(OgaTokenizerBatchStream* p) {
+  delete reinterpret_cast<Generators::TokenizerBatchStream*>(p);
+}
+
 void OGA_API_CALL OgaDestroyTensor(OgaTensor* p) {
   reinterpret_cast<Generators::Tensor*>(p)->external_owner_ = nullptr;
 }
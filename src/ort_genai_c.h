@@ -51,11 +51,17 @@ typedef struct OgaResult OgaResult;
 typedef struct OgaGeneratorParams OgaGeneratorParams;
 typedef struct OgaGenerator OgaGenerator;
 typedef struct OgaModel OgaModel;
+typedef struct OgaModelReplicas OgaModelReplicas;
+typedef struct OgaSharedWeights OgaSharedWeights;
+typedef struct OgaAdapters OgaAdapters;
+typedef struct OgaCancellation OgaCancellation;
+typedef struct OgaScheduler OgaScheduler;
 // OgaSequences is an array of token arrays where the number of token arrays can be obtained using
 // OgaSequencesCount and the number of tokens in each token array can be obtained using OgaSequencesGetSequenceCount.
 typedef struct OgaSequences OgaSequences;
 typedef struct OgaTokenizer OgaTokenizer;
 typedef struct OgaTokenizerStream OgaTokenizerStream;
+typedef struct OgaTokenizerBatchStream OgaTokenizerBatchStream;
 typedef struct OgaTensor OgaTensor;
 typedef struct OgaImages OgaImages;
 typedef struct OgaNamedTensors OgaNamedTensors;
@@ -116,6 +122,20 @@ OGA_EXPORT const int32_t* OGA_API_CALL OgaSequencesGetSequenceData(const OgaSequ
 
 OGA_EXPORT OgaResult* OGA_API_CALL OgaLoadImage(const char* image_path, OgaImages** images);
 
+/*
+ * \brief Loads several images, which all go with the same prompt as <|image_1|>, <|image_2|>, ...
+ * \param[in] image_paths Array of image_path_count null terminated utf8 paths.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaLoadImages(const char* const* image_paths, size_t image_path_count, OgaImages** images);
+
+/*
+ * \brief Creates images from encoded image files (jpeg, png, ...) that are already in memory, without going
+ *        through the filesystem. The bytes are copied, so the buffers can be freed once this returns.
+ * \param[in] buffers Array of buffer_count pointers to the encoded images.
+ * \param[in] buffer_sizes The size in bytes of every buffer.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaLoadImagesFromBuffers(const void* const* buffers, const size_t* buffer_sizes, size_t buffer_count, OgaImages** images);
+
 OGA_EXPORT void OGA_API_CALL OgaDestroyImages(OgaImages* images);
 
 /*
@@ -133,6 +153,50 @@ OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateModel(const char* config_path, OgaMo
  */
 OGA_EXPORT void OGA_API_CALL OgaDestroyModel(OgaModel* model);
 
+/*
+ * \brief Creates a handle that models can be loaded with to share their weights. A model file and its external data
+ *        are mapped once for every model created with the handle, and prepacked CPU weights are shared between them.
+ * \param[out] out The created handle, destroy it with OgaDestroySharedWeights.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateSharedWeights(OgaSharedWeights** out);
+
+OGA_EXPORT void OGA_API_CALL OgaDestroySharedWeights(OgaSharedWeights* shared_weights);
+
+/*
+ * \brief Creates a model like OgaCreateModel, sharing the weights with the other models created with shared_weights.
+ * \param[in] config_path The path to the model configuration directory.
+ * \param[in] shared_weights The handle from OgaCreateSharedWeights, the models keep what they use of it alive.
+ * \param[out] out The created model.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateModelWithSharedWeights(const char* config_path, OgaSharedWeights* shared_weights, OgaModel** out);
+
+/*
+ * \brief Loads the model once per CUDA device in this process, for data parallel serving without a process per GPU.
+ * \param[in] config_path The path to the model configuration directory, the model must run on CUDA.
+ * \param[in] device_ids The CUDA devices to load a replica on.
+ * \param[in] device_ids_count The number of device ids.
+ * \param[out] out The created replicas.
+ * \return OgaResult containing the error message if loading a replica failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateModelReplicas(const char* config_path, const int32_t* device_ids, size_t device_ids_count, OgaModelReplicas** out);
+
+/*
+ * \brief Picks the replica with the fewest generators alive, create the next generator on it. The model belongs to the
+ *        replicas, it stays valid until they're destroyed and must not be passed to OgaDestroyModel.
+ * \param[in] replicas The replicas.
+ * \param[out] out The least loaded model.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaModelReplicasGetModel(const OgaModelReplicas* replicas, const OgaModel** out);
+
+/*
+ * \brief The tokenizer shared by every replica, it belongs to the replicas like the models.
+ * \param[in] replicas The replicas.
+ * \param[out] out The tokenizer.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaModelReplicasGetTokenizer(const OgaModelReplicas* replicas, const OgaTokenizer** out);
+
+OGA_EXPORT void OGA_API_CALL OgaDestroyModelReplicas(OgaModelReplicas* replicas);
+
 /*
  * \brief Generates an array of token arrays from the model execution based on the given generator params.
  * \param[in] model The model to use for generation.
@@ -143,6 +207,98 @@ OGA_EXPORT void OGA_API_CALL OgaDestroyModel(OgaModel* model);
  */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerate(const OgaModel* model, const OgaGeneratorParams* generator_params, OgaSequences** out);
 
+/*
+ * \brief Scores the input sequences of the generator params without generating: a single run of the model gives the log
+ *        probability of every token given the tokens before it. Positions where the token or the one before it is the
+ *        pad token score 0. Decoder only models on CPU and CUDA only.
+ * \param[in] model The model to score with.
+ * \param[in] generator_params The parameters holding the input sequences, batch_size of sequence_length tokens.
+ * \param[out] scores The log probabilities, batch_size * (sequence_length - 1) of them, row by row.
+ * \param[in] scores_count The number of floats scores has room for.
+ * \return OgaResult containing the error message if the scoring failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaScoreSequences(const OgaModel* model, const OgaGeneratorParams* generator_params, float* scores, size_t scores_count);
+
+typedef enum OgaPooling {
+  OgaPooling_LastToken,  // The hidden state of each row's last token
+  OgaPooling_Mean,       // The mean of the hidden states of each row's tokens, padding left out
+} OgaPooling;
+
+/*
+ * \brief Embeds the input sequences of the generator params: a single run of the model gives the final hidden states of
+ *        every token, pooled per row. The model needs its hidden_states output, see the model builder's
+ *        include_hidden_states option. Decoder only models on CPU and CUDA only.
+ * \param[in] model The model to embed with.
+ * \param[in] generator_params The parameters holding the input sequences, batch_size of sequence_length tokens.
+ * \param[in] pooling How the hidden states of a row are reduced to its embedding.
+ * \param[out] embeddings The embeddings, batch_size * hidden_size of them, row by row.
+ * \param[in] embeddings_count The number of floats embeddings has room for.
+ * \return OgaResult containing the error message if the embedding failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaEmbedSequences(const OgaModel* model, const OgaGeneratorParams* generator_params, OgaPooling pooling, float* embeddings, size_t embeddings_count);
+
+/*
+ * \brief Captures the graphs for every batch size and max length up front, so the first requests don't pay for it.
+ *        Generators that call OgaGeneratorParamsTryGraphCaptureWithMaxBatchSize with one of the batch sizes and use
+ *        one of the max lengths reuse them. Graph capture has to be enabled in the decoder session options.
+ * \param[in] model The model.
+ * \param[in] batch_sizes The max batch sizes to capture graphs for.
+ * \param[in] batch_sizes_count The number of batch sizes.
+ * \param[in] max_lengths The max lengths to capture graphs for, the search max_length if null.
+ * \param[in] max_lengths_count The number of max lengths.
+ * \return OgaResult containing the error message if capturing failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaModelCaptureGraphs(const OgaModel* model, const int32_t* batch_sizes, size_t batch_sizes_count, const int32_t* max_lengths, size_t max_lengths_count);
+
+/*
+ * \brief Prefill/decode disaggregation: the prompts of the generators created on model afterwards are run on
+ *        prefill_model, and their kv cache is copied over for the decode steps. The prefill model can be on another
+ *        device (see OgaCreateModelReplicas), or share the weights with its own session options
+ *        (see OgaCreateModelWithSharedWeights), so long prompts don't hold up the decode steps of other generators.
+ *        Both have to be decoder only models with the same kv cache layout. Call it before creating generators.
+ * \param[in] model The model the generators are created on.
+ * \param[in] prefill_model The model the prompts are run on, it's kept alive by model.
+ * \return OgaResult containing the error message if the models aren't compatible.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaModelSetPrefillModel(OgaModel* model, const OgaModel* prefill_model);
+
+/*
+ * \brief Device memory of generators in bytes, estimated from their params before anything is allocated.
+ */
+typedef struct OgaGeneratorMemory {
+  uint64_t kv_cache;        /* Past and present key/values at max_length */
+  uint64_t logits;          /* The prompt's logits, the largest ones */
+  uint64_t static_buffers;  /* Graph capture: the other inputs sized for the max batch size */
+} OgaGeneratorMemory;
+
+/*
+ * \brief Estimates the device memory a generator created with params would take, so a server can tell whether it fits
+ *        before creating it. It's an upper bound, a graph captured earlier or a paged kv cache can need less.
+ * \param[in] model The model.
+ * \param[in] params The generator params.
+ * \param[out] out The estimate.
+ * \return OgaResult containing the error message if the estimate failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaModelEstimateGeneratorMemory(const OgaModel* model, const OgaGeneratorParams* params, OgaGeneratorMemory* out);
+
+/*
+ * \brief Reads the memory estimated for the generators of the model that are alive. With memory_budget_mb in the decoder
+ *        config, OgaCreateGenerator fails when a generator's estimate doesn't fit next to it.
+ * \param[in] model The model.
+ * \param[out] used The memory of the live generators.
+ * \param[out] budget The memory_budget_mb in bytes, 0 when there's no budget.
+ * \return OgaResult containing the error message if reading the usage failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaModelGetMemoryUsage(const OgaModel* model, OgaGeneratorMemory* used, uint64_t* budget);
+
+/*
+ * \brief With memory_pool_mb in the decoder config, gives the device memory the pool keeps for the next generators
+ *        back to the device allocator, e.g. before loading another model. Does nothing without a pool.
+ * \param[in] model The model.
+ * \return OgaResult containing the error message if trimming failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaModelTrimMemoryPool(const OgaModel* model);
+
 /*
  * \brief Creates a OgaGeneratorParams from the given model.
  * \param[in] model The model to use for generation.
@@ -161,6 +317,120 @@ OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetSearchNumber(OgaGenerato
 OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetSearchBool(OgaGeneratorParams* generator_params, const char* name, bool value);
 OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsTryGraphCaptureWithMaxBatchSize(OgaGeneratorParams* generator_params, int32_t max_batch_size);
 
+/*
+ * \brief Sets a search option of one row of the batch only: do_sample, top_k, top_p, temperature, the penalties or
+ * random_seed. The other options of the row are copied from the batch wide ones the first time one of its options is
+ * set, so set those first. A row draws from the batch's random stream until its own random_seed is set, after which it
+ * samples the same tokens whatever batch it's in. Only supported by greedy search and sampling.
+ * \param[in] generator_params The generator params to set the option on.
+ * \param[in] row The index of the row in the batch.
+ * \param[in] name The name of the option, see config.h 'struct Search'.
+ * \param[in] value The value of the option.
+ * \return OgaResult containing the error message if the option is unknown.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetRowSearchNumber(OgaGeneratorParams* generator_params, size_t row, const char* name, double value);
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetRowSearchBool(OgaGeneratorParams* generator_params, size_t row, const char* name, bool value);
+
+/*
+ * \brief Creates a cancellation, to stop every generator created with the generator params it's set on (including the
+ *        one OgaGenerate runs) from another thread, like when the client of a request goes away. Cancelled generators
+ *        are done, the search option timeout_ms cancels a generator that long after its creation.
+ * \param[out] out The created cancellation, destroy it with OgaDestroyCancellation.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateCancellation(OgaCancellation** out);
+OGA_EXPORT void OGA_API_CALL OgaDestroyCancellation(OgaCancellation* cancellation);
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetCancellation(OgaGeneratorParams* generator_params, OgaCancellation* cancellation);
+
+/*
+ * \brief Cancels the generators of a cancellation. Safe to call from any thread while they run.
+ * \param[in] cancellation The cancellation.
+ * \param[in] terminate_runs True to also terminate the model runs in progress, like a long prompt, instead of stopping
+ *            at the end of the current one.
+ */
+OGA_EXPORT void OGA_API_CALL OgaCancel(OgaCancellation* cancellation, bool terminate_runs);
+
+/*
+ * \brief Creates the LoRA adapters of a model exported with the enable_lora builder option. The adapters are kept in
+ *        device memory once and every generator, or every row of one, can run with a different adapter.
+ * \param[in] model The base model, kept alive by the adapters.
+ * \param[out] out The created adapters, destroy them with OgaDestroyAdapters.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateAdapters(const OgaModel* model, OgaAdapters** out);
+OGA_EXPORT void OGA_API_CALL OgaDestroyAdapters(OgaAdapters* adapters);
+
+/*
+ * \brief Loads an adapter exported by the model builder's adapter_path option. Generators created before keep using
+ *        the adapters that were loaded when they were created.
+ * \param[in] adapters The adapters to add it to.
+ * \param[in] adapter_path The path to the adapter's onnx file.
+ * \param[in] name The name generators select it by.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaLoadAdapter(OgaAdapters* adapters, const char* adapter_path, const char* name);
+
+/*
+ * \brief Unloads an adapter, its device memory is reused by the next adapter loaded once no generator runs with it.
+ *        Generators created before keep running with it, generator params that select it fail to create generators.
+ * \param[in] adapters The adapters to remove it from.
+ * \param[in] name The name the adapter was loaded with.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaUnloadAdapter(OgaAdapters* adapters, const char* name);
+
+/*
+ * \brief Selects the adapter every row of the batch runs with, an empty name runs the base model.
+ * \param[in] generator_params The generator params to set the adapter on.
+ * \param[in] adapters The adapters the name is looked up in, kept alive by the generator params.
+ * \param[in] name The name the adapter was loaded with.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetAdapter(OgaGeneratorParams* generator_params, const OgaAdapters* adapters, const char* name);
+
+/*
+ * \brief Overrides the adapter of one row of the batch, after OgaGeneratorParamsSetAdapter.
+ * \param[in] generator_params The generator params to set the adapter on.
+ * \param[in] row The index of the row in the batch.
+ * \param[in] name The name the adapter was loaded with, empty for the base model.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetRowAdapter(OgaGeneratorParams* generator_params, size_t row, const char* name);
+
+/*
+ * \brief Sets a bias that is added to the logit of each of the given tokens every step, replacing any earlier bias.
+ * \param[in] generator_params The generator params to set the bias on.
+ * \param[in] token_ids The tokens to bias, of size count.
+ * \param[in] biases The bias of each token, of size count.
+ * \param[in] count The number of tokens.
+ * \return OgaResult containing the error message if the setting of the bias failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetLogitBias(OgaGeneratorParams* generator_params, const int32_t* token_ids, const float* biases, size_t count);
+
+/*
+ * \brief Adds a token sequence that is never generated. The last token is banned whenever the sequence ends with the
+ * ones before it, so a single token is banned every step.
+ * \param[in] generator_params The generator params to add the bad word to.
+ * \param[in] token_ids The tokens of the bad word, of size count.
+ * \param[in] count The number of tokens.
+ * \return OgaResult containing the error message if the adding of the bad word failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsAddBadWords(OgaGeneratorParams* generator_params, const int32_t* token_ids, size_t count);
+
+/*
+ * \brief Adds a token sequence that finishes a row once its generated tokens end with it. The sequence is kept in the
+ * output and the row is padded from then on, like after eos. Only supported by greedy search and sampling.
+ * \param[in] generator_params The generator params to add the stop sequence to.
+ * \param[in] token_ids The tokens of the stop sequence, of size count.
+ * \param[in] count The number of tokens.
+ * \return OgaResult containing the error message if the adding of the stop sequence failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsAddStopSequence(OgaGeneratorParams* generator_params, const int32_t* token_ids, size_t count);
+
+/*
+ * \brief Constrains the generated text to a match of the regex pattern. Compiling a pattern the first time is slow,
+ * grammars are reused while another generator params of the tokenizer still uses them.
+ * \param[in] generator_params The generator params to constrain, it must be for greedy search or sampling.
+ * \param[in] tokenizer The tokenizer of the model, its vocab is what the pattern is matched against.
+ * \param[in] pattern The regex, see Grammar in grammar.h for the supported syntax.
+ * \return OgaResult containing the error message if the pattern is invalid.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetRegexConstraint(OgaGeneratorParams* generator_params, const OgaTokenizer* tokenizer, const char* pattern);
+
 /*
  * \brief Sets the input ids for the generator params. The input ids are used to seed the generation.
  * \param[in] generator_params The generator params to set the input ids on.
@@ -173,6 +443,32 @@ OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsTryGraphCaptureWithMaxBatch
 OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetInputIDs(OgaGeneratorParams* generator_params, const int32_t* input_ids,
                                                                  size_t input_ids_count, size_t sequence_length, size_t batch_size);
 
+/*
+ * \brief Sets the encoder input ids of an encoder-decoder model (t5, bart), padded with the model's pad token. The input
+ *        ids set with OgaGeneratorParamsSetInputIDs are then the decoder's prompt, if there are none yet every row's is
+ *        the model's decoder_start_token_id. The encoder runs once per row, its outputs are shared by the beams and samples.
+ * \param[in] generator_params The generator params to set the encoder input ids on.
+ * \param[in] input_ids The encoder input ids array of size input_ids_count = batch_size * sequence_length, which has to
+ *            outlive the generator params like the input ids.
+ * \param[in] input_ids_count The total number of encoder input ids.
+ * \param[in] sequence_length The sequence length of the encoder input ids.
+ * \param[in] batch_size The batch size of the encoder input ids, the same as the decoder's.
+ * \return OgaResult containing the error message if the setting of the encoder input ids failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetEncoderInputIDs(OgaGeneratorParams* generator_params, const int32_t* input_ids,
+                                                                        size_t input_ids_count, size_t sequence_length, size_t batch_size);
+
+/*
+ * \brief Sets ragged prompts for the generator params: the prompts of every row one after another with their lengths.
+ * The rows are padded to the longest one, and the padding is told apart by the lengths, not by the pad token id.
+ * \param[in] tokens The tokens of all prompts, token_count of them, lengths[0] for the first row followed by the next.
+ * \param[in] lengths batch_size token counts, at least one each.
+ * \param[in] pad_left Pads the start of the rows rather than the end, so every row ends on its last token.
+ * \return OgaResult containing the error message if the lengths don't add up to token_count.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetPackedInputs(OgaGeneratorParams* generator_params, const int32_t* tokens, size_t token_count,
+                                                                     const int32_t* lengths, size_t batch_size, bool pad_left);
+
 /*
  * \brief Sets the input id sequences for the generator params. The input id sequences are used to seed the generation.
  * \param[in] generator_params The generator params to set the input ids on.
@@ -216,6 +512,14 @@ OGA_EXPORT void OGA_API_CALL OgaDestroyGenerator(OgaGenerator* generator);
  */
 OGA_EXPORT bool OGA_API_CALL OgaGenerator_IsDone(const OgaGenerator* generator);
 
+/*
+ * \brief Cancels a generator like OgaCancel, it's done from the next step on. Safe to call from any thread while the
+ *        generator runs.
+ * \param[in] generator The generator to cancel.
+ * \param[in] terminate_runs True to also terminate the model run in progress.
+ */
+OGA_EXPORT void OGA_API_CALL OgaGenerator_Cancel(OgaGenerator* generator, bool terminate_runs);
+
 /*
  * \brief Computes the logits from the model based on the input ids and the past state. The computed logits are stored in the generator.
  * \param[in] generator The generator to compute the logits for.
@@ -224,6 +528,125 @@ OGA_EXPORT bool OGA_API_CALL OgaGenerator_IsDone(const OgaGenerator* generator);
 OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_ComputeLogits(OgaGenerator* generator);
 OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_GenerateNextToken(OgaGenerator* generator);
 
+/*
+ * \brief Frees the device memory of an idle generator (e.g. between chat turns) by moving its kv cache to pinned host memory.
+ *        OgaGenerator_SwapIn must be called before the next OgaGenerator_ComputeLogits.
+ * \param[in] generator The generator to swap out.
+ * \param[in] path Optional, when not null the kv cache is written to this file instead of host memory.
+ * \return OgaResult containing the error message if swapping out failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_SwapOut(OgaGenerator* generator, const char* path);
+
+/*
+ * \brief Moves the kv cache of a generator swapped out with OgaGenerator_SwapOut back into device memory.
+ * \param[in] generator The generator to swap in.
+ * \return OgaResult containing the error message if swapping in failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_SwapIn(OgaGenerator* generator);
+
+/*
+ * \brief Appends tokens (e.g. the next user turn of a chat) to the sequence of a batch size 1 greedy generator. The next
+ *        OgaGenerator_ComputeLogits runs them on top of the existing kv cache, so the whole history isn't run again.
+ *        Call it after OgaGenerator_GenerateNextToken, it also works once the generator is done.
+ * \param[in] generator The generator to append the tokens to.
+ * \param[in] tokens The tokens to append.
+ * \param[in] token_count The number of tokens.
+ * \return OgaResult containing the error message if appending the tokens failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_AppendTokens(OgaGenerator* generator, const int32_t* tokens, size_t token_count);
+
+/*
+ * \brief Writes a snapshot of a batch size 1 greedy generator (its sequence, search state and kv cache) to a file, so the
+ *        session can be moved to another process with OgaLoadGenerator without running the prompt again.
+ *        Call it after OgaGenerator_GenerateNextToken, the generator stays usable.
+ * \param[in] generator The generator to save.
+ * \param[in] path The file to write the snapshot to.
+ * \return OgaResult containing the error message if saving the generator failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_Save(const OgaGenerator* generator, const char* path);
+
+/*
+ * \brief Timers and counters of a generator since it was created. Times are host wall clock seconds. The transfers and
+ *        device allocations are the ones made by this library, not the ones made inside onnxruntime.
+ */
+typedef struct OgaGeneratorMetrics {
+  double prefill_seconds;        /* Model runs of the first OgaGenerator_ComputeLogits, the prompt */
+  double decode_seconds;         /* Model runs of every later OgaGenerator_ComputeLogits */
+  double update_inputs_seconds;  /* The rest of OgaGenerator_ComputeLogits: input ids, positions, mask and kv cache updates */
+  double search_seconds;         /* Processing the logits and OgaGenerator_GenerateNextToken */
+  uint64_t decode_steps;         /* OgaGenerator_ComputeLogits calls after the first */
+  uint64_t host_to_device_bytes;
+  uint64_t device_to_host_bytes;
+  uint64_t device_allocations;
+} OgaGeneratorMetrics;
+
+/*
+ * \brief Reads the metrics of a generator, cheap enough to call after every step.
+ * \param[in] generator The generator to read the metrics of.
+ * \param[out] out The metrics.
+ * \return OgaResult containing the error message if reading the metrics failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_GetMetrics(const OgaGenerator* generator, OgaGeneratorMetrics* out);
+
+/*
+ * \brief Returns the log probabilities of the tokens generated by the last OgaGenerator_GenerateNextToken, the search
+ *        option top_logprobs must be set. The arrays are owned by the generator and valid until its next step.
+ * \param[in] generator The generator to get the log probabilities of.
+ * \param[out] logprobs The log probability of the new token of every sequence.
+ * \param[out] count The number of sequences.
+ * \param[out] top_tokens The top_count most likely tokens of every sequence, most likely first, count * top_count entries.
+ * \param[out] top_logprobs The log probabilities of top_tokens.
+ * \param[out] top_count The top_logprobs search option.
+ * \return OgaResult containing the error message if getting the log probabilities failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_GetLogProbs(const OgaGenerator* generator, const float** logprobs, size_t* count,
+                                                             const int32_t** top_tokens, const float** top_logprobs, size_t* top_count);
+
+/*
+ * \brief Called by OgaGenerator_Stream with every token generated for a row of the batch.
+ * \param[in] user_data The user_data passed to OgaGenerator_Stream.
+ * \param[in] row The batch row the token was generated for.
+ * \param[in] token The generated token.
+ * \param[in] text The token decoded by the tokenizer, an empty string without one. Only valid during the call.
+ * \return false to stop the generation.
+ */
+typedef bool(OGA_API_CALL* OgaTokenCallback)(void* user_data, size_t row, int32_t token, const char* text);
+
+/*
+ * \brief Runs a greedy search or sampling generator until it's done and hands every new token to the callback, instead
+ *        of calling OgaGenerator_ComputeLogits and OgaGenerator_GenerateNextToken in a loop. Decoding and the callback
+ *        run on a separate thread so they overlap with the next decoder step, the callback is only ever called from
+ *        that thread, one token at a time in the order they were generated. Eos tokens and the pad tokens of finished
+ *        rows aren't handed over.
+ * \param[in] generator The generator to run.
+ * \param[in] tokenizer Optional, decodes the tokens for the callback.
+ * \param[in] callback Called with every new token.
+ * \param[in] user_data Passed on to the callback.
+ * \return OgaResult containing the error message if the generation failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_Stream(OgaGenerator* generator, const OgaTokenizer* tokenizer, OgaTokenCallback callback, void* user_data);
+
+/*
+ * \brief Branches a batch size 1 greedy generator: the new generator carries on from its sequence and kv cache without
+ *        running them again, with the search options of params (their input ids aren't used). Give it another
+ *        random_seed to sample differently. Call it after OgaGenerator_GenerateNextToken, the generator stays usable.
+ * \param[in] generator The generator to fork.
+ * \param[in] params The search options of the fork.
+ * \param[out] out The new generator.
+ * \return OgaResult containing the error message if forking the generator failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_Fork(const OgaGenerator* generator, const OgaGeneratorParams* params, OgaGenerator** out);
+
+/*
+ * \brief Creates a generator from a snapshot written by OgaGenerator_Save with the same model.
+ * \param[in] model The model to use for generation.
+ * \param[in] params The search options to continue with, the input ids come from the snapshot.
+ * \param[in] path The snapshot file.
+ * \param[out] out The restored generator.
+ * \return OgaResult containing the error message if loading the generator failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaLoadGenerator(const OgaModel* model, const OgaGeneratorParams* params, const char* path, OgaGenerator** out);
+
 /*
  * \brief Returns the number of tokens in the sequence at the given index.
  * \param[in] generator The generator to get the count of the tokens for the sequence at the given index.
@@ -236,11 +659,109 @@ OGA_EXPORT size_t OGA_API_CALL OgaGenerator_GetSequenceCount(const OgaGenerator*
  *        is given by OgaGenerator_GetSequenceCount
  * \param[in] generator The generator to get the sequence data for the sequence at the given index.
  * \return The pointer to the sequence data at the given index. The sequence data is owned by the OgaGenerator
- *         and will be freed when the OgaGenerator is destroyed. The caller must copy the data if it needs to
- *         be used after the OgaGenerator is destroyed.
+ *         and will be freed when the OgaGenerator is destroyed. Every index has its own data, which later calls for
+ *         the same index (here or in OgaGenerator_GetSequenceTail) and new tokens may overwrite. The caller must copy
+ *         the data if it needs to be used after that or after the OgaGenerator is destroyed.
  */
 OGA_EXPORT const int32_t* OGA_API_CALL OgaGenerator_GetSequenceData(const OgaGenerator* generator, size_t index);
 
+/*
+ * \brief Returns the tokens of the sequence at the given index from offset on. For streaming, pass the number of
+ *        tokens already read: only the new ones are copied off the device, instead of the whole sequence for
+ *        OgaGenerator_GetSequenceData. The last n tokens are at offset OgaGenerator_GetSequenceCount - n.
+ * \param[in] offset The first token to return, at most the sequence length.
+ * \param[out] tokens The tokens, owned by the generator like the data of OgaGenerator_GetSequenceData for the same
+ *        index and valid as long.
+ * \param[out] count The number of tokens, the sequence length minus offset.
+ * \return OgaResult containing the error message if offset is past the end of the sequence.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_GetSequenceTail(const OgaGenerator* generator, size_t index, size_t offset,
+                                                                const int32_t** tokens, size_t* count);
+
+/*
+ * \brief Returns the tokens picked by the last OgaGenerator_GenerateNextToken, one per row of the batch (batch_size *
+ *        num_beams). They are owned by the generator and valid until its next OgaGenerator_GenerateNextToken.
+ * \param[out] tokens The next tokens.
+ * \param[out] count The number of tokens.
+ * \return OgaResult containing the error message if getting the tokens failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_GetNextTokens(const OgaGenerator* generator, const int32_t** tokens, size_t* count);
+
+/*
+ * \brief Steps many generators by one token in a single call: OgaGenerator_ComputeLogits and
+ *        OgaGenerator_GenerateNextToken for every generator that isn't done, then its next tokens. For serving loops
+ *        that step hundreds of generators per tick, so they don't pay an OgaResult and three calls per generator.
+ *        Each generator keeps its own kv cache and runs its own session, the runs of different generators overlap.
+ *        To step independent requests in one batched model run, merge their generators with OgaGenerators_Merge, or
+ *        let an OgaScheduler (see OgaCreateScheduler) pack and merge them as they arrive.
+ * \param[in] generators The generators, they can belong to different models.
+ * \param[in] count The number of generators.
+ * \param[out] next_tokens The next tokens of every generator one after another, batch_size * num_beams each. The rows
+ *        of a generator that was already done or failed get -1, which OgaTokenizerBatchStreamDecode skips.
+ * \param[in] next_tokens_capacity The number of tokens next_tokens holds.
+ * \param[out] next_tokens_count The number of tokens written. Also set when the buffer is too small, then nothing is
+ *        stepped.
+ * \return OgaResult containing the error message if the buffer is too small or a generator failed, the message names
+ *         the first generator that failed. The other generators have stepped and their tokens are written.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerators_Step(OgaGenerator* const* generators, size_t count, int32_t* next_tokens,
+                                                      size_t next_tokens_capacity, size_t* next_tokens_count);
+
+/*
+ * \brief Merges generators of one decoder only model into a single generator, whose batch holds every row of each of
+ *        them in order, so OgaGenerators_Step or OgaGenerator_ComputeLogits runs them all in one batched run. Call it
+ *        after OgaGenerator_GenerateNextToken. The sequences are left padded to the longest and carry on from their
+ *        kv cache, which is taken from the merged generators: they can only be destroyed afterwards.
+ * \param[in] generators The generators, num_beams 1 without constrained decoding.
+ * \param[in] count The number of generators.
+ * \param[in] params The search options of the merged generator (search.max_length covering the padding), their input
+ *        ids aren't used.
+ * \param[out] out The merged generator.
+ * \return OgaResult containing the error message if the generators can't be merged, they're left as they were.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerators_Merge(OgaGenerator* const* generators, size_t count, const OgaGeneratorParams* params,
+                                                       OgaGenerator** out);
+
+/*
+ * \brief Creates a scheduler serving many independent requests on one model: every OgaScheduler_Step generates one
+ *        token for all the running requests in as few batched model runs as it can, and admits the queued ones.
+ *        Requests finish on their own, when their row hits EOS, a stop sequence or their max_length.
+ * \param[in] model The model, which has to outlive the scheduler.
+ * \param[in] params The search options of every request (greedy search or sampling), their input ids aren't used.
+ * \param[out] out The created scheduler.
+ * \return OgaResult containing the error message if the scheduler creation failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateScheduler(const OgaModel* model, const OgaGeneratorParams* params, OgaScheduler** out);
+OGA_EXPORT void OGA_API_CALL OgaDestroyScheduler(OgaScheduler* scheduler);
+
+/*
+ * \brief Queues a prompt, it starts generating on a following OgaScheduler_Step.
+ * \param[in] max_length The length the request is finished at, 0 for the max_length of the scheduler's params.
+ * \param[out] request_id The id to check the request and take its result with.
+ * \return OgaResult containing the error message if the prompt is empty or too long.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaScheduler_AddRequest(OgaScheduler* scheduler, const int32_t* prompt, size_t prompt_count,
+                                                           int32_t max_length, int32_t* request_id);
+
+/*
+ * \brief Same as OgaScheduler_AddRequest, with the request's priority in place of the one of the scheduler's params.
+ *        Requests of a higher priority are admitted first, and preempt running ones of a lower priority when memory
+ *        runs short.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaScheduler_AddRequestWithPriority(OgaScheduler* scheduler, const int32_t* prompt, size_t prompt_count,
+                                                                       int32_t max_length, int32_t priority, int32_t* request_id);
+OGA_EXPORT OgaResult* OGA_API_CALL OgaScheduler_Step(OgaScheduler* scheduler);
+OGA_EXPORT bool OGA_API_CALL OgaScheduler_IsIdle(const OgaScheduler* scheduler);  // No queued or running requests
+OGA_EXPORT OgaResult* OGA_API_CALL OgaScheduler_IsFinished(const OgaScheduler* scheduler, int32_t request_id, bool* out);
+
+/*
+ * \brief Takes the result of a finished request, which the scheduler then forgets.
+ * \param[out] out One sequence, the prompt followed by the generated tokens. Destroy it with OgaDestroySequences.
+ * \return OgaResult containing the error message if the request id is unknown, the request isn't finished, or the
+ *         request failed (e.g. it can never fit in the model's memory budget).
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaScheduler_TakeResult(OgaScheduler* scheduler, int32_t request_id, OgaSequences** out);
+
 OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateTokenizer(const OgaModel* model, OgaTokenizer** out);
 OGA_EXPORT void OGA_API_CALL OgaDestroyTokenizer(OgaTokenizer*);
 
@@ -253,8 +774,62 @@ OGA_EXPORT void OGA_API_CALL OgaDestroyMultiModalProcessor(OgaMultiModalProcesso
  */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaTokenizerEncode(const OgaTokenizer*, const char* str, OgaSequences* sequences);
 
+/*
+ * \brief Encodes a prompt given as segments, like a fixed system prompt, a tool schema and the user's message, and adds
+ *        the tokens of all of them as one sequence to the OgaSequences. Each segment is tokenized on its own and the
+ *        tokenizer keeps the tokens of recent segments (model.tokenizer_cache_size in the config), so repeated
+ *        segments aren't tokenized again. Segment boundaries should be where the tokenizer splits anyway, like next to
+ *        a special token or a newline.
+ * \param[in] tokenizer The tokenizer to use.
+ * \param[in] segments The segments of the prompt, in order.
+ * \param[in] count The number of segments.
+ * \param[out] sequences The sequences to add the prompt's tokens to.
+ * \return OgaResult containing the error message if the encoding failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaTokenizerEncodeSegments(const OgaTokenizer* tokenizer, const char* const* segments, size_t count,
+                                                              OgaSequences* sequences);
+
+/*
+ * \brief Encodes a batch of strings straight into a caller provided buffer, with no copies in between. Row i starts at
+ *        tokens + i * sequence_length and is padded with the model's pad token to the longest row.
+ * \param[in] tokenizer The tokenizer to use.
+ * \param[in] strings The strings to encode.
+ * \param[in] count The number of strings.
+ * \param[out] tokens The buffer to write the rows into.
+ * \param[in] tokens_capacity The number of tokens the buffer holds, at least count * sequence_length.
+ * \param[out] lengths Optional, count entries: the length of every row before the padding.
+ * \param[out] sequence_length The length of the padded rows. Also set when the buffer is too small, so the call can
+ *        be repeated with a large enough one.
+ * \return OgaResult containing the error message if the encoding failed or the buffer is too small.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaTokenizerEncodeBatchInto(const OgaTokenizer* tokenizer, const char* const* strings, size_t count,
+                                                               int32_t* tokens, size_t tokens_capacity, int32_t* lengths, size_t* sequence_length);
+
+/*
+ * \brief Encodes a batch of strings straight into the input ids of the generator params, padded with the model's pad
+ *        token to the longest row and setting the batch size and sequence length, like OgaGeneratorParamsSetInputSequences
+ *        without going through OgaSequences.
+ * \param[in] tokenizer The tokenizer to use.
+ * \param[in] strings The strings to encode.
+ * \param[in] count The number of strings.
+ * \param[in] generator_params The generator params to set the input ids of.
+ * \param[out] lengths Optional, count entries: the length of every row before the padding.
+ * \return OgaResult containing the error message if the encoding failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaTokenizerEncodeBatchToParams(const OgaTokenizer* tokenizer, const char* const* strings, size_t count,
+                                                                   OgaGeneratorParams* generator_params, int32_t* lengths);
+
 OGA_EXPORT OgaResult* OGA_API_CALL OgaProcessorProcessImages(const OgaMultiModalProcessor*, const char* prompt, const OgaImages* images, OgaNamedTensors** input_tensors);
 
+/*
+ * \brief Processes several prompts and their images at once, the images are preprocessed in parallel.
+ * \param[in] prompts Array of count null terminated utf8 prompts.
+ * \param[in] images Array of count images, images[i] goes with prompts[i] and may be null for a prompt without images.
+ * \param[out] input_tensors Array of count pointers that receive the inputs of every prompt, each must be freed
+ *              with OgaDestroyNamedTensors.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaProcessorProcessImagesBatch(const OgaMultiModalProcessor*, const char* const* prompts, const OgaImages* const* images, size_t count, OgaNamedTensors** input_tensors);
+
 /* Decode a single token sequence and returns a null terminated utf8 string. out_string must be freed with OgaDestroyString
  */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaTokenizerDecode(const OgaTokenizer*, const int32_t* tokens, size_t token_count, const char** out_string);
@@ -273,6 +848,24 @@ OGA_EXPORT void OGA_API_CALL OgaDestroyTokenizerStream(OgaTokenizerStream*);
  */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaTokenizerStreamDecode(OgaTokenizerStream*, int32_t token, const char** out);
 
+/* OgaTokenizerBatchStream is an OgaTokenizerStream for every row of a batch, to decode the next tokens of all rows in one call.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateTokenizerBatchStream(const OgaTokenizer*, size_t batch_size, OgaTokenizerBatchStream** out);
+OGA_EXPORT void OGA_API_CALL OgaDestroyTokenizerBatchStream(OgaTokenizerBatchStream*);
+
+/*
+ * \brief Decodes the next token of every row, for example the output of OgaGenerator_GetNextTokens.
+ * \param[in] tokens batch_size tokens, a negative token is skipped (a finished row gets no text).
+ * \param[out] text The new text of all rows one after another, not null terminated.
+ * \param[out] offsets batch_size + 1 offsets into text, row i's text is text[offsets[i]] to text[offsets[i + 1]].
+ * text and offsets are valid until the next call to OgaTokenizerBatchStreamDecode or when the stream is destroyed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaTokenizerBatchStreamDecode(OgaTokenizerBatchStream*, const int32_t* tokens, size_t token_count,
+                                                                  const char** text, const size_t** offsets);
+
+/* Starts a row of the stream over, for a new sequence in the row */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaTokenizerBatchStreamResetRow(OgaTokenizerBatchStream*, size_t row);
+
 /* Create an OgaTensor from a user owned buffer. The OgaTensor does not own the memory (as it has no way to free it) so
  * the 'data' parameter must be valid for the lifetime of the OgaTensor.
  *
@@ -283,6 +876,16 @@ OGA_EXPORT OgaResult* OGA_API_CALL OgaTokenizerStreamDecode(OgaTokenizerStream*,
  * \param[out] out Writes the newly created OgaTensor into this, must be destroyed with OgaDestroyTensor
  */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateTensorFromBuffer(void* data, const int64_t* shape_dims, size_t shape_dims_count, OgaElementType element_type, OgaTensor** out);
+
+/* Like OgaCreateTensorFromBuffer, for data already in the memory of the model's device: a CUDA pointer, or on DML an
+ * allocation of the DML execution provider's allocator. Set as a model input, the generator binds it or copies it on the
+ * device, so it never goes through the host.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateTensorFromDeviceBuffer(const OgaModel* model, void* data, const int64_t* shape_dims, size_t shape_dims_count, OgaElementType element_type, OgaTensor** out);
+
+/* Allocates an OgaTensor in the memory of the model's device, to be filled on the device through OgaTensorGetData
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateDeviceTensor(const OgaModel* model, const int64_t* shape_dims, size_t shape_dims_count, OgaElementType element_type, OgaTensor** out);
 OGA_EXPORT void OGA_API_CALL OgaDestroyTensor(OgaTensor* tensor);
 
 /* Get the OgaElementType of the data stored in the OgaTensor
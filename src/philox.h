@@ -0,0 +1,55 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+// Counter based random numbers, Philox4x32-10 from "Parallel Random Numbers: As Easy as 1, 2, 3" (Salmon et al.,
+// SC 2011). A draw is a pure function of the row's seed, its subsequence and the step, so a row samples the same tokens
+// whatever else is in its batch or whichever thread samples it, and there's no engine state to seed, save or restore.
+// Included by the CPU search and the CUDA sampling kernels, which then draw the same numbers.
+#pragma once
+#include <cstdint>
+
+#if defined(__CUDACC__)
+#define PHILOX_HOST_DEVICE __host__ __device__
+#else
+#define PHILOX_HOST_DEVICE
+#endif
+
+namespace Generators {
+
+// The random stream of one batch row
+struct RandomRow {
+  uint64_t seed;
+  uint64_t subsequence;  // The row index for rows sharing the batch seed, 0 for a row with a seed of its own
+};
+
+PHILOX_HOST_DEVICE inline uint32_t PhiloxMulHiLo(uint32_t a, uint32_t b, uint32_t& lo) {
+  const uint64_t product = static_cast<uint64_t>(a) * b;
+  lo = static_cast<uint32_t>(product);
+  return static_cast<uint32_t>(product >> 32);
+}
+
+// The first word of the Philox4x32-10 block with key seed and counter (step, subsequence)
+PHILOX_HOST_DEVICE inline uint32_t Philox4x32(uint64_t seed, uint64_t subsequence, uint64_t step) {
+  uint32_t c0 = static_cast<uint32_t>(step), c1 = static_cast<uint32_t>(step >> 32);
+  uint32_t c2 = static_cast<uint32_t>(subsequence), c3 = static_cast<uint32_t>(subsequence >> 32);
+  uint32_t k0 = static_cast<uint32_t>(seed), k1 = static_cast<uint32_t>(seed >> 32);
+  for (int round = 0; round < 10; round++) {
+    uint32_t lo0, lo1;
+    const uint32_t hi0 = PhiloxMulHiLo(0xD2511F53u, c0, lo0);
+    const uint32_t hi1 = PhiloxMulHiLo(0xCD9E8D57u, c2, lo1);
+    c0 = hi1 ^ c1 ^ k0;
+    c1 = lo1;
+    c2 = hi0 ^ c3 ^ k1;
+    c3 = lo0;
+    k0 += 0x9E3779B9u;
+    k1 += 0xBB67AE85u;
+  }
+  return c0;
+}
+
+// A uniform number in [0, 1) for the row's draw at step, from the top 24 bits so every value is exact in a float
+PHILOX_HOST_DEVICE inline float PhiloxUniform(const RandomRow& row, uint64_t step) {
+  return static_cast<float>(Philox4x32(row.seed, row.subsequence, step) >> 8) * (1.0f / 16777216.0f);
+}
+
+}  // namespace Generators
@@ -36,13 +36,42 @@ class Model:
 
         self.model_name_or_path = config._name_or_path
         self.model_type = config.architectures[0]
+
+        # Tensor parallel: with a world_size > 1 this builds the shard of one rank. The attention heads and the MLP are split over
+        # the ranks and an AllReduce sums their partial outputs, the embedding and the LM head are replicated on every rank.
+        self.world_size = int(extra_options["world_size"]) if "world_size" in extra_options else 1
+        self.rank = int(extra_options["rank"]) if "rank" in extra_options else 0
+        if self.world_size > 1:
+            if self.model_type not in {"LlamaForCausalLM", "MistralForCausalLM", "MixtralForCausalLM", "GemmaForCausalLM", "PhiForCausalLM"}:
+                raise NotImplementedError(f"Tensor parallel export isn't supported for {self.model_type}, its attention or MLP weights are packed")
+            if not 0 <= self.rank < self.world_size:
+                raise ValueError(f"rank {self.rank} is outside of the world_size {self.world_size}")
+            for name, size in [("num_attention_heads", self.num_attn_heads), ("num_key_value_heads", self.num_kv_heads), ("intermediate_size", self.intermediate_size)]:
+                if size % self.world_size != 0:
+                    raise ValueError(f"{name} ({size}) doesn't divide evenly over the world_size {self.world_size}")
+            self.num_attn_heads //= self.world_size
+            self.num_kv_heads //= self.world_size
+            self.intermediate_size //= self.world_size
         self.io_dtype = io_dtype      # {'fp16', 'fp32'}
-        self.onnx_dtype = onnx_dtype  # {"int4", "fp16", "fp32"}
+        self.onnx_dtype = onnx_dtype  # {"int4", "int8", "fp16", "fp32"}
 
         self.cache_dir = cache_dir
-        self.filename = extra_options["filename"] if "filename" in extra_options else "model.onnx"
+        self.filename = extra_options["filename"] if "filename" in extra_options else "model_%d.onnx" if self.world_size > 1 else "model.onnx"  # %d is the rank
+        if self.world_size > 1 and "%d" not in self.filename:
+            raise ValueError("filename needs a %d for the rank when world_size > 1")
         self.extra_options = extra_options
 
+        # CPU/GPU hybrid: the decoder layers in this model and the model with the layers after them (see `set_layers_range`)
+        self.layers_range = (0, self.num_layers)
+        self.offload_filename = None
+
+        # Multi-LoRA: every MatMul of the decoder layers gets <weight>.lora_A and <weight>.lora_B inputs holding the weights
+        # of all loaded adapters, and adapter_ids picks the adapter of every batch row (see make_lora)
+        self.enable_lora = "enable_lora" in extra_options and extra_options["enable_lora"] == "1"
+        if self.enable_lora and self.world_size > 1:
+            raise NotImplementedError("LoRA inputs aren't supported with tensor parallelism")
+        self.lora_targets = {}  # MatMul weight name: (in features, out features)
+
         self.inputs = []
         self.outputs = []
         self.initializers = []
@@ -70,6 +99,10 @@ class Model:
             "inputs_embeds": self.io_dtype,                                                                      # For standard models where you want to remove the embedding layer from the model (note that `inputs_embeds` is written this way to match Hugging Face format)
             "past_key_values.key": self.io_dtype,                                                                # For standard models (note that `past_key_values.key` is written this way to match Hugging Face format)
             "past_key_values.value": self.io_dtype,                                                              # For standard models (note that `past_key_values.value` is written this way to match Hugging Face format)
+            "last_token_indices": TensorProto.INT64,                                                             # For models that only compute the logits of the last token (see `last_token_logits`)
+            "adapter_ids": TensorProto.INT32,                                                                    # For models with LoRA inputs (see `enable_lora`)
+            "seqlens_k": TensorProto.INT32,                                                                      # For GQA models fed seqlens_k instead of the attention mask (see `exclude_attention_mask`)
+            "total_seq_len": TensorProto.INT32,                                                                  # For GQA models fed total_seq_len instead of the attention mask (see `exclude_attention_mask`)
         }
         self.input_shapes = {
             "input_ids": ["batch_size", "sequence_length"],                                                      # For standard models
@@ -78,6 +111,10 @@ class Model:
             "inputs_embeds": ["batch_size", "sequence_length", self.hidden_size],                                # For standard models where you want to remove the embedding layer from the model (note that `inputs_embeds` is written this way to match Hugging Face format)
             "past_key_values.key": ["batch_size", self.num_kv_heads, "past_sequence_length", self.head_size],    # For standard models (note that `past_key_values.key` is written this way to match Hugging Face format)
             "past_key_values.value": ["batch_size", self.num_kv_heads, "past_sequence_length", self.head_size],  # For standard models (note that `past_key_values.value` is written this way to match Hugging Face format)
+            "last_token_indices": ["batch_size", 1],                                                             # For models that only compute the logits of the last token (see `last_token_logits`)
+            "adapter_ids": ["batch_size"],                                                                       # For models with LoRA inputs (see `enable_lora`)
+            "seqlens_k": ["batch_size"],                                                                         # For GQA models fed seqlens_k instead of the attention mask (see `exclude_attention_mask`)
+            "total_seq_len": [],                                                                                 # For GQA models fed total_seq_len instead of the attention mask (see `exclude_attention_mask`)
         }
         self.exclude_embeds = "exclude_embeds" in extra_options
         if self.exclude_embeds:
@@ -88,18 +125,55 @@ class Model:
         self.output_types = {
             "hidden_states": self.io_dtype,                                                                      # For standard models where you want to remove the language modeling head from the model (note that `hidden_states` is written this way to match Hugging Face format)
             "logits": self.io_dtype,                                                                             # For standard models
+            "next_tokens": TensorProto.INT32,                                                                    # For models with an in-graph greedy head
+            "top_k_logits": self.io_dtype,                                                                       # For models with an in-graph top-k head
+            "top_k_indices": TensorProto.INT32,                                                                  # For models with an in-graph top-k head
             "present.key": self.io_dtype,                                                                        # For standard models (note that `present.key` is written this way to match Hugging Face format)
             "present.value": self.io_dtype,                                                                      # For standard models (note that `present.value` is written this way to match Hugging Face format)
         }
         self.output_shapes = {
             "hidden_states": ["batch_size", "sequence_length", self.hidden_size],                                # For standard models where you want to remove the language modeling head from the model (note that `hidden_states` is written this way to match Hugging Face format)
             "logits": ["batch_size", "sequence_length", self.vocab_size],                                        # For standard models
+            "next_tokens": ["batch_size", "sequence_length"],                                                    # For models with an in-graph greedy head
+            "top_k_logits": ["batch_size", "sequence_length", "top_k"],                                          # For models with an in-graph top-k head
+            "top_k_indices": ["batch_size", "sequence_length", "top_k"],                                         # For models with an in-graph top-k head
             "present.key": ["batch_size", self.num_kv_heads, "total_sequence_length", self.head_size],           # For standard models (note that `present.key` is written this way to match Hugging Face format)
             "present.value": ["batch_size", self.num_kv_heads, "total_sequence_length", self.head_size],         # For standard models (note that `present.value` is written this way to match Hugging Face format)
         }
         self.exclude_lm_head = "exclude_lm_head" in extra_options
         if self.exclude_lm_head:
             self.output_names = [name.replace("logits", "hidden_states") for name in self.output_names]
+        self.include_hidden_states = "include_hidden_states" in extra_options and extra_options["include_hidden_states"] == "1" and not self.exclude_lm_head
+        if self.include_hidden_states:
+            self.output_names.append("hidden_states")
+        self.last_token_logits = "last_token_logits" in extra_options and extra_options["last_token_logits"] == "1" and not self.exclude_lm_head
+        if self.last_token_logits:
+            # Gather the position given by `last_token_indices` before the LM head, so the prompt doesn't produce logits for every token
+            self.input_names.append("last_token_indices")
+            self.output_shapes["logits"] = ["batch_size", 1, self.vocab_size]
+        # In-graph sampling head on the logits: the runtime binds `next_tokens` instead of `logits` on plain greedy steps
+        self.next_tokens_head = "next_tokens_head" in extra_options and extra_options["next_tokens_head"] == "1" and not self.exclude_lm_head
+        if self.next_tokens_head:
+            self.output_names.append("next_tokens")
+        self.top_k_head = int(extra_options["top_k_head"]) if "top_k_head" in extra_options and not self.exclude_lm_head else 0
+        if self.top_k_head > 0:
+            self.output_names.extend(["top_k_logits", "top_k_indices"])
+            self.output_shapes["top_k_logits"][-1] = self.top_k_head
+            self.output_shapes["top_k_indices"][-1] = self.top_k_head
+        for name in ["next_tokens", "top_k_logits", "top_k_indices"]:
+            if self.last_token_logits:
+                self.output_shapes[name][1] = 1
+        if self.enable_lora:
+            self.input_names.append("adapter_ids")
+
+        # GGUF skeleton: the weights that are used as the GGUF file stores them aren't copied, their initializers point into the GGUF file
+        self.gguf_skeleton = "gguf_skeleton" in extra_options and extra_options["gguf_skeleton"] == "1"
+        self.gguf_filename = None  # Set when the GGUF file is loaded
+        self.gguf_initializers = []
+        if self.gguf_skeleton and onnx_dtype not in {"fp16", "fp32"}:
+            raise NotImplementedError("gguf_skeleton is only supported with the fp16 and fp32 precisions.")
+        if self.gguf_skeleton and ep == "cpu" and onnx_dtype != "fp32":
+            raise NotImplementedError("gguf_skeleton on CPU is only supported with the fp32 precision, the CPU FusedMatMul is fp32 only.")
 
         # Store names of nodes already created
         self.node_names = set()
@@ -226,6 +300,28 @@ class Model:
 
         self.past_present_share_buffer = self.attention_attrs["op_type"] == "GroupQueryAttention"
 
+        # Feed GQA's seqlens_k and total_seq_len directly, so there's no 2D attention mask to grow and reformat
+        self.exclude_attention_mask = "exclude_attention_mask" in extra_options and extra_options["exclude_attention_mask"] == "1"
+        if self.exclude_attention_mask:
+            if self.attention_attrs["op_type"] != "GroupQueryAttention" or self.ep == "dml":
+                raise NotImplementedError("exclude_attention_mask requires GroupQueryAttention on CPU or CUDA.")
+            index = self.input_names.index("attention_mask")
+            self.input_names[index:index + 1] = ["seqlens_k", "total_seq_len"]
+
+        # KV cache quantization: store the past/present key/values as INT8 with one scale per token per head
+        self.kv_quant = "kv_quant" in extra_options and extra_options["kv_quant"] == "int8"
+        if "kv_quant" in extra_options and not self.kv_quant:
+            raise NotImplementedError(f"The {extra_options['kv_quant']} KV cache quantization is not currently supported.")
+        if self.kv_quant:
+            if self.ep == "dml" or enable_cuda_graph == "1":
+                raise NotImplementedError("KV cache quantization is not supported with DML or CUDA graph capture.")
+            # The presents are the quantized pasts with the new tokens appended, so they can't share a buffer with the pasts
+            self.past_present_share_buffer = False
+            self.input_types["past_key_values.key"] = TensorProto.INT8
+            self.input_types["past_key_values.value"] = TensorProto.INT8
+            self.output_types["present.key"] = TensorProto.INT8
+            self.output_types["present.value"] = TensorProto.INT8
+
         # MLP-specific variables
         self.mlp_attrs = {
             "use_proj": True,           # Use projection style for MLP (GateProj/UpProj/DownProj)
@@ -245,12 +341,16 @@ class Model:
             self.lm_head_attrs["mask"] = dummy_tokens_mask
 
         # Quantization-specific variables (INT4, INT8, etc.)
+        # On CPU, int4 MatMuls default to int8 activations (accuracy level 4), which run on the MLAS int8 GEMM kernels
         self.quant_attrs = {
             "int4": {
                 "block_size": int(extra_options["int4_block_size"]) if "int4_block_size" in extra_options else 32,
-                "accuracy_level": int(extra_options["int4_accuracy_level"]) if "int4_accuracy_level" in extra_options else None,
-            }
+                "accuracy_level": int(extra_options["int4_accuracy_level"]) if "int4_accuracy_level" in extra_options else 4 if ep == "cpu" else None,
+            },
+            "embedding": onnx_dtype in {"int4", "int8"} and extra_options.get("quantize_embedding", "0") == "1",
         }
+        if extra_options.get("quantize_embedding", "0") == "1" and onnx_dtype not in {"int4", "int8"}:
+            raise ValueError("quantize_embedding is only supported with the int4 and int8 precisions")
 
     def make_genai_config(self, model_name_or_path, extra_kwargs, out_dir):
         config = GenerationConfig.from_pretrained(model_name_or_path, use_auth_token=True, trust_remote_code=True, **extra_kwargs)
@@ -259,6 +359,24 @@ class Model:
             "past_key_names": "past_key_values.%d.key",
             "past_value_names": "past_key_values.%d.value",
         })
+        outputs = {
+            "logits": "logits",
+            "present_key_names": "present.%d.key",
+            "present_value_names": "present.%d.value",
+        }
+        if self.exclude_lm_head or self.include_hidden_states or self.layers_range[1] < self.num_layers:
+            outputs["hidden_states"] = "hidden_states"
+        if self.next_tokens_head:
+            outputs["next_tokens"] = "next_tokens"
+        if self.kv_quant:
+            inputs.update({
+                "past_key_scale_names": "past_key_values.%d.key_scale",
+                "past_value_scale_names": "past_key_values.%d.value_scale",
+            })
+            outputs.update({
+                "present_key_scale_names": "present.%d.key_scale",
+                "present_value_scale_names": "present.%d.value_scale",
+            })
         genai_config = {
             "model": {
                 "bos_token_id": config.bos_token_id,
@@ -272,14 +390,10 @@ class Model:
                     "head_size": self.head_size,
                     "hidden_size": self.hidden_size,
                     "inputs": inputs,
-                    "outputs": {
-                        "logits": "logits",
-                        "present_key_names": "present.%d.key",
-                        "present_value_names": "present.%d.value",
-                    },
-                    "num_attention_heads": self.num_attn_heads,
+                    "outputs": outputs,
+                    "num_attention_heads": self.num_attn_heads * self.world_size,
                     "num_hidden_layers": self.num_layers,
-                    "num_key_value_heads": self.num_kv_heads,
+                    "num_key_value_heads": self.num_kv_heads * self.world_size,
                 },
                 "eos_token_id": config.eos_token_id,
                 "pad_token_id": config.pad_token_id if hasattr(config, "pad_token_id") and config.pad_token_id is not None else config.eos_token_id[0] if isinstance(config.eos_token_id, list) else config.eos_token_id,
@@ -307,6 +421,39 @@ class Model:
         if self.ep != "cpu":
             ep_options = { self.ep : self.ep_attrs[self.ep] }
             genai_config["model"]["decoder"]["session_options"]["provider_options"].append(ep_options)
+        if self.world_size > 1:
+            genai_config["model"]["decoder"]["world_size"] = self.world_size
+        if self.gguf_filename is not None:
+            genai_config["model"]["decoder"]["gguf_filename"] = self.gguf_filename
+        if self.ep == "cpu" and not self.past_present_share_buffer:
+            # Without a shared past/present buffer, keep the decode steps from allocating a new kv cache every token
+            genai_config["model"]["decoder"]["kv_cache"] = { "preallocate": True }
+        if self.rotemb_attrs.get("runtime_caches", False):
+            multi_cache = self.rotemb_attrs["multi_cache"]
+            genai_config["model"]["decoder"]["rotary_embedding"] = {
+                "dim": int(self.rotemb_attrs["partial_rotary_factor"] * self.head_size),
+                "theta": self.rotemb_attrs["theta"],
+                "original_context_length": self.original_context_length,
+                "short_factor": multi_cache["short_factor"].tolist(),
+                "long_factor": multi_cache["long_factor"].tolist(),
+                "short_mscale": float(multi_cache["short_mscale"]),
+                "long_mscale": float(multi_cache["long_mscale"]),
+            }
+        if self.attention_attrs["block_sparse"]["sparse_block_size"] != 0:
+            block_sparse = self.attention_attrs["block_sparse"]
+            genai_config["model"]["decoder"]["sparse_attention"] = {
+                "block_size": block_sparse["sparse_block_size"],
+                "local_blocks": block_sparse["local_blocks"],
+                "vert_stride": block_sparse["vert_stride"],
+                "homo_head": block_sparse["homo_head"],
+            }
+        if self.layers_range[1] < self.num_layers:
+            # The model with the other layers and the LM head runs on the CPU, with its own kv cache
+            genai_config["model"]["decoder"]["offload"] = {
+                "filename": self.offload_filename,
+                "first_layer": self.layers_range[1],
+                "session_options": { "log_id": "onnxruntime-genai", "provider_options": [] },
+            }
 
         print(f"Saving GenAI config in {out_dir}")
         with open(os.path.join(out_dir,"genai_config.json"), "w") as f:
@@ -354,8 +501,13 @@ class Model:
         if self.onnx_dtype == "int4":
             model = self.to_int4(model)
 
+        # Add the initializers that point into the GGUF file, save_model leaves them as they are since they have no raw data
+        model.graph.initializer.extend(self.gguf_initializers)
+        if self.gguf_filename is not None:
+            self.link_gguf_file(out_dir)
+
         # Save ONNX model with only one external data file and delete any existing duplicate copies
-        out_path = os.path.join(out_dir, self.filename)
+        out_path = os.path.join(out_dir, self.filename.replace("%d", str(self.rank)))
         data_path = os.path.join(out_dir, os.path.basename(out_path) + ".data")
         if os.path.exists(out_path):
             print(f"Overwriting {out_path}")
@@ -374,6 +526,18 @@ class Model:
             convert_attribute=False,
         )
 
+    def link_gguf_file(self, out_dir):
+        # The initializers refer to the GGUF file by its name, relative to the ONNX model like any external data
+        out_path = os.path.join(out_dir, self.gguf_filename)
+        if os.path.exists(out_path):
+            if not os.path.samefile(out_path, self.gguf_path):
+                raise FileExistsError(f"{out_path} is not the GGUF file {self.gguf_path}")
+            return
+        try:
+            os.symlink(os.path.abspath(self.gguf_path), out_path)
+        except OSError:
+            print(f"Couldn't link {self.gguf_path} into {out_dir}, move or copy it there before loading the model")
+
     def to_int4(self, model):
         quant = MatMul4BitsQuantizer(
             model=model,
@@ -394,6 +558,8 @@ class Model:
         repeated_proto.sort(key=lambda x: order.index(getattr(x, key_name)))
 
     def make_external_tensor(self, np_data, name, **kwargs):
+        if self.make_gguf_tensor(np_data, name):
+            return
         tensor = numpy_helper.from_array(np_data)
         tensor.name = name
 
@@ -406,6 +572,21 @@ class Model:
 
         self.initializers.append(tensor)
 
+    def make_gguf_tensor(self, np_data, name):
+        # Only the data that is a contiguous view of the GGUF file is used in place
+        if not self.gguf_skeleton or self.gguf_filename is None or not np_data.flags.c_contiguous:
+            return False
+        begin = self.gguf_data.__array_interface__["data"][0]
+        address = np_data.__array_interface__["data"][0]
+        if not (begin <= address and address + np_data.nbytes <= begin + self.gguf_data.nbytes):
+            return False
+
+        initializer = TensorProto(name=name, data_type=helper.np_dtype_to_tensor_dtype(np_data.dtype), dims=np_data.shape)
+        external_data_helper.set_external_data(initializer, location=self.gguf_filename, offset=address - begin, length=np_data.nbytes)
+        initializer.data_location = TensorProto.EXTERNAL
+        self.gguf_initializers.append(initializer)
+        return True
+
     def make_node(self, op_type, inputs, outputs, name=None, doc_string=None, domain=None, **kwargs):
         # Save any constants as nodes
         for input_name in inputs:
@@ -457,7 +638,7 @@ class Model:
             outputs.append(helper.make_tensor_value_info(name, dtype, shape=shape))
 
         # Add KV cache to inputs and outputs
-        for i in range(self.num_layers):
+        for i in range(self.layers_range[1] - self.layers_range[0]):
             # Add KV cache to inputs
             key_name = f"past_key_values.{i}.key"
             inputs.append(helper.make_tensor_value_info(key_name, self.input_types["past_key_values.key"], shape=self.input_shapes["past_key_values.key"]))
@@ -470,6 +651,12 @@ class Model:
             value_name = f"present.{i}.value"
             outputs.append(helper.make_tensor_value_info(value_name, self.output_types["present.value"], shape=self.output_shapes["present.value"]))
 
+            if self.kv_quant:
+                # Add KV cache scales to inputs and outputs
+                for kv in ["key", "value"]:
+                    inputs.append(helper.make_tensor_value_info(f"past_key_values.{i}.{kv}_scale", self.io_dtype, shape=self.input_shapes[f"past_key_values.{kv}"][:-1] + [1]))
+                    outputs.append(helper.make_tensor_value_info(f"present.{i}.{kv}_scale", self.io_dtype, shape=self.output_shapes[f"present.{kv}"][:-1] + [1]))
+
         self.inputs = inputs
         self.outputs = outputs
 
@@ -602,26 +789,153 @@ class Model:
         self.make_value_info(output, dtype, shape=shape)
 
     def make_matmul(self, matmul, name, root_input, **kwargs):
+        if self.enable_lora and name.startswith("/model/layers."):
+            self.make_lora(matmul, name, root_input, **kwargs)
+            return
+        if self.onnx_dtype == "int8":
+            self.make_matmul_int8(matmul, name, root_input, **kwargs)
+            return
         self.make_matmul_fp16_or_fp32(matmul, name, root_input, **kwargs)
 
-        # TODO: add other dtypes
-        # if self.onnx_dtype in {"fp16", "fp32"}:
-        #     self.make_matmul_fp16_or_fp32(matmul, name, root_input, **kwargs)
-        # elif self.onnx_dtype == "int8":
-        #     pass
-        # elif self.onnx_dtype == "int4":
+        # TODO: quantize int4 as the MatMuls are created instead of in to_int4
+        # if self.onnx_dtype == "int4":
         #     int4_name = f"{name}NBits"
         #     self.make_matmul_int4(matmul, int4_name, root_input, **kwargs)
 
     def make_matmul_fp16_or_fp32(self, matmul, name, root_input, **kwargs):
         weight = name[1:].replace("/", ".") + ".weight"
-        self.make_external_tensor(matmul.transpose().astype(self.to_numpy_dtype[self.io_dtype]), weight)
+        last_dim = matmul.shape[0]
+        output = "logits" if kwargs.get("logits", False) else kwargs.get("output", f"{name}/output_0")
+
+        if self.gguf_skeleton and self.make_gguf_tensor(matmul.astype(self.to_numpy_dtype[self.io_dtype], copy=False), weight):
+            # The GGUF file stores the weight as [out_features, in_features], which FusedMatMul reads transposed in place.
+            # A Transpose in front of a MatMul would be folded into a transposed copy of the weight at session creation.
+            self.make_node("FusedMatMul", inputs=[root_input, weight], outputs=[output], name=name, domain="com.microsoft", transB=1)
+        else:
+            self.make_external_tensor(matmul.transpose().astype(self.to_numpy_dtype[self.io_dtype]), weight)
+            self.make_node("MatMul", inputs=[root_input, weight], outputs=[output], name=name)
+        self.make_value_info(output, self.io_dtype, shape=['batch_size', 'sequence_length', last_dim])
+
+    def make_matmul_int8(self, matmul, name, root_input, **kwargs):
+        # Weight only int8 with a symmetric scale per output channel. DynamicQuantizeMatMul quantizes the activations to
+        # uint8 on the fly and runs the MLAS int8 GEMM on CPU.
+        weight = name[1:].replace("/", ".") + ".weight"
+        transposed = matmul.transpose().astype(np.float32)
+        scales = np.abs(transposed).max(axis=0) / 127
+        scales[scales == 0] = 1
+        self.make_external_tensor(np.clip(np.round(transposed / scales), -127, 127).astype(np.int8), weight)
+        self.make_external_tensor(scales.astype(np.float32), f"{weight}_scale")
+        self.make_external_tensor(np.zeros(scales.shape, dtype=np.int8), f"{weight}_zero_point")
 
         last_dim = matmul.shape[0]
-        output = "logits" if kwargs.get("logits", False) else f"{name}/output_0"
-        self.make_node("MatMul", inputs=[root_input, weight], outputs=[output], name=name)
+        output = "logits" if kwargs.get("logits", False) else kwargs.get("output", f"{name}/output_0")
+        inputs = [root_input, weight, f"{weight}_scale", f"{weight}_zero_point"]
+        self.make_node("DynamicQuantizeMatMul", inputs=inputs, outputs=[output], name=name, domain="com.microsoft")
         self.make_value_info(output, self.io_dtype, shape=['batch_size', 'sequence_length', last_dim])
 
+    def make_lora(self, matmul, name, root_input, **kwargs):
+        # MatMul with a LoRA adapter picked per batch row:
+        #
+        #     root_input   lora_A  adapter_ids  lora_B
+        #      /     \         \     /    \      /
+        #  MatMul     \        Gather     Gather
+        #     |        \        /           |
+        #     |         MatMul             |
+        #     |              \             |
+        #     |               +-- MatMul --+
+        #      \                 /
+        #           Add
+        #
+        # lora_A {num_adapters, in, rank} and lora_B {num_adapters, rank, out} stack the weights of every adapter, adapter 0
+        # is all zeros for the base model. The runtime pads adapters of a lower rank with zeros.
+        basename = name[1:].replace("/", ".")
+        out_features, in_features = matmul.shape
+        base_output = f"{name}/base/output_0"
+        self.make_matmul_fp16_or_fp32(matmul, name, root_input, output=base_output)
+
+        lora_a, lora_b, rank = f"{basename}.lora_A", f"{basename}.lora_B", f"{basename}.rank"
+        self.inputs.append(helper.make_tensor_value_info(lora_a, self.io_dtype, shape=["num_adapters", in_features, rank]))
+        self.inputs.append(helper.make_tensor_value_info(lora_b, self.io_dtype, shape=["num_adapters", rank, out_features]))
+        self.lora_targets[basename] = (in_features, out_features)
+
+        gather_a_name = f"{name}/lora_A/Gather"
+        self.make_node("Gather", inputs=[lora_a, "adapter_ids"], outputs=[f"{gather_a_name}/output_0"], name=gather_a_name, axis=0)
+        self.make_value_info(f"{gather_a_name}/output_0", self.io_dtype, shape=["batch_size", in_features, rank])
+        matmul_a_name = f"{name}/lora_A/MatMul"
+        self.make_node("MatMul", inputs=[root_input, f"{gather_a_name}/output_0"], outputs=[f"{matmul_a_name}/output_0"], name=matmul_a_name)
+        self.make_value_info(f"{matmul_a_name}/output_0", self.io_dtype, shape=["batch_size", "sequence_length", rank])
+
+        gather_b_name = f"{name}/lora_B/Gather"
+        self.make_node("Gather", inputs=[lora_b, "adapter_ids"], outputs=[f"{gather_b_name}/output_0"], name=gather_b_name, axis=0)
+        self.make_value_info(f"{gather_b_name}/output_0", self.io_dtype, shape=["batch_size", rank, out_features])
+        matmul_b_name = f"{name}/lora_B/MatMul"
+        self.make_node("MatMul", inputs=[f"{matmul_a_name}/output_0", f"{gather_b_name}/output_0"], outputs=[f"{matmul_b_name}/output_0"], name=matmul_b_name)
+        self.make_value_info(f"{matmul_b_name}/output_0", self.io_dtype, shape=["batch_size", "sequence_length", out_features])
+
+        add_name = f"{name}/lora/Add"
+        self.make_node("Add", inputs=[base_output, f"{matmul_b_name}/output_0"], outputs=[f"{name}/output_0"], name=add_name)
+        self.make_value_info(f"{name}/output_0", self.io_dtype, shape=["batch_size", "sequence_length", out_features])
+
+    def save_adapter(self, adapter_path, out_dir):
+        # Export a PEFT LoRA adapter for the LoRA inputs of this model, as a graph without inputs whose outputs are the
+        # lora_A {in, rank} and lora_B {rank, out} of every MatMul the adapter changes. lora_alpha / r is folded into lora_B.
+        with open(os.path.join(adapter_path, "adapter_config.json"), "r") as f:
+            adapter_config = json.load(f)
+        scale = adapter_config["lora_alpha"] / adapter_config["r"]
+        weights_path = os.path.join(adapter_path, "adapter_model.safetensors")
+        if os.path.exists(weights_path):
+            from safetensors.torch import load_file
+            state_dict = load_file(weights_path)
+        else:
+            state_dict = torch.load(os.path.join(adapter_path, "adapter_model.bin"), map_location="cpu")
+
+        # Map the Hugging Face modules to the MatMuls of make_attention and make_mlp, q, k and v may be packed
+        qkv_offsets = {"q_proj": 0, "k_proj": self.num_attn_heads * self.head_size, "v_proj": (self.num_attn_heads + self.num_kv_heads) * self.head_size}
+        targets = {}  # MatMul weight name: [(out features offset, lora_A {r, in}, lora_B {out, r})]
+        for key, lora_a in state_dict.items():
+            if ".lora_A." not in key:
+                continue
+            lora_b = state_dict[key.replace(".lora_A.", ".lora_B.")]
+            module = key[key.index("model.layers."):key.index(".lora_A.")].replace(".self_attn.", ".attn.").replace(".attn.dense", ".attn.o_proj")
+            basename, offset = f"{module}.MatMul", 0
+            if basename not in self.lora_targets:
+                layer, proj = module.rsplit(".", 1)
+                basename = f"{layer}.qkv_proj.MatMul"
+                if proj not in qkv_offsets or basename not in self.lora_targets:
+                    raise NotImplementedError(f"The adapter changes {module}, which isn't a MatMul with LoRA inputs in the ONNX model")
+                offset = qkv_offsets[proj]
+            targets.setdefault(basename, []).append((offset, lora_a.float().numpy(), lora_b.float().numpy() * scale))
+
+        nodes, initializers, outputs = [], [], []
+        for basename, parts in targets.items():
+            # Parts packed into one MatMul stack their ranks, each lora_B only writes its own out features
+            in_features, out_features = self.lora_targets[basename]
+            rank = sum(a.shape[0] for _, a, _ in parts)
+            packed_a = np.zeros((in_features, rank), dtype=np.float32)
+            packed_b = np.zeros((rank, out_features), dtype=np.float32)
+            start = 0
+            for offset, a, b in parts:
+                packed_a[:, start : start + a.shape[0]] = a.T
+                packed_b[start : start + a.shape[0], offset : offset + b.shape[0]] = b.T
+                start += a.shape[0]
+
+            for name, value in [(f"{basename}.lora_A", packed_a), (f"{basename}.lora_B", packed_b)]:
+                initializers.append(numpy_helper.from_array(value.astype(self.to_numpy_dtype[self.io_dtype]), f"{name}.weight"))
+                nodes.append(helper.make_node("Identity", inputs=[f"{name}.weight"], outputs=[name], name=f"/{name}/Identity"))
+                outputs.append(helper.make_tensor_value_info(name, self.io_dtype, shape=list(value.shape)))
+
+        model = helper.make_model(
+            opset_imports=[self.clear_field(helper.make_operatorsetid('', 14), 'domain')],
+            ir_version=7,
+            producer_name="onnxruntime-genai",
+            producer_version="0.0.0",
+            graph=self.make_graph(name="adapter", inputs=[], outputs=outputs, initializer=initializers, nodes=nodes),
+        )
+        out_path = os.path.join(out_dir, "adapters", os.path.basename(os.path.normpath(adapter_path)) + ".onnx")
+        print(f"Saving adapter in {out_path}")
+        os.makedirs(os.path.dirname(out_path), exist_ok=True)
+        save_model(model, out_path)
+
     # TODO: quantize weights, then save new MatMul numpy weights for onnx model
     # def make_matmul_int4(self, matmul, name, root_input, **kwargs):
     #     weight = name[1:].replace("/", ".") + ".weight"
@@ -660,15 +974,32 @@ class Model:
         add = np.concatenate([q_add, k_add, v_add], axis=0).flatten()
         self.make_add_bias(add, name, root_input, **kwargs)
 
+    def make_shard(self, linear, dim):
+        # Keep this rank's slice of a Linear layer for tensor parallelism. dim = 0 splits the output features (and the bias),
+        # dim = 1 splits the input features, whose bias is added once after the AllReduce.
+        size = linear.weight.shape[dim] // self.world_size
+        linear.weight = torch.nn.Parameter(linear.weight.narrow(dim, self.rank * size, size))
+        if dim == 0 and linear.bias is not None:
+            linear.bias = torch.nn.Parameter(linear.bias.narrow(0, self.rank * size, size))
+
+    def make_all_reduce(self, name, root_input):
+        # Sum the partial outputs of every tensor parallel rank (NCCL inside onnxruntime, the ranks are MPI processes)
+        output = f"{name}/output_0"
+        self.make_node("AllReduce", inputs=[root_input], outputs=[output], name=name, domain="com.microsoft")
+        self.make_value_info(output, self.io_dtype, shape=['batch_size', 'sequence_length', self.hidden_size])
+        return output
+
     def make_embedding(self, embedding):
         weight = "model.embed_tokens.weight"
-        self.make_external_tensor(embedding.astype(self.to_numpy_dtype[self.io_dtype]), weight)
-
         basename = "/model/embed_tokens"
         gather_name = f"{basename}/Gather"
         gather_output = f"{gather_name}/output_0"
-        self.make_node('Gather', inputs=[weight, 'input_ids'], outputs=[gather_output], name=gather_name)
-        self.make_value_info(gather_output, self.io_dtype, shape=['batch_size', 'sequence_length', self.hidden_size])
+        if self.quant_attrs["embedding"]:
+            self.make_embedding_int8(embedding, weight, basename, gather_output)
+        else:
+            self.make_external_tensor(embedding.astype(self.to_numpy_dtype[self.io_dtype], copy=False), weight)
+            self.make_node('Gather', inputs=[weight, 'input_ids'], outputs=[gather_output], name=gather_name)
+            self.make_value_info(gather_output, self.io_dtype, shape=['batch_size', 'sequence_length', self.hidden_size])
 
         if self.embed_attrs["scale"] != 1:
             # Scale the embeddings
@@ -685,6 +1016,35 @@ class Model:
         self.layernorm_attrs["root_input"] = layernorm_attrs_value
         self.layernorm_attrs["skip_input"] = layernorm_attrs_value
 
+    def make_embedding_int8(self, embedding, weight, basename, output):
+        # int8 rows with a scale per token, only the looked up rows are dequantized:
+        #
+        #   weight  input_ids  weight_scale
+        #       \    /     \    /
+        #       Gather     Gather
+        #         |          |
+        #        Cast        |
+        #           \       /
+        #              Mul
+        embedding = embedding.astype(np.float32)
+        scales = np.abs(embedding).max(axis=1, keepdims=True) / 127
+        scales[scales == 0] = 1
+        self.make_external_tensor(np.clip(np.round(embedding / scales), -127, 127).astype(np.int8), weight)
+        self.make_external_tensor(scales.astype(self.to_numpy_dtype[self.io_dtype]), f"{weight}_scale")
+
+        gather_name = f"{basename}/Gather"
+        self.make_node('Gather', inputs=[weight, 'input_ids'], outputs=[f"{gather_name}/quantized"], name=gather_name)
+        self.make_value_info(f"{gather_name}/quantized", TensorProto.INT8, shape=['batch_size', 'sequence_length', self.hidden_size])
+        cast_name = f"{basename}/Cast"
+        self.make_cast(cast_name, f"{gather_name}/quantized", self.io_dtype, shape=['batch_size', 'sequence_length', self.hidden_size])
+        scale_gather_name = f"{basename}/scale/Gather"
+        scale_gather_output = f"{scale_gather_name}/output_0"
+        self.make_node('Gather', inputs=[f"{weight}_scale", 'input_ids'], outputs=[scale_gather_output], name=scale_gather_name)
+        self.make_value_info(scale_gather_output, self.io_dtype, shape=['batch_size', 'sequence_length', 1])
+        mul_name = f"{basename}/DequantizeMul"
+        self.make_node('Mul', inputs=[f"{cast_name}/output_0", scale_gather_output], outputs=[output], name=mul_name)
+        self.make_value_info(output, self.io_dtype, shape=['batch_size', 'sequence_length', self.hidden_size])
+
     def make_layernorm(self, layer_id, layernorm, skip, simple, location):
         root_input = self.layernorm_attrs["root_input"]
         skip_input = self.layernorm_attrs["skip_input"]
@@ -707,7 +1067,7 @@ class Model:
 
         output_0 = f"/model/layers.{layer_id}/{location}_layernorm/output_0"
         output_3 = f"/model/layers.{layer_id}/{location}_layernorm/output_3"
-        if self.layernorm_attrs["last_layernorm"] and self.exclude_lm_head:
+        if self.layernorm_attrs["last_layernorm"] and (self.exclude_lm_head or self.include_hidden_states):
             output_0 = "hidden_states"
         outputs = [output_0, "", "", output_3] if skip and not self.layernorm_attrs["last_layernorm"] else [output_0]
 
@@ -795,76 +1155,15 @@ class Model:
         self.make_value_info(output, self.io_dtype, shape=['batch_size', 'sequence_length', self.head_size * (self.num_kv_heads if "k_rotary" in name else self.num_attn_heads)])
 
     def make_rotary_embedding_multi_cache(self):
-        # Create dummy rotary embedding class
-        rotemb = type("RotaryEmbedding", (object,), {'content':{}})()
-
-        # Create caches for when sequence_length > self.original_context_length
-        self.rotemb_attrs["rescale_factors"] = self.rotemb_attrs["multi_cache"]["long_factor"]
-        self.rotemb_attrs["cache_length"] = self.context_length
-        self.rotemb_attrs["mscale"] = self.rotemb_attrs["multi_cache"]["long_mscale"]
-        cos_cache_large_name, sin_cache_large_name = "cos_cache_large", "sin_cache_large"
-        cos_cache_large, sin_cache_large = self.make_rotary_embedding_caches(rotemb, cos_cache_name=cos_cache_large_name, sin_cache_name=sin_cache_large_name)
-
-        # Create caches for when sequence_length <= self.original_context_length
-        self.rotemb_attrs["rescale_factors"] = self.rotemb_attrs["multi_cache"]["short_factor"]
-        self.rotemb_attrs["cache_length"] = self.original_context_length
-        self.rotemb_attrs["mscale"] = self.rotemb_attrs["multi_cache"]["short_mscale"]
-        cos_cache_small_name, sin_cache_small_name = "cos_cache_small", "sin_cache_small"
-        cos_cache_small, sin_cache_small = self.make_rotary_embedding_caches(rotemb, cos_cache_name=cos_cache_small_name, sin_cache_name=sin_cache_small_name)
-
+        # The runtime makes the cos/sin caches from the short and long factors in the GenAI config (see `rotary_embedding`),
+        # switching to the long ones once the sequence goes past the original context length, so they're inputs of the model
         self.rotemb_attrs["create_rotary_embedding_caches"] = False
-
-        # Make the following subgraph to decide which cos/sin caches to use in the rotary embeddings
-        #
-        # attention_mask --> Shape --> Gather --> Greater --> If --> (cos_cache, sin_cache)
-        #                             (idx=1)
-        #
-
-        basename = "/model/rotemb_caches_subgraph"
-        gather_name = ""
-        if self.attention_attrs["op_type"] == "GroupQueryAttention":
-            gather_name = "/model/attn_mask_reformat/attn_mask_subgraph/Gather"
-        else:
-            gather_name = "/model/attn_mask_reformat/attn_mask_subgraph/Gather_2"
-
-        greater_name = f"{basename}/Greater"
-        greater_inputs = [f"{gather_name}/output_0", f"/model/constants/TensorProto.INT64/0D/{self.original_context_length}"]
-        self.make_greater(greater_name, greater_inputs, shape=[])
-        if_name = f"{basename}/If"
-        if_cos_cache_output, if_sin_cache_output = "cos_cache", "sin_cache"
-        self.make_node(
-            "If", inputs=[f"{greater_name}/output_0"], outputs=[if_cos_cache_output, if_sin_cache_output], name=if_name,
-            then_branch=self.make_graph(
-                name="large_rotemb_caches_graph",
-                inputs=[],
-                outputs=[
-                    helper.make_tensor_value_info(cos_cache_large_name, self.io_dtype, shape=cos_cache_large.shape),
-                    helper.make_tensor_value_info(sin_cache_large_name, self.io_dtype, shape=sin_cache_large.shape),
-                ],
-                initializer=[],
-                value_info=[],
-                nodes=[
-                    helper.make_node("Constant", inputs=[], outputs=[cos_cache_large_name], name="/large/cos_cache/Constant", value=numpy_helper.from_array(cos_cache_large)),
-                    helper.make_node("Constant", inputs=[], outputs=[sin_cache_large_name], name="/large/sin_cache/Constant", value=numpy_helper.from_array(sin_cache_large)),
-                ],
-            ),
-            else_branch=self.make_graph(
-                name="small_rotemb_caches_graph",
-                inputs=[],
-                outputs=[
-                    helper.make_tensor_value_info(cos_cache_small_name, self.io_dtype, shape=cos_cache_small.shape),
-                    helper.make_tensor_value_info(sin_cache_small_name, self.io_dtype, shape=sin_cache_small.shape),
-                ],
-                initializer=[],
-                value_info=[],
-                nodes=[
-                    helper.make_node("Constant", inputs=[], outputs=[cos_cache_small_name], name="/small/cos_cache/Constant", value=numpy_helper.from_array(cos_cache_small)),
-                    helper.make_node("Constant", inputs=[], outputs=[sin_cache_small_name], name="/small/sin_cache/Constant", value=numpy_helper.from_array(sin_cache_small)),
-                ],
-            ),
-        )
-        self.make_value_info(if_cos_cache_output, self.io_dtype, shape=["max_sequence_length", "head_dim / 2"])
-        self.make_value_info(if_sin_cache_output, self.io_dtype, shape=["max_sequence_length", "head_dim / 2"])
+        self.rotemb_attrs["runtime_caches"] = True
+        dim = int(self.rotemb_attrs["partial_rotary_factor"] * self.head_size)
+        for name in ["cos_cache", "sin_cache"]:
+            self.input_names.append(name)
+            self.input_types[name] = self.io_dtype
+            self.input_shapes[name] = ["max_sequence_length", dim // 2]
 
     def make_repeat_kv(self, layer_id, root_input, past_kv, present_kv, **kwargs):
         # Make subgraph that repeats tensor of shape (batch_size, sequence_length, num_kv_heads, head_size)
@@ -1044,13 +1343,99 @@ class Model:
         input_to_attention = f"{reshape_4_name}/output_0"
         return input_to_attention
 
+    def make_kv_dequantize(self, name, root_input, scale):
+        # Make subgraph that dequantizes an INT8 KV cache input of shape (batch_size, num_kv_heads, past_sequence_length, head_size)
+        #
+        #    root_input   scale
+        #        |          |
+        #      Cast         |
+        #         \        /
+        #            Mul
+        shape = self.input_shapes["past_key_values.key"]
+        cast_name = f"{name}/Cast"
+        self.make_cast(cast_name, root_input, dtype=self.io_dtype, shape=shape)
+        mul_name = f"{name}/Mul"
+        self.make_mul(mul_name, [f"{cast_name}/output_0", scale], dtype=self.io_dtype, shape=shape)
+        return f"{mul_name}/output_0"
+
+    def make_kv_quantize(self, name, root_input, past, past_scale, output, scale_output):
+        # Make subgraph that quantizes the tokens a run appends to a KV cache output of shape (batch_size, num_kv_heads,
+        # total_sequence_length, head_size) to INT8 with one scale per token per head. The past tokens are already
+        # quantized, so they're concatenated as they are instead of being requantized on every run.
+        #
+        #     past      root_input
+        #      |            |
+        #    Shape          |
+        #      |            |
+        #    Slice -----> Slice (new tokens)
+        #                 /        \
+        #               Abs         |
+        #                |          |
+        #            ReduceMax      |
+        #                |          |
+        #            Div (127)      |
+        #                |          |
+        #            Max (eps) -----+     past_scale
+        #                     \     |          |
+        #                       Div   +---> Concat ---> scale_output
+        #                        |
+        #                      Round
+        #                        |
+        #        past          Cast
+        #          \            /
+        #             Concat ---> output
+        shape = ["batch_size", self.num_kv_heads, "sequence_length", self.head_size]
+        scale_shape = shape[:-1] + [1]
+        dtype_str = self.to_str_dtype[self.io_dtype]
+
+        shape_name = f"{name}/Shape"
+        self.make_shape(shape_name, past, shape=[4])
+        past_len_name = f"{name}/Slice_1"
+        past_len_inputs = [f"{shape_name}/output_0", "/model/constants/TensorProto.INT64/1D/2", "/model/constants/TensorProto.INT64/1D/3"]
+        self.make_slice(past_len_name, past_len_inputs, dtype=TensorProto.INT64, shape=[1])
+        new_name = f"{name}/Slice_2"
+        new_inputs = [root_input, f"{past_len_name}/output_0", f"/model/constants/TensorProto.INT64/1D/{np.iinfo(np.int64).max}", "/model/constants/TensorProto.INT64/1D/2"]
+        self.make_slice(new_name, new_inputs, dtype=self.io_dtype, shape=shape)
+        new_tokens = f"{new_name}/output_0"
+
+        abs_name = f"{name}/Abs"
+        self.make_node("Abs", inputs=[new_tokens], outputs=[f"{abs_name}/output_0"], name=abs_name)
+        self.make_value_info(f"{abs_name}/output_0", self.io_dtype, shape=shape)
+        reduce_max_name = f"{name}/ReduceMax"
+        self.make_node("ReduceMax", inputs=[f"{abs_name}/output_0"], outputs=[f"{reduce_max_name}/output_0"], name=reduce_max_name, axes=[-1], keepdims=1)
+        self.make_value_info(f"{reduce_max_name}/output_0", self.io_dtype, shape=scale_shape)
+        div_1_name = f"{name}/Div_1"
+        self.make_node("Div", inputs=[f"{reduce_max_name}/output_0", f"/model/constants/{dtype_str}/0D/127"], outputs=[f"{div_1_name}/output_0"], name=div_1_name)
+        self.make_value_info(f"{div_1_name}/output_0", self.io_dtype, shape=scale_shape)
+        max_name = f"{name}/Max"
+        self.make_node("Max", inputs=[f"{div_1_name}/output_0", f"/model/constants/{dtype_str}/0D/1e-06"], outputs=[f"{max_name}/output_0"], name=max_name)
+        self.make_value_info(f"{max_name}/output_0", self.io_dtype, shape=scale_shape)
+
+        div_2_name = f"{name}/Div_2"
+        self.make_node("Div", inputs=[new_tokens, f"{max_name}/output_0"], outputs=[f"{div_2_name}/output_0"], name=div_2_name)
+        self.make_value_info(f"{div_2_name}/output_0", self.io_dtype, shape=shape)
+        round_name = f"{name}/Round"
+        self.make_node("Round", inputs=[f"{div_2_name}/output_0"], outputs=[f"{round_name}/output_0"], name=round_name)
+        self.make_value_info(f"{round_name}/output_0", self.io_dtype, shape=shape)
+        cast_name = f"{name}/Cast"
+        self.make_cast(cast_name, f"{round_name}/output_0", dtype=TensorProto.INT8, shape=shape)
+
+        concat_1_name = f"{name}/Concat_1"
+        self.make_node("Concat", inputs=[past, f"{cast_name}/output_0"], outputs=[output], name=concat_1_name, axis=2)
+        concat_2_name = f"{name}/Concat_2"
+        self.make_node("Concat", inputs=[past_scale, f"{max_name}/output_0"], outputs=[scale_output], name=concat_2_name, axis=2)
+
     def make_attention_op(self, name, **kwargs):
         op_type = self.attention_attrs["op_type"]
 
         if op_type == "MultiHeadAttention":
             self.make_multi_head_attention(name, add_qk=f"{self.mask_attrs['mask_name']}/output_0", **kwargs)
         elif op_type == "GroupQueryAttention":
-            self.make_group_query_attention(name, seqlens_k=f"{self.mask_attrs['seqlens_k']}/output_0", total_seq_len=f"{self.mask_attrs['total_seq_len']}/output_0", **kwargs)
+            if self.exclude_attention_mask:
+                seqlens_k, total_seq_len = "seqlens_k", "total_seq_len"
+            else:
+                seqlens_k, total_seq_len = f"{self.mask_attrs['seqlens_k']}/output_0", f"{self.mask_attrs['total_seq_len']}/output_0"
+            self.make_group_query_attention(name, seqlens_k=seqlens_k, total_seq_len=total_seq_len, **kwargs)
         elif op_type == "SparseAttention":
             self.make_sparse_attention(name, block_row_indices=self.mask_attrs['block_row_indices'], block_col_indices=self.mask_attrs['block_col_indices'], key_total_seq_lens=f"{self.mask_attrs['key_total_seq_lens']}/output_0", total_seq_len=f"{self.mask_attrs['total_seq_len']}/output_0", **kwargs)
         else:
@@ -1141,6 +1526,13 @@ class Model:
         k_input_to_attention = ""
         v_input_to_attention = ""
 
+        o_proj = 'o_proj' if hasattr(attention, 'o_proj') else 'dense'
+        if self.world_size > 1:
+            # Each rank gets its own heads
+            for proj in [attention.q_proj, attention.k_proj, attention.v_proj]:
+                self.make_shard(proj, 0)
+            self.make_shard(eval(f"attention.{o_proj}"), 1)
+
         # Make MatMul nodes
         if self.attention_attrs["use_packed_matmul"]:
             # Combine 3 MatMuls into 1 packed MatMul
@@ -1196,10 +1588,24 @@ class Model:
             k_input_to_attention = f"{k_rotary_name}/output_0"
 
         # Make repeat KV nodes (Note: `repeat_kv` needs to be kept since GroupQueryAttention isn't supported for FP32 CUDA)
-        past_k = f"past_key_values.{layer_id}.key"
-        past_v = f"past_key_values.{layer_id}.value"
-        present_k = f"present.{layer_id}.key"
-        present_v = f"present.{layer_id}.value"
+        kv_id = layer_id - self.layers_range[0]
+        past_k = f"past_key_values.{kv_id}.key"
+        past_v = f"past_key_values.{kv_id}.value"
+        present_k = f"present.{kv_id}.key"
+        present_v = f"present.{kv_id}.value"
+        if self.kv_quant:
+            # Attention works on the dequantized past and produces an unquantized present, of which only the new tokens
+            # are quantized and appended to the quantized past
+            past_k = self.make_kv_dequantize(f"/model/layers.{layer_id}/attn/k_dequant", past_k, f"past_key_values.{kv_id}.key_scale")
+            past_v = self.make_kv_dequantize(f"/model/layers.{layer_id}/attn/v_dequant", past_v, f"past_key_values.{kv_id}.value_scale")
+            present_k = f"/model/layers.{layer_id}/attn/present_k"
+            present_v = f"/model/layers.{layer_id}/attn/present_v"
+            self.make_value_info(present_k, self.io_dtype, shape=self.output_shapes["present.key"])
+            self.make_value_info(present_v, self.io_dtype, shape=self.output_shapes["present.value"])
+            self.make_kv_quantize(f"/model/layers.{layer_id}/attn/k_quant", present_k, f"past_key_values.{kv_id}.key", f"past_key_values.{kv_id}.key_scale",
+                                  f"present.{kv_id}.key", f"present.{kv_id}.key_scale")
+            self.make_kv_quantize(f"/model/layers.{layer_id}/attn/v_quant", present_v, f"past_key_values.{kv_id}.value", f"past_key_values.{kv_id}.value_scale",
+                                  f"present.{kv_id}.value", f"present.{kv_id}.value_scale")
         if self.num_attn_heads != self.num_kv_heads and self.attention_attrs["op_type"] == "MultiHeadAttention":
             k_input_to_attention = self.make_repeat_kv(layer_id, root_input=k_input_to_attention, past_kv=past_k, present_kv=present_k)
             v_input_to_attention = self.make_repeat_kv(layer_id, root_input=v_input_to_attention, past_kv=past_v, present_kv=present_v)
@@ -1214,20 +1620,23 @@ class Model:
         )
 
         # Make MatMul node (output projection weight node)
-        o_proj = 'o_proj' if hasattr(attention, 'o_proj') else 'dense'
         o_matmul_name = f"/model/layers.{layer_id}/attn/o_proj/MatMul"
         o_weight = eval(f"attention.{o_proj}.weight.detach().numpy()")
         self.make_matmul(o_weight, o_matmul_name, f"{attn_name}/output_0")
+        o_output = f"{o_matmul_name}/output_0"
+        if self.world_size > 1:
+            o_output = self.make_all_reduce(f"/model/layers.{layer_id}/attn/o_proj/AllReduce", o_output)
 
         # Make Add node (output projection bias node if bias exists)
         o_bias_exists = eval(f"attention.{o_proj}.bias") is not None
         if o_bias_exists:
             o_add_name = f"/model/layers.{layer_id}/attn/o_proj/Add"
             o_bias = eval(f"attention.{o_proj}.bias.detach().numpy()")
-            self.make_add_bias(o_bias, o_add_name, root_input=f"{o_matmul_name}/output_0")
+            self.make_add_bias(o_bias, o_add_name, root_input=o_output)
+            o_output = f"{o_add_name}/output_0"
 
         # Assign output 0 of previous output node as skip input to next SkipLayerNorm
-        self.layernorm_attrs["skip_input"] = f"{o_matmul_name if not o_bias_exists else o_add_name}/output_0"
+        self.layernorm_attrs["skip_input"] = o_output
 
     def make_attention_unpacked(self, layer_id, attention, root_input, **kwargs):
         q_size = self.num_attn_heads * self.head_size
@@ -1276,6 +1685,12 @@ class Model:
         #              |
         #        DownProjMatMul
 
+        if self.world_size > 1:
+            # Each rank gets its own slice of the intermediate features
+            self.make_shard(mlp.gate_proj, 0)
+            self.make_shard(mlp.up_proj, 0)
+            self.make_shard(mlp.down_proj, 1)
+
         # Make MatMul nodes
         gate_name = f"/model/layers.{layer_id}/mlp/gate_proj/MatMul"
         self.make_matmul(mlp.gate_proj.weight.detach().numpy(), gate_name, root_input)
@@ -1293,9 +1708,12 @@ class Model:
         # Make output MatMul node
         down_name = f"/model/layers.{layer_id}/mlp/down_proj/MatMul"
         self.make_matmul(mlp.down_proj.weight.detach().numpy(), down_name, f"{mul_name}/output_0")
+        down_output = f"{down_name}/output_0"
+        if self.world_size > 1:
+            down_output = self.make_all_reduce(f"/model/layers.{layer_id}/mlp/down_proj/AllReduce", down_output)
 
         # Assign output 0 of previous MatMul as skip input to next SkipLayerNorm
-        self.layernorm_attrs["skip_input"] = f"{down_name}/output_0"
+        self.layernorm_attrs["skip_input"] = down_output
 
     def make_mlp_fc(self, layer_id, mlp, root_input):
         # Make nodes for the MLP subgraph
@@ -1312,6 +1730,11 @@ class Model:
         #              |
         #           FC2_Add
 
+        if self.world_size > 1:
+            # Each rank gets its own slice of the intermediate features
+            self.make_shard(mlp.fc1, 0)
+            self.make_shard(mlp.fc2, 1)
+
         # Make first layer of fully connected nodes (FC1)
         fc1_matmul_name = f"/model/layers.{layer_id}/mlp/fc1/MatMul"
         self.make_matmul(mlp.fc1.weight.detach().numpy(), fc1_matmul_name, root_input)
@@ -1324,8 +1747,11 @@ class Model:
         # Make second layer of fully connected nodes (FC2)
         fc2_matmul_name = f"/model/layers.{layer_id}/mlp/fc2/MatMul"
         self.make_matmul(mlp.fc2.weight.detach().numpy(), fc2_matmul_name, root_input=f"{act_fn_name}/output_0")
+        fc2_output = f"{fc2_matmul_name}/output_0"
+        if self.world_size > 1:
+            fc2_output = self.make_all_reduce(f"/model/layers.{layer_id}/mlp/fc2/AllReduce", fc2_output)
         fc2_add_name = f"/model/layers.{layer_id}/mlp/fc2/Add"
-        self.make_add_bias(mlp.fc2.bias.detach().numpy(), fc2_add_name, root_input=f"{fc2_matmul_name}/output_0")
+        self.make_add_bias(mlp.fc2.bias.detach().numpy(), fc2_add_name, root_input=fc2_output)
 
         # Assign output 0 of MLP layer as output of last layer
         self.mlp_attrs["output_0"] = f"{fc2_add_name}/output_0"
@@ -1382,6 +1808,17 @@ class Model:
 
         matmul_name = "/lm_head/MatMul"
         root_input = self.layernorm_attrs["output_0"]
+
+        if self.last_token_logits:
+            # Only keep the hidden states of the last token: GatherND(hidden_states, last_token_indices[:, :, None], batch_dims=1)
+            unsqueeze_name = "/lm_head/last_token/Unsqueeze"
+            unsqueeze_inputs = ["last_token_indices", "/model/constants/TensorProto.INT64/1D/2"]
+            self.make_unsqueeze(unsqueeze_name, unsqueeze_inputs, dtype=TensorProto.INT64, shape=["batch_size", 1, 1])
+            gather_name = "/lm_head/last_token/GatherND"
+            gather_output = f"{gather_name}/output_0"
+            self.make_node("GatherND", inputs=[root_input, f"{unsqueeze_name}/output_0"], outputs=[gather_output], name=gather_name, batch_dims=1)
+            self.make_value_info(gather_output, self.io_dtype, shape=["batch_size", 1, self.hidden_size])
+            root_input = gather_output
         self.make_matmul(lm_head.weight.detach().numpy(), matmul_name, root_input, logits=not bias_exists and not scale_exists)
 
         if bias_exists:
@@ -1406,6 +1843,46 @@ class Model:
             self.make_node('Where', inputs=where_inputs, outputs=[where_output], name=where_name)
             self.make_value_info(where_output, self.io_dtype, shape=['batch_size', 'sequence_length', self.vocab_size])
 
+        if self.next_tokens_head:
+            self.make_next_tokens_head()
+        if self.top_k_head > 0:
+            self.make_top_k_head()
+
+    def make_next_tokens_head(self):
+        # Greedy head on the logits, so a step only has to read back a token per row:
+        #
+        #     logits
+        #       |
+        #     ArgMax
+        #       |
+        #      Cast
+        #       |
+        #   next_tokens
+        argmax_name = "/lm_head/ArgMax"
+        argmax_output = f"{argmax_name}/output_0"
+        self.make_node("ArgMax", inputs=["logits"], outputs=[argmax_output], name=argmax_name, axis=-1, keepdims=0)
+        self.make_value_info(argmax_output, TensorProto.INT64, shape=self.output_shapes["next_tokens"])
+        cast_name = "/lm_head/ArgMax/Cast"
+        self.make_node("Cast", inputs=[argmax_output], outputs=["next_tokens"], name=cast_name, to=TensorProto.INT32)
+
+    def make_top_k_head(self):
+        # Top-k head on the logits, the k largest logits of every position and their token ids:
+        #
+        #          logits
+        #            |
+        #          TopK
+        #          /   \
+        #         |    Cast
+        #         |      |
+        #   top_k_logits top_k_indices
+        topk_name = "/lm_head/TopK"
+        topk_indices = f"{topk_name}/output_1"
+        topk_inputs = ["logits", f"/model/constants/TensorProto.INT64/1D/{self.top_k_head}"]
+        self.make_node("TopK", inputs=topk_inputs, outputs=["top_k_logits", topk_indices], name=topk_name, axis=-1, largest=1, sorted=1)
+        self.make_value_info(topk_indices, TensorProto.INT64, shape=self.output_shapes["top_k_indices"])
+        cast_name = "/lm_head/TopK/Cast"
+        self.make_node("Cast", inputs=[topk_indices], outputs=["top_k_indices"], name=cast_name, to=TensorProto.INT32)
+
     def make_layer(self, layer_id, layer):
         # Each LLM decoder layer is typically defined as:
         # input_layernorm --> attention --> MLP --> output_layernorm
@@ -1432,6 +1909,12 @@ class Model:
             from gguf_model import GGUFModel
             model = GGUFModel.from_pretrained(self.model_type, input_path, self.head_size, self.hidden_size, self.intermediate_size, self.num_attn_heads, self.num_kv_heads, self.vocab_size)
             self.layernorm_attrs["add_offset"] = 0  # add offset already done for GGUF models
+            if self.gguf_skeleton:
+                # Separate Q/K/V MatMuls, so their weights can be used where they are in the GGUF file
+                self.attention_attrs["use_packed_matmul"] = False
+                self.gguf_data = model.data
+                self.gguf_path = input_path
+                self.gguf_filename = os.path.basename(input_path)
         else:
             # Load PyTorch model
             extra_kwargs = {} if os.path.exists(self.model_name_or_path) else {"num_hidden_layers": self.num_layers} if "num_hidden_layers" in self.extra_options else {"cache_dir": self.cache_dir}
@@ -1453,24 +1936,43 @@ class Model:
 
             elif module.__class__.__name__.endswith("DecoderLayer"):
                 # Each decoder layer of model
-                print(f"Reading decoder layer {self.layer_id}")
-                self.make_layer(self.layer_id, module)
+                if self.layers_range[0] <= self.layer_id < self.layers_range[1]:
+                    print(f"Reading decoder layer {self.layer_id}")
+                    self.make_layer(self.layer_id, module)
+                    if self.layer_id == self.layers_range[1] - 1 and self.layers_range[1] < self.num_layers:
+                        self.make_partition_output()
                 self.layer_id += 1
 
-            elif self.layer_id == self.num_layers and self.has_final_norm(module, model):
+            elif self.layer_id == self.num_layers and self.layers_range[1] == self.num_layers and self.has_final_norm(module, model):
                 # SkipLayerNorm after last decoder layer (MatMul --> SkipLayerNorm)
                 print("Reading final norm")
                 self.make_layernorm(self.layer_id, module, skip=True, simple=self.layernorm_attrs["simple"], location="final_norm")
 
             elif (isinstance(module, torch.nn.Linear) and module.out_features == self.vocab_size) or (hasattr(model, "lm_head") and module == model.lm_head):
                 # Checks (Hugging Face logic) or (GGUF logic)
-                if not self.exclude_lm_head:
+                if not self.exclude_lm_head and self.layers_range[1] == self.num_layers:
                     # Language modeling head (SkipLayerNorm --> logits)
                     print("Reading LM head")
                     self.make_lm_head(module)
 
         del model
 
+    def set_layers_range(self, first_layer, last_layer):
+        # CPU/GPU hybrid (see `gpu_layers`): only decoder layers [first_layer, last_layer) go in this model and their
+        # past/present names count from 0. A model without the last layer ends with a float32 `hidden_states` output
+        # instead of the final norm and LM head, the model with the next layers takes it as `inputs_embeds`.
+        self.layers_range = (first_layer, last_layer)
+        if last_layer < self.num_layers:
+            self.input_names = [name for name in self.input_names if name != "last_token_indices"]
+            self.output_names = ["hidden_states"]
+            self.output_types["hidden_states"] = TensorProto.FLOAT
+
+    def make_partition_output(self):
+        # The residual stream after the partition's last layer, which the next SkipLayerNorm would have added up
+        basename = f"/model/layers.{self.layer_id}/partition_output"
+        self.make_add(f"{basename}/Add", [self.layernorm_attrs["root_input"], self.layernorm_attrs["skip_input"]], dtype=self.io_dtype, shape=['batch_size', 'sequence_length', self.hidden_size])
+        self.make_node("Cast", inputs=[f"{basename}/Add/output_0"], outputs=["hidden_states"], name=f"{basename}/Cast", to=TensorProto.FLOAT)
+
     def has_final_norm(self, module, model):
         # Hugging Face names
         hf_norm = hasattr(model, "model") and hasattr(model.model, "norm") and module == model.model.norm
@@ -1506,6 +2008,8 @@ class Model:
             self.make_attention_mask_reformatting_for_mha()
 
         if self.attention_attrs["block_sparse"]["sparse_block_size"] != 0:
+            if self.exclude_attention_mask:
+                raise NotImplementedError("exclude_attention_mask is not supported with block sparse attention.")
             self.make_attention_mask_reformatting_for_sparse_attn()
 
     def make_attention_mask_reformatting_for_mha(self):
@@ -1822,6 +2326,10 @@ class Model:
         #              |                |
         #          seqlens_k      total_seq_len
         #            (1D)             (int)
+        if self.exclude_attention_mask:
+            # They're model inputs, there's no mask to reformat
+            return
+
         basename = "/model/attn_mask_reformat"
         attn_mask_basename = f"{basename}/attn_mask_subgraph"
 
@@ -1934,6 +2442,82 @@ class MistralModel(Model):
         super().make_attention(layer_id, attention, root_input, position_ids=self.position_ids_name, **kwargs)
 
 
+class MixtralModel(MistralModel):
+    def __init__(self, config, io_dtype, onnx_dtype, ep, cache_dir, extra_options):
+        super().__init__(config, io_dtype, onnx_dtype, ep, cache_dir, extra_options)
+        self.moe_attrs = {
+            "num_experts": config.num_local_experts,     # Number of experts in every MoE layer
+            "top_k": config.num_experts_per_tok,         # Number of experts every token is routed to
+            "normalize_routing_weights": 1,              # Renormalize the weights of the top_k experts to sum to 1
+        }
+        if self.world_size > 1:
+            # Expert parallel: every rank holds whole experts, num_experts / world_size of them, instead of a slice of every
+            # expert. The routing is done for all of them on every rank and ShardedMoE gathers the experts' outputs.
+            if self.moe_attrs["num_experts"] % self.world_size != 0:
+                raise ValueError(f"num_local_experts ({self.moe_attrs['num_experts']}) doesn't divide evenly over the world_size {self.world_size}")
+            self.intermediate_size = config.intermediate_size
+
+    def make_layer(self, layer_id, layer):
+        # Each Mixtral decoder layer is defined as:
+        # input_layernorm --> attention --> MoE --> output_layernorm
+        self.make_layernorm(layer_id, layer.input_layernorm, skip=not self.layernorm_attrs["first_layernorm"], simple=self.layernorm_attrs["simple"], location="input")
+        self.make_attention(layer_id, layer.self_attn, self.layernorm_attrs["output_0"])
+        self.make_layernorm(layer_id, layer.post_attention_layernorm, skip=True, simple=self.layernorm_attrs["simple"], location="post_attention")
+        self.make_moe(layer_id, layer.block_sparse_moe, self.layernorm_attrs["output_0"])
+
+        self.layernorm_attrs["first_layernorm"] = False
+        if layer_id == self.num_layers - 1:
+            # Norm after last decoder layer of model (last layer --> norm)
+            self.layernorm_attrs["last_layernorm"] = True
+
+    def make_moe(self, layer_id, moe, root_input):
+        # Make nodes for the MoE subgraph
+        #
+        #           root_input
+        #          /          \
+        #   GateMatMul         |
+        #        |             |
+        #     Reshape          |
+        #          \          /
+        #         MoE (top_k experts of
+        #       act(w1) * w3 --> w2)
+        #
+        # The experts' weights are stacked to {num_experts, in, out}, fc1 = w1 (gate), fc2 = w2 (down) and fc3 = w3 (up).
+        # They stay in io_dtype, int4 only quantizes the MatMuls.
+        basename = f"/model/layers.{layer_id}/moe"
+        num_experts = self.moe_attrs["num_experts"]
+        gate_name = f"{basename}/gate/MatMul"
+        self.make_matmul_fp16_or_fp32(moe.gate.weight.detach().numpy(), gate_name, root_input)
+        reshape_name = f"{basename}/gate/Reshape"
+        reshape_inputs = [f"{gate_name}/output_0", f"/model/constants/TensorProto.INT64/1D/-1, {num_experts}"]
+        self.make_reshape(reshape_name, reshape_inputs, dtype=self.io_dtype, shape=["batch_size * sequence_length", num_experts])
+
+        experts = range(num_experts)
+        if self.world_size > 1:
+            local_experts = num_experts // self.world_size
+            experts = range(self.rank * local_experts, (self.rank + 1) * local_experts)
+
+        weights = []
+        for fc, linear in [("fc1", "w1"), ("fc2", "w2"), ("fc3", "w3")]:
+            weight = f"model.layers.{layer_id}.moe.{fc}.weight"
+            stacked = np.stack([getattr(moe.experts[i], linear).weight.detach().numpy().transpose() for i in experts])
+            self.make_external_tensor(stacked.astype(self.to_numpy_dtype[self.io_dtype]), weight)
+            weights.append(weight)
+
+        moe_name = f"{basename}/MoE"
+        output = f"{moe_name}/output_0"
+        inputs = [root_input, f"{reshape_name}/output_0", weights[0], "", weights[1], "", weights[2]]
+        attrs = {"activation_type": "silu", "k": self.moe_attrs["top_k"], "normalize_routing_weights": self.moe_attrs["normalize_routing_weights"]}
+        if self.world_size > 1:
+            self.make_node("ShardedMoE", inputs=inputs, outputs=[output], name=moe_name, domain="com.microsoft", local_experts_start_index=experts[0], **attrs)
+        else:
+            self.make_node("MoE", inputs=inputs, outputs=[output], name=moe_name, domain="com.microsoft", **attrs)
+        self.make_value_info(output, self.io_dtype, shape=["batch_size", "sequence_length", self.hidden_size])
+
+        # Assign output 0 of MoE as skip input to next SkipLayerNorm
+        self.layernorm_attrs["skip_input"] = output
+
+
 class PhiModel(Model):
     def __init__(self, config, io_dtype, onnx_dtype, ep, cache_dir, extra_options):
         super().__init__(config, io_dtype, onnx_dtype, ep, cache_dir, extra_options)
@@ -2006,74 +2590,22 @@ class Phi3Small8KModel(Model):
         self.rotemb_attrs["t_dtype"] = torch.float32
         self.lm_head_attrs["scale"] = 1 / config.mup_width_multiplier
 
-        self.calculate_block_mask()
+        self.make_block_mask_inputs()
         self.dense_attention_every_n_layers = config.dense_attention_every_n_layers
         if config.mup_use_scaling:
             self.attention_attrs["scale"] = config.mup_attn_multiplier / self.head_size
 
         self.clamp_limit = config.gegelu_limit
 
-    def calculate_cdiv(self, a, b):
-        return -(a // -b)
-
-    def calculate_block_mask(self):
-        # Initialize parameters for calculating block dense mask
-        n_heads = self.num_attn_heads
-        q_len = self.context_length
-        N_CTX = self.context_length
-        BLOCK = self.attention_attrs["block_sparse"]["sparse_block_size"]
-        local_blocks = self.attention_attrs["block_sparse"]["local_blocks"]
-        vert_stride = self.attention_attrs["block_sparse"]["vert_stride"]
-        homo_head = self.attention_attrs["block_sparse"]["homo_head"]
-
-        N_BLOCK = self.calculate_cdiv(N_CTX, BLOCK)
-        if homo_head:
-            q_pos = torch.arange(N_BLOCK)[:, None]
-            k_pos = torch.arange(N_BLOCK)[None]
-            mask_vert_strided = (torch.arange(N_BLOCK) + 1) % vert_stride == 0
-            block_mask_dense = ((q_pos >= k_pos) & ((q_pos - k_pos < local_blocks) | mask_vert_strided))
-            N_BLOCK_Q = self.calculate_cdiv(q_len, BLOCK)
-            block_mask_dense_output = block_mask_dense[-N_BLOCK_Q:].contiguous().to_sparse_csr()
-
-            crows = block_mask_dense_output.crow_indices()
-            cols = block_mask_dense_output.col_indices()
-
-            crows = crows[None].expand(n_heads, crows.shape[0])
-            cols = cols[None].expand(n_heads, cols.shape[0])
-        else:
-            q_pos = torch.arange(N_BLOCK)[None, :, None]
-            k_pos = torch.arange(N_BLOCK)[None, None]
-            head_sliding_step = max(1, int(vert_stride / n_heads))  # if vert_stride <= n_heads, rotating the heads
-            mask_vert_strided = [(torch.arange(N_BLOCK) + h * head_sliding_step + 1) % vert_stride == 0 for h in range(n_heads)]
-            mask_vert_strided = torch.vstack(mask_vert_strided).unsqueeze(1)
-            block_mask_dense = ((q_pos >= k_pos) & ((q_pos - k_pos < local_blocks) | mask_vert_strided))
-            N_BLOCK_Q = self.calculate_cdiv(q_len, BLOCK)
-            block_mask_dense_output = block_mask_dense[:, -N_BLOCK_Q:]
-
-            # Dense to crow_col
-            pad = -1
-            dim = block_mask_dense_output.dim()
-            assert dim in (2, 3)
-            if dim == 2:
-                block_mask_dense_output = block_mask_dense_output[None]
-            block_mask_dense_output = [xi.to_sparse_csr() for xi in block_mask_dense_output]
-            crows = torch.vstack([xi.crow_indices() for xi in block_mask_dense_output])
-            cols = [xi.col_indices() for xi in block_mask_dense_output]
-            max_cols = max(len(xi) for xi in cols)
-            cols = [torch.cat([xi, pad + xi.new_zeros(max_cols - xi.shape[0])]) for xi in cols]
-            cols = torch.vstack(cols)
-            if dim == 2:
-                crows = crows[0]
-                cols = cols[0]
-
-        # Create tensors for row indices and col indices
-        crows_name = "block_row_indices"
-        self.make_external_tensor(crows.detach().numpy().astype(np.int32), crows_name)
-        self.mask_attrs["block_row_indices"] = crows_name
-        
-        cols_name = "block_col_indices"
-        self.make_external_tensor(cols.detach().numpy().astype(np.int32), cols_name)
-        self.mask_attrs["block_col_indices"] = cols_name
+    def make_block_mask_inputs(self):
+        # The CSR block mask of the SparseAttention layers is fed by the runtime (see `sparse_attention` in the GenAI config),
+        # which makes it for the blocks of a generator's max length instead of the whole context length
+        n_layouts = 1 if self.attention_attrs["block_sparse"]["homo_head"] else self.num_attn_heads
+        for name, blocks in [("block_row_indices", "max_blocks_plus_1"), ("block_col_indices", "max_layout_blocks")]:
+            self.input_names.append(name)
+            self.input_types[name] = TensorProto.INT32
+            self.input_shapes[name] = [n_layouts, blocks]
+            self.mask_attrs[name] = name
 
     def make_attention(self, layer_id, attention, root_input, **kwargs):
         dense_attention_op = self.attention_attrs["op_type"]
@@ -2244,6 +2776,10 @@ def create_model(model_name, input_path, output_dir, precision, execution_provid
             onnx_model = LlamaModel(config, io_dtype, precision, execution_provider, cache_dir, extra_options)
         elif config.architectures[0] == "MistralForCausalLM":
             onnx_model = MistralModel(config, io_dtype, precision, execution_provider, cache_dir, extra_options)
+        elif config.architectures[0] == "MixtralForCausalLM":
+            print("WARNING: This model only works for CUDA currently because `MoE` is only supported for CUDA in ONNX Runtime. Setting `--execution_provider cuda` by default.")
+            execution_provider = "cuda"
+            onnx_model = MixtralModel(config, io_dtype, precision, execution_provider, cache_dir, extra_options)
         elif config.architectures[0] == "PhiForCausalLM":
             onnx_model = PhiModel(config, io_dtype, precision, execution_provider, cache_dir, extra_options)
         elif config.architectures[0] == "Phi3ForCausalLM" and config.max_position_embeddings == 4096:
@@ -2265,11 +2801,35 @@ def create_model(model_name, input_path, output_dir, precision, execution_provid
         else:
             raise NotImplementedError(f"The {hf_name} model is not currently supported.")
 
+        gpu_layers = int(extra_options["gpu_layers"]) if "gpu_layers" in extra_options else 0
+        if gpu_layers > 0:
+            if execution_provider != "cuda" or onnx_model.world_size > 1:
+                raise NotImplementedError("gpu_layers is only supported for CUDA without tensor parallelism")
+            if not 0 < gpu_layers < onnx_model.num_layers:
+                raise ValueError(f"gpu_layers ({gpu_layers}) must leave layers for the CPU, the model has {onnx_model.num_layers}")
+
+            # The layers from gpu_layers on and the LM head go in a CPU model of their own, which takes the GPU model's hidden states
+            cpu_options = {key: value for key, value in extra_options.items() if key not in {"enable_cuda_graph", "filename"}}
+            cpu_options.update({"exclude_embeds": True, "filename": "model_cpu.onnx"})
+            cpu_model = onnx_model.__class__(config, TensorProto.FLOAT, "int4" if precision == "int4" else "fp32", "cpu", cache_dir, cpu_options)
+            cpu_model.set_layers_range(gpu_layers, cpu_model.num_layers)
+            cpu_model.make_model(input_path)
+            cpu_model.save_model(output_dir)
+            del cpu_model
+
+            onnx_model.set_layers_range(0, gpu_layers)
+            onnx_model.offload_filename = "model_cpu.onnx"
+
         # Make ONNX model
         onnx_model.make_model(input_path)
 
         # Save ONNX model
         onnx_model.save_model(output_dir)
+
+        # Save the adapters for its LoRA inputs
+        if onnx_model.enable_lora and "adapter_path" in extra_options:
+            for adapter_path in extra_options["adapter_path"].split(","):
+                onnx_model.save_adapter(adapter_path, output_dir)
     else:
         onnx_model = Model(config, io_dtype, precision, execution_provider, cache_dir, extra_options)
 
@@ -2314,7 +2874,7 @@ def get_args():
         "-p",
         "--precision",
         required=True,
-        choices=["int4", "fp16", "fp32"],
+        choices=["int4", "int8", "fp16", "fp32"],
         help="Precision of model",
     )
 
@@ -2348,6 +2908,9 @@ def get_args():
                     3 is bf16.
                     2 is fp16.
                     1 is fp32.
+                    The default is 4 for the CPU execution provider.
+                quantize_embedding = 1 : Store the embeddings as INT8 with one scale per token, with the int4 or int8 precision.
+                    The int8 precision quantizes every MatMul including the lm_head to INT8 weights with per channel scales (DynamicQuantizeMatMul), for CPU.
                 num_hidden_layers = Manually specify the number of layers in your ONNX model (for unit testing purposes).
                 filename = Filename for ONNX model (default is 'model.onnx').
                     For models with multiple components, each component is exported to its own ONNX model.
@@ -2360,6 +2923,31 @@ def get_args():
                 exclude_lm_head = Remove language modeling head from your ONNX model.
                     Use this option when you want to remove the language modeling head from within your ONNX model.
                     Instead of `logits`, you will have `hidden_states` as the output to your ONNX model.
+                gguf_skeleton = 1 : With a GGUF input, don't copy the weights that are used as the GGUF file stores them. Their initializers point into the GGUF file,
+                    which is linked next to the ONNX model and memory mapped by the runtime (`gguf_filename` in the genai_config), so swapping in another GGUF file of the
+                    same model doesn't need a new export. Requires the fp16 or fp32 precision matching the GGUF file's weights; the Q/K/V MatMuls aren't packed.
+                include_hidden_states = 1 : Output the `hidden_states` of the final norm alongside the `logits`.
+                    Use this option to get embeddings out of the same model used for generation, see EmbedSequences in the API.
+                last_token_logits = 1 : Only compute the logits of the token given by the `last_token_indices` input instead of every input token.
+                    Use this option to avoid producing and converting the logits of the whole prompt. Requires a runtime that feeds `last_token_indices`.
+                next_tokens_head = 1 : Add a `next_tokens` output with the argmax of the `logits` (int32) of every position.
+                    Use this option on CPU to have greedy steps fetch a token per row instead of the full vocab logits.
+                top_k_head = Add `top_k_logits` and `top_k_indices` outputs with the largest `top_k_head` logits of every position and their token ids.
+                exclude_attention_mask = 1 : Take GroupQueryAttention's `seqlens_k` and `total_seq_len` as inputs instead of a 2D `attention_mask` they are computed from.
+                    Use this option to skip growing the mask every step and the mask reformatting subgraph. Requires GQA (CPU or CUDA) and a runtime that feeds them.
+                kv_quant = int8 : Store the KV cache as INT8 with one scale per token per head, which halves its size compared to FP16.
+                    The presents are requantized on every run, so past_present_share_buffer is disabled. Not supported with DML or CUDA graph capture.
+                world_size = Number of GPUs to split the model over with tensor parallelism (default is 1). Supported for LLaMA, Mistral, Gemma and Phi-2.
+                    Each run exports the shard of one rank, the filename gets a %d for the rank (default is 'model_%d.onnx').
+                    Run the model with one process per rank through mpirun, it needs onnxruntime built with NCCL and MPI.
+                rank = The rank to export when world_size > 1 (default is 0).
+                gpu_layers = Split the decoder for models bigger than the GPU memory: the first `gpu_layers` layers are exported for CUDA to the usual filename,
+                    the other layers and the LM head for CPU (FP32, or INT4 with the int4 precision) to 'model_cpu.onnx'. The runtime runs one after the other
+                    every step, handing the hidden states over in pinned memory, and keeps the KV cache of each model in its own memory. CUDA only.
+                enable_lora = 1 : Add LoRA inputs to every MatMul of the decoder layers, so one exported model can run many adapters.
+                    The adapter of every batch row is picked at runtime through `adapter_ids`, see Adapters in the API.
+                adapter_path = Comma separated paths to PEFT LoRA adapters to export for the LoRA inputs, requires enable_lora = 1.
+                    Each adapter is saved as 'adapters/<adapter folder name>.onnx' in the output folder.
                 enable_cuda_graph = 1 : The model can use CUDA graph capture for CUDA execution provider. If enabled, all nodes being placed on the CUDA EP
                     is the prerequisite for the CUDA graph to be used correctly. It is not guaranteed that cuda graph be enabled as it depends on the model
                     and the graph structure.
@@ -2367,7 +2955,7 @@ def get_args():
     )
 
     args = parser.parse_args()
-    print("Valid precision + execution provider combinations are: FP32 CPU, FP32 CUDA, FP16 CUDA, FP16 DML, INT4 CPU, INT4 CUDA, INT4 DML")
+    print("Valid precision + execution provider combinations are: FP32 CPU, FP32 CUDA, FP16 CUDA, FP16 DML, INT4 CPU, INT4 CUDA, INT4 DML, INT8 CPU")
     return args
 
 if __name__ == '__main__':
@@ -74,6 +74,7 @@ class GGUFModel:
     def __init__(self, input_path, head_size, hidden_size, intermediate_size, num_attn_heads, num_kv_heads, vocab_size):
         # Load GGUF model and read its info
         reader = GGUFReader(input_path)
+        self.data = reader.data  # Memory map of the whole file, the tensors are views of it
 
         self.embedding = GGUFTensorModule()
         self.final_norm = GGUFTensorModule()
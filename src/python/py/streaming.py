@@ -0,0 +1,32 @@
+# Copyright (c) Microsoft Corporation. All rights reserved.
+# Licensed under the MIT License
+
+import asyncio
+
+
+async def stream_async(generator, tokenizer=None):
+    """Runs Generator.stream on a worker thread and yields (row, token, text) as the tokens are generated.
+
+    Leaving the loop early stops the generation, the generator must not be used until the loop is done.
+    """
+    loop = asyncio.get_running_loop()
+    tokens = asyncio.Queue()
+    finished = object()
+    stopped = False
+
+    def on_token(row, token, text):
+        loop.call_soon_threadsafe(tokens.put_nowait, (row, token, text))
+        return not stopped
+
+    future = loop.run_in_executor(None, generator.stream, on_token, tokenizer)
+    future.add_done_callback(lambda _: tokens.put_nowait(finished))
+    try:
+        while True:
+            item = await tokens.get()
+            if item is finished:
+                break
+            yield item
+        future.result()  # Raises if the generation failed
+    finally:
+        stopped = True
+        await asyncio.wait([future])
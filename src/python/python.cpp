@@ -8,7 +8,11 @@
 #include "../json.h"
 #include "../search.h"
 #include "../models/model.h"
+#include "../models/adapters.h"
 #include "../logging.h"
+#include "../streaming.h"
+#include "../scheduler.h"
+#include "dlpack.h"
 
 using namespace pybind11::literals;
 
@@ -43,6 +47,15 @@ pybind11::array_t<T> ToPython(std::span<T> v) {
   return pybind11::array_t<T>(v.size(), v.data());
 }
 
+// A read only array over v rather than a copy of it, which keeps owner (the object owning v's memory) alive. Only valid
+// until the owner writes there again, as a generator does on its next step.
+template <typename T>
+pybind11::array_t<T> ToPythonView(std::span<T> v, pybind11::handle owner) {
+  pybind11::array_t<T> array({v.size()}, {sizeof(T)}, v.data(), owner);
+  array.attr("setflags")("write"_a = false);
+  return array;
+}
+
 ONNXTensorElementDataType ToTensorType(const pybind11::dtype& type) {
   switch (type.num()) {
     case pybind11::detail::npy_api::NPY_BOOL_:
@@ -147,7 +160,8 @@ std::unique_ptr<OrtValue> ToOrtValue(pybind11::array& v) {
   return OrtValue::CreateTensor(*p_memory_info, v.mutable_data(), v.nbytes(), shape, type);
 }
 
-pybind11::array ToNumpy(OrtValue* v) {
+// A copy of v, or a read only view of it that keeps owner alive when it's in CPU memory and an owner is given
+pybind11::array ToNumpy(OrtValue* v, pybind11::handle owner = {}) {
   if (!v)
     return {};
 
@@ -190,7 +204,246 @@ pybind11::array ToNumpy(OrtValue* v) {
       strides                                        // Strides (in bytes) for each index
   };
 
-  return pybind11::array{bufinfo};
+  if (!owner || cpu_copy)
+    return pybind11::array{bufinfo};
+
+  pybind11::array view{bufinfo, owner};
+  view.attr("setflags")("write"_a = false);
+  return view;
+}
+
+// DLPack and __cuda_array_interface__: tensors in CPU or CUDA memory go to and from torch, cupy and the like without a
+// copy. A Tensor made from another library's memory keeps that memory alive, and an exported capsule keeps ours alive.
+
+DLDataType ToDLDataType(ONNXTensorElementDataType type) {
+  switch (type) {
+    case Ort::TypeToTensorType<bool>::type:
+      return {kDLBool, 8, 1};
+    case Ort::TypeToTensorType<int8_t>::type:
+      return {kDLInt, 8, 1};
+    case Ort::TypeToTensorType<uint8_t>::type:
+      return {kDLUInt, 8, 1};
+    case Ort::TypeToTensorType<int16_t>::type:
+      return {kDLInt, 16, 1};
+    case Ort::TypeToTensorType<uint16_t>::type:
+      return {kDLUInt, 16, 1};
+    case Ort::TypeToTensorType<int32_t>::type:
+      return {kDLInt, 32, 1};
+    case Ort::TypeToTensorType<uint32_t>::type:
+      return {kDLUInt, 32, 1};
+    case Ort::TypeToTensorType<int64_t>::type:
+      return {kDLInt, 64, 1};
+    case Ort::TypeToTensorType<uint64_t>::type:
+      return {kDLUInt, 64, 1};
+    case Ort::TypeToTensorType<Ort::Float16_t>::type:
+      return {kDLFloat, 16, 1};
+    case Ort::TypeToTensorType<float>::type:
+      return {kDLFloat, 32, 1};
+    case Ort::TypeToTensorType<double>::type:
+      return {kDLFloat, 64, 1};
+    default:
+      throw std::runtime_error("Unsupported onnx type");
+  }
+}
+
+ONNXTensorElementDataType ToTensorType(DLDataType type) {
+  for (auto candidate : {Ort::TypeToTensorType<bool>::type, Ort::TypeToTensorType<int8_t>::type, Ort::TypeToTensorType<uint8_t>::type,
+                         Ort::TypeToTensorType<int16_t>::type, Ort::TypeToTensorType<uint16_t>::type, Ort::TypeToTensorType<int32_t>::type,
+                         Ort::TypeToTensorType<uint32_t>::type, Ort::TypeToTensorType<int64_t>::type, Ort::TypeToTensorType<uint64_t>::type,
+                         Ort::TypeToTensorType<Ort::Float16_t>::type, Ort::TypeToTensorType<float>::type, Ort::TypeToTensorType<double>::type}) {
+    auto dl_type = ToDLDataType(candidate);
+    if (type.lanes == 1 && dl_type.code == type.code && dl_type.bits == type.bits)
+      return candidate;
+  }
+  throw std::runtime_error("Unsupported DLPack type");
+}
+
+DLDevice ToDLDevice(const OrtValue& v) {
+  auto& memory_info = v.GetTensorMemoryInfo();
+  if (memory_info.GetDeviceType() == OrtMemoryInfoDeviceType_CPU)
+    return {kDLCPU, 0};
+  if (memory_info.GetAllocatorName() == "Cuda")
+    return {kDLCUDA, memory_info.GetDeviceId()};
+  throw std::runtime_error("Only tensors in CPU or CUDA memory can be shared through DLPack");
+}
+
+std::unique_ptr<OrtMemoryInfo> ToMemoryInfo(DLDevice device) {
+  switch (device.device_type) {
+    case kDLCPU:
+    case kDLCUDAHost:
+      return OrtMemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeCPU);
+    case kDLCUDA:
+      return OrtMemoryInfo::Create("Cuda", OrtDeviceAllocator, device.device_id, OrtMemTypeDefault);
+    default:
+      throw std::runtime_error("Only tensors in CPU or CUDA memory are supported");
+  }
+}
+
+// strides are in elements, empty for a row major tensor
+void CheckContiguous(std::span<const int64_t> shape, std::span<const int64_t> strides) {
+  int64_t expected = 1;
+  for (size_t i = strides.size(); i-- > 0;) {
+    if (shape[i] != 1 && strides[i] != expected)
+      throw std::runtime_error("Only contiguous row major tensors are supported");
+    expected *= shape[i];
+  }
+}
+
+// Keeps a Python object alive from C++, where it can be let go of without holding the GIL
+std::shared_ptr<void> KeepAlive(pybind11::handle object) {
+  return std::shared_ptr<void>(new pybind11::object(pybind11::reinterpret_borrow<pybind11::object>(object)), [](void* p) {
+    pybind11::gil_scoped_acquire acquire;
+    delete static_cast<pybind11::object*>(p);
+  });
+}
+
+std::shared_ptr<Generators::Tensor> MakeTensor(const OrtMemoryInfo& memory_info, void* data, std::vector<int64_t> shape, ONNXTensorElementDataType type, std::shared_ptr<void> owner) {
+  auto bytes = static_cast<size_t>(std::accumulate(shape.begin(), shape.end(), int64_t{1}, std::multiplies<int64_t>())) * Generators::SizeOf(type);
+  auto tensor = std::make_shared<Generators::Tensor>(OrtValue::CreateTensor(memory_info, data, bytes, shape, type));
+  tensor->buffer_ = std::move(owner);
+  return tensor;
+}
+
+std::shared_ptr<Generators::Tensor> FromDLPack(pybind11::handle object) {
+  auto capsule = object.attr("__dlpack__")();
+  auto* managed = static_cast<DLManagedTensor*>(PyCapsule_GetPointer(capsule.ptr(), "dltensor"));
+  if (!managed)
+    throw pybind11::error_already_set();
+  PyCapsule_SetName(capsule.ptr(), "used_dltensor");  // Consumed, so its deleter is ours to call
+  std::shared_ptr<void> owner(managed, [](void* p) {
+    auto* managed = static_cast<DLManagedTensor*>(p);
+    if (managed->deleter) {
+      pybind11::gil_scoped_acquire acquire;
+      managed->deleter(managed);
+    }
+  });
+
+  auto& dl_tensor = managed->dl_tensor;
+  std::vector<int64_t> shape(dl_tensor.shape, dl_tensor.shape + dl_tensor.ndim);
+  if (dl_tensor.strides)
+    CheckContiguous(shape, std::span<const int64_t>(dl_tensor.strides, dl_tensor.ndim));
+  auto memory_info = ToMemoryInfo(dl_tensor.device);
+  return MakeTensor(*memory_info, static_cast<uint8_t*>(dl_tensor.data) + dl_tensor.byte_offset, std::move(shape), ToTensorType(dl_tensor.dtype), std::move(owner));
+}
+
+std::shared_ptr<Generators::Tensor> FromCudaArrayInterface(pybind11::handle object) {
+  auto interface = object.attr("__cuda_array_interface__").cast<pybind11::dict>();
+  auto shape = interface["shape"].cast<std::vector<int64_t>>();
+  auto type = ToTensorType(pybind11::dtype::from_args(interface["typestr"]));
+  if (interface.contains("strides") && !interface["strides"].is_none()) {
+    auto strides = interface["strides"].cast<std::vector<int64_t>>();  // In bytes
+    for (auto& stride : strides)
+      stride /= static_cast<int64_t>(Generators::SizeOf(type));
+    CheckContiguous(shape, strides);
+  }
+  auto* data = reinterpret_cast<void*>(interface["data"].cast<pybind11::tuple>()[0].cast<uintptr_t>());
+
+  int device_id{};
+#if USE_CUDA
+  cudaPointerAttributes attributes{};
+  Generators::CudaCheck() == cudaPointerGetAttributes(&attributes, data);
+  device_id = attributes.device;
+#else
+  throw std::runtime_error("__cuda_array_interface__ needs a CUDA build");
+#endif
+  auto memory_info = OrtMemoryInfo::Create("Cuda", OrtDeviceAllocator, device_id, OrtMemTypeDefault);
+  return MakeTensor(*memory_info, data, std::move(shape), type, KeepAlive(object));
+}
+
+// A tensor over the memory of object, which is a Tensor, a numpy array, or anything with __dlpack__ or
+// __cuda_array_interface__ (torch, cupy, ...). Anything else is converted to a numpy array first.
+std::shared_ptr<Generators::Tensor> ToTensor(pybind11::handle object) {
+  if (pybind11::isinstance<Generators::Tensor>(object))
+    return object.cast<std::shared_ptr<Generators::Tensor>>();
+  if (!pybind11::isinstance<pybind11::array>(object)) {
+    if (pybind11::hasattr(object, "__dlpack__"))
+      return FromDLPack(object);
+    if (pybind11::hasattr(object, "__cuda_array_interface__"))
+      return FromCudaArrayInterface(object);
+  }
+
+  auto array = pybind11::array::ensure(object, pybind11::array::c_style);
+  if (!array)
+    throw pybind11::error_already_set();
+  auto tensor = std::make_shared<Generators::Tensor>(ToOrtValue(array));
+  tensor->buffer_ = KeepAlive(array);
+  return tensor;
+}
+
+struct DLPackExport {
+  DLManagedTensor managed;
+  std::vector<int64_t> shape;
+  pybind11::object owner;  // The object keeping the memory alive
+};
+
+pybind11::capsule ToDLPack(OrtValue& v, pybind11::handle owner) {
+  auto type_info = v.GetTensorTypeAndShapeInfo();
+  auto* dl_export = new DLPackExport{};
+  dl_export->shape = type_info->GetShape();
+  dl_export->owner = pybind11::reinterpret_borrow<pybind11::object>(owner);
+
+  auto& dl_tensor = dl_export->managed.dl_tensor;
+  dl_tensor.data = v.GetTensorMutableRawData();
+  dl_tensor.device = ToDLDevice(v);
+  dl_tensor.ndim = static_cast<int32_t>(dl_export->shape.size());
+  dl_tensor.dtype = ToDLDataType(type_info->GetElementType());
+  dl_tensor.shape = dl_export->shape.data();
+  dl_export->managed.manager_ctx = dl_export;
+  dl_export->managed.deleter = [](DLManagedTensor* self) {
+    pybind11::gil_scoped_acquire acquire;
+    delete static_cast<DLPackExport*>(self->manager_ctx);
+  };
+
+  return pybind11::capsule(&dl_export->managed, "dltensor", [](PyObject* capsule) {
+    // A consumer renames the capsule and calls the deleter itself, so it's only called here when nobody took it
+    if (PyCapsule_IsValid(capsule, "dltensor")) {
+      auto* managed = static_cast<DLManagedTensor*>(PyCapsule_GetPointer(capsule, "dltensor"));
+      managed->deleter(managed);
+    }
+  });
+}
+
+// DLPack's stream argument is the consumer's CUDA stream (None and 1 the legacy default stream, 2 the per thread
+// default stream, -1 for none), which waits for the writes to tensor still in flight
+void WaitOnStream(Generators::Tensor& tensor, pybind11::handle stream) {
+#if USE_CUDA
+  if (!tensor.ready_)
+    return;
+  cudaStream_t consumer = cudaStreamLegacy;
+  if (!stream.is_none()) {
+    auto value = stream.cast<intptr_t>();
+    if (value == -1)
+      return;  // The consumer synchronizes itself
+    if (value == 2)
+      consumer = cudaStreamPerThread;
+    else if (value != 1)
+      consumer = reinterpret_cast<cudaStream_t>(value);
+  }
+  Generators::CudaCheck() == cudaStreamWaitEvent(consumer, *tensor.ready_);
+#endif
+}
+
+// For readers that don't say which stream they're on: __cuda_array_interface__ and the copy to numpy
+void WaitOnHost(Generators::Tensor& tensor) {
+#if USE_CUDA
+  if (tensor.ready_)
+    Generators::CudaCheck() == cudaEventSynchronize(*tensor.ready_);
+#endif
+}
+
+pybind11::dict ToCudaArrayInterface(OrtValue& v) {
+  if (ToDLDevice(v).device_type != kDLCUDA)
+    throw pybind11::attribute_error("__cuda_array_interface__ is only available for tensors in CUDA memory");
+
+  auto type_info = v.GetTensorTypeAndShapeInfo();
+  pybind11::dict interface;
+  interface["shape"] = pybind11::tuple(pybind11::cast(type_info->GetShape()));
+  auto dtype = pybind11::reinterpret_steal<pybind11::dtype>(pybind11::detail::npy_api::get().PyArray_DescrFromType_(ToNumpyType(type_info->GetElementType())));
+  interface["typestr"] = dtype.attr("str");
+  interface["data"] = pybind11::make_tuple(reinterpret_cast<uintptr_t>(v.GetTensorMutableRawData()), false);
+  interface["strides"] = pybind11::none();
+  interface["version"] = 3;
+  return interface;
 }
 namespace Generators {
 
@@ -237,6 +490,16 @@ struct PyGeneratorParams {
         params_->sequence_length = static_cast<int>(py_input_ids_.shape(1));
       }
       params_->input_ids = ToSpan(py_input_ids_);
+      params_->input_lengths.clear();
+    }
+
+    if (py_encoder_input_ids_.size() != 0) {
+      if (py_encoder_input_ids_.ndim() == 1)
+        params_->SetEncoderInputs(ToSpan(py_encoder_input_ids_), static_cast<int>(py_encoder_input_ids_.shape(0)), 1);
+      else if (py_encoder_input_ids_.ndim() == 2)
+        params_->SetEncoderInputs(ToSpan(py_encoder_input_ids_), static_cast<int>(py_encoder_input_ids_.shape(1)), static_cast<int>(py_encoder_input_ids_.shape(0)));
+      else
+        throw std::runtime_error("Encoder input IDs can only be 1 or 2 dimensional");
     }
 
     if (py_whisper_input_features_.size() != 0) {
@@ -245,21 +508,39 @@ struct PyGeneratorParams {
     }
   }
 
-  void SetModelInput(const std::string& name, pybind11::array& value) {
-    params_->extra_inputs.push_back({name, std::make_shared<Tensor>(ToOrtValue(value))});
-    refs_.emplace_back(value);
+  // value can be on the device already, see ToTensor
+  void SetModelInput(const std::string& name, pybind11::object value) {
+    params_->extra_inputs.push_back({name, ToTensor(value)});
   }
 
   void SetSearchOptions(const pybind11::kwargs& dict) {
+    ApplySearchOptions(params_->search, dict);
+  }
+
+  void SetRowSearchOptions(int row, const pybind11::kwargs& dict) {
+    ApplySearchOptions(params_->SetRowSearch(row), dict);
+  }
+
+  void SetAdapter(std::shared_ptr<Adapters> adapters, const std::string& name) {
+    adapters->GetWeights()->GetIndex(name);  // Fail here for an adapter that isn't loaded
+    params_->adapters = std::move(adapters);
+    params_->adapter = name;
+  }
+
+  void SetRowAdapter(int row, const std::string& name) {
+    params_->SetRowAdapter(row, name);
+  }
+
+  static void ApplySearchOptions(Config::Search& search, const pybind11::kwargs& dict) {
     for (auto& entry : dict) {
       auto name = entry.first.cast<std::string>();
       try {
         if (pybind11::isinstance<pybind11::float_>(entry.second)) {
-          SetSearchNumber(params_->search, name, entry.second.cast<double>());
+          SetSearchNumber(search, name, entry.second.cast<double>());
         } else if (pybind11::isinstance<pybind11::bool_>(entry.second)) {
-          SetSearchBool(params_->search, name, entry.second.cast<bool>());
+          SetSearchBool(search, name, entry.second.cast<bool>());
         } else if (pybind11::isinstance<pybind11::int_>(entry.second)) {
-          SetSearchNumber(params_->search, name, entry.second.cast<int>());
+          SetSearchNumber(search, name, entry.second.cast<int>());
         } else
           throw std::runtime_error("Unknown search option type, can be float/bool/int:" + name);
       } catch (JSON::unknown_value_error& e) {
@@ -268,6 +549,28 @@ struct PyGeneratorParams {
     }
   }
 
+  void SetLogitBias(const pybind11::dict& bias) {
+    params_->logit_bias.clear();
+    for (auto& entry : bias)
+      params_->logit_bias.emplace_back(entry.first.cast<int32_t>(), entry.second.cast<float>());
+  }
+
+  void SetRegexConstraint(const Tokenizer& tokenizer, const std::string& pattern) {
+    params_->grammar = tokenizer.GetGrammar(pattern, params_->vocab_size, params_->eos_token_id);
+  }
+
+  void AddBadWords(const std::vector<int32_t>& tokens) {
+    if (tokens.empty())
+      throw std::runtime_error("A bad word needs at least one token");
+    params_->bad_words.push_back(tokens);
+  }
+
+  void AddStopSequence(const std::vector<int32_t>& tokens) {
+    if (tokens.empty())
+      throw std::runtime_error("A stop sequence needs at least one token");
+    params_->stop_sequences.push_back(tokens);
+  }
+
   void TryUseCudaGraphWithMaxBatchSize(pybind11::int_ max_batch_size) {
     Log("warning", "try_use_cuda_graph_with_max_batch_size will be deprecated in release 0.3.0. Please use try_graph_capture_with_max_batch_size instead");
     params_->TryGraphCapture(max_batch_size.cast<int>());
@@ -279,8 +582,7 @@ struct PyGeneratorParams {
 
   pybind11::array_t<int32_t> py_input_ids_;
   pybind11::array_t<float> py_whisper_input_features_;
-
-  std::vector<pybind11::object> refs_;  // References to data we want to ensure doesn't get garbage collected
+  pybind11::array_t<int32_t> py_encoder_input_ids_;
 };
 
 struct PyNamedTensors {
@@ -296,33 +598,196 @@ struct PyGenerator {
     generator_ = CreateGenerator(model, params);
   }
 
-  pybind11::array_t<int32_t> GetNextTokens() {
+  PyGenerator(Model& model, PyGeneratorParams& params, const std::string& snapshot_path) {
+    params.Prepare();
+    generator_ = LoadGenerator(model, params, snapshot_path);
+  }
+
+  explicit PyGenerator(std::unique_ptr<Generator> generator) : generator_{std::move(generator)} {}
+
+  // Copies, unless view is set: then on CPU they're read only views of the generator's memory, which are only valid
+  // until its next step. The steps refuse to run while views of the current one are still around, so drop them (del)
+  // first. Device memory is always copied, as the memory the roaming arrays copy to is reused by the next call.
+  pybind11::array_t<int32_t> GetNextTokens(bool view, pybind11::handle self) {
+    Use use{*this};
     py_tokens_.Assign(generator_->search_->GetNextTokens());
-    return ToPython(py_tokens_.GetCPU());
+    if (!view || !OnHost(generator_->model_->device_type_))
+      return ToPython(py_tokens_.GetCPU());
+    return ToPythonView(py_tokens_.GetCPU(), ViewOwner(self));
   }
 
-  pybind11::array_t<int32_t> GetSequence(int index) {
-    py_sequence_.Assign(generator_->search_->GetSequence(index));
-    return ToPython(py_sequence_.GetCPU());
+  // offset: only the tokens from there on, so a streaming caller copies just the new ones off the device
+  pybind11::array_t<int32_t> GetSequence(int index, size_t offset, bool view, pybind11::handle self) {
+    Use use{*this};
+    if (!view || !OnHost(generator_->model_->device_type_)) {
+      auto tail = generator_->GetSequenceTail(index, offset);  // Copied through the generator's host copy of the row
+      return pybind11::array_t<int32_t>(tail.size(), tail.data());
+    }
+    auto length = static_cast<size_t>(generator_->search_->GetSequenceLength());
+    if (offset > length)
+      throw std::runtime_error("Sequence offset " + std::to_string(offset) + " is past the sequence length " + std::to_string(length));
+    py_sequence_.Assign(generator_->search_->GetSequence(index).Tail(offset));
+    return ToPythonView(py_sequence_.GetCPU(), ViewOwner(self));
   }
 
   void ComputeLogits() {
+    Use use{*this, true};
     generator_->ComputeLogits();
   }
 
-  pybind11::array GetOutput(const std::string& name) {
-    return ToNumpy(generator_->state_->GetOutput(name.c_str()));
+  // The run's output, as a view when it's in CPU memory and view is set, which the next run can write over or replace
+  pybind11::array GetOutput(const std::string& name, bool view, pybind11::handle self) {
+    Use use{*this};
+    auto* value = generator_->GetState().GetOutput(name.c_str());
+    if (!view)
+      return ToNumpy(value);
+    return ToNumpy(value, ViewOwner(self));
+  }
+
+  // A Tensor with a copy of the output, as the next run writes over or replaces the output itself. The copy is made on
+  // the output's device, on CUDA its ready_ event is what DLPack consumers wait for.
+  std::shared_ptr<Tensor> GetOutputTensor(const std::string& name) {
+    Use use{*this};
+    auto* value = generator_->GetState().GetOutput(name.c_str());
+    if (!value)
+      throw std::runtime_error("The generator has no output named " + name);
+    auto type_info = value->GetTensorTypeAndShapeInfo();
+    auto shape = type_info->GetShape();
+    const auto type = type_info->GetElementType();
+    const size_t bytes = type_info->GetElementCount() * SizeOf(type);
+    auto& model = *generator_->model_;
+
+    if (ToDLDevice(*value).device_type == kDLCPU) {
+      auto tensor = std::make_shared<Tensor>(OrtValue::CreateTensor(model.allocator_cpu_, shape, type));
+      std::memcpy(tensor->ort_tensor_->GetTensorMutableRawData(), value->GetTensorRawData(), bytes);
+      return tensor;
+    }
+#if USE_CUDA
+    auto tensor = std::make_shared<Tensor>(OrtValue::CreateTensor(*model.allocator_device_, shape, type));
+    CudaCheck() == cudaMemcpyAsync(tensor->ort_tensor_->GetTensorMutableRawData(), value->GetTensorRawData(), bytes, cudaMemcpyDeviceToDevice, model.cuda_stream_);
+    tensor->ready_ = std::make_unique<cuda_event_holder>(cudaEventDisableTiming);
+    CudaCheck() == cudaEventRecord(*tensor->ready_, model.cuda_stream_);
+    return tensor;
+#else
+    throw std::runtime_error("Only outputs in CPU or CUDA memory can be returned as a Tensor");
+#endif
   }
 
   void GenerateNextToken() {
+    Use use{*this, true};
     generator_->GenerateNextToken();
   }
 
-  bool IsDone() const {
+  bool IsDone() {
+    Use use{*this};
     return generator_->IsDone();
   }
 
+  // From any thread, the one running the generator releases the GIL during its steps
+  void Cancel(bool terminate_runs) {
+    generator_->Cancel(terminate_runs);
+  }
+
+  void SwapOut(const std::string& path) {
+    Use use{*this};
+    generator_->SwapOut(path);
+  }
+
+  void SwapIn() {
+    Use use{*this};
+    generator_->SwapIn();
+  }
+
+  void AppendTokens(pybind11::array_t<int32_t> tokens) {
+    auto span = ToSpan(tokens);
+    pybind11::gil_scoped_release release;
+    Use use{*this, true};
+    generator_->AppendTokens(span);
+  }
+
+  void Save(const std::string& path) {
+    Use use{*this};
+    generator_->Save(path);
+  }
+
+  std::unique_ptr<PyGenerator> Fork(PyGeneratorParams& params) {
+    Use use{*this};
+    params.Prepare();
+    return std::make_unique<PyGenerator>(generator_->Fork(params));
+  }
+
+  pybind11::dict GetMetrics() {
+    Use use{*this};
+    auto& metrics = generator_->metrics_;
+    pybind11::dict dict;
+    dict["prefill_seconds"] = metrics.prefill_seconds;
+    dict["decode_seconds"] = metrics.decode_seconds;
+    dict["update_inputs_seconds"] = metrics.update_inputs_seconds;
+    dict["search_seconds"] = metrics.search_seconds;
+    dict["decode_steps"] = metrics.decode_steps;
+    dict["host_to_device_bytes"] = metrics.host_to_device_bytes;
+    dict["device_to_host_bytes"] = metrics.device_to_host_bytes;
+    dict["device_allocations"] = metrics.device_allocations;
+    return dict;
+  }
+
+  // With the search option top_logprobs: the log probabilities of the last generated tokens, and the most likely
+  // tokens of every row with theirs
+  pybind11::dict GetLogProbs() {
+    Use use{*this};
+    auto logprobs = generator_->GetLogProbs();
+    const size_t rows = logprobs.logprobs.size();
+    const size_t top_count = rows ? logprobs.top_tokens.size() / rows : 0;
+    pybind11::dict dict;
+    dict["logprobs"] = pybind11::array_t<float>(rows, logprobs.logprobs.data());
+    dict["top_tokens"] = pybind11::array_t<int32_t>(std::vector<size_t>{rows, top_count}, logprobs.top_tokens.data());
+    dict["top_logprobs"] = pybind11::array_t<float>(std::vector<size_t>{rows, top_count}, logprobs.top_logprobs.data());
+    return dict;
+  }
+
+  // callback(row, token, text) is called from another thread, returning False stops the generation
+  void Stream(pybind11::function callback, const Tokenizer* tokenizer) {
+    pybind11::gil_scoped_release release;
+    Use use{*this, true};
+    StreamTokens(*generator_, tokenizer, [&](size_t row, int32_t token, const std::string& text) {
+      pybind11::gil_scoped_acquire acquire;
+      auto result = callback(row, token, text);
+      return result.is_none() || result.cast<bool>();
+    });
+  }
+
  private:
+  // The steps release the GIL, so without this another Python thread could call into the generator while one runs.
+  // It gets an error instead, except for cancel which is made for that. step is set by the calls that write over the
+  // memory views point to, which refuse to run while there are views.
+  struct Use {
+    Use(PyGenerator& generator, bool step = false) : generator_{generator} {
+      if (generator_.in_use_.exchange(true))
+        throw std::runtime_error("The generator is in use by another thread");
+      if (step && generator_.live_views_ > 0) {
+        generator_.in_use_ = false;
+        throw std::runtime_error("The generator has " + std::to_string(generator_.live_views_) + " views of its memory left (view=True), delete them before its next step");
+      }
+    }
+    ~Use() { generator_.in_use_ = false; }
+
+   private:
+    PyGenerator& generator_;
+  };
+
+  // The base object of a view: keeps the generator's Python object alive and counts the views left
+  pybind11::capsule ViewOwner(pybind11::handle self) {
+    live_views_++;
+    auto* owner = new std::pair<PyGenerator*, pybind11::object>{this, pybind11::reinterpret_borrow<pybind11::object>(self)};
+    return pybind11::capsule(owner, [](void* p) {
+      auto* owner = static_cast<std::pair<PyGenerator*, pybind11::object>*>(p);
+      owner->first->live_views_--;
+      delete owner;
+    });
+  }
+
+  std::atomic<bool> in_use_{};
+  std::atomic<int> live_views_{};
   std::unique_ptr<Generator> generator_;
   PyRoamingArray<int32_t> py_tokens_;
   PyRoamingArray<int32_t> py_indices_;
@@ -330,6 +795,26 @@ struct PyGenerator {
   PyRoamingArray<int32_t> py_sequencelengths_;
 };
 
+struct PyScheduler {
+  PyScheduler(Model& model, PyGeneratorParams& params)
+      : model_{model.shared_from_this()},
+        scheduler_{std::make_unique<Scheduler>(model, *params.params_)} {}
+
+  int AddRequest(pybind11::array_t<int32_t> prompt, int max_length, std::optional<int> priority) {
+    return scheduler_->AddRequest(ToSpan(prompt), max_length, priority);
+  }
+
+  void Step() { scheduler_->Step(); }
+
+  pybind11::array_t<int32_t> TakeResult(int request_id) {
+    auto tokens = scheduler_->TakeResult(request_id);
+    return ToPython(std::span<int32_t>{tokens});
+  }
+
+  std::shared_ptr<const Model> model_;
+  std::unique_ptr<Scheduler> scheduler_;
+};
+
 void SetLogOptions(const pybind11::kwargs& dict) {
   for (auto& entry : dict) {
     auto name = entry.first.cast<std::string>();
@@ -346,6 +831,14 @@ void SetLogOptions(const pybind11::kwargs& dict) {
   }
 }
 
+pybind11::dict ToDict(const GeneratorMemory& memory) {
+  pybind11::dict dict;
+  dict["kv_cache"] = memory.kv_cache;
+  dict["logits"] = memory.logits;
+  dict["static_buffers"] = memory.static_buffers;
+  return dict;
+}
+
 PYBIND11_MODULE(onnxruntime_genai, m) {
   m.doc() = R"pbdoc(
         Ort Generators library
@@ -379,70 +872,267 @@ PYBIND11_MODULE(onnxruntime_genai, m) {
       .def_property_readonly("vocab_size", [](const PyGeneratorParams& v) { return v.params_->vocab_size; })
       .def_readwrite("input_ids", &PyGeneratorParams::py_input_ids_)
       .def_readwrite("whisper_input_features", &PyGeneratorParams::py_whisper_input_features_)
+      .def_readwrite("encoder_input_ids", &PyGeneratorParams::py_encoder_input_ids_)
       .def("set_inputs", [](PyGeneratorParams& generator_params, PyNamedTensors* named_tensors) {
         if (!named_tensors || !named_tensors->named_tensors_)
           throw std::runtime_error("No inputs provided.");
 
         generator_params.params_->SetInputs(*named_tensors->named_tensors_);
       })
+      .def("set_packed_inputs", [](PyGeneratorParams& p, pybind11::array_t<int32_t> tokens, pybind11::array_t<int32_t> lengths, bool pad_left) {
+        // Ragged prompts, the tokens of every row one after another, padded here and told apart from the padding by lengths
+        p.params_->SetPackedInputs(ToSpan(tokens), ToSpan(lengths), pad_left);
+        p.py_input_ids_ = pybind11::array_t<int32_t>{};
+      }, pybind11::arg("tokens"), pybind11::arg("lengths"), pybind11::arg("pad_left") = false)
       .def("set_model_input", &PyGeneratorParams::SetModelInput)
       .def("set_search_options", &PyGeneratorParams::SetSearchOptions)                                     // See config.h 'struct Search' for the options
+      .def("set_row_search_options", &PyGeneratorParams::SetRowSearchOptions)                             // (row, **options), options of one row of the batch
+      .def("set_adapter", &PyGeneratorParams::SetAdapter)                                                  // (adapters, name), "" is the base model
+      .def("set_cancellation", [](PyGeneratorParams& p, std::shared_ptr<Cancellation> c) { p.params_->cancellation = std::move(c); })
+      .def("set_row_adapter", &PyGeneratorParams::SetRowAdapter)                                           // (row, name), the adapter of one row of the batch
+      .def("set_logit_bias", &PyGeneratorParams::SetLogitBias)                                             // {token id: bias}
+      .def("add_bad_words", &PyGeneratorParams::AddBadWords)
+      .def("add_stop_sequence", &PyGeneratorParams::AddStopSequence)
+      .def("set_regex_constraint", &PyGeneratorParams::SetRegexConstraint)
       .def("try_use_cuda_graph_with_max_batch_size", &PyGeneratorParams::TryUseCudaGraphWithMaxBatchSize)  // will be deprecated
       .def("try_graph_capture_with_max_batch_size", &PyGeneratorParams::TryGraphCaptureWithMaxBatchSize);
 
   pybind11::class_<TokenizerStream>(m, "TokenizerStream")
       .def("decode", [](TokenizerStream& t, int32_t token) { return t.Decode(token); });
 
+  pybind11::class_<TokenizerBatchStream>(m, "TokenizerBatchStream")
+      .def("decode", [](TokenizerBatchStream& t, pybind11::array_t<int32_t> tokens) {
+        // The new text of every row, empty for a skipped (negative) token
+        t.Decode(ToSpan(tokens));
+        auto text = t.Text();
+        auto offsets = t.Offsets();
+        pybind11::list result;
+        for (size_t row = 0; row < t.BatchSize(); row++) {
+          auto chunk = text.substr(offsets[row], offsets[row + 1] - offsets[row]);
+          result.append(pybind11::str(chunk.data(), chunk.size()));
+        }
+        return result;
+      })
+      .def("reset_row", &TokenizerBatchStream::Reset);
+
   pybind11::class_<Tokenizer, std::shared_ptr<Tokenizer>>(m, "Tokenizer")
       .def(pybind11::init([](Model& model) { return model.CreateTokenizer(); }))
       .def("encode", &Tokenizer::Encode)
+      .def("encode_segments", [](const Tokenizer& t, std::vector<std::string> segments) {
+        pybind11::gil_scoped_release release;
+        return t.EncodeSegments(segments);
+      })
       .def("decode", [](const Tokenizer& t, pybind11::array_t<int32_t> tokens) { return t.Decode(ToSpan(tokens)); })
       .def("encode_batch", [](const Tokenizer& t, std::vector<std::string> strings) {
-        auto result = t.EncodeBatch(strings);
-        return pybind11::array_t<int32_t>({strings.size(), result.size() / strings.size()}, result.data());
+        std::unique_ptr<std::vector<int32_t>> result;
+        {
+          pybind11::gil_scoped_release release;
+          result = std::make_unique<std::vector<int32_t>>(t.EncodeBatch(strings));
+        }
+        // The array keeps the tokens where they are rather than copying them
+        auto* data = result->data();
+        const size_t sequence_length = result->size() / strings.size();
+        pybind11::capsule owner(result.release(), [](void* p) { delete reinterpret_cast<std::vector<int32_t>*>(p); });
+        return pybind11::array_t<int32_t>({strings.size(), sequence_length}, data, owner);
       })
-      .def("decode_batch", [](const Tokenizer& t, pybind11::array_t<int32_t> tokens) {
-        if (tokens.ndim() == 1) {  // Just a 1D array
-          return t.DecodeBatch(ToSpan(tokens), 1);
-        } else {
-          if (tokens.ndim() != 2)
-            throw std::runtime_error("token shape can only be 1 or 2 dimensional");
-
-          return t.DecodeBatch(ToSpan(tokens), tokens.shape(0));
+      .def("encode_batch_to_params", [](const Tokenizer& t, std::vector<std::string> strings, PyGeneratorParams& params) {
+        // Written straight into the params' own input ids, returns the length of every row before the padding
+        std::vector<const char*> texts;
+        for (auto& string : strings)
+          texts.push_back(string.c_str());
+        pybind11::array_t<int32_t> lengths(static_cast<pybind11::ssize_t>(strings.size()));
+        auto lengths_span = ToSpan(lengths);
+        {
+          pybind11::gil_scoped_release release;
+          t.EncodeBatchInto(texts, *params.params_, lengths_span);
         }
+        params.py_input_ids_ = pybind11::array_t<int32_t>{};  // Or Prepare() would put the previous input_ids back
+        return lengths;
+      })
+      .def("decode_batch", [](const Tokenizer& t, pybind11::array_t<int32_t> tokens) {
+        if (tokens.ndim() != 1 && tokens.ndim() != 2)
+          throw std::runtime_error("token shape can only be 1 or 2 dimensional");
+        auto span = ToSpan(tokens);
+        const size_t count = tokens.ndim() == 1 ? 1 : static_cast<size_t>(tokens.shape(0));  // 1D is a single sequence
+        pybind11::gil_scoped_release release;
+        return t.DecodeBatch(span, count);
       })
-      .def("create_stream", [](const Tokenizer& t) { return t.CreateStream(); });
+      .def("create_stream", [](const Tokenizer& t) { return t.CreateStream(); })
+      .def("create_batch_stream", [](const Tokenizer& t, size_t batch_size) { return t.CreateBatchStream(batch_size); });
+
+  pybind11::class_<Adapters, std::shared_ptr<Adapters>>(m, "Adapters")
+      .def(pybind11::init([](const Model& model) { return std::make_shared<Adapters>(model); }))
+      .def("load_adapter", [](Adapters& adapters, const std::string& path, const std::string& name) { adapters.LoadAdapter(fs::path(path), name); })
+      .def("unload_adapter", &Adapters::UnloadAdapter);
+
+  // Cancels the generators of the params it's set on, including Model.generate's, from another thread
+  pybind11::class_<Cancellation, std::shared_ptr<Cancellation>>(m, "Cancellation")
+      .def(pybind11::init<>())
+      .def("cancel", &Cancellation::Cancel, pybind11::arg("terminate_runs") = false)
+      .def("is_cancelled", &Cancellation::IsCancelled);
+
+  pybind11::class_<SharedWeights, std::shared_ptr<SharedWeights>>(m, "SharedWeights")
+      .def(pybind11::init<>());
 
   pybind11::class_<Model, std::shared_ptr<Model>>(m, "Model")
       .def(pybind11::init([](const std::string& config_path) {
+        pybind11::gil_scoped_release release;
         return CreateModel(GetOrtEnv(), config_path.c_str());
       }))
-      .def("generate", [](Model& model, PyGeneratorParams& params) { params.Prepare(); return Generate(model, params); })
+      .def(pybind11::init([](const std::string& config_path, std::shared_ptr<SharedWeights> shared_weights) {
+        pybind11::gil_scoped_release release;
+        return CreateModel(GetOrtEnv(), config_path.c_str(), std::move(shared_weights));
+      }))
+      .def("generate", [](Model& model, PyGeneratorParams& params) {
+        params.Prepare();
+        pybind11::gil_scoped_release release;
+        return Generate(model, params);
+      })
+      .def("score", [](Model& model, PyGeneratorParams& params) {
+        params.Prepare();
+        std::vector<float> scores;
+        {
+          pybind11::gil_scoped_release release;
+          scores = ScoreSequences(model, params);
+        }
+        const GeneratorParams& prepared = params;
+        return pybind11::array_t<float>(std::vector<size_t>{static_cast<size_t>(prepared.batch_size), static_cast<size_t>(prepared.sequence_length - 1)}, scores.data());
+      })
+      .def("embed", [](Model& model, PyGeneratorParams& params, const std::string& pooling) {
+        if (pooling != "last" && pooling != "mean")
+          throw std::runtime_error("pooling must be 'last' or 'mean', not '" + pooling + "'");
+        params.Prepare();
+        std::vector<float> embeddings;
+        {
+          pybind11::gil_scoped_release release;
+          embeddings = EmbedSequences(model, params, pooling == "mean" ? Pooling::Mean : Pooling::LastToken);
+        }
+        const GeneratorParams& prepared = params;
+        const size_t batch_size = prepared.batch_size;
+        return pybind11::array_t<float>(std::vector<size_t>{batch_size, embeddings.size() / batch_size}, embeddings.data());
+      }, pybind11::arg("params"), pybind11::arg("pooling") = "last")
       .def_property_readonly("device_type", [](const Model& s) { return s.device_type_; })
+      .def("capture_graphs", [](const Model& model, const std::vector<int>& batch_sizes, const std::vector<int>& max_lengths) { model.CaptureGraphs(batch_sizes, max_lengths); },
+           pybind11::arg("batch_sizes"), pybind11::arg("max_lengths") = std::vector<int>{}, pybind11::call_guard<pybind11::gil_scoped_release>())
+      .def("set_prefill_model", [](Model& model, std::shared_ptr<Model> prefill_model) { model.SetPrefillModel(std::move(prefill_model)); })
+      .def("estimate_memory", [](const Model& model, PyGeneratorParams& params) {
+        params.Prepare();
+        return ToDict(model.EstimateMemory(params));
+      })
+      .def("get_memory_usage", [](const Model& model) {
+        auto& budget = model.GetMemoryBudget();
+        auto dict = ToDict(budget.Used());
+        dict["budget"] = budget.Bytes();
+        return dict;
+      })
+      .def("trim_memory_pool", &Model::TrimMemoryPool)
       .def("create_multimodal_processor", [](const Model& model) { return model.CreateMultiModalProcessor(); });
 
+  pybind11::class_<ModelReplicas, std::shared_ptr<ModelReplicas>>(m, "ModelReplicas")
+      .def(pybind11::init([](const std::string& config_path, const std::vector<int>& device_ids) {
+        return std::make_shared<ModelReplicas>(GetOrtEnv(), config_path.c_str(), device_ids);
+      }))
+      .def("get_model", [](const ModelReplicas& replicas) { return std::const_pointer_cast<Model>(replicas.GetLeastLoaded().shared_from_this()); })
+      .def("get_tokenizer", &ModelReplicas::GetTokenizer);
+
   pybind11::class_<PyGenerator>(m, "Generator")
       .def(pybind11::init<Model&, PyGeneratorParams&>())
       .def("is_done", &PyGenerator::IsDone)
-      .def("compute_logits", &PyGenerator::ComputeLogits)
-      .def("get_output", &PyGenerator::GetOutput)
-      .def("generate_next_token", &PyGenerator::GenerateNextToken)
-      .def("get_next_tokens", &PyGenerator::GetNextTokens)
-      .def("get_sequence", &PyGenerator::GetSequence);
+      .def("cancel", &PyGenerator::Cancel, pybind11::arg("terminate_runs") = false)
+      // The model runs release the GIL, so generators on other Python threads run at the same time
+      .def("compute_logits", &PyGenerator::ComputeLogits, pybind11::call_guard<pybind11::gil_scoped_release>())
+      .def("get_output", [](pybind11::object self, const std::string& name, bool view) { return self.cast<PyGenerator&>().GetOutput(name, view, self); }, pybind11::arg("name"), pybind11::arg("view") = false)
+      .def("get_output_tensor", &PyGenerator::GetOutputTensor)
+      .def("generate_next_token", &PyGenerator::GenerateNextToken, pybind11::call_guard<pybind11::gil_scoped_release>())
+      .def("get_next_tokens", [](pybind11::object self, bool view) { return self.cast<PyGenerator&>().GetNextTokens(view, self); }, pybind11::arg("view") = false)
+      .def("get_sequence", [](pybind11::object self, int index, size_t offset, bool view) { return self.cast<PyGenerator&>().GetSequence(index, offset, view, self); },
+           pybind11::arg("index"), pybind11::arg("offset") = 0, pybind11::arg("view") = false)
+      .def("swap_out", &PyGenerator::SwapOut, pybind11::arg("path") = "", pybind11::call_guard<pybind11::gil_scoped_release>())
+      .def("swap_in", &PyGenerator::SwapIn, pybind11::call_guard<pybind11::gil_scoped_release>())
+      .def("append_tokens", &PyGenerator::AppendTokens)
+      .def("save", &PyGenerator::Save, pybind11::call_guard<pybind11::gil_scoped_release>())
+      .def("fork", &PyGenerator::Fork)
+      .def("get_metrics", &PyGenerator::GetMetrics)
+      .def("get_logprobs", &PyGenerator::GetLogProbs)
+      .def("stream", &PyGenerator::Stream, pybind11::arg("callback"), pybind11::arg("tokenizer") = nullptr)  // See stream_async for asyncio
+      .def_static("load", [](Model& model, PyGeneratorParams& params, const std::string& path) { return std::make_unique<PyGenerator>(model, params, path); });
+
+  // The model is kept alive by the scheduler, the params' search options are copied by every request's cohort
+  pybind11::class_<PyScheduler>(m, "Scheduler")
+      .def(pybind11::init<Model&, PyGeneratorParams&>())
+      .def("add_request", &PyScheduler::AddRequest, pybind11::arg("prompt"), pybind11::arg("max_length") = 0, pybind11::arg("priority") = pybind11::none())
+      .def("step", &PyScheduler::Step, pybind11::call_guard<pybind11::gil_scoped_release>())
+      .def("is_idle", [](const PyScheduler& s) { return s.scheduler_->IsIdle(); })
+      .def("is_finished", [](const PyScheduler& s, int request_id) { return s.scheduler_->IsFinished(request_id); })
+      .def("take_result", &PyScheduler::TakeResult)
+      .def_property_readonly("queued_count", [](const PyScheduler& s) { return s.scheduler_->QueuedCount(); })
+      .def_property_readonly("active_count", [](const PyScheduler& s) { return s.scheduler_->ActiveCount(); })
+      .def_property_readonly("preempted_count", [](const PyScheduler& s) { return s.scheduler_->PreemptedCount(); })
+      .def_property(
+          "max_active_sequences", [](const PyScheduler& s) { return s.scheduler_->max_active_sequences_; },
+          [](PyScheduler& s, int value) { s.scheduler_->max_active_sequences_ = value; });
 
   pybind11::class_<Images>(m, "Images")
       .def_static("open", [](pybind11::args image_paths) {
-        if (image_paths.empty())
-          throw std::runtime_error("No images provided");
-
-        if (image_paths.size() > 1U)
-          throw std::runtime_error("Loading multiple images is not supported");
+        std::vector<std::string> paths;
+        for (auto& image_path : image_paths)
+          paths.push_back(image_path.cast<std::string>());
+        std::vector<const char*> path_pointers;
+        for (auto& path : paths)
+          path_pointers.push_back(path.c_str());
+        return LoadImagesImpl(path_pointers);
+      })
+      .def_static("open_bytes", [](pybind11::args image_datas) {  // Encoded images (bytes), like the contents of the files
+        std::vector<std::string> datas;
+        for (auto& image_data : image_datas)
+          datas.push_back(image_data.cast<std::string>());
+        std::vector<const void*> buffers;
+        std::vector<size_t> sizes;
+        for (auto& data : datas) {
+          buffers.push_back(data.data());
+          sizes.push_back(data.size());
+        }
+        return LoadImagesFromBuffersImpl(buffers, sizes);
+      });
 
-        auto image_path = image_paths[0].cast<std::string>();
-        return LoadImageImpl(image_path.c_str());
+  // Interop with torch, cupy and the like: torch.from_dlpack(tensor), or Tensor.from_dlpack(torch_tensor)
+  pybind11::class_<Tensor, std::shared_ptr<Tensor>>(m, "Tensor")
+      .def_static("from_dlpack", [](pybind11::object object) { return ToTensor(object); })  // See ToTensor
+      .def_property_readonly("shape", [](const Tensor& t) { return t.ort_tensor_->GetTensorTypeAndShapeInfo()->GetShape(); })
+      .def("as_numpy", [](pybind11::object self) {
+        auto& tensor = self.cast<Tensor&>();
+        WaitOnHost(tensor);
+        return ToNumpy(tensor.ort_tensor_.get(), self);
+      })
+      .def("__dlpack__", [](pybind11::object self, pybind11::object stream) {
+        auto& tensor = self.cast<Tensor&>();
+        WaitOnStream(tensor, stream);
+        return ToDLPack(*tensor.ort_tensor_, self);  // The capsule keeps self, and so the memory, alive
+      }, pybind11::arg("stream") = pybind11::none())
+      .def("__dlpack_device__", [](const Tensor& t) {
+        auto device = ToDLDevice(*t.ort_tensor_);
+        return pybind11::make_tuple(static_cast<int>(device.device_type), device.device_id);
+      })
+      .def_property_readonly("__cuda_array_interface__", [](Tensor& t) {
+        WaitOnHost(t);
+        return ToCudaArrayInterface(*t.ort_tensor_);
       });
 
-  pybind11::class_<PyNamedTensors>(m, "NamedTensors");
+  pybind11::class_<PyNamedTensors>(m, "NamedTensors")
+      .def("__getitem__", [](const PyNamedTensors& t, const std::string& name) {
+        auto it = t.named_tensors_->find(name);
+        if (it == t.named_tensors_->end())
+          throw pybind11::key_error(name);
+        return it->second;
+      })
+      .def("__setitem__", [](PyNamedTensors& t, const std::string& name, pybind11::object value) { (*t.named_tensors_)[name] = ToTensor(value); })
+      .def("__contains__", [](const PyNamedTensors& t, const std::string& name) { return t.named_tensors_->count(name) != 0; })
+      .def("keys", [](const PyNamedTensors& t) {
+        std::vector<std::string> names;
+        for (auto& entry : *t.named_tensors_)
+          names.push_back(entry.first);
+        return names;
+      });
 
   pybind11::class_<MultiModalProcessor, std::shared_ptr<MultiModalProcessor>>(m, "MultiModalProcessor")
       .def("__call__", [](MultiModalProcessor& processor, const std::string& prompt, const pybind11::kwargs& kwargs) -> std::unique_ptr<PyNamedTensors> {
@@ -456,6 +1146,15 @@ PYBIND11_MODULE(onnxruntime_genai, m) {
           throw std::runtime_error("Image processor is not available.");
         }
       })
+      .def("process_batch", [](MultiModalProcessor& processor, const std::vector<std::string>& prompts, const std::vector<const Images*>& images) {
+        // images[i] (None for no image) goes with prompts[i]
+        if (!processor.image_processor_)
+          throw std::runtime_error("Image processor is not available.");
+        std::vector<std::unique_ptr<PyNamedTensors>> result;
+        for (auto& named_tensors : processor.image_processor_->ProcessBatch(*processor.tokenizer_, prompts, images))
+          result.push_back(std::make_unique<PyNamedTensors>(std::move(named_tensors)));
+        return result;
+      })
       .def("create_stream", [](MultiModalProcessor& processor) { return processor.tokenizer_->CreateStream(); })
       .def("decode", [](MultiModalProcessor& processor, pybind11::array_t<int32_t> tokens) {
         return processor.tokenizer_->Decode(ToSpan(tokens));
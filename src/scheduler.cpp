@@ -0,0 +1,384 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include <algorithm>
+#include <limits>
+#include "generators.h"
+#include "search.h"
+#include "models/model.h"
+#include "scheduler.h"
+
+namespace Generators {
+
+Scheduler::Scheduler(const Model& model, const GeneratorParams& params)
+    : model_{model},
+      params_{params.shared_from_this()} {
+  if (params.search.num_beams != 1)
+    throw std::runtime_error("The scheduler only supports greedy search and sampling, num_beams must be 1");
+}
+
+Scheduler::~Scheduler() = default;
+
+int Scheduler::AddRequest(std::span<const int32_t> prompt, int max_length, std::optional<int> priority) {
+  if (prompt.empty())
+    throw std::runtime_error("Scheduler request prompt is empty");
+  if (max_length == 0)
+    max_length = params_->search.max_length;
+  if (max_length > model_.config_->model.context_length)
+    throw std::runtime_error("max_length (" + std::to_string(max_length) + ") cannot be greater than model context_length (" + std::to_string(model_.config_->model.context_length) + ")");
+  if (static_cast<int>(prompt.size()) >= max_length)
+    throw std::runtime_error("prompt length (" + std::to_string(prompt.size()) + ") is >= max_length (" + std::to_string(max_length) + ")");
+
+  int id = next_request_id_++;
+  auto& request = requests_[id];
+  request.tokens.assign(prompt.begin(), prompt.end());
+  request.max_length = max_length;
+  request.priority = priority.value_or(params_->priority);
+  Enqueue(id, false);
+  return id;
+}
+
+void Scheduler::Enqueue(int request_id, bool front_of_priority) {
+  int priority = requests_.at(request_id).priority;
+  auto it = std::find_if(queue_.begin(), queue_.end(), [&](int id) {
+    return front_of_priority ? requests_.at(id).priority <= priority : requests_.at(id).priority < priority;
+  });
+  queue_.insert(it, request_id);
+}
+
+Scheduler::Request* Scheduler::Unfinished(int request_id) {
+  auto it = requests_.find(request_id);
+  return it == requests_.end() || it->second.finished ? nullptr : &it->second;
+}
+
+const Scheduler::Request* Scheduler::Unfinished(int request_id) const {
+  return const_cast<Scheduler*>(this)->Unfinished(request_id);
+}
+
+size_t Scheduler::ActiveCount() const {
+  size_t count = 0;
+  for (auto& cohort : cohorts_)
+    count += cohort->unfinished_count;
+  return count;
+}
+
+void Scheduler::Admit() {
+  int batch_limit = max_batch_size_;
+  if (params_->use_cuda_graph)
+    batch_limit = std::min(batch_limit, params_->max_batch_size);  // Captured graphs are sized for max_batch_size
+
+  if (queue_.empty())
+    return;
+
+  // A queued request makes room for itself by preempting running ones of a lower priority, which always recomputes
+  // since a swapped out cohort would still count
+  int priority = requests_.at(queue_.front()).priority;
+  while (static_cast<int>(ActiveCount()) >= max_active_sequences_ && PreemptBelow(priority, Preemption::Recompute, false)) {
+  }
+
+  int available = max_active_sequences_ - static_cast<int>(ActiveCount());
+  int batch_size = std::min({batch_limit, available, static_cast<int>(queue_.size())});
+  if (batch_size <= 0)
+    return;
+
+  // The first batch_size queued requests as one batch
+  auto make_params = [&](int batch_size) {
+    std::vector<std::span<const int32_t>> prompts;
+    int max_length = 0;
+    for (int i = 0; i < batch_size; i++) {
+      auto& request = requests_.at(queue_[i]);
+      prompts.emplace_back(request.tokens);
+      max_length = std::max(max_length, request.max_length);
+    }
+
+    auto params = std::make_shared<GeneratorParams>(*params_);
+    params->input_ids_owner = PadInputs(prompts, params->pad_token_id);
+    params->input_ids = params->input_ids_owner;
+    params->batch_size = batch_size;
+    params->sequence_length = static_cast<int>(params->input_ids_owner.size()) / batch_size;
+    params->search.max_length = std::max(max_length, params->sequence_length + 1);  // Padding can make the batch longer than a single prompt
+    return params;
+  };
+
+  // A quick look at the memory budget and the kv block pool the prompt's blocks are taken from. Others can take the
+  // memory after it, so creating the generator is what decides: it reserves the memory or throws MemoryExhausted.
+  auto may_fit = [&](const GeneratorParams& params) {
+    auto* pool = model_.GetKVBlockPool();
+    if (pool && pool->FreeBlocks() >= 0 && params.batch_size * pool->BlocksFor(params.sequence_length) > pool->FreeBlocks())
+      return false;
+    return model_.GetMemoryBudget().Fits(model_.EstimateMemory(params));
+  };
+
+  // The cohort shrinks until it fits next to the running ones, then it preempts those of a lower priority or waits for
+  // them to finish. When nothing is running it's tried anyway, so a request that can never fit fails instead of
+  // waiting forever. The requests stay queued until their generator exists, a failed one finishes with the error.
+  auto params = make_params(batch_size);
+  std::unique_ptr<Generator> generator;
+  while (!generator) {
+    bool last_chance = batch_size == 1 && cohorts_.empty();
+    if (last_chance || may_fit(*params)) {
+      try {
+        generator = CreateGenerator(model_, *params);
+        break;
+      } catch (const MemoryExhausted& e) {
+        if (last_chance) {
+          FailQueued(1, e.what());
+          return;
+        }
+      } catch (const std::exception& e) {
+        FailQueued(batch_size, e.what());
+        return;
+      }
+    }
+
+    if (batch_size > 1) {
+      batch_size /= 2;
+      params = make_params(batch_size);
+    } else if (!PreemptBelow(priority, Preemption::Recompute, false) && !cohorts_.empty())
+      return;
+  }
+
+  auto cohort = std::make_unique<Cohort>();
+  for (int i = 0; i < batch_size; i++) {
+    cohort->request_ids.push_back(queue_.front());
+    queue_.pop_front();
+  }
+
+  cohort->params = params;
+  cohort->generator = std::move(generator);
+  cohort->unfinished_count = cohort->request_ids.size();
+  cohorts_.push_back(std::move(cohort));
+}
+
+void Scheduler::FailQueued(int count, const std::string& error) {
+  for (int i = 0; i < count; i++) {
+    auto& request = requests_.at(queue_.front());
+    request.finished = true;
+    request.error = error;
+    queue_.pop_front();
+  }
+}
+
+int Scheduler::Priority(const Cohort& cohort) const {
+  int priority = std::numeric_limits<int>::min();
+  for (auto id : cohort.request_ids) {
+    if (auto* request = Unfinished(id))
+      priority = std::max(priority, request->priority);
+  }
+  return priority;
+}
+
+bool Scheduler::PreemptBelow(int priority, Preemption preemption, bool only_running) {
+  auto lowest = cohorts_.end();
+  for (auto it = cohorts_.begin(); it != cohorts_.end(); ++it) {
+    auto& cohort = **it;
+    if (cohort.unfinished_count == 0 || (only_running && cohort.swapped_out) || Priority(cohort) >= priority)
+      continue;
+    if (lowest == cohorts_.end() || Priority(cohort) < Priority(**lowest))
+      lowest = it;
+  }
+  if (lowest == cohorts_.end())
+    return false;
+
+  Preempt(**lowest, preemption);
+  if (!(*lowest)->swapped_out)
+    cohorts_.erase(lowest);  // Frees its kv cache and its place in the memory budget
+  return true;
+}
+
+void Scheduler::Preempt(Cohort& cohort, Preemption preemption) {
+  preempted_count_++;
+
+  // Only the device kv is worth swapping, and a captured graph's kv is part of the graph
+  if (preemption == Preemption::Swap && !cohort.swapped_out && model_.device_type_ == DeviceType::CUDA && !cohort.params->use_cuda_graph) {
+    cohort.generator->SwapOut();
+    cohort.swapped_out = true;
+    return;
+  }
+
+  // Back to the queue ahead of the others of their priority, in their order
+  for (auto it = cohort.request_ids.rbegin(); it != cohort.request_ids.rend(); ++it) {
+    if (Unfinished(*it))
+      Enqueue(*it, true);
+  }
+  cohort.swapped_out = false;
+  cohort.unfinished_count = 0;
+}
+
+int Scheduler::BlocksNeeded(const Cohort& cohort) const {
+  auto& pool = *model_.GetKVBlockPool();
+  int length = cohort.generator->search_->GetSequenceLength();  // The kv length after the next step
+  int blocks = pool.BlocksFor(length) - (cohort.swapped_out ? 0 : pool.BlocksFor(length - 1));
+  return cohort.params->batch_size * blocks;
+}
+
+void Scheduler::MakeRoomForStep() {
+  auto* pool = model_.GetKVBlockPool();
+  if (!pool || pool->FreeBlocks() < 0)
+    return;  // Unbounded
+
+  auto running_needed = [&] {
+    int needed = 0;
+    for (auto& cohort : cohorts_) {
+      if (!cohort->swapped_out)
+        needed += BlocksNeeded(*cohort);
+    }
+    return needed;
+  };
+
+  // Swapped out cohorts come back while they fit, the most important first
+  std::vector<Cohort*> swapped;
+  for (auto& cohort : cohorts_) {
+    if (cohort->swapped_out)
+      swapped.push_back(cohort.get());
+  }
+  std::stable_sort(swapped.begin(), swapped.end(), [&](const Cohort* a, const Cohort* b) { return Priority(*a) > Priority(*b); });
+  for (auto* cohort : swapped) {
+    if (running_needed() + BlocksNeeded(*cohort) > pool->FreeBlocks())
+      break;
+    cohort->generator->SwapIn();
+    cohort->swapped_out = false;
+  }
+
+  // Then the least important running cohorts give way, the last one runs anyway and fails if it doesn't fit
+  auto running_count = [&] { return std::count_if(cohorts_.begin(), cohorts_.end(), [](const auto& cohort) { return !cohort->swapped_out; }); };
+  while (running_needed() > pool->FreeBlocks() && running_count() > 1 &&
+         PreemptBelow(std::numeric_limits<int>::max(), preemption_, true)) {
+  }
+}
+
+void Scheduler::Finish(Request& request, Cohort& cohort) {
+  if (request.finished)
+    return;
+  request.finished = true;
+  cohort.unfinished_count--;
+}
+
+void Scheduler::MergeCohorts() {
+  int batch_limit = max_batch_size_;
+  if (!can_merge_ || params_->use_cuda_graph || params_->grammar || params_->search.compact_finished_rows)
+    return;  // Merging starts a new state, which a captured graph or a compacted batch can't carry over
+
+  // The unfinished rows of the cohorts, oldest first, while they fit in a batch and the context. The merged sequences
+  // are left padded to the longest, which the rows still to generate come after.
+  std::vector<Cohort*> merged;
+  std::vector<std::vector<int32_t>> rows;
+  std::vector<int> request_ids;
+  int sequence_length = 0, max_length = 0;
+  for (auto& cohort : cohorts_) {
+    if (cohort->swapped_out || !cohort->prefilled || cohort->unfinished_count == 0)
+      continue;
+
+    std::vector<int32_t> cohort_rows;
+    std::vector<int> cohort_ids;
+    int length = std::max(sequence_length, cohort->generator->search_->GetSequenceLength());
+    int remaining = 0;
+    for (size_t row = 0; row < cohort->request_ids.size(); row++) {
+      if (auto* request = Unfinished(cohort->request_ids[row])) {
+        cohort_rows.push_back(static_cast<int32_t>(row));
+        cohort_ids.push_back(cohort->request_ids[row]);
+        remaining = std::max(remaining, request->max_length - static_cast<int>(request->tokens.size()));
+      }
+    }
+    int cohort_max_length = std::max(max_length - sequence_length, remaining) + length;
+    if (request_ids.size() + cohort_ids.size() > static_cast<size_t>(batch_limit) || cohort_max_length > model_.config_->model.context_length)
+      continue;
+
+    merged.push_back(cohort.get());
+    rows.push_back(std::move(cohort_rows));
+    request_ids.insert(request_ids.end(), cohort_ids.begin(), cohort_ids.end());
+    sequence_length = length;
+    max_length = cohort_max_length;
+  }
+  if (merged.size() < 2)
+    return;
+
+  auto params = std::make_shared<GeneratorParams>(*params_);
+  params->batch_size = static_cast<int>(request_ids.size());
+  params->sequence_length = sequence_length;
+  params->search.max_length = max_length;
+
+  std::vector<Generator*> generators;
+  for (auto* cohort : merged)
+    generators.push_back(cohort->generator.get());
+  std::unique_ptr<Generator> generator;
+  try {
+    generator = Generator::Merge(generators, rows, *params);
+  } catch (const MemoryExhausted&) {
+    return;  // The cohorts keep running apart until there's room
+  } catch (const std::exception&) {
+    can_merge_ = false;  // The model can't merge them, which it finds out before taking their kv
+    return;
+  }
+
+  // The merged cohort takes the place of the first one, the others go away with their emptied generators
+  auto& first = *merged.front();
+  first.params = params;
+  first.generator = std::move(generator);
+  first.request_ids = std::move(request_ids);
+  first.unfinished_count = first.request_ids.size();
+  for (size_t i = 1; i < merged.size(); i++)
+    merged[i]->unfinished_count = 0;
+  cohorts_.erase(std::remove_if(cohorts_.begin(), cohorts_.end(), [](const auto& cohort) { return cohort->unfinished_count == 0; }),
+                 cohorts_.end());
+}
+
+void Scheduler::Step() {
+  Admit();
+  MakeRoomForStep();
+  MergeCohorts();
+
+  for (auto& cohort : cohorts_) {
+    if (cohort->swapped_out || cohort->unfinished_count == 0)
+      continue;
+    auto& generator = *cohort->generator;
+    generator.ComputeLogits();
+    generator.GenerateNextToken();
+    cohort->prefilled = true;
+
+    auto next_tokens = generator.search_->GetNextTokens().GetCPU();
+    auto done_rows = generator.search_->GetDoneRows().GetCPU();  // Stop sequences and max_new_tokens
+    for (size_t row = 0; row < cohort->request_ids.size(); row++) {
+      auto* request = Unfinished(cohort->request_ids[row]);
+      if (!request)
+        continue;
+
+      request->tokens.push_back(next_tokens[row]);
+      if (next_tokens[row] == params_->eos_token_id || done_rows[row] || static_cast<int>(request->tokens.size()) >= request->max_length)
+        Finish(*request, *cohort);
+    }
+
+    // The search can be done before every row has hit its own limit (e.g. cohort max_length), so finish the stragglers
+    if (generator.IsDone()) {
+      for (auto id : cohort->request_ids) {
+        if (auto* request = Unfinished(id))
+          Finish(*request, *cohort);
+      }
+    }
+  }
+
+  // Release cohorts with no unfinished rows, which frees their state and kv cache
+  cohorts_.erase(std::remove_if(cohorts_.begin(), cohorts_.end(), [](const auto& cohort) { return cohort->unfinished_count == 0; }),
+                 cohorts_.end());
+}
+
+bool Scheduler::IsFinished(int request_id) const {
+  auto it = requests_.find(request_id);
+  if (it == requests_.end())
+    throw std::runtime_error("Unknown scheduler request id: " + std::to_string(request_id));
+  return it->second.finished;
+}
+
+std::vector<int32_t> Scheduler::TakeResult(int request_id) {
+  if (!IsFinished(request_id))
+    throw std::runtime_error("Scheduler request " + std::to_string(request_id) + " is not finished");
+
+  auto it = requests_.find(request_id);
+  auto request = std::move(it->second);
+  requests_.erase(it);
+  if (!request.error.empty())
+    throw std::runtime_error(request.error);
+  return std::move(request.tokens);
+}
+
+}  // namespace Generators
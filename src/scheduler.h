@@ -0,0 +1,109 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Generators {
+
+// Iteration level scheduler for serving many independent requests on one model. Requests added between steps are
+// packed into a single batch (a cohort) on the next Step(), every running cohort advances by one token per Step(),
+// and a request finishes as soon as its own row hits EOS, a stop sequence or its max_length instead of when its whole
+// batch is done.
+// Cohorts whose rows have all finished are released right away, along with their kv cache. Once their prompts have
+// run, the cohorts are merged into one (see Generator::Merge) as long as their unfinished rows fit in max_batch_size_,
+// so every step is a single run however many requests arrived apart. A merge starts a new search, sampled rows draw
+// from a new random sequence after it.
+//
+// Under memory pressure the cohorts of the lowest priority are preempted: when a queued request of a higher priority
+// doesn't fit in max_active_sequences_ or the model's memory budget, and when the kv block pool can't grow every
+// running cohort by the next token. See Preemption for what happens to them.
+struct Scheduler {
+  enum struct Preemption {
+    Recompute,  // The cohort is dropped and its unfinished requests requeued, their prompt followed by the tokens so far
+    Swap,       // The kv cache is swapped to host memory until the pool has room again (CUDA without graph capture,
+                // otherwise it's recomputed). Admitting a queued request always recomputes, a swapped cohort keeps its
+                // place in the memory budget.
+  };
+
+  // params is the template for every cohort (search options, device, cuda stream), its input_ids are ignored
+  Scheduler(const Model& model, const GeneratorParams& params);
+  ~Scheduler();
+
+  // Queues a prompt, returns the id used to retrieve the result. A max_length of 0 uses params.search.max_length, and
+  // priority defaults to params.priority. Requests are admitted by priority, then in the order they were added.
+  int AddRequest(std::span<const int32_t> prompt, int max_length = 0, std::optional<int> priority = {});
+
+  // Admits queued requests, as many as fit in the model's memory budget, then generates one token for every running request
+  void Step();
+
+  bool IsFinished(int request_id) const;
+  // Returns the prompt followed by the generated tokens and forgets the request. A request whose generator couldn't be
+  // created (e.g. it can never fit in the memory budget) is finished with that error, which this throws. The other
+  // rows of its cohort keep running.
+  std::vector<int32_t> TakeResult(int request_id);
+
+  bool IsIdle() const { return queue_.empty() && cohorts_.empty(); }
+  size_t QueuedCount() const { return queue_.size(); }
+  size_t ActiveCount() const;  // Number of requests currently being generated
+  size_t CohortCount() const { return cohorts_.size(); }  // Batches run per step, fewer once they're merged
+
+  int max_batch_size_{16};        // Largest number of requests packed into a single cohort
+  int max_active_sequences_{64};  // Queued requests wait while this many rows are running
+  Preemption preemption_{Preemption::Recompute};
+  size_t PreemptedCount() const { return preempted_count_; }  // Cohorts preempted so far
+
+ private:
+  struct Request {
+    std::vector<int32_t> tokens;  // Prompt, then generated tokens are appended
+    int max_length{};
+    int priority{};
+    bool finished{};
+    std::string error;  // Set when it finished without running
+  };
+
+  struct Cohort {
+    std::shared_ptr<GeneratorParams> params;
+    std::unique_ptr<Generator> generator;
+    std::vector<int> request_ids;  // One per batch row
+    size_t unfinished_count{};
+    bool swapped_out{};
+    bool prefilled{};  // Its prompt has run, so it can be merged
+  };
+
+  void Admit();
+  void MergeCohorts();  // The prefilled running cohorts into one, as many as fit in a batch
+  // The request of a cohort row, nullptr once it's finished or taken by TakeResult
+  Request* Unfinished(int request_id);
+  const Request* Unfinished(int request_id) const;
+  void Finish(Request& request, Cohort& cohort);
+  void FailQueued(int count, const std::string& error);  // Finishes the first count queued requests with error
+  void Enqueue(int request_id, bool front_of_priority);  // Behind the requests of the same or a higher priority, or in front of the same
+
+  int Priority(const Cohort& cohort) const;  // Of its most important unfinished request
+  // Preempts the cohort of the lowest priority below priority, returns false if there's none. With only_running,
+  // swapped out cohorts aren't considered.
+  bool PreemptBelow(int priority, Preemption preemption, bool only_running);
+  void Preempt(Cohort& cohort, Preemption preemption);
+  // Paged kv: the blocks the cohort needs for its next step, or to be swapped back in
+  int BlocksNeeded(const Cohort& cohort) const;
+  void MakeRoomForStep();  // Swaps in what fits, then preempts until the running cohorts' next step fits in the pool
+
+  const Model& model_;
+  std::shared_ptr<const GeneratorParams> params_;
+
+  int next_request_id_{};
+  std::deque<int> queue_;
+  std::unordered_map<int, Request> requests_;
+  std::vector<std::unique_ptr<Cohort>> cohorts_;
+  size_t preempted_count_{};
+  bool can_merge_{true};  // Cleared when the model can't merge generators
+};
+
+}  // namespace Generators
@@ -0,0 +1,87 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+// Prompt scoring: the batch is run through the decoder once with the logits of every position kept, and each position
+// is reduced to the log probability of the token that follows it. On CUDA the log softmax and the gather of the next
+// tokens are one kernel on the logits where the decoder left them, so only the scores are copied to the host.
+
+#include "generators.h"
+#include "models/model.h"
+#include "models/decoder_only.h"
+#include "thread_pool.h"
+#include "softmax.h"
+#if USE_CUDA
+#include "models/kernels.h"
+#endif
+
+namespace Generators {
+
+static float TokenLogProb(std::span<const float> logits, int32_t token) {
+  return logits[token] - log_sum_exp(logits);
+}
+
+std::vector<float> ScoreSequences(const Model& model, const GeneratorParams& params) {
+  auto* decoder_only = dynamic_cast<const DecoderOnly_Model*>(&model);
+  if (!decoder_only)
+    throw std::runtime_error("Scoring requires a decoder only model, not " + model.config_->model.type);
+  if (!OnHost(model.device_type_) && model.device_type_ != DeviceType::CUDA)
+    throw std::runtime_error("Scoring only supports CPU and CUDA");
+  if (model.session_info_->HasInput(model.config_->model.decoder.inputs.last_token_indices))
+    throw std::runtime_error("Scoring needs the logits of every position, the model only computes the last one");
+  if (params.search.num_beams != 1)
+    throw std::runtime_error("Scoring doesn't search, num_beams must be 1");
+  if (params.sequence_length < 2)
+    throw std::runtime_error("Scoring needs sequences of at least 2 tokens");
+  if (params.input_ids.size() != static_cast<size_t>(params.batch_size) * params.sequence_length)
+    throw std::runtime_error("input_ids size (" + std::to_string(params.input_ids.size()) + ") is not batch_size * sequence_length");
+
+  // A single run, so the kv only has to hold the prompt
+  auto state_params = std::make_shared<GeneratorParams>(params);
+  state_params->external_owner_.reset();
+  state_params->search.max_length = std::max(params.search.max_length, params.sequence_length);
+  state_params->search.past_present_share_buffer = false;
+  state_params->use_cuda_graph = false;
+  std::vector<int32_t> sequence_lengths(params.batch_size);  // Written by the position inputs, scoring goes by the ranges
+  DecoderOnly_State state{*decoder_only, cpu_span<int32_t>{sequence_lengths.data(), sequence_lengths.size()}, *state_params};
+  auto logits = state.RunAllPositions(false);
+
+  const size_t batch_size = params.batch_size;
+  const size_t vocab_size = params.vocab_size;
+  const size_t sequence_length = params.sequence_length;
+  const size_t count = batch_size * (sequence_length - 1);
+  std::vector<float> scores(count);
+  // Padding is told apart by position, not by token, so a pad_token_id inside a row is scored
+  const auto ranges = params.TokenRanges();
+#if USE_CUDA
+  if (model.device_type_ == DeviceType::CUDA) {
+    auto logits_gpu = logits.GetGPU();
+    if (logits_gpu.size() != batch_size * sequence_length * vocab_size)
+      throw std::runtime_error("Scoring needs the logits of every position, the model didn't return them");
+
+    auto input_ids = CudaMallocArray<int32_t>(params.input_ids.size());
+    auto ranges_gpu = CudaMallocArray<int32_t>(ranges.size());
+    auto scores_gpu = CudaMallocArray<float>(count);
+    CudaCheck() == cudaMemcpyAsync(input_ids.get(), params.input_ids.data(), params.input_ids.size_bytes(), cudaMemcpyHostToDevice, model.cuda_stream_);
+    CudaCheck() == cudaMemcpyAsync(ranges_gpu.get(), ranges.data(), ranges.size() * sizeof(int32_t), cudaMemcpyHostToDevice, model.cuda_stream_);
+    cuda::LaunchTokenLogProbs(scores_gpu.get(), logits_gpu.data(), input_ids.get(), ranges_gpu.get(), params.batch_size, params.sequence_length,
+                              params.vocab_size, model.cuda_stream_);
+    CudaCheck() == cudaMemcpyAsync(scores.data(), scores_gpu.get(), count * sizeof(float), cudaMemcpyDeviceToHost, model.cuda_stream_);
+    CudaCheck() == cudaStreamSynchronize(model.cuda_stream_);
+    return scores;
+  }
+#endif
+
+  auto logits_cpu = logits.GetCPU();
+  if (logits_cpu.size() != batch_size * sequence_length * vocab_size)
+    throw std::runtime_error("Scoring needs the logits of every position, the model didn't return them");
+  GetSearchThreadPool().ParallelFor(count, [&](size_t index) {
+    const size_t row = index / (sequence_length - 1), position = index % (sequence_length - 1);
+    const int32_t* ids = params.input_ids.data() + row * sequence_length;
+    if (static_cast<int32_t>(position) < ranges[row * 2] || static_cast<int32_t>(position) + 1 >= ranges[row * 2 + 1])
+      return;  // Padding, stays 0
+    scores[index] = TokenLogProb(logits_cpu.subspan((row * sequence_length + position) * vocab_size, vocab_size), ids[position + 1]);
+  });
+  return scores;
+}
+
+}  // namespace Generators
@@ -2,8 +2,10 @@
 #include "softmax.h"
 #include "search.h"
 #include "beam_search_scorer.h"
+#include "thread_pool.h"
 #include <queue>
 #include <algorithm>
+#include <sstream>
 
 namespace Generators {
 
@@ -12,31 +14,55 @@ Search_Cpu::Search_Cpu(const GeneratorParams& params)
       sequences_{params.input_ids, params.batch_size, params.search.num_beams, params_->search.max_length} {
   auto batch_beam_size = params.BatchBeamSize();
   sequence_lengths_buffer_ = AllocateArray<int32_t>(batch_beam_size, &sequence_lengths_);
+  if (params.grammar)
+    grammar_ = std::make_unique<GrammarMatcher>(params.grammar, batch_beam_size, sequences_.GetSequenceLength());
 }
 
-GreedySearch_Cpu::GreedySearch_Cpu(const GeneratorParams& params)
-    : Search_Cpu(params) {
-  if (params_->search.random_seed != -1)
-    gen_.seed(params_->search.random_seed);
+std::vector<RandomRow> MakeRandomRows(const GeneratorParams& params) {
+  uint64_t seed;
+  if (params.search.random_seed != -1)
+    seed = static_cast<uint64_t>(params.search.random_seed);
   else {
     std::random_device rd;
-    std::array<uint32_t, decltype(gen_)::state_size> data;
-    std::generate(std::begin(data), std::end(data), std::ref(rd));
-    std::seed_seq seq(data.begin(), data.end());
-    gen_.seed(seq);
+    seed = (static_cast<uint64_t>(rd()) << 32) | rd();
   }
 
+  std::vector<RandomRow> rows(params.batch_size);
+  for (int i = 0; i < params.batch_size; i++) {
+    auto row_seed = params.row_search.empty() ? -1 : params.RowSearch(i).random_seed;
+    if (row_seed != -1)
+      rows[i] = {static_cast<uint64_t>(row_seed), 0};
+    else
+      rows[i] = {seed, static_cast<uint64_t>(i)};
+  }
+  return rows;
+}
+
+GreedySearch_Cpu::GreedySearch_Cpu(const GeneratorParams& params)
+    : Search_Cpu(params),
+      random_rows_{MakeRandomRows(params)} {
   next_tokens_buffer_ = AllocateArray<int32_t>(params.batch_size, &next_tokens_);
   memset(next_tokens_.data(), 0, next_tokens_.size_bytes());
 
   eos_seen_buffer_ = AllocateArray<bool>(params.batch_size, &eos_seen_);
   memset(eos_seen_.data(), 0, eos_seen_.size_bytes());
+
+  draws_buffer_ = AllocateArray<float>(params.batch_size, &draws_);
+  StartTurn();
 }
 
 BeamSearch_Cpu::BeamSearch_Cpu(const GeneratorParams& params)
     : Search_Cpu(params) {
   assert(params_->search.num_beams > 1);  // If 1, use GreedySearch
   beam_scorer_ = std::make_unique<BeamSearchScorer>(*params_);
+
+  const size_t top_k_size = 2 * static_cast<size_t>(params_->search.num_beams) * params_->batch_size;
+  topk_scores_ = std::make_unique<float[]>(top_k_size);
+  topk_indices_ = std::make_unique<int32_t[]>(top_k_size);
+  topk_tokens_ = std::make_unique<int32_t[]>(top_k_size);
+  topk_heap_ = std::make_unique<ScoreIndex[]>(top_k_size);
+  if (params_->search.diversity_penalty != 0.0f)
+    diversity_tokens_ = std::make_unique<int32_t[]>(static_cast<size_t>(params_->BatchBeamSize()));
 }
 
 BeamSearch_Cpu::~BeamSearch_Cpu() = default;
@@ -63,55 +89,63 @@ int Search_Cpu::GetSequenceLength() const {
 
 void BeamSearch_Cpu::SelectTop() {
   auto beam_scores = beam_scorer_->GetNextScores();
-  // Add beam score to next token scores. Corresponding python code is like:
-  //    next_token_scores = next_token_scores + beam_scores[:, None].expand_as(next_token_scores)
-  // TODO(tianleiwu): use thread pool to parallel
-  int offset = 0;
-  int batch_beam_index = 0;
-  for (int i = 0; i < params_->batch_size; i++) {
-    for (int j = 0; j < params_->search.num_beams; j++, batch_beam_index++) {
-      for (int k = 0; k < params_->vocab_size; k++, offset++) {
-        next_token_scores_[offset] += beam_scores[batch_beam_index];
-      }
-    }
-  }
 
   // TODO: Write output scores?
   const size_t top_k = 2 * params_->search.num_beams;
+  const size_t beam_vocab_size = static_cast<size_t>(params_->search.num_beams) * params_->vocab_size;
+
+  auto next_scores = std::span<float>(topk_scores_.get(), top_k * params_->batch_size);
+  auto next_indices = std::span<int32_t>(topk_indices_.get(), top_k * params_->batch_size);
+  auto next_tokens = std::span<int32_t>(topk_tokens_.get(), top_k * params_->batch_size);
+
+  GetSearchThreadPool().ParallelFor(params_->batch_size, [&](size_t batch_index) {
+    // The scorer pads a finished batch entry without looking at its candidates
+    if (beam_scorer_->IsDone(static_cast<int>(batch_index)))
+      return;
+
+    // A min heap of the best top_k so far, most scores lose to its smallest one and are dropped after one compare
+    auto heap = std::span<ScoreIndex>(topk_heap_.get() + batch_index * top_k, top_k);
+    auto greater = [](const ScoreIndex& a, const ScoreIndex& b) { return a.score > b.score; };
+    size_t count = 0;
+
+    auto token_scores_sub = next_token_scores_.subspan(batch_index * beam_vocab_size, beam_vocab_size);
+    for (int beam = 0; beam < params_->search.num_beams; beam++) {
+      // Diverse beam search with a group per beam: the best token of every beam is penalized in the beams after it
+      if (diversity_tokens_) {
+        auto chosen = diversity_tokens_.get() + batch_index * params_->search.num_beams;
+        auto beam_token_scores = token_scores_sub.subspan(static_cast<size_t>(beam) * params_->vocab_size, params_->vocab_size);
+        for (int i = 0; i < beam; i++)
+          beam_token_scores[chosen[i]] -= params_->search.diversity_penalty;
+        chosen[beam] = static_cast<int32_t>(std::max_element(beam_token_scores.begin(), beam_token_scores.end()) - beam_token_scores.begin());
+      }
 
-  struct ScoreIndex {
-    float score;
-    int32_t index;
-
-    bool operator<(const ScoreIndex& s) const { return score < s.score; }
-  };
-
-  auto scores = std::make_unique<float[]>(top_k * params_->batch_size);
-  auto indices = std::make_unique<int32_t[]>(top_k * params_->batch_size);
-  auto tokens = std::make_unique<int32_t[]>(top_k * params_->batch_size);
-
-  auto next_scores = std::span<float>(scores.get(), top_k * params_->batch_size);
-  auto next_indices = std::span<int32_t>(indices.get(), top_k * params_->batch_size);
-  auto next_tokens = std::span<int32_t>(tokens.get(), top_k * params_->batch_size);
-
-  for (size_t batch_index = 0; batch_index < static_cast<size_t>(params_->batch_size); batch_index++) {
-    std::priority_queue<ScoreIndex, std::vector<ScoreIndex>> queue;
-    auto token_scores_sub = next_token_scores_.subspan(batch_index * params_->search.num_beams * params_->vocab_size, static_cast<size_t>(params_->search.num_beams) * params_->vocab_size);
-    for (int i = 0; i < token_scores_sub.size(); i++) {
-      queue.push({token_scores_sub[i], i});
+      // Add beam score to next token scores in the same pass. Corresponding python code is like:
+      //    next_token_scores = next_token_scores + beam_scores[:, None].expand_as(next_token_scores)
+      float const beam_score = beam_scores[batch_index * params_->search.num_beams + beam];
+      int32_t const beam_offset = beam * params_->vocab_size;
+      for (int32_t token = 0; token < params_->vocab_size; token++) {
+        float const score = token_scores_sub[beam_offset + token] += beam_score;
+        if (count < top_k) {
+          heap[count++] = {score, beam_offset + token};
+          std::push_heap(heap.begin(), heap.begin() + count, greater);
+        } else if (score > heap[0].score) {
+          std::pop_heap(heap.begin(), heap.end(), greater);
+          heap[top_k - 1] = {score, beam_offset + token};
+          std::push_heap(heap.begin(), heap.end(), greater);
+        }
+      }
     }
+    std::sort_heap(heap.begin(), heap.end(), greater);  // Best first
 
     auto next_indices_sub = next_indices.subspan(top_k * batch_index, top_k);
     auto next_tokens_sub = next_tokens.subspan(top_k * batch_index, top_k);
     auto next_scores_sub = next_scores.subspan(top_k * batch_index, top_k);
-    for (unsigned i = 0; i < top_k; i++) {
-      auto v = queue.top();
-      next_indices_sub[i] = v.index / params_->vocab_size;
-      next_tokens_sub[i] = v.index % params_->vocab_size;
-      next_scores_sub[i] = v.score;
-      queue.pop();
+    for (size_t i = 0; i < top_k; i++) {
+      next_indices_sub[i] = heap[i].index / params_->vocab_size;
+      next_tokens_sub[i] = heap[i].index % params_->vocab_size;
+      next_scores_sub[i] = heap[i].score;
     }
-  }
+  });
 
 #if 0
   DumpMemory("Next Scores", next_scores);
@@ -127,101 +161,233 @@ void BeamSearch_Cpu::SelectTop() {
 
 void GreedySearch_Cpu::SelectTop() {
   // next_tokens = torch.argmax(scores, dim=-1)
+  GetSearchThreadPool().ParallelFor(params_->batch_size, [&](size_t batch_id) {
+    if (eos_seen_[batch_id])
+      return;
+    next_tokens_[batch_id] = top_tokens_.empty() ? ArgMaxToken(batch_id) : top_tokens_[batch_id];
+  });
+  top_tokens_ = {};
+
   for (size_t batch_id = 0; batch_id < params_->batch_size; batch_id++) {
     if (PadIfAlreadyEOS(batch_id)) {
       continue;
     }
-
-    std::span<float> const scores = next_token_scores_.subspan(batch_id * params_->vocab_size, params_->vocab_size);
-    auto const token = static_cast<int32_t>(std::distance(scores.begin(), std::max_element(scores.begin(), scores.end())));
-    SetNextToken(batch_id, token);
+    SetNextToken(batch_id, next_tokens_[batch_id]);
   }
 
   AppendNextTokensToSequences();
 }
 
-void SoftMax(std::span<float> scores, float temperature) {
-  float const max_score = *std::max_element(scores.begin(), scores.end());
-
-  // Subtract max score and scale by temperature
-  std::transform(scores.begin(), scores.end(), scores.begin(), [max_score, temperature](float score) { return std::exp((score - max_score) / temperature); });
+void GreedySearch_Cpu::ReserveTopK(int k) {
+  if (k <= temp_topk_capacity_)
+    return;
+  temp_topk_buffer_ = std::make_unique<int32_t[]>(static_cast<size_t>(k) * params_->batch_size);
+  temp_topk_scores_buffer_ = std::make_unique<float[]>(static_cast<size_t>(k) * params_->batch_size);
+  temp_topk_capacity_ = k;
+}
 
-  // Compute sum of exponentials
-  float const exp_sum = std::accumulate(scores.begin(), scores.end(), 0.0f);
+void GreedySearch_Cpu::ReserveTopP() {
+  if (!temp_topp_buffer_)
+    temp_topp_buffer_ = std::make_unique<int32_t[]>(static_cast<size_t>(params_->vocab_size) * params_->batch_size);
+}
 
-  // Divide each score by the sum of exponentials
-  std::transform(scores.begin(), scores.end(), scores.begin(), [exp_sum](float score) { return score / exp_sum; });
+// The step is the sequence length, so the draws don't depend on how many came before: a forked, restored or
+// rescheduled row draws what it would have
+float GreedySearch_Cpu::Draw(size_t batch_id, float max) const {
+  return max * PhiloxUniform(random_rows_[batch_id], static_cast<uint64_t>(sequences_.GetSequenceLength()));
 }
 
-void GreedySearch_Cpu::SampleTopK(int k, float temperature) {
+void GreedySearch_Cpu::DrawSamples(float max, bool skip_eos_rows) {
   for (size_t batch_id = 0; batch_id < params_->batch_size; batch_id++) {
-    std::span<float> const scores = next_token_scores_.subspan(batch_id * params_->vocab_size, params_->vocab_size);
-    SoftMax(scores, temperature);
-    // Find the top K scores
-    std::vector<int> indices(scores.size());
-    std::iota(indices.begin(), indices.end(), 0);
-    std::partial_sort(indices.begin(), indices.begin() + k, indices.end(), [scores = scores.data()](int i, int j) { return scores[i] > scores[j]; });
-    // Sample a token from the top K
-    std::discrete_distribution<> dis(scores.begin(), scores.begin() + k);
-    SetNextToken(batch_id, indices[dis(gen_)]);
+    if (!skip_eos_rows || !eos_seen_[batch_id])
+      draws_[batch_id] = Draw(batch_id, max);
   }
+}
+
+GreedySearch_Cpu::Sampler GreedySearch_Cpu::GetSampler(const Config::Search& search) {
+  if (!search.do_sample || search.top_k == 1)
+    return Sampler::ArgMax;
+  if (search.top_p > 0.0f && search.top_p < 1.0f && search.top_k > 1)
+    return Sampler::TopKTopP;
+  if (search.top_k > 1)
+    return Sampler::TopK;
+  return Sampler::TopP;
+}
+
+int32_t GreedySearch_Cpu::ArgMaxToken(size_t batch_id) const {
+  std::span<float> const scores = next_token_scores_.subspan(batch_id * params_->vocab_size, params_->vocab_size);
+  auto token = static_cast<int32_t>(argmax(scores));
+  // The token folding the eos tokens into eos_token_id leads to, for the steps that leave them in the logits (see
+  // State::greedy_step_folds_eos_)
+  auto& eos_token_ids = params_->eos_token_ids;
+  if (std::find(eos_token_ids.begin(), eos_token_ids.end(), token) != eos_token_ids.end())
+    token = params_->eos_token_id;
+  return token;
+}
+
+int32_t GreedySearch_Cpu::TopKToken(size_t batch_id, int k, float temperature) {
+  std::span<float> const scores = next_token_scores_.subspan(batch_id * params_->vocab_size, params_->vocab_size);
+  std::span<int32_t> const indices{temp_topk_buffer_.get() + batch_id * temp_topk_capacity_, static_cast<size_t>(k)};
+  std::span<float> const top_scores{temp_topk_scores_buffer_.get() + batch_id * temp_topk_capacity_, static_cast<size_t>(k)};
+  top_k_threshold(indices, top_scores, scores);
+
+  // Softmax over the K survivors only, the largest comes first. Sampling works on the unnormalized weights.
+  float const max_score = top_scores[0];
+  float sum = 0.0f;
+  for (auto& score : top_scores) {
+    score = std::exp((score - max_score) / temperature);
+    sum += score;
+  }
+  float target = draws_[batch_id] * sum;
+  for (int i = 0; i < k; i++) {
+    target -= top_scores[i];
+    if (target <= 0)
+      return indices[i];
+  }
+  return indices[k - 1];
+}
+
+int32_t GreedySearch_Cpu::TopPToken(size_t batch_id, float temperature) {
+  std::span<float> const scores = next_token_scores_.subspan(batch_id * params_->vocab_size, params_->vocab_size);
+  softmax(scores, temperature);
+  std::span<int32_t> const indices{temp_topp_buffer_.get() + batch_id * params_->vocab_size, scores.size()};
+  return FindTopPToken(scores, draws_[batch_id], indices);
+}
+
+int32_t GreedySearch_Cpu::TopKTopPToken(size_t batch_id, int k, float temperature) {
+  std::span<float> const scores = next_token_scores_.subspan(batch_id * params_->vocab_size, params_->vocab_size);
+  std::span<int32_t> const indices{temp_topk_buffer_.get() + batch_id * temp_topk_capacity_, static_cast<size_t>(k)};
+  std::span<float> const top_scores{temp_topk_scores_buffer_.get() + batch_id * temp_topk_capacity_, static_cast<size_t>(k)};
+  softmax(scores, temperature);
+  // Find the top K scores
+  top_k_threshold(indices, top_scores, scores);
+  float threshold = draws_[batch_id];
+  // Find the first token where the cumulative probability exceeds the threshold
+  for (int i = 0; i < k; i++) {
+    threshold -= top_scores[i];
+    if (threshold <= 0)
+      return indices[i];
+  }
+  return indices[k - 1];
+}
+
+void GreedySearch_Cpu::SampleTopK(int k, float temperature) {
+  k = std::min(k, params_->vocab_size);
+  ReserveTopK(k);
+  DrawSamples(1.0f, false);
+
+  GetSearchThreadPool().ParallelFor(params_->batch_size, [&](size_t batch_id) {
+    next_tokens_[batch_id] = TopKToken(batch_id, k, temperature);
+  });
+
+  for (size_t batch_id = 0; batch_id < params_->batch_size; batch_id++)
+    SetNextToken(batch_id, next_tokens_[batch_id]);
   AppendNextTokensToSequences();
 }
 
 void GreedySearch_Cpu::SampleTopP(float p, float temperature) {
-  std::uniform_real_distribution<float> dis(0, p);
+  ReserveTopP();
+  DrawSamples(p, true);
+
+  GetSearchThreadPool().ParallelFor(params_->batch_size, [&](size_t batch_id) {
+    if (eos_seen_[batch_id])
+      return;
+    next_tokens_[batch_id] = TopPToken(batch_id, temperature);
+  });
+
   for (size_t batch_id = 0; batch_id < params_->batch_size; batch_id++) {
     if (PadIfAlreadyEOS(batch_id)) {
       continue;
     }
-    std::span<float> const scores = next_token_scores_.subspan(batch_id * params_->vocab_size, params_->vocab_size);
-    SoftMax(scores, temperature);
-    // Sort an array of indices into the scores
-    std::vector<int32_t> indices(scores.size());
-    std::iota(indices.begin(), indices.end(), 0);
-    std::sort(indices.begin(), indices.end(), [scores = scores.data()](int32_t i, int32_t j) { return scores[i] > scores[j]; });
-    // Sample a probability threshold
-    float threshold = dis(gen_);
-    int32_t token = 0;
+    SetNextToken(batch_id, next_tokens_[batch_id]);
+  }
+  AppendNextTokensToSequences();
+}
+
+int32_t GreedySearch_Cpu::FindTopPToken(std::span<const float> probabilities, float threshold, std::span<int32_t> indices) {
+  std::iota(indices.begin(), indices.end(), 0);
+  auto descending = [probabilities = probabilities.data()](int32_t i, int32_t j) { return probabilities[i] > probabilities[j]; };
+
+  // The threshold is at most p, so it's usually reached within the first few of the most likely tokens. Instead of
+  // sorting the vocab, select the next most likely block of tokens, sort only that and walk it, doubling the block
+  // size until the threshold is reached.
+  size_t begin = 0;
+  for (size_t block_size = 64; begin < indices.size(); block_size *= 2) {
+    auto end = std::min(begin + block_size, indices.size());
+    std::nth_element(indices.begin() + begin, indices.begin() + end - 1, indices.end(), descending);
+    std::sort(indices.begin() + begin, indices.begin() + end, descending);
     // Find the first token where the cumulative probability exceeds the threshold
-    for (int i = 0; i < scores.size(); i++) {
-      threshold -= scores[indices[i]];
-      if (threshold > 0) {
-        continue;
-      }
-      token = indices[i];
-      break;
+    for (; begin < end; begin++) {
+      threshold -= probabilities[indices[begin]];
+      if (threshold <= 0)
+        return indices[begin];
     }
-    SetNextToken(batch_id, token);
   }
-  AppendNextTokensToSequences();
+  return 0;  // Rounding kept the threshold above the total probability
 }
 
 void GreedySearch_Cpu::SampleTopKTopP(int k, float p, float temperature) {
-  std::uniform_real_distribution<float> dis(0, p);
+  k = std::min(k, params_->vocab_size);
+  ReserveTopK(k);
+  DrawSamples(p, true);
+
+  GetSearchThreadPool().ParallelFor(params_->batch_size, [&](size_t batch_id) {
+    if (eos_seen_[batch_id])
+      return;
+    next_tokens_[batch_id] = TopKTopPToken(batch_id, k, temperature);
+  });
+
   for (size_t batch_id = 0; batch_id < params_->batch_size; batch_id++) {
     if (PadIfAlreadyEOS(batch_id)) {
       continue;
     }
-    std::span<float> const scores = next_token_scores_.subspan(batch_id * params_->vocab_size, params_->vocab_size);
-    SoftMax(scores, temperature);
-    // Find the top K scores
-    std::vector<int> indices(scores.size());
-    std::iota(indices.begin(), indices.end(), 0);
-    std::partial_sort(indices.begin(), indices.begin() + k, indices.end(), [scores = scores.data()](int i, int j) { return scores[i] > scores[j]; });
-    // Sample a probability threshold
-    float threshold = dis(gen_);
-    int32_t token = indices[k - 1];
-    // Find the first token where the cumulative probability exceeds the threshold
-    for (int i = 0; i < k; i++) {
-      threshold -= scores[indices[i]];
-      if (threshold > 0) {
-        continue;
-      }
-      token = indices[i];
-      break;
+    SetNextToken(batch_id, next_tokens_[batch_id]);
+  }
+  AppendNextTokensToSequences();
+}
+
+// Like GenerateNextToken picks a sampler for the whole batch, but per row
+void GreedySearch_Cpu::SampleRows() {
+  int max_k = 0;
+  for (size_t batch_id = 0; batch_id < params_->batch_size; batch_id++) {
+    auto& search = params_->RowSearch(static_cast<int>(batch_id));
+    auto sampler = GetSampler(search);
+    if (sampler == Sampler::TopK || sampler == Sampler::TopKTopP)
+      max_k = std::max(max_k, std::min(search.top_k, params_->vocab_size));
+    else if (sampler == Sampler::TopP)
+      ReserveTopP();
+
+    if (!eos_seen_[batch_id] && sampler != Sampler::ArgMax)
+      draws_[batch_id] = Draw(batch_id, sampler == Sampler::TopK ? 1.0f : search.top_p);
+  }
+  ReserveTopK(max_k);
+
+  GetSearchThreadPool().ParallelFor(params_->batch_size, [&](size_t batch_id) {
+    if (eos_seen_[batch_id])
+      return;
+    auto& search = params_->RowSearch(static_cast<int>(batch_id));
+    const int k = std::min(search.top_k, params_->vocab_size);
+    switch (GetSampler(search)) {
+      case Sampler::ArgMax:
+        next_tokens_[batch_id] = ArgMaxToken(batch_id);
+        break;
+      case Sampler::TopK:
+        next_tokens_[batch_id] = TopKToken(batch_id, k, search.temperature);
+        break;
+      case Sampler::TopP:
+        next_tokens_[batch_id] = TopPToken(batch_id, search.temperature);
+        break;
+      case Sampler::TopKTopP:
+        next_tokens_[batch_id] = TopKTopPToken(batch_id, k, search.temperature);
+        break;
+    }
+  });
+
+  for (size_t batch_id = 0; batch_id < params_->batch_size; batch_id++) {
+    if (PadIfAlreadyEOS(batch_id)) {
+      continue;
     }
-    SetNextToken(batch_id, token);
+    SetNextToken(batch_id, next_tokens_[batch_id]);
   }
   AppendNextTokensToSequences();
 }
@@ -239,17 +405,55 @@ bool GreedySearch_Cpu::PadIfAlreadyEOS(size_t batch_id) {
 void GreedySearch_Cpu::SetNextToken(size_t batch_id, int32_t token) {
   next_tokens_[batch_id] = token;
   if (token == params_->eos_token_id) {
-    eos_seen_[batch_id] = true;
     if (g_log.enabled && g_log.hit_eos)
       Log("hit_eos", "EOS seen on batch " + std::to_string(batch_id));
-    if (--not_done_count_ == 0) {
-      done_ = true;
+    FinishRow(batch_id);
+  }
+}
+
+void GreedySearch_Cpu::FinishRow(size_t batch_id) {
+  eos_seen_[batch_id] = true;
+  if (--not_done_count_ == 0) {
+    done_ = true;
+  }
+}
+
+void GreedySearch_Cpu::StartTurn() {
+  start_length_ = sequences_.GetSequenceLength();
+  row_length_limits_.resize(params_->batch_size);
+  bool any_limit = false;
+  for (int i = 0; i < params_->batch_size; i++) {
+    row_length_limits_[i] = params_->RowLengthLimit(i, start_length_);
+    any_limit |= row_length_limits_[i] < params_->search.max_length;
+  }
+  if (!any_limit)
+    row_length_limits_.clear();
+}
+
+// Only the tokens generated this turn are matched, a stop sequence can't end in the prompt
+void GreedySearch_Cpu::CheckStopConditions() {
+  if (params_->stop_sequences.empty() && row_length_limits_.empty())
+    return;
+
+  const int length = sequences_.GetSequenceLength();
+  for (size_t batch_id = 0; batch_id < params_->batch_size; batch_id++) {
+    if (eos_seen_[batch_id])
+      continue;
+
+    bool stop = !row_length_limits_.empty() && length >= row_length_limits_[batch_id];
+    auto generated = sequences_.GetSequence(static_cast<int>(batch_id)).subspan(start_length_, length - start_length_);
+    for (size_t i = 0; i < params_->stop_sequences.size() && !stop; i++) {
+      auto& stop_sequence = params_->stop_sequences[i];
+      stop = stop_sequence.size() <= generated.size() && std::equal(stop_sequence.begin(), stop_sequence.end(), generated.end() - stop_sequence.size());
     }
+    if (stop)
+      FinishRow(batch_id);
   }
 }
 
 void GreedySearch_Cpu::AppendNextTokensToSequences() {
   sequences_.AppendNextTokenToSequences(next_tokens_);
+  CheckStopConditions();
 
   if (sequences_.GetSequenceLength() == params_->search.max_length) {
     if (g_log.enabled && g_log.hit_max_length)
@@ -258,6 +462,68 @@ void GreedySearch_Cpu::AppendNextTokensToSequences() {
   }
 }
 
+void GreedySearch_Cpu::AppendTokens(std::span<const int32_t> tokens) {
+  sequences_.AppendTokens(tokens);
+  memset(eos_seen_.data(), 0, eos_seen_.size_bytes());
+  not_done_count_ = params_->batch_size;
+  done_ = false;
+  StartTurn();
+  if (grammar_)
+    grammar_->Reset(sequences_.GetSequenceLength());
+}
+
+// The draws only depend on the seeds of params and the sequence length, so there's no random state to save. The
+// engine size field stays for the layout, older snapshots saved a random engine there.
+void GreedySearch_Cpu::Save(std::ostream& file) const {
+  uint64_t engine_size = 0;
+  file.write(reinterpret_cast<const char*>(&engine_size), sizeof(engine_size));
+  file.write(reinterpret_cast<const char*>(eos_seen_.data()), eos_seen_.size_bytes());
+}
+
+void GreedySearch_Cpu::Load(std::istream& file) {
+  uint64_t engine_size{};
+  file.read(reinterpret_cast<char*>(&engine_size), sizeof(engine_size));
+  file.seekg(engine_size, std::ios::cur);
+  file.read(reinterpret_cast<char*>(eos_seen_.data()), eos_seen_.size_bytes());
+  if (!file)
+    throw std::runtime_error("The generator snapshot is corrupt");
+
+  not_done_count_ = static_cast<int>(std::count(eos_seen_.begin(), eos_seen_.end(), false));
+  done_ = not_done_count_ == 0;
+}
+
+// Into a buffer of our own, as the top p samplers softmax the scores in place
+void GreedySearch_Cpu::LogSoftMax() {
+  const size_t vocab_size = params_->vocab_size;
+  log_probs_.resize(params_->batch_size * vocab_size);
+  GetSearchThreadPool().ParallelFor(params_->batch_size, [&](size_t batch_id) {
+    auto& search = params_->RowSearch(static_cast<int>(batch_id));
+    const float temperature = GetSampler(search) == Sampler::ArgMax ? 1.0f : search.temperature;
+    auto scores = next_token_scores_.subspan(batch_id * vocab_size, vocab_size);
+    std::span<float> log_probs{log_probs_.data() + batch_id * vocab_size, vocab_size};
+    log_softmax(scores, log_probs, temperature);
+  });
+}
+
+void GreedySearch_Cpu::GatherLogProbs() {
+  const size_t vocab_size = params_->vocab_size;
+  const size_t top_count = std::min<size_t>(params_->search.top_logprobs, vocab_size);
+  logprobs_.resize(params_->batch_size);
+  top_logprobs_.resize(params_->batch_size * top_count);
+  top_logprob_tokens_.resize(params_->batch_size * top_count);
+  GetSearchThreadPool().ParallelFor(params_->batch_size, [&](size_t batch_id) {
+    std::span<const float> log_probs{log_probs_.data() + batch_id * vocab_size, vocab_size};
+    logprobs_[batch_id] = log_probs[next_tokens_[batch_id]];
+    top_k_threshold({top_logprob_tokens_.data() + batch_id * top_count, top_count}, {top_logprobs_.data() + batch_id * top_count, top_count}, log_probs);
+  });
+}
+
+TokenLogProbs GreedySearch_Cpu::GetLogProbs() {
+  return {cpu_span<const float>{logprobs_.data(), logprobs_.size()},
+          cpu_span<const int32_t>{top_logprob_tokens_.data(), top_logprob_tokens_.size()},
+          cpu_span<const float>{top_logprobs_.data(), top_logprobs_.size()}};
+}
+
 void BeamSearch_Cpu::AppendNextTokensToSequences() {
   sequences_.AppendNextTokenToSequences(beam_scorer_->GetNextIndicesCPU(), beam_scorer_->GetNextTokens());
 
@@ -277,41 +543,76 @@ std::span<float> Search_Cpu::GetScores(int batch_beam_index) const {
   return next_token_scores_.subspan(static_cast<size_t>(batch_beam_index) * params_->vocab_size, params_->vocab_size);
 }
 
-void Search_Cpu::ApplyMinLength(int min_length) {
-  if (sequences_.GetSequenceLength() >= min_length) {
+// Calls ban(token) for every token that would complete one of the bad_words or repeat an ngram of the sequence
+template <typename Ban>
+static void ForEachBannedToken(std::span<const int32_t> sequence, const GeneratorParams& params, Ban&& ban) {
+  for (auto& bad_word : params.bad_words) {
+    size_t prefix_length = bad_word.size() - 1;
+    if (prefix_length <= sequence.size() && std::equal(bad_word.begin(), bad_word.end() - 1, sequence.end() - prefix_length))
+      ban(bad_word.back());
+  }
+
+  const size_t n = static_cast<size_t>(params.search.no_repeat_ngram_size);
+  if (n == 0 || sequence.size() < n)
     return;
+  auto suffix = sequence.subspan(sequence.size() - (n - 1), n - 1);
+  for (size_t start = 0; start + n <= sequence.size(); start++) {
+    if (std::equal(suffix.begin(), suffix.end(), sequence.begin() + start))
+      ban(sequence[start + n - 1]);
   }
+}
 
-  const int batch_beam_size = params_->BatchBeamSize();
-  for (int i = 0; i < batch_beam_size; i++) {
-    std::span<float> const beam_token_scores = GetScores(i);
-    beam_token_scores[params_->eos_token_id] = std::numeric_limits<float>::lowest();
+// Bans every token whose bit is clear. Words of 32 allowed tokens are skipped, the rest is a branch free select.
+static void ApplyTokenMask(std::span<float> scores, std::span<const uint32_t> mask) {
+  for (size_t word = 0; word < mask.size(); word++) {
+    const uint32_t bits = mask[word];
+    if (bits == ~0u)
+      continue;
+    const size_t begin = word * 32;
+    const size_t end = std::min(begin + 32, scores.size());
+    for (size_t token = begin; token < end; token++)
+      scores[token] = (bits >> (token - begin)) & 1 ? scores[token] : std::numeric_limits<float>::lowest();
   }
 }
 
-void Search_Cpu::ApplyRepetitionPenalty(float penalty) {
-  if (penalty == 1.0f)
+// Each row gets every processor before moving on to the next, only the tokens a processor touches are visited
+void Search_Cpu::ProcessLogits() {
+  auto& search = params_->search;
+  const int length = sequences_.GetSequenceLength();
+  const bool min_length = length < search.min_length;
+  auto has_penalties = [](const Config::Search& s) { return s.repetition_penalty != 1.0f || s.frequency_penalty != 0.0f || s.presence_penalty != 0.0f; };
+  const bool penalties = has_penalties(search) || std::any_of(params_->row_search.begin(), params_->row_search.end(), has_penalties);
+  const bool bans = !params_->bad_words.empty() || search.no_repeat_ngram_size > 0;
+  if (!min_length && !penalties && !bans && params_->logit_bias.empty() && !grammar_)
     return;
 
-  const int batch_beam_size = params_->BatchBeamSize();
-  for (int i = 0; i < batch_beam_size; i++) {
-    std::span<float> const beam_token_scores = GetScores(i);
-    std::span<const int32_t> const sequence = sequences_.GetSequence(i);
+  if (grammar_) {
+    for (int i = 0; i < params_->BatchBeamSize(); i++)
+      grammar_->Advance(i, sequences_.GetSequence(i).subspan(grammar_->sequence_length_, length - grammar_->sequence_length_));
+    grammar_->sequence_length_ = length;
+  }
 
-    // Find unique word IDs in sequence.
-    std::unordered_set<int32_t> unique_word_ids;
-    for (const auto& word_id : sequence) {
-      unique_word_ids.insert(word_id);
+  GetSearchThreadPool().ParallelFor(params_->BatchBeamSize(), [&](size_t i) {
+    std::span<float> const scores = GetScores(static_cast<int>(i));
+    if (penalties) {
+      auto& row = params_->RowSearch(static_cast<int>(i) / search.num_beams);
+      for (const auto& [word_id, count] : sequences_.GetTokenCounts(static_cast<int>(i))) {
+        float score = scores[word_id];
+        score = score < 0 ? score * row.repetition_penalty : score / row.repetition_penalty;
+        scores[word_id] = score - static_cast<float>(count) * row.frequency_penalty - row.presence_penalty;
+      }
     }
 
-    for (const int32_t word_id : unique_word_ids) {
-      float const score = beam_token_scores[word_id];
+    for (const auto& [token, bias] : params_->logit_bias)
+      scores[token] += bias;
 
-      // If score < 0, then repetition penalty > 1.0 has to multiplied to reduce the previous token probability,
-      // This assumes that scores are either positive (like ctrl) or negative (like GPT-2), but not a mixture.
-      beam_token_scores[word_id] = (score < 0 ? score * penalty : score / penalty);
-    }
-  }
+    if (bans)
+      ForEachBannedToken(sequences_.GetSequence(static_cast<int>(i)), *params_, [&](int32_t token) { scores[token] = std::numeric_limits<float>::lowest(); });
+    if (min_length)
+      scores[params_->eos_token_id] = std::numeric_limits<float>::lowest();
+    if (grammar_)
+      ApplyTokenMask(scores, grammar_->GetMask(static_cast<int>(i)));
+  });
 }
 
 }  // namespace Generators
\ No newline at end of file
@@ -1,10 +1,17 @@
 #include "sequences.h"
+#include "grammar.h"
+#include "philox.h"
 #include <random>
 
 namespace Generators {
 
 struct BeamSearchScorer;
 
+// The random stream of every row: the batch's random_seed (a random one when -1) with the row index as subsequence, or
+// the row_search random_seed set for the row on its own, even one equal to the batch's, so the row reproduces whatever
+// the other rows are. Rows start out with a random_seed of -1, which follows the batch.
+std::vector<RandomRow> MakeRandomRows(const GeneratorParams& params);
+
 struct Search {
   Search(const GeneratorParams& params) : params_{params.shared_from_this()} {}
   virtual ~Search() = default;
@@ -16,7 +23,16 @@ struct Search {
   virtual RoamingArray<int32_t> GetSequence(int index) = 0;
 
   virtual void SetLogits(RoamingArray<float> logits) = 0;
+  // Instead of the logits: the top token of every row, already picked by the state (see State::top_tokens_on_device_)
+  virtual void SetTopTokens(cpu_span<const int32_t> /*tokens*/) { throw std::runtime_error("SetTopTokens is only supported by greedy search"); }
+  // Instead of the logits: fp16 logits as the model wrote them, for a step that only picks a token (see State::logits16_)
+  virtual void SetLogits16(gpu_span<uint16_t> /*logits*/) { throw std::runtime_error("SetLogits16 is only supported by the CUDA greedy search"); }
   virtual bool IsDone() const = 0;
+  // Pipelined steps: IsDone() can return false before the device has checked the last step for eos. True if the search
+  // was in fact done before the step being generated, which then appends nothing.
+  virtual bool WasDone() const { return false; }
+  // The rows that hit eos, a stop sequence or their own length limit, their next tokens are padding from then on
+  virtual RoamingArray<bool> GetDoneRows() { throw std::runtime_error("GetDoneRows is only supported by greedy search"); }
 
   // TODO: Beam Search only, this should be removed and made automatic
   virtual void Finalize(size_t /*num_return_sequences*/, RoamingArray<int32_t> /*output*/, RoamingArray<float> /*sequence_scores*/) { assert(false); }
@@ -25,12 +41,31 @@ struct Search {
   virtual void SampleTopP(float /*p*/, float /*temperature*/) { assert(false); }
   virtual void SampleTopK(int /*k*/, float /*temperature*/) { assert(false); }
   virtual void SampleTopKTopP(int /*k*/, float /*p*/, float /*temperature*/) { assert(false); }
+  // Each row chooses between the above with its own options, see GeneratorParams::row_search
+  virtual void SampleRows() { throw std::runtime_error("Per row search options are only supported by greedy search"); }
+
+  // Multi-turn: appends tokens to the single sequence and clears the finished state, see Generator::AppendTokens
+  virtual void AppendTokens(std::span<const int32_t> /*tokens*/) { throw std::runtime_error("AppendTokens is only supported by greedy search"); }
+
+  // Generator snapshots: the random engine and finished state, the sequence is saved by the generator
+  virtual void Save(std::ostream& /*file*/) const { throw std::runtime_error("Saving a generator is only supported by greedy search"); }
+  virtual void Load(std::istream& /*file*/) { throw std::runtime_error("Loading a generator is only supported by greedy search"); }
 
-  // Scoring features
-  virtual void ApplyMinLength(int min_length) = 0;
-  virtual void ApplyRepetitionPenalty(float penalty) = 0;
+  // Applies every logits processor enabled by the params in as few passes over the scores as possible: min_length,
+  // the penalties, logit_bias, bad_words, no_repeat_ngram_size and the grammar mask. The frequency and presence
+  // penalties are OpenAI style, count * frequency_penalty + presence_penalty is subtracted from the score of every
+  // token seen so far. Temperature is applied by the sampling softmax.
+  virtual void ProcessLogits() = 0;
+
+  // top_logprobs: LogSoftMax keeps the log probabilities of the processed scores, at each row's sampling temperature,
+  // before a sampler overwrites them. Once the next tokens are picked GatherLogProbs takes those of the next tokens and
+  // of the top_logprobs most likely ones, which GetLogProbs returns.
+  virtual void LogSoftMax() { throw std::runtime_error("top_logprobs is only supported by greedy search"); }
+  virtual void GatherLogProbs() { throw std::runtime_error("top_logprobs is only supported by greedy search"); }
+  virtual TokenLogProbs GetLogProbs() { throw std::runtime_error("top_logprobs is only supported by greedy search"); }
 
   std::shared_ptr<const GeneratorParams> params_;
+  std::unique_ptr<GrammarMatcher> grammar_;  // Only with params grammar
 };
 
 struct Search_Cpu : Search {
@@ -43,8 +78,7 @@ struct Search_Cpu : Search {
   bool IsDone() const override { return done_; }
   void SetLogits(RoamingArray<float> logits) override;
 
-  void ApplyMinLength(int min_length) override;
-  void ApplyRepetitionPenalty(float penalty) override;
+  void ProcessLogits() override;
 
   std::span<float> GetScores(int batch_beam_index) const;
   Sequences& GetSequences() { return sequences_; }
@@ -65,25 +99,70 @@ struct GreedySearch_Cpu : Search_Cpu {
 
   RoamingArray<int32_t> GetNextTokens() override;
   RoamingArray<int32_t> GetNextIndices() override { return cpu_span<int32_t>{}; }
+  RoamingArray<bool> GetDoneRows() override { return cpu_span<bool>{eos_seen_}; }
 
+  void SetTopTokens(cpu_span<const int32_t> tokens) override { top_tokens_ = tokens; }
   void SelectTop() override;
   void SampleTopK(int k, float temperature) override;
   void SampleTopP(float p, float temperature) override;
   void SampleTopKTopP(int /*k*/, float /*p*/, float /*temperature*/) override;
+  void SampleRows() override;
+
+  void AppendTokens(std::span<const int32_t> tokens) override;
+
+  void Save(std::ostream& file) const override;
+  void Load(std::istream& file) override;
+
+  void LogSoftMax() override;
+  void GatherLogProbs() override;
+  TokenLogProbs GetLogProbs() override;
 
  private:
   bool PadIfAlreadyEOS(size_t batch_id);
   void SetNextToken(size_t batch_id, int32_t token);
+  void FinishRow(size_t batch_id);
   void AppendNextTokensToSequences();
+  void StartTurn();            // The stop conditions count the generated tokens from the current sequence length
+  void CheckStopConditions();  // Finishes the rows that end with a stop sequence or hit their length limit
+  void ReserveTopK(int k);  // Grows the top-k scratch buffers to hold k entries per row
+  void ReserveTopP();
+  float Draw(size_t batch_id, float max) const;      // A uniform [0, max) number for the row at this step
+  void DrawSamples(float max, bool skip_eos_rows);  // Fills draws_ with a uniform [0, max) number per row
+
+  // The token of one row, using its draw
+  enum struct Sampler { ArgMax, TopK, TopP, TopKTopP };
+  static Sampler GetSampler(const Config::Search& search);
+  int32_t ArgMaxToken(size_t batch_id) const;
+  int32_t TopKToken(size_t batch_id, int k, float temperature);
+  int32_t TopPToken(size_t batch_id, float temperature);
+  int32_t TopKTopPToken(size_t batch_id, int k, float temperature);
+  // The most likely tokens are walked in order until their cumulative probability reaches threshold, indices is
+  // vocab_size scratch
+  static int32_t FindTopPToken(std::span<const float> probabilities, float threshold, std::span<int32_t> indices);
 
   std::unique_ptr<int32_t[]> next_tokens_buffer_;
+  cpu_span<const int32_t> top_tokens_;  // From SetTopTokens, used by the next SelectTop in place of the argmax
   std::unique_ptr<int32_t[]> temp_topk_buffer_;
+  std::unique_ptr<float[]> temp_topk_scores_buffer_;
+  int temp_topk_capacity_{};
+  std::unique_ptr<int32_t[]> temp_topp_buffer_;  // shape (batch_size, vocab_size)
+
+  std::span<float> draws_;  // shape (batch_size)
+  std::unique_ptr<float[]> draws_buffer_;
 
   std::span<bool> eos_seen_;  // shape (batch_size)
   std::unique_ptr<bool[]> eos_seen_buffer_;
   int not_done_count_{params_->batch_size};  // When zero, every batch entry is done (starts at batch_size_)
 
-  std::mt19937 gen_;
+  int start_length_{};                  // Sequence length when the current turn started
+  std::vector<int> row_length_limits_;  // Empty when every row stops at max_length
+
+  std::vector<RandomRow> random_rows_;  // shape (batch_size), drawn from at the sequence length
+
+  // top_logprobs, see Search::LogSoftMax
+  std::vector<float> log_probs_;                // shape (batch_size, vocab_size)
+  std::vector<float> logprobs_, top_logprobs_;  // shape (batch_size) and (batch_size, top_logprobs)
+  std::vector<int32_t> top_logprob_tokens_;     // shape (batch_size, top_logprobs)
 };
 
 struct BeamSearch_Cpu : Search_Cpu {
@@ -101,6 +180,18 @@ struct BeamSearch_Cpu : Search_Cpu {
   void AppendNextTokensToSequences();
 
   std::unique_ptr<BeamSearchScorer> beam_scorer_;
+
+  struct ScoreIndex {
+    float score;
+    int32_t index;  // Into the num_beams * vocab_size scores of a batch entry
+  };
+
+  // SelectTop results and scratch, shape (batch_size, 2 * num_beams)
+  std::unique_ptr<float[]> topk_scores_;
+  std::unique_ptr<int32_t[]> topk_indices_;
+  std::unique_ptr<int32_t[]> topk_tokens_;
+  std::unique_ptr<ScoreIndex[]> topk_heap_;
+  std::unique_ptr<int32_t[]> diversity_tokens_;  // shape (batch_size, num_beams), the best token of each beam, only with a diversity_penalty
 };
 
 }  // namespace Generators
\ No newline at end of file
@@ -27,6 +27,45 @@ Search_Cuda::Search_Cuda(const GeneratorParams& params)
 
   done_cpu_ = CudaMallocHostArray<bool>(1);
   *done_cpu_ = false;
+
+  // Pageable host memory is staged before cudaMemcpyAsync returns, so the temporaries can go right away
+  if (!params.logit_bias.empty()) {
+    std::vector<float> logit_bias(params.vocab_size);
+    for (auto& [token, bias] : params.logit_bias)
+      logit_bias[token] += bias;
+    logit_bias_ = CudaMallocArray<float>(logit_bias.size());
+    cudaMemcpyAsync(logit_bias_.get(), logit_bias.data(), logit_bias.size() * sizeof(float), cudaMemcpyHostToDevice, params_->cuda_stream);
+  }
+
+  if (!params.bad_words.empty()) {
+    std::vector<int32_t> bad_words, offsets{0};
+    for (auto& bad_word : params.bad_words) {
+      bad_words.insert(bad_words.end(), bad_word.begin(), bad_word.end());
+      offsets.push_back(static_cast<int32_t>(bad_words.size()));
+    }
+    bad_words_ = CudaMallocArray<int32_t>(bad_words.size());
+    bad_words_offsets_ = CudaMallocArray<int32_t>(offsets.size());
+    cudaMemcpyAsync(bad_words_.get(), bad_words.data(), bad_words.size() * sizeof(int32_t), cudaMemcpyHostToDevice, params_->cuda_stream);
+    cudaMemcpyAsync(bad_words_offsets_.get(), offsets.data(), offsets.size() * sizeof(int32_t), cudaMemcpyHostToDevice, params_->cuda_stream);
+  }
+
+  auto has_penalties = [](const Config::Search& s) { return s.repetition_penalty != 1.0f || s.frequency_penalty != 0.0f || s.presence_penalty != 0.0f; };
+  if (std::any_of(params.row_search.begin(), params.row_search.end(), has_penalties)) {
+    std::vector<float> row_penalties;
+    for (int i = 0; i < params.batch_size; i++) {
+      auto& row = params.RowSearch(i);
+      row_penalties.insert(row_penalties.end(), {row.repetition_penalty, row.frequency_penalty, row.presence_penalty});
+    }
+    row_penalties_ = CudaMallocArray<float>(row_penalties.size());
+    cudaMemcpyAsync(row_penalties_.get(), row_penalties.data(), row_penalties.size() * sizeof(float), cudaMemcpyHostToDevice, params_->cuda_stream);
+  }
+
+  if (params.grammar) {
+    grammar_ = std::make_unique<GrammarMatcher>(params.grammar, batch_beam_size, sequences_.GetSequenceLength());
+    const size_t mask_size = batch_beam_size * ((params.vocab_size + 31) / 32);
+    grammar_mask_ = CudaMallocArray<uint32_t>(mask_size);
+    grammar_mask_cpu_ = CudaMallocHostArray<uint32_t>(mask_size);
+  }
 }
 
 GreedySearch_Cuda::GreedySearch_Cuda(const GeneratorParams& params)
@@ -34,12 +73,76 @@ GreedySearch_Cuda::GreedySearch_Cuda(const GeneratorParams& params)
   next_tokens_buffer_ = CudaMallocArray<int32_t>(params.batch_size, &next_tokens_);
   cudaMemsetAsync(next_tokens_.data(), 0, next_tokens_.size_bytes(), params_->cuda_stream);
 
-  unsigned long long random_seed;
-  if (params_->search.random_seed != -1)
-    random_seed = params_->search.random_seed;
-  else
-    random_seed = std::random_device{}();
-  samplingdata_ = std::make_unique<cuda::SamplingData>(random_seed, params_->batch_size, params_->vocab_size, params_->cuda_stream);
+  samplingdata_ = std::make_unique<cuda::SamplingData>(MakeRandomRows(params), params_->batch_size, params_->vocab_size, params_->cuda_stream);
+
+  if (!params.stop_sequences.empty()) {
+    std::vector<int32_t> tokens, offsets{0}, failures;
+    for (auto& stop_sequence : params.stop_sequences) {
+      tokens.insert(tokens.end(), stop_sequence.begin(), stop_sequence.end());
+      offsets.push_back(static_cast<int32_t>(tokens.size()));
+      // KMP failure function, so the automaton never has to look back at the sequence
+      const size_t begin = failures.size();
+      failures.push_back(0);
+      for (size_t i = 1; i < stop_sequence.size(); i++) {
+        int32_t length = failures[begin + i - 1];
+        while (length > 0 && stop_sequence[i] != stop_sequence[length])
+          length = failures[begin + length - 1];
+        failures.push_back(stop_sequence[i] == stop_sequence[length] ? length + 1 : length);
+      }
+    }
+    stop_tokens_ = CudaMallocArray<int32_t>(tokens.size());
+    stop_offsets_ = CudaMallocArray<int32_t>(offsets.size());
+    stop_failures_ = CudaMallocArray<int32_t>(failures.size());
+    stop_states_ = CudaMallocArray<int32_t>(params.batch_size * params.stop_sequences.size());
+    cudaMemcpyAsync(stop_tokens_.get(), tokens.data(), tokens.size() * sizeof(int32_t), cudaMemcpyHostToDevice, params_->cuda_stream);
+    cudaMemcpyAsync(stop_offsets_.get(), offsets.data(), offsets.size() * sizeof(int32_t), cudaMemcpyHostToDevice, params_->cuda_stream);
+    cudaMemcpyAsync(stop_failures_.get(), failures.data(), failures.size() * sizeof(int32_t), cudaMemcpyHostToDevice, params_->cuda_stream);
+    stop_.tokens = stop_tokens_.get();
+    stop_.offsets = stop_offsets_.get();
+    stop_.failures = stop_failures_.get();
+    stop_.states = stop_states_.get();
+    stop_.count = static_cast<int>(params.stop_sequences.size());
+  }
+  StartTurn();
+
+  if (!params.eos_token_ids.empty()) {
+    auto& ids = params.eos_token_ids;
+    eos_token_ids_ = CudaMallocArray<int32_t>(ids.size());
+    cudaMemcpyAsync(eos_token_ids_.get(), ids.data(), ids.size() * sizeof(int32_t), cudaMemcpyHostToDevice, params_->cuda_stream);
+    eos_token_ids_count_ = static_cast<int>(ids.size());
+  }
+  greedy_step_blocks_ = CudaMallocArray<int>(1);
+  cudaMemsetAsync(greedy_step_blocks_.get(), 0, sizeof(int), params_->cuda_stream);
+
+  // Every row through the same kernels, a greedy row samples from its single most likely token
+  if (!params.row_search.empty()) {
+    std::vector<int> k(params.batch_size);
+    std::vector<float> p(params.batch_size), temperature(params.batch_size);
+    for (int i = 0; i < params.batch_size; i++) {
+      auto& row = params.RowSearch(i);
+      const bool greedy = !row.do_sample || row.top_k == 1;
+      const bool top_p = row.top_p > 0.0f && row.top_p < 1.0f;
+      k[i] = greedy ? 1 : row.top_k;  // 0 is the whole vocab
+      p[i] = greedy || (row.top_k > 1 && !top_p) ? 1.0f : row.top_p;
+      temperature[i] = greedy ? 1.0f : row.temperature;
+    }
+    samplingdata_->SetRowOptions(k, p, temperature, params.vocab_size, params_->cuda_stream);
+  }
+
+  if (const size_t top_count = params.search.top_logprobs; top_count > 0) {
+    std::vector<float> temperatures(params.batch_size);
+    for (int i = 0; i < params.batch_size; i++) {
+      auto& row = params.RowSearch(i);
+      temperatures[i] = !row.do_sample || row.top_k == 1 ? 1.0f : row.temperature;
+    }
+    log_probs_ = CudaMallocArray<float>(params.batch_size * params.vocab_size);
+    logprob_temperatures_ = CudaMallocArray<float>(params.batch_size);
+    cudaMemcpyAsync(logprob_temperatures_.get(), temperatures.data(), temperatures.size() * sizeof(float), cudaMemcpyHostToDevice, params_->cuda_stream);
+    logprobs_ = CudaMallocArray<float>(params.batch_size * (1 + top_count));
+    top_logprob_tokens_ = CudaMallocArray<int32_t>(params.batch_size * top_count);
+    logprobs_cpu_ = CudaMallocHostArray<float>(params.batch_size * (1 + top_count));
+    top_logprob_tokens_cpu_ = CudaMallocHostArray<int32_t>(params.batch_size * top_count);
+  }
 }
 
 BeamSearch_Cuda::BeamSearch_Cuda(const GeneratorParams& params)
@@ -74,17 +177,36 @@ RoamingArray<int32_t> BeamSearch_Cuda::GetNextTokens() {
   return beam_scorer_->GetNextTokens();
 }
 
+// The kv cache reorders itself from the device copy, so the step doesn't wait for the scorer. Only a cache that picks
+// its past states on the host (KV_Cache_Combined) reads them back.
 RoamingArray<int32_t> BeamSearch_Cuda::GetNextIndices() {
-  return beam_scorer_->GetNextIndicesCPU();
+  return beam_scorer_->GetNextIndices();
 }
 
 int Search_Cuda::GetSequenceLength() const {
   return sequences_.GetSequenceLength();
 }
 
+// With pipelined steps the next step is launched while the eos check of the last one is still queued, so the decoder
+// runs back to back. max_length is known on the host and never overrun.
+bool Search_Cuda::IsDone() const {
+  if (params_->search.pipelined_steps) {
+    if (cudaEventQuery(done_event_) == cudaErrorNotReady)
+      return sequences_.GetSequenceLength() >= params_->search.max_length;
+    return *done_cpu_;
+  }
+
+  cudaStreamSynchronize(params_->cuda_stream);
+  return *done_cpu_;
+}
+
 void BeamSearch_Cuda::SelectTop() {
   auto beam_scores = beam_scorer_->GetNextScores();
 
+  if (params_->search.diversity_penalty != 0.0f)
+    cuda::LaunchDiversityPenalty(next_token_scores_.data(), params_->batch_size, params_->search.num_beams, params_->vocab_size,
+                                 params_->search.diversity_penalty, params_->cuda_stream);
+
   // Add beam score to next token scores. Corresponding python code is like:
   //    next_token_scores = next_token_scores + beam_scores[:, None].expand_as(next_token_scores)
   cuda::LaunchAddProbsKernel(next_token_scores_.data(), beam_scores.data(),
@@ -117,8 +239,6 @@ void BeamSearch_Cuda::SelectTop() {
   } else
     assert(false);
 
-  CudaCheck() == cudaStreamSynchronize(params_->cuda_stream);
-
   size_t size = params_->BatchBeamSize() * 2;
   std::span<float> next_scores{topk_next_scores_.get(), size};
   std::span<int32_t> next_tokens{topk_next_tokens_.get(), size};
@@ -136,46 +256,109 @@ void BeamSearch_Cuda::SelectTop() {
   AppendNextTokensToSequences();
 }
 
+// Eos folding, min_length, the argmax, the eos check and the append in one launch. The scores may already have had the
+// eos folding and min_length applied by Logits::Get and ProcessLogits, doing them again doesn't change the argmax.
 void GreedySearch_Cuda::SelectTop() {
-  std::span<float> scores = next_token_scores_.subspan(0, params_->batch_size * params_->vocab_size);
-  cuda::GetSample(samplingdata_.get(), params_->cuda_stream, next_tokens_.data(), scores.data(), int(scores.size() / params_->batch_size),
-                  params_->batch_size, 1, 0.0, 1.0);
-  CheckForEOS();
-  AppendNextTokensToSequences();
+  const int length = sequences_.GetSequenceLength();
+  auto stop = stop_;
+  stop.sequence_length = length + 1;
+  auto launch = [&](auto* scores) {
+    cuda::LaunchGreedyStep(scores, params_->batch_size, params_->vocab_size, eos_token_ids_.get(), eos_token_ids_count_, params_->eos_token_id,
+                           length < params_->search.min_length, next_tokens_.data(), eos_meet_.data(), params_->pad_token_id, stop,
+                           sequences_.GetSequences().data(), length, params_->search.max_length, greedy_step_blocks_.get(), done_cpu_.get(), params_->cuda_stream);
+  };
+  if (auto scores16 = std::exchange(next_token_scores16_, {}); !scores16.empty())
+    launch(scores16.data());
+  else
+    launch(next_token_scores_.data());
+  cudaEventRecord(done_event_, params_->cuda_stream);
+
+  if (g_log.enabled && g_log.append_next_tokens) {
+    auto& stream = Log("append_next_tokens");
+    DumpCudaSpan(stream, std::span<const int32_t>{next_tokens_});
+    stream << std::endl;
+  }
+  sequences_.AfterDeviceAppendedNextToken();
+  CheckForMaxLength();
 }
 
 void GreedySearch_Cuda::SampleTopP(float p, float temperature) {
-  std::span<float> scores = next_token_scores_.subspan(0, params_->batch_size * params_->vocab_size);
-  cuda::GetSample(samplingdata_.get(), params_->cuda_stream, next_tokens_.data(), scores.data(), int(scores.size() / params_->batch_size),
-                  params_->batch_size, -1, p, temperature);
+  Sample(-1, p, temperature);
   CheckForEOS();
   AppendNextTokensToSequences();
 }
 
 void GreedySearch_Cuda::SampleTopK(int k, float temperature) {
-  std::span<float> scores = next_token_scores_.subspan(0, params_->batch_size * params_->vocab_size);
-  cuda::GetSample(samplingdata_.get(), params_->cuda_stream, next_tokens_.data(), scores.data(), int(scores.size() / params_->batch_size),
-                  params_->batch_size, k, 0.0, temperature);
+  Sample(k, 0.0, temperature);
   CheckForEOS();
   AppendNextTokensToSequences();
 }
 
 void GreedySearch_Cuda::SampleTopKTopP(int k, float p, float temperature) {
+  Sample(k, p, temperature);
+  CheckForEOS();
+  AppendNextTokensToSequences();
+}
+
+void GreedySearch_Cuda::Sample(int k, float p, float temperature) {
+  if (auto scores16 = std::exchange(next_token_scores16_, {}); !scores16.empty()) {
+    cuda::GetSample(samplingdata_.get(), params_->cuda_stream, next_tokens_.data(), scores16.data(), params_->vocab_size,
+                    params_->batch_size, k, p, temperature, sequences_.GetSequenceLength());
+    return;
+  }
   std::span<float> scores = next_token_scores_.subspan(0, params_->batch_size * params_->vocab_size);
   cuda::GetSample(samplingdata_.get(), params_->cuda_stream, next_tokens_.data(), scores.data(), int(scores.size() / params_->batch_size),
-                  params_->batch_size, k, p, temperature);
+                  params_->batch_size, k, p, temperature, sequences_.GetSequenceLength());
+}
+
+void GreedySearch_Cuda::SampleRows() {
+  std::span<float> scores = next_token_scores_.subspan(0, params_->batch_size * params_->vocab_size);
+  cuda::GetSampleRows(samplingdata_.get(), params_->cuda_stream, next_tokens_.data(), scores.data(), params_->vocab_size, params_->batch_size,
+                      sequences_.GetSequenceLength());
   CheckForEOS();
   AppendNextTokensToSequences();
 }
 
+void GreedySearch_Cuda::StartTurn() {
+  const int start_length = sequences_.GetSequenceLength();
+  std::vector<int32_t> limits(params_->batch_size);
+  bool any_limit = false;
+  for (int i = 0; i < params_->batch_size; i++) {
+    limits[i] = params_->RowLengthLimit(i, start_length);
+    any_limit |= limits[i] < params_->search.max_length;
+  }
+  if (any_limit) {
+    if (!row_length_limits_)
+      row_length_limits_ = CudaMallocArray<int32_t>(params_->batch_size);
+    cudaMemcpyAsync(row_length_limits_.get(), limits.data(), limits.size() * sizeof(int32_t), cudaMemcpyHostToDevice, params_->cuda_stream);
+  }
+  stop_.row_length_limits = any_limit ? row_length_limits_.get() : nullptr;
+
+  if (stop_states_)
+    cudaMemsetAsync(stop_states_.get(), 0, params_->batch_size * params_->stop_sequences.size() * sizeof(int32_t), params_->cuda_stream);
+}
+
 void GreedySearch_Cuda::CheckForEOS() {
   assert(next_tokens_.size() == eos_meet_.size());
-  cuda::Launch_CheckForEOS(next_tokens_.data(), static_cast<int>(next_tokens_.size()), eos_meet_.data(), params_->eos_token_id, params_->pad_token_id, done_cpu_.get(), params_->cuda_stream);
+  auto stop = stop_;
+  stop.sequence_length = sequences_.GetSequenceLength() + 1;
+  cuda::Launch_CheckForEOS(next_tokens_.data(), static_cast<int>(next_tokens_.size()), eos_meet_.data(), params_->eos_token_id, params_->pad_token_id, stop, done_cpu_.get(), params_->cuda_stream);
+  cudaEventRecord(done_event_, params_->cuda_stream);
+}
+
+bool GreedySearch_Cuda::WasDone() const {
+  if (!params_->search.pipelined_steps)
+    return false;
+  cudaEventSynchronize(done_event_);  // The eos check of the step before, it finished while this step's decoder ran
+  return *done_cpu_;
 }
 
 void GreedySearch_Cuda::AppendNextTokensToSequences() {
   sequences_.AppendNextTokenToSequences(next_tokens_);
+  CheckForMaxLength();
+}
 
+void GreedySearch_Cuda::CheckForMaxLength() {
   if (sequences_.GetSequenceLength() == params_->search.max_length) {
     if (g_log.enabled && g_log.hit_max_length)
       Log("hit_max_length", "greedy cuda hit");
@@ -183,9 +366,66 @@ void GreedySearch_Cuda::AppendNextTokensToSequences() {
   }
 }
 
+void GreedySearch_Cuda::AppendTokens(std::span<const int32_t> tokens) {
+  sequences_.AppendTokens(tokens);
+  cudaMemsetAsync(eos_meet_.data(), 0, eos_meet_.size_bytes(), params_->cuda_stream);
+  cudaStreamSynchronize(params_->cuda_stream);  // The EOS check kernel writes done_cpu_
+  *done_cpu_ = false;
+  StartTurn();
+  if (grammar_)
+    grammar_->Reset(sequences_.GetSequenceLength());
+}
+
+// Same layout as GreedySearch_Cpu::Save, neither has random state to save
+void GreedySearch_Cuda::Save(std::ostream& file) const {
+  uint64_t engine_size{};
+  file.write(reinterpret_cast<const char*>(&engine_size), sizeof(engine_size));
+  auto eos_meet = CudaMallocHostArray<bool>(eos_meet_.size());
+  cudaMemcpyAsync(eos_meet.get(), eos_meet_.data(), eos_meet_.size_bytes(), cudaMemcpyDeviceToHost, params_->cuda_stream);
+  cudaStreamSynchronize(params_->cuda_stream);
+  file.write(reinterpret_cast<const char*>(eos_meet.get()), eos_meet_.size_bytes());
+}
+
+void GreedySearch_Cuda::Load(std::istream& file) {
+  uint64_t engine_size{};
+  file.read(reinterpret_cast<char*>(&engine_size), sizeof(engine_size));
+  file.seekg(engine_size, std::ios::cur);  // Older snapshots saved a random engine here
+  auto eos_meet = CudaMallocHostArray<bool>(eos_meet_.size());
+  file.read(reinterpret_cast<char*>(eos_meet.get()), eos_meet_.size_bytes());
+  if (!file)
+    throw std::runtime_error("The generator snapshot is corrupt");
+
+  cudaMemcpyAsync(eos_meet_.data(), eos_meet.get(), eos_meet_.size_bytes(), cudaMemcpyHostToDevice, params_->cuda_stream);
+  cudaStreamSynchronize(params_->cuda_stream);  // Before the pinned memory is freed
+  *done_cpu_ = std::count(eos_meet.get(), eos_meet.get() + eos_meet_.size(), false) == 0;
+}
+
+// Into a buffer of our own, the samplers scale and softmax the scores in place
+void GreedySearch_Cuda::LogSoftMax() {
+  cuda::LaunchLogSoftmax(log_probs_.get(), next_token_scores_.data(), logprob_temperatures_.get(), params_->vocab_size, params_->batch_size, params_->cuda_stream);
+}
+
+void GreedySearch_Cuda::GatherLogProbs() {
+  const size_t batch_size = params_->batch_size;
+  const size_t top_count = params_->search.top_logprobs;
+  cuda::LaunchGatherLogProbs(logprobs_.get(), top_logprob_tokens_.get(), logprobs_.get() + batch_size, log_probs_.get(), next_tokens_.data(),
+                             params_->vocab_size, params_->batch_size, static_cast<int>(top_count), params_->cuda_stream);
+  cudaMemcpyAsync(logprobs_cpu_.get(), logprobs_.get(), batch_size * (1 + top_count) * sizeof(float), cudaMemcpyDeviceToHost, params_->cuda_stream);
+  cudaMemcpyAsync(top_logprob_tokens_cpu_.get(), top_logprob_tokens_.get(), batch_size * top_count * sizeof(int32_t), cudaMemcpyDeviceToHost, params_->cuda_stream);
+}
+
+TokenLogProbs GreedySearch_Cuda::GetLogProbs() {
+  cudaStreamSynchronize(params_->cuda_stream);
+  const size_t batch_size = params_->batch_size;
+  const size_t top_count = params_->search.top_logprobs;
+  return {cpu_span<const float>{logprobs_cpu_.get(), batch_size},
+          cpu_span<const int32_t>{top_logprob_tokens_cpu_.get(), batch_size * top_count},
+          cpu_span<const float>{logprobs_cpu_.get() + batch_size, batch_size * top_count}};
+}
+
+// Like Search_Cuda::IsDone, with pipelined steps a scorer that hasn't finished yet is taken as not done
 bool BeamSearch_Cuda::IsDone() const {
-  beam_scorer_->IsDone();
-  if (beam_scorer_->IsDoneLater())
+  if (params_->search.pipelined_steps ? beam_scorer_->IsDoneIfReady() : beam_scorer_->IsDoneLater())
     return true;
 
   if (sequences_.GetSequenceLength() == params_->search.max_length) {
@@ -196,6 +436,12 @@ bool BeamSearch_Cuda::IsDone() const {
   return false;
 }
 
+bool BeamSearch_Cuda::WasDone() const {
+  if (!params_->search.pipelined_steps)
+    return false;
+  return beam_scorer_->IsDoneLater();  // The scorer of the step before, it finished while this step's decoder ran
+}
+
 void BeamSearch_Cuda::AppendNextTokensToSequences() {
   sequences_.AfterDeviceAppendedNextToken();
 }
@@ -231,20 +477,74 @@ std::span<float> Search_Cuda::GetScores() {
   return next_token_scores_;
 }
 
-void Search_Cuda::ApplyMinLength(int min_length) {
-  if (sequences_.GetSequenceLength() >= min_length)
+// Greedy sequences only ever grow, so only the tokens appended since the last call are counted. Beam search reorders
+// the sequences every step, copying the count rows along would cost as much as recounting, so it recounts.
+void Search_Cuda::UpdateTokenCounts() {
+  auto batch_beam_size = params_->BatchBeamSize();
+  if (!token_counts_) {
+    token_counts_ = CudaMallocArray<int32_t>(static_cast<size_t>(batch_beam_size) * params_->vocab_size);
+    token_counts_length_ = -1;
+  }
+
+  int length = GetSequenceLength();
+  if (length == token_counts_length_)
     return;
+  if (params_->search.num_beams > 1 || token_counts_length_ < 0 || token_counts_length_ > length) {
+    cudaMemsetAsync(token_counts_.get(), 0, static_cast<size_t>(batch_beam_size) * params_->vocab_size * sizeof(int32_t), params_->cuda_stream);
+    token_counts_length_ = 0;
+  }
 
-  cuda::LaunchSetScoreProcessor(GetScores().data(), params_->BatchBeamSize(), params_->vocab_size, params_->eos_token_id, std::numeric_limits<float>::lowest(), params_->cuda_stream);
+  cuda::LaunchCountTokens(sequences_.GetSequences().data(), token_counts_.get(), batch_beam_size, params_->vocab_size,
+                          params_->search.max_length, token_counts_length_, length, params_->cuda_stream);
+  token_counts_length_ = length;
 }
 
-void Search_Cuda::ApplyRepetitionPenalty(float penalty) {
-  if (penalty == 1.0f)
-    return;
+// The grammar masks are looked up on the CPU, which needs the last token of every row, and uploaded for the kernel
+void Search_Cuda::UpdateGrammarMask() {
+  const int length = GetSequenceLength();
+  if (length > grammar_->sequence_length_) {
+    assert(length == grammar_->sequence_length_ + 1);  // AppendTokens resets the grammar
+    auto next_tokens = GetNextTokens().GetCPU();        // Synchronizes, so the previous mask upload is done too
+    for (int i = 0; i < params_->BatchBeamSize(); i++)
+      grammar_->Advance(i, next_tokens.subspan(i, 1));
+    grammar_->sequence_length_ = length;
+  } else
+    cudaStreamSynchronize(params_->cuda_stream);
+
+  const size_t words = (params_->vocab_size + 31) / 32;
+  for (int i = 0; i < params_->BatchBeamSize(); i++) {
+    auto mask = grammar_->GetMask(i);
+    std::copy(mask.begin(), mask.end(), grammar_mask_cpu_.get() + i * words);
+  }
+  cudaMemcpyAsync(grammar_mask_.get(), grammar_mask_cpu_.get(), params_->BatchBeamSize() * words * sizeof(uint32_t), cudaMemcpyHostToDevice, params_->cuda_stream);
+}
 
-  cuda::LaunchRepetitionPenaltyProcessor(sequences_.GetSequences().data(),
-                                         GetScores().data(), params_->batch_size, params_->search.num_beams, params_->vocab_size,
-                                         params_->search.max_length, GetSequenceLength(), penalty, params_->cuda_stream);
+// The penalties, logit_bias, min_length and the grammar mask share one kernel over the scores. The bans only touch the banned tokens, so
+// they are separate launches that cost O(sequence length) rather than O(vocab_size).
+void Search_Cuda::ProcessLogits() {
+  auto& search = params_->search;
+  const int length = GetSequenceLength();
+  const bool min_length = length < search.min_length;
+  const bool penalties = row_penalties_ || search.repetition_penalty != 1.0f || search.frequency_penalty != 0.0f || search.presence_penalty != 0.0f;
+  auto scores = GetScores().data();
+
+  if (penalties)
+    UpdateTokenCounts();
+  if (grammar_)
+    UpdateGrammarMask();
+  if (penalties || logit_bias_ || grammar_)
+    cuda::LaunchLogitsProcessor(penalties ? token_counts_.get() : nullptr, logit_bias_.get(), grammar_mask_.get(), scores, params_->BatchBeamSize(), params_->vocab_size,
+                                search.repetition_penalty, search.frequency_penalty, search.presence_penalty, row_penalties_.get(),
+                                min_length ? params_->eos_token_id : -1, params_->cuda_stream);
+  else if (min_length)
+    cuda::LaunchSetScoreProcessor(scores, params_->BatchBeamSize(), params_->vocab_size, params_->eos_token_id, std::numeric_limits<float>::lowest(), params_->cuda_stream);
+
+  if (search.no_repeat_ngram_size > 0)
+    cuda::LaunchNoRepeatNGramProcessor(sequences_.GetSequences().data(), scores, params_->BatchBeamSize(), params_->vocab_size,
+                                       search.max_length, length, search.no_repeat_ngram_size, params_->cuda_stream);
+  if (bad_words_)
+    cuda::LaunchBadWordsProcessor(sequences_.GetSequences().data(), scores, params_->BatchBeamSize(), params_->vocab_size, search.max_length, length,
+                                  bad_words_.get(), bad_words_offsets_.get(), static_cast<int>(params_->bad_words.size()), params_->cuda_stream);
 }
 
 }  // namespace Generators
\ No newline at end of file
@@ -1,3 +1,4 @@
+#include <cuda_fp16.h>
 #include <cuda_runtime.h>
 #include <cub/cub.cuh>
 #include <algorithm>
@@ -25,26 +26,40 @@ void LaunchSetInputSequence(std::span<int32_t> sequences) {
 }
 #endif
 
-__global__ void ArgMax(cub::KeyValuePair<int, float>* argmaxen, int32_t* next_tokens, int batch_size) {
-  int batch_index = threadIdx.x;
-  next_tokens[batch_index] = argmaxen[batch_index].key;
+__device__ bool AdvanceStopSequences(const StopConditions& stop, int batch_id, int32_t token) {
+  bool matched = false;
+  for (int i = 0; i < stop.count; i++) {
+    const int32_t* stop_sequence = stop.tokens + stop.offsets[i];
+    const int32_t* failures = stop.failures + stop.offsets[i];
+    int length = stop.offsets[i + 1] - stop.offsets[i];
+    int32_t& state = stop.states[batch_id * stop.count + i];
+    while (state > 0 && stop_sequence[state] != token)
+      state = failures[state - 1];
+    if (stop_sequence[state] == token)
+      state++;
+    if (state == length) {
+      matched = true;
+      state = failures[state - 1];
+    }
+  }
+  return matched;
 }
 
-struct ArgMaxDataImpl : ArgMaxData {
-  cuda_unique_ptr<uint8_t> temp_storage_;
-  size_t temp_storage_element_size_{};  // Size per batch, temp_storage_ is this size * batch_size
-
-  gpu_span<cub::KeyValuePair<int, float>> argmaxen_;
-  cuda_unique_ptr<cub::KeyValuePair<int, float>> argmaxen_owner_;
-};
-
-__global__ void CheckForEOS(int32_t* next_tokens, int next_tokens_count, bool* eos_meet, int eos_token_id, int pad_token_id, bool* done_cpu) {
+__global__ void CheckForEOS(int32_t* next_tokens, int next_tokens_count, bool* eos_meet, int eos_token_id, int pad_token_id, StopConditions stop, bool* done_cpu) {
   // Look for EOS tokens, if seen set EOS flag and replace with pad token
   for (size_t batch_id = 0; batch_id < next_tokens_count; ++batch_id) {
     if (next_tokens[batch_id] == eos_token_id || eos_meet[batch_id] == true) {
       eos_meet[batch_id] = true;
       next_tokens[batch_id] = pad_token_id;
+      continue;
     }
+
+    // The token that completes a stop condition is kept, the row is padded from the next one on
+    bool done = stop.row_length_limits && stop.sequence_length >= stop.row_length_limits[batch_id];
+    if (stop.count > 0 && AdvanceStopSequences(stop, static_cast<int>(batch_id), next_tokens[batch_id]))
+      done = true;
+    if (done)
+      eos_meet[batch_id] = true;
   }
 
   // When all batches are finished, stop earlier to avoid wasting computation.
@@ -64,8 +79,99 @@ __global__ void CheckForEOS(int32_t* next_tokens, int next_tokens_count, bool* e
   }
 }
 
-void Launch_CheckForEOS(int32_t* next_tokens, int next_tokens_count, bool* eos_meet, int eos_token_id, int pad_token_id, bool* done_cpu, cudaStream_t stream) {
-  CheckForEOS<<<1, 1, 0, stream>>>(next_tokens, next_tokens_count, eos_meet, eos_token_id, pad_token_id, done_cpu);
+void Launch_CheckForEOS(int32_t* next_tokens, int next_tokens_count, bool* eos_meet, int eos_token_id, int pad_token_id, const StopConditions& stop, bool* done_cpu, cudaStream_t stream) {
+  CheckForEOS<<<1, 1, 0, stream>>>(next_tokens, next_tokens_count, eos_meet, eos_token_id, pad_token_id, stop, done_cpu);
+}
+
+// One block per row: folds the eos tokens into eos_token_ids[0] as HandleEOSArray does, masks it before min_length,
+// takes the argmax, then does what CheckForEOS and AppendNextTokenToSequences do for the row. The last block to finish
+// sets done_cpu, so a greedy step is a single launch. fp16 scores are compared in fp32.
+template <int kBlockSize, typename T>
+__global__ void GreedyStep(T* scores, int vocab_size, const int32_t* eos_token_ids, int eos_token_ids_count, int eos_token_id, bool mask_eos,
+                           int32_t* next_tokens, bool* eos_meet, int pad_token_id, StopConditions stop, int32_t* sequences, int current_length,
+                           int max_length, int* blocks_finished, bool* done_cpu) {
+  const int batch_id = blockIdx.x;
+  T* row_scores = scores + static_cast<size_t>(batch_id) * vocab_size;
+
+  if (threadIdx.x == 0) {
+    if (eos_token_ids_count > 0) {
+      float max = std::numeric_limits<float>::lowest();
+      for (int i = 0; i < eos_token_ids_count; i++) {
+        max = std::max(max, static_cast<float>(row_scores[eos_token_ids[i]]));
+        row_scores[eos_token_ids[i]] = T(std::numeric_limits<float>::lowest());
+      }
+      row_scores[eos_token_ids[0]] = T(max);
+    }
+    if (mask_eos)
+      row_scores[eos_token_id] = T(std::numeric_limits<float>::lowest());
+  }
+  __syncthreads();
+
+  cub::KeyValuePair<int, float> best{vocab_size, std::numeric_limits<float>::lowest()};
+  for (int i = threadIdx.x; i < vocab_size; i += kBlockSize) {
+    float score = static_cast<float>(row_scores[i]);
+    if (score > best.value || best.key == vocab_size) {
+      best.key = i;
+      best.value = score;
+    }
+  }
+
+  typedef cub::BlockReduce<cub::KeyValuePair<int, float>, kBlockSize> BlockReduce;
+  __shared__ typename BlockReduce::TempStorage temp_storage;
+  best = BlockReduce(temp_storage).Reduce(best, cub::ArgMax());
+
+  if (threadIdx.x != 0)
+    return;
+
+  int32_t token = best.key;
+  if (token == eos_token_id || eos_meet[batch_id]) {
+    eos_meet[batch_id] = true;
+    token = pad_token_id;
+  } else {
+    // The token that completes a stop condition is kept, the row is padded from the next one on
+    bool done = stop.row_length_limits && stop.sequence_length >= stop.row_length_limits[batch_id];
+    if (stop.count > 0 && AdvanceStopSequences(stop, batch_id, token))
+      done = true;
+    if (done)
+      eos_meet[batch_id] = true;
+  }
+  next_tokens[batch_id] = token;
+  sequences[batch_id * max_length + current_length] = token;
+
+  // The other rows' eos_meet are visible to the block that finishes last
+  __threadfence();
+  if (atomicAdd(blocks_finished, 1) != gridDim.x - 1)
+    return;
+  *blocks_finished = 0;
+  const volatile bool* rows_done = eos_meet;
+  for (int i = 0; i < gridDim.x; i++) {
+    if (!rows_done[i])
+      return;
+  }
+  *done_cpu = true;
+}
+
+template <typename T>
+void LaunchGreedyStep(T* scores, int batch_size, int vocab_size, const int32_t* eos_token_ids, int eos_token_ids_count, int eos_token_id, bool mask_eos,
+                      int32_t* next_tokens, bool* eos_meet, int pad_token_id, const StopConditions& stop, int32_t* sequences, int current_length,
+                      int max_length, int* blocks_finished, bool* done_cpu, cudaStream_t stream) {
+  constexpr int kBlockSize = 1024;
+  GreedyStep<kBlockSize><<<batch_size, kBlockSize, 0, stream>>>(scores, vocab_size, eos_token_ids, eos_token_ids_count, eos_token_id, mask_eos, next_tokens, eos_meet,
+                                                                pad_token_id, stop, sequences, current_length, max_length, blocks_finished, done_cpu);
+}
+
+void LaunchGreedyStep(float* scores, int batch_size, int vocab_size, const int32_t* eos_token_ids, int eos_token_ids_count, int eos_token_id, bool mask_eos,
+                      int32_t* next_tokens, bool* eos_meet, int pad_token_id, const StopConditions& stop, int32_t* sequences, int current_length,
+                      int max_length, int* blocks_finished, bool* done_cpu, cudaStream_t stream) {
+  LaunchGreedyStep<float>(scores, batch_size, vocab_size, eos_token_ids, eos_token_ids_count, eos_token_id, mask_eos, next_tokens, eos_meet,
+                          pad_token_id, stop, sequences, current_length, max_length, blocks_finished, done_cpu, stream);
+}
+
+void LaunchGreedyStep(uint16_t* scores, int batch_size, int vocab_size, const int32_t* eos_token_ids, int eos_token_ids_count, int eos_token_id, bool mask_eos,
+                      int32_t* next_tokens, bool* eos_meet, int pad_token_id, const StopConditions& stop, int32_t* sequences, int current_length,
+                      int max_length, int* blocks_finished, bool* done_cpu, cudaStream_t stream) {
+  LaunchGreedyStep<half>(reinterpret_cast<half*>(scores), batch_size, vocab_size, eos_token_ids, eos_token_ids_count, eos_token_id, mask_eos, next_tokens,
+                         eos_meet, pad_token_id, stop, sequences, current_length, max_length, blocks_finished, done_cpu, stream);
 }
 
 __global__ void AddProbsKernel(float* log_probs,
@@ -91,6 +197,41 @@ void LaunchAddProbsKernel(float* log_probs,
   AddProbsKernel<<<gridSize, blockSize, 0, stream>>>(log_probs, cum_log_probs, vocab_size, total_elements);
 }
 
+// One block per batch entry, the beams in order: every beam's best token is penalized in the beams after it, which is
+// diverse beam search with a group per beam. num_beams is at most 32, as for BeamSearchTopK.
+template <int kBlockSize>
+__global__ void DiversityPenalty(float* next_token_scores, int num_beams, int vocab_size, float penalty) {
+  __shared__ int32_t chosen[32];
+  typedef cub::BlockReduce<cub::KeyValuePair<int, float>, kBlockSize> BlockReduce;
+  __shared__ typename BlockReduce::TempStorage temp_storage;
+
+  for (int beam = 0; beam < num_beams; beam++) {
+    float* scores = next_token_scores + (static_cast<size_t>(blockIdx.x) * num_beams + beam) * vocab_size;
+    if (threadIdx.x == 0) {
+      for (int i = 0; i < beam; i++)
+        scores[chosen[i]] -= penalty;
+    }
+    __syncthreads();
+
+    cub::KeyValuePair<int, float> best{vocab_size, std::numeric_limits<float>::lowest()};
+    for (int i = threadIdx.x; i < vocab_size; i += kBlockSize) {
+      if (scores[i] > best.value || best.key == vocab_size) {
+        best.key = i;
+        best.value = scores[i];
+      }
+    }
+    best = BlockReduce(temp_storage).Reduce(best, cub::ArgMax());
+    if (threadIdx.x == 0)
+      chosen[beam] = best.key;
+    __syncthreads();
+  }
+}
+
+void LaunchDiversityPenalty(float* next_token_scores, int batch_size, int num_beams, int vocab_size, float penalty, cudaStream_t stream) {
+  constexpr int kBlockSize = 512;
+  DiversityPenalty<kBlockSize><<<batch_size, kBlockSize, 0, stream>>>(next_token_scores, num_beams, vocab_size, penalty);
+}
+
 __global__ void SetScoreProcessor(float* next_token_scores, int batch_beam_size, int vocab_size, int token, float score) {
   int index = blockIdx.x * blockDim.x + threadIdx.x;
   if (index >= batch_beam_size)
@@ -107,34 +248,130 @@ void LaunchSetScoreProcessor(float* next_token_scores, int batch_beam_size, int
   SetScoreProcessor<<<gridSize, blockSize, 0, stream>>>(next_token_scores, batch_beam_size, vocab_size, token, score);
 }
 
-__global__ void RepetitionPenaltyProcessor(const int32_t* sequences, float* next_token_scores, int max_sequence_length, int vocab_size, int total_elements, int current_sequence_length, float repetition_penalty) {
+// Adds the tokens at positions [begin, end) of every sequence to its counts, one thread per token
+__global__ void CountTokens(const int32_t* sequences, int32_t* token_counts, int max_sequence_length, int vocab_size, int begin, int length, int total_elements) {
+  int index = blockIdx.x * blockDim.x + threadIdx.x;
+  if (index >= total_elements)
+    return;
+
+  int batch_beam_index = index / length;
+  int32_t word_id = sequences[batch_beam_index * max_sequence_length + begin + index % length];
+  atomicAdd(&token_counts[batch_beam_index * vocab_size + word_id], 1);
+}
+
+void LaunchCountTokens(const int32_t* sequences, int32_t* token_counts, int batch_beam_size, int vocab_size, int max_sequence_length, int begin, int end, cudaStream_t stream) {
+  int length = end - begin;
+  int total_elements = batch_beam_size * length;
+  if (total_elements == 0)
+    return;
+  constexpr int blockSize = 256;
+  const int gridSize = (total_elements + blockSize - 1) / blockSize;
+
+  CountTokens<<<gridSize, blockSize, 0, stream>>>(sequences, token_counts, max_sequence_length, vocab_size, begin, length, total_elements);
+}
+
+// The dense processors in one pass over the scores, token_counts, logit_bias, token_mask and row_penalties can be null.
+// row_penalties holds the repetition, frequency and presence penalty of every row and replaces the scalar ones.
+__global__ void LogitsProcessor(const int32_t* token_counts, const float* logit_bias, const uint32_t* token_mask, float* next_token_scores, int vocab_size, int total_elements,
+                                float repetition_penalty, float frequency_penalty, float presence_penalty, const float* row_penalties, int banned_token) {
   int index = blockIdx.x * blockDim.x + threadIdx.x;
   if (index >= total_elements)
     return;
 
-  int batch_beam_index = index / vocab_size;
   int word_id = index % vocab_size;
+  bool masked = token_mask && !((token_mask[(index / vocab_size) * ((vocab_size + 31) / 32) + word_id / 32] >> (word_id % 32)) & 1);
+  if (word_id == banned_token || masked) {
+    next_token_scores[index] = std::numeric_limits<float>::lowest();
+    return;
+  }
+
+  int32_t count = token_counts ? token_counts[index] : 0;
+  if (count == 0 && !logit_bias)
+    return;
 
-  const int32_t* current_sequence = sequences + batch_beam_index * max_sequence_length;
-  bool found = false;
-  for (int i = 0; i < current_sequence_length; i++) {
-    if (current_sequence[i] == word_id) {
-      found = true;
-      break;
+  float score = next_token_scores[index];
+  if (count != 0) {
+    if (row_penalties) {
+      const float* penalties = row_penalties + (index / vocab_size) * 3;
+      repetition_penalty = penalties[0];
+      frequency_penalty = penalties[1];
+      presence_penalty = penalties[2];
     }
+    score = score < 0 ? score * repetition_penalty : score / repetition_penalty;
+    score -= count * frequency_penalty + presence_penalty;
   }
-  if (found) {
-    float score = next_token_scores[index];
-    next_token_scores[index] = score < 0 ? score * repetition_penalty : score / repetition_penalty;
+  if (logit_bias)
+    score += logit_bias[word_id];
+  next_token_scores[index] = score;
+}
+
+void LaunchLogitsProcessor(const int32_t* token_counts, const float* logit_bias, const uint32_t* token_mask, float* next_token_scores, int batch_beam_size, int vocab_size,
+                           float repetition_penalty, float frequency_penalty, float presence_penalty, const float* row_penalties, int banned_token, cudaStream_t stream) {
+  int total_elements = batch_beam_size * vocab_size;
+  constexpr int blockSize = 256;
+  const int gridSize = (total_elements + blockSize - 1) / blockSize;
+
+  LogitsProcessor<<<gridSize, blockSize, 0, stream>>>(token_counts, logit_bias, token_mask, next_token_scores, vocab_size, total_elements,
+                                                      repetition_penalty, frequency_penalty, presence_penalty, row_penalties, banned_token);
+}
+
+// One thread per (sequence, ngram start), bans the token after every earlier ngram matching the sequence's last n - 1 tokens
+__global__ void NoRepeatNGramProcessor(const int32_t* sequences, float* next_token_scores, int vocab_size, int max_sequence_length, int current_sequence_length, int n, int starts, int total_elements) {
+  int index = blockIdx.x * blockDim.x + threadIdx.x;
+  if (index >= total_elements)
+    return;
+
+  int batch_beam_index = index / starts;
+  int start = index % starts;
+  const int32_t* sequence = sequences + batch_beam_index * max_sequence_length;
+  const int32_t* suffix = sequence + current_sequence_length - (n - 1);
+  for (int i = 0; i < n - 1; i++) {
+    if (sequence[start + i] != suffix[i])
+      return;
   }
+  next_token_scores[batch_beam_index * vocab_size + sequence[start + n - 1]] = std::numeric_limits<float>::lowest();
 }
 
-void LaunchRepetitionPenaltyProcessor(const int32_t* sequences, float* next_token_scores, int batch_size, int num_beams, int vocab_size, int max_sequence_length, int current_sequence_length, float repetition_penalty, cudaStream_t stream) {
-  int total_elements = batch_size * num_beams * vocab_size;
+void LaunchNoRepeatNGramProcessor(const int32_t* sequences, float* next_token_scores, int batch_beam_size, int vocab_size, int max_sequence_length, int current_sequence_length, int n, cudaStream_t stream) {
+  int starts = current_sequence_length - n + 1;
+  if (starts <= 0)
+    return;
+  int total_elements = batch_beam_size * starts;
+  constexpr int blockSize = 256;
+  const int gridSize = (total_elements + blockSize - 1) / blockSize;
+
+  NoRepeatNGramProcessor<<<gridSize, blockSize, 0, stream>>>(sequences, next_token_scores, vocab_size, max_sequence_length, current_sequence_length, n, starts, total_elements);
+}
+
+// One thread per (sequence, bad word), bans the bad word's last token if the sequence ends with the rest of it
+__global__ void BadWordsProcessor(const int32_t* sequences, float* next_token_scores, int vocab_size, int max_sequence_length, int current_sequence_length,
+                                  const int32_t* bad_words, const int32_t* bad_words_offsets, int bad_words_count, int total_elements) {
+  int index = blockIdx.x * blockDim.x + threadIdx.x;
+  if (index >= total_elements)
+    return;
+
+  int batch_beam_index = index / bad_words_count;
+  const int32_t* bad_word = bad_words + bad_words_offsets[index % bad_words_count];
+  int prefix_length = bad_words_offsets[index % bad_words_count + 1] - bad_words_offsets[index % bad_words_count] - 1;
+  if (prefix_length > current_sequence_length)
+    return;
+
+  const int32_t* suffix = sequences + batch_beam_index * max_sequence_length + current_sequence_length - prefix_length;
+  for (int i = 0; i < prefix_length; i++) {
+    if (suffix[i] != bad_word[i])
+      return;
+  }
+  next_token_scores[batch_beam_index * vocab_size + bad_word[prefix_length]] = std::numeric_limits<float>::lowest();
+}
+
+void LaunchBadWordsProcessor(const int32_t* sequences, float* next_token_scores, int batch_beam_size, int vocab_size, int max_sequence_length, int current_sequence_length,
+                             const int32_t* bad_words, const int32_t* bad_words_offsets, int bad_words_count, cudaStream_t stream) {
+  int total_elements = batch_beam_size * bad_words_count;
   constexpr int blockSize = 256;
   const int gridSize = (total_elements + blockSize - 1) / blockSize;
 
-  RepetitionPenaltyProcessor<<<gridSize, blockSize, 0, stream>>>(sequences, next_token_scores, max_sequence_length, vocab_size, total_elements, current_sequence_length, repetition_penalty);
+  BadWordsProcessor<<<gridSize, blockSize, 0, stream>>>(sequences, next_token_scores, vocab_size, max_sequence_length, current_sequence_length,
+                                                        bad_words, bad_words_offsets, bad_words_count, total_elements);
 }
 
 }  // namespace cuda
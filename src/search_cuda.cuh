@@ -2,14 +2,37 @@ namespace Generators {
 
 namespace cuda {
 
-struct ArgMaxData {
-  virtual ~ArgMaxData() = default;
+// The stop conditions of Launch_CheckForEOS besides eos, null pointers are unused
+struct StopConditions {
+  const int32_t* row_length_limits{};  // shape (batch_size), the sequence length each row is done at
+  int sequence_length{};               // Once the next tokens are appended
+
+  // The stop sequences back to back, matched with a KMP automaton per row and stop sequence
+  const int32_t* tokens{};
+  const int32_t* offsets{};   // shape (count + 1), where each stop sequence starts in tokens
+  const int32_t* failures{};  // Same layout as tokens, the longest proper prefix of the sequence up to here that is also its suffix
+  int32_t* states{};          // shape (batch_size, count), how much of each stop sequence the row's generated tokens end with
+  int count{};
 };
 
-void Launch_CheckForEOS(int32_t* next_tokens, int next_tokens_count, bool* eos_meet, int eos_token_id, int pad_token_id, bool* done_cpu, cudaStream_t stream);
+void Launch_CheckForEOS(int32_t* next_tokens, int next_tokens_count, bool* eos_meet, int eos_token_id, int pad_token_id, const StopConditions& stop, bool* done_cpu, cudaStream_t stream);
+// The whole greedy step of a row per block, blocks_finished is a zeroed counter the launch leaves at zero
+void LaunchGreedyStep(float* scores, int batch_size, int vocab_size, const int32_t* eos_token_ids, int eos_token_ids_count, int eos_token_id, bool mask_eos,
+                      int32_t* next_tokens, bool* eos_meet, int pad_token_id, const StopConditions& stop, int32_t* sequences, int current_length,
+                      int max_length, int* blocks_finished, bool* done_cpu, cudaStream_t stream);
+// The same on fp16 scores as the model wrote them, see State::logits16_
+void LaunchGreedyStep(uint16_t* scores, int batch_size, int vocab_size, const int32_t* eos_token_ids, int eos_token_ids_count, int eos_token_id, bool mask_eos,
+                      int32_t* next_tokens, bool* eos_meet, int pad_token_id, const StopConditions& stop, int32_t* sequences, int current_length,
+                      int max_length, int* blocks_finished, bool* done_cpu, cudaStream_t stream);
 void LaunchAddProbsKernel(float* log_probs, float* cum_log_probs, const int batch_size, const int num_beams, const int vocab_size, cudaStream_t stream);
+void LaunchDiversityPenalty(float* next_token_scores, int batch_size, int num_beams, int vocab_size, float penalty, cudaStream_t stream);
 void LaunchSetScoreProcessor(float* next_token_scores, int batch_beam_size, int vocab_size, int token, float score, cudaStream_t stream);
-void LaunchRepetitionPenaltyProcessor(const int32_t* sequences, float* next_token_scores, int batch_size, int num_beams, int vocab_size, int max_sequence_length, int current_sequence_length, float repetition_penalty, cudaStream_t stream);
+void LaunchCountTokens(const int32_t* sequences, int32_t* token_counts, int batch_beam_size, int vocab_size, int max_sequence_length, int begin, int end, cudaStream_t stream);
+void LaunchLogitsProcessor(const int32_t* token_counts, const float* logit_bias, const uint32_t* token_mask, float* next_token_scores, int batch_beam_size, int vocab_size,
+                           float repetition_penalty, float frequency_penalty, float presence_penalty, const float* row_penalties, int banned_token, cudaStream_t stream);
+void LaunchNoRepeatNGramProcessor(const int32_t* sequences, float* next_token_scores, int batch_beam_size, int vocab_size, int max_sequence_length, int current_sequence_length, int n, cudaStream_t stream);
+void LaunchBadWordsProcessor(const int32_t* sequences, float* next_token_scores, int batch_beam_size, int vocab_size, int max_sequence_length, int current_sequence_length,
+                             const int32_t* bad_words, const int32_t* bad_words_offsets, int bad_words_count, cudaStream_t stream);
 
 void TopPSampling(int32_t* next_token, float* scores, int size, float p, float temperature);
 }  // namespace cuda
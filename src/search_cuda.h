@@ -14,14 +14,10 @@ struct Search_Cuda : Search {
   RoamingArray<int32_t> GetSequenceLengths() override { return sequence_lengths_; }
   RoamingArray<int32_t> GetSequence(int index) override { return sequences_.GetSequence(index); }
 
-  bool IsDone() const {
-    cudaStreamSynchronize(params_->cuda_stream);
-    return *done_cpu_;
-  }  // TODO: Use an event
+  bool IsDone() const;
   void SetLogits(RoamingArray<float> logits);
 
-  void ApplyMinLength(int min_length) override;
-  void ApplyRepetitionPenalty(float penalty) override;
+  void ProcessLogits() override;
 
   std::span<float> GetScores(int batch_beam_index);
   std::span<float> GetScores();
@@ -38,8 +34,25 @@ struct Search_Cuda : Search {
   gpu_span<float> next_token_scores_;  // shape (beam_size*batch_size, vocab_size)
 
   cuda_host_unique_ptr<bool> done_cpu_;
+  mutable cuda_event_holder done_event_{cudaEventDisableTiming};  // Recorded after the EOS check writes done_cpu_
 
   Sequences_Cuda sequences_;
+
+ private:
+  void UpdateTokenCounts();
+  void UpdateGrammarMask();
+
+  cuda_unique_ptr<int32_t> token_counts_;  // shape (beam_size*batch_size, vocab_size), allocated on first use
+  int token_counts_length_{-1};            // Sequence length the counts were taken at
+
+  cuda_unique_ptr<float> logit_bias_;           // shape (vocab_size), null without a logit_bias
+  cuda_unique_ptr<int32_t> bad_words_;          // Every bad word back to back
+  cuda_unique_ptr<int32_t> bad_words_offsets_;  // shape (bad_words count + 1), where each bad word starts in bad_words_
+
+  cuda_unique_ptr<float> row_penalties_;  // shape (batch_size, 3), only with row_search, see LaunchLogitsProcessor
+
+  cuda_unique_ptr<uint32_t> grammar_mask_;            // shape (batch_size, (vocab_size + 31) / 32), see Grammar::GetMask
+  cuda_host_unique_ptr<uint32_t> grammar_mask_cpu_;  // Staging for grammar_mask_
 };
 
 struct GreedySearch_Cuda : Search_Cuda {
@@ -47,19 +60,50 @@ struct GreedySearch_Cuda : Search_Cuda {
 
   RoamingArray<int32_t> GetNextTokens() override;
   RoamingArray<int32_t> GetNextIndices() override { return gpu_span<int32_t>{}; }
+  RoamingArray<bool> GetDoneRows() override { return eos_meet_; }
 
   void SelectTop() override;
   void SampleTopK(int k, float t) override;
   void SampleTopP(float p, float t) override;
   void SampleTopKTopP(int k, float p, float t) override;
+  void SampleRows() override;
+  void SetLogits16(gpu_span<uint16_t> logits) override { next_token_scores16_ = logits; }
+
+  void AppendTokens(std::span<const int32_t> tokens) override;
+  bool WasDone() const override;
+
+  void Save(std::ostream& file) const override;
+  void Load(std::istream& file) override;
+
+  void LogSoftMax() override;
+  void GatherLogProbs() override;
+  TokenLogProbs GetLogProbs() override;
 
  private:
+  void Sample(int k, float p, float temperature);  // Into next_tokens_, from the fp16 logits when there are any
   void CheckForEOS();
   void AppendNextTokensToSequences();
+  void CheckForMaxLength();
+  void StartTurn();  // Same as GreedySearch_Cpu::StartTurn
 
   cuda_unique_ptr<int32_t> next_tokens_buffer_;
-  std::unique_ptr<cuda::ArgMaxData> argmaxdata_;
+  gpu_span<uint16_t> next_token_scores16_;  // From SetLogits16, read by the next SelectTop or Sample in place of the scores
+
+  cuda::StopConditions stop_;
+  cuda_unique_ptr<int32_t> row_length_limits_;  // Null when every row stops at max_length
+  cuda_unique_ptr<int32_t> stop_tokens_, stop_offsets_, stop_failures_, stop_states_;
+  cuda_unique_ptr<int32_t> eos_token_ids_;  // The model's eos tokens for SelectTop to fold, null with a single one
+  int eos_token_ids_count_{};
+  cuda_unique_ptr<int> greedy_step_blocks_;  // Zeroed counter for cuda::LaunchGreedyStep
   std::unique_ptr<cuda::SamplingData> samplingdata_;
+
+  // top_logprobs, see Search::LogSoftMax. The results are copied to the host after every step.
+  cuda_unique_ptr<float> log_probs_;             // shape (batch_size, vocab_size)
+  cuda_unique_ptr<float> logprob_temperatures_;  // shape (batch_size), 1 for the rows that don't sample
+  cuda_unique_ptr<float> logprobs_;              // shape (batch_size * (1 + top_logprobs)), the next tokens' then the top ones'
+  cuda_unique_ptr<int32_t> top_logprob_tokens_;  // shape (batch_size, top_logprobs)
+  cuda_host_unique_ptr<float> logprobs_cpu_;
+  cuda_host_unique_ptr<int32_t> top_logprob_tokens_cpu_;
 };
 
 struct BeamSearch_Cuda : Search_Cuda {
@@ -73,6 +117,7 @@ struct BeamSearch_Cuda : Search_Cuda {
   void Finalize(size_t num_return_sequences, RoamingArray<int32_t> output, RoamingArray<float> sequence_scores) override;
 
   bool IsDone() const;
+  bool WasDone() const override;
 
  private:
   void AppendNextTokensToSequences();
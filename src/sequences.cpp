@@ -6,6 +6,14 @@
 
 namespace Generators {
 
+static void CountToken(TokenCounts& counts, int32_t token) {
+  auto it = std::lower_bound(counts.begin(), counts.end(), token, [](const auto& count, int32_t t) { return count.first < t; });
+  if (it != counts.end() && it->first == token)
+    it->second++;
+  else
+    counts.insert(it, {token, 1});
+}
+
 Sequences::Sequences(std::span<const int32_t> input_sequences, int batch_size, int beam_size, int max_length)
     : batch_beam_size_{batch_size * beam_size},
       max_length_{max_length},
@@ -17,27 +25,69 @@ Sequences::Sequences(std::span<const int32_t> input_sequences, int batch_size, i
     sequences_buffer_ = std::make_unique<int32_t[]>(sequences_size);
     sequences_ = cpu_span<int32_t>(sequences_buffer_.get(), sequences_size);
   } else {
-    sequences_buffer_ = std::make_unique<int32_t[]>(2 * sequences_size);
+    sequences_buffer_ = std::make_unique<int32_t[]>(3 * sequences_size);
     sequences_ = cpu_span<int32_t>(sequences_buffer_.get(), sequences_size);
-    sequences_next_ = cpu_span<int32_t>(sequences_buffer_.get() + sequences_size, sequences_size);
+    parents_ = cpu_span<int32_t>(sequences_buffer_.get() + sequences_size, sequences_size);
+    materialized_ = cpu_span<int32_t>(sequences_buffer_.get() + 2 * sequences_size, sequences_size);
+    materialized_lengths_.resize(batch_beam_size_, -1);
   }
 
   // The original inputs are not expanded, this expands them in place into the sequences
+  token_counts_.resize(batch_beam_size_);
   for (size_t batch = 0; batch < batch_size; batch++) {
     for (size_t beam = 0; beam < beam_size; beam++) {
+      auto batch_beam_index = batch * beam_size + beam;
+      auto& token_counts = token_counts_[batch_beam_index];
       for (int j = 0; j < current_length_; j++) {
-        sequences_[(batch * beam_size + beam) * max_length + j] =
-            static_cast<int32_t>(input_sequences[batch * current_length_ + j]);
+        auto token = static_cast<int32_t>(input_sequences[batch * current_length_ + j]);
+        sequences_[batch_beam_index * max_length + j] = token;
+        if (beam_size > 1)
+          parents_[batch_beam_index * max_length + j] = static_cast<int32_t>(batch_beam_index);
+        CountToken(token_counts, token);
       }
     }
   }
+  if (beam_size > 1)
+    token_counts_next_.resize(batch_beam_size_);
 }
 
 cpu_span<int32_t> Sequences::GetSequence(int batch_beam_index) {
-  auto span = sequences_.subspan(batch_beam_index * max_length_, current_length_);
+  if (parents_.empty()) {
+    auto span = sequences_.subspan(batch_beam_index * max_length_, current_length_);
+    return cpu_span<int32_t>{span.data(), span.size()};
+  }
+
+  auto span = materialized_.subspan(batch_beam_index * max_length_, current_length_);
+  if (materialized_lengths_[batch_beam_index] != current_length_) {
+    CopySequence(batch_beam_index, current_length_, span);
+    materialized_lengths_[batch_beam_index] = current_length_;
+  }
   return cpu_span<int32_t>{span.data(), span.size()};
 }
 
+cpu_span<int32_t> Sequences::GetSequences() {
+  if (parents_.empty())
+    return sequences_;
+
+  for (int i = 0; i < batch_beam_size_; i++)
+    GetSequence(i);
+  return materialized_;
+}
+
+void Sequences::CopySequence(int batch_beam_index, int length, std::span<int32_t> target) const {
+  assert(length <= current_length_ && target.size() >= static_cast<size_t>(length));
+  if (parents_.empty()) {
+    std::copy_n(sequences_.begin() + batch_beam_index * max_length_, length, target.begin());
+    return;
+  }
+
+  // Back from the last token, each one's parent is the row holding the token before it
+  for (int i = length - 1; i >= 0; i--) {
+    target[i] = sequences_[batch_beam_index * max_length_ + i];
+    batch_beam_index = parents_[batch_beam_index * max_length_ + i];
+  }
+}
+
 int Sequences::GetSequenceLength() const {
   return current_length_;
 }
@@ -45,18 +95,18 @@ int Sequences::GetSequenceLength() const {
 void Sequences::AppendNextTokenToSequences(std::span<const int32_t> batch_beam_indices, std::span<const int32_t> batch_beam_next_tokens) {
   for (ptrdiff_t i = 0; i < batch_beam_size_; i++) {
     int batch_beam_index = batch_beam_indices[i];
-    std::span<const int32_t> source = sequences_.subspan(batch_beam_index * max_length_, current_length_);
-    std::span<int32_t> target = sequences_next_.subspan(i * max_length_, current_length_);
-    copy(source, target);
 
-    // Append next token to each beam.
-    sequences_next_[i * max_length_ + current_length_] = batch_beam_next_tokens[i];
+    // Append next token to each beam, and the beam it continues
+    sequences_[i * max_length_ + current_length_] = batch_beam_next_tokens[i];
+    parents_[i * max_length_ + current_length_] = batch_beam_index;
+
+    token_counts_next_[i] = token_counts_[batch_beam_index];
+    CountToken(token_counts_next_[i], batch_beam_next_tokens[i]);
   }
 
   ++current_length_;
 
-  // Rotate buffer for next round.
-  std::swap(sequences_, sequences_next_);
+  std::swap(token_counts_, token_counts_next_);
 }
 
 void Sequences::AppendNextTokenToSequences(std::span<const int32_t> next_tokens) {
@@ -68,9 +118,18 @@ void Sequences::AppendNextTokenToSequences(std::span<const int32_t> next_tokens)
   // Append next token to each sequence.
   for (int i = 0; i < batch_beam_size_; i++) {
     sequences_[i * max_length_ + current_length_] = next_tokens[i];
+    CountToken(token_counts_[i], next_tokens[i]);
   }
 
   ++current_length_;
 }
 
+void Sequences::AppendTokens(std::span<const int32_t> tokens) {
+  assert(batch_beam_size_ == 1 && current_length_ + static_cast<int>(tokens.size()) <= max_length_);
+  std::copy(tokens.begin(), tokens.end(), sequences_.begin() + current_length_);
+  current_length_ += static_cast<int>(tokens.size());
+  for (auto token : tokens)
+    CountToken(token_counts_[0], token);
+}
+
 }  // namespace Generators
@@ -1,13 +1,26 @@
 #pragma once
 namespace Generators {
 
+// (token, count) pairs sorted by token. A flat vector as beam search copies the counts of every beam every step, which
+// then reuses the capacity of the target instead of allocating a node per distinct token.
+using TokenCounts = std::vector<std::pair<int32_t, int32_t>>;
+
 // This class keeps track of sequences generated.
+//
+// Beam search keeps them as a tree: every step stores each beam's new token and the beam it continues, so reordering
+// the beams costs O(batch_beam_size) per step instead of a copy of every sequence. A sequence is only put together,
+// by walking the tree back from its last token, when it's asked for.
 struct Sequences {
   Sequences(std::span<const int32_t> input_sequence, int batch_size, int beam_size, int max_length);
 
   // Returns a sequence of word IDs for a given beam index ( beam_index < batch_beam_size).
   cpu_span<int32_t> GetSequence(int batch_beam_index);
-  cpu_span<int32_t> GetSequences() { return sequences_; }
+  cpu_span<int32_t> GetSequences();  // shape (batch_beam_size, max_length), the first GetSequenceLength() are valid
+
+  // Copies the first length tokens of a beam's sequence as it was when the sequence had that length. The tree never
+  // changes what's behind the current length, so a (batch_beam_index, length) pair stays a valid reference to the
+  // sequence, which is how beam search keeps its finished hypotheses.
+  void CopySequence(int batch_beam_index, int length, std::span<int32_t> target) const;
 
   // Returns current sequence length.
   int GetSequenceLength() const;
@@ -19,14 +32,26 @@ struct Sequences {
   // Used by Greedy search:
   void AppendNextTokenToSequences(std::span<const int32_t> next_tokens);
 
+  // Multi-turn: appends several tokens to a single sequence (batch_beam_size 1)
+  void AppendTokens(std::span<const int32_t> tokens);
+
+  // How often every distinct token occurs in a sequence, kept up to date as tokens are appended so the penalties cost
+  // O(unique tokens) rather than a scan of the sequence
+  const TokenCounts& GetTokenCounts(int batch_beam_index) const { return token_counts_[batch_beam_index]; }
+
  private:
   std::unique_ptr<int32_t[]> sequences_buffer_;
 
-  // Two buffers of shape (batch_size, num_beams, max_seq_length) to store sequences.
-  // At each time, there is only one buffer is active. The other one will be active in next token.
-  // Each AppendNextTokenToSequences call will trigger a rotation of active buffer.
+  // Shape (batch_size, num_beams, max_seq_length). Greedy search appends to the sequences in place. For beam search it's
+  // the tree: position i of a row is the token the row's beam appended at length i, and parents_ at the same place is
+  // the row it continued, the row itself for the prompt.
   cpu_span<int32_t> sequences_;
-  cpu_span<int32_t> sequences_next_;  // This only exists for beam search, to allow for the easy reordering of sequences
+  cpu_span<int32_t> parents_;              // Beam search only
+  cpu_span<int32_t> materialized_;         // Beam search only, the sequences put together by GetSequence
+  std::vector<int> materialized_lengths_;  // Beam search only, the length each row of materialized_ was put together at
+
+  std::vector<TokenCounts> token_counts_;       // shape (batch_beam_size)
+  std::vector<TokenCounts> token_counts_next_;  // Beam search only, the counts being reordered into
 
   int batch_beam_size_;
   int max_length_;
@@ -6,7 +6,9 @@
 
 namespace Generators {
 namespace cuda {
-void Launch_ExpandInputSequences(std::span<const int32_t> input_sequences, std::span<int32_t> sequences, int batch_size, int beam_size, int current_length, int max_length, cudaStream_t stream);
+void Launch_ExpandInputSequences(std::span<const int32_t> input_sequences, std::span<int32_t> sequences, std::span<int32_t> parents, int batch_size, int beam_size, int current_length, int max_length, cudaStream_t stream);
+void Launch_MaterializeSequences(std::span<const int32_t> tokens, std::span<const int32_t> parents, std::span<int32_t> sequences, int batch_beam_size, int current_length, int max_length, cudaStream_t stream);
+void Launch_ExtendMaterializedSequences(std::span<const int32_t> tokens, std::span<const int32_t> parents, std::span<const int32_t> previous, std::span<int32_t> sequences, int batch_beam_size, int current_length, int max_length, cudaStream_t stream);
 void Launch_AppendNextTokenToSequences(std::span<const int32_t> next_tokens, std::span<int32_t> sequences, int batch_beam_size, int current_length, int max_length, cudaStream_t stream);
 }  // namespace cuda
 
@@ -22,9 +24,11 @@ Sequences_Cuda::Sequences_Cuda(std::span<const int32_t> input_sequences, int bat
     sequences_buffer_ = CudaMallocArray<int32_t>(sequences_size);
     sequences_ = gpu_span<int32_t>(sequences_buffer_.get(), sequences_size);
   } else {
-    sequences_buffer_ = CudaMallocArray<int32_t>(2 * sequences_size);
+    sequences_buffer_ = CudaMallocArray<int32_t>(4 * sequences_size);
     sequences_ = gpu_span<int32_t>(sequences_buffer_.get(), sequences_size);
-    sequences_next_ = gpu_span<int32_t>(sequences_buffer_.get() + sequences_size, sequences_size);
+    parents_ = gpu_span<int32_t>(sequences_buffer_.get() + sequences_size, sequences_size);
+    materialized_ = gpu_span<int32_t>(sequences_buffer_.get() + 2 * sequences_size, sequences_size);
+    materialized_previous_ = gpu_span<int32_t>(sequences_buffer_.get() + 3 * sequences_size, sequences_size);
   }
 
   // TODO: input_sequences will be in cuda memory in the future, for now make a temp copy
@@ -33,15 +37,31 @@ Sequences_Cuda::Sequences_Cuda(std::span<const int32_t> input_sequences, int bat
   auto input_sequences_temp = CudaMallocArray<int32_t>(input_sequences.size(), &input_sequences_gpu);
   cudaMemcpyAsync(input_sequences_gpu.data(), input_sequences.data(), input_sequences.size_bytes(), cudaMemcpyHostToDevice, stream);
 
-  cuda::Launch_ExpandInputSequences(input_sequences_gpu, sequences_, batch_size, beam_size, current_length_, max_length, stream_);
+  cuda::Launch_ExpandInputSequences(input_sequences_gpu, sequences_, parents_, batch_size, beam_size, current_length_, max_length, stream_);
   cudaStreamSynchronize(stream);  // Until we remove the todo above, wait for this to complete as input_sequences_gpu is on the stack
 }
 
 RoamingArray<int32_t> Sequences_Cuda::GetSequence(int batch_beam_index) {
-  auto span = sequences_.subspan(batch_beam_index * max_length_, current_length_);
+  auto span = GetSequences().subspan(batch_beam_index * max_length_, current_length_);
   return gpu_span<int32_t>{span.data(), span.size()};
 }
 
+gpu_span<int32_t> Sequences_Cuda::GetSequences() {
+  if (parents_.empty())
+    return sequences_;
+
+  // The penalties ask every step, so the sequences are usually one token behind and are extended from the last ones
+  if (materialized_length_ == current_length_ - 1) {
+    std::swap(materialized_, materialized_previous_);
+    cuda::Launch_ExtendMaterializedSequences(sequences_, parents_, materialized_previous_, materialized_, batch_beam_size_, current_length_, max_length_, stream_);
+    materialized_length_ = current_length_;
+  } else if (materialized_length_ != current_length_) {
+    cuda::Launch_MaterializeSequences(sequences_, parents_, materialized_, batch_beam_size_, current_length_, max_length_, stream_);
+    materialized_length_ = current_length_;
+  }
+  return materialized_;
+}
+
 int Sequences_Cuda::GetSequenceLength() const {
   return current_length_;
 }
@@ -57,11 +77,14 @@ void Sequences_Cuda::AppendNextTokenToSequences(std::span<const int32_t> next_to
   ++current_length_;
 }
 
+void Sequences_Cuda::AppendTokens(std::span<const int32_t> tokens) {
+  assert(batch_beam_size_ == 1 && current_length_ + static_cast<int>(tokens.size()) <= max_length_);
+  cudaMemcpyAsync(sequences_.data() + current_length_, tokens.data(), tokens.size_bytes(), cudaMemcpyHostToDevice, stream_);
+  current_length_ += static_cast<int>(tokens.size());
+}
+
 void Sequences_Cuda::AfterDeviceAppendedNextToken() {
   ++current_length_;
-
-  // Rotate buffer for next round.
-  std::swap(sequences_, sequences_next_);
 }
 
 }  // namespace Generators
\ No newline at end of file
@@ -5,20 +5,64 @@
 namespace Generators {
 namespace cuda {
 
-__global__ void ExpandInputSequences(const int32_t* input_sequences, int32_t* sequences, int batch_size, int beam_size, int current_length, int max_length) {
+__global__ void ExpandInputSequences(const int32_t* input_sequences, int32_t* sequences, int32_t* parents, int batch_size, int beam_size, int current_length, int max_length) {
   // The original inputs are not expanded, this expands them in place into the sequences
   for (size_t batch = 0; batch < batch_size; batch++) {
     for (size_t beam = 0; beam < beam_size; beam++) {
+      size_t batch_beam_index = batch * beam_size + beam;
       for (int j = 0; j < current_length; j++) {
-        sequences[(batch * beam_size + beam) * max_length + j] =
+        sequences[batch_beam_index * max_length + j] =
             static_cast<int32_t>(input_sequences[batch * current_length + j]);
+        if (parents)  // Beam search, the prompt of every row continues the row itself
+          parents[batch_beam_index * max_length + j] = static_cast<int32_t>(batch_beam_index);
       }
     }
   }
 }
 
-void Launch_ExpandInputSequences(std::span<const int32_t> input_sequences, std::span<int32_t> sequences, int batch_size, int beam_size, int current_length, int max_length, cudaStream_t stream) {
-  ExpandInputSequences<<<1, 1, 0, stream>>>(input_sequences.data(), sequences.data(), batch_size, beam_size, current_length, max_length);
+void Launch_ExpandInputSequences(std::span<const int32_t> input_sequences, std::span<int32_t> sequences, std::span<int32_t> parents, int batch_size, int beam_size, int current_length, int max_length, cudaStream_t stream) {
+  ExpandInputSequences<<<1, 1, 0, stream>>>(input_sequences.data(), sequences.data(), parents.data(), batch_size, beam_size, current_length, max_length);
+}
+
+// One thread per row walks the tree back from the row's last token, each token's parent is the row holding the one
+// before it
+__global__ void MaterializeSequences(const int32_t* tokens, const int32_t* parents, int32_t* sequences, int batch_beam_size, int current_length, int max_length) {
+  int row = blockIdx.x * blockDim.x + threadIdx.x;
+  if (row >= batch_beam_size)
+    return;
+
+  int32_t* target = sequences + row * max_length;
+  int source = row;
+  for (int i = current_length - 1; i >= 0; i--) {
+    target[i] = tokens[source * max_length + i];
+    source = parents[source * max_length + i];
+  }
+}
+
+void Launch_MaterializeSequences(std::span<const int32_t> tokens, std::span<const int32_t> parents, std::span<int32_t> sequences, int batch_beam_size, int current_length, int max_length, cudaStream_t stream) {
+  const int block_size = 128;
+  MaterializeSequences<<<(batch_beam_size + block_size - 1) / block_size, block_size, 0, stream>>>(tokens.data(), parents.data(), sequences.data(), batch_beam_size, current_length, max_length);
+}
+
+// The sequences one token on from previous, materialized at current_length - 1: every row is a copy of the row it
+// continues, followed by its new token. One thread per token, so unlike MaterializeSequences nothing walks the tree.
+__global__ void ExtendMaterializedSequences(const int32_t* tokens, const int32_t* parents, const int32_t* previous, int32_t* sequences, int current_length, int max_length) {
+  int row = blockIdx.y;
+  int i = blockIdx.x * blockDim.x + threadIdx.x;
+  if (i >= current_length)
+    return;
+
+  int last = current_length - 1;
+  if (i == last)
+    sequences[row * max_length + i] = tokens[row * max_length + i];
+  else
+    sequences[row * max_length + i] = previous[parents[row * max_length + last] * max_length + i];
+}
+
+void Launch_ExtendMaterializedSequences(std::span<const int32_t> tokens, std::span<const int32_t> parents, std::span<const int32_t> previous, std::span<int32_t> sequences, int batch_beam_size, int current_length, int max_length, cudaStream_t stream) {
+  const int block_size = 256;
+  dim3 grid((current_length + block_size - 1) / block_size, batch_beam_size);
+  ExtendMaterializedSequences<<<grid, block_size, 0, stream>>>(tokens.data(), parents.data(), previous.data(), sequences.data(), current_length, max_length);
 }
 
 __global__ void AppendNextTokenToSequences(const int32_t* next_tokens, int32_t* sequences, int batch_beam_size, int current_length, int max_length) {
@@ -1,17 +1,24 @@
 #pragma once
 namespace Generators {
 
-// This class keeps track of sequences generated.
+// This class keeps track of sequences generated. Beam search keeps them as a tree like Sequences does, appended to by
+// the beam scorer, and puts them together on the device when they're asked for.
 struct Sequences_Cuda {
   Sequences_Cuda(std::span<const int32_t> input_sequences, int batch_size, int beam_size, int max_length, cudaStream_t stream);
 
   // Returns a sequence of word IDs for a given beam index ( beam_index < batch_beam_size).
   RoamingArray<int32_t> GetSequence(int batch_beam_index);
-  gpu_span<int32_t> GetSequences() { return sequences_; }
-  gpu_span<int32_t> GetNextSequences() { return sequences_next_; }
+  gpu_span<int32_t> GetSequences();  // shape (batch_beam_size, max_length), the first GetSequenceLength() are valid
+
+  // Beam search: the tree's tokens and the rows they continue, see Sequences::sequences_
+  gpu_span<int32_t> GetBeamTokens() { return sequences_; }
+  gpu_span<int32_t> GetBeamParents() { return parents_; }
 
   void AppendNextTokenToSequences(std::span<const int32_t> next_tokens);
 
+  // Multi-turn: appends several host tokens to a single sequence (batch_beam_size 1)
+  void AppendTokens(std::span<const int32_t> tokens);
+
   // Returns current sequence length.
   int GetSequenceLength() const;
   void AfterDeviceAppendedNextToken();
@@ -20,11 +27,12 @@ struct Sequences_Cuda {
   cuda_unique_ptr<int32_t> sequences_buffer_;
   cudaStream_t stream_;
 
-  // Two buffers of shape (batch_size, num_beams, max_seq_length) to store sequences.
-  // At each time, there is only one buffer is active. The other one will be active in next token.
-  // Each AppendNextTokenToSequences call will trigger a rotation of active buffer.
+  // Shape (batch_size, num_beams, max_seq_length), the sequences for greedy search and the tree for beam search
   gpu_span<int32_t> sequences_;
-  gpu_span<int32_t> sequences_next_;  // This only exists for beam search, to allow for the easy reordering of sequences
+  gpu_span<int32_t> parents_;       // Beam search only
+  gpu_span<int32_t> materialized_;  // Beam search only, the sequences put together by GetSequences
+  gpu_span<int32_t> materialized_previous_;  // Beam search only, the ones before, extended by a step into materialized_
+  int materialized_length_{-1};     // The length materialized_ was put together at
 
   int batch_beam_size_;
   int max_length_;
@@ -38,6 +38,15 @@ std::unique_ptr<T[]> AllocateArray(size_t count, std::span<T>* p_span = nullptr)
   return std::unique_ptr<T[]>{p};
 }
 
+// The copies between host and device and the device allocations made by this library on the current thread, what
+// onnxruntime allocates and copies itself isn't included. The generator metrics are made from the deltas of a step.
+struct TransferCounters {
+  uint64_t host_to_device_bytes{};
+  uint64_t device_to_host_bytes{};
+  uint64_t device_allocations{};
+};
+inline thread_local TransferCounters g_transfer_counters;
+
 #if USE_CUDA
 struct CudaDeleter {
   void operator()(void* p) {
@@ -52,6 +61,7 @@ template <typename T>
 cuda_unique_ptr<T> CudaMallocArray(size_t count, gpu_span<T>* p_span = nullptr) {
   T* p;
   ::cudaMalloc(&p, sizeof(T) * count);
+  g_transfer_counters.device_allocations++;
   if (p_span)
     *p_span = gpu_span<T>(p, count);
   return cuda_unique_ptr<T>{p};
@@ -70,6 +80,7 @@ template <typename T>
 cuda_host_unique_ptr<T> CudaMallocHostArray(size_t count, cpu_span<T>* p_span = nullptr) {
   T* p;
   ::cudaMallocHost(&p, sizeof(T) * count);
+  g_transfer_counters.device_allocations++;
   if (p_span)
     *p_span = cpu_span<T>(p, count);
   return cuda_host_unique_ptr<T>{p};
@@ -161,6 +172,7 @@ struct RoamingArray {
     if (cpu_.empty() && !device_.empty()) {
       cpu_owner_ = CudaMallocHostArray<T>(device_.size(), &cpu_);
       cudaMemcpy(cpu_.data(), device_.data(), cpu_.size_bytes(), cudaMemcpyDeviceToHost);
+      g_transfer_counters.device_to_host_bytes += cpu_.size_bytes();
     }
 
     return cpu_;
@@ -170,18 +182,23 @@ struct RoamingArray {
     if (device_.empty() && !cpu_.empty()) {
       device_owner_ = CudaMallocArray<T>(cpu_.size(), &device_);
       cudaMemcpy(device_.data(), cpu_.data(), cpu_.size_bytes(), cudaMemcpyHostToDevice);
+      g_transfer_counters.host_to_device_bytes += cpu_.size_bytes();
     }
     return device_;
   }
 
   void FlushCPUChanges() {
-    if (!device_.empty())
+    if (!device_.empty()) {
       cudaMemcpy(device_.data(), cpu_.data(), cpu_.size_bytes(), cudaMemcpyHostToDevice);
+      g_transfer_counters.host_to_device_bytes += cpu_.size_bytes();
+    }
   }
 
   void FlushGPUChanges() {
-    if (!cpu_.empty())
+    if (!cpu_.empty()) {
       cudaMemcpy(cpu_.data(), device_.data(), cpu_.size_bytes(), cudaMemcpyDeviceToHost);
+      g_transfer_counters.device_to_host_bytes += cpu_.size_bytes();
+    }
   }
 
   void Assign(const RoamingArray<T>& v) {
@@ -189,6 +206,16 @@ struct RoamingArray {
     device_ = v.device_;
   }
 
+  // The elements from offset on, a view wherever they are so a later GetCPU/GetGPU copies only those
+  RoamingArray<T> Tail(size_t offset) const {
+    RoamingArray<T> v;
+    if (!cpu_.empty())
+      v.cpu_ = cpu_span<T>{cpu_.data() + offset, cpu_.size() - offset};
+    if (!device_.empty())
+      v.device_ = gpu_span<T>{device_.data() + offset, device_.size() - offset};
+    return v;
+  }
+
   cpu_span<T> cpu_;
   cuda_host_unique_ptr<T> cpu_owner_;
   gpu_span<T> device_;
@@ -221,6 +248,10 @@ struct RoamingArray {
     cpu_ = v.cpu_;
   }
 
+  RoamingArray<T> Tail(size_t offset) const {
+    return cpu_span<T>{cpu_.data() + offset, cpu_.size() - offset};
+  }
+
   cpu_span<T> cpu_;
 };
 #endif
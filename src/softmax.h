@@ -2,7 +2,13 @@
 
 namespace Generators {
 
-void softmax(std::span<float> values);
-void log_softmax(std::span<float> values);
+// Over one row of scores, each divided by temperature first. Vectorized with the widest of AVX-512 or AVX2 the CPU has,
+// checked once at runtime, or NEON on ARM64, and shared by the samplers, the logprob APIs and scoring. A NaN in the row
+// makes every softmax and log softmax output NaN, and log_sum_exp NaN.
+void softmax(std::span<float> values, float temperature = 1.0f);
+void log_softmax(std::span<float> values, float temperature = 1.0f);
+void log_softmax(std::span<const float> input, std::span<float> output, float temperature = 1.0f);  // input is left as it is
+float log_sum_exp(std::span<const float> values);  // log(sum(exp(values))), the log softmax of x is x minus this
+size_t argmax(std::span<const float> values);      // The index of the first largest value, like std::max_element
 
 }  // namespace Generators
@@ -1,22 +1,239 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
 #include "generators.h"
+#include "softmax.h"
+#include "cpu_features.h"
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define GENAI_SOFTMAX_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// On x86-64 the kernels are compiled for AVX-512 and AVX2 with FMA next to the baseline ones, whatever the build
+// targets, and the widest the CPU has is picked the first time (see GetCpuFeatures). On ARM64 they use NEON, which
+// every such CPU has. Every kernel is written once over the Ops of a vector width (softmax_kernels.h) and the
+// remainder of a row goes through ScalarOps.
+//
+// Exp is the Cephes expf: x = n ln2 + r with |r| <= ln2 / 2, a degree 5 polynomial for exp(r) and n added to the
+// exponent bits, within 2 ulp of std::exp. Below kExpMin it's 0, so the banned tokens (lowest float) get nothing, and
+// a NaN stays a NaN: the clamps keep it as their second operand.
+//
+// Clang and GCC compile a region for an instruction set with a pragma, MSVC compiles the intrinsics of any of them.
+#if defined(__clang__)
+#define GENAI_TARGET_PUSH(isa) _Pragma(GENAI_STRINGIFY(clang attribute push(__attribute__((target(isa))), apply_to = function)))
+#define GENAI_TARGET_POP _Pragma("clang attribute pop")
+#elif defined(__GNUC__)
+#define GENAI_TARGET_PUSH(isa) _Pragma("GCC push_options") _Pragma(GENAI_STRINGIFY(GCC target(isa)))
+#define GENAI_TARGET_POP _Pragma("GCC pop_options")
+#else
+#define GENAI_TARGET_PUSH(isa)
+#define GENAI_TARGET_POP
+#endif
+#define GENAI_STRINGIFY(x) #x
 
 namespace Generators {
 
-void softmax(std::span<float> values) {
-  float max = *std::max_element(values.data(), values.data() + values.size());
-  std::transform(values.begin(), values.end(), values.begin(), [max](float v) { return std::exp(v - max); });
-  float sum = std::accumulate(values.begin(), values.end(), 0.0f);
-  std::transform(values.begin(), values.end(), values.begin(), [sum](float v) { return v / sum; });
+namespace {
+
+constexpr float kExpMin = -87.3365f;  // 2^-126, the smallest normal float
+constexpr float kExpMax = 88.0f;      // n stays at most 127
+constexpr float kLog2e = 1.44269504088896341f;
+constexpr float kLn2Hi = 0.693359375f;
+constexpr float kLn2Lo = -2.12194440e-4f;
+constexpr float kExpP[] = {1.9875691500e-4f, 1.3981999507e-3f, 8.3334519073e-3f, 4.1665795894e-2f, 1.6666665459e-1f, 5.0000001201e-1f};
+
+struct ScalarOps {
+  using V = float;
+  static constexpr size_t kWidth = 1;
+  static V Load(const float* p) { return *p; }
+  static void Store(float* p, V v) { *p = v; }
+  static V Set(float v) { return v; }
+  static V Add(V a, V b) { return a + b; }
+  static V Sub(V a, V b) { return a - b; }
+  static V Mul(V a, V b) { return a * b; }
+  static V MulAdd(V a, V b, V c) { return a * b + c; }
+  static V Max(V a, V b) { return std::max(a, b); }
+  static bool AnyGreater(V a, V b) { return a > b; }
+  static bool AnyEqual(V a, V b) { return a == b; }
+  static float ReduceMax(V v) { return v; }
+  static float ReduceAdd(V v) { return v; }
+  static V Exp(V x) { return x < kExpMin ? 0.0f : std::exp(std::min(x, kExpMax)); }
+};
+
+// Folds the running (max, sum of exp(x - max)) of some values into another
+void CombineMaxSum(float& max, float& sum, float other_max, float other_sum) {
+  if (other_max > max) {
+    sum = sum * ScalarOps::Exp(max - other_max) + other_sum;
+    max = other_max;
+  } else {
+    sum += other_sum * ScalarOps::Exp(other_max - max);
+  }
 }
 
-void log_softmax(std::span<float> values) {
-  float max = *std::max_element(values.data(), values.data() + values.size());
-  std::vector<float> scaled(values.begin(), values.end());
-  std::transform(values.begin(), values.end(), scaled.begin(), [max](float v) { return std::exp(v - max); });
+namespace scalar {
+using SimdOps = ScalarOps;
+#include "softmax_kernels.h"
+}  // namespace scalar
+
+#if GENAI_SOFTMAX_X86
+GENAI_TARGET_PUSH("avx2,fma")
+namespace avx2 {
+struct Ops {
+  using V = __m256;
+  static constexpr size_t kWidth = 8;
+  static V Load(const float* p) { return _mm256_loadu_ps(p); }
+  static void Store(float* p, V v) { _mm256_storeu_ps(p, v); }
+  static V Set(float v) { return _mm256_set1_ps(v); }
+  static V Add(V a, V b) { return _mm256_add_ps(a, b); }
+  static V Sub(V a, V b) { return _mm256_sub_ps(a, b); }
+  static V Mul(V a, V b) { return _mm256_mul_ps(a, b); }
+  static V MulAdd(V a, V b, V c) { return _mm256_fmadd_ps(a, b, c); }
+  static V Max(V a, V b) { return _mm256_max_ps(a, b); }
+  static bool AnyGreater(V a, V b) { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_GT_OQ)) != 0; }
+  static bool AnyEqual(V a, V b) { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_EQ_OQ)) != 0; }
+  static float ReduceMax(V v) {
+    __m128 m = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    return _mm_cvtss_f32(_mm_max_ss(m, _mm_shuffle_ps(m, m, 1)));
+  }
+  static float ReduceAdd(V v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 1)));
+  }
+  static V Exp(V x) {
+    const V underflow = _mm256_cmp_ps(x, Set(kExpMin), _CMP_LT_OQ);
+    x = _mm256_min_ps(Set(kExpMax), _mm256_max_ps(Set(kExpMin), x));
+    const V n = _mm256_round_ps(Mul(x, Set(kLog2e)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    const V r = _mm256_fnmadd_ps(n, Set(kLn2Lo), _mm256_fnmadd_ps(n, Set(kLn2Hi), x));
+    V y = Set(kExpP[0]);
+    for (int i = 1; i < 6; i++)
+      y = MulAdd(y, r, Set(kExpP[i]));
+    y = MulAdd(y, Mul(r, r), Add(r, Set(1.0f)));
+    const __m256i exponent = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_andnot_ps(underflow, Mul(y, _mm256_castsi256_ps(exponent)));
+  }
+};
+using SimdOps = Ops;
+#include "softmax_kernels.h"
+}  // namespace avx2
+GENAI_TARGET_POP
+
+GENAI_TARGET_PUSH("avx512f,avx2,fma")
+namespace avx512 {
+struct Ops {
+  using V = __m512;
+  static constexpr size_t kWidth = 16;
+  static V Load(const float* p) { return _mm512_loadu_ps(p); }
+  static void Store(float* p, V v) { _mm512_storeu_ps(p, v); }
+  static V Set(float v) { return _mm512_set1_ps(v); }
+  static V Add(V a, V b) { return _mm512_add_ps(a, b); }
+  static V Sub(V a, V b) { return _mm512_sub_ps(a, b); }
+  static V Mul(V a, V b) { return _mm512_mul_ps(a, b); }
+  static V MulAdd(V a, V b, V c) { return _mm512_fmadd_ps(a, b, c); }
+  static V Max(V a, V b) { return _mm512_max_ps(a, b); }
+  static bool AnyGreater(V a, V b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ) != 0; }
+  static bool AnyEqual(V a, V b) { return _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ) != 0; }
+  static float ReduceMax(V v) { return _mm512_reduce_max_ps(v); }
+  static float ReduceAdd(V v) { return _mm512_reduce_add_ps(v); }
+  static V Exp(V x) {
+    const __mmask16 underflow = _mm512_cmp_ps_mask(x, Set(kExpMin), _CMP_LT_OQ);
+    x = _mm512_min_ps(Set(kExpMax), _mm512_max_ps(Set(kExpMin), x));
+    const V n = _mm512_roundscale_ps(Mul(x, Set(kLog2e)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    const V r = _mm512_fnmadd_ps(n, Set(kLn2Lo), _mm512_fnmadd_ps(n, Set(kLn2Hi), x));
+    V y = Set(kExpP[0]);
+    for (int i = 1; i < 6; i++)
+      y = MulAdd(y, r, Set(kExpP[i]));
+    y = MulAdd(y, Mul(r, r), Add(r, Set(1.0f)));
+    const __m512i exponent = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(n), _mm512_set1_epi32(127)), 23);
+    return _mm512_maskz_mov_ps(static_cast<__mmask16>(~underflow), Mul(y, _mm512_castsi512_ps(exponent)));
+  }
+};
+using SimdOps = Ops;
+#include "softmax_kernels.h"
+}  // namespace avx512
+GENAI_TARGET_POP
+#elif defined(__aarch64__)
+namespace neon {
+struct Ops {
+  using V = float32x4_t;
+  static constexpr size_t kWidth = 4;
+  static V Load(const float* p) { return vld1q_f32(p); }
+  static void Store(float* p, V v) { vst1q_f32(p, v); }
+  static V Set(float v) { return vdupq_n_f32(v); }
+  static V Add(V a, V b) { return vaddq_f32(a, b); }
+  static V Sub(V a, V b) { return vsubq_f32(a, b); }
+  static V Mul(V a, V b) { return vmulq_f32(a, b); }
+  static V MulAdd(V a, V b, V c) { return vfmaq_f32(c, a, b); }
+  static V Max(V a, V b) { return vmaxq_f32(a, b); }
+  static bool AnyGreater(V a, V b) { return vmaxvq_u32(vcgtq_f32(a, b)) != 0; }
+  static bool AnyEqual(V a, V b) { return vmaxvq_u32(vceqq_f32(a, b)) != 0; }
+  static float ReduceMax(V v) { return vmaxvq_f32(v); }
+  static float ReduceAdd(V v) { return vaddvq_f32(v); }
+  static V Exp(V x) {
+    const uint32x4_t underflow = vcltq_f32(x, Set(kExpMin));
+    x = vminq_f32(vmaxq_f32(x, Set(kExpMin)), Set(kExpMax));
+    const V n = vrndnq_f32(Mul(x, Set(kLog2e)));
+    const V r = vfmsq_f32(vfmsq_f32(x, n, Set(kLn2Hi)), n, Set(kLn2Lo));
+    V y = Set(kExpP[0]);
+    for (int i = 1; i < 6; i++)
+      y = MulAdd(y, r, Set(kExpP[i]));
+    y = MulAdd(y, Mul(r, r), Add(r, Set(1.0f)));
+    const int32x4_t exponent = vshlq_n_s32(vaddq_s32(vcvtq_s32_f32(n), vdupq_n_s32(127)), 23);
+    return vbslq_f32(underflow, Set(0.0f), Mul(y, vreinterpretq_f32_s32(exponent)));
+  }
+};
+using SimdOps = Ops;
+#include "softmax_kernels.h"
+}  // namespace neon
+#endif
+
+struct Kernels {
+  decltype(&scalar::Softmax) softmax;
+  decltype(&scalar::LogSoftmax) log_softmax;
+  decltype(&scalar::Argmax) argmax;
+  decltype(&scalar::LogSumExp) log_sum_exp;
+};
+
+#define GENAI_KERNELS(isa) Kernels{&isa::Softmax, &isa::LogSoftmax, &isa::Argmax, &isa::LogSumExp}
+
+const Kernels& GetKernels() {
+  static const Kernels kernels = [] {
+#if GENAI_SOFTMAX_X86
+    if (GetCpuFeatures().avx512f && GetCpuFeatures().avx2_fma)
+      return GENAI_KERNELS(avx512);
+    if (GetCpuFeatures().avx2_fma)
+      return GENAI_KERNELS(avx2);
+#elif defined(__aarch64__)
+    return GENAI_KERNELS(neon);
+#endif
+    return GENAI_KERNELS(scalar);
+  }();
+  return kernels;
+}
+
+}  // namespace
+
+void softmax(std::span<float> values, float temperature) {
+  GetKernels().softmax(values, temperature);
+}
+
+void log_softmax(std::span<float> values, float temperature) {
+  GetKernels().log_softmax(values, values, temperature);
+}
+
+void log_softmax(std::span<const float> input, std::span<float> output, float temperature) {
+  assert(input.size() == output.size());
+  GetKernels().log_softmax(input, output, temperature);
+}
+
+size_t argmax(std::span<const float> values) {
+  return GetKernels().argmax(values);
+}
 
-  float sum = std::accumulate(scaled.begin(), scaled.end(), 0.0f);
-  float log_max = std::log(sum);
-  std::transform(values.begin(), values.end(), values.begin(), [max, log_max](float v) { return v - max - log_max; });
+float log_sum_exp(std::span<const float> values) {
+  return GetKernels().log_sum_exp(values);
 }
 
 }  // namespace Generators
@@ -0,0 +1,109 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+// The softmax kernels over SimdOps, included by softmax_cpu.cpp once per instruction set, each time inside a namespace
+// defining SimdOps and compiled for that instruction set. No include guard on purpose.
+
+template <typename Ops>
+float MaxOf(const float* x, size_t count) {
+  float max = std::numeric_limits<float>::lowest();
+  size_t i = 0;
+  if (count >= Ops::kWidth) {
+    auto m = Ops::Load(x);
+    for (i = Ops::kWidth; i + Ops::kWidth <= count; i += Ops::kWidth)
+      m = Ops::Max(m, Ops::Load(x + i));
+    max = Ops::ReduceMax(m);
+  }
+  for (; i < count; i++)
+    max = std::max(max, x[i]);
+  return max;
+}
+
+// The first index of value in x, count if it isn't there. The vector holding it is found first, then the index in it.
+template <typename Ops>
+size_t FindFirst(const float* x, size_t count, float value) {
+  const auto vvalue = Ops::Set(value);
+  size_t i = 0;
+  for (; i + Ops::kWidth <= count; i += Ops::kWidth) {
+    if (Ops::AnyEqual(Ops::Load(x + i), vvalue))
+      break;
+  }
+  for (; i < count; i++) {
+    if (x[i] == value)
+      return i;
+  }
+  return count;
+}
+
+// output = input * scale + bias, or exp of it
+template <typename Ops, bool exp>
+void Affine(const float* input, float* output, size_t count, float scale, float bias) {
+  const auto vscale = Ops::Set(scale), vbias = Ops::Set(bias);
+  size_t i = 0;
+  for (; i + Ops::kWidth <= count; i += Ops::kWidth) {
+    const auto v = Ops::MulAdd(Ops::Load(input + i), vscale, vbias);
+    Ops::Store(output + i, exp ? Ops::Exp(v) : v);
+  }
+  for (; i < count; i++)
+    output[i] = exp ? ScalarOps::Exp(input[i] * scale + bias) : input[i] * scale + bias;
+}
+
+// The max of x * scale and the sum of exp(x * scale - max) in one pass: every lane keeps its own running max, and its
+// sum is only rescaled when a vector raises it, which after the first few is rare. A NaN makes the sum NaN, as Exp
+// passes it through.
+template <typename Ops>
+void OnlineMaxSum(const float* x, size_t count, float scale, float& max, float& sum) {
+  max = std::numeric_limits<float>::lowest();
+  sum = 0.0f;
+  size_t i = 0;
+  if (count >= Ops::kWidth) {
+    const auto vscale = Ops::Set(scale);
+    auto vmax = Ops::Set(std::numeric_limits<float>::lowest());
+    auto vsum = Ops::Set(0.0f);
+    for (; i + Ops::kWidth <= count; i += Ops::kWidth) {
+      const auto v = Ops::Mul(Ops::Load(x + i), vscale);
+      if (Ops::AnyGreater(v, vmax)) {
+        const auto new_max = Ops::Max(vmax, v);
+        vsum = Ops::Mul(vsum, Ops::Exp(Ops::Sub(vmax, new_max)));
+        vmax = new_max;
+      }
+      vsum = Ops::Add(vsum, Ops::Exp(Ops::Sub(v, vmax)));
+    }
+    float lane_max[Ops::kWidth], lane_sum[Ops::kWidth];
+    Ops::Store(lane_max, vmax);
+    Ops::Store(lane_sum, vsum);
+    for (size_t lane = 0; lane < Ops::kWidth; lane++)
+      CombineMaxSum(max, sum, lane_max[lane], lane_sum[lane]);
+  }
+  for (; i < count; i++)
+    CombineMaxSum(max, sum, x[i] * scale, 1.0f);
+}
+
+// Two passes, the online max and sum then the exps divided by the sum, which is folded into their exponent
+void Softmax(std::span<float> values, float temperature) {
+  const float scale = 1.0f / temperature;
+  float max, sum;
+  OnlineMaxSum<SimdOps>(values.data(), values.size(), scale, max, sum);
+  Affine<SimdOps, true>(values.data(), values.data(), values.size(), scale, -(max + std::log(sum)));
+}
+
+// Two passes, the online max and sum then the output
+void LogSoftmax(std::span<const float> input, std::span<float> output, float temperature) {
+  const float scale = 1.0f / temperature;
+  float max, sum;
+  OnlineMaxSum<SimdOps>(input.data(), input.size(), scale, max, sum);
+  Affine<SimdOps, false>(input.data(), output.data(), input.size(), scale, -(max + std::log(sum)));
+}
+
+// Two passes, the max then the first index holding it, which stops as soon as it's found
+size_t Argmax(std::span<const float> values) {
+  const float max = MaxOf<SimdOps>(values.data(), values.size());
+  const size_t index = FindFirst<SimdOps>(values.data(), values.size(), max);
+  return index < values.size() ? index : 0;  // Only when every value is NaN
+}
+
+float LogSumExp(std::span<const float> values) {
+  float max, sum;
+  OnlineMaxSum<SimdOps>(values.data(), values.size(), 1.0f, max, sum);
+  return max + std::log(sum);
+}
@@ -0,0 +1,176 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "generators.h"
+#include "models/model.h"
+#include "models/decoder_only.h"
+#include "speculative.h"
+
+namespace Generators {
+
+static const DecoderOnly_Model& GetDecoderOnlyModel(const Model& model, const char* role) {
+  auto* decoder_only = dynamic_cast<const DecoderOnly_Model*>(&model);
+  if (!decoder_only)
+    throw std::runtime_error(std::string("Speculative decoding requires a decoder only ") + role + " model, not " + model.config_->model.type);
+  if (!OnHost(model.device_type_) && model.device_type_ != DeviceType::CUDA)
+    throw std::runtime_error(std::string("Speculative decoding only supports CPU and CUDA, the ") + role + " model is on another device");
+  return *decoder_only;
+}
+
+static int32_t ArgMax(std::span<const float> logits) {
+  return static_cast<int32_t>(std::distance(logits.begin(), std::max_element(logits.begin(), logits.end())));
+}
+
+// The states hand their presents over as the next state's past, so the kv can't be a shared buffer
+static void DisableSharedState(GeneratorParams& params) {
+  params.search.past_present_share_buffer = false;
+  params.use_cuda_graph = false;
+}
+
+SpeculativeGenerator::SpeculativeGenerator(const Model& target, const Model& draft, const GeneratorParams& params)
+    : SpeculativeGenerator{target, params} {
+  draft_model_ = draft.shared_from_this();
+  draft_ = &GetDecoderOnlyModel(draft, "draft");
+  if (params.search.max_length > draft.config_->model.context_length)
+    throw std::runtime_error("max_length (" + std::to_string(params.search.max_length) + ") cannot be greater than the draft model context_length (" + std::to_string(draft.config_->model.context_length) + ")");
+
+  draft_params_ = CreateGeneratorParams(draft);
+  draft_params_->search = target_params_->search;
+  DisableSharedState(*draft_params_);
+}
+
+SpeculativeGenerator::SpeculativeGenerator(const Model& target, const GeneratorParams& params)
+    : target_model_{target.shared_from_this()},
+      target_{&GetDecoderOnlyModel(target, "target")},
+      sequences_{params.input_ids, params.batch_size, params.search.num_beams, params.search.max_length} {
+  if (params.batch_size != 1 || params.search.num_beams != 1)
+    throw std::runtime_error("Speculative decoding only supports batch_size 1 and num_beams 1");
+  if (params.search.do_sample && params.search.top_k != 1)
+    throw std::runtime_error("Speculative decoding only supports greedy search, do_sample must be false");
+  if (params.search.max_length == 0)
+    throw std::runtime_error("search max_length is 0");
+  if (params.search.max_length > target.config_->model.context_length)
+    throw std::runtime_error("max_length (" + std::to_string(params.search.max_length) + ") cannot be greater than model context_length (" + std::to_string(target.config_->model.context_length) + ")");
+  if (params.sequence_length >= params.search.max_length)
+    throw std::runtime_error("input sequence_length (" + std::to_string(params.sequence_length) + ") is >= max_length (" + std::to_string(params.search.max_length) + ")");
+  if (target.session_info_->HasInput(target.config_->model.decoder.inputs.last_token_indices))
+    throw std::runtime_error("Speculative decoding needs the logits of every position, the target model only computes the last one");
+
+  target_params_ = std::make_shared<GeneratorParams>(params);
+  target_params_->external_owner_.reset();
+  DisableSharedState(*target_params_);
+}
+
+SpeculativeGenerator::~SpeculativeGenerator() = default;
+
+std::unique_ptr<DecoderOnly_State> SpeculativeGenerator::CreateState(const DecoderOnly_Model& model, const GeneratorParams& params, std::span<const int32_t> input_ids,
+                                                                     int cached_length, std::vector<std::unique_ptr<OrtValue>>& past) {
+  auto state_params = std::make_shared<GeneratorParams>(params);
+  state_params->external_owner_.reset();
+  state_params->input_ids_owner.assign(input_ids.begin(), input_ids.end());
+  state_params->input_ids = state_params->input_ids_owner;
+  state_params->sequence_length = static_cast<int>(input_ids.size());
+
+  auto sequence = GetSequence();
+  PromptPrefix prefix;
+  prefix.tokens.assign(sequence.begin(), sequence.begin() + cached_length);
+  prefix.values = std::move(past);
+  return std::make_unique<DecoderOnly_State>(model, cpu_span<int32_t>{&sequence_length_, 1}, *state_params, std::move(prefix));
+}
+
+std::vector<int32_t> PromptLookup(std::span<const int32_t> sequence, int max_ngram_size, int count) {
+  const int length = static_cast<int>(sequence.size());
+  for (int n = std::min(max_ngram_size, length - 1); n > 0; n--) {
+    auto suffix = sequence.subspan(length - n);
+    // Latest match first, it's the most likely to continue the same way. A match has to end before the suffix begins.
+    for (int start = length - n - 1; start >= 0; start--) {
+      if (!std::equal(suffix.begin(), suffix.end(), sequence.begin() + start))
+        continue;
+      int begin = start + n;
+      int end = std::min(begin + count, length);
+      return std::vector<int32_t>(sequence.begin() + begin, sequence.begin() + end);
+    }
+  }
+  return {};
+}
+
+std::vector<int32_t> SpeculativeGenerator::Draft(int count) {
+  if (draft_)
+    return DraftWithModel(count);
+  return PromptLookup(GetSequence(), max_ngram_size_, count);
+}
+
+std::vector<int32_t> SpeculativeGenerator::DraftWithModel(int count) {
+  auto sequence = GetSequence();
+  int current_length = static_cast<int>(sequence.size());
+  draft_state_ = CreateState(*draft_, *draft_params_, sequence.subspan(draft_length_), draft_length_, draft_past_);
+
+  std::vector<int32_t> draft_tokens;
+  auto logits = draft_state_->Run(current_length, RoamingArray<int32_t>{}, RoamingArray<int32_t>{});
+  draft_tokens.push_back(ArgMax(logits.GetCPU()));
+  while (static_cast<int>(draft_tokens.size()) < count) {
+    int32_t token = draft_tokens.back();
+    logits = draft_state_->Run(++current_length, cpu_span<int32_t>{&token, 1}, RoamingArray<int32_t>{});
+    draft_tokens.push_back(ArgMax(logits.GetCPU()));
+  }
+
+  draft_length_ = current_length;  // The last draft token was never run through the draft model
+  return draft_tokens;
+}
+
+void SpeculativeGenerator::Append(int32_t token) {
+  sequences_.AppendNextTokenToSequences(std::span<const int32_t>{&token, 1});
+  if (token == target_params_->eos_token_id || sequences_.GetSequenceLength() >= target_params_->search.max_length)
+    done_ = true;
+}
+
+void SpeculativeGenerator::GenerateNextTokens() {
+  if (done_)
+    throw std::runtime_error("GenerateNextTokens called on a finished generator");
+
+  int length = sequences_.GetSequenceLength();
+  int count = std::min(num_draft_tokens_, target_params_->search.max_length - length - 1);  // The target adds one more
+  std::vector<int32_t> draft_tokens;
+  if (count > 0)
+    draft_tokens = Draft(count);
+
+  // Run everything the target hasn't seen yet plus the draft in one go. The logits at the position before each draft
+  // token are the target's choice for it.
+  auto sequence = GetSequence();
+  std::vector<int32_t> input_ids(sequence.begin() + target_length_, sequence.end());
+  input_ids.insert(input_ids.end(), draft_tokens.begin(), draft_tokens.end());
+  auto state = CreateState(*target_, *target_params_, input_ids, target_length_, target_past_);
+  auto logits = state->RunAllPositions().GetCPU();
+
+  const size_t vocab_size = target_params_->vocab_size;
+  const size_t first_position = input_ids.size() - draft_tokens.size() - 1;
+  size_t accepted = 0;
+  int32_t next_token;
+  while (true) {
+    next_token = ArgMax(logits.subspan((first_position + accepted) * vocab_size, vocab_size));
+    if (accepted == draft_tokens.size() || next_token != draft_tokens[accepted])
+      break;
+    accepted++;
+  }
+  drafted_count_ += draft_tokens.size();
+  accepted_count_ += accepted;
+
+  if (g_log.enabled && g_log.speculative_decoding)
+    Log("speculative_decoding", "accepted " + std::to_string(accepted) + " of " + std::to_string(draft_tokens.size()) + " draft tokens");
+
+  // Keep the kv of the accepted tokens only, next_token hasn't been run through either model yet
+  target_length_ = length + static_cast<int>(accepted);
+  target_past_ = state->TakePast(target_length_);
+  if (draft_state_) {
+    draft_length_ = std::min(draft_length_, target_length_);
+    draft_past_ = draft_state_->TakePast(draft_length_);
+    draft_state_.reset();
+  }
+
+  for (size_t i = 0; i < accepted && !done_; i++)
+    Append(draft_tokens[i]);
+  if (!done_)
+    Append(next_token);
+}
+
+}  // namespace Generators
@@ -0,0 +1,64 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+#include "sequences.h"
+
+namespace Generators {
+
+struct DecoderOnly_Model;
+struct DecoderOnly_State;
+
+// Greedy speculative decoding. Every step the small draft model proposes up to num_draft_tokens_ tokens one at a time,
+// then the target model checks all of them in a single run. The longest run of proposals matching the target's own
+// greedy choice is accepted along with the target's next token, so the output is the same as a greedy search on the
+// target alone, but the target only runs once per up to num_draft_tokens_ + 1 tokens. The kv of both models is rolled
+// back to the accepted tokens after each step.
+// Without a draft model, the proposals come from prompt lookup: the tokens that followed the latest earlier occurrence
+// of the sequence's last few tokens, which works well when the output copies spans of the prompt (summaries, edits).
+// Both models must be decoder only and share the tokenizer. Only batch_size 1 greedy search is supported, and the
+// logits processing options (repetition_penalty, min_length) are not applied.
+struct SpeculativeGenerator {
+  SpeculativeGenerator(const Model& target, const Model& draft, const GeneratorParams& params);
+  SpeculativeGenerator(const Model& target, const GeneratorParams& params);  // Prompt lookup
+  ~SpeculativeGenerator();
+
+  bool IsDone() const { return done_; }
+  void GenerateNextTokens();  // Appends between 1 and num_draft_tokens_ + 1 tokens to the sequence
+
+  cpu_span<int32_t> GetSequence() { return sequences_.GetSequence(0); }
+
+  int num_draft_tokens_{4};  // Most tokens proposed per step
+  int max_ngram_size_{3};    // Prompt lookup: longest suffix of the sequence that is searched for, shorter ones are tried next
+
+  size_t drafted_count_{};   // Number of draft tokens checked by the target so far
+  size_t accepted_count_{};  // How many of those were accepted
+
+ private:
+  std::unique_ptr<DecoderOnly_State> CreateState(const DecoderOnly_Model& model, const GeneratorParams& params, std::span<const int32_t> input_ids,
+                                                 int cached_length, std::vector<std::unique_ptr<OrtValue>>& past);
+  std::vector<int32_t> Draft(int count);
+  std::vector<int32_t> DraftWithModel(int count);
+  void Append(int32_t token);
+
+  std::shared_ptr<const Model> target_model_, draft_model_;
+  const DecoderOnly_Model* target_;
+  const DecoderOnly_Model* draft_{};  // Null when using prompt lookup
+  std::shared_ptr<GeneratorParams> target_params_, draft_params_;
+
+  Sequences sequences_;
+  bool done_{};
+
+  // Past key/values of the first *_length_ tokens of the sequence, the rest is run through each model on the next step
+  std::vector<std::unique_ptr<OrtValue>> target_past_, draft_past_;
+  int target_length_{}, draft_length_{};
+  std::unique_ptr<DecoderOnly_State> draft_state_;  // Kept until the target decides how much of the draft kv to keep
+
+  int32_t sequence_length_{};  // Required by the states, unused
+};
+
+// Finds the latest earlier occurrence of the last n tokens of sequence, trying n = max_ngram_size down to 1, and returns
+// up to count of the tokens that followed it. Returns nothing if no suffix occurs earlier.
+std::vector<int32_t> PromptLookup(std::span<const int32_t> sequence, int max_ngram_size, int count);
+
+}  // namespace Generators
@@ -0,0 +1,111 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include "generators.h"
+#include "models/model.h"
+#include "search.h"
+#include "streaming.h"
+
+namespace Generators {
+
+void StreamTokens(Generator& generator, const Tokenizer* tokenizer, const TokenCallback& callback) {
+  auto& params = *generator.search_->params_;
+  if (params.search.num_beams != 1)
+    throw std::runtime_error("Streaming tokens only supports greedy search and sampling, num_beams must be 1");
+  if (generator.computed_logits_)
+    throw std::runtime_error("Streaming tokens can't start in the middle of processing logits, call GenerateNextToken first");
+
+  const size_t batch_size = static_cast<size_t>(params.batch_size);
+
+  std::mutex mutex;
+  std::condition_variable steps_changed;
+  std::deque<std::vector<int32_t>> steps;  // The next token of every row for each step not handed over yet, -1 to skip
+  bool generating{true};
+  std::atomic<bool> stop{};
+  std::exception_ptr callback_error;
+
+  std::thread delivery([&] {
+    std::vector<std::unique_ptr<TokenizerStream>> streams(batch_size);
+    if (tokenizer) {
+      for (auto& stream : streams)
+        stream = tokenizer->CreateStream();
+    }
+    const std::string no_text;
+
+    while (true) {
+      std::vector<int32_t> tokens;
+      {
+        std::unique_lock lock(mutex);
+        steps_changed.wait(lock, [&] { return !steps.empty() || !generating; });
+        if (steps.empty())
+          return;
+        tokens = std::move(steps.front());
+        steps.pop_front();
+      }
+
+      for (size_t row = 0; row < batch_size && !stop; row++) {
+        if (tokens[row] < 0)
+          continue;
+        try {
+          if (!callback(row, tokens[row], tokenizer ? streams[row]->Decode(tokens[row]) : no_text))
+            stop = true;
+        } catch (...) {
+          callback_error = std::current_exception();
+          stop = true;
+        }
+      }
+    }
+  });
+
+  auto finish_delivery = [&] {
+    {
+      std::lock_guard lock(mutex);
+      generating = false;
+    }
+    steps_changed.notify_one();
+    delivery.join();
+  };
+
+  std::vector<bool> finished(batch_size);
+  try {
+    while (!stop && !generator.IsDone()) {
+      generator.ComputeLogits();
+      generator.GenerateNextToken();
+
+      // Held on to, on CUDA the cpu copies belong to the arrays
+      auto next_tokens_array = generator.search_->GetNextTokens();
+      auto done_rows_array = generator.search_->GetDoneRows();
+      auto next_tokens = next_tokens_array.GetCPU();
+      auto done_rows = done_rows_array.GetCPU();
+
+      std::vector<int32_t> tokens(batch_size, -1);
+      for (size_t row = 0; row < batch_size; row++) {
+        if (finished[row])
+          continue;
+        if (next_tokens[row] != params.eos_token_id)
+          tokens[row] = next_tokens[row];
+        finished[row] = next_tokens[row] == params.eos_token_id || done_rows[row];
+      }
+
+      {
+        std::lock_guard lock(mutex);
+        steps.push_back(std::move(tokens));
+      }
+      steps_changed.notify_one();
+    }
+  } catch (...) {
+    finish_delivery();
+    throw;
+  }
+
+  finish_delivery();
+  if (callback_error)
+    std::rethrow_exception(callback_error);
+}
+
+}  // namespace Generators
@@ -0,0 +1,19 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+namespace Generators {
+
+// Called with every token generated for a row of the batch. text is the token decoded by the row's tokenizer stream,
+// empty when streaming without a tokenizer. Returning false stops the generation.
+using TokenCallback = std::function<bool(size_t row, int32_t token, const std::string& text)>;
+
+// Runs a greedy search or sampling generator until it's done, instead of the caller polling it every step. Decoding and
+// the callback happen on a separate thread, so they overlap with the next decoder step. The callback is only ever called
+// from that thread, one token at a time in the order they were generated. A row's eos token isn't handed over, nor are
+// the pad tokens of rows that are done.
+// After the callback returns false the step in progress still finishes, but nothing more is handed over. An exception
+// thrown by the callback is rethrown once the generation has stopped.
+void StreamTokens(Generator& generator, const Tokenizer* tokenizer, const TokenCallback& callback);
+
+}  // namespace Generators
@@ -7,7 +7,11 @@ struct Tensor : std::enable_shared_from_this<Tensor> {
   Tensor(std::unique_ptr<OrtValue> ort_tensor) : ort_tensor_{std::move(ort_tensor)} {}
 
   std::unique_ptr<OrtValue> ort_tensor_;
+  std::shared_ptr<void> buffer_;            // The memory of ort_tensor_ when it isn't from an ORT allocator (pinned host memory)
   std::shared_ptr<Tensor> external_owner_;  // Set to 'this' when created by the C API to preserve lifetime
+#if USE_CUDA
+  std::unique_ptr<cuda_event_holder> ready_;  // When ort_tensor_ is still being written on a stream, recorded after the writes
+#endif
 };
 
 using NamedTensors = std::unordered_map<std::string, std::shared_ptr<Tensor>>;
@@ -0,0 +1,107 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "generators.h"
+#include "thread_pool.h"
+
+namespace Generators {
+
+ThreadPool::ThreadPool(size_t thread_count) {
+  for (size_t i = 0; i < thread_count; i++)
+    threads_.emplace_back([this] { Worker(); });
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  for (auto& thread : threads_)
+    thread.join();
+}
+
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t)>& fn) {
+  if (count <= 1 || threads_.empty()) {
+    for (size_t i = 0; i < count; i++)
+      fn(i);
+    return;
+  }
+
+  Job job{&fn, count};
+  {
+    std::lock_guard lock(mutex_);
+    jobs_.push_back(&job);
+  }
+  // The caller takes rows too, so it takes at most count - 1 workers to run every row at once
+  for (size_t i = std::min(count - 1, threads_.size()); i > 0; i--)
+    wake_.notify_one();
+
+  Run(job);
+
+  std::unique_lock lock(mutex_);
+  Remove(job);
+  done_.wait(lock, [&] { return job.helpers == 0; });
+  if (job.error)
+    std::rethrow_exception(job.error);
+}
+
+void ThreadPool::Run(Job& job) {
+  for (size_t i; (i = job.next_index++) < job.count;) {
+    try {
+      (*job.fn)(i);
+    } catch (...) {
+      std::lock_guard lock(mutex_);
+      if (!job.error)
+        job.error = std::current_exception();
+    }
+  }
+}
+
+void ThreadPool::Remove(Job& job) {
+  auto it = std::find(jobs_.begin(), jobs_.end(), &job);
+  if (it != jobs_.end())
+    jobs_.erase(it);
+}
+
+void ThreadPool::Worker() {
+  std::unique_lock lock(mutex_);
+  while (true) {
+    wake_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+    if (stop_)
+      return;
+
+    // Concurrent jobs take turns, the next worker woken helps the job queued after this one
+    auto* job = jobs_.front();
+    jobs_.pop_front();
+    jobs_.push_back(job);
+    job->helpers++;
+    lock.unlock();
+
+    Run(*job);
+
+    lock.lock();
+    Remove(*job);  // Its rows are all taken
+    if (--job->helpers == 0)
+      done_.notify_all();
+  }
+}
+
+ThreadPool& GetSearchThreadPool() {
+  // Never destroyed, joining threads while the library unloads can deadlock on Windows
+  static auto* pool = new ThreadPool{std::max(std::thread::hardware_concurrency(), 1u) - 1};
+  return *pool;
+}
+
+ThreadPool& GetImageThreadPool() {
+  static auto* pool = new ThreadPool{std::max(std::thread::hardware_concurrency(), 1u) - 1};
+  return *pool;
+}
+
+ThreadPool& GetSessionThreadPool() {
+  // A few runs at once, onnxruntime's own threads do the work of each
+  static auto* pool = new ThreadPool{2};
+  return *pool;
+}
+
+}  // namespace Generators
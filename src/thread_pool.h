@@ -0,0 +1,58 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Generators {
+
+// Runs the per row work of the CPU search (sampling, penalties, beam top-k) in parallel. The caller joins in and every
+// thread takes the next row from a shared counter, so threads that finish early pick up the rows left over.
+// Only the workers a job can use are woken. Several threads can call ParallelFor at once, even from within a job: their
+// jobs share the workers, which take turns helping each of them.
+struct ThreadPool {
+  explicit ThreadPool(size_t thread_count);  // Worker threads besides the caller
+  ~ThreadPool();
+
+  // Calls fn(i) for every i in [0, count) and returns once all are done. The first exception thrown is rethrown here.
+  void ParallelFor(size_t count, const std::function<void(size_t)>& fn);
+
+ private:
+  // A ParallelFor call, on the stack of its caller
+  struct Job {
+    const std::function<void(size_t)>* fn;
+    size_t count;
+    std::atomic<size_t> next_index{};
+    size_t helpers{};  // Workers running it, guarded by mutex_
+    std::exception_ptr error;  // Guarded by mutex_
+  };
+
+  void Worker();
+  void Run(Job& job);
+  void Remove(Job& job);  // From jobs_, with mutex_ held
+
+  std::vector<std::thread> threads_;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  bool stop_{};
+  std::deque<Job*> jobs_;  // The jobs that may have rows left, guarded by mutex_
+};
+
+// Shared by the CPU searches of every generator and batch tokenization, one worker per hardware thread besides the
+// caller. Their jobs take turns on the workers, so tokenizing a large batch doesn't hold up the searches.
+ThreadPool& GetSearchThreadPool();
+// The same for image preprocessing, separate so a prompt's images never wait for the searches of other generators
+ThreadPool& GetImageThreadPool();
+// And for the session runs of generators stepped together, see OgaGenerators_Step
+ThreadPool& GetSessionThreadPool();
+
+}  // namespace Generators
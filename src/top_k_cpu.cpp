@@ -1,4 +1,5 @@
 #include "generators.h"
+#include <limits>
 namespace Generators {
 
 void top_k_indices(std::span<int32_t> top_k, std::span<const float> inputs) {
@@ -29,4 +30,50 @@ void top_k_indices(std::span<int32_t> top_k, std::span<const float> inputs) {
   }
 }
 
+void top_k_threshold(std::span<int32_t> top_k, std::span<float> top_k_values, std::span<const float> inputs) {
+  const size_t k = top_k.size();
+  assert(k > 0 && k <= inputs.size() && top_k_values.size() == k);
+
+  // top_k_values[0, count) is sorted descending, once it's full its last entry is the threshold to beat
+  size_t count = 0;
+  float threshold = -std::numeric_limits<float>::infinity();
+  auto insert = [&](float value, size_t index) {
+    size_t i = count < k ? count++ : k - 1;
+    for (; i > 0 && top_k_values[i - 1] < value; i--) {
+      top_k_values[i] = top_k_values[i - 1];
+      top_k[i] = top_k[i - 1];
+    }
+    top_k_values[i] = value;
+    top_k[i] = static_cast<int32_t>(index);
+    if (count == k)
+      threshold = top_k_values[k - 1];
+  };
+
+  size_t i = 0;
+  for (; i < k; i++)
+    insert(inputs[i], i);
+
+  // Most blocks hold nothing above the threshold, and their max is a fixed size branch free loop the compiler turns
+  // into SIMD max instructions (SSE/AVX/NEON), so the vocab is scanned at close to memory speed
+  constexpr size_t block_size = 16;
+  for (; i + block_size <= inputs.size(); i += block_size) {
+    const float* block = inputs.data() + i;
+    float block_max = block[0];
+    for (size_t j = 1; j < block_size; j++)
+      block_max = block[j] > block_max ? block[j] : block_max;
+    if (block_max <= threshold)
+      continue;
+
+    for (size_t j = 0; j < block_size; j++) {
+      if (block[j] > threshold)
+        insert(block[j], i + j);
+    }
+  }
+
+  for (; i < inputs.size(); i++) {
+    if (inputs[i] > threshold)
+      insert(inputs[i], i);
+  }
+}
+
 }  // namespace Generators
@@ -0,0 +1,260 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include "generators.h"
+#include "tracing.h"
+#include <condition_variable>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#if _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace Generators {
+
+std::atomic<bool> g_trace_recording;
+
+namespace {
+
+// Events are kept in memory and written by the writer thread once a thread has this many, or at this interval
+constexpr size_t c_trace_flush_count = 4096;
+constexpr std::chrono::milliseconds c_trace_write_interval{100};
+
+int64_t NowMicroseconds() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
+}
+
+int ProcessId() {
+#if _WIN32
+  return _getpid();
+#else
+  return static_cast<int>(getpid());
+#endif
+}
+
+int ThreadIndex() {
+  static std::atomic<int> next_index{1};
+  thread_local int index = next_index++;
+  return index;
+}
+
+struct TraceEvent {
+  const char* name;
+  const void* generator;
+  int64_t start_us, duration_us;
+  int thread;
+};
+
+struct ProfiledSession {
+  std::string model;
+  std::string profile_prefix;
+  uint64_t start_ns;
+};
+
+// The events recorded on one thread, which only the writer thread takes them from
+struct ThreadEvents {
+  std::mutex mutex;
+  std::vector<TraceEvent> events;
+};
+
+// Recording threads append to a buffer of their own, a writer thread takes the events of every buffer and does the
+// file I/O, so threads recording at the same time never wait on each other or on the file.
+struct Tracer {
+  ~Tracer() {
+    std::lock_guard control_lock{control_mutex_};
+    StopWriter();
+    std::lock_guard lock{mutex_};
+    Close();
+  }
+
+  void SetRecording(bool value) {
+    std::lock_guard control_lock{control_mutex_};
+    std::lock_guard lock{mutex_};
+    recording_ = value;
+    g_trace_recording = recording_ && file_;
+    if (!recording_)
+      WriteEvents();
+  }
+
+  void SetFilename(std::string_view path) {
+    std::lock_guard control_lock{control_mutex_};
+    StopWriter();
+    std::lock_guard lock{mutex_};
+    Close();
+    if (!path.empty()) {
+      fs::path filename{std::string(path)};
+      file_ = std::make_unique<std::ofstream>(filename.open_for_write());
+      if (!*file_) {
+        file_.reset();
+        g_trace_recording = false;
+        throw std::runtime_error("Couldn't open the trace file " + std::string(path));
+      }
+      Open();
+      writer_ = std::thread{[this] { Write(); }};
+    }
+    g_trace_recording = recording_ && file_;
+  }
+
+  void Add(const TraceEvent& event) {
+    thread_local std::shared_ptr<ThreadEvents> buffer = AddThread();
+    size_t count;
+    {
+      std::lock_guard lock{buffer->mutex};
+      buffer->events.push_back(event);
+      count = buffer->events.size();
+    }
+    if (count == c_trace_flush_count)
+      wake_.notify_one();
+  }
+
+  void AddSession(const std::string& model, const std::string& profile_prefix, uint64_t start_ns) {
+    std::lock_guard lock{mutex_};
+    sessions_.push_back({model, profile_prefix, start_ns});
+    if (file_)
+      WriteSession(sessions_.back());
+  }
+
+ private:
+  std::shared_ptr<ThreadEvents> AddThread() {
+    std::lock_guard lock{mutex_};
+    return threads_.emplace_back(std::make_shared<ThreadEvents>());
+  }
+
+  // The writer thread, wakes up when a buffer fills and at every interval to keep the file current
+  void Write() {
+    std::unique_lock lock{mutex_};
+    while (!stop_writer_) {
+      wake_.wait_for(lock, c_trace_write_interval);
+      WriteEvents();
+    }
+  }
+
+  void StopWriter() {
+    if (!writer_.joinable())
+      return;
+    {
+      std::lock_guard lock{mutex_};
+      stop_writer_ = true;
+    }
+    wake_.notify_one();
+    writer_.join();
+    stop_writer_ = false;
+  }
+
+  // Takes the events of every thread, buffers of threads that have exited are dropped once they're empty
+  std::vector<TraceEvent> TakeEvents() {
+    std::vector<TraceEvent> events;
+    for (auto it = threads_.begin(); it != threads_.end();) {
+      {
+        std::lock_guard lock{(*it)->mutex};
+        events.insert(events.end(), (*it)->events.begin(), (*it)->events.end());
+        (*it)->events.clear();
+      }
+      if (it->use_count() == 1)
+        it = threads_.erase(it);
+      else
+        ++it;
+    }
+    return events;
+  }
+
+  void Open() {
+    TakeEvents();  // Left from a previous file, after it was closed
+    *file_ << "[\n";
+    *file_ << R"({"name":"process_name","ph":"M","pid":)" << ProcessId() << R"(,"args":{"name":"onnxruntime-genai"}})";
+    for (auto& session : sessions_)
+      WriteSession(session);
+  }
+
+  static std::string Escape(const std::string& value) {
+    std::string escaped;
+    for (char c : value) {
+      if (c == '"' || c == '\\')
+        escaped += '\\';
+      escaped += c;
+    }
+    return escaped;
+  }
+
+  void WriteSession(const ProfiledSession& session) {
+    // An instant event at the start of the session's profile, onnxruntime names the profile file
+    // <profile_prefix>_<date and time>.json
+    *file_ << ",\n"
+           << R"({"name":"ort_profile","cat":"genai","ph":"i","s":"p","pid":)" << ProcessId()
+           << R"(,"tid":0,"ts":)" << session.start_ns / 1000 << R"(,"args":{"model":")" << Escape(session.model)
+           << R"(","profile_prefix":")" << Escape(session.profile_prefix) << R"(","start_ns":)" << session.start_ns << "}}";
+  }
+
+  void WriteEvents() {
+    if (!file_)
+      return;
+    const auto pid = ProcessId();
+    for (auto& event : TakeEvents()) {
+      *file_ << ",\n"
+             << R"({"name":")" << event.name << R"(","cat":"genai","ph":"X","pid":)" << pid << R"(,"tid":)" << event.thread
+             << R"(,"ts":)" << event.start_us << R"(,"dur":)" << event.duration_us;
+      if (event.generator)
+        *file_ << R"(,"args":{"generator":")" << event.generator << R"("})";
+      *file_ << '}';
+    }
+    file_->flush();
+  }
+
+  void Close() {
+    if (!file_)
+      return;
+    WriteEvents();
+    *file_ << "\n]\n";
+    file_.reset();
+  }
+
+  std::mutex control_mutex_;  // Held by the calls that start and stop the writer
+  std::mutex mutex_;          // Guards everything below but the events in the buffers
+  std::condition_variable wake_;
+  std::thread writer_;
+  bool stop_writer_{};
+  bool recording_{};
+  std::unique_ptr<std::ofstream> file_;
+  std::vector<std::shared_ptr<ThreadEvents>> threads_;
+  std::vector<ProfiledSession> sessions_;
+};
+
+Tracer& GetTracer() {
+  static Tracer tracer;
+  return tracer;
+}
+
+// The generator of the innermost scope that named one on this thread, given to the scopes inside it that don't
+thread_local const void* t_generator{};
+
+}  // namespace
+
+void TraceScope::Start(const char* name, const void* generator) {
+  name_ = name;
+  outer_generator_ = t_generator;
+  generator_ = generator ? generator : t_generator;
+  t_generator = generator_;
+  start_us_ = NowMicroseconds();
+}
+
+void TraceScope::End() {
+  GetTracer().Add({name_, generator_, start_us_, NowMicroseconds() - start_us_, ThreadIndex()});
+  t_generator = outer_generator_;
+}
+
+void TraceProfiledSession(const std::string& model_filename, const std::string& profile_prefix, uint64_t profiling_start_ns) {
+  GetTracer().AddSession(model_filename, profile_prefix, profiling_start_ns);
+}
+
+void SetTraceRecording(bool value) {
+  GetTracer().SetRecording(value);
+}
+
+void SetTraceFilename(std::string_view path) {
+  GetTracer().SetFilename(path);
+}
+
+}  // namespace Generators
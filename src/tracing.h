@@ -0,0 +1,56 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+/*
+ * Timeline of the generator phases in the Chrome trace event format, which chrome://tracing and ui.perfetto.dev open.
+ *
+ * SetLogString("trace_filename", "path") starts a trace file and SetLogBool("trace", true) records into it, so a trace
+ * can be taken from a running process. Turning "trace" off or setting another filename (or "") writes what was
+ * recorded, the file is closed with the last one. Neither needs the log to be enabled.
+ *
+ * Timestamps are microseconds of the clock onnxruntime's profiler uses, since its epoch. Sessions created with
+ * session_options.enable_profiling are listed in every trace with their model, profiling start and the prefix of their
+ * profile file, so the op level profiles onnxruntime writes can be shifted onto the same timeline, see
+ * tools/python/merge_trace.py.
+ *
+ * Every thread records into a buffer of its own, which a writer thread empties into the file.
+ */
+namespace Generators {
+
+// True while "trace" is on and a trace file is open, checked before anything else is done for a trace event
+extern std::atomic<bool> g_trace_recording;
+
+// Records a complete event for its lifetime, named by a string literal. generator goes in the event's args to tell the
+// generators apart, scopes that don't name one take the generator of the scope they're in on the same thread (so a
+// session_run inside a generator's decode is that generator's).
+struct TraceScope {
+  TraceScope(const char* name, const void* generator = nullptr) {
+    if (g_trace_recording.load(std::memory_order_relaxed))
+      Start(name, generator);
+  }
+  ~TraceScope() {
+    if (name_)
+      End();
+  }
+
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+
+ private:
+  void Start(const char* name, const void* generator);
+  void End();
+
+  const char* name_{};
+  const void* generator_{};
+  const void* outer_generator_{};
+  int64_t start_us_{};
+};
+
+// A session of model_filename profiled by onnxruntime from profiling_start_ns into <profile_prefix>_<date and time>.json,
+// for the traces to list
+void TraceProfiledSession(const std::string& model_filename, const std::string& profile_prefix, uint64_t profiling_start_ns);
+
+void SetTraceRecording(bool value);           // SetLogBool("trace", value)
+void SetTraceFilename(std::string_view path);  // SetLogString("trace_filename", path)
+
+}  // namespace Generators
@@ -0,0 +1,328 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "generators.h"
+#include "models/model.h"
+#include "models/whisper.h"
+#include "whisper_streaming.h"
+
+namespace Generators {
+
+static constexpr int c_window_frames = 3000;  // 30s, the length of Whisper's input_features
+static constexpr double c_seconds_per_frame = 0.01;
+static constexpr int c_max_initial_timestamp = 50;  // 1s
+
+void ApplyTimestampRules(std::span<float> logits, std::span<const int32_t> generated, int32_t timestamp_begin, int32_t eos_token_id) {
+  constexpr float c_suppressed = std::numeric_limits<float>::lowest();
+  auto suppress = [&](size_t first, size_t last) {
+    std::fill(logits.begin() + std::min(first, logits.size()), logits.begin() + std::min(last, logits.size()), c_suppressed);
+  };
+  const size_t begin = static_cast<size_t>(timestamp_begin);
+  suppress(static_cast<size_t>(eos_token_id) + 1, begin);  // The special tokens only go in prompts
+
+  const size_t count = generated.size();
+  if (count == 0) {
+    suppress(0, begin);
+    suppress(begin + c_max_initial_timestamp + 1, logits.size());
+    return;
+  }
+
+  const bool last_was_timestamp = generated[count - 1] >= timestamp_begin;
+  const bool penultimate_was_timestamp = count < 2 || generated[count - 2] >= timestamp_begin;
+  if (last_was_timestamp) {
+    if (penultimate_was_timestamp)
+      suppress(begin, logits.size());  // A segment starts, its text comes next
+    else
+      suppress(0, static_cast<size_t>(eos_token_id));  // The segment ended, the start of the next one or eos comes next
+  }
+
+  for (size_t i = count; i-- > 0;) {
+    if (generated[i] < timestamp_begin)
+      continue;
+    // An end timestamp can't be before its start, and a new start has to be after the last end
+    size_t last = static_cast<size_t>(generated[i]);
+    suppress(begin, last_was_timestamp && !penultimate_was_timestamp ? last : last + 1);
+    break;
+  }
+
+  // Compared as log probabilities the softmax denominator cancels out
+  auto text_end = logits.begin() + std::min(begin, logits.size());
+  float max_text = *std::max_element(logits.begin(), text_end);
+  float max_timestamp = text_end == logits.end() ? c_suppressed : *std::max_element(text_end, logits.end());
+  if (max_timestamp == c_suppressed)
+    return;
+  double timestamp_sum = 0.0;
+  for (auto it = text_end; it != logits.end(); ++it)
+    timestamp_sum += std::exp(static_cast<double>(*it) - max_timestamp);
+  if (max_text == c_suppressed || max_timestamp + std::log(timestamp_sum) > max_text)
+    suppress(0, begin);
+}
+
+std::vector<WhisperSegment> ParseTimestamps(std::span<const int32_t> generated, int32_t timestamp_begin) {
+  std::vector<WhisperSegment> segments;
+  WhisperSegment segment;
+  bool open = false;
+  for (auto token : generated) {
+    if (token < timestamp_begin) {
+      if (!open) {
+        segment.start = segments.empty() ? 0.0 : segments.back().end;
+        open = true;
+      }
+      segment.tokens.push_back(token);
+      continue;
+    }
+
+    double time = (token - timestamp_begin) * c_whisper_seconds_per_timestamp;
+    if (!open) {
+      segment.start = time;
+      open = true;
+      continue;
+    }
+    segment.end = time;
+    segment.complete = true;
+    if (!segment.tokens.empty())
+      segments.push_back(std::move(segment));
+    segment = {};
+    open = false;
+  }
+
+  if (open && !segment.tokens.empty()) {
+    segment.end = segment.start;
+    segments.push_back(std::move(segment));
+  }
+  return segments;
+}
+
+std::vector<std::vector<int32_t>> TranscribeClips(const Model& model, const GeneratorParams& params, std::span<const std::span<const float>> clips,
+                                                  int num_mels, int max_batch_size) {
+  auto* whisper = dynamic_cast<const Whisper_Model*>(&model);
+  if (!whisper)
+    throw std::runtime_error("TranscribeClips requires a whisper model, not " + model.config_->model.type);
+  if (params.batch_size != 1 || params.search.num_beams != 1)
+    throw std::runtime_error("TranscribeClips only supports num_beams 1, and params.input_ids is the prompt of a single clip (batch_size 1)");
+  if (num_mels <= 0 || max_batch_size <= 0)
+    throw std::runtime_error("num_mels and max_batch_size must be greater than 0");
+  if (params.input_ids.empty())
+    throw std::runtime_error("TranscribeClips needs the decoder prompt in params.input_ids");
+
+  std::vector<int> frame_counts(clips.size());
+  for (size_t i = 0; i < clips.size(); i++) {
+    frame_counts[i] = static_cast<int>(clips[i].size() / num_mels);
+    if (clips[i].empty() || clips[i].size() % num_mels != 0)
+      throw std::runtime_error("Clip " + std::to_string(i) + " must be a non empty num_mels * frame count values");
+    if (whisper->encoder_frames_ > 0 && frame_counts[i] > whisper->encoder_frames_)
+      throw std::runtime_error("Clip " + std::to_string(i) + " is longer than the " + std::to_string(whisper->encoder_frames_) + " frames of the encoder");
+  }
+
+  // Shortest first, so a batch has clips of a similar length and little padding
+  std::vector<size_t> order(clips.size());
+  std::iota(order.begin(), order.end(), size_t{0});
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return frame_counts[a] < frame_counts[b]; });
+
+  const std::span<const int32_t> prompt = params.input_ids;
+  std::vector<std::vector<int32_t>> results(clips.size());
+  for (size_t first = 0; first < order.size(); first += max_batch_size) {
+    auto batch = std::span<const size_t>{order}.subspan(first, std::min(order.size() - first, static_cast<size_t>(max_batch_size)));
+    const int batch_size = static_cast<int>(batch.size());
+
+    // The encoder downsamples by 2, so a dynamic length is kept even
+    int64_t window_frames = whisper->encoder_frames_;
+    if (window_frames <= 0)
+      window_frames = (frame_counts[batch.back()] + 1) / 2 * 2;
+
+    // Padded with the floor of the clip's log-mel values, which is what silence is
+    const std::array<int64_t, 3> shape{batch_size, num_mels, window_frames};
+    auto features = OrtValue::CreateTensor<float>(model.allocator_cpu_, shape);
+    auto* data = features->GetTensorMutableData<float>();
+    for (size_t clip_index : batch) {
+      auto clip = clips[clip_index];
+      const size_t frame_count = static_cast<size_t>(frame_counts[clip_index]);
+      const float pad = *std::min_element(clip.begin(), clip.end());
+      for (int mel = 0; mel < num_mels; mel++) {
+        data = std::copy_n(clip.begin() + mel * frame_count, frame_count, data);
+        data = std::fill_n(data, static_cast<size_t>(window_frames) - frame_count, pad);
+      }
+    }
+
+    auto batch_params = std::make_shared<GeneratorParams>(params);
+    batch_params->external_owner_.reset();
+    batch_params->batch_size = batch_size;
+    batch_params->input_ids_owner.clear();
+    for (int i = 0; i < batch_size; i++)
+      batch_params->input_ids_owner.insert(batch_params->input_ids_owner.end(), prompt.begin(), prompt.end());
+    batch_params->input_ids = batch_params->input_ids_owner;
+    batch_params->sequence_length = static_cast<int>(prompt.size());
+    batch_params->inputs = GeneratorParams::Whisper{std::make_shared<Tensor>(std::move(features))};
+
+    auto sequences = Generate(model, *batch_params);
+    for (int i = 0; i < batch_size; i++) {
+      auto& sequence = sequences[i];
+      auto end = std::find(sequence.begin() + prompt.size(), sequence.end(), params.eos_token_id);
+      results[batch[i]].assign(sequence.begin() + prompt.size(), end);
+    }
+  }
+  return results;
+}
+
+WhisperStreamer::WhisperStreamer(const Model& model, const GeneratorParams& params, int num_mels, const Tokenizer* tokenizer)
+    : model_{model.shared_from_this()},
+      tokenizer_{tokenizer},
+      num_mels_{num_mels},
+      prompt_(params.input_ids.begin(), params.input_ids.end()) {
+  auto* whisper = dynamic_cast<const Whisper_Model*>(&model);
+  if (!whisper)
+    throw std::runtime_error("WhisperStreamer requires a whisper model, not " + model.config_->model.type);
+  encoder_frames_ = whisper->encoder_frames_;
+  if (encoder_frames_ > 0 && encoder_frames_ < c_window_frames)
+    throw std::runtime_error("WhisperStreamer needs an encoder of at least " + std::to_string(c_window_frames) + " frames");
+  if (params.batch_size != 1 || params.search.num_beams != 1)
+    throw std::runtime_error("WhisperStreamer only supports batch_size 1 and num_beams 1");
+  if (params.search.do_sample && params.search.top_k != 1)
+    throw std::runtime_error("WhisperStreamer only supports greedy search, do_sample must be false");
+  if (num_mels_ <= 0)
+    throw std::runtime_error("num_mels must be greater than 0");
+  if (params.vocab_size <= c_whisper_timestamp_count + params.eos_token_id)
+    throw std::runtime_error("The vocab_size is too small for Whisper's timestamp tokens");
+
+  // The tokens before the timestamps are ..., <|startofprev|>, <|nospeech|>, <|notimestamps|>
+  timestamp_begin_ = params.vocab_size - c_whisper_timestamp_count;
+  start_of_prev_token_id_ = timestamp_begin_ - 3;
+  if (std::find(prompt_.begin(), prompt_.end(), timestamp_begin_ - 1) != prompt_.end())
+    throw std::runtime_error("WhisperStreamer needs timestamps, the decoder prompt can't contain <|notimestamps|>");
+  if (prompt_.empty())
+    prompt_.push_back(model.config_->model.decoder_start_token_id);
+
+  params_ = std::make_shared<GeneratorParams>(params);
+  params_->external_owner_.reset();
+  params_->inputs = GeneratorParams::Whisper{};  // The features of every window go in features_
+}
+
+void WhisperStreamer::AddAudio(std::span<const float> features, int frame_count) {
+  if (frame_count < 0 || features.size() != static_cast<size_t>(frame_count) * num_mels_)
+    throw std::runtime_error("AddAudio features must be num_mels * frame_count values");
+
+  size_t offset = frames_.size();
+  frames_.resize(offset + features.size());
+  for (int frame = 0; frame < frame_count; frame++) {
+    for (int mel = 0; mel < num_mels_; mel++)
+      frames_[offset + mel] = features[static_cast<size_t>(mel) * frame_count + frame];
+    offset += num_mels_;
+  }
+  new_frames_ += frame_count;
+}
+
+std::vector<int32_t> WhisperStreamer::BuildPrompt() const {
+  // Room for at least as many new tokens as the prompt has
+  const int room = params_->search.max_length / 2 - static_cast<int>(prompt_.size()) - 1;
+  const size_t context_count = std::min(context_.size(), static_cast<size_t>(std::max(std::min(max_context_tokens_, room), 0)));
+
+  std::vector<int32_t> prompt;
+  if (context_count > 0) {
+    prompt.push_back(start_of_prev_token_id_);
+    prompt.insert(prompt.end(), context_.end() - context_count, context_.end());
+  }
+  prompt.insert(prompt.end(), prompt_.begin(), prompt_.end());
+  return prompt;
+}
+
+void WhisperStreamer::SetFeatures(int frame_count) {
+  // The encoder downsamples by 2, so a dynamic length is kept even
+  const int64_t window_frames = encoder_frames_ > 0 ? encoder_frames_ : (frame_count + 1) / 2 * 2;
+  if (!features_ || features_->ort_tensor_->GetTensorTypeAndShapeInfo()->GetShape()[2] != window_frames) {
+    const std::array<int64_t, 3> shape{1, num_mels_, window_frames};
+    features_ = std::make_shared<Tensor>(OrtValue::CreateTensor<float>(model_->allocator_cpu_, shape));
+    std::get<GeneratorParams::Whisper>(params_->inputs).input_features = features_;
+  }
+
+  // The features of silence are the floor of the log-mel values, which is what a shorter window is padded with
+  auto* data = features_->ort_tensor_->GetTensorMutableData<float>();
+  const float pad = *std::min_element(frames_.begin(), frames_.begin() + static_cast<size_t>(frame_count) * num_mels_);
+  for (int mel = 0; mel < num_mels_; mel++) {
+    for (int64_t frame = 0; frame < window_frames; frame++)
+      *data++ = frame < frame_count ? frames_[static_cast<size_t>(frame) * num_mels_ + mel] : pad;
+  }
+}
+
+// The state of a window only lives for its decoding, so its features and prompt are written into the same params for
+// the next one
+std::vector<int32_t> WhisperStreamer::DecodeWindow(int frame_count) {
+  SetFeatures(frame_count);
+  params_->input_ids_owner = BuildPrompt();
+  params_->input_ids = params_->input_ids_owner;
+  params_->sequence_length = static_cast<int>(params_->input_ids_owner.size());
+  auto state = model_->CreateState(cpu_span<int32_t>{&sequence_length_, 1}, *params_);
+
+  std::vector<int32_t> generated;
+  std::vector<float> scores;
+  int current_length = params_->sequence_length;
+  auto logits = state->Run(current_length, RoamingArray<int32_t>{}, RoamingArray<int32_t>{});
+  while (true) {
+    auto cpu_logits = logits.GetCPU();
+    scores.assign(cpu_logits.begin(), cpu_logits.end());
+    ApplyTimestampRules(scores, generated, timestamp_begin_, params_->eos_token_id);
+    int32_t token = static_cast<int32_t>(std::distance(scores.begin(), std::max_element(scores.begin(), scores.end())));
+    if (token == params_->eos_token_id)
+      break;
+    generated.push_back(token);
+    if (current_length + 1 >= params_->search.max_length)
+      break;
+    logits = state->Run(++current_length, cpu_span<int32_t>{&token, 1}, RoamingArray<int32_t>{});
+  }
+  return generated;
+}
+
+std::vector<WhisperSegment> WhisperStreamer::Transcribe(bool flush) {
+  std::vector<WhisperSegment> committed;
+  while (FrameCount() > 0) {
+    const int frame_count = std::min(FrameCount(), c_window_frames);
+    const bool full = frame_count == c_window_frames;
+    if (!full && !flush && new_frames_ < step_frames_)
+      break;
+    new_frames_ = 0;
+
+    auto segments = ParseTimestamps(DecodeWindow(frame_count), timestamp_begin_);
+    const double window_seconds = frame_count * c_seconds_per_frame;
+    const bool last_window = flush && !full;  // Everything in it is final
+
+    size_t count = 0;
+    for (; count < segments.size(); count++) {
+      auto& segment = segments[count];
+      if (last_window && !segment.complete)
+        segment.end = window_seconds;
+      else if (!last_window && (!segment.complete || segment.end > window_seconds - commit_delay_))
+        break;
+    }
+
+    int drop_count = count > 0 ? static_cast<int>(std::lround(segments[count - 1].end / c_seconds_per_frame)) : 0;
+    if (last_window)
+      drop_count = frame_count;
+    else if (full && drop_count <= 0) {
+      // The window can't grow, so it moves on even when none of it is final
+      count = segments.size();
+      drop_count = frame_count;
+    }
+
+    const double offset = dropped_frames_ * c_seconds_per_frame;
+    for (size_t i = 0; i < count; i++) {
+      auto& segment = segments[i];
+      segment.start += offset;
+      segment.end = std::max(segment.end + offset, segment.start);
+      if (tokenizer_)
+        segment.text = tokenizer_->Decode(segment.tokens);
+      context_.insert(context_.end(), segment.tokens.begin(), segment.tokens.end());
+      committed.push_back(std::move(segment));
+    }
+    if (context_.size() > static_cast<size_t>(max_context_tokens_))
+      context_.erase(context_.begin(), context_.end() - max_context_tokens_);
+
+    drop_count = std::min(drop_count, FrameCount());
+    frames_.erase(frames_.begin(), frames_.begin() + static_cast<size_t>(drop_count) * num_mels_);
+    dropped_frames_ += drop_count;
+
+    if (!full)
+      break;  // The rest of the audio was all in this window
+  }
+  return committed;
+}
+
+}  // namespace Generators
@@ -0,0 +1,80 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+namespace Generators {
+
+// Whisper's timestamp tokens are the last 1501 of its vocab, <|0.00|> to <|30.00|> in steps of 20ms
+constexpr int c_whisper_timestamp_count = 1501;
+constexpr double c_whisper_seconds_per_timestamp = 0.02;
+
+struct WhisperSegment {
+  double start{}, end{};        // Seconds
+  std::vector<int32_t> tokens;  // The text tokens, without the timestamps
+  std::string text;             // Empty without a tokenizer
+  bool complete{};              // Has its end timestamp, an incomplete segment was cut off by the end of the generation
+};
+
+// Masks the logits of the tokens Whisper's timestamp rules don't allow after generated (the tokens after the prompt):
+// the first token is a timestamp of at most 1s, text goes between a start and an end timestamp, timestamps never go
+// back and a segment can't be empty. A timestamp is forced when the timestamps together are more likely than any text.
+void ApplyTimestampRules(std::span<float> logits, std::span<const int32_t> generated, int32_t timestamp_begin, int32_t eos_token_id);
+
+// Splits generated tokens into segments at their timestamps, in seconds from the start of the window
+std::vector<WhisperSegment> ParseTimestamps(std::span<const int32_t> generated, int32_t timestamp_begin);
+
+// Transcribes many short clips with few encoder runs. Each clip is num_mels rows of its own frame count, the layout of
+// the feature extractor's output without the padding to 30s. The clips are sorted by length and packed into batches of
+// up to max_batch_size. An encoder with a fixed input length gets every clip padded to it, otherwise a batch is only
+// padded to its longest clip. Every batch is decoded with a batched greedy search, params.input_ids is the decoder
+// prompt of a single clip. Returns the tokens generated for every clip in the order of clips, without the prompt and eos.
+std::vector<std::vector<int32_t>> TranscribeClips(const Model& model, const GeneratorParams& params, std::span<const std::span<const float>> clips,
+                                                  int num_mels = 80, int max_batch_size = 16);
+
+// Live transcription with a Whisper model. Audio goes in as log-mel frames (100 per second) as it arrives and is decoded
+// in windows of up to 30s, once step_frames_ new frames have come in, so the encoder runs once per step and not once
+// per chunk. An encoder that takes features of any length only encodes the audio of the window, a fixed length one
+// gets it padded to its length. A segment is only committed (returned) once it ends commit_delay_ before the end of the audio so far, as
+// speech there may be cut off. The audio of committed segments is dropped and their text becomes the <|startofprev|>
+// prompt of the next window, so the window and the latency stay bounded.
+// The self attention kv of a window depends on its audio through the cross attention, so it isn't carried over, only
+// the committed text is. Only greedy search with batch_size 1 is supported, params.input_ids is the decoder prompt
+// (<|startoftranscript|>, language and task tokens) and must leave timestamps enabled.
+struct WhisperStreamer {
+  WhisperStreamer(const Model& model, const GeneratorParams& params, int num_mels = 80, const Tokenizer* tokenizer = nullptr);
+
+  // features are num_mels rows of frame_count values each, the layout of the feature extractor's output
+  void AddAudio(std::span<const float> features, int frame_count);
+  // Decodes the buffered audio if enough of it is new and returns the segments committed, with times in seconds from
+  // the start of the stream. flush decodes and commits everything left, for the end of the stream.
+  std::vector<WhisperSegment> Transcribe(bool flush = false);
+
+  int step_frames_{200};         // 2s
+  double commit_delay_{1.0};     // Seconds
+  int max_context_tokens_{224};  // Most committed tokens in the prompt of the next window
+
+ private:
+  int FrameCount() const { return static_cast<int>(frames_.size() / static_cast<size_t>(num_mels_)); }
+  std::vector<int32_t> BuildPrompt() const;
+  std::vector<int32_t> DecodeWindow(int frame_count);
+  void SetFeatures(int frame_count);
+
+  std::shared_ptr<const Model> model_;
+  std::shared_ptr<GeneratorParams> params_;  // Of every window, with its features and prompt
+  std::shared_ptr<Tensor> features_;         // Rewritten for every window, reallocated when its length changes
+  int64_t encoder_frames_;                   // Of a fixed length encoder, -1 for any length
+  const Tokenizer* tokenizer_;
+  int num_mels_;
+  int32_t start_of_prev_token_id_;
+  int32_t timestamp_begin_;
+
+  std::vector<int32_t> prompt_;   // The decoder prompt of params
+  std::vector<int32_t> context_;  // Committed text
+  std::vector<float> frames_;     // Frame major, so dropping the oldest frames is a single erase
+  int new_frames_{};              // Frames added since the last decoded window
+  int64_t dropped_frames_{};      // Where frames_ starts in the stream
+
+  int32_t sequence_length_{};  // Required by the states, unused
+};
+
+}  // namespace Generators
@@ -2,7 +2,11 @@
 #include <generators.h>
 #include <search.h>
 #include <models/model.h>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include <thread>
 #include <ort_genai.h>
 #ifndef MODEL_PATH
 #define MODEL_PATH "../../test/test_models/"
@@ -44,6 +48,18 @@ TEST(CAPITests, TokenizerCAPI) {
       throw std::runtime_error("Token decoding mismatch");
   }
 
+  // Encode all strings into one padded buffer, each row matches its single encode
+  {
+    std::vector<int32_t> tokens(std::size(input_strings) * 64);
+    int32_t lengths[std::size(input_strings)];
+    size_t sequence_length = tokenizer->EncodeBatchInto(input_strings, std::size(input_strings), tokens.data(), tokens.size(), lengths);
+    for (size_t i = 0; i < sequences->Count(); i++) {
+      auto sequence = sequences->Get(i);
+      ASSERT_EQ(static_cast<size_t>(lengths[i]), sequence.size());
+      ASSERT_TRUE(std::equal(sequence.begin(), sequence.end(), tokens.begin() + i * sequence_length));
+    }
+  }
+
   // Stream Decode one at a time
   for (size_t i = 0; i < sequences->Count(); i++) {
     auto tokenizer_stream = OgaTokenizerStream::Create(*tokenizer);
@@ -57,6 +73,34 @@ TEST(CAPITests, TokenizerCAPI) {
     if (strcmp(input_strings[i], stream_result.c_str()) != 0)
       throw std::runtime_error("Stream token decoding mismatch");
   }
+
+  // Batch stream decode all of them together, a row that has run out of tokens gets -1
+  {
+    const size_t count = sequences->Count();
+    auto batch_stream = OgaTokenizerBatchStream::Create(*tokenizer, count);
+    std::vector<std::string> results(count);
+    for (size_t step = 0;; step++) {
+      std::vector<int32_t> tokens(count, -1);
+      bool any = false;
+      for (size_t i = 0; i < count; i++) {
+        auto sequence = sequences->Get(i);
+        if (step < sequence.size()) {
+          tokens[i] = sequence[step];
+          any = true;
+        }
+      }
+      if (!any)
+        break;
+
+      const char* text;
+      const size_t* offsets;
+      batch_stream->Decode(tokens.data(), tokens.size(), text, offsets);
+      for (size_t i = 0; i < count; i++)
+        results[i].append(text + offsets[i], offsets[i + 1] - offsets[i]);
+    }
+    for (size_t i = 0; i < count; i++)
+      ASSERT_STREQ(input_strings[i], results[i].c_str());
+  }
 #endif
 }
 
@@ -89,6 +133,63 @@ TEST(CAPITests, EndToEndPhiBatch) {
 #endif
 }
 
+// Generators stepped apart, then merged into one that steps them in a single run, carry on with the tokens they
+// generate alone behind the left padding
+TEST(CAPITests, GeneratorsMergePhi) {
+#if TEST_PHI2
+  auto model = OgaModel::Create(MODEL_PATH "phi-2");
+  auto tokenizer = OgaTokenizer::Create(*model);
+  constexpr int max_length = 30;
+  constexpr size_t steps_apart = 2;
+
+  const char* input_strings[] = {
+      "This is a test.",
+      "The quick brown fox jumps over the lazy dog.",
+  };
+
+  std::vector<std::unique_ptr<OgaGeneratorParams>> params;
+  std::vector<std::unique_ptr<OgaGenerator>> generators;
+  std::vector<std::vector<int32_t>> expected;
+  std::vector<size_t> lengths;  // At the merge
+  for (auto& string : input_strings) {
+    auto input_sequences = OgaSequences::Create();
+    tokenizer->Encode(string, *input_sequences);
+    lengths.push_back(input_sequences->SequenceCount(0) + steps_apart);
+
+    auto& row_params = params.emplace_back(OgaGeneratorParams::Create(*model));
+    row_params->SetSearchOption("max_length", max_length);
+    row_params->SetInputSequences(*input_sequences);
+    auto output_sequences = model->Generate(*row_params);
+    expected.emplace_back(output_sequences->Get(0).begin(), output_sequences->Get(0).end());
+    generators.push_back(OgaGenerator::Create(*model, *row_params));
+  }
+
+  OgaGenerator* raw_generators[] = {generators[0].get(), generators[1].get()};
+  std::vector<int32_t> next_tokens(2);
+  for (size_t step = 0; step < steps_apart; step++)
+    OgaGenerator::Step(raw_generators, 2, next_tokens.data(), next_tokens.size());
+
+  auto merged_params = OgaGeneratorParams::Create(*model);
+  merged_params->SetSearchOption("max_length", max_length);
+  auto merged = OgaGenerator::Merge(raw_generators, 2, *merged_params);
+  generators.clear();
+  OgaGenerator* merged_generators[] = {merged.get()};
+  while (!merged->IsDone())
+    OgaGenerator::Step(merged_generators, 1, next_tokens.data(), next_tokens.size());
+
+  const size_t merged_length = std::max(lengths[0], lengths[1]);
+  for (size_t i = 0; i < 2; i++) {
+    const auto* sequence = merged->GetSequenceData(i);
+    const auto count = merged->GetSequenceCount(i);
+    const size_t padding = merged_length - lengths[i];
+    ASSERT_GT(count, merged_length);
+    const size_t compared = std::min(count - padding, expected[i].size());
+    EXPECT_EQ(std::vector<int32_t>(sequence + padding, sequence + padding + compared),
+              std::vector<int32_t>(expected[i].begin(), expected[i].begin() + compared));
+  }
+#endif
+}
+
 TEST(CAPITests, Tensor_And_AddExtraInput) {
   // Create a [3 4] shaped tensor
   std::array<float, 12> data{0, 1, 2, 3,
@@ -108,6 +209,23 @@ TEST(CAPITests, Tensor_And_AddExtraInput) {
   params->SetModelInput("test_input", *tensor);
 }
 
+TEST(CAPITests, DeviceTensor) {
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  std::vector<int64_t> shape{2, 8};
+
+  // The model is on the CPU, so its device memory is host memory
+  auto tensor = OgaTensor::CreateOnDevice(*model, shape.data(), shape.size(), OgaElementType_float32);
+  EXPECT_EQ(tensor->Shape(), shape);
+  EXPECT_EQ(tensor->Type(), OgaElementType_float32);
+  ASSERT_NE(tensor->Data(), nullptr);
+
+  auto view = OgaTensor::CreateOnDevice(*model, tensor->Data(), shape.data(), shape.size(), OgaElementType_float32);
+  EXPECT_EQ(view->Data(), tensor->Data());
+
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetModelInput("test_input", *view);
+}
+
 TEST(CAPITests, Logging) {
   // Trivial test to ensure the API builds properly
   Oga::SetLogBool("enabled", true);
@@ -115,6 +233,59 @@ TEST(CAPITests, Logging) {
   Oga::SetLogBool("enabled", false);
 }
 
+// Async entries from several threads are all written by the time async is turned off, past the rate limit they're
+// dropped and counted
+TEST(CAPITests, AsyncLogging) {
+  const auto log_path = (std::filesystem::temp_directory_path() / "async_logging_test.txt").string();
+  auto count_lines = [&](std::string_view text) {
+    std::ifstream file{log_path};
+    int count = 0;
+    for (std::string line; std::getline(file, line);)
+      count += line.find(text) != std::string::npos;
+    return count;
+  };
+
+  Oga::SetLogBool("enabled", true);
+  Oga::SetLogBool("ansi_tags", false);
+  Oga::SetLogString("filename", log_path.c_str());
+  Oga::SetLogBool("async", true);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([t] {
+      for (int i = 0; i < 100; i++)
+        Generators::Log("async_test", "thread " + std::to_string(t) + " entry " + std::to_string(i));
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+  Oga::SetLogBool("async", false);
+  EXPECT_EQ(count_lines("async_test"), 400);
+  EXPECT_EQ(count_lines("thread 3 entry 99"), 1);
+
+  Oga::SetLogString("rate_limit", "5");
+  Oga::SetLogBool("async", true);
+  for (int i = 0; i < 50; i++)
+    Generators::Log("limited_test", "entry " + std::to_string(i));
+  Oga::SetLogBool("async", false);
+  Oga::SetLogString("rate_limit", "0");
+  auto limited = count_lines("limited_test");
+  EXPECT_GE(limited, 5);
+  EXPECT_LE(limited, 10);  // If the entries straddle a second
+  EXPECT_EQ(count_lines("log entries dropped"), 1);
+
+  // Without async the entries are written right away
+  Generators::Log("sync_test", "entry");
+  EXPECT_EQ(count_lines("sync_test"), 1);
+
+  for (const char* rate_limit : {"ten", "-1", "5x", ""})
+    EXPECT_THROW(Oga::SetLogString("rate_limit", rate_limit), std::runtime_error);
+
+  Oga::SetLogString("filename", "");
+  Oga::SetLogBool("ansi_tags", true);
+  Oga::SetLogBool("enabled", false);
+  std::filesystem::remove(log_path);
+}
+
 // DML doesn't support GPT attention
 #if !USE_DML
 TEST(CAPITests, GreedySearchGptFp32CAPI) {
@@ -157,6 +328,13 @@ TEST(CAPITests, GreedySearchGptFp32CAPI) {
     EXPECT_TRUE(0 == std::memcmp(expected_output_start, sequence_data, sequence_length * sizeof(int32_t)));
   }
 
+  // One prompt run, then one decoder step per token after the first
+  auto metrics = generator->GetMetrics();
+  EXPECT_EQ(metrics.decode_steps, static_cast<uint64_t>(max_length - sequence_length - 1));
+  EXPECT_GT(metrics.prefill_seconds, 0.0);
+  EXPECT_GT(metrics.decode_seconds, 0.0);
+  EXPECT_GE(metrics.search_seconds, 0.0);
+
   // Test high level API
   auto sequences = model->Generate(*params);
 
@@ -171,6 +349,197 @@ TEST(CAPITests, GreedySearchGptFp32CAPI) {
     EXPECT_TRUE(0 == std::memcmp(expected_output_start, sequence_data, sequence_length * sizeof(int32_t)));
   }
 }
+
+// Reading each sequence from the length already read gets just the new token of every step
+TEST(CAPITests, GetSequenceTailGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+  const size_t batch_size = 2;
+  const size_t max_length = 10;
+
+  std::vector<const char*> model_paths{MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32"};
+#if USE_CUDA
+  model_paths.push_back(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32-cuda");  // Copied off the device
+#endif
+  for (auto* model_path : model_paths) {
+    auto model = OgaModel::Create(model_path);
+    auto params = OgaGeneratorParams::Create(*model);
+    params->SetSearchOption("max_length", static_cast<double>(max_length));
+    params->SetInputIDs(input_ids.data(), input_ids.size(), 4, batch_size);
+    auto generator = OgaGenerator::Create(*model, *params);
+
+    std::vector<std::vector<int32_t>> streamed(batch_size);
+    for (size_t i = 0; i < batch_size; i++) {
+      auto prompt = generator->GetSequenceTail(i, 0);
+      streamed[i].assign(prompt.begin(), prompt.end());
+    }
+    while (!generator->IsDone()) {
+      generator->ComputeLogits();
+      generator->GenerateNextToken();
+      for (size_t i = 0; i < batch_size; i++) {
+        auto tail = generator->GetSequenceTail(i, streamed[i].size());
+        ASSERT_EQ(tail.size(), 1U);
+        EXPECT_EQ(generator->GetSequenceCount(i), streamed[i].size() + 1);
+        streamed[i].insert(streamed[i].end(), tail.begin(), tail.end());
+      }
+    }
+
+    for (size_t i = 0; i < batch_size; i++)
+      EXPECT_EQ(streamed[i], std::vector<int32_t>(expected_output.begin() + i * max_length, expected_output.begin() + (i + 1) * max_length));
+
+    // Every row has its own copy, so reading one doesn't overwrite another's
+    const int32_t* row0 = generator->GetSequenceData(0);
+    const int32_t* row1 = generator->GetSequenceData(1);
+    EXPECT_TRUE(std::equal(row0, row0 + max_length, expected_output.begin()));
+    EXPECT_TRUE(std::equal(row1, row1 + max_length, expected_output.begin() + max_length));
+
+    // The last n tokens, none at the end, and an error past it
+    auto last = generator->GetSequenceTail(1, max_length - 3);
+    EXPECT_EQ(std::vector<int32_t>(last.begin(), last.end()), (std::vector<int32_t>{114, 114, 114}));
+    EXPECT_TRUE(generator->GetSequenceTail(1, max_length).empty());
+    EXPECT_THROW(generator->GetSequenceTail(1, max_length + 1), std::runtime_error);
+    EXPECT_TRUE(std::equal(row0, row0 + max_length, expected_output.begin()));
+  }
+}
+
+// Generators stepped on two threads at once record every event, and their session runs and kv updates name them
+TEST(CAPITests, TraceGptFp32CAPI) {
+  const char* trace_filename = "trace_test.json";
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  std::vector<int32_t> prompts[] = {{0, 0, 0, 52}, {0, 0, 195, 731}};
+  std::vector<std::unique_ptr<OgaGeneratorParams>> params;
+  std::vector<std::unique_ptr<OgaGenerator>> generators;
+  for (auto& prompt : prompts) {
+    params.push_back(OgaGeneratorParams::Create(*model));
+    params.back()->SetSearchOption("max_length", 10);
+    params.back()->SetInputIDs(prompt.data(), prompt.size(), prompt.size(), 1);
+    generators.push_back(OgaGenerator::Create(*model, *params.back()));
+  }
+
+  Oga::SetLogString("trace_filename", trace_filename);
+  Oga::SetLogBool("trace", true);
+  std::vector<std::thread> threads;
+  for (auto& generator : generators) {
+    threads.emplace_back([&generator] {
+      while (!generator->IsDone()) {
+        generator->ComputeLogits();
+        generator->GenerateNextToken();
+      }
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+  Oga::SetLogBool("trace", false);
+  Oga::SetLogString("trace_filename", "");
+
+  std::ifstream file{trace_filename};
+  std::vector<std::string> lines;
+  for (std::string line; std::getline(file, line);)
+    lines.push_back(line);
+  file.close();
+  std::remove(trace_filename);
+  ASSERT_FALSE(lines.empty());
+  EXPECT_EQ(lines.back(), "]");
+
+  for (auto& generator : generators) {
+    std::ostringstream id;
+    id << R"("generator":")" << static_cast<const void*>(generator.get()) << '"';
+    auto count = [&](const char* name) {
+      return std::count_if(lines.begin(), lines.end(), [&](const std::string& line) {
+        return line.find(std::string(R"("name":")") + name + '"') != std::string::npos && line.find(id.str()) != std::string::npos;
+      });
+    };
+    EXPECT_EQ(count("decode"), 5);  // After the prefill, one step per token but the last
+    EXPECT_EQ(count("session_run"), 6);
+    EXPECT_GE(count("kv_update"), 5);
+  }
+  for (auto& line : lines) {
+    if (line.find(R"("name":"session_run")") != std::string::npos || line.find(R"("name":"kv_update")") != std::string::npos)
+      EXPECT_NE(line.find(R"("generator":")"), std::string::npos) << line;
+  }
+}
+
+// The second request joins while the first runs, and a request finished early is taken while its cohort carries on
+TEST(CAPITests, SchedulerGptFp32CAPI) {
+  std::vector<int32_t> prompt0{0, 0, 0, 52}, prompt1{0, 0, 195, 731};
+  std::vector<int32_t> expected_output0{0, 0, 0, 52, 204, 204, 204, 204, 204, 204};
+  std::vector<int32_t> expected_output1{0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", 10);
+
+  auto scheduler = OgaScheduler::Create(*model, *params);
+  auto id0 = scheduler->AddRequest(prompt0.data(), prompt0.size());
+  auto short_id = scheduler->AddRequest(prompt0.data(), prompt0.size(), 6);
+  scheduler->Step();
+  auto id1 = scheduler->AddRequest(prompt1.data(), prompt1.size());
+  EXPECT_FALSE(scheduler->IsFinished(short_id));
+
+  while (!scheduler->IsFinished(short_id))
+    scheduler->Step();
+  auto short_result = scheduler->TakeResult(short_id);
+  EXPECT_EQ(std::vector<int32_t>(short_result->Get(0).begin(), short_result->Get(0).end()),
+            std::vector<int32_t>(expected_output0.begin(), expected_output0.begin() + 6));
+
+  while (!scheduler->IsIdle())
+    scheduler->Step();
+  auto result0 = scheduler->TakeResult(id0);
+  auto result1 = scheduler->TakeResult(id1);
+  EXPECT_EQ(std::vector<int32_t>(result0->Get(0).begin(), result0->Get(0).end()), expected_output0);
+  EXPECT_EQ(std::vector<int32_t>(result1->Get(0).begin(), result1->Get(0).end()), expected_output1);
+
+  EXPECT_THROW(scheduler->TakeResult(id0), std::runtime_error);  // Forgotten
+  EXPECT_THROW(scheduler->AddRequest(prompt0.data(), 0), std::runtime_error);
+
+  // A request's own priority
+  auto low = scheduler->AddRequest(prompt0.data(), prompt0.size(), 0, -1);
+  auto high = scheduler->AddRequest(prompt1.data(), prompt1.size(), 0, 1);
+  while (!scheduler->IsIdle())
+    scheduler->Step();
+  auto low_result = scheduler->TakeResult(low);
+  auto high_result = scheduler->TakeResult(high);
+  EXPECT_EQ(std::vector<int32_t>(low_result->Get(0).begin(), low_result->Get(0).end()), expected_output0);
+  EXPECT_EQ(std::vector<int32_t>(high_result->Get(0).begin(), high_result->Get(0).end()), expected_output1);
+  EXPECT_THROW(scheduler->AddRequest(prompt0.data(), 0, 0, 1), std::runtime_error);
+}
+
+// Generators stepped together give the tokens they give alone, the rows of a done generator are -1
+TEST(CAPITests, GeneratorsStepGptFp32CAPI) {
+  std::vector<int32_t> prompt0{0, 0, 0, 52}, prompt1{0, 0, 195, 731};
+  std::vector<int32_t> expected_output0{0, 0, 0, 52, 204, 204, 204, 204, 204, 204};
+  std::vector<int32_t> expected_output1{0, 0, 195, 731, 731, 114, 114, 114};
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params0 = OgaGeneratorParams::Create(*model);
+  params0->SetSearchOption("max_length", 10);
+  params0->SetInputIDs(prompt0.data(), prompt0.size(), prompt0.size(), 1);
+  auto params1 = OgaGeneratorParams::Create(*model);
+  params1->SetSearchOption("max_length", 8);
+  params1->SetInputIDs(prompt1.data(), prompt1.size(), prompt1.size(), 1);
+
+  auto generator0 = OgaGenerator::Create(*model, *params0);
+  auto generator1 = OgaGenerator::Create(*model, *params1);
+  OgaGenerator* generators[] = {generator0.get(), generator1.get()};
+  std::vector<int32_t> next_tokens(2);
+  EXPECT_THROW(OgaGenerator::Step(generators, 2, next_tokens.data(), 1), std::runtime_error);
+
+  for (size_t step = 0; step < 6; step++) {
+    ASSERT_EQ(OgaGenerator::Step(generators, 2, next_tokens.data(), next_tokens.size()), 2u);
+    EXPECT_EQ(next_tokens[0], expected_output0[4 + step]);
+    EXPECT_EQ(next_tokens[1], step < 4 ? expected_output1[4 + step] : -1);
+
+    // gpt2 can't merge its generators, which are left as they were
+    if (step == 0)
+      EXPECT_THROW(OgaGenerator::Merge(generators, 2, *params0), std::runtime_error);
+  }
+  EXPECT_TRUE(generator0->IsDone());
+  EXPECT_TRUE(generator1->IsDone());
+  EXPECT_EQ(std::vector<int32_t>(generator0->GetSequenceData(0), generator0->GetSequenceData(0) + generator0->GetSequenceCount(0)), expected_output0);
+  EXPECT_EQ(std::vector<int32_t>(generator1->GetSequenceData(0), generator1->GetSequenceData(0) + generator1->GetSequenceCount(0)), expected_output1);
+}
 #endif
 
 #if TEST_PHI2
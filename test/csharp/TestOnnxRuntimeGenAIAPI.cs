@@ -336,6 +336,122 @@ namespace Microsoft.ML.OnnxRuntimeGenAI.Tests
             }
         }
 
+        [IgnoreOnModelAbsebceFact(DisplayName = "TestTokenizerEncodeBatchInto")]
+        public void TestTokenizerEncodeBatchInto()
+        {
+            string modelPath = Path.Combine(Directory.GetCurrentDirectory(), "test_models", "cpu", "phi-2");
+            using (var model = new Model(modelPath))
+            {
+                Assert.NotNull(model);
+                using (var tokenizer = new Tokenizer(model))
+                {
+                    Assert.NotNull(tokenizer);
+
+                    var strings = new string[] {
+                        "This is a test.",
+                        "Rats are awesome pets!",
+                        "The quick brown fox jumps over the lazy dog."
+                    };
+
+                    var tokens = new int[256];
+                    var lengths = new int[strings.Length];
+                    int sequenceLength = tokenizer.EncodeBatchInto(strings, tokens, lengths);
+
+                    // Every row matches Encode, then is padded to the longest row
+                    for (int i = 0; i < strings.Length; i++)
+                    {
+                        var expected = tokenizer.Encode(strings[i])[0].ToArray();
+                        Assert.Equal(expected.Length, lengths[i]);
+                        Assert.Equal(expected, tokens.AsSpan(i * sequenceLength, lengths[i]).ToArray());
+                        Assert.Equal(strings[i], tokenizer.Decode(tokens.AsSpan(i * sequenceLength, lengths[i])));
+                        Assert.True(lengths[i] <= sequenceLength);
+                    }
+                    Assert.Equal(lengths.Max(), sequenceLength);
+
+                    int count = tokenizer.EncodeInto(strings[0], tokens);
+                    Assert.Equal(lengths[0], count);
+                    Assert.Equal(tokenizer.Encode(strings[0])[0].ToArray(), tokens.AsSpan(0, count).ToArray());
+
+                    Assert.Throws<OnnxRuntimeGenAIException>(() => tokenizer.EncodeBatchInto(strings, new int[sequenceLength], Span<int>.Empty));
+                    Assert.Throws<ArgumentException>(() => tokenizer.EncodeBatchInto(strings, tokens, new int[1]));
+                }
+            }
+        }
+
+        [IgnoreOnModelAbsebceFact(DisplayName = "TestTokenizerBatchStreamDecode")]
+        public void TestTokenizerBatchStreamDecode()
+        {
+            string modelPath = Path.Combine(Directory.GetCurrentDirectory(), "test_models", "cpu", "phi-2");
+            using (var model = new Model(modelPath))
+            {
+                Assert.NotNull(model);
+                using (var tokenizer = new Tokenizer(model))
+                {
+                    Assert.NotNull(tokenizer);
+
+                    var strings = new string[] {
+                        "This is a test.",
+                        "Rats are awesome pets!",
+                        "The quick brown fox jumps over the lazy dog."
+                    };
+                    var sequences = strings.Select(str => tokenizer.Encode(str)[0].ToArray()).ToArray();
+                    int maxLength = sequences.Max(sequence => sequence.Length);
+
+                    // Rows that ran out of tokens pass -1, like a finished row of a generator
+                    using (var batchStream = tokenizer.CreateBatchStream(strings.Length))
+                    {
+                        Assert.Equal(strings.Length, batchStream.BatchSize);
+                        Assert.Throws<InvalidOperationException>(() => batchStream.GetRowText(0));
+
+                        var decoded = new string[strings.Length];
+                        var streamDecoded = new string[strings.Length];
+                        var streams = strings.Select(_ => tokenizer.CreateStream()).ToArray();
+                        var nextTokens = new int[strings.Length];
+                        for (int j = 0; j < maxLength; j++)
+                        {
+                            for (int i = 0; i < strings.Length; i++)
+                            {
+                                nextTokens[i] = j < sequences[i].Length ? sequences[i][j] : -1;
+                            }
+
+                            int totalBytes = batchStream.Decode(nextTokens).Length;
+                            int rowBytes = 0;
+                            for (int i = 0; i < strings.Length; i++)
+                            {
+                                rowBytes += batchStream.GetRowUtf8(i).Length;
+                                decoded[i] += batchStream.GetRowText(i);
+                                if (nextTokens[i] >= 0)
+                                {
+                                    // DecodeUtf8 gives the bytes of what Decode would return
+                                    streamDecoded[i] += System.Text.Encoding.UTF8.GetString(streams[i].DecodeUtf8(nextTokens[i]));
+                                }
+                            }
+                            Assert.Equal(totalBytes, rowBytes);
+                        }
+                        Assert.Equal(strings, decoded);
+                        Assert.Equal(strings, streamDecoded);
+
+                        // A reset row decodes a new sequence from its start
+                        batchStream.ResetRow(0);
+                        string restarted = "";
+                        foreach (int token in sequences[1])
+                        {
+                            batchStream.Decode(new int[] { token, -1, -1 });
+                            restarted += batchStream.GetRowText(0);
+                            Assert.Equal("", batchStream.GetRowText(1));
+                        }
+                        Assert.Equal(strings[1], restarted);
+                        Assert.Throws<ArgumentOutOfRangeException>(() => batchStream.GetRowText(strings.Length));
+
+                        foreach (var stream in streams)
+                        {
+                            stream.Dispose();
+                        }
+                    }
+                }
+            }
+        }
+
         [IgnoreOnModelAbsebceFact(DisplayName = "TestPhi2")]
         public void TestPhi2()
         {
@@ -5,8 +5,26 @@
 #include <generators.h>
 #include <search.h>
 #include <models/model.h>
+#include <models/adapters.h>
+#include <models/captured_graph_pool.h>
+#include <models/gpt.h>
+#include <models/kv_cache.h>
+#include <models/multi_modal_vision_model.h>
+#include <models/numa.h>
+#include <models/prompt_image_processor.h>
+#include <models/rotary_embedding.h>
+#include <models/sparse_attention.h>
+#include <models/static_buffer.h>
+#include <scheduler.h>
+#include <speculative.h>
+#include <streaming.h>
+#include <whisper_streaming.h>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <random>
+#include <thread>
 #ifndef MODEL_PATH
 #define MODEL_PATH "../../test/test_models/"
 #endif
@@ -19,41 +37,1852 @@ static const std::pair<const char*, const char*> c_tiny_gpt2_model_paths[] = {
     {MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp16-cuda", "fp16"},
 };
 
+// The prompts of the tiny gpt2 tests and their greedy output at max_length 10
+static const std::vector<int32_t> c_tiny_gpt2_input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+static const std::vector<int32_t> c_tiny_gpt2_expected_output{
+    0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+    0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+// Generates the greedy output of the tiny gpt2 prompts with the config and params changed first, for options that
+// mustn't change the tokens. on_step runs after every ComputeLogits. Returns the model, to check what the option did.
+static std::shared_ptr<Generators::Model> ExpectGpt2Output(const std::function<void(Generators::Config&)>& config_mutator = {},
+                                                           const std::function<void(Generators::GeneratorParams&)>& params_mutator = {},
+                                                           const std::function<void(Generators::Generator&)>& on_step = {},
+                                                           const char* model_path = MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32") {
+  auto config = std::make_unique<Generators::Config>(fs::path(model_path));
+  if (config_mutator)
+    config_mutator(*config);
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), std::move(config));
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+  params->batch_size = 2;
+  params->sequence_length = 4;
+  params->input_ids = c_tiny_gpt2_input_ids;
+  if (params_mutator)
+    params_mutator(*params);
+
+  auto generator = Generators::CreateGenerator(*model, *params);
+  while (!generator->IsDone()) {
+    generator->ComputeLogits();
+    if (on_step)
+      on_step(*generator);
+    generator->GenerateNextToken();
+  }
+
+  for (int i = 0; i < params->batch_size; i++) {
+    auto sequence = generator->GetSequence(i).GetCPU();
+    EXPECT_EQ(std::vector<int32_t>(sequence.begin(), sequence.end()),
+              std::vector<int32_t>(c_tiny_gpt2_expected_output.begin() + i * 10, c_tiny_gpt2_expected_output.begin() + (i + 1) * 10));
+  }
+  return model;
+}
+
+// Records where every step's first present is, see ExpectPingPongPresents
+static std::function<void(Generators::Generator&)> RecordPresents(std::vector<const void*>& presents) {
+  return [&presents](Generators::Generator& generator) {
+    presents.push_back(generator.GetState().GetOutput("present_0")->GetTensorMutableRawData());
+  };
+}
+
+// The presents alternate between the two ping pong buffers of the kv tensor, which grow at lengths 6 and 7 and then
+// hold lengths 8 and 9 where they are
+static void ExpectPingPongPresents(const std::vector<const void*>& presents) {
+  ASSERT_EQ(presents.size(), 6u);  // Lengths 4 to 9
+  EXPECT_NE(presents[4], presents[5]);
+  EXPECT_EQ(presents[4], presents[2]);
+  EXPECT_EQ(presents[5], presents[3]);
+}
+
 // DML doesn't support GPT attention
 #if !USE_DML
 TEST(ModelTests, GreedySearchGptFp32) {
-  std::vector<int64_t> input_ids_shape{2, 4};
-  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+  // To generate this file:
+  // python convert_generation.py --model_type gpt2 -m hf-internal-testing/tiny-random-gpt2 --output tiny_gpt2_greedysearch_fp16.onnx --use_gpu --max_length 20
+  // And copy the resulting gpt2_init_past_fp32.onnx file into these two files (as it's the same for gpt2)
+  ExpectGpt2Output();
+}
+
+// The tiny gpt2's attention doesn't take past_sequence_length, so asking for the shared buffer keeps the growing pasts
+// in the ping pong buffers instead, for greedy and beam search alike
+TEST(ModelTests, SharedBufferGptFp32) {
+  std::vector<const void*> presents;
+  auto model = ExpectGpt2Output({}, [](Generators::GeneratorParams& params) { params.search.past_present_share_buffer = true; }, RecordPresents(presents));
+  ExpectPingPongPresents(presents);
+
+  auto generate = [&](bool share_buffer) {
+    auto params = Generators::CreateGeneratorParams(*model);
+    params->search.max_length = 10;
+    params->search.num_beams = 4;
+    params->search.past_present_share_buffer = share_buffer;
+    params->batch_size = 2;
+    params->sequence_length = 4;
+    params->input_ids = c_tiny_gpt2_input_ids;
+    EXPECT_FALSE(Generators::KV_Cache_Combined::IsBufferShared(*model, *params));
+    return Generators::Generate(*model, *params);
+  };
+  EXPECT_EQ(generate(true), generate(false));
+}
+
+// kv_cache.preallocate keeps the pasts in the ping pong buffers, which must not change what is generated
+TEST(ModelTests, PreallocatedKVGptFp32) {
+  std::vector<const void*> presents;
+  auto model = ExpectGpt2Output([](Generators::Config& config) { config.model.decoder.kv_cache.preallocate = true; }, {}, RecordPresents(presents));
+  ExpectPingPongPresents(presents);
+
+  auto generate = [&](Generators::Model& model) {
+    auto params = Generators::CreateGeneratorParams(model);
+    params->search.max_length = 10;
+    params->search.num_beams = 4;
+    params->batch_size = 2;
+    params->sequence_length = 4;
+    params->input_ids = c_tiny_gpt2_input_ids;
+    return Generators::Generate(model, *params);
+  };
+  auto growing_model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  EXPECT_EQ(generate(*model), generate(*growing_model));
+}
+
+// phi-2's split kv reorders the beams of the shared buffer in place, the beams have to match the growing pasts
+TEST(ModelTests, SharedBufferBeamSearchPhi2) {
+#if TEST_PHI2
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "phi-2");
+  auto tokenizer = model->CreateTokenizer();
+  std::vector<std::string> prompts{"This is a test.", "Rats are awesome pets!"};
+  auto input_ids = tokenizer->EncodeBatch(prompts);
+
+  auto generate = [&](bool share_buffer) {
+    auto params = Generators::CreateGeneratorParams(*model);
+    params->search.max_length = 24;
+    params->search.num_beams = 4;
+    params->search.past_present_share_buffer = share_buffer;
+    params->batch_size = static_cast<int>(prompts.size());
+    params->sequence_length = static_cast<int>(input_ids.size()) / params->batch_size;
+    params->input_ids = input_ids;
+
+    auto generator = Generators::CreateGenerator(*model, *params);
+    while (!generator->IsDone()) {
+      generator->ComputeLogits();
+      generator->GenerateNextToken();
+    }
+    std::vector<int32_t> output;
+    for (int i = 0; i < params->batch_size; i++) {
+      auto sequence = generator->GetSequence(i).GetCPU();
+      output.insert(output.end(), sequence.begin(), sequence.end());
+    }
+    return output;
+  };
+
+  EXPECT_EQ(generate(true), generate(false));
+#endif
+}
+
+// Every prompt gets num_return_sequences batch rows, top_k 1 makes each of its samples the greedy sequence
+TEST(ModelTests, SamplingReturnSequencesGptFp32) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+  params->search.do_sample = true;
+  params->search.top_k = 1;
+  params->search.num_return_sequences = 3;
+  params->batch_size = 2;
+  params->sequence_length = 4;
+  params->input_ids = c_tiny_gpt2_input_ids;
+
+  auto result = Generators::Generate(*model, *params);
+  ASSERT_EQ(result.size(), 6);
+  for (size_t i = 0; i < result.size(); i++) {
+    auto* expected = &c_tiny_gpt2_expected_output[i / 3 * params->search.max_length];
+    EXPECT_TRUE(std::equal(result[i].begin(), result[i].end(), expected, expected + params->search.max_length));
+  }
+}
+
+// phi-2 is a decoder only model, so the samples of a prompt share its kv (ExpandBeams of one prompt run) and still
+// match the greedy sequence with top_k 1
+TEST(ModelTests, SamplingReturnSequencesPhi2) {
+#if TEST_PHI2
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "phi-2");
+  auto tokenizer = model->CreateTokenizer();
+  std::vector<std::string> prompts{"This is a test.", "Rats are awesome pets!"};
+  auto input_ids = tokenizer->EncodeBatch(prompts);
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 24;
+  params->batch_size = static_cast<int>(prompts.size());
+  params->sequence_length = static_cast<int>(input_ids.size()) / params->batch_size;
+  params->input_ids = input_ids;
+  auto expected = Generators::Generate(*model, *params);
+
+  params->search.do_sample = true;
+  params->search.top_k = 1;
+  params->search.num_return_sequences = 3;
+  auto result = Generators::Generate(*model, *params);
+  ASSERT_EQ(result.size(), 6);
+  for (size_t i = 0; i < result.size(); i++)
+    EXPECT_EQ(result[i], expected[i / 3]);
+#endif
+}
+
+// The chunks of a prompt run without the shared buffer and are seeded into it, so the tokens match a whole prefill
+// either way
+TEST(ModelTests, ChunkedPrefillPhi2) {
+#if TEST_PHI2
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "phi-2");
+  auto tokenizer = model->CreateTokenizer();
+  auto input_ids = tokenizer->Encode("The quick brown fox jumps over the lazy dog, and then it");
+
+  auto generate = [&](bool share_buffer, int chunk_size) {
+    auto params = Generators::CreateGeneratorParams(*model);
+    params->search.max_length = static_cast<int>(input_ids.size()) + 8;
+    params->search.past_present_share_buffer = share_buffer;
+    params->search.prefill_chunk_size = chunk_size;
+    params->batch_size = 1;
+    params->sequence_length = static_cast<int>(input_ids.size());
+    params->input_ids = input_ids;
+    return Generators::Generate(*model, *params)[0];
+  };
+
+  auto expected = generate(false, 0);
+  for (bool share_buffer : {false, true}) {
+    EXPECT_EQ(generate(share_buffer, 0), expected);
+    EXPECT_EQ(generate(share_buffer, 3), expected);
+    EXPECT_EQ(generate(share_buffer, static_cast<int>(input_ids.size()) - 1), expected);
+  }
+#endif
+}
+
+// Segments split where the tokenizer splits anyway give the tokens of the whole prompt, cached or not
+TEST(ModelTests, EncodeSegmentsGptFp32) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto tokenizer = model->CreateTokenizer();
+
+  std::vector<std::string> segments{"You are a helpful assistant.", "\n", "What is the capital of France?", "\n"};
+  std::string prompt;
+  for (auto& segment : segments)
+    prompt += segment;
+  auto expected = tokenizer->Encode(prompt.c_str());
+  EXPECT_EQ(tokenizer->EncodeSegments(segments), expected);
+
+  // The second time the system prompt's tokens come from the cache
+  segments[2] = "Where is the Eiffel tower?";
+  prompt = segments[0] + segments[1] + segments[2] + segments[3];
+  EXPECT_EQ(tokenizer->EncodeSegments(segments), tokenizer->Encode(prompt.c_str()));
+
+  EXPECT_EQ(tokenizer->EncodeSegments(std::span<const std::string>(segments).first(1)), tokenizer->Encode(segments[0].c_str()));
+  EXPECT_TRUE(tokenizer->EncodeSegments({}).empty());
+}
+
+// Whatever the machine, the calling thread's node has cpus and at least one physical core among them
+TEST(ModelTests, NumaNode) {
+  auto node = Generators::GetNumaNode(-1);
+  ASSERT_FALSE(node.cpus.empty());
+  EXPECT_TRUE(std::is_sorted(node.cpus.begin(), node.cpus.end()));
+  ASSERT_FALSE(node.core_cpus.empty());
+  for (int cpu : node.core_cpus)
+    EXPECT_NE(std::find(node.cpus.begin(), node.cpus.end(), cpu), node.cpus.end());
+
+  EXPECT_THROW(Generators::GetNumaNode(1 << 20), std::runtime_error);
+}
+
+// Pinning the intra op threads to a node only changes where they run: the calling thread and then a physical core of
+// the node each, onnxruntime numbering them from 1
+TEST(ModelTests, NumaNodeGptFp32) {
+  auto model = ExpectGpt2Output([](Generators::Config& config) {
+    config.model.decoder.session_options.numa_node = -1;
+    config.model.decoder.session_options.intra_op_num_threads = 3;
+  });
+
+  auto node = Generators::GetNumaNode(-1);
+  std::vector<int> cpus = node.core_cpus;
+  for (int cpu : node.cpus) {
+    if (std::find(node.core_cpus.begin(), node.core_cpus.end(), cpu) == node.core_cpus.end())
+      cpus.push_back(cpu);
+  }
+  auto expected = std::to_string(cpus[1 % cpus.size()] + 1) + ";" + std::to_string(cpus[2 % cpus.size()] + 1);
+  EXPECT_EQ(model->session_options_->GetConfigEntry("session.intra_op_thread_affinities"), expected);
+}
+
+// A model loaded from a memory mapping runs the same as one read from its file, the Python tests map external data too
+TEST(ModelTests, MemoryMappedGptFp32) {
+  ExpectGpt2Output([](Generators::Config& config) { config.model.decoder.session_options.memory_map = true; });
+}
+
+// The external data locations are read from the serialized ModelProto, the way the model records them
+TEST(ModelTests, ExternalDataLocations) {
+  auto varint = [](std::string& out, uint64_t value) {
+    for (; value >= 0x80; value >>= 7)
+      out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+    out.push_back(static_cast<char>(value));
+  };
+  auto field = [&](uint32_t number, const std::string& bytes) {
+    std::string out;
+    varint(out, (static_cast<uint64_t>(number) << 3) | 2);
+    varint(out, bytes.size());
+    return out + bytes;
+  };
+  auto tensor = [&](const std::string& location) {
+    std::string dims;
+    varint(dims, 1 << 3);  // dims: 4, a varint field to skip
+    varint(dims, 4);
+    return dims + field(8, "weight") + field(13, field(1, "location") + field(2, location)) + field(13, field(1, "offset") + field(2, "0"));
+  };
+
+  // Initializers of the main graph, a sparse initializer and the subgraph of an If node's then_branch attribute
+  auto subgraph = field(5, tensor("sub/weights.bin"));
+  auto node = field(5, field(1, "then_branch") + field(6, subgraph));
+  auto graph = field(1, node) + field(5, tensor("model.onnx.data")) + field(5, tensor("model.onnx.data")) + field(15, field(1, tensor("sparse.data")));
+  auto model = field(7, graph);
+  auto bytes = std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(model.data()), model.size());
+  EXPECT_EQ(Generators::GetExternalDataLocations(bytes), (std::vector<std::string>{"sub/weights.bin", "model.onnx.data", "sparse.data"}));
+
+  EXPECT_TRUE(Generators::GetExternalDataLocations({}).empty());
+  EXPECT_THROW(Generators::GetExternalDataLocations(bytes.subspan(0, bytes.size() - 3)), std::runtime_error);  // Truncated
+}
+
+struct SessionsModel : Generators::Gpt_Model {
+  using Gpt_Model::Gpt_Model;
+  using Model::CreateSessions;
+};
+
+// Session creations don't share a pool: a creation can create sessions itself, models load on several threads at
+// once, and every creation finishes before the first error is thrown
+TEST(ModelTests, CreateSessionsConcurrently) {
+  auto model = std::make_shared<SessionsModel>(std::make_unique<Generators::Config>(fs::path(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32")),
+                                               Generators::GetOrtEnv());
+  std::atomic<int> created{};
+  auto create = [&] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    created++;
+  };
+
+  auto create_nested = [&] { model->CreateSessions({create, create}); };
+  model->CreateSessions({create_nested, create_nested, create});
+  EXPECT_EQ(created, 5);
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++)
+    threads.emplace_back([&] { model->CreateSessions({create, create, create}); });
+  for (auto& thread : threads)
+    thread.join();
+  EXPECT_EQ(created, 17);
+
+  created = 0;
+  EXPECT_THROW(model->CreateSessions({create, [] { throw std::runtime_error("failed"); }, create}), std::runtime_error);
+  EXPECT_EQ(created, 2);
+}
+
+// The first load saves the optimized graph to the cache_dir, the second one loads it and has to generate the same
+TEST(ModelTests, SessionCacheGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+  std::vector<int32_t> expected_output{0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  const std::filesystem::path cache_path{MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32/session_cache_test"};
+  std::filesystem::remove_all(cache_path);
+  auto cached_files = [&] {
+    std::vector<std::string> names;
+    for (auto& entry : std::filesystem::directory_iterator(cache_path))
+      names.push_back(entry.path().filename().string());
+    std::sort(names.begin(), names.end());
+    return names;
+  };
+
+  std::vector<std::string> saved;
+  for (int load = 0; load < 2; load++) {
+    auto config = std::make_unique<Generators::Config>(fs::path(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32"));
+    config->model.decoder.session_options.cache_dir = "session_cache_test";
+    auto model = Generators::CreateModel(Generators::GetOrtEnv(), std::move(config));
+
+    auto params = Generators::CreateGeneratorParams(*model);
+    params->search.max_length = 10;
+    params->sequence_length = 4;
+    params->input_ids = input_ids;
+    EXPECT_EQ(Generators::Generate(*model, *params)[0], expected_output);
+
+    if (load == 0) {
+      // The optimized model and its weights, no temporary file left behind
+      saved = cached_files();
+      auto count = [&](const char* extension) {
+        return std::count_if(saved.begin(), saved.end(), [&](const std::string& name) { return std::filesystem::path(name).extension() == extension; });
+      };
+      EXPECT_EQ(count(".onnx"), 1);
+      EXPECT_EQ(count(".tmp"), 0);
+    }
+  }
+  EXPECT_EQ(cached_files(), saved);  // Loaded from the cache, not saved again
+  std::filesystem::remove_all(cache_path);
+}
+
+// model.decoder.offload is read from the config, and a decoder has to be on CUDA with layers on both sides to use it
+TEST(ModelTests, OffloadConfig) {
+  const auto config_path = std::filesystem::temp_directory_path() / "offload_config_test";
+  std::filesystem::create_directories(config_path);
+  {
+    std::ofstream file{config_path / "genai_config.json"};
+    file << R"({"model": {"type": "gpt2", "vocab_size": 1000, "context_length": 512,
+                "decoder": {"filename": "model.onnx", "num_key_value_heads": 4, "head_size": 8, "num_hidden_layers": 5,
+                            "offload": {"filename": "model_cpu.onnx", "first_layer": 3, "session_options": {"intra_op_num_threads": 4}}}}})";
+  }
+  Generators::Config parsed{fs::path(config_path.string())};
+  std::filesystem::remove_all(config_path);
+  EXPECT_EQ(parsed.model.decoder.offload.filename, "model_cpu.onnx");
+  EXPECT_EQ(parsed.model.decoder.offload.first_layer, 3);
+  EXPECT_EQ(parsed.model.decoder.offload.session_options.intra_op_num_threads.value_or(0), 4);
+
+  auto config = std::make_unique<Generators::Config>(fs::path(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32"));
+  config->model.decoder.offload.filename = config->model.decoder.filename;
+  config->model.decoder.offload.first_layer = 2;
+  EXPECT_THROW(Generators::CreateModel(Generators::GetOrtEnv(), std::move(config)), std::runtime_error);  // Not on CUDA
+#if USE_CUDA
+  for (int first_layer : {0, 5}) {
+    config = std::make_unique<Generators::Config>(fs::path(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32-cuda"));
+    config->model.decoder.offload.filename = config->model.decoder.filename;
+    config->model.decoder.offload.first_layer = first_layer;
+    EXPECT_THROW(Generators::CreateModel(Generators::GetOrtEnv(), std::move(config)), std::runtime_error);
+  }
+#endif
+}
+
+// The encoder's ids set the batch size, and rows without a decoder prompt start from decoder_start_token_id
+TEST(ModelTests, SetEncoderInputs) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  model->config_->model.decoder_start_token_id = 7;
+  auto params = Generators::CreateGeneratorParams(*model);
+
+  std::vector<int32_t> encoder_ids{1, 2, 3, 4, 5, 6};
+  EXPECT_THROW(params->SetEncoderInputs(encoder_ids, 4, 2), std::runtime_error);
+  EXPECT_THROW(params->SetEncoderInputs(encoder_ids, 0, 2), std::runtime_error);
+  EXPECT_THROW(params->SetEncoderInputs(encoder_ids, 6, 0), std::runtime_error);
+
+  params->SetEncoderInputs(encoder_ids, 3, 2);
+  EXPECT_EQ(params->batch_size, 2);
+  EXPECT_EQ(params->sequence_length, 1);
+  EXPECT_EQ(std::vector<int32_t>(params->input_ids.begin(), params->input_ids.end()), (std::vector<int32_t>{7, 7}));
+  auto& inputs = std::get<Generators::GeneratorParams::EncoderDecoder>(params->inputs);
+  EXPECT_EQ(inputs.sequence_length, 3);
+  EXPECT_EQ(inputs.input_ids.size(), 6U);
+
+  // The defaulted decoder prompt follows new encoder ids of another batch size, as a second Prepare() in Python sets them
+  params->SetEncoderInputs(encoder_ids, 2, 3);
+  EXPECT_EQ(params->batch_size, 3);
+  EXPECT_EQ(std::vector<int32_t>(params->input_ids.begin(), params->input_ids.end()), (std::vector<int32_t>{7, 7, 7}));
+
+  // A decoder prompt of the caller's is kept, and has to have a row per encoder row
+  std::vector<int32_t> decoder_ids{7, 10, 7, 11};
+  params->input_ids = decoder_ids;
+  params->batch_size = 2;
+  params->sequence_length = 2;
+  EXPECT_THROW(params->SetEncoderInputs(encoder_ids, 2, 3), std::runtime_error);
+  params->SetEncoderInputs(encoder_ids, 3, 2);
+  EXPECT_EQ(params->input_ids.data(), decoder_ids.data());
+  EXPECT_EQ(params->sequence_length, 2);
+
+  // The model checks its config before creating any session
+  auto config = std::make_unique<Generators::Config>(fs::path(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32"));
+  config->model.type = "t5";
+  EXPECT_THROW(Generators::CreateModel(Generators::GetOrtEnv(), std::move(config)), std::runtime_error);
+  config = std::make_unique<Generators::Config>(fs::path(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32"));
+  config->model.type = "bart";
+  config->model.encoder_decoder_init.filename = config->model.decoder.filename;
+  EXPECT_THROW(Generators::CreateModel(Generators::GetOrtEnv(), std::move(config)), std::runtime_error);  // No cross kv names
+}
+
+// Adapters need a decoder exported with enable_lora, and rows fall back to the adapter of the whole batch
+TEST(ModelTests, AdaptersGptFp32) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  EXPECT_THROW(Generators::Adapters{*model}, std::runtime_error);
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->batch_size = 3;
+  params->adapter = "math";
+  params->SetRowAdapter(1, "");
+  EXPECT_EQ(params->RowAdapter(0), "math");
+  EXPECT_EQ(params->RowAdapter(1), "");
+  EXPECT_EQ(params->RowAdapter(2), "math");
+}
+
+// An adapter of lora_A {2, rank} and lora_B {rank, 3}, every weight set to value
+static Generators::Adapter MakeAdapter(Generators::Model& model, const std::string& name, int64_t rank, float value) {
+  Generators::Adapter adapter{name, {}};
+  auto a = OrtValue::CreateTensor<float>(model.allocator_cpu_, std::array<int64_t, 2>{2, rank});
+  auto b = OrtValue::CreateTensor<float>(model.allocator_cpu_, std::array<int64_t, 2>{rank, 3});
+  std::fill_n(a->GetTensorMutableData<float>(), 2 * rank, value);
+  std::fill_n(b->GetTensorMutableData<float>(), rank * 3, value);
+  adapter.values.emplace("w.lora_A", std::move(a));
+  adapter.values.emplace("w.lora_B", std::move(b));
+  return adapter;
+}
+
+// Loading writes only the adapter's own slot, restacking when the slots run out or the rank grows, and an unloaded
+// adapter's slot is reused once no weights hold it anymore
+TEST(ModelTests, AdapterStackSlots) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  std::vector<Generators::LoraInput> inputs{{"w.lora_A", true, 2, Ort::TypeToTensorType<float>::type},
+                                            {"w.lora_B", false, 3, Ort::TypeToTensorType<float>::type}};
+  Generators::AdapterStack stack{*model, inputs};
+  EXPECT_EQ(stack.Get()->storage_->slots, 1);
+
+  auto with_a = stack.Load(MakeAdapter(*model, "a", 1, 1.0f));
+  auto with_b = stack.Load(MakeAdapter(*model, "b", 1, 2.0f));
+  EXPECT_EQ(with_b->storage_->slots, 4);
+  auto with_c = stack.Load(MakeAdapter(*model, "c", 1, 3.0f));
+  EXPECT_EQ(with_c->storage_, with_b->storage_);  // Written into a free slot
+  EXPECT_EQ(with_c->GetIndex(""), 0);
+  EXPECT_EQ(with_c->GetIndex("a"), 1);
+  EXPECT_EQ(with_c->GetIndex("c"), 3);
+  EXPECT_THROW(with_b->GetIndex("c"), std::runtime_error);
+  EXPECT_THROW(stack.Load(MakeAdapter(*model, "a", 1, 1.0f)), std::runtime_error);
+
+  // with_c still runs on a, so d can't take its slot
+  auto without_a = stack.Unload("a");
+  EXPECT_THROW(without_a->GetIndex("a"), std::runtime_error);
+  EXPECT_THROW(stack.Unload("a"), std::runtime_error);
+  auto with_d = stack.Load(MakeAdapter(*model, "d", 1, 4.0f));
+  EXPECT_NE(with_d->storage_, with_c->storage_);
+  EXPECT_EQ(with_d->storage_->slots, 4);
+  EXPECT_EQ(with_d->GetIndex("d"), 1);  // The restacked storage is new, so a's slot is free in it
+  EXPECT_EQ(with_c->GetIndex("a"), 1);
+  EXPECT_EQ(with_c->storage_->values[0].second->GetTensorData<float>()[2], 1.0f);  // Slot 1 of the old storage kept a
+
+  // Once nothing holds c, e reuses its slot in place
+  stack.Unload("c");
+  auto storage = with_d->storage_;
+  with_d.reset();
+  with_a.reset();
+  with_b.reset();
+  with_c.reset();
+  without_a.reset();
+  auto with_e = stack.Load(MakeAdapter(*model, "e", 1, 5.0f));
+  EXPECT_EQ(with_e->storage_, storage);
+  EXPECT_EQ(with_e->GetIndex("e"), 3);
+  EXPECT_EQ(with_e->storage_->values[1].second->GetTensorData<float>()[3 * 3], 5.0f);
+
+  // A higher rank restacks with every adapter zero padded to it
+  auto with_f = stack.Load(MakeAdapter(*model, "f", 2, 6.0f));
+  EXPECT_NE(with_f->storage_, with_e->storage_);
+  EXPECT_EQ(with_f->storage_->ranks, (std::vector<int64_t>{2, 2}));
+  auto* lora_a = with_f->storage_->values[0].second->GetTensorData<float>();  // {slots, 2, 2}
+  EXPECT_EQ(std::vector<float>(lora_a + 4, lora_a + 8), (std::vector<float>{4.0f, 0.0f, 4.0f, 0.0f}));  // d at slot 1
+  auto f = with_f->GetIndex("f");
+  EXPECT_EQ(std::vector<float>(lora_a + f * 4, lora_a + f * 4 + 4), (std::vector<float>(4, 6.0f)));
+  auto* lora_b = with_f->storage_->values[1].second->GetTensorData<float>();  // {slots, 2, 3}
+  EXPECT_EQ(std::vector<float>(lora_b + 3 * 6, lora_b + 4 * 6), (std::vector<float>{5.0f, 5.0f, 5.0f, 0.0f, 0.0f, 0.0f}));  // e at slot 3
+}
+
+// Batches of several chunks tokenized from several threads at once match the strings encoded one by one
+TEST(ModelTests, EncodeBatchConcurrentGptFp32) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto tokenizer = model->CreateTokenizer();
+  std::vector<std::string> strings;
+  for (int i = 0; i < 150; i++)
+    strings.push_back(std::string(static_cast<size_t>(i % 7), 'a') + " string " + std::to_string(i));
+  std::vector<const char*> texts;
+  for (auto& string : strings)
+    texts.push_back(string.c_str());
+
+  auto check = [&] {
+    auto params = Generators::CreateGeneratorParams(*model);
+    std::vector<int32_t> lengths(strings.size());
+    tokenizer->EncodeBatchInto(texts, *params, lengths);
+    for (size_t i = 0; i < strings.size(); i++) {
+      auto row = params->input_ids.subspan(i * params->sequence_length, params->sequence_length);
+      auto expected = tokenizer->Encode(strings[i].c_str());
+      ASSERT_EQ(static_cast<size_t>(lengths[i]), expected.size());
+      EXPECT_TRUE(std::equal(expected.begin(), expected.end(), row.begin()));
+      EXPECT_TRUE(std::all_of(row.begin() + lengths[i], row.end(), [&](int32_t id) { return id == params->pad_token_id; }));
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++)
+    threads.emplace_back(check);
+  for (auto& thread : threads)
+    thread.join();
+}
+
+// Models loaded with the same shared weights map each file once and still run like a model of their own
+TEST(ModelTests, SharedWeightsGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52};
+  std::vector<int32_t> expected_output{0, 0, 0, 52, 204, 204, 204, 204, 204, 204};
+
+  auto shared_weights = std::make_shared<Generators::SharedWeights>();
+  auto model1 = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32", shared_weights);
+  auto model2 = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32", shared_weights);
+
+  fs::path model_file{MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32"};
+  auto mapping = shared_weights->Map(model_file / model1->config_->model.decoder.filename);
+  EXPECT_EQ(mapping, shared_weights->Map(model_file / model2->config_->model.decoder.filename));
+
+  for (auto* model : {model1.get(), model2.get()}) {
+    auto params = Generators::CreateGeneratorParams(*model);
+    params->search.max_length = 10;
+    params->sequence_length = 4;
+    params->input_ids = input_ids;
+    EXPECT_EQ(Generators::Generate(*model, *params)[0], expected_output);
+  }
+}
+
+// Generators on one model running from their own threads get the same outputs as GreedySearchGptFp32
+TEST(ModelTests, ConcurrentGeneratorsGptFp32) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+  params->batch_size = 2;
+  params->sequence_length = 4;
+  params->input_ids = c_tiny_gpt2_input_ids;
+
+  constexpr int c_thread_count = 4;
+  std::vector<std::vector<int32_t>> outputs(c_thread_count);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < c_thread_count; t++) {
+    threads.emplace_back([&, t] {
+      auto generator = Generators::CreateGenerator(*model, *params);
+      while (!generator->IsDone()) {
+        generator->ComputeLogits();
+        generator->GenerateNextToken();
+      }
+      for (int i = 0; i < params->batch_size; i++) {
+        auto sequence = generator->GetSequence(i).GetCPU();
+        outputs[t].insert(outputs[t].end(), sequence.begin(), sequence.end());
+      }
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+
+  for (auto& output : outputs)
+    EXPECT_EQ(output, c_tiny_gpt2_expected_output);
+}
+
+TEST(ModelTests, CancelGptFp32) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+  params->batch_size = 2;
+  params->sequence_length = 4;
+  params->input_ids_owner = c_tiny_gpt2_input_ids;  // Like the C API, the generators point into the params
+  params->input_ids = params->input_ids_owner;
+  auto cancellation = std::make_shared<Generators::Cancellation>();
+  params->cancellation = cancellation;
+
+  auto generator_a = Generators::CreateGenerator(*model, *params);
+  auto generator_b = Generators::CreateGenerator(*model, *params);
+  params.reset();  // The generators keep what they use of it
+
+  generator_a->ComputeLogits();
+  generator_a->GenerateNextToken();
+  generator_a->Cancel();
+  EXPECT_TRUE(generator_a->IsDone());
+  generator_a->ComputeLogits();  // Does nothing
+  generator_a->GenerateNextToken();
+  EXPECT_EQ(generator_a->GetSequence(0).GetCPU().size(), 5u);
+
+  // Cancelling a generator leaves the others of the shared cancellation running, cancelling that stops them all
+  EXPECT_FALSE(generator_b->IsDone());
+  generator_b->ComputeLogits();
+  generator_b->GenerateNextToken();
+  EXPECT_EQ(generator_b->GetSequence(1).GetCPU()[4], 731);
+  cancellation->Cancel(true);
+  EXPECT_TRUE(generator_b->IsDone());
+
+  // A generator of an already cancelled request is done before its prompt runs
+  auto params_c = Generators::CreateGeneratorParams(*model);
+  params_c->batch_size = 2;
+  params_c->sequence_length = 4;
+  params_c->input_ids = c_tiny_gpt2_input_ids;
+  params_c->cancellation = cancellation;
+  auto generator_c = Generators::CreateGenerator(*model, *params_c);
+  EXPECT_TRUE(generator_c->IsDone());
+}
+
+TEST(ModelTests, TimeoutGptFp32) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+  params->batch_size = 2;
+  params->sequence_length = 4;
+  params->input_ids = c_tiny_gpt2_input_ids;
+
+  params->search.timeout_ms = 60 * 1000;
+  auto generator = Generators::CreateGenerator(*model, *params);
+  generator->ComputeLogits();
+  generator->GenerateNextToken();
+  EXPECT_FALSE(generator->IsDone());
+
+  params->search.timeout_ms = 1;
+  auto timed_out = Generators::CreateGenerator(*model, *params);
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  EXPECT_TRUE(timed_out->IsDone());
+  timed_out->ComputeLogits();
+  timed_out->GenerateNextToken();
+  EXPECT_EQ(timed_out->GetSequence(0).GetCPU().size(), 4u);  // Nothing was generated
+}
+
+TEST(ModelTests, SchedulerGptFp32) {
+  // Same prompts and expected outputs as GreedySearchGptFp32, but the second request joins after the first has started
+  std::vector<int32_t> prompt0{0, 0, 0, 52}, prompt1{0, 0, 195, 731};
+  std::vector<int32_t> expected_output0{0, 0, 0, 52, 204, 204, 204, 204, 204, 204};
+  std::vector<int32_t> expected_output1{0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+
+  Generators::Scheduler scheduler{*model, *params};
+  int id0 = scheduler.AddRequest(prompt0);
+  scheduler.Step();
+  scheduler.Step();
+  int id1 = scheduler.AddRequest(prompt1);
+  EXPECT_EQ(scheduler.QueuedCount(), 1u);
+
+  while (!scheduler.IsIdle())
+    scheduler.Step();
+
+  EXPECT_EQ(scheduler.TakeResult(id0), expected_output0);
+  EXPECT_EQ(scheduler.TakeResult(id1), expected_output1);
+}
+
+// With room for one running request, a queued request of a higher priority goes first, and one added later preempts
+// the running request of a lower priority. Recompute requeues it with the tokens it had, so it still finishes the same.
+TEST(ModelTests, SchedulerPriorityGptFp32) {
+  std::vector<int32_t> prompt0{0, 0, 0, 52}, prompt1{0, 0, 195, 731};
+  std::vector<int32_t> expected_output0{0, 0, 0, 52, 204, 204, 204, 204, 204, 204};
+  std::vector<int32_t> expected_output1{0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+
+  Generators::Scheduler queued{*model, *params};
+  queued.max_active_sequences_ = 1;
+  int low = queued.AddRequest(prompt0);
+  int high = queued.AddRequest(prompt1, 0, 1);
+  while (!queued.IsFinished(high)) {
+    queued.Step();
+    EXPECT_EQ(queued.QueuedCount(), 1u);
+  }
+  EXPECT_FALSE(queued.IsFinished(low));
+  while (!queued.IsIdle())
+    queued.Step();
+  EXPECT_EQ(queued.PreemptedCount(), 0u);
+  EXPECT_EQ(queued.TakeResult(low), expected_output0);
+  EXPECT_EQ(queued.TakeResult(high), expected_output1);
+
+  Generators::Scheduler preempting{*model, *params};
+  preempting.max_active_sequences_ = 1;
+  low = preempting.AddRequest(prompt0);
+  for (int i = 0; i < 3; i++)
+    preempting.Step();
+  high = preempting.AddRequest(prompt1, 0, 1);
+  preempting.Step();
+  EXPECT_EQ(preempting.PreemptedCount(), 1u);
+  EXPECT_EQ(preempting.ActiveCount(), 1u);
+  EXPECT_EQ(preempting.QueuedCount(), 1u);  // The preempted request
+  while (!preempting.IsFinished(high))
+    preempting.Step();
+  EXPECT_FALSE(preempting.IsFinished(low));
+  while (!preempting.IsIdle())
+    preempting.Step();
+  EXPECT_EQ(preempting.TakeResult(low), expected_output0);
+  EXPECT_EQ(preempting.TakeResult(high), expected_output1);
+
+  // A request of the same priority waits instead
+  Generators::Scheduler waiting{*model, *params};
+  waiting.max_active_sequences_ = 1;
+  waiting.AddRequest(prompt0);
+  waiting.Step();
+  waiting.AddRequest(prompt1);
+  waiting.Step();
+  EXPECT_EQ(waiting.PreemptedCount(), 0u);
+  EXPECT_EQ(waiting.QueuedCount(), 1u);
+}
+
+// Gpt_Model can't merge generators: Merge throws before taking anything, so both keep going with their own memory
+TEST(ModelTests, MergeChecksGptFp32) {
+  std::vector<int32_t> input_ids0{0, 0, 0, 52}, input_ids1{0, 0, 195, 731};
+  std::vector<int32_t> expected_output0{0, 0, 0, 52, 204, 204, 204, 204, 204, 204};
+  std::vector<int32_t> expected_output1{0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto used_before = model->GetMemoryBudget().Used().Total();
+
+  auto params0 = Generators::CreateGeneratorParams(*model);
+  params0->search.max_length = 10;
+  params0->batch_size = 1;
+  params0->sequence_length = 4;
+  params0->input_ids = input_ids0;
+  auto params1 = std::make_shared<Generators::GeneratorParams>(*params0);
+  params1->input_ids = input_ids1;
+
+  auto generator0 = Generators::CreateGenerator(*model, *params0);
+  auto generator1 = Generators::CreateGenerator(*model, *params1);
+  std::vector<Generators::Generator*> generators{generator0.get(), generator1.get()};
+  std::vector<std::vector<int32_t>> rows{{0}, {0}};
+  EXPECT_THROW(Generators::Generator::Merge(generators, rows, *params0), std::runtime_error);  // Prompts haven't run
+
+  for (auto* generator : generators) {
+    generator->ComputeLogits();
+    generator->GenerateNextToken();
+  }
+  auto used = model->GetMemoryBudget().Used().Total();
+  EXPECT_THROW(Generators::Generator::Merge(generators, std::vector<std::vector<int32_t>>{{1}, {0}}, *params0), std::runtime_error);
+  EXPECT_THROW(Generators::Generator::Merge(generators, rows, *params0), std::runtime_error);  // Not a DecoderOnly_Model
+  EXPECT_EQ(model->GetMemoryBudget().Used().Total(), used);
+
+  for (auto* generator : generators) {
+    while (!generator->IsDone()) {
+      generator->ComputeLogits();
+      generator->GenerateNextToken();
+    }
+  }
+  auto sequence0 = generator0->GetSequence(0).GetCPU();
+  auto sequence1 = generator1->GetSequence(0).GetCPU();
+  EXPECT_EQ(std::vector<int32_t>(sequence0.begin(), sequence0.end()), expected_output0);
+  EXPECT_EQ(std::vector<int32_t>(sequence1.begin(), sequence1.end()), expected_output1);
+
+  generator0.reset();
+  generator1.reset();
+  EXPECT_EQ(model->GetMemoryBudget().Used().Total(), used_before);
+}
+
+// Requests that arrive apart end up in one batch, with the tokens each would get on its own
+TEST(ModelTests, SchedulerMergeCohorts) {
+#if TEST_PHI2
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "phi-2");
+  auto tokenizer = model->CreateTokenizer();
+  std::vector<std::vector<int32_t>> prompts{tokenizer->Encode("This is a test."),
+                                            tokenizer->Encode("The quick brown fox jumps over the lazy dog."),
+                                            tokenizer->Encode("Rats are awesome pets!")};
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 32;
+
+  std::vector<std::vector<int32_t>> expected;
+  for (auto& prompt : prompts) {
+    auto prompt_params = std::make_shared<Generators::GeneratorParams>(*params);
+    prompt_params->batch_size = 1;
+    prompt_params->sequence_length = static_cast<int>(prompt.size());
+    prompt_params->input_ids = prompt;
+    auto generator = Generators::CreateGenerator(*model, *prompt_params);
+    std::vector<int32_t> sequence{prompt};
+    while (!generator->IsDone()) {
+      generator->ComputeLogits();
+      generator->GenerateNextToken();
+      auto token = generator->search_->GetNextTokens().GetCPU()[0];
+      sequence.push_back(token);
+      if (token == params->eos_token_id)
+        break;
+    }
+    expected.push_back(std::move(sequence));
+  }
+
+  Generators::Scheduler scheduler{*model, *params};
+  std::vector<int> ids;
+  for (auto& prompt : prompts) {
+    ids.push_back(scheduler.AddRequest(prompt));
+    scheduler.Step();
+  }
+  EXPECT_EQ(scheduler.CohortCount(), 2u);  // The last one's prompt ran on its own
+  scheduler.Step();
+  EXPECT_EQ(scheduler.CohortCount(), 1u);
+
+  while (!scheduler.IsIdle())
+    scheduler.Step();
+  for (size_t i = 0; i < ids.size(); i++)
+    EXPECT_EQ(scheduler.TakeResult(ids[i]), expected[i]);
+#endif
+}
+
+// Two cohorts outgrow a pool of paged kv blocks, so the one of a lower priority gives way on the step that needs the
+// blocks. Swap only swaps the device kv, on CPU both recompute. Either way every request gets the tokens it gets alone.
+TEST(ModelTests, SchedulerPreemptionPhi2) {
+#if TEST_PHI2
+  auto config = std::make_unique<Generators::Config>(fs::path(MODEL_PATH "phi-2"));
+  config->model.decoder.kv_cache.block_size = 16;
+  config->model.decoder.kv_cache.max_blocks = 3;
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), std::move(config));
+  auto tokenizer = model->CreateTokenizer();
+  std::vector<std::vector<int32_t>> prompts{tokenizer->Encode("This is a test."), tokenizer->Encode("Rats are awesome pets!")};
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 28;
+  params->search.past_present_share_buffer = true;
+
+  std::vector<std::vector<int32_t>> expected;
+  for (auto& prompt : prompts) {
+    auto prompt_params = std::make_shared<Generators::GeneratorParams>(*params);
+    prompt_params->batch_size = 1;
+    prompt_params->sequence_length = static_cast<int>(prompt.size());
+    prompt_params->input_ids = prompt;
+    auto generator = Generators::CreateGenerator(*model, *prompt_params);
+    std::vector<int32_t> sequence{prompt};
+    while (!generator->IsDone()) {
+      generator->ComputeLogits();
+      generator->GenerateNextToken();
+      auto token = generator->search_->GetNextTokens().GetCPU()[0];
+      sequence.push_back(token);
+      if (token == params->eos_token_id)
+        break;
+    }
+    expected.push_back(std::move(sequence));
+  }
+
+  for (auto preemption : {Generators::Scheduler::Preemption::Recompute, Generators::Scheduler::Preemption::Swap}) {
+    Generators::Scheduler scheduler{*model, *params};
+    scheduler.preemption_ = preemption;
+    scheduler.max_batch_size_ = 1;  // Merged, the two would be one cohort that can't give way
+    int high = scheduler.AddRequest(prompts[0], 0, 1);
+    scheduler.Step();
+    int low = scheduler.AddRequest(prompts[1]);
+    while (!scheduler.IsIdle())
+      scheduler.Step();
+    EXPECT_GE(scheduler.PreemptedCount(), 1u);
+    EXPECT_EQ(scheduler.TakeResult(high), expected[0]);
+    EXPECT_EQ(scheduler.TakeResult(low), expected[1]);
+  }
+#endif
+}
+
+// A request that can't fit in the memory budget next to the running ones stays queued until it does, and one that can
+// never fit finishes with the error instead of being lost
+TEST(ModelTests, SchedulerMemoryBudgetGptFp32) {
+  std::vector<int32_t> prompt0{0, 0, 0, 52}, prompt1{0, 0, 195, 731};
+  std::vector<int32_t> expected_output0{0, 0, 0, 52, 204, 204, 204, 204, 204, 204};
+  std::vector<int32_t> expected_output1{0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  auto config = std::make_unique<Generators::Config>(fs::path(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32"));
+  config->model.decoder.memory_budget_mb = 1;
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), std::move(config));
+  auto& budget = model->GetMemoryBudget();
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+  auto cohort_params = std::make_shared<Generators::GeneratorParams>(*params);
+  cohort_params->batch_size = 1;
+  cohort_params->sequence_length = 4;
+  auto cohort_memory = model->EstimateMemory(*cohort_params);
+
+  Generators::Scheduler scheduler{*model, *params};
+
+  // Room for one cohort of one request
+  Generators::GeneratorMemory others;
+  others.kv_cache = budget.Bytes() - cohort_memory.Total() * 3 / 2;
+  budget.Reserve(others);
+
+  int id0 = scheduler.AddRequest(prompt0);
+  scheduler.Step();
+  int id1 = scheduler.AddRequest(prompt1);
+  scheduler.Step();
+  EXPECT_EQ(scheduler.ActiveCount(), 1u);
+  EXPECT_EQ(scheduler.QueuedCount(), 1u);
+
+  while (!scheduler.IsIdle())
+    scheduler.Step();
+  EXPECT_EQ(scheduler.TakeResult(id0), expected_output0);
+  EXPECT_EQ(scheduler.TakeResult(id1), expected_output1);
+
+  // No room at all
+  budget.Release(others);
+  others.kv_cache = budget.Bytes() - cohort_memory.Total() / 2;
+  budget.Reserve(others);
+
+  int id2 = scheduler.AddRequest(prompt0);
+  EXPECT_NO_THROW(scheduler.Step());
+  EXPECT_TRUE(scheduler.IsIdle());
+  EXPECT_TRUE(scheduler.IsFinished(id2));
+  EXPECT_THROW(scheduler.TakeResult(id2), std::runtime_error);
+  EXPECT_THROW(scheduler.IsFinished(id2), std::runtime_error);  // Forgotten
+
+  budget.Release(others);
+}
+
+// A tensor parallel rank holds only its share of the kv heads, which the config has already divided by the world_size
+TEST(ModelTests, EstimateMemoryTensorParallelGptFp32) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->batch_size = 2;
+  params->sequence_length = 4;
+  params->search.max_length = 10;
+  auto memory = model->EstimateMemory(*params);
+
+  // What SetupTensorParallel leaves in the config of a rank of two
+  auto config = std::make_unique<Generators::Config>(fs::path(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32"));
+  config->model.decoder.world_size = 2;
+  config->model.decoder.num_attention_heads /= 2;
+  config->model.decoder.num_key_value_heads /= 2;
+  auto rank_model = Generators::CreateModel(Generators::GetOrtEnv(), std::move(config));
+  auto rank_params = Generators::CreateGeneratorParams(*rank_model);
+  rank_params->batch_size = 2;
+  rank_params->sequence_length = 4;
+  rank_params->search.max_length = 10;
+  auto rank_memory = rank_model->EstimateMemory(*rank_params);
+
+  ASSERT_GT(memory.kv_cache, 0u);
+  EXPECT_EQ(rank_memory.kv_cache * 2, memory.kv_cache);
+  EXPECT_EQ(rank_memory.logits, memory.logits);
+}
+
+TEST(ModelTests, StreamTokensGptFp32) {
+  // Same prompts and expected outputs as GreedySearchGptFp32
+  std::vector<std::vector<int32_t>> expected_tokens{{204, 204, 204, 204, 204, 204}, {731, 114, 114, 114, 114, 114}};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+  params->batch_size = 2;
+  params->sequence_length = 4;
+  params->input_ids = c_tiny_gpt2_input_ids;
+
+  auto generator = Generators::CreateGenerator(*model, *params);
+  std::vector<std::vector<int32_t>> tokens(2);
+  Generators::StreamTokens(*generator, nullptr, [&](size_t row, int32_t token, const std::string& text) {
+    EXPECT_TRUE(text.empty());
+    tokens[row].push_back(token);
+    return true;
+  });
+  EXPECT_EQ(tokens, expected_tokens);
+  EXPECT_TRUE(generator->IsDone());
+
+  // Nothing is handed over once the callback asks to stop, and its exceptions reach the caller
+  generator = Generators::CreateGenerator(*model, *params);
+  int count = 0;
+  Generators::StreamTokens(*generator, nullptr, [&](size_t, int32_t, const std::string&) { return ++count < 3; });
+  EXPECT_EQ(count, 3);
+
+  generator = Generators::CreateGenerator(*model, *params);
+  EXPECT_THROW(Generators::StreamTokens(*generator, nullptr, [](size_t, int32_t, const std::string&) -> bool { throw std::runtime_error("callback"); }),
+               std::runtime_error);
+}
+
+TEST(ModelTests, SpeculativeRequiresDecoderOnly) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  std::vector<int32_t> input_ids{0, 0, 0, 52};
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+  params->input_ids = input_ids;
+  params->sequence_length = static_cast<int>(input_ids.size());
+
+  // gpt2 uses the combined kv cache, which can't be rolled back
+  EXPECT_THROW((Generators::SpeculativeGenerator{*model, *model, *params}), std::runtime_error);
+}
+
+TEST(ModelTests, ScoreAndEmbedRequireDecoderOnly) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  std::vector<int32_t> input_ids{0, 0, 0, 52};
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+  params->input_ids = input_ids;
+  params->sequence_length = static_cast<int>(input_ids.size());
+
+  // gpt2 isn't a decoder only model
+  EXPECT_THROW(Generators::ScoreSequences(*model, *params), std::runtime_error);
+  EXPECT_THROW(Generators::EmbedSequences(*model, *params, Generators::Pooling::Mean), std::runtime_error);
+}
+
+// Padding is found by position, so a pad_token_id between real tokens, like an eos that is also the pad, stays a token
+TEST(ModelTests, TokenRanges) {
+  Generators::GeneratorParams params;
+  params.pad_token_id = 98;
+  std::vector<int32_t> input_ids{98, 98, 5, 98, 7, 98,
+                                 1, 2, 3, 4, 5, 6,
+                                 98, 98, 98, 98, 98, 98};
+  params.input_ids = input_ids;
+  params.batch_size = 3;
+  params.sequence_length = 6;
+  EXPECT_EQ(params.TokenRanges(), (std::vector<int32_t>{2, 5, 0, 6, 0, 1}));
+
+  // With the lengths the pad tokens at the edges are real too
+  params.input_lengths = {6, 3, 1};
+  EXPECT_EQ(params.TokenRanges(), (std::vector<int32_t>{0, 6, 0, 3, 0, 1}));
+  params.pad_left = true;
+  EXPECT_EQ(params.TokenRanges(), (std::vector<int32_t>{0, 6, 3, 6, 5, 6}));
+}
+
+// A pad token inside a row is scored, and a padded row scores the same as on its own
+TEST(ModelTests, ScoreSequencesInteriorPad) {
+#if TEST_PHI2
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "phi-2");
+  auto tokenizer = model->CreateTokenizer();
+  auto first = tokenizer->Encode("This is a test.");
+  auto second = tokenizer->Encode("Hello");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 32;
+  std::vector<int32_t> row = first;
+  row.push_back(params->pad_token_id);
+  row.insert(row.end(), first.begin(), first.end());
+  const int length = static_cast<int>(row.size());
+  std::vector<int32_t> packed = row;
+  packed.insert(packed.end(), second.begin(), second.end());
+  const std::vector<int32_t> lengths{length, static_cast<int>(second.size())};
+  params->SetPackedInputs(packed, lengths);
+  auto scores = Generators::ScoreSequences(*model, *params);
+  ASSERT_EQ(scores.size(), static_cast<size_t>(2 * (length - 1)));
+
+  // Both the pad token and the token after it are scored
+  const size_t pad_position = first.size();
+  EXPECT_LT(scores[pad_position - 1], 0.0f);
+  EXPECT_LT(scores[pad_position], 0.0f);
+
+  auto single_params = Generators::CreateGeneratorParams(*model);
+  single_params->search.max_length = 32;
+  single_params->input_ids = second;
+  single_params->sequence_length = static_cast<int>(second.size());
+  auto single = Generators::ScoreSequences(*model, *single_params);
+  for (size_t i = 0; i < single.size(); i++)
+    EXPECT_NEAR(scores[length - 1 + i], single[i], 1e-3f);
+  for (size_t i = single.size(); i < static_cast<size_t>(length - 1); i++)
+    EXPECT_EQ(scores[length - 1 + i], 0.0f);
+#endif
+}
+
+// Last token pooling takes the end of each row's tokens, mean pooling all of them
+TEST(ModelTests, PoolingRanges) {
+  Generators::GeneratorParams params;
+  params.pad_token_id = 98;
+  std::vector<int32_t> input_ids{98, 5, 98, 7, 98, 98,
+                                 98, 98, 98, 98, 98, 98};
+  params.input_ids = input_ids;
+  params.batch_size = 2;
+  params.sequence_length = 6;
+  EXPECT_EQ(Generators::GetPoolingRanges(params, Generators::Pooling::Mean), (std::vector<int32_t>{1, 4, 0, 1}));
+  EXPECT_EQ(Generators::GetPoolingRanges(params, Generators::Pooling::LastToken), (std::vector<int32_t>{3, 4, 0, 1}));
+
+  params.input_lengths = {5, 2};
+  params.pad_left = true;
+  EXPECT_EQ(Generators::GetPoolingRanges(params, Generators::Pooling::Mean), (std::vector<int32_t>{1, 6, 4, 6}));
+  EXPECT_EQ(Generators::GetPoolingRanges(params, Generators::Pooling::LastToken), (std::vector<int32_t>{5, 6, 5, 6}));
+}
+
+TEST(ModelTests, SwapOutRequiresSwapIn) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  std::vector<int32_t> input_ids{0, 0, 0, 52};
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+  params->input_ids = input_ids;
+  params->sequence_length = static_cast<int>(input_ids.size());
+
+  auto generator = Generators::CreateGenerator(*model, *params);
+  EXPECT_THROW(generator->SwapIn(), std::runtime_error);
+
+  // gpt2 uses the combined kv cache, which doesn't support swapping, so the generator must stay usable
+  generator->ComputeLogits();
+  generator->GenerateNextToken();
+  EXPECT_THROW(generator->SwapOut(), std::runtime_error);
+  generator->ComputeLogits();
+}
+
+// Ragged prompts padded on either side generate what every prompt does on its own, including a 98 (the pad token)
+TEST(ModelTests, PackedInputsGptFp32) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  const std::vector<std::vector<int32_t>> prompts{{0, 0, 0, 52}, {195, 98, 731}};
+  constexpr int c_new_tokens = 6;
+
+  auto generate = [&](Generators::GeneratorParams& params) {
+    auto generator = Generators::CreateGenerator(*model, params);
+    while (!generator->IsDone()) {
+      generator->ComputeLogits();
+      generator->GenerateNextToken();
+    }
+    std::vector<std::vector<int32_t>> generated;
+    for (int i = 0; i < params.batch_size; i++) {
+      auto sequence = generator->GetSequence(i).GetCPU();
+      generated.emplace_back(sequence.begin() + params.sequence_length, sequence.end());
+    }
+    return generated;
+  };
+
+  std::vector<std::vector<int32_t>> expected;
+  for (auto& prompt : prompts) {
+    auto params = Generators::CreateGeneratorParams(*model);
+    std::vector<int32_t> length{static_cast<int32_t>(prompt.size())};
+    params->SetPackedInputs(prompt, length);
+    params->search.max_length = params->sequence_length + c_new_tokens;
+    expected.push_back(generate(*params)[0]);
+  }
+
+  std::vector<int32_t> tokens, lengths;
+  for (auto& prompt : prompts) {
+    tokens.insert(tokens.end(), prompt.begin(), prompt.end());
+    lengths.push_back(static_cast<int32_t>(prompt.size()));
+  }
+  for (bool pad_left : {false, true}) {
+    auto params = Generators::CreateGeneratorParams(*model);
+    params->SetPackedInputs(tokens, lengths, pad_left);
+    ASSERT_EQ(params->sequence_length, 4);
+    EXPECT_EQ(params->input_ids[pad_left ? 4 : 7], params->pad_token_id);
+    params->search.max_length = params->sequence_length + c_new_tokens;
+    EXPECT_EQ(generate(*params), expected);
+  }
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  std::vector<int32_t> short_lengths{4, 2};
+  EXPECT_THROW(params->SetPackedInputs(tokens, short_lengths), std::runtime_error);
+  std::vector<int32_t> empty_row{7, 0};
+  EXPECT_THROW(params->SetPackedInputs(tokens, empty_row), std::runtime_error);
+}
+
+TEST(ModelTests, AppendTokensChecks) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  std::vector<int32_t> input_ids{0, 0, 0, 52};
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+  params->input_ids = input_ids;
+  params->sequence_length = static_cast<int>(input_ids.size());
+
+  auto generator = Generators::CreateGenerator(*model, *params);
+  std::vector<int32_t> turn{1, 2};
+  generator->ComputeLogits();
+  EXPECT_THROW(generator->AppendTokens(turn), std::runtime_error);  // In the middle of processing logits
+  generator->GenerateNextToken();
+
+  std::vector<int32_t> too_long(5, 1);
+  EXPECT_THROW(generator->AppendTokens(too_long), std::runtime_error);
+
+  // gpt2 uses the combined kv cache, which can't continue, so the sequence must be left as it was
+  EXPECT_THROW(generator->AppendTokens(turn), std::runtime_error);
+  EXPECT_EQ(generator->search_->GetSequenceLength(), 5);
+  generator->ComputeLogits();
+}
+
+// Runs the gpt2 decoder directly on inputs and outputs it sets up itself
+struct DecoderRunState : Generators::State {
+  DecoderRunState(const Generators::GeneratorParams& params, const Generators::Model& model) : State{params, model} {}
+  Generators::RoamingArray<float> Run(int, Generators::RoamingArray<int32_t>, Generators::RoamingArray<int32_t>) override { return {}; }
+  using State::ClearIO;
+  using State::Run;
+};
+
+// Two prompts run through the io binding with logits written to the same buffer at two shapes, then the second one
+// without it, where onnxruntime allocates the logits
+TEST(ModelTests, RunBindingShapeChangeCpu) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto& gpt = static_cast<const Generators::Gpt_Model&>(*model);
+  auto& decoder = model->config_->model.decoder;
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+  const int64_t vocab_size = model->config_->model.vocab_size;
+
+  auto& cpu = model->allocator_cpu_;
+  auto layer_name = [](const std::string& pattern, int layer) {
+    char name[64];
+    snprintf(name, std::size(name), pattern.c_str(), layer);
+    return std::string(name);
+  };
+  auto create_ids = [&](const std::string& name, std::span<const int32_t> values) {
+    const std::array<int64_t, 2> shape{1, static_cast<int64_t>(values.size())};
+    auto type = model->session_info_->GetInputDataType(name);
+    auto value = OrtValue::CreateTensor(cpu, shape, type);
+    if (type == Ort::TypeToTensorType<int64_t>::type)
+      std::copy(values.begin(), values.end(), value->GetTensorMutableData<int64_t>());
+    else
+      std::copy(values.begin(), values.end(), value->GetTensorMutableData<int32_t>());
+    return value;
+  };
+
+  std::vector<float> logits_buffer(4 * vocab_size);
+  auto run = [&](DecoderRunState& state, std::span<const int32_t> tokens, bool bind_logits) {
+    std::vector<int32_t> positions(tokens.size()), mask(tokens.size(), 1);
+    std::iota(positions.begin(), positions.end(), 0);
+    std::vector<std::unique_ptr<OrtValue>> values;
+    values.push_back(create_ids(decoder.inputs.input_ids, tokens));
+    values.push_back(create_ids(decoder.inputs.position_ids, positions));
+    values.push_back(create_ids(decoder.inputs.attention_mask, mask));
+    std::vector<std::string> names{decoder.inputs.input_ids, decoder.inputs.position_ids, decoder.inputs.attention_mask};
+    const std::array<int64_t, 5> past_shape{2, 1, decoder.num_key_value_heads, 0, decoder.head_size};
+    for (int i = 0; i < decoder.num_hidden_layers; i++) {
+      values.push_back(OrtValue::CreateTensor<float>(cpu, past_shape));
+      names.push_back(layer_name(decoder.inputs.past_names, i));
+    }
+
+    state.ClearIO();
+    for (size_t i = 0; i < values.size(); i++) {
+      state.input_names_.push_back(names[i].c_str());
+      state.inputs_.push_back(values[i].get());
+    }
+
+    const std::array<int64_t, 3> logits_shape{1, static_cast<int64_t>(tokens.size()), vocab_size};
+    std::unique_ptr<OrtValue> logits;
+    if (bind_logits)
+      logits = OrtValue::CreateTensor<float>(cpu.GetInfo(), logits_buffer, logits_shape);
+    state.output_names_.push_back(decoder.outputs.logits.c_str());
+    state.outputs_.push_back(logits.get());
+
+    std::vector<std::string> present_names;
+    const std::array<int64_t, 5> present_shape{2, 1, decoder.num_key_value_heads, static_cast<int64_t>(tokens.size()), decoder.head_size};
+    for (int i = 0; i < decoder.num_hidden_layers; i++)
+      present_names.push_back(layer_name(decoder.outputs.present_names, i));
+    for (int i = 0; i < decoder.num_hidden_layers; i++) {
+      values.push_back(OrtValue::CreateTensor<float>(cpu, present_shape));
+      state.output_names_.push_back(present_names[i].c_str());
+      state.outputs_.push_back(values.back().get());
+    }
+
+    state.Run(*gpt.session_decoder_, 1);
+    auto* output = state.outputs_[0];
+    auto data = output->GetTensorData<float>();
+    std::vector<float> result(data, data + tokens.size() * vocab_size);
+    if (!bind_logits)
+      delete output;
+    return result;
+  };
+
+  DecoderRunState state{*params, *model};
+  std::vector<int32_t> first{0, 0, 0, 52}, second{195, 731};
+  run(state, first, true);
+  auto bound = run(state, second, true);
+  auto plain = run(state, second, false);
+  EXPECT_EQ(bound, plain);
+}
+
+// An encoder's self attention kv copied to the beams of a kv buffer shared by past and present, which is longer
+TEST(ModelTests, ExpandBeamsSharedBufferCpu) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  Generators::KV_BeamGather beam_gather{*model};
+
+  const int num_beams = 2;
+  const std::array<int64_t, 4> source_shape{2, 3, 4, 5}, target_shape{4, 3, 10, 5};
+  auto source = OrtValue::CreateTensor<float>(model->allocator_cpu_, source_shape);
+  auto target = OrtValue::CreateTensor<float>(model->allocator_cpu_, target_shape);
+  auto* source_data = source->GetTensorMutableData<float>();
+  std::iota(source_data, source_data + 2 * 3 * 4 * 5, 0.0f);
+  auto* target_data = target->GetTensorMutableData<float>();
+  std::fill(target_data, target_data + 4 * 3 * 10 * 5, -1.0f);
+
+  beam_gather.ExpandBeams(*source, *target, num_beams);
+  for (int row = 0; row < 4; row++) {
+    for (int head = 0; head < 3; head++) {
+      for (int token = 0; token < 10; token++) {
+        for (int i = 0; i < 5; i++) {
+          const float expected = token < 4 ? source_data[((row / num_beams * 3 + head) * 4 + token) * 5 + i] : -1.0f;
+          ASSERT_EQ(target_data[((row * 3 + head) * 10 + token) * 5 + i], expected) << row << " " << head << " " << token;
+        }
+      }
+    }
+  }
+
+  // Neither num_beams times the elements nor a longer sequence
+  const std::array<int64_t, 4> wrong_shape{4, 3, 3, 5};
+  auto wrong = OrtValue::CreateTensor<float>(model->allocator_cpu_, wrong_shape);
+  EXPECT_THROW(beam_gather.ExpandBeams(*source, *wrong, num_beams), std::runtime_error);
+}
 
-  std::vector<int32_t> expected_output{
-      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
-      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+// Beam reordering of a kv buffer shared by past and present: only the valid tokens of every head move
+TEST(ModelTests, GatherRowsCpu) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  Generators::KV_BeamGather beam_gather{*model};
 
-  // To generate this file:
-  // python convert_generation.py --model_type gpt2 -m hf-internal-testing/tiny-random-gpt2 --output tiny_gpt2_greedysearch_fp16.onnx --use_gpu --max_length 20
-  // And copy the resulting gpt2_init_past_fp32.onnx file into these two files (as it's the same for gpt2)
+  const std::array<int64_t, 4> shape{3, 2, 6, 4};  // Beams, heads, max_length, head_size
+  const int valid_length = 4;
+  auto source = OrtValue::CreateTensor<float>(model->allocator_cpu_, shape);
+  auto target = OrtValue::CreateTensor<float>(model->allocator_cpu_, shape);
+  auto* source_data = source->GetTensorMutableData<float>();
+  std::iota(source_data, source_data + 3 * 2 * 6 * 4, 0.0f);
+  auto* target_data = target->GetTensorMutableData<float>();
+  std::fill(target_data, target_data + 3 * 2 * 6 * 4, -1.0f);
+
+  std::vector<int32_t> beam_indices{2, 0, 0};
+  const OrtValue* sources[]{source.get()};
+  OrtValue* targets[]{target.get()};
+  beam_gather.GatherRows(beam_indices, sources, targets, 2, 6 * 4 * sizeof(float), valid_length * 4 * sizeof(float));
+  for (int beam = 0; beam < 3; beam++) {
+    for (int head = 0; head < 2; head++) {
+      for (int token = 0; token < 6; token++) {
+        for (int i = 0; i < 4; i++) {
+          const float expected = token < valid_length ? source_data[((beam_indices[beam] * 2 + head) * 6 + token) * 4 + i] : -1.0f;
+          ASSERT_EQ(target_data[((beam * 2 + head) * 6 + token) * 4 + i], expected) << beam << " " << head << " " << token;
+        }
+      }
+    }
+  }
+}
+
+TEST(ModelTests, ForkChecks) {
   auto model = Generators::CreateModel(Generators::GetOrtEnv(),
                                        MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
 
+  std::vector<int32_t> input_ids{0, 0, 0, 52};
   auto params = Generators::CreateGeneratorParams(*model);
   params->search.max_length = 10;
-  params->batch_size = static_cast<int>(input_ids_shape[0]);
-  params->sequence_length = static_cast<int>(input_ids_shape[1]);
   params->input_ids = input_ids;
+  params->sequence_length = static_cast<int>(input_ids.size());
 
   auto generator = Generators::CreateGenerator(*model, *params);
+  generator->ComputeLogits();
+  EXPECT_THROW(generator->Fork(*params), std::runtime_error);  // In the middle of processing logits
+  generator->GenerateNextToken();
+
+  // gpt2 uses the combined kv cache, which can't be copied to a fork, and the generator carries on
+  EXPECT_THROW(generator->Fork(*params), std::runtime_error);
+  EXPECT_EQ(generator->search_->GetSequenceLength(), 5);
+  generator->ComputeLogits();
+}
+
+// Greedy, so the parent and the fork both carry on exactly like a generator that was never forked
+TEST(ModelTests, ForkContinuations) {
+#if TEST_PHI2
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "phi-2");
+  auto tokenizer = model->CreateTokenizer();
+  auto prompt = tokenizer->Encode("This is a test.");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 24;
+  params->sequence_length = static_cast<int>(prompt.size());
+  params->input_ids = prompt;
+
+  auto run_to_end = [](Generators::Generator& generator) {
+    while (!generator.IsDone()) {
+      generator.ComputeLogits();
+      generator.GenerateNextToken();
+    }
+    auto sequence = generator.GetSequence(0).GetCPU();
+    return std::vector<int32_t>(sequence.begin(), sequence.end());
+  };
+
+  auto reference = Generators::CreateGenerator(*model, *params);
+  auto expected = run_to_end(*reference);
+
+  auto parent = Generators::CreateGenerator(*model, *params);
+  for (int i = 0; i < 4; i++) {
+    parent->ComputeLogits();
+    parent->GenerateNextToken();
+  }
+
+  auto beam_params = std::make_shared<Generators::GeneratorParams>(*params);
+  beam_params->search.num_beams = 2;
+  EXPECT_THROW(parent->Fork(*beam_params), std::runtime_error);
+
+  auto fork = parent->Fork(*params);
+  EXPECT_EQ(fork->search_->GetSequenceLength(), parent->search_->GetSequenceLength());
+  EXPECT_EQ(run_to_end(*fork), expected);
+  EXPECT_EQ(run_to_end(*parent), expected);
+#endif
+}
+
+// The prompt runs on the prefill model and its kv is copied over, which doesn't change the tokens. Models that would
+// send a prompt back and forth between them are rejected.
+TEST(ModelTests, PrefillModel) {
+  auto gpt2 = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  EXPECT_THROW(gpt2->SetPrefillModel(gpt2), std::runtime_error);  // Not a decoder only model
+#if TEST_PHI2
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "phi-2");
+  auto prefill_model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "phi-2");
+  auto tokenizer = model->CreateTokenizer();
+  auto prompt = tokenizer->Encode("This is a test.");
 
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 24;
+  params->sequence_length = static_cast<int>(prompt.size());
+  params->input_ids = prompt;
+  auto expected = Generators::Generate(*model, *params);
+
+  EXPECT_THROW(model->SetPrefillModel(model), std::runtime_error);
+  EXPECT_THROW(model->SetPrefillModel(gpt2), std::runtime_error);
+  model->SetPrefillModel(prefill_model);
+  EXPECT_THROW(prefill_model->SetPrefillModel(model), std::runtime_error);
+  EXPECT_EQ(Generators::Generate(*model, *params), expected);
+#endif
+}
+
+// A generator swapped out to host memory or to a file and back carries on with the tokens it generates when it isn't
+TEST(ModelTests, SwapRoundTrip) {
+#if TEST_PHI2
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "phi-2");
+  auto tokenizer = model->CreateTokenizer();
+  auto prompt = tokenizer->Encode("This is a test.");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 24;
+  params->sequence_length = static_cast<int>(prompt.size());
+  params->input_ids = prompt;
+
+  auto run_to_end = [](Generators::Generator& generator) {
+    while (!generator.IsDone()) {
+      generator.ComputeLogits();
+      generator.GenerateNextToken();
+    }
+    auto sequence = generator.GetSequence(0).GetCPU();
+    return std::vector<int32_t>(sequence.begin(), sequence.end());
+  };
+
+  auto reference = Generators::CreateGenerator(*model, *params);
+  auto expected = run_to_end(*reference);
+
+  const std::string swap_path = "swap_round_trip.kv";
+  for (auto& path : {std::string{}, swap_path}) {
+    auto generator = Generators::CreateGenerator(*model, *params);
+    for (int i = 0; i < 4; i++) {
+      generator->ComputeLogits();
+      generator->GenerateNextToken();
+    }
+
+    generator->SwapOut(path);
+    EXPECT_THROW(generator->SwapOut(path), std::runtime_error);
+    EXPECT_THROW(generator->ComputeLogits(), std::runtime_error);
+    EXPECT_THROW(generator->GetState().SwapOut(path), std::runtime_error);  // The kv cache knows it's swapped out too
+    generator->SwapIn();
+    EXPECT_THROW(generator->GetState().SwapIn(), std::runtime_error);
+    EXPECT_FALSE(fs::path(swap_path).exists());
+
+    EXPECT_EQ(run_to_end(*generator), expected);
+  }
+#endif
+}
+
+TEST(ModelTests, CompactFinishedRowsChecks) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+  params->batch_size = 2;
+  params->sequence_length = 4;
+  params->input_ids = c_tiny_gpt2_input_ids;
+  Generators::SetSearchBool(params->search, "compact_finished_rows", true);
+
+  params->search.num_beams = 2;
+  EXPECT_THROW(Generators::CreateGenerator(*model, *params), std::runtime_error);
+
+  // gpt2 isn't a decoder only state so the rows keep running, the output must be the same either way
+  params->search.num_beams = 1;
+  auto generator = Generators::CreateGenerator(*model, *params);
   while (!generator->IsDone()) {
     generator->ComputeLogits();
     generator->GenerateNextToken();
   }
+  std::vector<int32_t> expected_output1{0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+  auto sequence = generator->GetSequence(1).GetCPU();
+  EXPECT_TRUE(std::equal(expected_output1.begin(), expected_output1.end(), sequence.begin()));
+}
 
-  // Verify outputs match expected outputs
-  for (size_t i = 0; i < static_cast<size_t>(params->batch_size); i++) {
-    auto sequence = generator->GetSequence(i).GetCPU();
-    auto* expected_output_start = &expected_output[i * params->search.max_length];
-    EXPECT_TRUE(0 == std::memcmp(expected_output_start, sequence.data(), params->search.max_length * sizeof(int32_t)));
+// A decoder only model leaves the finished rows out of its runs, the other rows get the tokens they'd get without that
+TEST(ModelTests, CompactFinishedRows) {
+#if TEST_PHI2
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "phi-2");
+  auto tokenizer = model->CreateTokenizer();
+  std::vector<std::string> prompts{"This is a test.", "Rats are awesome pets!", "The quick brown fox jumps over the lazy dog."};
+  auto input_ids = tokenizer->EncodeBatch(prompts);
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 32;
+  params->batch_size = static_cast<int>(prompts.size());
+  params->sequence_length = static_cast<int>(input_ids.size()) / params->batch_size;
+  params->input_ids = input_ids;
+  params->SetRowSearch(0).max_new_tokens = 2;  // Row 0 finishes first and row 1 after it, so the batch shrinks twice
+  params->SetRowSearch(1).max_new_tokens = 6;
+
+  auto run = [&](bool compact) {
+    params->search.compact_finished_rows = compact;
+    auto generator = Generators::CreateGenerator(*model, *params);
+    while (!generator->IsDone()) {
+      generator->ComputeLogits();
+      generator->GenerateNextToken();
+    }
+    std::vector<std::vector<int32_t>> sequences;
+    for (int i = 0; i < params->batch_size; i++) {
+      auto sequence = generator->GetSequence(i).GetCPU();
+      sequences.emplace_back(sequence.begin(), sequence.end());
+    }
+    return sequences;
+  };
+
+  EXPECT_EQ(run(true), run(false));
+#endif
+}
+
+TEST(ModelTests, CaptureGraphsChecks) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  std::vector<int> batch_sizes{1, 2};
+  EXPECT_THROW(model->CaptureGraphs(batch_sizes, {}), std::runtime_error);  // Not on CPU
+}
+
+TEST(ModelTests, GraphCaptureBuckets) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->max_batch_size = 3;
+  params->search.max_length = 20;
+  EXPECT_EQ(params->GraphMaxBatchSize(), 3);  // Without graph capture nothing is rounded
+  EXPECT_EQ(params->BufferMaxLength(), 20);
+
+  model->config_->model.decoder.graph_capture.bucketed = true;
+  params->use_cuda_graph = true;
+  EXPECT_EQ(params->GraphMaxBatchSize(), 4);
+  EXPECT_EQ(params->BufferMaxLength(), 32);
+  params->search.max_length = 300;
+  EXPECT_EQ(params->BufferMaxLength(), 512);  // context_length
+}
+
+// The runtime made cos/sin caches of model.decoder.rotary_embedding: position t of frequency i is at t * half_dim + i,
+// scaled by the short or the long factors and mscale
+TEST(ModelTests, RotaryCacheValues) {
+  Generators::Config::Model::Decoder::RotaryEmbedding rotary;
+  rotary.dim = 4;
+  rotary.theta = 10000.0f;
+  rotary.short_factor = {1.0f, 1.0f};
+  rotary.long_factor = {2.0f, 8.0f};
+  rotary.long_mscale = 1.5f;
+
+  std::vector<float> cos, sin;
+  Generators::RotaryCache::Compute(rotary, false, 3, cos, sin);
+  ASSERT_EQ(cos.size(), 6u);
+  ASSERT_EQ(sin.size(), 6u);
+  EXPECT_FLOAT_EQ(cos[0], 1.0f);
+  EXPECT_FLOAT_EQ(sin[1], 0.0f);
+  EXPECT_NEAR(cos[2 * 2 + 1], std::cos(2.0f / 100.0f), 1e-6f);  // theta^(2/4) = 100
+  EXPECT_NEAR(sin[2 * 2 + 0], std::sin(2.0f), 1e-6f);
+
+  Generators::RotaryCache::Compute(rotary, true, 3, cos, sin);
+  EXPECT_FLOAT_EQ(cos[0], 1.5f);
+  EXPECT_NEAR(cos[2 * 2 + 1], std::cos(2.0f / 800.0f) * 1.5f, 1e-6f);
+  EXPECT_NEAR(sin[1 * 2 + 0], std::sin(0.5f) * 1.5f, 1e-6f);
+
+  rotary.long_factor.pop_back();
+  EXPECT_THROW(Generators::RotaryCache::Compute(rotary, true, 3, cos, sin), std::runtime_error);
+}
+
+// The layout lists, for every head and block row, the local blocks and the ones on the head's vertical stride, as the
+// dense mask of the builder does. Generators with as many blocks share it.
+TEST(ModelTests, SparseAttentionLayoutGptFp32) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto& decoder = model->config_->model.decoder;
+  decoder.num_attention_heads = 4;
+  decoder.sparse_attention.block_size = 16;
+
+  struct Case {
+    int local_blocks, vert_stride;
+    bool homo_head;
+  };
+  for (auto [local_blocks, vert_stride, homo_head] : {Case{2, 3, true}, Case{2, 3, false}, Case{1, 8, false}, Case{3, 0, false}, Case{0, 2, true}}) {
+    decoder.sparse_attention.local_blocks = local_blocks;
+    decoder.sparse_attention.vert_stride = vert_stride;
+    decoder.sparse_attention.homo_head = homo_head;
+    const int block_count = 11;
+    Generators::SparseAttentionLayout layout{*model, block_count};
+
+    const int num_layouts = homo_head ? 1 : decoder.num_attention_heads;
+    const int head_step = homo_head ? 0 : std::max(1, vert_stride / decoder.num_attention_heads);
+    auto rows_shape = layout.row_indices_->GetTensorTypeAndShapeInfo()->GetShape();
+    auto cols_shape = layout.col_indices_->GetTensorTypeAndShapeInfo()->GetShape();
+    ASSERT_EQ(rows_shape, (std::vector<int64_t>{num_layouts, block_count + 1}));
+    ASSERT_EQ(cols_shape[0], num_layouts);
+    const auto* rows = layout.row_indices_->GetTensorData<int32_t>();
+    const auto* cols = layout.col_indices_->GetTensorData<int32_t>();
+
+    for (int h = 0; h < num_layouts; h++) {
+      std::vector<int32_t> expected_rows{0}, expected_cols;
+      for (int q = 0; q < block_count; q++) {
+        for (int k = 0; k <= q; k++) {
+          if (q - k < local_blocks || (vert_stride > 0 && (k + h * head_step + 1) % vert_stride == 0))
+            expected_cols.push_back(k);
+        }
+        expected_rows.push_back(static_cast<int32_t>(expected_cols.size()));
+      }
+      EXPECT_EQ(std::vector<int32_t>(rows + h * (block_count + 1), rows + (h + 1) * (block_count + 1)), expected_rows);
+      expected_cols.resize(static_cast<size_t>(cols_shape[1]), -1);
+      EXPECT_EQ(std::vector<int32_t>(cols + h * cols_shape[1], cols + (h + 1) * cols_shape[1]), expected_cols);
+    }
+  }
+
+  auto layout = model->GetSparseAttentionLayout(4);
+  EXPECT_EQ(model->GetSparseAttentionLayout(4), layout);
+  EXPECT_NE(model->GetSparseAttentionLayout(5), layout);
+}
+
+TEST(ModelTests, LoadGeneratorChecks) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+
+  EXPECT_THROW(Generators::LoadGenerator(*model, *params, "missing_snapshot.bin"), std::runtime_error);
+
+  const char* path = "not_a_snapshot.bin";
+  fs::path(path).open_for_write(std::ios::binary) << "not a generator snapshot";
+  EXPECT_THROW(Generators::LoadGenerator(*model, *params, path), std::runtime_error);
+
+  // A header with a sequence_length that doesn't fit max_length is rejected before anything is allocated for it
+  for (int32_t sequence_length : {0, -1, 10, 0x7fffffff}) {
+    const int32_t header[2]{params->vocab_size, sequence_length};
+    auto file = fs::path(path).open_for_write(std::ios::binary);
+    file.write("OGASNAP1", 8);
+    file.write(reinterpret_cast<const char*>(header), sizeof(header));
+    file.close();
+    EXPECT_THROW(Generators::LoadGenerator(*model, *params, path), std::runtime_error);
+  }
+  std::remove(path);
+}
+
+// A generator saved partway and loaded again carries on with the tokens the saved one generates
+TEST(ModelTests, SaveLoadRoundTrip) {
+#if TEST_PHI2
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "phi-2");
+  auto tokenizer = model->CreateTokenizer();
+  auto prompt = tokenizer->Encode("This is a test.");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 24;
+  params->sequence_length = static_cast<int>(prompt.size());
+  params->input_ids = prompt;
+
+  auto run_to_end = [](Generators::Generator& generator) {
+    while (!generator.IsDone()) {
+      generator.ComputeLogits();
+      generator.GenerateNextToken();
+    }
+    auto sequence = generator.GetSequence(0).GetCPU();
+    return std::vector<int32_t>(sequence.begin(), sequence.end());
+  };
+
+  auto generator = Generators::CreateGenerator(*model, *params);
+  for (int i = 0; i < 4; i++) {
+    generator->ComputeLogits();
+    generator->GenerateNextToken();
   }
+
+  const char* path = "save_load_round_trip.bin";
+  generator->Save(path);
+  auto loaded = Generators::LoadGenerator(*model, *params, path);
+  std::remove(path);
+
+  auto saved_sequence = generator->GetSequence(0).GetCPU();
+  auto loaded_sequence = loaded->GetSequence(0).GetCPU();
+  EXPECT_TRUE(std::equal(saved_sequence.begin(), saved_sequence.end(), loaded_sequence.begin(), loaded_sequence.end()));
+  EXPECT_EQ(run_to_end(*loaded), run_to_end(*generator));
+#endif
+}
+
+// Grammars are shared per vocab size, eos and pattern, and the users of a cached grammar don't wait on another's compile
+TEST(ModelTests, GetGrammarCache) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto tokenizer = model->CreateTokenizer();
+  const int vocab_size = model->config_->model.vocab_size;
+
+  auto grammar = tokenizer->GetGrammar("[a-z]+", vocab_size, 0);
+  EXPECT_EQ(tokenizer->GetGrammar("[a-z]+", vocab_size, 0), grammar);
+  EXPECT_NE(tokenizer->GetGrammar("[a-z]+", vocab_size, 1), grammar);
+  EXPECT_EQ(tokenizer->GetGrammar("[a-z]+", vocab_size - 1, 0)->VocabSize(), vocab_size - 1);
+
+  std::vector<std::thread> threads;
+  std::vector<std::shared_ptr<const Generators::Grammar>> grammars(4);
+  for (size_t i = 0; i < grammars.size(); i++)
+    threads.emplace_back([&, i] { grammars[i] = tokenizer->GetGrammar("[0-9]+", vocab_size, 0); });
+  for (auto& thread : threads)
+    thread.join();
+  for (auto& other : grammars)
+    EXPECT_EQ(other->VocabSize(), vocab_size);
+}
+
+TEST(ModelTests, PromptLookup) {
+  // The last 3 tokens {2, 3, 4} occurred earlier, followed by {5, 6}
+  std::vector<int32_t> sequence{1, 2, 3, 4, 5, 6, 7, 2, 3, 4};
+  EXPECT_EQ(Generators::PromptLookup(sequence, 3, 2), (std::vector<int32_t>{5, 6}));
+
+  // Only the last token {9} matches, and the latest occurrence wins
+  std::vector<int32_t> short_match{9, 1, 9, 2, 8, 9};
+  EXPECT_EQ(Generators::PromptLookup(short_match, 3, 4), (std::vector<int32_t>{2, 8, 9}));
+
+  std::vector<int32_t> no_match{1, 2, 3};
+  EXPECT_TRUE(Generators::PromptLookup(no_match, 3, 4).empty());
+}
+
+TEST(ModelTests, WhisperTimestampRules) {
+  // A vocab of 10 text tokens, eos 10, two special tokens and timestamps from 13
+  constexpr int32_t eos = 10, timestamp_begin = 13;
+  constexpr float suppressed = std::numeric_limits<float>::lowest();
+  std::vector<float> logits(timestamp_begin + 60, 0.0f);
+
+  // The first token is a timestamp of at most 1s
+  Generators::ApplyTimestampRules(logits, {}, timestamp_begin, eos);
+  EXPECT_EQ(logits[0], suppressed);
+  EXPECT_EQ(logits[eos + 1], suppressed);
+  EXPECT_EQ(logits[timestamp_begin + 50], 0.0f);
+  EXPECT_EQ(logits[timestamp_begin + 51], suppressed);
+
+  // After a start timestamp comes text
+  std::fill(logits.begin(), logits.end(), 0.0f);
+  logits[3] = 5.0f;
+  std::vector<int32_t> generated{timestamp_begin + 2};
+  Generators::ApplyTimestampRules(logits, generated, timestamp_begin, eos);
+  EXPECT_EQ(logits[3], 5.0f);
+  EXPECT_EQ(logits[timestamp_begin + 10], suppressed);
+
+  // After text, timestamps before the start are not allowed, and they win when together they're more likely
+  std::fill(logits.begin(), logits.end(), 0.0f);
+  generated.push_back(3);
+  Generators::ApplyTimestampRules(logits, generated, timestamp_begin, eos);
+  EXPECT_EQ(logits[timestamp_begin + 1], suppressed);
+  EXPECT_EQ(logits[timestamp_begin + 3], 0.0f);
+  EXPECT_EQ(logits[3], suppressed);
+
+  // After an end timestamp comes eos or the start of the next segment, which can be at the same time
+  std::fill(logits.begin(), logits.end(), 0.0f);
+  generated.push_back(timestamp_begin + 5);
+  Generators::ApplyTimestampRules(logits, generated, timestamp_begin, eos);
+  EXPECT_EQ(logits[3], suppressed);
+  EXPECT_EQ(logits[eos], 0.0f);
+  EXPECT_EQ(logits[timestamp_begin + 4], suppressed);
+  EXPECT_EQ(logits[timestamp_begin + 5], 0.0f);
+}
+
+TEST(ModelTests, WhisperParseTimestamps) {
+  constexpr int32_t timestamp_begin = 100;
+  std::vector<int32_t> generated{timestamp_begin, 1, 2, timestamp_begin + 50, timestamp_begin + 50, 3, timestamp_begin + 80, timestamp_begin + 90, 4};
+  auto segments = Generators::ParseTimestamps(generated, timestamp_begin);
+  ASSERT_EQ(segments.size(), 3U);
+
+  EXPECT_DOUBLE_EQ(segments[0].start, 0.0);
+  EXPECT_DOUBLE_EQ(segments[0].end, 1.0);
+  EXPECT_EQ(segments[0].tokens, (std::vector<int32_t>{1, 2}));
+  EXPECT_TRUE(segments[0].complete);
+
+  EXPECT_DOUBLE_EQ(segments[1].start, 1.0);
+  EXPECT_DOUBLE_EQ(segments[1].end, 1.6);
+  EXPECT_EQ(segments[1].tokens, (std::vector<int32_t>{3}));
+
+  // Cut off by the end of the generation
+  EXPECT_DOUBLE_EQ(segments[2].start, 1.8);
+  EXPECT_EQ(segments[2].tokens, (std::vector<int32_t>{4}));
+  EXPECT_FALSE(segments[2].complete);
+}
+
+TEST(ModelTests, WhisperStreamerRequiresWhisper) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = Generators::CreateGeneratorParams(*model);
+  EXPECT_THROW((Generators::WhisperStreamer{*model, *params}), std::runtime_error);
+}
+
+TEST(ModelTests, TranscribeClipsRequiresWhisper) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = Generators::CreateGeneratorParams(*model);
+  std::vector<float> clip(80 * 100);
+  std::vector<std::span<const float>> clips{clip};
+  EXPECT_THROW(Generators::TranscribeClips(*model, *params, clips), std::runtime_error);
 }
 
 TEST(ModelTests, BeamSearchGptFp32) {
@@ -89,9 +1918,7 @@ TEST(ModelTests, BeamSearchGptFp32) {
   while (!search.IsDone()) {
     search.SetLogits(state->Run(search.GetSequenceLength(), search.GetNextTokens(), search.GetNextIndices()));
 
-    // Scoring
-    search.ApplyMinLength(1);
-    search.ApplyRepetitionPenalty(1.0f);
+    search.ProcessLogits();
 
     search.SelectTop();
   }
@@ -110,44 +1937,81 @@ TEST(ModelTests, BeamSearchGptFp32) {
 
 #if USE_CUDA
 
-void Test_GreedySearch_Gpt_Cuda(const char* model_path, const char* model_label) {
-  std::vector<int64_t> input_ids_shape{2, 4};
-  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+void Test_GreedySearch_Gpt_Cuda(const char* model_path, const char* model_label, bool pipelined_steps = false) {
+  ExpectGpt2Output({}, [&](Generators::GeneratorParams& params) { params.search.pipelined_steps = pipelined_steps; }, {}, model_path);
+}
 
-  std::vector<int32_t> expected_output{
-      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
-      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+TEST(ModelTests, GreedySearchGptCuda) {
+  for (auto model_path : c_tiny_gpt2_model_paths)
+    Test_GreedySearch_Gpt_Cuda(model_path.first, model_path.second);
+}
 
-  auto model = Generators::CreateModel(Generators::GetOrtEnv(), model_path);
+// Not waiting for the eos check between steps gives the same output
+TEST(ModelTests, GreedySearchGptCudaPipelined) {
+  for (auto model_path : c_tiny_gpt2_model_paths)
+    Test_GreedySearch_Gpt_Cuda(model_path.first, model_path.second, true);
+}
+
+// Two generators interleaving their steps, each searching on its own stream, get the same output as alone
+TEST(ModelTests, GreedySearchGptCudaGeneratorStreams) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32-cuda");
+  model->config_->model.decoder.generator_streams = true;
 
   auto params = Generators::CreateGeneratorParams(*model);
-  params->batch_size = static_cast<int>(input_ids_shape[0]);
-  params->sequence_length = static_cast<int>(input_ids_shape[1]);
+  params->batch_size = 2;
+  params->sequence_length = 4;
   params->search.max_length = 10;
-  params->input_ids = input_ids;
-
-  auto generator = Generators::CreateGenerator(*model, *params);
+  params->input_ids = c_tiny_gpt2_input_ids;
 
-  while (!generator->IsDone()) {
-    generator->ComputeLogits();
-    generator->GenerateNextToken();
+  auto generator1 = Generators::CreateGenerator(*model, *params);
+  auto generator2 = Generators::CreateGenerator(*model, *params);
+  while (!generator1->IsDone() || !generator2->IsDone()) {
+    for (auto* generator : {generator1.get(), generator2.get()}) {
+      if (generator->IsDone())
+        continue;
+      generator->ComputeLogits();
+      generator->GenerateNextToken();
+    }
   }
 
-  // Verify outputs match expected outputs
-  for (int i = 0; i < params->batch_size; i++) {
-    auto sequence_gpu = generator->GetSequence(i);
-    auto sequence = sequence_gpu.GetCPU();
-    auto* expected_output_start = &expected_output[i * params->search.max_length];
-    EXPECT_TRUE(0 == std::memcmp(expected_output_start, sequence.data(), params->search.max_length * sizeof(int32_t)));
+  for (auto* generator : {generator1.get(), generator2.get()}) {
+    for (int i = 0; i < params->batch_size; i++) {
+      auto sequence = generator->GetSequence(i).GetCPU();
+      EXPECT_TRUE(0 == std::memcmp(&c_tiny_gpt2_expected_output[i * params->search.max_length], sequence.data(), params->search.max_length * sizeof(int32_t)));
+    }
   }
 }
 
-TEST(ModelTests, GreedySearchGptCuda) {
-  for (auto model_path : c_tiny_gpt2_model_paths)
-    Test_GreedySearch_Gpt_Cuda(model_path.first, model_path.second);
+// Two replicas on the same device still take turns, a new generator goes to the one with fewer alive
+TEST(ModelTests, ModelReplicasLeastLoaded) {
+  std::vector<int> device_ids{0, 0};
+  Generators::ModelReplicas replicas{Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32-cuda", device_ids};
+  ASSERT_EQ(replicas.models_.size(), 2u);
+
+  // The params carry the device and stream of their replica, so they're made for the one that runs them
+  std::vector<int32_t> input_ids{0, 0, 0, 52};
+  auto create_params = [&](const Generators::Model& model) {
+    auto params = Generators::CreateGeneratorParams(model);
+    params->sequence_length = 4;
+    params->search.max_length = 10;
+    params->input_ids = input_ids;
+    return params;
+  };
+
+  auto& first = replicas.GetLeastLoaded();
+  auto first_params = create_params(first);
+  auto generator = Generators::CreateGenerator(first, *first_params);
+  auto& second = replicas.GetLeastLoaded();
+  EXPECT_NE(&first, &second);
+  EXPECT_THROW(Generators::CreateGenerator(second, *first_params), std::runtime_error);
+  auto second_params = create_params(second);
+  EXPECT_NO_THROW(Generators::CreateGenerator(second, *second_params));
+
+  generator.reset();
+  EXPECT_EQ(first.generator_count_.load(), 0);
 }
 
-void Test_BeamSearch_Gpt_Cuda(const char* model_path, const char* model_label) {
+void Test_BeamSearch_Gpt_Cuda(const char* model_path, const char* model_label, bool pipelined_steps = false) {
   std::vector<int64_t> input_ids_shape{3, 12};
   std::vector<int32_t> input_ids{
       0, 0, 0, 0, 0, 52, 195, 731, 321, 301, 734, 620,
@@ -172,6 +2036,7 @@ void Test_BeamSearch_Gpt_Cuda(const char* model_path, const char* model_label) {
   params->search.max_length = 20;
   params->search.num_beams = 4;
   params->search.length_penalty = 1.0f;
+  params->search.pipelined_steps = pipelined_steps;
 
   auto generator = Generators::CreateGenerator(*model, *params);
 
@@ -201,6 +2066,12 @@ TEST(ModelTests, BeamSearchGptCuda) {
     Test_BeamSearch_Gpt_Cuda(model_path.first, model_path.second);
 }
 
+// The scorer's indices stay on the device and its done state is read a step late, the output is the same
+TEST(ModelTests, BeamSearchGptCudaPipelined) {
+  for (auto model_path : c_tiny_gpt2_model_paths)
+    Test_BeamSearch_Gpt_Cuda(model_path.first, model_path.second, true);
+}
+
 TEST(ModelTests, TestApiCuda) {
 #if TEST_PHI2
 
@@ -264,4 +2135,351 @@ Print all primes between 1 and n
 #endif
 }
 
-#endif
\ No newline at end of file
+#endif
+TEST(ModelTests, DevicePoolCpu) {
+  Generators::DevicePool pool{Ort::Allocator::GetWithDefaultOptions(), 8 << 20};
+
+  // Small blocks are kept by bucket, so a similar size gets the same block back
+  void* small = pool.Alloc(100);
+  pool.Free(small);
+  EXPECT_EQ(pool.FreeBytes(), Generators::BucketSize(100));
+  EXPECT_EQ(pool.Alloc(110), small);
+  EXPECT_EQ(pool.FreeBytes(), 0u);
+
+  // Large ones by their exact size, which is all the memory budget charges for them
+  const size_t large_bytes = (3 << 20) + 1;
+  void* large = pool.Alloc(large_bytes);
+  pool.Free(large);
+  EXPECT_EQ(pool.FreeBytes(), large_bytes);
+  void* other = pool.Alloc(large_bytes + 1);  // Doesn't fit the kept block's size
+  EXPECT_EQ(pool.FreeBytes(), large_bytes);
+  EXPECT_EQ(pool.Alloc(large_bytes), large);
+  EXPECT_EQ(pool.FreeBytes(), 0u);
+
+  // Past max_free_bytes, freed blocks go back to the allocator
+  void* big = pool.Alloc(9 << 20);
+  pool.Free(big);
+  EXPECT_EQ(pool.FreeBytes(), 0u);
+
+  pool.Free(large);
+  pool.Free(other);
+  pool.Free(small);
+  EXPECT_EQ(pool.FreeBytes(), large_bytes + large_bytes + 1 + Generators::BucketSize(100));
+  pool.Trim();
+  EXPECT_EQ(pool.FreeBytes(), 0u);
+}
+
+TEST(ModelTests, KVBlockPool) {
+  Generators::KV_BlockPool pool{16, 4};
+
+  std::vector<int> a, b;
+  pool.Grow(a, 20);  // Two blocks
+  EXPECT_EQ(a.size(), 2u);
+  pool.Grow(a, 32);  // Still fits in two blocks
+  EXPECT_EQ(a.size(), 2u);
+  pool.Grow(b, 1);
+  EXPECT_EQ(pool.UsedBlocks(), 3);
+  EXPECT_EQ(pool.FreeBlocks(), 1);
+  EXPECT_THROW(pool.Grow(b, 48), std::runtime_error);
+
+  pool.Release(a);
+  EXPECT_TRUE(a.empty());
+  pool.Grow(b, 48);
+  EXPECT_EQ(b.size(), 3u);
+  EXPECT_EQ(pool.FreeBlocks(), 1);
+  pool.Release(b);
+
+  // The rows of a kv cache grow together or not at all, so a failure leaves no blocks behind
+  std::vector<std::vector<int>> rows(3);
+  EXPECT_THROW(pool.Grow(rows, 17), std::runtime_error);  // Six blocks
+  EXPECT_TRUE(std::all_of(rows.begin(), rows.end(), [](auto& row) { return row.empty(); }));
+  EXPECT_EQ(pool.UsedBlocks(), 0);
+  pool.Grow(rows, 16);
+  EXPECT_EQ(pool.UsedBlocks(), 3);
+  EXPECT_THROW(pool.Grow(rows, 17), std::runtime_error);
+  EXPECT_TRUE(std::all_of(rows.begin(), rows.end(), [](auto& row) { return row.size() == 1; }));
+  EXPECT_EQ(pool.UsedBlocks(), 3);
+}
+
+TEST(ModelTests, StaticBufferArena) {
+  auto& allocator = Ort::Allocator::GetWithDefaultOptions();
+  auto arena = std::make_shared<Generators::StaticBufferArena>(&allocator);
+  std::vector<int64_t> shape{2, 100};
+  auto type = Ort::TypeToTensorType<float>::type;
+
+  // Two graphs of one buffer each, the second one is created while the first one is idle so they share memory
+  Generators::StaticBuffer a{arena, &allocator, 2}, b{arena, &allocator, 2};
+  auto* a_data = a.CreateTensorOnStaticBuffer(shape, type)->GetTensorRawData();
+  std::vector<Generators::StaticBuffer*> graph_a{&a}, graph_b{&b};
+  arena->Release(graph_a);
+  auto* b_data = b.CreateTensorOnStaticBuffer(shape, type)->GetTensorRawData();
+  EXPECT_EQ(a_data, b_data);
+
+  EXPECT_FALSE(arena->Acquire(graph_a));  // b is using it
+  arena->Release(graph_b);
+  EXPECT_TRUE(arena->Acquire(graph_a));
+  EXPECT_EQ(a.CreateTensorOnStaticBuffer(shape, type)->GetTensorRawData(), a_data);  // Same address every time
+}
+
+TEST(ModelTests, PrefixCache) {
+  Generators::PrefixCache cache{1, 4};
+
+  auto make_values = [](int64_t length) {
+    std::vector<std::unique_ptr<OrtValue>> values;
+    values.push_back(OrtValue::CreateTensor<float>(Ort::Allocator::GetWithDefaultOptions(), std::array<int64_t, 4>{1, 1, length, 1}));
+    return values;
+  };
+
+  cache.Insert({0, 1, 2, 3, 4, 5, 6, 7}, make_values(8));
+
+  int prefix_length{};
+  std::vector<int32_t> diverges{0, 1, 2, 3, 4, 5, 9, 9, 9};
+  EXPECT_TRUE(cache.Find(diverges, prefix_length));
+  EXPECT_EQ(prefix_length, 4);
+
+  // At least one token has to be left over for the prompt run
+  std::vector<int32_t> same{0, 1, 2, 3, 4, 5, 6, 7};
+  EXPECT_TRUE(cache.Find(same, prefix_length));
+  EXPECT_EQ(prefix_length, 4);
+
+  std::vector<int32_t> longer{0, 1, 2, 3, 4, 5, 6, 7, 8};
+  EXPECT_TRUE(cache.Find(longer, prefix_length));
+  EXPECT_EQ(prefix_length, 8);
+
+  std::vector<int32_t> miss{1, 1, 2, 3, 4};
+  EXPECT_FALSE(cache.Find(miss, prefix_length));
+  EXPECT_EQ(prefix_length, 0);
+
+  // Only one entry fits, so this evicts the first
+  cache.Insert({1, 1, 2, 3}, make_values(4));
+  EXPECT_FALSE(cache.Find(longer, prefix_length));
+  EXPECT_TRUE(cache.Find(miss, prefix_length));
+  EXPECT_EQ(prefix_length, 4);
+}
+
+TEST(ModelTests, PrefixCacheDedupeAndBytes) {
+  auto make_values = [](int64_t length) {
+    std::vector<std::unique_ptr<OrtValue>> values;
+    values.push_back(OrtValue::CreateTensor<float>(Ort::Allocator::GetWithDefaultOptions(), std::array<int64_t, 4>{1, 1, length, 1}));
+    return values;
+  };
+
+  Generators::PrefixCache cache{4, 4};
+  cache.Insert({0, 1, 2, 3, 4, 5, 6, 7}, make_values(8));
+  EXPECT_TRUE(cache.Contains(std::vector<int32_t>{0, 1, 2, 3}));
+  EXPECT_TRUE(cache.Contains(std::vector<int32_t>{0, 1, 2, 3, 4, 5, 6, 7}));
+  EXPECT_FALSE(cache.Contains(std::vector<int32_t>{0, 1, 2, 3, 4, 5, 6, 8}));
+
+  // The same prompt, or a prefix of it, isn't cached twice
+  cache.Insert({0, 1, 2, 3, 4, 5, 6, 7}, make_values(8));
+  cache.Insert({0, 1, 2, 3}, make_values(4));
+  EXPECT_EQ(cache.EntryCount(), 1u);
+  EXPECT_EQ(cache.Bytes(), 8 * sizeof(float));
+
+  // A prompt extending a cached one replaces it
+  cache.Insert({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11}, make_values(12));
+  EXPECT_EQ(cache.EntryCount(), 1u);
+  EXPECT_EQ(cache.Bytes(), 12 * sizeof(float));
+  int prefix_length{};
+  std::vector<int32_t> prompt{0, 1, 2, 3, 4, 5, 6, 7, 8};
+  EXPECT_TRUE(cache.Find(prompt, prefix_length));
+  EXPECT_EQ(prefix_length, 8);
+
+  // Bounded by bytes: 12 floats fit, so each new entry evicts the least recently used
+  Generators::PrefixCache small{4, 4, 12 * sizeof(float)};
+  small.Insert({0, 0, 0, 0, 0, 0, 0, 0}, make_values(8));
+  small.Insert({1, 1, 1, 1}, make_values(4));
+  EXPECT_EQ(small.EntryCount(), 2u);
+  small.Insert({2, 2, 2, 2}, make_values(4));
+  EXPECT_EQ(small.EntryCount(), 2u);
+  EXPECT_EQ(small.Bytes(), 8 * sizeof(float));
+  EXPECT_FALSE(small.Contains(std::vector<int32_t>{0, 0, 0, 0}));
+  EXPECT_TRUE(small.Contains(std::vector<int32_t>{1, 1, 1, 1}));
+
+  // An entry bigger than the whole cache is dropped instead of evicting everything
+  small.Insert({3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3}, make_values(16));
+  EXPECT_EQ(small.EntryCount(), 2u);
+}
+
+static std::shared_ptr<Generators::Tensor> MakeImageInput(std::vector<float> values) {
+  auto value = OrtValue::CreateTensor<float>(Ort::Allocator::GetWithDefaultOptions(), std::array<int64_t, 1>{static_cast<int64_t>(values.size())});
+  std::copy(values.begin(), values.end(), value->GetTensorMutableData<float>());
+  return std::make_shared<Generators::Tensor>(std::move(value));
+}
+
+// The images of a multimodal model only go to its vision session, so graphs are shared between image sizes. Other
+// models key their graphs by the shapes of their extra inputs.
+TEST(ModelTests, GraphKeyExtraInputs) {
+  auto config = std::make_unique<Generators::Config>(fs::path(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32"));
+  Generators::GeneratorParams small, large;
+  small.extra_inputs.push_back({"pixel_values", MakeImageInput({1, 2})});
+  large.extra_inputs.push_back({"pixel_values", MakeImageInput({1, 2, 3})});
+
+  auto key = [&](const Generators::GeneratorParams& params) {
+    return CapturedGraphKey{4, 32, 1, Generators::CapturedGraphPool::GetGraphExtraInputs(*config, params)};
+  };
+  EXPECT_EQ(Generators::CapturedGraphPool::GetGraphExtraInputs(*config, small).size(), 1u);
+  EXPECT_TRUE(key(small) == key(small));
+  EXPECT_FALSE(key(small) == key(large));
+
+  config->model.vision.filename = "vision.onnx";
+  EXPECT_TRUE(Generators::CapturedGraphPool::GetGraphExtraInputs(*config, small).empty());
+  EXPECT_TRUE(key(small) == key(large));
+  EXPECT_EQ(std::hash<CapturedGraphKey>{}(key(small)), std::hash<CapturedGraphKey>{}(key(large)));
+}
+
+TEST(ModelTests, ImagePositionStart) {
+  std::vector<int32_t> input_ids{1, 2, -1, -1, -1, 3};
+  EXPECT_EQ(Generators::GetImagePositionStart(input_ids, 3), 2);
+  EXPECT_EQ(Generators::GetImagePositionStart(input_ids, 4), 2);
+  EXPECT_THROW(Generators::GetImagePositionStart(input_ids, 5), std::runtime_error);  // Past the end of the prompt
+
+  std::vector<int32_t> no_image{1, 2, 3};
+  EXPECT_THROW(Generators::GetImagePositionStart(no_image, 1), std::runtime_error);
+}
+
+TEST(ModelTests, VisualFeatureCache) {
+  std::vector<Generators::GeneratorParams::Input> image_a{{"pixel_values", MakeImageInput({1, 2, 3})}};
+  std::vector<Generators::GeneratorParams::Input> image_b{{"pixel_values", MakeImageInput({1, 2, 4})}};
+  std::vector<Generators::GeneratorParams::Input> image_a_again{{"pixel_values", MakeImageInput({1, 2, 3})}};
+  auto hash_a = Generators::VisualFeatureCache::Hash(image_a);
+  auto hash_b = Generators::VisualFeatureCache::Hash(image_b);
+  EXPECT_EQ(hash_a, Generators::VisualFeatureCache::Hash(image_a_again));
+  EXPECT_NE(hash_a, hash_b);
+
+  Generators::VisualFeatureCache cache{1};
+  std::shared_ptr<OrtValue> features_a = std::move(MakeImageInput({5})->ort_tensor_);
+  cache.Insert(hash_a, image_a, features_a);
+  EXPECT_EQ(cache.Find(hash_a, image_a_again), features_a);
+  EXPECT_EQ(cache.Find(hash_b, image_b), nullptr);
+
+  // A colliding hash of other inputs is a miss, not image a's features
+  EXPECT_EQ(cache.Find(hash_a, image_b), nullptr);
+  std::vector<Generators::GeneratorParams::Input> image_a_longer{{"pixel_values", MakeImageInput({1, 2, 3, 0})}};
+  EXPECT_EQ(cache.Find(hash_a, image_a_longer), nullptr);
+
+  // Only one entry fits, so this evicts the first
+  cache.Insert(hash_b, image_b, std::move(MakeImageInput({6})->ort_tensor_));
+  EXPECT_EQ(cache.Find(hash_a, image_a), nullptr);
+  EXPECT_NE(cache.Find(hash_b, image_b), nullptr);
+}
+
+// Images are checked when they're loaded, the encoded bytes are kept as they are
+TEST(ModelTests, LoadImages) {
+  EXPECT_THROW(Generators::LoadImageImpl(MODEL_PATH "images/missing.png"), std::runtime_error);
+  EXPECT_THROW(Generators::LoadImagesImpl(std::span<const char* const>{}), std::runtime_error);
+
+  auto from_path = Generators::LoadImageImpl(MODEL_PATH "images/robot.png");
+  auto& bytes = from_path->images_[0];
+  const void* buffers[]{bytes.data(), bytes.data()};
+  const size_t sizes[]{bytes.size(), bytes.size()};
+  auto from_buffers = Generators::LoadImagesFromBuffersImpl(buffers, sizes);
+  ASSERT_EQ(from_buffers->num_images_, 2u);
+  EXPECT_EQ(from_buffers->images_[1], bytes);
+
+  const size_t empty_size[]{0, bytes.size()};
+  EXPECT_THROW(Generators::LoadImagesFromBuffersImpl(buffers, empty_size), std::runtime_error);
+  EXPECT_THROW(Generators::LoadImagesFromBuffersImpl(buffers, std::span<const size_t>(sizes, 1)), std::runtime_error);
+}
+
+#if TEST_PHI3V
+// The tokens generated for prompt and image by a fresh generator. The generator holds the vision session until its
+// prompt ran, if it needs it, and with vision.idle_unload_seconds = 0 the session is unloaded right after.
+static std::vector<int32_t> GenerateWithImage(Generators::Model& model, const Generators::MultiModalProcessor& processor,
+                                              const Generators::Images& images, bool needs_vision_session) {
+  auto inputs = processor.image_processor_->Process(*processor.tokenizer_, "<|user|>\n<|image_1|>\nWhat is shown here?<|end|>\n<|assistant|>\n", &images);
+  auto params = Generators::CreateGeneratorParams(model);
+  params->SetInputs(*inputs);
+  params->search.max_length = 1024;
+  auto& vision_model = dynamic_cast<Generators::MultiModalVisionModel&>(model);
+
+  auto generator = Generators::CreateGenerator(model, *params);
+  EXPECT_EQ(vision_model.IsVisionSessionLoaded(), needs_vision_session);
+  std::vector<int32_t> tokens;
+  for (int i = 0; i < 5 && !generator->IsDone(); i++) {
+    generator->ComputeLogits();
+    generator->GenerateNextToken();
+    tokens.push_back(generator->GetSequence(0).GetCPU().back());
+    EXPECT_FALSE(vision_model.IsVisionSessionLoaded());
+  }
+  return tokens;
+}
+
+static std::vector<uint8_t> TensorBytes(const Generators::Tensor& tensor) {
+  auto info = tensor.ort_tensor_->GetTensorTypeAndShapeInfo();
+  auto* data = static_cast<const uint8_t*>(tensor.ort_tensor_->GetTensorRawData());
+  return {data, data + info->GetElementCount() * Generators::SizeOf(info->GetElementType())};
+}
+
+// A batch gets the inputs of every prompt processed on its own, and an image that can't be decoded fails only its batch
+TEST(ModelTests, ProcessImagesBatchPhi3V) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "phi-3-vision");
+  auto processor = model->CreateMultiModalProcessor();
+  auto& image_processor = *processor->image_processor_;
+  auto& tokenizer = *processor->tokenizer_;
+
+  const char* paths[]{MODEL_PATH "images/robot.png", MODEL_PATH "images/robot.png"};
+  auto one_image = Generators::LoadImageImpl(paths[0]);
+  auto two_images = Generators::LoadImagesImpl(paths);
+  std::vector<std::string> prompts{"<|user|>\n<|image_1|>\nWhat is shown here?<|end|>\n<|assistant|>\n",
+                                   "<|user|>\nNo image<|end|>\n<|assistant|>\n",
+                                   "<|user|>\n<|image_1|>\n<|image_2|>\nAre these the same?<|end|>\n<|assistant|>\n"};
+  std::vector<const Generators::Images*> images{one_image.get(), nullptr, two_images.get()};
+
+  auto batch = image_processor.ProcessBatch(tokenizer, prompts, images);
+  ASSERT_EQ(batch.size(), prompts.size());
+  for (size_t i = 0; i < prompts.size(); i++) {
+    auto single = image_processor.Process(tokenizer, prompts[i], images[i]);
+    ASSERT_EQ(batch[i]->size(), single->size());
+    for (auto& [name, tensor] : *single)
+      EXPECT_EQ(TensorBytes(*batch[i]->at(name)), TensorBytes(*tensor)) << name << " of prompt " << i;
+  }
+  EXPECT_EQ(batch[1]->count("pixel_values"), 0u);
+
+#if USE_CUDA
+  // The pinned pixel_values buffer is reused once its tensor is released
+  if (model->device_type_ == Generators::DeviceType::CUDA) {
+    auto* buffer = batch[0]->at("pixel_values")->buffer_.get();
+    batch.clear();
+    EXPECT_EQ(image_processor.Process(tokenizer, prompts[0], one_image.get())->at("pixel_values")->buffer_.get(), buffer);
+  }
+#endif
+
+  // The processor that failed on the bad image goes back to the free list and works for the next one
+  const uint8_t garbage[]{1, 2, 3, 4};
+  const void* buffers[]{garbage};
+  const size_t sizes[]{sizeof(garbage)};
+  auto bad_image = Generators::LoadImagesFromBuffersImpl(buffers, sizes);
+  EXPECT_THROW(image_processor.Process(tokenizer, prompts[0], bad_image.get()), std::exception);
+  EXPECT_EQ(TensorBytes(*image_processor.Process(tokenizer, prompts[0], one_image.get())->at("pixel_values")),
+            TensorBytes(*image_processor.Process(tokenizer, prompts[0], one_image.get())->at("pixel_values")));
+}
+
+TEST(ModelTests, VisionSessionOnDemandPhi3V) {
+  auto config = std::make_unique<Generators::Config>(fs::path(MODEL_PATH "phi-3-vision"));
+  config->model.vision.load_on_demand = true;
+  config->model.vision.idle_unload_seconds = 0;
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), std::move(config));
+  auto& vision_model = dynamic_cast<Generators::MultiModalVisionModel&>(*model);
+  EXPECT_FALSE(vision_model.IsVisionSessionLoaded());
+
+  auto processor = model->CreateMultiModalProcessor();
+  auto images = Generators::LoadImageImpl(MODEL_PATH "images/robot.png");
+  auto tokens = GenerateWithImage(*model, *processor, *images, true);
+  EXPECT_FALSE(vision_model.IsVisionSessionLoaded());
+  EXPECT_EQ(GenerateWithImage(*model, *processor, *images, true), tokens);  // Loaded again, with the same visual features
+}
+
+TEST(ModelTests, VisualFeatureCachePhi3V) {
+  auto config = std::make_unique<Generators::Config>(fs::path(MODEL_PATH "phi-3-vision"));
+  config->model.vision.feature_cache_size = 1;
+  config->model.vision.load_on_demand = true;
+  config->model.vision.idle_unload_seconds = 0;
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), std::move(config));
+
+  auto processor = model->CreateMultiModalProcessor();
+  auto images = Generators::LoadImageImpl(MODEL_PATH "images/robot.png");
+  auto tokens = GenerateWithImage(*model, *processor, *images, true);
+  EXPECT_EQ(GenerateWithImage(*model, *processor, *images, false), tokens);  // From the cache, without the vision session
+}
+#endif  // TEST_PHI3V
@@ -1,6 +1,8 @@
 # Copyright (c) Microsoft Corporation. All rights reserved.
 # Licensed under the MIT License
 
+import asyncio
+import json
 import os
 import sys
 import sysconfig
@@ -63,6 +65,205 @@ def test_greedy_search(test_data_path, relative_model_path):
         assert sequences[i] == expected_sequence[i].tolist()
 
 
+# A memory mapped model gets its external data file through the mapping too, and runs like the original
+def test_memory_mapped_external_data(test_data_path, tmp_path):
+    onnx = pytest.importorskip("onnx")
+    from onnx.external_data_helper import uses_external_data
+
+    model_path = Path(test_data_path) / "hf-internal-testing" / "tiny-random-gpt2-fp32"
+    onnx_model = onnx.load(os.fspath(model_path / "past.onnx"))
+    onnx.save_model(
+        onnx_model,
+        os.fspath(tmp_path / "past.onnx"),
+        save_as_external_data=True,
+        all_tensors_to_one_file=True,
+        location="past.onnx.data",
+        size_threshold=0,
+    )
+    assert (tmp_path / "past.onnx.data").stat().st_size > 0
+    assert any(uses_external_data(tensor) for tensor in onnx.load(os.fspath(tmp_path / "past.onnx"), load_external_data=False).graph.initializer)
+
+    config = json.loads((model_path / "genai_config.json").read_text())
+    config["model"]["decoder"].setdefault("session_options", {})["memory_map"] = True
+    (tmp_path / "genai_config.json").write_text(json.dumps(config))
+
+    model = og.Model(os.fspath(tmp_path))
+    params = og.GeneratorParams(model)
+    params.input_ids = np.array([[0, 0, 0, 52], [0, 0, 195, 731]], dtype=np.int32)
+    params.set_search_options(do_sample=False, max_length=10)
+    assert model.generate(params) == [
+        [0, 0, 0, 52, 204, 204, 204, 204, 204, 204],
+        [0, 0, 195, 731, 731, 114, 114, 114, 114, 114],
+    ]
+
+
+def test_stream_async(test_data_path):
+    model_path = os.fspath(Path(test_data_path) / "hf-internal-testing" / "tiny-random-gpt2-fp32")
+    model = og.Model(model_path)
+
+    search_params = og.GeneratorParams(model)
+    search_params.input_ids = np.array(
+        [[0, 0, 0, 52], [0, 0, 195, 731]], dtype=np.int32
+    )
+    search_params.set_search_options(do_sample=False, max_length=10)
+
+    async def collect():
+        generator = og.Generator(model, search_params)
+        tokens = [[], []]
+        async for row, token, _ in og.stream_async(generator):
+            tokens[row].append(token)
+        return tokens
+
+    assert asyncio.run(collect()) == [[204] * 6, [731] + [114] * 5]
+
+
+def _gpt2_generator(test_data_path):
+    model_path = os.fspath(Path(test_data_path) / "hf-internal-testing" / "tiny-random-gpt2-fp32")
+    model = og.Model(model_path)
+
+    search_params = og.GeneratorParams(model)
+    search_params.input_ids = np.array(
+        [[0, 0, 0, 52], [0, 0, 195, 731]], dtype=np.int32
+    )
+    search_params.set_search_options(do_sample=False, max_length=10)
+    return og.Generator(model, search_params)
+
+
+def test_scheduler(test_data_path):
+    model_path = os.fspath(Path(test_data_path) / "hf-internal-testing" / "tiny-random-gpt2-fp32")
+    model = og.Model(model_path)
+    params = og.GeneratorParams(model)
+    params.set_search_options(do_sample=False, max_length=10)
+
+    scheduler = og.Scheduler(model, params)
+    id0 = scheduler.add_request(np.array([0, 0, 0, 52], dtype=np.int32))
+    scheduler.step()
+    id1 = scheduler.add_request(np.array([0, 0, 195, 731], dtype=np.int32), max_length=7)
+    assert scheduler.queued_count == 1
+    while not scheduler.is_idle():
+        scheduler.step()
+
+    assert scheduler.is_finished(id0)
+    assert scheduler.take_result(id0).tolist() == [0, 0, 0, 52, 204, 204, 204, 204, 204, 204]
+    assert scheduler.take_result(id1).tolist() == [0, 0, 195, 731, 731, 114, 114]
+    with pytest.raises(RuntimeError):
+        scheduler.is_finished(id0)
+
+    # With room for one running request, a later request of a higher priority preempts the running one
+    scheduler.max_active_sequences = 1
+    low = scheduler.add_request(np.array([0, 0, 0, 52], dtype=np.int32))
+    scheduler.step()
+    high = scheduler.add_request(np.array([0, 0, 195, 731], dtype=np.int32), priority=1)
+    scheduler.step()
+    assert scheduler.preempted_count == 1
+    assert scheduler.queued_count == 1
+    while not scheduler.is_finished(high):
+        scheduler.step()
+    assert not scheduler.is_finished(low)
+    while not scheduler.is_idle():
+        scheduler.step()
+    assert scheduler.take_result(low).tolist() == [0, 0, 0, 52, 204, 204, 204, 204, 204, 204]
+    assert scheduler.take_result(high).tolist() == [0, 0, 195, 731, 731, 114, 114, 114, 114, 114]
+
+
+def test_generator_copies(test_data_path):
+    generator = _gpt2_generator(test_data_path)
+    generator.compute_logits()
+    logits = generator.get_output("logits")
+    logits_before = logits.copy()
+    generator.generate_next_token()
+    sequence = generator.get_sequence(1)
+    tokens = generator.get_next_tokens()
+
+    # Copies are left alone by the next steps
+    generator.compute_logits()
+    generator.generate_next_token()
+    assert np.array_equal(logits, logits_before)
+    assert sequence.tolist() == [0, 0, 195, 731, 731]
+    assert tokens.tolist() == [204, 731]
+    assert sequence.flags.writeable
+
+
+def test_generator_views(test_data_path):
+    generator = _gpt2_generator(test_data_path)
+    generator.compute_logits()
+    generator.generate_next_token()
+
+    sequence = generator.get_sequence(1, view=True)
+    assert sequence.tolist() == [0, 0, 195, 731, 731]
+    assert not sequence.flags.writeable
+
+    # The next step would write over the view's memory
+    with pytest.raises(RuntimeError):
+        generator.compute_logits()
+    del sequence
+    generator.compute_logits()
+
+    logits = generator.get_output("logits", view=True)
+    with pytest.raises(RuntimeError):
+        generator.generate_next_token()
+    del logits
+    generator.generate_next_token()
+    assert generator.get_next_tokens(view=True).tolist() == [204, 114]
+
+
+def test_generator_sequence_offset(test_data_path):
+    generator = _gpt2_generator(test_data_path)
+    streamed = [generator.get_sequence(0).tolist(), generator.get_sequence(1).tolist()]
+    while not generator.is_done():
+        generator.compute_logits()
+        generator.generate_next_token()
+        for i in range(2):
+            # Only the tokens past the ones already read
+            tail = generator.get_sequence(i, offset=len(streamed[i]))
+            assert len(tail) == 1
+            streamed[i] += tail.tolist()
+
+    assert streamed[0] == [0, 0, 0, 52, 204, 204, 204, 204, 204, 204]
+    assert streamed[1] == [0, 0, 195, 731, 731, 114, 114, 114, 114, 114]
+    assert generator.get_sequence(1, offset=7).tolist() == [114, 114, 114]
+    assert generator.get_sequence(1, offset=10).tolist() == []
+    with pytest.raises(RuntimeError):
+        generator.get_sequence(1, offset=11)
+
+
+def test_generator_output_tensor(test_data_path):
+    generator = _gpt2_generator(test_data_path)
+    generator.compute_logits()
+    tensor = generator.get_output_tensor("logits")
+    expected = generator.get_output("logits")
+    assert list(tensor.shape) == list(expected.shape)
+    assert tensor.__dlpack_device__() == (1, 0)  # kDLCPU
+    assert tensor.__dlpack__(stream=None) is not None
+
+    # The tensor owns its copy, so neither the next step nor the generator going away changes it
+    generator.generate_next_token()
+    generator.compute_logits()
+    del generator
+    assert np.array_equal(tensor.as_numpy(), expected)
+    if hasattr(np, "from_dlpack"):
+        assert np.array_equal(np.from_dlpack(tensor), expected)
+
+
+def test_generator_used_from_two_threads(test_data_path):
+    import threading
+
+    generator = _gpt2_generator(test_data_path)
+    started = threading.Event()
+
+    def on_token(row, token, text):
+        started.set()
+        with pytest.raises(RuntimeError):  # The other thread's stream is using it
+            generator.get_sequence(0)
+        return True
+
+    # The callback runs on another thread while the generator is streaming, so any other call fails instead of racing
+    generator.stream(on_token)
+    assert started.is_set()
+    assert generator.is_done()
+    assert generator.get_sequence(0).tolist() == [0, 0, 0, 52, 204, 204, 204, 204, 204, 204]
+
+
 # TODO: CUDA pipelines use python3.6 and do not have a way to download models since downloading models
 # requires pytorch and hf transformers. This test should be re-enabled once the pipeline is updated.
 @pytest.mark.skipif(
@@ -149,3 +350,281 @@ def test_logging():
     og.set_log_options(enabled=True, model_input_values=True, model_output_shapes=True)
     og.set_log_options(model_input_values=False, model_output_shapes=False)
     og.set_log_options(enabled=False)
+
+# The trace's events name their generator, and merge_trace.py puts a session's profile on the trace's timeline
+def test_trace_merge(test_data_path, tmp_path):
+    sys.path.insert(0, os.fspath(Path(__file__).resolve().parents[2] / "tools" / "python"))
+    import merge_trace
+
+    model = og.Model(os.fspath(Path(test_data_path) / "hf-internal-testing" / "tiny-random-gpt2-fp32"))
+    params = og.GeneratorParams(model)
+    params.input_ids = np.array([[0, 0, 0, 52]], dtype=np.int32)
+    params.set_search_options(max_length=10)
+
+    trace_path = tmp_path / "trace.json"
+    og.set_log_options(trace_filename=os.fspath(trace_path), trace=True)
+    model.generate(params)
+    og.set_log_options(trace=False, trace_filename="")
+
+    events = merge_trace.load_events(trace_path)
+    runs = [event for event in events if event["name"] == "session_run"]
+    assert len(runs) == 6
+    assert all("generator" in event["args"] for event in runs)
+
+    # A profiled session, listed like the trace lists them, and its profile next to its prefix
+    prefix = os.fspath(tmp_path / "profile_model_onnx_0")
+    session = {"name": "ort_profile", "ph": "i", "ts": 5000, "args": {"model": "model.onnx", "profile_prefix": prefix, "start_ns": 5000000}}
+    profile = tmp_path / "profile_model_onnx_0_2024-01-01_10-00-00.json"
+    profile.write_text('[{"name": "op", "ph": "X", "ts": 3, "dur": 1}]')
+    (tmp_path / "profile_model_onnx_01_2024-01-01_10-00-00.json").write_text("[]")  # Another session's
+
+    events.append(session)
+    merged = merge_trace.merge_profiles(events, [session], [])
+    assert merged == {prefix: os.fspath(profile)}
+    assert session["args"]["profile"] == profile.name
+    assert [event["ts"] for event in events if event["name"] == "op"] == [5003]
+
+
+# A gguf_skeleton MatMul reads its weight where the GGUF file stores it, as [out_features, in_features]
+def test_builder_gguf_skeleton_matmul(tmp_path):
+    builder = pytest.importorskip("onnxruntime_genai.models.builder")
+    ort = pytest.importorskip("onnxruntime")
+    from onnx import TensorProto, helper, save_model
+
+    # A stand-in for the GGUF file, with the weight after a header
+    weight = np.arange(12, dtype=np.float32).reshape(3, 4) / 10
+    gguf_data = np.concatenate([np.zeros(8, dtype=np.uint8), weight.reshape(-1).view(np.uint8)])
+    (tmp_path / "model.gguf").write_bytes(gguf_data.tobytes())
+
+    # Only the state the MatMul, node and initializer helpers use
+    model = builder.Model.__new__(builder.Model)
+    model.gguf_skeleton = True
+    model.gguf_filename = "model.gguf"
+    model.gguf_data = gguf_data
+    model.gguf_initializers = []
+    model.io_dtype = TensorProto.FLOAT
+    model.to_numpy_dtype = {TensorProto.FLOAT: np.float32}
+    model.nodes, model.node_names, model.value_infos = [], set(), []
+
+    model.make_matmul_fp16_or_fp32(gguf_data[8:].view(np.float32).reshape(3, 4), "/lm_head/MatMul", "input", logits=True)
+    assert [node.op_type for node in model.nodes] == ["FusedMatMul"]  # No Transpose to fold into a copy
+    assert [initializer.name for initializer in model.gguf_initializers] == ["lm_head.MatMul.weight"]
+    assert {entry.key: entry.value for entry in model.gguf_initializers[0].external_data}["offset"] == "8"
+
+    graph = helper.make_graph(
+        model.nodes,
+        "gguf_skeleton",
+        [helper.make_tensor_value_info("input", TensorProto.FLOAT, [2, 1, 4])],
+        [helper.make_tensor_value_info("logits", TensorProto.FLOAT, [2, 1, 3])],
+        model.gguf_initializers,
+    )
+    onnx_model = helper.make_model(graph, opset_imports=[helper.make_opsetid("", 17), helper.make_opsetid("com.microsoft", 1)])
+    onnx_model.ir_version = 8
+    save_model(onnx_model, os.fspath(tmp_path / "model.onnx"))
+
+    inputs = np.random.default_rng(0).standard_normal((2, 1, 4)).astype(np.float32)
+    session = ort.InferenceSession(os.fspath(tmp_path / "model.onnx"), providers=["CPUExecutionProvider"])
+    np.testing.assert_allclose(session.run(None, {"input": inputs})[0], inputs @ weight.T, rtol=1e-5, atol=1e-6)
+
+
+# The int8 precision's MatMul and the int8 embedding table come within quantization error of the float model
+def test_builder_int8_matmul_and_embedding(tmp_path):
+    builder = pytest.importorskip("onnxruntime_genai.models.builder")
+    ort = pytest.importorskip("onnxruntime")
+    from onnx import TensorProto, helper, save_model
+
+    # Only the state the MatMul, embedding, node and initializer helpers use
+    model = builder.Model.__new__(builder.Model)
+    model.gguf_skeleton = False
+    model.cache_dir = os.fspath(tmp_path)
+    model.initializers = []
+    model.hidden_size = 8
+    model.io_dtype = TensorProto.FLOAT
+    model.to_numpy_dtype = {TensorProto.FLOAT: np.float32}
+    model.nodes, model.node_names, model.value_infos = [], set(), []
+
+    rng = np.random.default_rng(0)
+    weight = rng.uniform(-1, 1, (3, 8)).astype(np.float32)
+    embedding = rng.uniform(-1, 1, (5, 8)).astype(np.float32)
+    embedding[4] = 0  # A row of zeros keeps a scale of 1
+    model.make_embedding_int8(embedding, "model.embed_tokens.weight", "/model/embed_tokens", "embeddings")
+    model.make_matmul_int8(weight, "/lm_head/MatMul", "embeddings", logits=True)
+    assert [node.op_type for node in model.nodes] == ["Gather", "Cast", "Gather", "Mul", "DynamicQuantizeMatMul"]
+
+    graph = helper.make_graph(
+        model.nodes,
+        "int8",
+        [helper.make_tensor_value_info("input_ids", TensorProto.INT64, [2, 3])],
+        [
+            helper.make_tensor_value_info("embeddings", TensorProto.FLOAT, [2, 3, 8]),
+            helper.make_tensor_value_info("logits", TensorProto.FLOAT, [2, 3, 3]),
+        ],
+        model.initializers,
+    )
+    onnx_model = helper.make_model(graph, opset_imports=[helper.make_opsetid("", 17), helper.make_opsetid("com.microsoft", 1)])
+    onnx_model.ir_version = 8
+    save_model(onnx_model, os.fspath(tmp_path / "model.onnx"))
+
+    input_ids = np.array([[0, 1, 2], [3, 4, 0]], dtype=np.int64)
+    session = ort.InferenceSession(os.fspath(tmp_path / "model.onnx"), providers=["CPUExecutionProvider"])
+    embeddings, logits = session.run(None, {"input_ids": input_ids})
+    np.testing.assert_allclose(embeddings, embedding[input_ids], atol=1 / 127)
+    np.testing.assert_array_equal(embeddings[1, 1], 0)
+    np.testing.assert_allclose(logits, embeddings @ weight.T, atol=0.1)
+
+
+# The in-graph heads pick the same tokens as an argmax and a top-k of the logits
+def test_builder_next_tokens_and_top_k_heads(tmp_path):
+    builder = pytest.importorskip("onnxruntime_genai.models.builder")
+    ort = pytest.importorskip("onnxruntime")
+    from onnx import TensorProto, helper, save_model
+
+    # Only the state the head, node and constant helpers use
+    model = builder.Model.__new__(builder.Model)
+    model.top_k_head = 3
+    model.output_shapes = {
+        "next_tokens": ["batch_size", "sequence_length"],
+        "top_k_indices": ["batch_size", "sequence_length", 3],
+    }
+    model.to_numpy_dtype = {TensorProto.FLOAT: np.float32, TensorProto.INT64: np.int64}
+    model.nodes, model.node_names, model.value_infos = [], set(), []
+    model.make_next_tokens_head()
+    model.make_top_k_head()
+
+    graph = helper.make_graph(
+        model.nodes,
+        "heads",
+        [helper.make_tensor_value_info("logits", TensorProto.FLOAT, [2, 4, 10])],
+        [
+            helper.make_tensor_value_info("next_tokens", TensorProto.INT32, [2, 4]),
+            helper.make_tensor_value_info("top_k_logits", TensorProto.FLOAT, [2, 4, 3]),
+            helper.make_tensor_value_info("top_k_indices", TensorProto.INT32, [2, 4, 3]),
+        ],
+    )
+    onnx_model = helper.make_model(graph, opset_imports=[helper.make_opsetid("", 17)])
+    onnx_model.ir_version = 8
+    save_model(onnx_model, os.fspath(tmp_path / "model.onnx"))
+
+    logits = np.random.default_rng(0).standard_normal((2, 4, 10)).astype(np.float32)
+    session = ort.InferenceSession(os.fspath(tmp_path / "model.onnx"), providers=["CPUExecutionProvider"])
+    next_tokens, top_k_logits, top_k_indices = session.run(None, {"logits": logits})
+    assert next_tokens.dtype == np.int32 and top_k_indices.dtype == np.int32
+    np.testing.assert_array_equal(next_tokens, logits.argmax(axis=-1))
+    expected_indices = np.argsort(-logits, axis=-1)[..., :3]
+    np.testing.assert_array_equal(top_k_indices, expected_indices)
+    np.testing.assert_array_equal(top_k_logits, np.take_along_axis(logits, expected_indices, axis=-1))
+
+
+class _Weight:
+    # Stands in for a torch parameter, the builder only reads it through detach().numpy()
+    def __init__(self, data):
+        self.data = data
+
+    def detach(self):
+        return self
+
+    def numpy(self):
+        return self.data
+
+
+# The MoE layer routes through the gate MatMul and stacks every expert's w1/w2/w3, or a rank's share of the experts
+def test_builder_mixtral_moe(tmp_path):
+    builder = pytest.importorskip("onnxruntime_genai.models.builder")
+    from types import SimpleNamespace
+
+    from onnx import TensorProto, helper, numpy_helper
+
+    rng = np.random.default_rng(0)
+    hidden_size, intermediate_size, num_experts = 4, 6, 4
+    moe = SimpleNamespace(
+        gate=SimpleNamespace(weight=_Weight(rng.standard_normal((num_experts, hidden_size)).astype(np.float32))),
+        experts=[
+            SimpleNamespace(
+                w1=_Weight(rng.standard_normal((intermediate_size, hidden_size)).astype(np.float32)),
+                w2=_Weight(rng.standard_normal((hidden_size, intermediate_size)).astype(np.float32)),
+                w3=_Weight(rng.standard_normal((intermediate_size, hidden_size)).astype(np.float32)),
+            )
+            for _ in range(num_experts)
+        ],
+    )
+
+    def make_moe(world_size, rank):
+        # Only the state make_moe and the node, MatMul and initializer helpers use
+        model = builder.MixtralModel.__new__(builder.MixtralModel)
+        model.gguf_skeleton = False
+        model.cache_dir = os.fspath(tmp_path)
+        model.initializers = []
+        model.hidden_size = hidden_size
+        model.io_dtype = TensorProto.FLOAT
+        model.to_numpy_dtype = {TensorProto.FLOAT: np.float32, TensorProto.INT64: np.int64}
+        model.nodes, model.node_names, model.value_infos = [], set(), []
+        model.layernorm_attrs = {}
+        model.world_size, model.rank = world_size, rank
+        model.moe_attrs = {"num_experts": num_experts, "top_k": 2, "normalize_routing_weights": 1}
+        model.make_moe(0, moe, "hidden_states")
+        return model
+
+    def stacked(model, name):
+        tensor = next(initializer for initializer in model.initializers if initializer.name == name)
+        return numpy_helper.to_array(tensor, base_dir=os.fspath(tmp_path))
+
+    model = make_moe(1, 0)
+    moe_node = model.nodes[-1]
+    assert moe_node.op_type == "MoE" and moe_node.domain == "com.microsoft"
+    assert moe_node.input[:2] == ["hidden_states", "/model/layers.0/moe/gate/Reshape/output_0"]
+    attributes = {attribute.name: helper.get_attribute_value(attribute) for attribute in moe_node.attribute}
+    assert attributes["k"] == 2 and attributes["normalize_routing_weights"] == 1
+    assert attributes["activation_type"] == b"silu"
+    assert model.layernorm_attrs["skip_input"] == moe_node.output[0]
+    for fc, linear in [("fc1", "w1"), ("fc2", "w2"), ("fc3", "w3")]:
+        expected = np.stack([getattr(expert, linear).data.T for expert in moe.experts])
+        np.testing.assert_array_equal(stacked(model, f"model.layers.0.moe.{fc}.weight"), expected)
+
+    # Expert parallel: rank 1 of 2 holds experts 2 and 3, and ShardedMoE knows where they start
+    model = make_moe(2, 1)
+    moe_node = model.nodes[-1]
+    assert moe_node.op_type == "ShardedMoE"
+    attributes = {attribute.name: helper.get_attribute_value(attribute) for attribute in moe_node.attribute}
+    assert attributes["local_experts_start_index"] == 2
+    np.testing.assert_array_equal(stacked(model, "model.layers.0.moe.fc1.weight"), np.stack([expert.w1.data.T for expert in moe.experts[2:]]))
+
+
+# A model split by gpu_layers hands its hidden states from the CUDA part to the CPU part, each with its own kv and rotary caches,
+# and generates the same tokens as the whole model on CUDA
+@pytest.mark.skipif(not og.is_cuda_available(), reason="gpu_layers is only supported for CUDA")
+def test_builder_gpu_layers_split(tmp_path, monkeypatch):
+    builder = pytest.importorskip("onnxruntime_genai.models.builder")
+    torch = pytest.importorskip("torch")
+    transformers = pytest.importorskip("transformers")
+
+    torch.manual_seed(0)
+    config = transformers.LlamaConfig(
+        vocab_size=128,
+        hidden_size=64,
+        intermediate_size=128,
+        num_hidden_layers=2,
+        num_attention_heads=4,
+        num_key_value_heads=2,
+        max_position_embeddings=64,
+    )
+    hf_path = tmp_path / "hf"
+    transformers.LlamaForCausalLM(config).save_pretrained(os.fspath(hf_path))
+
+    # The test feeds input ids, there is no tokenizer to save
+    monkeypatch.setattr(builder.Model, "save_processing", lambda *args: None)
+
+    def generate(output_dir, **extra_options):
+        builder.create_model("", os.fspath(hf_path), os.fspath(output_dir), "fp32", "cuda", os.fspath(tmp_path / "cache"), **extra_options)
+        model = og.Model(os.fspath(output_dir))
+        params = og.GeneratorParams(model)
+        params.input_ids = np.array([[1, 17, 42, 99], [1, 5, 63, 8]], dtype=np.int32)
+        params.set_search_options(do_sample=False, max_length=16)
+        return model.generate(params)
+
+    split_path = tmp_path / "split"
+    split = generate(split_path, gpu_layers="1")
+    offload = json.loads((split_path / "genai_config.json").read_text())["model"]["decoder"]["offload"]
+    assert offload["filename"] == "model_cpu.onnx" and offload["first_layer"] == 1
+    assert (split_path / "model_cpu.onnx").exists()
+
+    assert split == generate(tmp_path / "whole")
@@ -4,15 +4,473 @@
 #include <gtest/gtest.h>
 #include <generators.h>
 #include <search.h>
+#include <softmax.h>
+#include <thread_pool.h>
 #include <models/model.h>
 #include <iostream>
 #include <random>
+#include <thread>
 
 // Our working directory is generators/build so one up puts us in the root directory:
 #ifndef MODEL_PATH
 #define MODEL_PATH "../../test/test_models/"
 #endif
 
+TEST(SamplingTests, TopKThresholdCpu) {
+  std::mt19937 engine(42);
+  std::uniform_real_distribution<float> dist(-10.0f, 10.0f);
+  std::vector<float> inputs(1000 + 7);  // Not a multiple of the block size
+  for (auto& input : inputs)
+    input = dist(engine);
+
+  for (int k : {1, 5, 50}) {
+    std::vector<int32_t> top_k(k);
+    std::vector<float> top_k_values(k);
+    Generators::top_k_threshold(top_k, top_k_values, inputs);
+
+    std::vector<float> sorted = inputs;
+    std::sort(sorted.begin(), sorted.end(), std::greater<>());
+    for (int i = 0; i < k; i++) {
+      EXPECT_EQ(top_k_values[i], sorted[i]);
+      EXPECT_EQ(inputs[top_k[i]], sorted[i]);
+    }
+  }
+}
+
+// Against a double precision reference, at lengths covering the vector bodies and the scalar tails of every width
+TEST(SamplingTests, SoftmaxCpu) {
+  std::mt19937 engine(42);
+  std::uniform_real_distribution<float> dist(-30.0f, 30.0f);
+  auto relative_error = [](double value, double expected) { return std::abs(value - expected) / std::max(1.0, std::abs(expected)); };
+
+  for (size_t length : {1, 7, 8, 17, 33, 1000, 32000}) {
+    std::vector<float> inputs(length);
+    for (auto& input : inputs)
+      input = dist(engine);
+
+    for (float temperature : {0.5f, 1.0f, 2.0f}) {
+      double max = -std::numeric_limits<double>::infinity(), sum = 0.0;
+      for (auto input : inputs)
+        max = std::max(max, input / double{temperature});
+      for (auto input : inputs)
+        sum += std::exp(input / double{temperature} - max);
+      const double log_sum = max + std::log(sum);
+
+      std::vector<float> probs = inputs, log_probs(length);
+      Generators::softmax(probs, temperature);
+      Generators::log_softmax(std::span<const float>(inputs), log_probs, temperature);
+      for (size_t i = 0; i < length; i++) {
+        const double expected = inputs[i] / double{temperature} - log_sum;
+        EXPECT_LE(std::abs(probs[i] - std::exp(expected)), 1e-4 * std::exp(expected) + 1e-30) << length << " " << i;
+        EXPECT_LE(relative_error(log_probs[i], expected), 1e-4) << length << " " << i;
+      }
+      if (temperature == 1.0f)
+        EXPECT_LE(relative_error(Generators::log_sum_exp(inputs), log_sum), 1e-4) << length;
+    }
+
+    EXPECT_EQ(Generators::argmax(inputs), static_cast<size_t>(std::max_element(inputs.begin(), inputs.end()) - inputs.begin()));
+
+    inputs[length / 2] = std::numeric_limits<float>::quiet_NaN();
+    Generators::softmax(inputs);
+    EXPECT_TRUE(std::all_of(inputs.begin(), inputs.end(), [](float prob) { return std::isnan(prob); })) << length;
+  }
+}
+
+// 11 values, so some go through the remainder of every vector width
+TEST(SamplingTests, Float16ToFloat32Cpu) {
+  std::vector<uint16_t> fp16{0x3c00, 0xc000, 0x3555, 0x0001, 0x0000, 0x8000, 0x7bff, 0x3c00, 0xc000, 0x0001, 0x3555};
+  std::vector<float> fp32(fp16.size());
+  Generators::FastFloat16ToFloat32(fp16.data(), fp32.data(), fp16.size());
+  for (size_t i = 0; i < fp16.size(); i++)
+    EXPECT_EQ(fp32[i], Generators::Float16ToFloat32(fp16[i])) << i;
+}
+
+TEST(SamplingTests, ThreadPoolParallelFor) {
+  Generators::ThreadPool pool{3};
+  std::vector<int> visits(100);
+  for (int i = 0; i < 10; i++)
+    pool.ParallelFor(visits.size(), [&](size_t row) { visits[row]++; });
+  EXPECT_TRUE(std::all_of(visits.begin(), visits.end(), [](int count) { return count == 10; }));
+
+  EXPECT_THROW(pool.ParallelFor(8, [](size_t row) { if (row == 5) throw std::runtime_error("row failed"); }), std::runtime_error);
+}
+
+// Callers on several threads share the workers, also from within a job, and each gets only the errors of its own job
+TEST(SamplingTests, ThreadPoolConcurrentCallers) {
+  Generators::ThreadPool pool{3};
+  std::vector<std::thread> threads;
+  std::atomic<int> errors{};
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < 50; i++) {
+        std::vector<int> visits(40);
+        pool.ParallelFor(visits.size(), [&](size_t row) { visits[row]++; });
+        EXPECT_TRUE(std::all_of(visits.begin(), visits.end(), [](int count) { return count == 1; }));
+
+        std::vector<std::atomic<int>> nested_visits(8);
+        pool.ParallelFor(8, [&](size_t) { pool.ParallelFor(nested_visits.size(), [&](size_t row) { nested_visits[row]++; }); });
+        EXPECT_TRUE(std::all_of(nested_visits.begin(), nested_visits.end(), [](auto& count) { return count == 8; }));
+
+        try {
+          pool.ParallelFor(8, [t](size_t row) { if (t == 1 && row == 3) throw std::runtime_error("row failed"); });
+        } catch (const std::runtime_error&) {
+          EXPECT_EQ(t, 1);
+          errors++;
+        }
+      }
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+  EXPECT_EQ(errors, 50);
+}
+
+TEST(SamplingTests, FrequencyPenaltyCpu) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  std::vector<int32_t> input_ids{1, 1, 3};
+  std::vector<float> logits_cpu{1.0f, 1.0f, 1.0f, -1.0f, 1.0f};
+  auto params = Generators::CreateGeneratorParams();
+  params->search.max_length = 10;
+  params->search.repetition_penalty = 2.0f;
+  params->search.frequency_penalty = 0.5f;
+  params->search.presence_penalty = 0.25f;
+  params->batch_size = 1;
+  params->sequence_length = 3;
+  params->vocab_size = 5;
+  params->input_ids = input_ids;
+  auto generator = Generators::CreateGenerator(*model, *params);
+  auto& search = static_cast<Generators::Search_Cpu&>(*generator->search_);
+  search.SetLogits(Generators::cpu_span<float>(logits_cpu));
+
+  search.ProcessLogits();
+  auto scores = search.GetScores(0);
+  std::vector<float> expected{1.0f, 0.5f - 1.0f - 0.25f, 1.0f, -2.0f - 0.5f - 0.25f, 1.0f};
+  for (size_t i = 0; i < expected.size(); i++)
+    EXPECT_FLOAT_EQ(scores[i], expected[i]);
+}
+
+TEST(SamplingTests, ProcessLogitsCpu) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  std::vector<int32_t> input_ids{1, 2, 1};
+  std::vector<float> logits_cpu(6, 1.0f);
+  auto params = Generators::CreateGeneratorParams();
+  params->search.max_length = 10;
+  params->search.min_length = 5;  // Bans eos (0)
+  params->search.repetition_penalty = 2.0f;
+  params->search.frequency_penalty = 0.1f;
+  params->search.no_repeat_ngram_size = 2;  // Bans 2, {1, 2} already occurred
+  params->logit_bias = {{3, 0.5f}};
+  params->bad_words = {{1, 4}, {5}};
+  params->batch_size = 1;
+  params->sequence_length = 3;
+  params->vocab_size = 6;
+  params->input_ids = input_ids;
+  auto generator = Generators::CreateGenerator(*model, *params);
+  auto& search = static_cast<Generators::Search_Cpu&>(*generator->search_);
+  search.SetLogits(Generators::cpu_span<float>(logits_cpu));
+
+  search.ProcessLogits();
+  auto scores = search.GetScores(0);
+  const float banned = std::numeric_limits<float>::lowest();
+  std::vector<float> expected{banned, 0.5f - 0.2f, banned, 1.5f, banned, banned};
+  for (size_t i = 0; i < expected.size(); i++)
+    EXPECT_FLOAT_EQ(scores[i], expected[i]);
+
+  params->bad_words = {{}};
+  EXPECT_THROW(Generators::CreateGenerator(*model, *params), std::runtime_error);
+}
+
+TEST(SamplingTests, RowSearchCpu) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  std::vector<int32_t> input_ids{1, 2, 1, 2};
+  auto params = Generators::CreateGeneratorParams();
+  params->search.max_length = 10;
+  params->search.random_seed = 42;
+  params->batch_size = 2;
+  params->sequence_length = 2;
+  params->vocab_size = 6;
+  params->input_ids = input_ids;
+
+  // Row 0 stays greedy, row 1 samples from its top 2
+  auto& row = params->SetRowSearch(1);
+  row.do_sample = true;
+  row.top_k = 2;
+  for (int i = 0; i < 20; i++) {
+    std::vector<float> logits_cpu{0.0f, 1.0f, 0.0f, 4.0f, 3.0f, 0.0f,
+                                  -9.0f, -9.0f, -9.0f, -9.0f, 5.0f, 5.0f};
+    auto generator = Generators::CreateGenerator(*model, *params);
+    auto& search = static_cast<Generators::Search_Cpu&>(*generator->search_);
+    search.SetLogits(Generators::cpu_span<float>(logits_cpu));
+    search.SampleRows();
+    auto next_tokens = search.GetNextTokens().GetCPU();
+    EXPECT_EQ(next_tokens[0], 3);
+    EXPECT_TRUE(next_tokens[1] == 4 || next_tokens[1] == 5);
+  }
+
+  params->SetRowSearch(2);
+  EXPECT_THROW(Generators::CreateGenerator(*model, *params), std::runtime_error);
+}
+
+TEST(SamplingTests, RowRandomSeeds) {
+  auto params = Generators::CreateGeneratorParams();
+  params->search.random_seed = 42;
+  params->batch_size = 3;
+
+  // Row 1 is only there because row 2 has options, row 2 is seeded on its own with the same value as the batch
+  params->SetRowSearch(2).random_seed = 42;
+  EXPECT_EQ(params->RowSearch(1).random_seed, -1);
+  auto rows = Generators::MakeRandomRows(*params);
+  EXPECT_EQ(rows[0].seed, 42u);
+  EXPECT_EQ(rows[0].subsequence, 0u);
+  EXPECT_EQ(rows[1].seed, 42u);
+  EXPECT_EQ(rows[1].subsequence, 1u);
+  EXPECT_EQ(rows[2].seed, 42u);
+  EXPECT_EQ(rows[2].subsequence, 0u);  // Not the batch's stream for row 2
+
+  params->SetRowSearch(1).random_seed = 7;
+  rows = Generators::MakeRandomRows(*params);
+  EXPECT_EQ(rows[1].seed, 7u);
+  EXPECT_EQ(rows[1].subsequence, 0u);
+}
+
+// A row with its own seed samples the same tokens alone, next to another prompt, and under any batch seed
+TEST(SamplingTests, RowSeedReproducibleGptFp32) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  const std::vector<int32_t> prompt{0, 0, 0, 52};
+  const std::vector<int32_t> other_prompt{0, 0, 195, 731};
+
+  auto sample = [&](std::vector<int32_t> input_ids, int batch_size, int seeded_row, int batch_seed) {
+    auto params = Generators::CreateGeneratorParams(*model);
+    params->search.max_length = 10;
+    params->search.do_sample = true;
+    params->search.temperature = 1.5f;
+    params->search.random_seed = batch_seed;
+    params->SetRowSearch(seeded_row).random_seed = 1234;
+    params->batch_size = batch_size;
+    params->sequence_length = 4;
+    params->input_ids = input_ids;
+    return Generators::Generate(*model, *params)[seeded_row];
+  };
+
+  auto alone = sample(prompt, 1, 0, -1);
+  ASSERT_EQ(alone.size(), 10U);
+  EXPECT_TRUE(std::equal(prompt.begin(), prompt.end(), alone.begin()));
+
+  std::vector<int32_t> second_row{other_prompt};
+  second_row.insert(second_row.end(), prompt.begin(), prompt.end());
+  std::vector<int32_t> first_row{prompt};
+  first_row.insert(first_row.end(), other_prompt.begin(), other_prompt.end());
+  EXPECT_EQ(sample(second_row, 2, 1, 42), alone);
+  EXPECT_EQ(sample(first_row, 2, 0, 7), alone);
+  EXPECT_EQ(sample(prompt, 1, 0, 99), alone);
+}
+
+// Ties go to the first of them, wherever they fall against the vector width, as with std::max_element
+TEST(SamplingTests, ArgMaxTiesCpu) {
+  for (size_t length : {1, 7, 8, 17, 33, 1000}) {
+    std::vector<float> values(length, -std::numeric_limits<float>::infinity());
+    EXPECT_EQ(Generators::argmax(values), 0U) << length;
+    for (size_t first : {length - 1, length / 2, size_t{0}}) {
+      values[first] = 3.0f;
+      if (first + 9 < length)
+        values[first + 9] = 3.0f;
+      EXPECT_EQ(Generators::argmax(values), first) << length << " " << first;
+    }
+  }
+}
+
+// A plain greedy step maps whichever eos token is the largest to eos_token_id, and ends the row
+TEST(SamplingTests, GreedyFoldsEosCpu) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  std::vector<int32_t> input_ids{1, 2, 1, 2};
+  std::vector<float> logits_cpu{0.0f, 1.0f, 0.0f, 4.0f, 3.0f, 0.0f,
+                                0.0f, 1.0f, 5.0f, 0.0f, 0.0f, 2.0f};
+  auto params = Generators::CreateGeneratorParams();
+  params->search.max_length = 10;
+  params->batch_size = 2;
+  params->sequence_length = 2;
+  params->vocab_size = 6;
+  params->input_ids = input_ids;
+  params->eos_token_id = 5;
+  params->eos_token_ids = {5, 3};
+  auto generator = Generators::CreateGenerator(*model, *params);
+  auto& search = static_cast<Generators::Search_Cpu&>(*generator->search_);
+  search.SetLogits(Generators::cpu_span<float>(logits_cpu));
+  search.SelectTop();
+
+  auto next_tokens = search.GetNextTokens().GetCPU();
+  EXPECT_EQ(next_tokens[0], 5);  // 3 is the argmax
+  EXPECT_EQ(next_tokens[1], 2);
+  auto done_rows = search.GetDoneRows().GetCPU();
+  EXPECT_TRUE(done_rows[0]);
+  EXPECT_FALSE(done_rows[1]);
+  EXPECT_EQ(logits_cpu[3], 4.0f);  // Folded in the argmax, the logits are left alone
+}
+
+TEST(SamplingTests, StopConditionsCpu) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  std::vector<int32_t> input_ids{1, 2, 1, 2};
+  std::vector<float> logits_cpu{0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f,
+                                0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f};
+  auto params = Generators::CreateGeneratorParams();
+  params->search.max_length = 10;
+  params->batch_size = 2;
+  params->sequence_length = 2;
+  params->vocab_size = 6;
+  params->input_ids = input_ids;
+  params->stop_sequences = {{3, 3}, {2, 4}};  // {2, 4} ends in the prompt, only generated tokens count
+  params->SetRowSearch(1).max_new_tokens = 3;
+  auto generator = Generators::CreateGenerator(*model, *params);
+  auto& search = static_cast<Generators::Search_Cpu&>(*generator->search_);
+
+  std::vector<std::vector<bool>> expected{{false, false}, {true, false}, {true, true}};
+  for (auto& expected_done : expected) {
+    search.SetLogits(Generators::cpu_span<float>(logits_cpu));
+    search.SelectTop();
+    auto done_rows = search.GetDoneRows().GetCPU();
+    EXPECT_EQ(done_rows[0], expected_done[0]);
+    EXPECT_EQ(done_rows[1], expected_done[1]);
+  }
+  EXPECT_TRUE(search.IsDone());
+
+  auto sequence = search.GetSequence(0).GetCPU();
+  EXPECT_EQ(std::vector<int32_t>(sequence.begin(), sequence.end()), (std::vector<int32_t>{1, 2, 3, 3, params->pad_token_id}));
+}
+
+static bool IsAllowed(std::span<const uint32_t> mask, int32_t token) {
+  return (mask[token / 32] >> (token % 32)) & 1;
+}
+
+TEST(SamplingTests, GrammarMasks) {
+  std::vector<std::string> vocab{"", "a", "b", "ab", "1", "12", "x"};  // 0 is eos
+  Generators::Grammar grammar{"a+b[0-9]{1,2}", vocab, 0};
+
+  auto expect_allowed = [&](int state, std::vector<int32_t> expected) {
+    auto mask = grammar.GetMask(state);
+    std::vector<int32_t> allowed;
+    for (int32_t token = 0; token < static_cast<int32_t>(vocab.size()); token++) {
+      if (IsAllowed(mask, token))
+        allowed.push_back(token);
+    }
+    EXPECT_EQ(allowed, expected);
+  };
+
+  int state = Generators::Grammar::InitialState;
+  expect_allowed(state, {1, 3});
+  state = grammar.Advance(state, 3);  // "ab"
+  expect_allowed(state, {4, 5});
+  state = grammar.Advance(state, 4);  // "ab1"
+  EXPECT_TRUE(grammar.IsMatch(state));
+  expect_allowed(state, {0, 4});
+  EXPECT_EQ(grammar.Advance(state, 6), Generators::Grammar::DeadState);
+  expect_allowed(Generators::Grammar::DeadState, {0});
+
+  EXPECT_THROW(Generators::Grammar("a(b", vocab, 0), std::runtime_error);
+  EXPECT_THROW(Generators::Grammar("a{3,1}", vocab, 0), std::runtime_error);
+  EXPECT_THROW(Generators::Grammar("a{3", vocab, 0), std::runtime_error);
+  EXPECT_THROW(Generators::Grammar("a{3,", vocab, 0), std::runtime_error);
+  EXPECT_THROW(Generators::Grammar("(a{1000}){1000}", vocab, 0), std::runtime_error);  // Too many NFA states
+}
+
+TEST(SamplingTests, GrammarProcessLogitsCpu) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  std::vector<int32_t> input_ids{6, 6};  // The prompt isn't matched
+  std::vector<float> logits_cpu(7, 1.0f);
+  auto params = Generators::CreateGeneratorParams();
+  params->search.max_length = 10;
+  params->batch_size = 1;
+  params->sequence_length = 2;
+  params->vocab_size = 7;
+  params->input_ids = input_ids;
+  params->grammar = std::make_shared<Generators::Grammar>("ab?", std::vector<std::string>{"", "a", "b", "ab", "1", "12", "x"}, 0);
+  auto generator = Generators::CreateGenerator(*model, *params);
+  auto& search = static_cast<Generators::Search_Cpu&>(*generator->search_);
+  search.SetLogits(Generators::cpu_span<float>(logits_cpu));
+
+  search.ProcessLogits();
+  auto scores = search.GetScores(0);
+  for (int32_t token = 0; token < 7; token++)
+    EXPECT_EQ(scores[token] == 1.0f, token == 1 || token == 3);
+
+  params->search.num_beams = 2;
+  EXPECT_THROW(Generators::CreateGenerator(*model, *params), std::runtime_error);
+}
+
+// Both beams continue best with token 1, the diversity penalty has the second beam's pick count against it
+TEST(SamplingTests, DiversityPenaltyCpu) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  std::vector<int32_t> input_ids{3};
+  for (float diversity_penalty : {0.0f, 10.0f}) {
+    auto params = Generators::CreateGeneratorParams();
+    params->search.max_length = 10;
+    params->search.num_beams = 2;
+    params->search.diversity_penalty = diversity_penalty;
+    params->batch_size = 1;
+    params->sequence_length = 1;
+    params->vocab_size = 4;
+    params->input_ids = input_ids;
+    auto generator = Generators::CreateGenerator(*model, *params);
+    auto& search = *generator->search_;
+
+    std::vector<float> first{-10.0f, 3.0f, 2.0f, 1.0f, -10.0f, 3.0f, 2.0f, 1.0f};
+    search.SetLogits(Generators::cpu_span<float>(first));
+    search.SelectTop();
+    std::vector<float> second{-10.0f, 3.0f, 1.0f, 0.0f, -10.0f, 3.0f, 1.0f, 0.0f};
+    search.SetLogits(Generators::cpu_span<float>(second));
+    search.SelectTop();
+
+    auto next_tokens = search.GetNextTokens().GetCPU();
+    EXPECT_EQ(next_tokens[0], 1);
+    EXPECT_EQ(next_tokens[1], diversity_penalty == 0.0f ? 1 : 2);
+  }
+
+  // The penalty keeps the picks of at most 32 beams, more are rejected rather than left unpenalized
+  auto params = Generators::CreateGeneratorParams();
+  params->search.max_length = 10;
+  params->search.num_beams = 33;
+  params->search.diversity_penalty = 1.0f;
+  params->batch_size = 1;
+  params->sequence_length = 1;
+  params->vocab_size = 4;
+  params->input_ids = input_ids;
+  EXPECT_THROW(Generators::CreateGenerator(*model, *params), std::runtime_error);
+}
+
+TEST(SamplingTests, TopLogProbsCpu) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  std::vector<int32_t> input_ids{0, 1};
+  auto params = Generators::CreateGeneratorParams();
+  params->search.max_length = 10;
+  params->search.top_logprobs = 2;
+  params->batch_size = 2;
+  params->sequence_length = 1;
+  params->vocab_size = 4;
+  params->input_ids = input_ids;
+  auto generator = Generators::CreateGenerator(*model, *params);
+  auto& search = *generator->search_;
+
+  std::vector<float> logits{1.0f, 3.0f, 2.0f, 0.0f,
+                            0.0f, 0.0f, 0.0f, 5.0f};
+  auto expected = logits;
+  search.SetLogits(Generators::cpu_span<float>(logits));
+  search.LogSoftMax();
+  search.SelectTop();
+  search.GatherLogProbs();
+
+  for (size_t row = 0; row < 2; row++)
+    Generators::log_softmax(std::span<float>(expected.data() + row * 4, 4));
+  auto logprobs = search.GetLogProbs();
+  ASSERT_EQ(logprobs.logprobs.size(), 2);
+  ASSERT_EQ(logprobs.top_tokens.size(), 4);
+  EXPECT_FLOAT_EQ(logprobs.logprobs[0], expected[1]);
+  EXPECT_FLOAT_EQ(logprobs.logprobs[1], expected[7]);
+  EXPECT_EQ(logprobs.top_tokens[0], 1);
+  EXPECT_EQ(logprobs.top_tokens[1], 2);
+  EXPECT_EQ(logprobs.top_tokens[2], 3);
+  EXPECT_FLOAT_EQ(logprobs.top_logprobs[1], expected[2]);
+  EXPECT_FLOAT_EQ(logprobs.top_logprobs[3], expected[4]);  // The tied tokens all have the same log probability
+}
+
 TEST(SamplingTests, BatchedSamplingTopPCpu) {
   auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
   std::vector<int32_t> input_ids{0, 1, 2, 3};
@@ -248,6 +706,7 @@ TEST(SamplingTests, RandomizedSamplingTopPAndKCpu) {
 
 #if USE_CUDA
 #include "tests_helper.cuh"
+#include <sequences_cuda.h>
 
 TEST(SamplingTests, BatchedSamplingTopPCuda) {
   auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
@@ -517,4 +976,113 @@ TEST(SamplingTests, RandomizedSamplingSelectTopCuda) {
   }
 }
 
+// fp16 logits handed to the search as the model wrote them pick the tokens that the same values in fp32 do, greedy and
+// sampled with the same seed
+TEST(SamplingTests, Fp16LogitsMatchFp32Cuda) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  int vocab_size = 32000;  // vocab size of llama
+  int batch_size = 5;
+  std::vector<int32_t> input_ids{0, 1, 2, 3, 4};
+  auto logits_gpu = Generators::CudaMallocArray<float>(vocab_size * batch_size);
+  auto logits16_gpu = Generators::CudaMallocArray<uint16_t>(vocab_size * batch_size);
+  auto indices_buffer = Generators::CudaMallocHostArray<int>(vocab_size * batch_size);
+  std::vector<float> cpu_logits(vocab_size * batch_size);
+  std::vector<uint16_t> cpu_logits16(vocab_size * batch_size);
+
+  struct Case {
+    bool do_sample;
+    int top_k;
+    float top_p;
+  };
+  for (auto [do_sample, top_k, top_p] : {Case{false, 50, 1.0f}, Case{true, 5, 1.0f}, Case{true, 0, 0.9f}, Case{true, 5, 0.9f}}) {
+    auto params = Generators::CreateGeneratorParams();
+    params->search.max_length = 10;
+    params->search.do_sample = do_sample;
+    params->search.top_k = top_k;
+    params->search.top_p = top_p;
+    params->search.random_seed = 42;
+    params->batch_size = batch_size;
+    params->sequence_length = 1;
+    params->vocab_size = vocab_size;
+    params->input_ids = input_ids;
+    params->device_type = Generators::DeviceType::CUDA;
+
+    for (int i = 0; i < 10; i++) {
+      LaunchGeometricDecayKernel(logits_gpu.get(), vocab_size, batch_size, 1 + i * 2, 20.0f, params->cuda_stream);
+      LaunchFisherYatesKernel(logits_gpu.get(), indices_buffer.get(), vocab_size, batch_size, params->cuda_stream);
+      cudaMemcpyAsync(cpu_logits.data(), logits_gpu.get(), cpu_logits.size() * sizeof(float), cudaMemcpyDeviceToHost, params->cuda_stream);
+      cudaStreamSynchronize(params->cuda_stream);
+
+      // Both get the values fp16 can hold, so only the path differs
+      for (size_t j = 0; j < cpu_logits.size(); j++) {
+        cpu_logits16[j] = Generators::FastFloat32ToFloat16(cpu_logits[j]);
+        cpu_logits[j] = Generators::Float16ToFloat32(cpu_logits16[j]);
+      }
+      cudaMemcpyAsync(logits_gpu.get(), cpu_logits.data(), cpu_logits.size() * sizeof(float), cudaMemcpyHostToDevice, params->cuda_stream);
+      cudaMemcpyAsync(logits16_gpu.get(), cpu_logits16.data(), cpu_logits16.size() * sizeof(uint16_t), cudaMemcpyHostToDevice, params->cuda_stream);
+      cudaStreamSynchronize(params->cuda_stream);
+
+      auto generator = Generators::CreateGenerator(*model, *params);
+      generator->search_->SetLogits(Generators::gpu_span<float>(logits_gpu.get(), cpu_logits.size()));
+      generator->computed_logits_ = true;
+      generator->GenerateNextToken();
+      auto next_tokens = generator->search_->GetNextTokens().GetCPU();
+      std::vector<int32_t> expected(next_tokens.begin(), next_tokens.end());
+
+      auto generator16 = Generators::CreateGenerator(*model, *params);
+      generator16->search_->SetLogits16(Generators::gpu_span<uint16_t>(logits16_gpu.get(), cpu_logits16.size()));
+      generator16->computed_logits_ = true;
+      generator16->GenerateNextToken();
+      auto next_tokens16 = generator16->search_->GetNextTokens().GetCPU();
+      EXPECT_EQ(std::vector<int32_t>(next_tokens16.begin(), next_tokens16.end()), expected) << "do_sample " << do_sample << " top_k " << top_k << " top_p " << top_p;
+    }
+  }
+}
+
+// Beam search sequences asked for every step are extended from the last ones, and put together from the tree again
+// when steps were skipped. Both give the walk back through the tree on the host.
+TEST(SamplingTests, BeamSequencesCuda) {
+  constexpr int batch_size = 1, beam_size = 3, max_length = 12;
+  constexpr int batch_beam_size = batch_size * beam_size;
+  std::vector<int32_t> prompt{5, 6};
+  cudaStream_t stream{};
+  std::mt19937 engine(3);
+  std::uniform_int_distribution<int32_t> token_dist(0, 99), parent_dist(0, batch_beam_size - 1);
+
+  for (bool every_step : {true, false}) {
+    Generators::Sequences_Cuda sequences{prompt, batch_size, beam_size, max_length, stream};
+    std::vector<int32_t> tokens(batch_beam_size * max_length), parents(batch_beam_size * max_length);
+    for (int row = 0; row < batch_beam_size; row++) {
+      for (int i = 0; i < static_cast<int>(prompt.size()); i++) {
+        tokens[row * max_length + i] = prompt[i];
+        parents[row * max_length + i] = row;
+      }
+    }
+
+    for (int length = static_cast<int>(prompt.size()); length < max_length; length++) {
+      for (int row = 0; row < batch_beam_size; row++) {
+        tokens[row * max_length + length] = token_dist(engine);
+        parents[row * max_length + length] = parent_dist(engine);
+      }
+      cudaMemcpyAsync(sequences.GetBeamTokens().data(), tokens.data(), tokens.size() * sizeof(int32_t), cudaMemcpyHostToDevice, stream);
+      cudaMemcpyAsync(sequences.GetBeamParents().data(), parents.data(), parents.size() * sizeof(int32_t), cudaMemcpyHostToDevice, stream);
+      sequences.AfterDeviceAppendedNextToken();
+      if (!every_step && length % 3 != 0)
+        continue;
+
+      auto device_sequences = sequences.GetSequences();
+      std::vector<int32_t> actual(device_sequences.size());
+      cudaMemcpyAsync(actual.data(), device_sequences.data(), device_sequences.size_bytes(), cudaMemcpyDeviceToHost, stream);
+      cudaStreamSynchronize(stream);
+      for (int row = 0; row < batch_beam_size; row++) {
+        int source = row;
+        for (int i = length; i >= 0; i--) {
+          ASSERT_EQ(actual[row * max_length + i], tokens[source * max_length + i]);
+          source = parents[source * max_length + i];
+        }
+      }
+    }
+  }
+}
+
 #endif
\ No newline at end of file
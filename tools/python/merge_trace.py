@@ -0,0 +1,80 @@
+# Copyright (c) Microsoft Corporation. All rights reserved.
+# Licensed under the MIT License.
+
+# Puts onnxruntime's op level profiles on the timeline of a generator trace (SetLogBool("trace", True) with
+# SetLogString("trace_filename", ...)), for chrome://tracing or ui.perfetto.dev.
+#
+# The trace lists every profiled session ("ort_profile" events) with the time its profile starts at and the prefix of
+# its profile file, which onnxruntime names <profile_prefix>_<date and time>.json. Every profile is matched to the
+# session of its prefix. Without profiles on the command line, they are looked up next to their prefix.
+#
+#   python merge_trace.py genai_trace.json [onnxruntime_profile_*.json] -o merged.json
+
+import argparse
+import glob
+import json
+import os
+
+
+def load_events(path):
+    with open(path, encoding="utf-8") as f:
+        text = f.read().strip()
+    # A trace still being written, or cut short, has no closing bracket, which the trace viewers accept too
+    if text.endswith(","):
+        text = text[:-1]
+    if not text.endswith("]"):
+        text += "]"
+    events = json.loads(text)
+    return events["traceEvents"] if isinstance(events, dict) else events
+
+
+def profile_of(session, profiles):
+    prefix = os.path.basename(session["args"]["profile_prefix"])
+    # The date and time after the prefix has no more underscores than "YYYY-MM-DD_HH-MM-SS"
+    matches = [p for p in profiles if os.path.basename(p).startswith(prefix + "_") and os.path.basename(p)[len(prefix) + 1 :].count("_") == 1]
+    if len(matches) > 1:
+        raise ValueError(f"{len(matches)} profiles match the session of {session['args']['model']}: {matches}")
+    return matches[0] if matches else None
+
+
+def merge_profiles(events, sessions, profiles):
+    """Appends the events of every session's profile to events, returns the profile of every session merged"""
+    if not profiles:
+        profiles = [p for session in sessions for p in glob.glob(glob.escape(session["args"]["profile_prefix"]) + "_*.json")]
+
+    merged = {}
+    for session in sessions:
+        profile = profile_of(session, profiles)
+        if not profile:
+            continue
+        merged[session["args"]["profile_prefix"]] = profile
+        session["args"]["profile"] = os.path.basename(profile)
+
+        # A profile's timestamps are microseconds from the start of its session's profiling
+        start_us = session["args"]["start_ns"] // 1000
+        for event in load_events(profile):
+            if "ts" in event:
+                event["ts"] += start_us
+            event.setdefault("args", {})["model"] = session["args"]["model"]
+            events.append(event)
+    return merged
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Merge onnxruntime profiles into an onnxruntime-genai trace")
+    parser.add_argument("trace", help="Trace written by onnxruntime-genai")
+    parser.add_argument("profiles", nargs="*", help="Profiles written by onnxruntime for the sessions in the trace")
+    parser.add_argument("-o", "--output", required=True, help="Merged trace to write")
+    args = parser.parse_args()
+
+    events = load_events(args.trace)
+    sessions = [event for event in events if event.get("name") == "ort_profile"]
+    merged = merge_profiles(events, sessions, args.profiles)
+    print(f"Merged {len(merged)} of {len(sessions)} session profiles")
+
+    with open(args.output, "w", encoding="utf-8") as f:
+        json.dump(events, f)
+
+
+if __name__ == "__main__":
+    main()